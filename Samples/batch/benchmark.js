@@ -0,0 +1,112 @@
+// ============================================================================
+// FILE: benchmark.js
+//
+//      Throughput of batch rendering.  Every page of the Samples tree is
+//      rendered for a desktop, a WML and an HDML browser with
+//      XMLServerDocument.TransformBatch, at several thread counts, and
+//      the pages per second of each run are reported.
+//
+//      Usage: cscript benchmark.js [root [repeat [threads ...]]]
+//
+//          root     directory the Samples directory is in (default:
+//                   the one above Samples, from where this script is)
+//          repeat   times each page is rendered per run (default 20)
+//          threads  thread counts to try (default 1 2 4 8)
+//
+//      Output goes to xslisapi-batch under root, where TransformBatch
+//      may write when it isn't called from an ASP page.  Browser
+//      capabilities come from browscap.ini only if masterConfig.xml
+//      (under root\xslisapi) turns on <browscap native="on"/>;
+//      otherwise every page gets its server-config's default device.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+var fso = new ActiveXObject("Scripting.FileSystemObject");
+var args = WScript.Arguments;
+
+var root = (args.length > 0) ?
+           args(0) :
+           fso.GetParentFolderName(
+               fso.GetParentFolderName(
+                   fso.GetParentFolderName(WScript.ScriptFullName)));
+var repeat = (args.length > 1) ? parseInt(args(1)) : 20;
+var threadCounts = [];
+for (var i = 2; i < args.length; i++) {
+    threadCounts.push(parseInt(args(i)));
+}
+if (threadCounts.length == 0) {
+    threadCounts = [1, 2, 4, 8];
+}
+
+var userAgents = [
+    "Mozilla/4.0 (compatible; MSIE 5.01; Windows NT 5.0)",
+    "Nokia7110/1.0 (04.84)",
+    "UP.Browser/3.1-UPG1 UP.Link/3.2"
+];
+
+var outputDir = fso.BuildPath(root, "xslisapi-batch");
+if (!fso.FolderExists(outputDir)) {
+    fso.CreateFolder(outputDir);
+}
+
+// Every .xml page under Samples, as a URL on the site.  Server-config
+// files aren't pages.
+var pages = [];
+function findPages(folder, url) {
+    for (var e = new Enumerator(folder.Files); !e.atEnd(); e.moveNext()) {
+        var name = e.item().Name;
+        if (/\.xml$/i.test(name) && !/config\.xml$/i.test(name)) {
+            pages.push(url + "/" + name);
+        }
+    }
+    for (var e = new Enumerator(folder.SubFolders); !e.atEnd(); e.moveNext()) {
+        // loadtest's page is meant to be slow.
+        if (e.item().Name.toLowerCase() != "loadtest") {
+            findPages(e.item(), url + "/" + e.item().Name);
+        }
+    }
+}
+findPages(fso.GetFolder(fso.BuildPath(root, "Samples")), "/Samples");
+
+function escapeXML(s) {
+    return s.replace(/&/g, "&amp;").replace(/</g, "&lt;")
+            .replace(/>/g, "&gt;").replace(/"/g, "&quot;");
+}
+
+var jobs = "<batch>";
+var numJobs = 0;
+for (var r = 0; r < repeat; r++) {
+    for (var p = 0; p < pages.length; p++) {
+        for (var u = 0; u < userAgents.length; u++) {
+            var output = fso.BuildPath(outputDir, "page" + p + "-" + u + ".out");
+            jobs += "<job url=\"" + escapeXML(pages[p]) +
+                    "\" user-agent=\"" + escapeXML(userAgents[u]) +
+                    "\" output=\"" + escapeXML(output) + "\"/>";
+            numJobs++;
+        }
+    }
+}
+jobs += "</batch>";
+
+var doc = new ActiveXObject("XSLISAPI.XMLServerDocument");
+var report = new ActiveXObject("Microsoft.XMLDOM");
+
+WScript.Echo(pages.length + " pages, " + userAgents.length + " browsers, " +
+             numJobs + " jobs per run");
+
+// The first run loads and compiles everything; it isn't counted.
+report.loadXML(doc.TransformBatch(jobs, root, 1, 0));
+if (report.documentElement.getAttribute("failed") != "0") {
+    WScript.Echo(report.xml);
+}
+
+WScript.Echo("threads\tpages/s\tms\tfailed\ttimed out");
+for (var t = 0; t < threadCounts.length; t++) {
+    report.loadXML(doc.TransformBatch(jobs, root, threadCounts[t], 0));
+    var batch = report.documentElement;
+    WScript.Echo(batch.getAttribute("threads") + "\t" +
+                 batch.getAttribute("pages-per-second") + "\t" +
+                 batch.getAttribute("milliseconds") + "\t" +
+                 batch.getAttribute("failed") + "\t" +
+                 batch.getAttribute("timed-out"));
+}
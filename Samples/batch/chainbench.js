@@ -0,0 +1,121 @@
+// ============================================================================
+// FILE: chainbench.js
+//
+//      Latency and peak memory of sampleB's chain: six removeX.xsl
+//      stages and the IE5 stylesheet, rendered with
+//      XMLServerDocument.TransformBatch on one thread, with the pool of
+//      intermediate documents on (<cache documents="8"/>) and off
+//      (documents="0").  The chain cache is turned off, so that every
+//      stage runs every time.  Each setting is run in a process of its
+//      own, whose peak working set is reported with the milliseconds a
+//      page.
+//
+//      Usage: cscript chainbench.js [root [repeat]]
+//
+//          root     directory the Samples directory is in (default:
+//                   the one above Samples, from where this script is)
+//          repeat   times the page is rendered per run (default 2000)
+//
+//      masterConfig.xml under root\xslisapi is replaced while it runs,
+//      and put back afterwards.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+var fso = new ActiveXObject("Scripting.FileSystemObject");
+var args = WScript.Arguments;
+
+var userAgent = "Mozilla/4.0 (compatible; MSIE 5.01; Windows NT 5.0)";
+var page = "/Samples/sampleB/sampleB.xml";
+
+// Renders the page, in this process, and reports its peak working set:
+// chainbench.js /run root repeat token
+function run(root, repeat, token) {
+    var outputDir = fso.BuildPath(root, "xslisapi-batch");
+    if (!fso.FolderExists(outputDir)) {
+        fso.CreateFolder(outputDir);
+    }
+
+    var jobs = "<batch>";
+    for (var r = 0; r < repeat; r++) {
+        jobs += "<job url=\"" + page +
+                "\" user-agent=\"" + userAgent +
+                "\" output=\"" + fso.BuildPath(outputDir, "sampleB.out") + "\"/>";
+    }
+    jobs += "</batch>";
+
+    var doc = new ActiveXObject("XSLISAPI.XMLServerDocument");
+    var report = new ActiveXObject("Microsoft.XMLDOM");
+
+    // The first run loads and compiles everything; it isn't counted.
+    report.loadXML(doc.TransformBatch(jobs, root, 1, 0));
+    report.loadXML(doc.TransformBatch(jobs, root, 1, 0));
+    var batch = report.documentElement;
+    if (batch.getAttribute("failed") != "0") {
+        WScript.Echo(report.xml);
+    }
+
+    // This process is the cscript.exe whose command line has the token.
+    var wmi = GetObject("winmgmts:\\\\.\\root\\cimv2");
+    var peakKB = "?";
+    for (var e = new Enumerator(wmi.ExecQuery(
+             "SELECT CommandLine, PeakWorkingSetSize FROM Win32_Process " +
+             "WHERE Name = 'cscript.exe'"));
+         !e.atEnd(); e.moveNext()) {
+        var process = e.item();
+        if (process.CommandLine != null &&
+            process.CommandLine.indexOf(token) >= 0) {
+            peakKB = process.PeakWorkingSetSize;
+        }
+    }
+
+    WScript.Echo((batch.getAttribute("milliseconds") / repeat).toFixed(3) +
+                 "\t" + peakKB);
+}
+
+if (args.length > 0 && args(0) == "/run") {
+    run(args(1), parseInt(args(2)), args(3));
+    WScript.Quit(0);
+}
+
+var root = (args.length > 0) ?
+           args(0) :
+           fso.GetParentFolderName(
+               fso.GetParentFolderName(
+                   fso.GetParentFolderName(WScript.ScriptFullName)));
+var repeat = (args.length > 1) ? parseInt(args(1)) : 2000;
+
+var configDir = fso.BuildPath(root, "xslisapi");
+var configPath = fso.BuildPath(configDir, "masterConfig.xml");
+var savedPath = configPath + ".chainbench";
+if (!fso.FolderExists(configDir)) {
+    fso.CreateFolder(configDir);
+}
+if (fso.FileExists(configPath)) {
+    fso.CopyFile(configPath, savedPath, true);
+}
+
+var shell = new ActiveXObject("WScript.Shell");
+var settings = [8, 0];
+
+WScript.Echo("sampleB, " + repeat + " pages a run, one thread");
+WScript.Echo("documents\tms/page\tpeak KB");
+for (var s = 0; s < settings.length; s++) {
+    var config = fso.CreateTextFile(configPath, true);
+    config.WriteLine("<config>");
+    config.WriteLine("  <cache chain-entries=\"0\" documents=\"" + settings[s] + "\"/>");
+    config.WriteLine("</config>");
+    config.Close();
+
+    var token = "chainbench" + settings[s] + "-" + new Date().getTime();
+    var child = shell.Exec("cscript //nologo \"" + WScript.ScriptFullName +
+                           "\" /run \"" + root + "\" " + repeat + " " + token);
+    var output = child.StdOut.ReadAll();
+    WScript.Echo(settings[s] + "\t\t" + output.replace(/\s+$/, ""));
+}
+
+if (fso.FileExists(savedPath)) {
+    fso.CopyFile(savedPath, configPath, true);
+    fso.DeleteFile(savedPath);
+} else {
+    fso.DeleteFile(configPath);
+}
@@ -0,0 +1,129 @@
+// ============================================================================
+// FILE: loadtest.js
+//
+//      Latency of a server under a mix of ordinary pages and pathological
+//      ones.  A number of requests are kept outstanding at once, most for
+//      an ordinary sample page and some for slow.xml, whose stylesheet
+//      takes time proportional to the cube of the size of its XML.  The
+//      latencies of the ordinary pages are reported as percentiles, with
+//      the counts of each status code, so that runs with and without a
+//      transform pool (<transform threads="n"/> in masterConfig.xml) can
+//      be compared.
+//
+//      Usage: cscript loadtest.js [server [requests [outstanding [slow%]]]]
+//
+//          server       base URL of the site (default http://localhost)
+//          requests     requests to make in all (default 2000)
+//          outstanding  requests in flight at once (default 32)
+//          slow%        percentage of requests for slow.xml (default 5)
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+var args = WScript.Arguments;
+
+var server = (args.length > 0) ? args(0) : "http://localhost";
+var numRequests = (args.length > 1) ? parseInt(args(1)) : 2000;
+var numOutstanding = (args.length > 2) ? parseInt(args(2)) : 32;
+var slowPercent = (args.length > 3) ? parseInt(args(3)) : 5;
+
+var normalURL = server + "/xslisapi/Samples/sampleA/sampleA.xml";
+var slowURL = server + "/xslisapi/Samples/loadtest/slow.xml";
+var userAgent = "Mozilla/4.0 (compatible; MSIE 5.01; Windows NT 5.0)";
+
+var normalTimes = [];
+var slowTimes = [];
+var statusCounts = {};
+var numStarted = 0;
+var numDone = 0;
+var numErrors = 0;
+
+// The requests in flight, each { request, start, slow }.
+var slots = [];
+
+function startRequest(slot) {
+    var bSlow = (Math.random() * 100 < slowPercent);
+    var request = new ActiveXObject("WinHttp.WinHttpRequest.5.1");
+
+    request.Open("GET", bSlow ? slowURL : normalURL, true);
+    request.SetRequestHeader("User-Agent", userAgent);
+    request.Send();
+
+    slots[slot] = { request: request, start: new Date().getTime(), slow: bSlow };
+    numStarted++;
+}
+
+function finishRequest(slot) {
+    var s = slots[slot];
+    var elapsed = new Date().getTime() - s.start;
+    var status;
+
+    try {
+        status = s.request.Status;
+    } catch (e) {
+        status = "error";
+        numErrors++;
+    }
+
+    statusCounts[status] = (statusCounts[status] || 0) + 1;
+    if (status == 200) {
+        (s.slow ? slowTimes : normalTimes).push(elapsed);
+    }
+
+    slots[slot] = null;
+    numDone++;
+}
+
+function percentile(times, p) {
+    if (times.length == 0) {
+        return "-";
+    }
+    var i = Math.ceil(times.length * p / 100) - 1;
+    return times[(i < 0) ? 0 : i];
+}
+
+function report(name, times) {
+    times.sort(function (a, b) { return a - b; });
+    WScript.Echo(name + ": " + times.length + " ok, ms p50 " +
+                 percentile(times, 50) + " p90 " + percentile(times, 90) +
+                 " p99 " + percentile(times, 99) + " max " +
+                 percentile(times, 100));
+}
+
+var begin = new Date().getTime();
+
+for (var i = 0; i < numOutstanding && numStarted < numRequests; i++) {
+    startRequest(i);
+}
+
+while (numDone < numRequests) {
+    var bProgress = false;
+
+    for (var i = 0; i < numOutstanding; i++) {
+        if (slots[i] != null && slots[i].request.WaitForResponse(0)) {
+            finishRequest(i);
+            if (numStarted < numRequests) {
+                startRequest(i);
+            }
+            bProgress = true;
+        }
+    }
+
+    if (!bProgress) {
+        WScript.Sleep(5);
+    }
+}
+
+var seconds = (new Date().getTime() - begin) / 1000;
+
+WScript.Echo(numRequests + " requests, " + numOutstanding +
+             " outstanding, " + slowPercent + "% slow, " +
+             seconds + " s, " +
+             Math.round(numRequests / seconds) + " requests/s");
+report("ordinary", normalTimes);
+report("slow", slowTimes);
+
+var line = "status:";
+for (var status in statusCounts) {
+    line += " " + status + "=" + statusCounts[status];
+}
+WScript.Echo(line);
@@ -0,0 +1,25 @@
+<?xml version="1.0"?>
+
+<!-- Takes time proportional to the cube of the number of items, while
+     writing next to nothing. -->
+
+<xsl:stylesheet xmlns:xsl="http://www.w3.org/TR/WD-xsl">
+
+  <xsl:template match="/">
+    <html>
+      <body>
+        <p>Done.</p>
+        <xsl:for-each select="items/item">
+          <xsl:for-each select="/items/item">
+            <xsl:for-each select="/items/item">
+              <xsl:if test="@id[. = 0]">
+                <xsl:value-of select="@id"/>
+              </xsl:if>
+            </xsl:for-each>
+          </xsl:for-each>
+        </xsl:for-each>
+      </body>
+    </html>
+  </xsl:template>
+
+</xsl:stylesheet>
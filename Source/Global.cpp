@@ -6,11 +6,30 @@
 // Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
 
 #include "StdAfx.h"
+#include "charset.h"
 
 BSTR              g_bstrServer = NULL;
+BSTR              g_bstrRequest = NULL;
 BSTR              g_bstrBrowserType = NULL;
 fso::IFileSystem *g_fileSystemObject = NULL;
 CXmlCache        *g_xmlCache = NULL;
+CChainCache      *g_chainCache = NULL;
+CBufferPool      *g_bufferPool = NULL;
+CDocumentPool    *g_documentPool = NULL;
+CWorkerPool      *g_workerPool = NULL;
+CWorkerPool      *g_batchPool = NULL;
+CSourceInfoCache *g_sourceInfoCache = NULL;
+CPhaseStatistics *g_phaseStats = NULL;
+CSlowRequestLog  *g_slowRequestLog = NULL;
+CBrowserCapsCache *g_browserCapsCache = NULL;
+CBrowscap        *g_browscap = NULL;
+CErrorPageCache  *g_errorPageCache = NULL;
+CArenaBlockCache *g_arenaBlocks = NULL;
+CTransformPool   *g_transformPool = NULL;
+CSingleByteEncoderCache *g_singleByteEncoders = NULL;
+CProcessingProfiles *g_processingProfiles = NULL;
+ULONG             g_cbResponseWriteBuffer = DEFAULT_RESPONSE_WRITE_BUFFER;
+bool              g_bUTF8Input = false;
 Xml3Availability  g_xml3Availability = xml3AvailabilityUnchecked;
 bool              g_globallyInitialized = false;
 
@@ -33,6 +52,9 @@ ModuleGlobalInitialize()
     ERRCHECK (
         (g_bstrServer = SysAllocString (L"Server")) == NULL, 
         E_OUTOFMEMORY);
+    ERRCHECK (
+        (g_bstrRequest = SysAllocString (L"Request")) == NULL, 
+        E_OUTOFMEMORY);
     ERRCHECK (
         (g_bstrBrowserType = SysAllocString (L"MSWC.BrowserType")) == NULL, 
         E_OUTOFMEMORY);
@@ -47,29 +69,109 @@ ModuleGlobalInitialize()
     g_xmlCache = new CXmlCache(60);
     ERRCHECK(g_xmlCache == NULL, E_OUTOFMEMORY);
 
+    g_chainCache = new CChainCache(60, 256);
+    ERRCHECK(g_chainCache == NULL, E_OUTOFMEMORY);
+
+    g_bufferPool = new CBufferPool(16);
+    ERRCHECK(g_bufferPool == NULL, E_OUTOFMEMORY);
+
+    g_documentPool = new CDocumentPool(8);
+    ERRCHECK(g_documentPool == NULL, E_OUTOFMEMORY);
+
+    g_workerPool = new CWorkerPool(4);
+    ERRCHECK(g_workerPool == NULL, E_OUTOFMEMORY);
+
+    g_sourceInfoCache = new CSourceInfoCache();
+    ERRCHECK(g_sourceInfoCache == NULL, E_OUTOFMEMORY);
+
+    g_phaseStats = new CPhaseStatistics();
+    ERRCHECK(g_phaseStats == NULL, E_OUTOFMEMORY);
+
+    g_slowRequestLog = new CSlowRequestLog();
+    ERRCHECK(g_slowRequestLog == NULL, E_OUTOFMEMORY);
+
+    g_browserCapsCache = new CBrowserCapsCache();
+    ERRCHECK(g_browserCapsCache == NULL, E_OUTOFMEMORY);
+
+    g_browscap = new CBrowscap();
+    ERRCHECK(g_browscap == NULL, E_OUTOFMEMORY);
+
+    g_errorPageCache = new CErrorPageCache();
+    ERRCHECK(g_errorPageCache == NULL, E_OUTOFMEMORY);
+
+    g_batchPool = new CWorkerPool(0);
+    ERRCHECK(g_batchPool == NULL, E_OUTOFMEMORY);
+
+    g_arenaBlocks = new CArenaBlockCache();
+    ERRCHECK(g_arenaBlocks == NULL, E_OUTOFMEMORY);
+
+    g_transformPool = new CTransformPool();
+    ERRCHECK(g_transformPool == NULL, E_OUTOFMEMORY);
+
+    g_singleByteEncoders = new CSingleByteEncoderCache();
+    ERRCHECK(g_singleByteEncoders == NULL, E_OUTOFMEMORY);
+
+    g_processingProfiles = new CProcessingProfiles();
+    ERRCHECK(g_processingProfiles == NULL, E_OUTOFMEMORY);
+
     g_globallyInitialized = true;
 
     hr = S_OK;
     
   Error:
     if (FAILED(hr)) {
-        ModuleGlobalUninitialize ();
+        ModuleGlobalUninitialize (true);
     }
     return SUCCEEDED(hr);
 }
 
 // ============================================================================
 // ModuleGlobalUninitialize
-//      Uninitializes globals.
+//      Uninitializes globals.  Items still running on the pools' threads
+//      use the other globals, so when the filter is terminated the
+//      threads are joined first; if they don't finish in time,
+//      everything is left as it is.  At process detach the loader lock
+//      is held and the threads can't be waited for, but they're gone by
+//      then (see ~CWorkerPool).
 
 void
-ModuleGlobalUninitialize()
+ModuleGlobalUninitialize(bool bProcessDetach)   // [in] called from DllMain
 {
     if (g_globallyInitialized) {
+        if (!bProcessDetach) {
+            if (!g_workerPool->Shutdown(POOL_SHUTDOWN_TIMEOUT) ||
+                !g_batchPool->Shutdown(POOL_SHUTDOWN_TIMEOUT) ||
+                !g_transformPool->Shutdown(POOL_SHUTDOWN_TIMEOUT)) {
+                return;
+            }
+        }
+
+        delete g_workerPool;
+        delete g_batchPool;
+        delete g_transformPool;
+        delete g_chainCache;
+        delete g_bufferPool;
+        delete g_documentPool;
         delete g_xmlCache;
+        delete g_sourceInfoCache;
+        delete g_phaseStats;
+        delete g_slowRequestLog;
+        delete g_browserCapsCache;
+        delete g_browscap;
+        delete g_errorPageCache;
+        delete g_singleByteEncoders;
+        delete g_processingProfiles;
         SysFreeString (g_bstrServer);
+        SysFreeString (g_bstrRequest);
         SysFreeString (g_bstrBrowserType);
         SAFERELEASE(g_fileSystemObject);
         g_globallyInitialized = false;
     }
+
+    // Documents that outlive the filter still give their arenas back
+    // when they go, so the blocks stay until the process detaches.
+    if (bProcessDetach) {
+        delete g_arenaBlocks;
+        g_arenaBlocks = NULL;
+    }
 }
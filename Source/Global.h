@@ -25,11 +25,18 @@ const LPCSTR g_szFileTypesA[] =
 
 const char g_szSourceFile[] = "SSXSLSRCFILE:";
 
+// Maximum number of stylesheets that may be chained for one document.
+const int MAX_SHEETS_TO_CHAIN = 64;
+
+// How long TerminateFilter waits for the threads of the pools to finish.
+const DWORD POOL_SHUTDOWN_TIMEOUT = 10000;
+
 extern bool ModuleGlobalInitialize();
-extern void ModuleGlobalUninitialize();
+extern void ModuleGlobalUninitialize(bool bProcessDetach);
 
 // Global, cached BSTRs.
 extern BSTR g_bstrServer;
+extern BSTR g_bstrRequest;
 extern BSTR g_bstrBrowserType;
 
 // Use for simple filename/pathname mappings
@@ -38,6 +45,75 @@ extern fso::IFileSystem *g_fileSystemObject;
 // Global cache for IXMLDOMDocument interface pointers.
 extern CXmlCache *g_xmlCache;
 
+// Pool of blocks for buffers that are reused across requests.
+extern CBufferPool *g_bufferPool;
+
+// Pool of documents for intermediate results of stylesheet chains.
+class CDocumentPool;
+extern CDocumentPool *g_documentPool;
+
+// Doctype and PI contents of static XML files, by version.
+class CSourceInfoCache;
+extern CSourceInfoCache *g_sourceInfoCache;
+
+// Threads for loading the stylesheets of a chain in parallel.
+class CWorkerPool;
+extern CWorkerPool *g_workerPool;
+
+// Threads for rendering batches of pages (see CBatchRenderer).  Kept
+// apart from g_workerPool, whose items a batch job may wait for.
+extern CWorkerPool *g_batchPool;
+
+// Latency histograms for the phases of a transform.
+class CPhaseStatistics;
+extern CPhaseStatistics *g_phaseStats;
+
+// Log of requests that took too long.
+class CSlowRequestLog;
+extern CSlowRequestLog *g_slowRequestLog;
+
+// Browser capabilities, by User-Agent.
+class CBrowserCapsCache;
+extern CBrowserCapsCache *g_browserCapsCache;
+
+// Native reader of browscap.ini.
+class CBrowscap;
+extern CBrowscap *g_browscap;
+
+// Error pages rendered once, by status code and browser.
+class CErrorPageCache;
+extern CErrorPageCache *g_errorPageCache;
+
+// Free lists of blocks for the per-request arenas.
+class CArenaBlockCache;
+extern CArenaBlockCache *g_arenaBlocks;
+
+// Threads that run stylesheet chains, with admission and deadlines.
+class CTransformPool;
+extern CTransformPool *g_transformPool;
+
+// Post-processing profiles from masterConfig.xml.
+class CProcessingProfiles;
+extern CProcessingProfiles *g_processingProfiles;
+
+// Table-driven encoders for single-byte output code pages.
+class CSingleByteEncoderCache;
+extern CSingleByteEncoderCache *g_singleByteEncoders;
+
+// Global cache for intermediate results of stylesheet chains.
+class CChainCache;
+extern CChainCache *g_chainCache;
+
+// Bytes of output gathered for each write to a Response without IStream
+// (see CProcessingStream::WriteToResponse), or 0 to write as it comes;
+// DEFAULT_RESPONSE_WRITE_BUFFER unless masterConfig says otherwise.
+const ULONG DEFAULT_RESPONSE_WRITE_BUFFER = 32 * 1024;
+extern ULONG g_cbResponseWriteBuffer;
+
+// Whether Write/WriteLine text goes to the parser as UTF-8 rather than
+// UTF-16 (see CXMLServerDocument::EnsureXMLDocumentObject).
+extern bool g_bUTF8Input;
+
 enum Xml3Availability {
     xml3AvailabilityUnchecked,
     xml3AvailabilityUnavailable,
@@ -433,7 +433,7 @@ extern "C" BOOL WINAPI
 TerminateFilter(
     DWORD /*dwFlags*/)                          // [in] Flags - currently 0
 {
-    ModuleGlobalUninitialize ();
+    ModuleGlobalUninitialize (false);
 
     return TRUE;
 }
@@ -43,27 +43,20 @@ PIParseInfo::~PIParseInfo()
 HRESULT
 PIParseInfo::Clear()
 {
-    for (long i = 0; i < _lCount; i++) {
-        delete _pAttrs[i]._pszName;
-        delete _pAttrs[i]._pszValue;
-    }
-    if (_pAttrs) {
-        delete [] _pAttrs;
-        _pAttrs = 0;
-    }
+    _pAttrs = 0;
     _lSize = _lCount = 0;
 
     return S_OK;
 }
 
 
-void
-PIParseInfo::SetField(wchar_t* pField, wchar_t* start, wchar_t* end)
+HRESULT
+PIParseInfo::SetField(wchar_t* pField, wchar_t* start, wchar_t* end, CArena &arena)
 {
-    int len = (end - start);
-    wchar_t* result = new wchar_t[len+1];
-    memcpy(result,start,len*sizeof(wchar_t));
-    result[len] = L'\0';
+    HRESULT hr;
+
+    wchar_t* result = arena.CopyString(start, end - start);
+    ERRCHECK(result == NULL, E_OUTOFMEMORY);
 
     if (wcscmp(pField, L"type") == 0)
       {   
@@ -72,21 +65,24 @@ PIParseInfo::SetField(wchar_t* pField, wchar_t* start, wchar_t* end)
     if (_lCount == _lSize)
       {
           long newsize = (_lSize*2)+5;
-          ATTRIBUTE_INFO* newinfo = new ATTRIBUTE_INFO[newsize];
-          ::memset(newinfo,0,sizeof(ATTRIBUTE_INFO)*newsize);
+          ATTRIBUTE_INFO* newinfo = static_cast<ATTRIBUTE_INFO*>(
+              arena.Alloc(sizeof(ATTRIBUTE_INFO)*newsize));
+          ERRCHECK(newinfo == NULL, E_OUTOFMEMORY);
+
           if (_lCount > 0)
               ::memcpy(newinfo,_pAttrs,sizeof(ATTRIBUTE_INFO)*_lCount);
 
-          if (_pAttrs) {
-              delete [] _pAttrs;
-          }
-          
+          // The old array stays in the arena until it's reset.
           _pAttrs = newinfo;
           _lSize = newsize;
       }
     _pAttrs[_lCount]._pszName = pField;
     _pAttrs[_lCount]._pszValue = result;
     _lCount++;
+
+    hr = S_OK;
+  Error:
+    return hr;
 }
 
 wchar_t *
@@ -104,7 +100,7 @@ PIParseInfo::Find(wchar_t* name)
 
 
 HRESULT
-PIParseInfo::Parse(wchar_t *pwszPIContents)
+PIParseInfo::Parse(wchar_t *pwszPIContents, CArena &arena)
 {
     HRESULT hr;
     
@@ -114,25 +110,14 @@ PIParseInfo::Parse(wchar_t *pwszPIContents)
         ptr = SkipName(start);
         ERRCHECK(!*ptr, E_FAIL);
 
-        int len = ptr - start;
-        wchar_t* name = new wchar_t[len+1];
+        wchar_t* name = arena.CopyString(start, ptr - start);
         ERRCHECK(name == NULL, E_OUTOFMEMORY);
-        
-        ::memcpy(name,start,len*sizeof(wchar_t));
-        name[len] = L'\0';
 
         ptr = SkipWhitespace(ptr);
-        if (*ptr != '=') {
-            delete[] name;
-            RETURNERR(E_FAIL);
-        }
+        ERRCHECK(*ptr != '=', E_FAIL);
 
         ptr = SkipWhitespace(ptr+1);
-
-        if (*ptr != '\'' && *ptr != '"') {
-            delete[] name;
-            RETURNERR(E_FAIL);
-        }
+        ERRCHECK(*ptr != '\'' && *ptr != '"', E_FAIL);
 
         wchar_t quote = *ptr;
         ptr++;
@@ -140,14 +125,11 @@ PIParseInfo::Parse(wchar_t *pwszPIContents)
         while (*ptr && *ptr != quote) {
             ptr++;
         }
-
-        if (*ptr != quote) {
-            delete[] name;
-            RETURNERR(E_FAIL);
-        }
+        ERRCHECK(*ptr != quote, E_FAIL);
 
         // Ok, so now we have the name and value of the attribute.
-        this->SetField(name, value, ptr);
+        hr = this->SetField(name, value, ptr, arena);
+        HRCHECK(FAILED(hr));
 
         ptr = SkipWhitespace(ptr+1);
     }
@@ -10,6 +10,11 @@
 
 #pragma once
 
+class CArena;
+
+// Names and values are allocated from the arena passed to Parse(), and
+// are gone when it's reset; Clear() before then.
+
 class PIParseInfo
 {
   public:
@@ -18,10 +23,10 @@ class PIParseInfo
 
     HRESULT  Clear();
     wchar_t *Find(wchar_t* name); // NULL if not found
-    HRESULT  Parse(wchar_t *pwszPIContents);
+    HRESULT  Parse(wchar_t *pwszPIContents, CArena &arena);
 
   private:
-    void SetField(wchar_t* pField, wchar_t* start, wchar_t* end);
+    HRESULT SetField(wchar_t* pField, wchar_t* start, wchar_t* end, CArena &arena);
     
     struct ATTRIBUTE_INFO
     {
@@ -8,6 +8,18 @@
 #include "StdAfx.h"
 #include "charset.h"
 
+// Runs of text outside tags are scanned sixteen characters at a time with
+// SSE2 where the compiler has it (VC6 needs the processor pack), and
+// one at a time otherwise.
+#if defined(_M_X64) || (defined(_M_IX86) && _MSC_FULL_VER >= 12008804)
+#define SCAN_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifndef PF_XMMI64_INSTRUCTIONS_AVAILABLE
+#define PF_XMMI64_INSTRUCTIONS_AVAILABLE 10
+#endif
+
 // ============================================================================
 // NOTES ON HOW THE POSTPROCESSOR WORKS
 //
@@ -29,6 +41,25 @@
 //      - any tag name, entity name or string to match must be 32 
 //        characters or less. (defined by g_nMaxResidualLength)
 //      - characters in (4) cannot include < or &
+//
+// Besides the built-in HDML and WML profiles below, profiles can be
+// defined in masterConfig.xml (see CProcessingProfiles).  They're
+// compiled into the same tables when the file is read, and run through
+// the generic profile.
+//
+// Independently of the above, the stream can compress its output with
+// gzip or deflate, when the caller has negotiated a Content-Encoding
+// with the client.  Compression is the last step before the data goes
+// to the Response (see WriteToDestinationObject).  The first
+// cbCompressMin bytes are held back, and if the whole body turns out to
+// be smaller than that it goes out uncompressed.  The caller is told
+// once the Content-Encoding header has been added, since a page sent
+// in place of this one (e.g. an error) has to be compressed too.
+//
+// A Response without IStream (NT4/IIS4) is written with BinaryWrite, a
+// late-bound call per write.  The output is gathered into writes of
+// g_cbResponseWriteBuffer bytes there (see WriteToResponse); the rest
+// goes out on Commit.
 
    
 typedef LPCWSTR CLOSING_TAG;
@@ -57,11 +88,153 @@ struct CHARACTER_REPLACEMENT
     LPCWSTR pwszReplace;                    // Text to replace with
 };
 
+// ============================================================================
+// CLASS: CCharClassTable
+//      What the postprocessor does with each character, for one set of
+//      character replacements, so that the NORMAL and IN_TAG states can
+//      tell plain text from the rest with one lookup.  Characters below
+//      256 are looked up in a table; characters above that are plain
+//      unless one of the replacements is for such a character, in which
+//      case they're looked for in the list of replacements.
+
+class CCharClassTable
+{
+public:
+    enum
+    {
+        CHARCLASS_PLAIN = 0,                // Copied as it is in any state
+        CHARCLASS_TAG,                      // ' " / > - special inside tags
+        CHARCLASS_MARKUP,                   // < & - starts a tag or entity
+        CHARCLASS_REPLACE,                  // Replacement 0; replacement i
+                                            // is CHARCLASS_REPLACE + i
+    };
+
+    CCharClassTable(const CHARACTER_REPLACEMENT * pCharsToReplace,
+                    int nCharsToReplace);
+
+    BYTE Classify(WCHAR c) const
+    {
+        if (c < 256)
+        {
+            return m_abClass[c];
+        }
+        return m_bHighReplacements ? ClassifyHigh(c) : (BYTE)CHARCLASS_PLAIN;
+    }
+
+private:
+    BYTE ClassifyHigh(WCHAR c) const;
+
+    BYTE m_abClass[256];
+    const CHARACTER_REPLACEMENT * m_pCharsToReplace;
+    int m_nCharsToReplace;
+    bool m_bHighReplacements;               // Some replacement is above 255
+};
+
+// ============================================================================
+// FoldNameChar, CompareNamesIgnoreCase
+//      How closing tags are matched regardless of case: each character
+//      folded to lower case, ASCII directly and the rest as CharLowerBuff
+//      does it.  Everything that matches, sorts or hashes closing tags
+//      uses these, so that they all agree on which names are the same.
+
+inline WCHAR
+FoldNameChar(
+    WCHAR c)                                // [in] Character to fold
+{
+    if (c < 128)
+    {
+        return (c >= L'A' && c <= L'Z') ? (WCHAR)(c + (L'a' - L'A')) : c;
+    }
+    CharLowerBuffW (&c, 1);
+    return c;
+}
+
+inline int
+CompareNamesIgnoreCase(
+    LPCWSTR pwsz1,                          // [in] Name
+    LPCWSTR pwsz2)                          // [in] Name to compare it to
+{
+    WCHAR c1, c2;
+
+    do
+    {
+        c1 = FoldNameChar (*pwsz1++);
+        c2 = FoldNameChar (*pwsz2++);
+    }
+    while (c1 == c2 && c1 != 0);
+
+    return (c1 < c2) ? -1 : (c1 > c2) ? 1 : 0;
+}
+
+// ============================================================================
+// CLASS: CNameHash
+//      Minimal perfect hash of a set of tag or entity names, so that
+//      looking a name up is one hash of it and one compare, rather than
+//      a binary search of the sorted array.  Names are read from an
+//      array of structures whose first member is the name, and Lookup
+//      returns the index into that array, as LookupSortedArray does.
+//
+//      The names are put in as many slots as there are names.  Each is
+//      hashed once into a bucket, and each bucket has its own seed that
+//      rehashes its names into free slots; Build tries seeds, fullest
+//      bucket first, until all the names have a slot.  If it can't (or
+//      runs out of memory), Lookup compares against every name instead.
+//
+//      Closing tags are looked up without regard to case, folded by
+//      FoldNameChar for both the hash and the compare; entities aren't.
+
+class CNameHash
+{
+public:
+    CNameHash(const void * pElems, int nElems, int cbElem, bool bIgnoreCase);
+    ~CNameHash();
+
+    int Lookup(LPCWSTR pwszName) const;
+
+private:
+    LPCWSTR Name(int i) const
+    {
+        return *(LPCWSTR const *)((const BYTE *)m_pElems + i * m_cbElem);
+    }
+
+    DWORD Hash(LPCWSTR pwszName) const;
+    static DWORD Slot(DWORD dwHash, DWORD dwSeed, int nSlots);
+
+    // dw scaled to 0..n-1, without a division.
+    static DWORD Reduce(DWORD dw, int n)
+    {
+        return (DWORD)(((DWORDLONG)dw * (DWORD)n) >> 32);
+    }
+    bool Build();
+    int Compare(LPCWSTR pwsz1, LPCWSTR pwsz2) const
+    {
+        return m_bIgnoreCase ? CompareNamesIgnoreCase (pwsz1, pwsz2) : lstrcmp (pwsz1, pwsz2);
+    }
+
+    const void * m_pElems;                  // Array the names are in
+    int m_nElems;                           // Number of names
+    int m_cbElem;                           // Size of an element
+    bool m_bIgnoreCase;
+    DWORD * m_pdwSeeds;                     // Seed of each bucket, 0 if empty;
+                                            // NULL if Build failed
+    int * m_pnSlots;                        // Index of the name in each slot
+};
+
 // Limits.
 
 const long g_nMaxInputBufferChunk = 4096;   // Input buffer chunking
 const long g_nOutputBufferPadding = 16;     // Padding to add to output buffer
 const long g_nMaxResidualLength = 32;       // See above
+const long g_nMaxOutputBufferLength =       // Output buffer for a full chunk
+    g_nMaxInputBufferChunk + g_nMaxInputBufferChunk / 2 +
+    g_nMaxResidualLength + g_nOutputBufferPadding;
+const long g_nMaxEncodeChunk = 8192;        // Characters encoded at once
+const ULONG g_cbCompressedChunk = 16384;    // Compressed data written at once
+const int g_nMaxScanStops = 18;             // '<', '&' and replaced characters
+                                            // ScanPlainText looks for
+const int g_nMaxScanRanges = 4;             // Ranges without any it skips
+const int g_nScanStopsUnranged = 4;         // Stops it looks for without
+                                            // those ranges
 
 
 // ============================================================================
@@ -84,6 +257,8 @@ const long g_nMaxResidualLength = 32;       // See above
 //          Array of closing tags to remove
 //      m_nClosingTagsToRemove
 //          Number of elements in m_pClosingTagsToRemove
+//      m_pClosingTagHash, m_pEntityHash
+//          Perfect hashes of m_pClosingTagsToRemove and m_pEntitiesToReplace
 //      m_bExpandEmptyTags
 //          Set to true to expand XML notation for empty tags ("/>")
 
@@ -91,13 +266,18 @@ const long g_nMaxResidualLength = 32;       // See above
 class CProcessingStream : public IStream
 {
 public:
+    struct SMIMEToStreamType;
+
     CProcessingStream(IStream * pOutputStream,
                       asp::IResponse * pResponse,
-                      const WCHAR * pwszStreamLanguage,
-                      UINT uiCP);
-#ifdef _DEBUG
-    ~CProcessingStream();
-#endif
+                      const SMIMEToStreamType * pStreamType,
+                      CProfileSet * pProfiles,
+                      UINT uiCP,
+                      const WCHAR * pwszContentEncoding,
+                      ULONG cbCompressMin,
+                      bool * pfEncodingHeaderSent,
+                      CRequestTrace * pTrace);
+    virtual ~CProcessingStream();
 
     // IUnknown Methods
     STDMETHOD(QueryInterface)(REFIID riid, LPVOID FAR* ppvObj);
@@ -137,10 +317,16 @@ public:
     {
         const WCHAR * pwszMIMEType;
         const SProcessingParameters * pProcessingParameters;
+        const CCharClassTable * pCharClasses;   // of pProcessingParameters
+        const CNameHash * pClosingTagHash;      // of pClosingTagsToRemove
+        const CNameHash * pEntityHash;          // of pEntitiesToReplace
     };
 
+    static const SMIMEToStreamType * FindStreamType(const WCHAR * pwszMIMEType);
+    static bool VerifyProcessingParameters(const SMIMEToStreamType * pStreamType);
+
 private:
-    UINT m_cRefs;
+    LONG m_cRefs;
     CComPtr<IStream> m_pcomDestinationStream;
     CComPtr<asp::IResponse> m_pcomResponse;
 
@@ -149,27 +335,38 @@ public:
     HRESULT ProcessorWrite(LPCWSTR pwszInData, long nDataLength);
     HRESULT ProcessorFlush();
 
-private:
+protected:
     ENTITY_REPLACEMENT const * m_pEntitiesToReplace;
     int m_nEntitiesToReplace;
     CHARACTER_REPLACEMENT const * m_pCharsToReplace;
     int m_nCharsToReplace;
+    CCharClassTable const * m_pCharClasses;
     CLOSING_TAG const * m_pClosingTagsToRemove;
     int m_nClosingTagsToRemove;
+    CNameHash const * m_pClosingTagHash;
+    CNameHash const * m_pEntityHash;
     bool m_bExpandEmptyTags;
+    CProfileSet * m_pProfiles;              // Set the parameters are from,
+                                            // if they were loaded
     bool m_fPostProcess;
     bool m_fFirstWrite;
 
-    HRESULT ProcessorWriteChunk(LPCWSTR pwszChunk, long nChunkLength);
+    // The state machine, specialized for each profile (see
+    // CProfileProcessingStream).
+    virtual HRESULT ProcessorWriteChunk(LPCWSTR pwszChunk, long nChunkLength) = 0;
+    long ScanPlainText(LPCWSTR pwszText, long nLength) const;
     HRESULT WriteToOutputBuffer(LPCWSTR pwszData, long nLength,
                 long nInputDataRemaining, long* pnBufferUsed);
     HRESULT WriteResidualToOutputBuffer(long nInputDataRemaining,
                 long* pnBufferUsed);
     HRESULT WriteToDestinationStream(const void __RPC_FAR *pv, ULONG cb, ULONG __RPC_FAR *pcbWritten);
+    HRESULT WriteEncoded(LPCWSTR pwch, long cch, ULONG *pcbTotal);
     HRESULT WriteToDestinationObject(const void __RPC_FAR *pv, ULONG cb, ULONG __RPC_FAR *pcbWritten);
-   #ifdef _DEBUG
-    void VerifyProcessingParameters();
-   #endif
+    HRESULT WriteToResponse(const void __RPC_FAR *pv, ULONG cb, ULONG __RPC_FAR *pcbWritten);
+    HRESULT WriteResponseNow(const void __RPC_FAR *pv, ULONG cb);
+    HRESULT StartCompression();
+    HRESULT WriteCompressedOutput(bool fAll);
+    HRESULT FinishContentEncoding();
 
     // Post-processor state. 
     enum PROCESSORSTATE
@@ -194,10 +391,50 @@ private:
                                             // Buffer to keep current tag
     long m_nClosingTagLength;               // Length of string in buffer
 
-    LPWSTR m_pwszOutputBuffer;              // Output buffer (_alloca)
+    LPWSTR m_pwszOutputBuffer;              // Output buffer (in m_outputBlock)
     long m_nOutputBufferLength;             // Length of output buffer
+    CPooledBuffer m_outputBlock;            // Holds the output buffer
+    CPooledBuffer m_encoded;                // Output in m_uiCP, a chunk at
+                                            // a time
+    WCHAR m_wchHeldSurrogate;               // End of the last write, if it
+                                            // was half a pair; else 0
 
     UINT m_uiCP;                            // Code page used for encoding
+    const CSingleByteEncoder * m_pSingleByte;
+                                            // Its table, if it's single-byte
+
+    BYTE m_abScanStops[(g_nMaxScanStops + 2 * g_nMaxScanRanges + 1) * 16];
+    BYTE *m_pbScanStops;                    // Characters below 0xFF that
+                                            // end plain text, 16 of each,
+                                            // then the first and length of
+                                            // each range, aligned in
+                                            // m_abScanStops
+    int m_nScanStops;                       // -1 if too many for SSE2
+    int m_nScanRanges;                      // 0 if there are few stops
+    WCHAR m_awchScanStopsHigh[g_nMaxScanStops];
+    int m_nScanStopsHigh;                   // Those from 0xFF up
+    bool m_bScanSSE2;                       // Processor has SSE2
+
+    // Content-Encoding state.
+    enum CONTENTENCODING
+    {
+        ENCODING_IDENTITY = 0,
+        ENCODING_GZIP,
+        ENCODING_DEFLATE,
+    };
+
+    CONTENTENCODING m_encoding;             // Encoding negotiated with client
+    ULONG m_cbCompressMin;                  // Smallest body worth compressing
+    CPooledBuffer m_heldBack;               // Output until that's reached
+    CDeflater * m_pDeflater;                // Compressor, once started
+    bool * m_pfEncodingHeaderSent;          // Content-Encoding added (caller's)
+
+    ULONG m_cbWriteBuffer;                  // Gather writes to the Response
+                                            // up to this, or 0
+    CPooledBuffer m_writeBuffer;            // Output gathered so far
+
+    LONGLONG m_outputTicks;                 // Time spent in Write and Commit
+    CRequestTrace * m_pTrace;               // Request's trace, or NULL
 
 private:
     CProcessingStream();                    // disable default constructor
@@ -263,1042 +500,3094 @@ const CProcessingStream::SProcessingParameters g_WMLProcessingParameters =
 };
 
 
+// Built when the DLL is loaded.
+const CCharClassTable g_HDMLCharClasses(g_arrHDMLCharsToReplace,
+                                        COUNTOF(g_arrHDMLCharsToReplace));
+const CCharClassTable g_WMLCharClasses(g_arrWMLCharsToReplace,
+                                       COUNTOF(g_arrWMLCharsToReplace));
+const CNameHash g_HDMLClosingTagHash(g_arrHDMLTagsToRemove,
+                                     COUNTOF(g_arrHDMLTagsToRemove),
+                                     sizeof(CLOSING_TAG), true);
+const CNameHash g_HDMLEntityHash(g_arrHDMLEntitiesToReplace,
+                                 COUNTOF(g_arrHDMLEntitiesToReplace),
+                                 sizeof(ENTITY_REPLACEMENT), false);
+const CNameHash g_WMLClosingTagHash(NULL, 0, sizeof(CLOSING_TAG), true);
+const CNameHash g_WMLEntityHash(g_arrWMLEntitiesToReplace,
+                                COUNTOF(g_arrWMLEntitiesToReplace),
+                                sizeof(ENTITY_REPLACEMENT), false);
+
 // TODO: It would be nice to make this a static member of CProcessingStream,
 // but getting the initialization to work right is tricky.
 const CProcessingStream::SMIMEToStreamType g_aMIMEToStreamTypeMap[] =
     {
-        { L"text/x-hdml", &g_HDMLProcessingParameters },
-        { L"text/x-wap.wml", &g_WMLProcessingParameters },
-        { L"text/vnd.wap.wml", &g_WMLProcessingParameters },
+        { L"text/x-hdml", &g_HDMLProcessingParameters, &g_HDMLCharClasses,
+          &g_HDMLClosingTagHash, &g_HDMLEntityHash },
+        { L"text/x-wap.wml", &g_WMLProcessingParameters, &g_WMLCharClasses,
+          &g_WMLClosingTagHash, &g_WMLEntityHash },
+        { L"text/vnd.wap.wml", &g_WMLProcessingParameters, &g_WMLCharClasses,
+          &g_WMLClosingTagHash, &g_WMLEntityHash },
     };
 
 const UINT g_cMIMEToStreamTypeMap = COUNTOF(g_aMIMEToStreamTypeMap);
 
+
+// Callback functions to compare tag names and entity names.
+
+int __fastcall CompareClosingTags(CLOSING_TAG const* pElem1,
+                    CLOSING_TAG const* pElem2);
+int __fastcall LookupClosingTags(LPCWSTR pwsz,
+                    CLOSING_TAG const* pElem);
+int __fastcall CompareEntityStructs(ENTITY_REPLACEMENT const* pElem1, 
+                    ENTITY_REPLACEMENT const* pElem2);
+int __fastcall LookupEntityStructs(LPCWSTR pwsz, 
+                    ENTITY_REPLACEMENT const* pElem);
+
+
 // ============================================================================
-// CProcessingStream::CProcessingStream
-//      Constructor.
+// CLASS: CLoadedProfile
+//      A profile from masterConfig.xml (see CProcessingProfiles): its
+//      tables, sorted as the built-in ones are, and the character class
+//      table and name hashes built from them.  The strings in the tables
+//      are BSTRs it owns.
 
-CProcessingStream::CProcessingStream
-(
-    IStream * pOutputStream,
-    // [in] Pointer to stream to write output to
-    asp::IResponse * pResponse,
-    // [in] Pointer to Response object, used when pOutputStream is not provided
-    const WCHAR * pwszStreamLanguage,
-    // [in] MIME-type of stream
-    UINT uiCP
-    // [in] Code page for Encoding of stream
-)
+class CLoadedProfile
 {
-    UINT iWhichMapEntry;
+public:
+    CLoadedProfile();
+    ~CLoadedProfile();
 
-    m_cRefs = 0;
-    m_pcomDestinationStream = pOutputStream;
-    m_pcomResponse = pResponse;
-    m_fPostProcess = false;
-    m_fFirstWrite = true;
+    HRESULT Load(IXMLDOMNode * pProfileNode, CComBSTR & bstrError);
 
-    m_state = STATE_NORMAL;
-    m_nResidualUsed = 0;
-    m_hrLast = S_OK;
+    const CProcessingStream::SMIMEToStreamType * GetStreamType() const
+    {
+        return &m_streamType;
+    }
 
-    m_pEntitiesToReplace = NULL;
-    m_nEntitiesToReplace = 0;
-    m_pCharsToReplace = NULL;
-    m_nCharsToReplace = 0;
-    m_pClosingTagsToRemove = NULL;
-    m_nClosingTagsToRemove = 0;
-    m_bExpandEmptyTags = false;
+    CLoadedProfile * m_pNext;               // Next in its set
 
-    m_uiCP = uiCP;
+private:
+    HRESULT LoadClosingTags(IXMLDOMNode * pProfileNode, CComBSTR & bstrError);
+    HRESULT LoadEntities(IXMLDOMNode * pProfileNode, CComBSTR & bstrError);
+    HRESULT LoadCharacters(IXMLDOMNode * pProfileNode, CComBSTR & bstrError);
+
+    CComBSTR m_bstrMIMEType;
+    CLOSING_TAG * m_pClosingTags;
+    ENTITY_REPLACEMENT * m_pEntities;
+    CHARACTER_REPLACEMENT * m_pChars;       // Counts are in m_parameters
+    CProcessingStream::SProcessingParameters m_parameters;
+    CProcessingStream::SMIMEToStreamType m_streamType;
+    CCharClassTable * m_pCharClasses;
+    CNameHash * m_pClosingTagHash;
+    CNameHash * m_pEntityHash;
+};
+
+// ============================================================================
+// CLASS: CProfileSet
+//      The profiles loaded from one version of masterConfig.xml.  It's
+//      reference counted, since the streams using its profiles hold on
+//      to it after a newer version replaces it.
+
+class CProfileSet
+{
+public:
+    CProfileSet() : m_ref(1), m_pProfiles(NULL) {}
 
+    long AddRef()
+    {
+        return InterlockedIncrement(&m_ref);
+    }
 
-    for(iWhichMapEntry = 0; iWhichMapEntry < g_cMIMEToStreamTypeMap; ++iWhichMapEntry)
+    long Release()
     {
-        if(0 == lstrcmp(pwszStreamLanguage, g_aMIMEToStreamTypeMap[iWhichMapEntry].pwszMIMEType))
+        long result = InterlockedDecrement(&m_ref);
+        if (result == 0)
         {
-            m_fPostProcess = true;
-            m_pEntitiesToReplace =
-                g_aMIMEToStreamTypeMap[iWhichMapEntry].pProcessingParameters->pEntitiesToReplace;
-            m_nEntitiesToReplace =
-                g_aMIMEToStreamTypeMap[iWhichMapEntry].pProcessingParameters->nEntitiesToReplace;
-            m_pCharsToReplace =
-                g_aMIMEToStreamTypeMap[iWhichMapEntry].pProcessingParameters->pCharsToReplace;
-            m_nCharsToReplace =
-                g_aMIMEToStreamTypeMap[iWhichMapEntry].pProcessingParameters->nCharsToReplace;
-            m_pClosingTagsToRemove =
-                g_aMIMEToStreamTypeMap[iWhichMapEntry].pProcessingParameters->pClosingTagsToRemove;
-            m_nClosingTagsToRemove =
-                g_aMIMEToStreamTypeMap[iWhichMapEntry].pProcessingParameters->nClosingTagsToRemove;
-            m_bExpandEmptyTags =
-                g_aMIMEToStreamTypeMap[iWhichMapEntry].pProcessingParameters->bExpandEmptyTags;
-            break;
+            delete this;
         }
+        return result;
     }
 
-   #ifdef _DEBUG
-    VerifyProcessingParameters ();
-   #endif   
+    // Takes over pProfile.  Of two profiles for a MIME type, the one
+    // added last is used.
+    void Add(CLoadedProfile * pProfile)
+    {
+        pProfile->m_pNext = m_pProfiles;
+        m_pProfiles = pProfile;
+    }
+
+    const CProcessingStream::SMIMEToStreamType * FindStreamType(const WCHAR * pwszMIMEType) const;
+
+private:
+    ~CProfileSet();
+
+    LONG m_ref;
+    CLoadedProfile * m_pProfiles;
 };
 
-// ============================================================================
-// CProcessingStream::~CProcessingStream
-//      Destructor.
 
-#ifdef _DEBUG
-CProcessingStream::~CProcessingStream
-(
-)
+// ============================================================================
+// PROFILES
+//      What the state machine in ProcessorWriteChunk asks of the
+//      processing parameters, answered by a class per profile.  The
+//      generic profile reads SProcessingParameters at run time; the HDML
+//      and WML profiles answer from their own tables, so that flags
+//      like bExpandEmptyTags are constants, and code that can't run for
+//      the profile is compiled out of its ProcessorWriteChunk.  They
+//      must agree with g_HDMLProcessingParameters and
+//      g_WMLProcessingParameters.
+//
+//      ExpandEmptyTags()       bExpandEmptyTags
+//      Classify(c)             CCharClassTable::Classify
+//      CharReplacement(i)      Replacement for character class i
+//      LookupClosingTag(psz)   Index of tag to remove, or -1
+//      LookupEntity(psz)       Index of entity to replace, or -1
+//      EntityReplacement(i)    Replacement for entity i
+
+class CGenericProfile
 {
-    // If you are getting this assert, you should make sure you
-    // flush the processor before this point.
-    ASSERT (FAILED (m_hrLast) || m_nResidualUsed == 0);
-}
-#endif
+public:
+    CGenericProfile(const CProcessingStream::SMIMEToStreamType * pStreamType)
+    {
+        m_pParameters = pStreamType ? pStreamType->pProcessingParameters : NULL;
+        m_pCharClasses = pStreamType ? pStreamType->pCharClasses : NULL;
+        m_pClosingTagHash = pStreamType ? pStreamType->pClosingTagHash : NULL;
+        m_pEntityHash = pStreamType ? pStreamType->pEntityHash : NULL;
+    }
 
+    bool ExpandEmptyTags() const
+    {
+        return m_pParameters->bExpandEmptyTags;
+    }
 
-// ============================================================================
-// CProcessingStream::QueryInterface
-//      Standard IUnknown method.
+    BYTE Classify(WCHAR c) const
+    {
+        return m_pCharClasses->Classify (c);
+    }
 
-STDMETHODIMP
-CProcessingStream::QueryInterface
-(
-    REFIID riid,
-    LPVOID FAR* ppvObj
-)
+    LPCWSTR CharReplacement(int i) const
+    {
+        return m_pParameters->pCharsToReplace[i].pwszReplace;
+    }
+
+    int LookupClosingTag(LPCWSTR pwszName) const
+    {
+        return m_pClosingTagHash->Lookup (pwszName);
+    }
+
+    int LookupEntity(LPCWSTR pwszName) const
+    {
+        return m_pEntityHash->Lookup (pwszName);
+    }
+
+    LPCWSTR EntityReplacement(int i) const
+    {
+        return m_pParameters->pEntitiesToReplace[i].pwszReplace;
+    }
+
+private:
+    const CProcessingStream::SProcessingParameters * m_pParameters;
+    const CCharClassTable * m_pCharClasses;
+    const CNameHash * m_pClosingTagHash;
+    const CNameHash * m_pEntityHash;
+};
+
+class CHDMLProfile
 {
-    HRESULT hr;
+public:
+    CHDMLProfile(const CProcessingStream::SMIMEToStreamType * pStreamType)
+    {
+        ASSERT (pStreamType->pProcessingParameters == &g_HDMLProcessingParameters);
+    }
 
-    ERRCHECK(NULL == ppvObj, E_POINTER);
+    bool ExpandEmptyTags() const
+    {
+        return true;
+    }
 
-    if(InlineIsEqualUnknown(riid))
+    BYTE Classify(WCHAR c) const
     {
-        *ppvObj = static_cast<IUnknown *>(this);
+        return g_HDMLCharClasses.Classify (c);
     }
-    else if(InlineIsEqualGUID(riid, IID_ISequentialStream))
+
+    LPCWSTR CharReplacement(int i) const
     {
-        *ppvObj = static_cast<ISequentialStream *>(this);
+        return g_arrHDMLCharsToReplace[i].pwszReplace;
     }
-    else if(InlineIsEqualGUID(riid, IID_IStream))
+
+    int LookupClosingTag(LPCWSTR pwszName) const
     {
-        *ppvObj = static_cast<IStream *>(this);
+        return g_HDMLClosingTagHash.Lookup (pwszName);
     }
-    else
+
+    int LookupEntity(LPCWSTR pwszName) const
     {
-        RETURNERR(E_NOINTERFACE);
+        return g_HDMLEntityHash.Lookup (pwszName);
     }
 
-    this->AddRef();
+    LPCWSTR EntityReplacement(int i) const
+    {
+        return g_arrHDMLEntitiesToReplace[i].pwszReplace;
+    }
+};
 
-    hr = S_OK;
-Error:
-    return hr;
-}
+class CWMLProfile
+{
+public:
+    CWMLProfile(const CProcessingStream::SMIMEToStreamType * pStreamType)
+    {
+        ASSERT (pStreamType->pProcessingParameters == &g_WMLProcessingParameters);
+    }
+
+    bool ExpandEmptyTags() const
+    {
+        return false;
+    }
+
+    BYTE Classify(WCHAR c) const
+    {
+        return g_WMLCharClasses.Classify (c);
+    }
+
+    LPCWSTR CharReplacement(int i) const
+    {
+        return g_arrWMLCharsToReplace[i].pwszReplace;
+    }
+
+    int LookupClosingTag(LPCWSTR) const
+    {
+        return -1;                          // No closing tags are removed
+    }
+
+    int LookupEntity(LPCWSTR pwszName) const
+    {
+        return g_WMLEntityHash.Lookup (pwszName);
+    }
+
+    LPCWSTR EntityReplacement(int i) const
+    {
+        return g_arrWMLEntitiesToReplace[i].pwszReplace;
+    }
+};
 
 
 // ============================================================================
-// CProcessingStream::AddRef
-//      Standard IUnknown method.
+// CLASS: CProfileProcessingStream
+//      The processing stream with the postprocessor's state machine
+//      compiled for one profile (see PROFILES above).
+//      CreateProcessingStream picks the profile once, by MIME type.
 
-STDMETHODIMP_(ULONG)
-CProcessingStream::AddRef
-(
-)
+template <class Profile>
+class CProfileProcessingStream : public CProcessingStream
 {
-    return ++m_cRefs;
-}
+public:
+    CProfileProcessingStream(IStream * pOutputStream,
+                             asp::IResponse * pResponse,
+                             const SMIMEToStreamType * pStreamType,
+                             CProfileSet * pProfiles,
+                             UINT uiCP,
+                             const WCHAR * pwszContentEncoding,
+                             ULONG cbCompressMin,
+                             bool * pfEncodingHeaderSent,
+                             CRequestTrace * pTrace)
+        : CProcessingStream(pOutputStream,
+                            pResponse,
+                            pStreamType,
+                            pProfiles,
+                            uiCP,
+                            pwszContentEncoding,
+                            cbCompressMin,
+                            pfEncodingHeaderSent,
+                            pTrace),
+          m_profile(pStreamType)
+    {
+    }
+
+protected:
+    virtual HRESULT ProcessorWriteChunk(LPCWSTR pwszChunk, long nChunkLength);
 
+private:
+    Profile m_profile;
+};
 
 // ============================================================================
-// CProcessingStream::AddRef
-//      Standard IUnknown method.
+// CCharClassTable::CCharClassTable
+//      Constructor.  Where a character has more than one replacement,
+//      the last is used, as the postprocessor always has.
 
-STDMETHODIMP_(ULONG)
-CProcessingStream::Release
+CCharClassTable::CCharClassTable
 (
+    const CHARACTER_REPLACEMENT * pCharsToReplace,
+    // [in] Array of character replacements
+    int nCharsToReplace
+    // [in] Number of elements in pCharsToReplace
 )
 {
-    ULONG ulReturn;
+    int i;
 
-    ASSERT(0 < m_cRefs);
+    m_pCharsToReplace = pCharsToReplace;
+    m_nCharsToReplace = nCharsToReplace;
+    m_bHighReplacements = false;
 
-    ulReturn = m_cRefs--;
-    if(0 == ulReturn)
+    ZeroMemory (m_abClass, sizeof(m_abClass));
+    m_abClass[L'\''] = CHARCLASS_TAG;
+    m_abClass[L'\"'] = CHARCLASS_TAG;
+    m_abClass[L'/'] = CHARCLASS_TAG;
+    m_abClass[L'>'] = CHARCLASS_TAG;
+    m_abClass[L'<'] = CHARCLASS_MARKUP;
+    m_abClass[L'&'] = CHARCLASS_MARKUP;
+
+    ASSERT (nCharsToReplace <= 256 - CHARCLASS_REPLACE);
+    for (i = 0; i < nCharsToReplace; i++)
     {
-        delete this;
+        WCHAR c = pCharsToReplace[i].cMatch;
+
+        if (c < 256)
+        {
+            m_abClass[c] = (BYTE)(CHARCLASS_REPLACE + i);
+        }
+        else
+        {
+            m_bHighReplacements = true;
+        }
     }
-    return ulReturn;
 }
 
-
 // ============================================================================
-// CProcessingStream::Read
-//      Standard ISequentialStream method.
+// CCharClassTable::ClassifyHigh
+//      Classifies a character above 255, when some replacement is for
+//      such a character.
 
-STDMETHODIMP
-CProcessingStream::Read
-( 
-    void __RPC_FAR * /* pv */,
-    ULONG /* cb */,
-    ULONG __RPC_FAR * /* pcbRead */
-)
+BYTE
+CCharClassTable::ClassifyHigh(
+    WCHAR c) const                          // [in] Character above 255
 {
-    ERRORTRACE(E_NOTIMPL);
-    return E_NOTIMPL;
+    int i = m_nCharsToReplace;
+    while (--i >= 0)
+    {
+        if (m_pCharsToReplace[i].cMatch == c)
+        {
+            return (BYTE)(CHARCLASS_REPLACE + i);
+        }
+    }
+    return CHARCLASS_PLAIN;
 }
 
+// Most seeds Build tries for a bucket before giving up.
+const DWORD g_dwMaxNameHashSeed = 0x10000;
 
 // ============================================================================
-// CProcessingStream::Write
-//      Standard ISequentialStream method.
+// CNameHash::CNameHash
+//      Constructor.  Builds the table.
 
-STDMETHODIMP
-CProcessingStream::Write
-( 
-    const void __RPC_FAR *pv,
-    ULONG cb,
-    ULONG __RPC_FAR *pcbWritten
+CNameHash::CNameHash
+(
+    const void * pElems,
+    // [in] Array of structures, each starting with a name
+    int nElems,
+    // [in] Number of elements in pElems
+    int cbElem,
+    // [in] Size of an element
+    bool bIgnoreCase
+    // [in] Whether names match regardless of case
 )
 {
-    HRESULT hr;
-    const WCHAR chBOM = L'\xFEFF'; // Byte-order mark
-
-    ERRCHECK(NULL == pv, STG_E_INVALIDPOINTER);
-
-    if(m_fFirstWrite)
-    {
-        // We expect this to be the byte-order mark (BOM)
-        ERRCHECK(cb != sizeof(WCHAR) ||
-                 *reinterpret_cast<const WCHAR *>(pv) != chBOM,
-                 STG_E_CANTSAVE);
-
-        // Add necessary BOM according to code page setting
-        if (m_uiCP == CP_UTF16 || m_uiCP == CP_UTF16FFFE) {
-            const BYTE bom[2] = { 0xFF, 0xFE };
-            const BYTE bomBig[2] = { 0xFE, 0xFF };  // Big-Endian
-            ULONG cbWritten;
-
-            hr = WriteToDestinationObject((m_uiCP == CP_UTF16)?bom:bomBig,
-                                          2, &cbWritten);
-            HRCHECK(FAILED(hr));
-        }
-
-        m_fFirstWrite = false;
-    }
-    else if(m_fPostProcess && cb > 0)
+    m_pElems = pElems;
+    m_nElems = nElems;
+    m_cbElem = cbElem;
+    m_bIgnoreCase = bIgnoreCase;
+    m_pdwSeeds = NULL;
+    m_pnSlots = NULL;
+
+    if (nElems > 0 && !Build())
     {
-        hr = this->ProcessorWrite(static_cast<LPCWSTR>(pv), (long)(cb / sizeof(WCHAR)));
-        HRCHECK(FAILED(hr));
-    }
-    else if(cb > 0)
-    {
-        // Just pass right on through... no post processing needed.
-        hr = WriteToDestinationStream(pv, cb, NULL);
-        HRCHECK(FAILED(hr));
-            
+        delete [] m_pdwSeeds;
+        delete [] m_pnSlots;
+        m_pdwSeeds = NULL;
+        m_pnSlots = NULL;
     }
 
-    if (pcbWritten != NULL)
+   #ifdef _DEBUG
+    for (int i = 0; i < nElems; i++)
     {
-        *pcbWritten = cb;
+        // If this assert fails, the name is in the array twice.
+        ASSERT (Compare (Name(i), Name(Lookup(Name(i)))) == 0);
     }
-
-    hr = S_OK;
-  Error:
-    return hr;
+   #endif
 }
 
-
-// ============================================================================
-// CProcessingStream::Seek
-//      Standard IStream method.
-
-STDMETHODIMP
-CProcessingStream::Seek
-( 
-    LARGE_INTEGER /* dlibMove */,
-    DWORD /* dwOrigin */,
-    ULARGE_INTEGER __RPC_FAR * /* plibNewPosition */
-)
+CNameHash::~CNameHash()
 {
-    ERRORTRACE(E_NOTIMPL);
-    return E_NOTIMPL;
+    delete [] m_pdwSeeds;
+    delete [] m_pnSlots;
 }
 
-
 // ============================================================================
-// CProcessingStream::SetSize
-//      Standard IStream method.
+// CNameHash::Hash
+//      FNV-1a of the name, folded by FoldNameChar if case doesn't matter.
 
-STDMETHODIMP
-CProcessingStream::SetSize
-( 
-    ULARGE_INTEGER /* libNewSize */
-)
+DWORD
+CNameHash::Hash(
+    LPCWSTR pwszName) const                 // [in] Name to hash
 {
-    ERRORTRACE(E_NOTIMPL);
-    return E_NOTIMPL;
-}
+    DWORD dwHash = 2166136261;
 
+    for (; *pwszName; pwszName++)
+    {
+        WCHAR c = *pwszName;
 
-// ============================================================================
-// CProcessingStream::CopyTo
-//      Standard IStream method.
-
-STDMETHODIMP
-CProcessingStream::CopyTo
-( 
-    IStream __RPC_FAR * /* pstm */,
-    ULARGE_INTEGER /* cb */,
-    ULARGE_INTEGER __RPC_FAR * /* pcbRead */,
-    ULARGE_INTEGER __RPC_FAR * /* pcbWritten */
-)
-{
-    ERRORTRACE(E_NOTIMPL);
-    return E_NOTIMPL;
+        if (m_bIgnoreCase)
+        {
+            c = FoldNameChar (c);
+        }
+        dwHash = (dwHash ^ c) * 16777619;
+    }
+    return dwHash;
 }
 
-
 // ============================================================================
-// CProcessingStream::Commit
-//      Standard IStream method.
-
-STDMETHODIMP
-CProcessingStream::Commit
-( 
-    DWORD /* grfCommitFlags */
-)
+// CNameHash::Slot
+//      Slot for a name, given its hash and its bucket's seed.
+
+DWORD
+CNameHash::Slot(
+    DWORD dwHash,                           // [in] Hash of the name
+    DWORD dwSeed,                           // [in] Seed of its bucket
+    int nSlots)                             // [in] Number of slots
 {
-    HRESULT hr;
-
-    if (m_fPostProcess) {
-        hr = this->ProcessorFlush();
-        HRCHECK(FAILED(hr));
-    }
-
-    hr = S_OK;
-  Error:
-    return hr;
+    DWORD dw = dwHash ^ (dwSeed * 0x9E3779B9);
+    dw ^= dw >> 16;
+    dw *= 0x85EBCA6B;
+    dw ^= dw >> 13;
+    return Reduce (dw, nSlots);
 }
 
-
 // ============================================================================
-// CProcessingStream::Revert
-//      Standard IStream method.
+// CNameHash::Build
+//      Returns false if there's no seed for some bucket (or no memory).
 
-STDMETHODIMP
-CProcessingStream::Revert
-(
-)
+bool
+CNameHash::Build()
 {
-    ERRORTRACE(E_NOTIMPL);
-    return E_NOTIMPL;
-}
-
+    int n = m_nElems;
+    DWORD * pdwHashes = new DWORD[n];
+    int * pnBucketOf = new int[n];
+    int * pnBucketSize = new int[n];
+    bool * pbDone = new bool[n];
+    bool bBuilt = false;
+    int i, j;
+
+    m_pdwSeeds = new DWORD[n];
+    m_pnSlots = new int[n];
+    if (!pdwHashes || !pnBucketOf || !pnBucketSize || !pbDone ||
+        !m_pdwSeeds || !m_pnSlots)
+    {
+        goto Cleanup;
+    }
 
-// ============================================================================
-// CProcessingStream::LockRegion
-//      Standard IStream method.
+    for (i = 0; i < n; i++)
+    {
+        pnBucketSize[i] = 0;
+        pbDone[i] = false;
+        m_pdwSeeds[i] = 0;
+        m_pnSlots[i] = -1;
+    }
 
-STDMETHODIMP
-CProcessingStream::LockRegion
-( 
-    ULARGE_INTEGER /* libOffset */,
-    ULARGE_INTEGER /* cb */,
-    DWORD /* dwLockType */
-)
-{
-    ERRORTRACE(E_NOTIMPL);
-    return E_NOTIMPL;
-}
+    for (i = 0; i < n; i++)
+    {
+        pdwHashes[i] = Hash (Name(i));
+        pnBucketOf[i] = Reduce (pdwHashes[i], n);
+        pnBucketSize[pnBucketOf[i]]++;
+    }
 
+    for (;;)
+    {
+        // Fullest bucket not yet placed.
+        int nBucket = -1;
+        for (i = 0; i < n; i++)
+        {
+            if (!pbDone[i] && pnBucketSize[i] > 0 &&
+                (nBucket == -1 || pnBucketSize[i] > pnBucketSize[nBucket]))
+            {
+                nBucket = i;
+            }
+        }
+        if (nBucket == -1)
+        {
+            break;
+        }
 
-// ============================================================================
-// CProcessingStream::UnlockRegion
-//      Standard IStream method.
+        DWORD dwSeed;
+        for (dwSeed = 1; dwSeed < g_dwMaxNameHashSeed; dwSeed++)
+        {
+            // Try to place the bucket's names; undo if one collides.
+            for (i = 0; i < n; i++)
+            {
+                if (pnBucketOf[i] == nBucket)
+                {
+                    DWORD dwSlot = Slot (pdwHashes[i], dwSeed, n);
+                    if (m_pnSlots[dwSlot] != -1)
+                    {
+                        break;
+                    }
+                    m_pnSlots[dwSlot] = i;
+                }
+            }
+            if (i == n)
+            {
+                break;
+            }
+            for (j = 0; j < i; j++)
+            {
+                if (pnBucketOf[j] == nBucket)
+                {
+                    m_pnSlots[Slot (pdwHashes[j], dwSeed, n)] = -1;
+                }
+            }
+        }
+        if (dwSeed == g_dwMaxNameHashSeed)
+        {
+            goto Cleanup;
+        }
 
-STDMETHODIMP
-CProcessingStream::UnlockRegion
-( 
-    ULARGE_INTEGER /* libOffset */,
-    ULARGE_INTEGER /* cb */,
-    DWORD /* dwLockType */
-)
-{
-    ERRORTRACE(E_NOTIMPL);
-    return E_NOTIMPL;
+        m_pdwSeeds[nBucket] = dwSeed;
+        pbDone[nBucket] = true;
+    }
+    bBuilt = true;
+
+Cleanup:
+    delete [] pdwHashes;
+    delete [] pnBucketOf;
+    delete [] pnBucketSize;
+    delete [] pbDone;
+    return bBuilt;
 }
 
-
 // ============================================================================
-// CProcessingStream::Stat
-//      Standard IStream method.
+// CNameHash::Lookup
+//      Returns the index of the name in the array, or -1.
 
-STDMETHODIMP
-CProcessingStream::Stat
-( 
-    STATSTG __RPC_FAR * /* pstatstg */,
-    DWORD /* grfStatFlag */
-)
+int
+CNameHash::Lookup(
+    LPCWSTR pwszName) const                 // [in] Name to look up
 {
-    ERRORTRACE(E_NOTIMPL);
-    return E_NOTIMPL;
-}
+    int i;
 
+    if (m_pdwSeeds == NULL)
+    {
+        for (i = 0; i < m_nElems; i++)
+        {
+            if (Compare (pwszName, Name(i)) == 0)
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
 
-// ============================================================================
-// CProcessingStream::Clone
-//      Standard IStream method.
+    DWORD dwHash = Hash (pwszName);
+    DWORD dwSeed = m_pdwSeeds[Reduce (dwHash, m_nElems)];
+    if (dwSeed == 0)
+    {
+        return -1;
+    }
 
-STDMETHODIMP
-CProcessingStream::Clone
-( 
-    IStream __RPC_FAR *__RPC_FAR * /* ppstm */
-)
-{
-    ERRORTRACE(E_NOTIMPL);
-    return E_NOTIMPL;
+    i = m_pnSlots[Slot (dwHash, dwSeed, m_nElems)];
+    return Compare (pwszName, Name(i)) == 0 ? i : -1;
 }
 
-
 // ============================================================================
-// CreateProcessingStream
-//      Create a new processing stream.
+// CProcessingStream::CProcessingStream
+//      Constructor.
 
-HRESULT
-CreateProcessingStream
+CProcessingStream::CProcessingStream
 (
     IStream * pOutputStream,
-    // [in] Stream to forward output to after processing
+    // [in] Pointer to stream to write output to
     asp::IResponse * pResponse,
-    // [in] Response object, used if pOutputStream is not available
-    const WCHAR * pwszStreamLanguage,
-    // [in] MIME-type of stream
+    // [in] Pointer to Response object, used when pOutputStream is not provided
+    const SMIMEToStreamType * pStreamType,
+    // [in] Processing to do, or NULL for none (see FindStreamType)
+    CProfileSet * pProfiles,
+    // [in] Set pStreamType is from, held by the stream, or NULL
     UINT uiCP,
-    // [in] Code page for encoding of stream
-    IStream ** ppProcessingStream
-    // [in] Storage for interface pointer to created processing stream
-    // [out] Interface pointer to created processing stream
+    // [in] Code page for Encoding of stream
+    const WCHAR * pwszContentEncoding,
+    // [in] "gzip" or "deflate" to compress the output, or NULL
+    ULONG cbCompressMin,
+    // [in] Output shorter than this isn't compressed
+    bool * pfEncodingHeaderSent,
+    // [in, out] Whether the Content-Encoding header has been added
+    CRequestTrace * pTrace
+    // [in] Trace to add output time and size to, or NULL
 )
 {
-    HRESULT hr;
-    CProcessingStream * pProcessingStream;
+    m_cRefs = 0;
+    m_pcomDestinationStream = pOutputStream;
+    m_pcomResponse = pResponse;
+    m_fPostProcess = false;
+    m_fFirstWrite = true;
 
-    ASSERT(NULL != pOutputStream || NULL != pResponse);
-    ASSERT(NULL != ppProcessingStream);
-    ASSERT(NULL != pwszStreamLanguage);
+    m_state = STATE_NORMAL;
+    m_nResidualUsed = 0;
+    m_hrLast = S_OK;
+    m_pwszOutputBuffer = NULL;
+    m_nOutputBufferLength = 0;
+    m_wchHeldSurrogate = 0;
 
-    pProcessingStream = new CProcessingStream(pOutputStream,
-                                              pResponse,
-                                              pwszStreamLanguage,
-                                              uiCP);
-    ERRCHECK(NULL == pProcessingStream, E_OUTOFMEMORY);
-    pProcessingStream->AddRef();
-    
-    *ppProcessingStream = pProcessingStream;
-    pProcessingStream = NULL;
+    m_pEntitiesToReplace = NULL;
+    m_nEntitiesToReplace = 0;
+    m_pCharsToReplace = NULL;
+    m_nCharsToReplace = 0;
+    m_pCharClasses = NULL;
+    m_pClosingTagsToRemove = NULL;
+    m_pClosingTagHash = NULL;
+    m_pEntityHash = NULL;
+    m_nClosingTagsToRemove = 0;
+    m_bExpandEmptyTags = false;
 
-    hr = S_OK;
-  Error:
-    SAFERELEASE(pProcessingStream);
-    return hr;
-}
+    m_pProfiles = pProfiles;
+    if (pProfiles != NULL)
+    {
+        pProfiles->AddRef();
+    }
 
+    m_uiCP = uiCP;
+    m_pSingleByte = NULL;
+    if (uiCP != CP_UTF16 && uiCP != CP_UTF16FFFE && uiCP != CP_UTF8)
+    {
+        m_pSingleByte = g_singleByteEncoders->Get(uiCP);
+    }
 
-// Callback functions to compare tag names and entity names.
+    // Compressing means adding a Content-Encoding header, which needs
+    // the Response object.
+    m_encoding = ENCODING_IDENTITY;
+    m_cbCompressMin = cbCompressMin;
+    m_pDeflater = NULL;
+    m_outputTicks = 0;
+    m_pTrace = pTrace;
+    m_pfEncodingHeaderSent = pfEncodingHeaderSent;
 
-int __fastcall CompareClosingTags(CLOSING_TAG const* pElem1,
-                    CLOSING_TAG const* pElem2);
-int __fastcall LookupClosingTags(LPCWSTR pwsz,
-                    CLOSING_TAG const* pElem);
-int __fastcall CompareEntityStructs(ENTITY_REPLACEMENT const* pElem1, 
-                    ENTITY_REPLACEMENT const* pElem2);
-int __fastcall LookupEntityStructs(LPCWSTR pwsz, 
-                    ENTITY_REPLACEMENT const* pElem);
+    // Writing to a stream costs no more than copying would.
+    m_cbWriteBuffer = (pOutputStream == NULL) ? g_cbResponseWriteBuffer : 0;
 
+    if (pwszContentEncoding != NULL && pResponse != NULL)
+    {
+        ASSERT(pfEncodingHeaderSent != NULL);
 
-// ============================================================================
-// CProcessingStream::ProcessorWrite
-//      Processes a chunk of data, and writes the results to the output
-//      stream. Call this once for each chunk of data to write.
-//
-//      NOTE: This function assumes it is being called by a trusted caller,
-//      and does not have the same parameter semantics and error handling as 
-//      IStream::Write. In particular, you cannot pass a length of 0,
-//      and passing bad parameters does not return error messages. (see
-//      further note below)
-//
-//      Because of the nature of processing, a call to this function
-//      may not fully write all the data passed in. After all data has
-//      been passed to this function, the caller should call ProcessorFlush
-//      to write any remaining data. 
-//
-//      Returns HRESULT indicating success.
+        if (0 == lstrcmpi(pwszContentEncoding, L"gzip"))
+        {
+            m_encoding = ENCODING_GZIP;
+        }
+        else if (0 == lstrcmpi(pwszContentEncoding, L"deflate"))
+        {
+            m_encoding = ENCODING_DEFLATE;
+        }
 
-HRESULT
-CProcessingStream::ProcessorWrite(
-    LPCWSTR pwszInData,                     // [in] Pointer to data
-    long nDataLength)                       // [in] Length of data, in characters
-{
-    // We'll just do ASSERTs here - if this is being called from
-    // IStream::Write, that function should handle the cases:
-    //      pszInData == NULL (error, return STG_E_INVALIDPOINTER)
-    //      nDataLength == 0 (OK, return S_OK)
+        // Once the header is out, everything has to be compressed.
+        if (*pfEncodingHeaderSent)
+        {
+            m_cbCompressMin = 0;
+        }
+    }
 
-    ASSERT (pwszInData != NULL);
-    ASSERT (nDataLength > 0);
-    ASSERT (!IsBadReadPtr (pwszInData, nDataLength));
 
-    // If there was a previous failure, we can't recover.
+    if (pStreamType != NULL)
+    {
+        m_fPostProcess = true;
+        m_pEntitiesToReplace = pStreamType->pProcessingParameters->pEntitiesToReplace;
+        m_nEntitiesToReplace = pStreamType->pProcessingParameters->nEntitiesToReplace;
+        m_pCharsToReplace = pStreamType->pProcessingParameters->pCharsToReplace;
+        m_nCharsToReplace = pStreamType->pProcessingParameters->nCharsToReplace;
+        m_pCharClasses = pStreamType->pCharClasses;
+        m_pClosingTagsToRemove = pStreamType->pProcessingParameters->pClosingTagsToRemove;
+        m_nClosingTagsToRemove = pStreamType->pProcessingParameters->nClosingTagsToRemove;
+        m_pClosingTagHash = pStreamType->pClosingTagHash;
+        m_pEntityHash = pStreamType->pEntityHash;
+        m_bExpandEmptyTags = pStreamType->pProcessingParameters->bExpandEmptyTags;
+    }
 
-    if (FAILED(m_hrLast))
+    // Text in the NORMAL state runs up to the next tag, entity or
+    // character to replace.  With more characters to replace than fit
+    // in m_abScanStops, it's scanned without SSE2.
+    m_pbScanStops = m_abScanStops + ((16 - (size_t)m_abScanStops % 16) % 16);
+    m_nScanStops = 0;
+    m_nScanStopsHigh = 0;
+    if (m_fPostProcess)
     {
-        m_hrLast = E_FAIL;
-        return m_hrLast;
+        memset (m_pbScanStops + 16 * m_nScanStops++, '<', 16);
+        memset (m_pbScanStops + 16 * m_nScanStops++, '&', 16);
+        for (int i = 0; i < m_nCharsToReplace; i++)
+        {
+            WCHAR c = m_pCharsToReplace[i].cMatch;
+            int j;
+
+            if (c < 0xFF)
+            {
+                for (j = 0; j < m_nScanStops && m_pbScanStops[16 * j] != c; j++)
+                {
+                }
+                if (j < m_nScanStops)
+                {
+                    continue;               // Replaced more than once
+                }
+                if (m_nScanStops == g_nMaxScanStops)
+                {
+                    m_nScanStops = -1;
+                    break;
+                }
+                memset (m_pbScanStops + 16 * m_nScanStops++, c, 16);
+            }
+            else
+            {
+                for (j = 0; j < m_nScanStopsHigh && m_awchScanStopsHigh[j] != c; j++)
+                {
+                }
+                if (j < m_nScanStopsHigh)
+                {
+                    continue;
+                }
+                if (m_nScanStopsHigh == g_nMaxScanStops)
+                {
+                    m_nScanStops = -1;
+                    break;
+                }
+                m_awchScanStopsHigh[m_nScanStopsHigh++] = c;
+            }
+        }
     }
 
-    // BUFFER MANAGEMENT NOTE
-    //
-    // The postprocessor can be called with buffers of arbitrary length.
-    // From this, it needs to output data in reasonably sized buffers.
-    // In order to accomplish this, without allocating any additional
-    // memory, the postprocessor uses a variable-length buffer, allocated
-    // on the stack. 
-    //
-    // There is a limit on the size of the output buffer. To handle input
-    // buffers that are bigger than the output buffer, this function
-    // breaks the input buffer into suitable "chunks", and calls 
-    // ProcessorWriteChunk to handle each chunk. 
-    //
-    // To write to the buffer without a lot of checking, some simple
-    // heuristics are followed. At any time, the output buffer contains
-    // at least enough room to allow all remaining characters in the 
-    // input chunk to be copied unmodified. This allows simple character
-    // copies to be done without checking for buffer overflow. Whenever
-    // a more complex write or substitution is required, the more complex
-    // WriteToOutputBuffer function is used, which preserves the 
-    // above condition, flushing the buffer if necessary.
-    //
-    // Whenever the input goes into a tag or entity, the input is copied
-    // instead to a residual buffer. After the entire tag name or entity
-    // has been read in, we can write or discard the contents of the
-    // residual buffer. The state of the residual buffer is preserved
-    // across calls to ProcessorWrite, allowing tags and entities to
-    // span multiple buffers. Whenever the residual buffer is filled up,
-    // the code flushes the buffer, and effectively skips special
-    // processing for the tag or entity.
+    // With many stops, runs of text are mostly skipped by checking that
+    // each character is in a range without any, those around the
+    // commonest characters of text.
+    m_nScanRanges = 0;
+    if (m_nScanStops > g_nScanStopsUnranged)
+    {
+        static const BYTE s_abCommon[g_nMaxScanRanges] = { ' ', 'e', 'E', '0' };
+        bool abStop[256];
+        int i;
 
-    long nInputBufferChunk;
-    if (nDataLength < g_nMaxInputBufferChunk)
-        nInputBufferChunk = nDataLength;
-    else
-        nInputBufferChunk = g_nMaxInputBufferChunk;
+        memset (abStop, 0, sizeof (abStop));
+        abStop[0xFF] = true;                // And all above
+        for (i = 0; i < m_nScanStops; i++)
+        {
+            abStop[m_pbScanStops[16 * i]] = true;
+        }
 
-    m_nOutputBufferLength = nInputBufferChunk + 
-                                nInputBufferChunk / 2 +
-                                g_nMaxResidualLength +
-                                g_nOutputBufferPadding;
+        for (i = 0; i < g_nMaxScanRanges; i++)
+        {
+            int first = s_abCommon[i];
+            int last = s_abCommon[i];
+            int j;
 
-    // Allocate output buffer on stack.
+            if (abStop[first])
+            {
+                continue;
+            }
+            while (first > 0 && !abStop[first - 1])
+            {
+                first--;
+            }
+            while (!abStop[last + 1])
+            {
+                last++;
+            }
+            for (j = 0; j < m_nScanRanges &&
+                        m_pbScanStops[16 * (g_nMaxScanStops + 2 * j)] != first; j++)
+            {
+            }
+            if (j < m_nScanRanges)
+            {
+                continue;                   // Around two of them
+            }
+            memset (m_pbScanStops + 16 * (g_nMaxScanStops + 2 * m_nScanRanges), first, 16);
+            memset (m_pbScanStops + 16 * (g_nMaxScanStops + 2 * m_nScanRanges + 1),
+                    last - first, 16);
+            m_nScanRanges++;
+        }
+    }
 
-    m_pwszOutputBuffer = (LPWSTR)_alloca (m_nOutputBufferLength * sizeof(WCHAR));
-    ASSERT (m_pwszOutputBuffer != NULL);
+   #ifdef SCAN_SSE2
+    m_bScanSSE2 = IsProcessorFeaturePresent (PF_XMMI64_INSTRUCTIONS_AVAILABLE) != FALSE;
+   #else
+    m_bScanSSE2 = false;
+   #endif
 
-    // Go through each chunk.
+    // If this assert fails, the profile's tables are wrong.
+    ASSERT (pStreamType == NULL || VerifyProcessingParameters (pStreamType));
+};
 
-    HRESULT hr = S_OK;
-    for (long nChunk = (nDataLength + nInputBufferChunk - 1) / nInputBufferChunk; 
-         nChunk > 0 && hr == S_OK; 
-         nChunk--)
+// ============================================================================
+// CProcessingStream::~CProcessingStream
+//      Destructor.
+
+CProcessingStream::~CProcessingStream
+(
+)
+{
+    // If you are getting this assert, you should make sure you
+    // flush the processor before this point.
+    ASSERT (FAILED (m_hrLast) || m_nResidualUsed == 0);
+
+    delete m_pDeflater;
+
+    if (m_pProfiles != NULL)
     {
-        hr = ProcessorWriteChunk (pwszInData,
-                    (nChunk == 1) ? nDataLength : nInputBufferChunk);
-        pwszInData += nInputBufferChunk;
-        nDataLength -= nInputBufferChunk;
+        m_pProfiles->Release();
     }
-
-    m_hrLast = hr;
-    return hr;
 }
 
+
 // ============================================================================
-// CProcessingStream::ProcessorFlush
-//      Writes any pending data to the output stream. Call this once after
-//      passing all data to the document, but before calling Uninitialize.
-//
-//      NOTE: Calling this function causes the postprocessor to lose state,
-//      so any subsequent calls to ProcessorWrite will have unpredictable
-//      results.
-//
-//      Returns HRESULT indicating success.
+// CProcessingStream::QueryInterface
+//      Standard IUnknown method.
 
-HRESULT
-CProcessingStream::ProcessorFlush()
+STDMETHODIMP
+CProcessingStream::QueryInterface
+(
+    REFIID riid,
+    LPVOID FAR* ppvObj
+)
 {
-    if (FAILED (m_hrLast))
+    HRESULT hr;
+
+    ERRCHECK(NULL == ppvObj, E_POINTER);
+
+    if(InlineIsEqualUnknown(riid))
     {
-        // If there was a previous failure, we can't recover.
-        m_hrLast = E_FAIL;
+        *ppvObj = static_cast<IUnknown *>(this);
     }
-    else if (m_nResidualUsed > 0)
+    else if(InlineIsEqualGUID(riid, IID_ISequentialStream))
     {
-        m_hrLast = WriteToDestinationStream (m_wszResidualBuffer, 
-                        m_nResidualUsed * sizeof(WCHAR), NULL);
-        m_nResidualUsed = 0;
+        *ppvObj = static_cast<ISequentialStream *>(this);
     }
-    return m_hrLast;
+    else if(InlineIsEqualGUID(riid, IID_IStream))
+    {
+        *ppvObj = static_cast<IStream *>(this);
+    }
+    else
+    {
+        RETURNERR(E_NOINTERFACE);
+    }
+
+    this->AddRef();
+
+    hr = S_OK;
+Error:
+    return hr;
 }
 
+
 // ============================================================================
-// CProcessingStream::ProcessorWriteChunk
-//      Internal function that processes and writes data in chunks. For
-//      an explanation of chunks, see ProcessorWrite above.  
-//
-//      Returns HRESULT indicating success.
+// CProcessingStream::AddRef
+//      Standard IUnknown method.
 
-HRESULT 
-CProcessingStream::ProcessorWriteChunk(
-    LPCWSTR pwszChunk,                      // [in] Pointer to chunk
-    long nChunkLength)                      // [in] Length of chunk, in characters
+STDMETHODIMP_(ULONG)
+CProcessingStream::AddRef
+(
+)
 {
-    ASSERT (m_hrLast == S_OK);
-    ASSERT (pwszChunk != NULL);
-    ASSERT (nChunkLength < m_nOutputBufferLength);
+    return InterlockedIncrement(&m_cRefs);
+}
 
-    // Initialize the output buffer, so that it is empty.
-    LPWSTR pwszBuffer = m_pwszOutputBuffer;
-    long nOutputBufferUsed = 0;
 
-    HRESULT hr = S_OK;
+// ============================================================================
+// CProcessingStream::Release
+//      Standard IUnknown method.  A transform job that's given up on can
+//      release the stream on its worker thread while the request does.
 
-    PROCESSORSTATE state = m_state;
-    while (hr == S_OK && nChunkLength > 0)
-    {
-        WCHAR c = *pwszChunk;
+STDMETHODIMP_(ULONG)
+CProcessingStream::Release
+(
+)
+{
+    ULONG ulReturn;
+
+    ASSERT(0 < m_cRefs);
+
+    ulReturn = InterlockedDecrement(&m_cRefs);
+    if(0 == ulReturn)
+    {
+        delete this;
+    }
+    return ulReturn;
+}
+
+
+// ============================================================================
+// CProcessingStream::Read
+//      Standard ISequentialStream method.
+
+STDMETHODIMP
+CProcessingStream::Read
+( 
+    void __RPC_FAR * /* pv */,
+    ULONG /* cb */,
+    ULONG __RPC_FAR * /* pcbRead */
+)
+{
+    ERRORTRACE(E_NOTIMPL);
+    return E_NOTIMPL;
+}
+
+
+// ============================================================================
+// CProcessingStream::Write
+//      Standard ISequentialStream method.
+
+STDMETHODIMP
+CProcessingStream::Write
+( 
+    const void __RPC_FAR *pv,
+    ULONG cb,
+    ULONG __RPC_FAR *pcbWritten
+)
+{
+    HRESULT hr;
+    const WCHAR chBOM = L'\xFEFF'; // Byte-order mark
+    CPhaseTimer timer(m_pTrace);
+
+    timer.Start();
+
+    ERRCHECK(NULL == pv, STG_E_INVALIDPOINTER);
+
+    if(m_fFirstWrite)
+    {
+        // We expect this to be the byte-order mark (BOM)
+        ERRCHECK(cb != sizeof(WCHAR) ||
+                 *reinterpret_cast<const WCHAR *>(pv) != chBOM,
+                 STG_E_CANTSAVE);
+
+        // Add necessary BOM according to code page setting
+        if (m_uiCP == CP_UTF16 || m_uiCP == CP_UTF16FFFE) {
+            const BYTE bom[2] = { 0xFF, 0xFE };
+            const BYTE bomBig[2] = { 0xFE, 0xFF };  // Big-Endian
+            ULONG cbWritten;
+
+            hr = WriteToDestinationObject((m_uiCP == CP_UTF16)?bom:bomBig,
+                                          2, &cbWritten);
+            HRCHECK(FAILED(hr));
+        }
+
+        m_fFirstWrite = false;
+    }
+    else if(m_fPostProcess && cb > 0)
+    {
+        hr = this->ProcessorWrite(static_cast<LPCWSTR>(pv), (long)(cb / sizeof(WCHAR)));
+        HRCHECK(FAILED(hr));
+    }
+    else if(cb > 0)
+    {
+        // Just pass right on through... no post processing needed.
+        hr = WriteToDestinationStream(pv, cb, NULL);
+        HRCHECK(FAILED(hr));
+            
+    }
+
+    if (pcbWritten != NULL)
+    {
+        *pcbWritten = cb;
+    }
+
+    hr = S_OK;
+  Error:
+    m_outputTicks += timer.Elapsed();
+    return hr;
+}
+
+
+// ============================================================================
+// CProcessingStream::Seek
+//      Standard IStream method.
+
+STDMETHODIMP
+CProcessingStream::Seek
+( 
+    LARGE_INTEGER /* dlibMove */,
+    DWORD /* dwOrigin */,
+    ULARGE_INTEGER __RPC_FAR * /* plibNewPosition */
+)
+{
+    ERRORTRACE(E_NOTIMPL);
+    return E_NOTIMPL;
+}
+
+
+// ============================================================================
+// CProcessingStream::SetSize
+//      Standard IStream method.
+
+STDMETHODIMP
+CProcessingStream::SetSize
+( 
+    ULARGE_INTEGER /* libNewSize */
+)
+{
+    ERRORTRACE(E_NOTIMPL);
+    return E_NOTIMPL;
+}
+
+
+// ============================================================================
+// CProcessingStream::CopyTo
+//      Standard IStream method.
+
+STDMETHODIMP
+CProcessingStream::CopyTo
+( 
+    IStream __RPC_FAR * /* pstm */,
+    ULARGE_INTEGER /* cb */,
+    ULARGE_INTEGER __RPC_FAR * /* pcbRead */,
+    ULARGE_INTEGER __RPC_FAR * /* pcbWritten */
+)
+{
+    ERRORTRACE(E_NOTIMPL);
+    return E_NOTIMPL;
+}
+
+
+// ============================================================================
+// CProcessingStream::Commit
+//      Standard IStream method.
+
+STDMETHODIMP
+CProcessingStream::Commit
+( 
+    DWORD /* grfCommitFlags */
+)
+{
+    HRESULT hr;
+    CPhaseTimer timer(m_pTrace);
+
+    timer.Start();
+
+    if (m_fPostProcess) {
+        hr = this->ProcessorFlush();
+        HRCHECK(FAILED(hr));
+    }
+
+    // A high surrogate the text ended with goes out on its own.
+    if (m_wchHeldSurrogate != 0) {
+        ULONG cbWritten = 0;
+        WCHAR wch = m_wchHeldSurrogate;
+
+        m_wchHeldSurrogate = 0;
+        hr = WriteEncoded(&wch, 1, &cbWritten);
+        HRCHECK(FAILED(hr));
+    }
+
+    hr = FinishContentEncoding();
+    HRCHECK(FAILED(hr));
+
+    if (m_writeBuffer.GetSize() > 0) {
+        hr = WriteResponseNow(m_writeBuffer.GetData(), m_writeBuffer.GetSize());
+        HRCHECK(FAILED(hr));
+
+        m_writeBuffer.Free();
+    }
+
+    // All of the output has been through here now.
+    m_outputTicks += timer.Elapsed();
+    if (g_phaseStats->IsEnabled()) {
+        g_phaseStats->Record(PHASE_OUTPUT, m_outputTicks);
+    }
+    if (m_pTrace != NULL) {
+        m_pTrace->AddPhase(PHASE_OUTPUT, m_outputTicks);
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+
+// ============================================================================
+// CProcessingStream::Revert
+//      Standard IStream method.
+
+STDMETHODIMP
+CProcessingStream::Revert
+(
+)
+{
+    ERRORTRACE(E_NOTIMPL);
+    return E_NOTIMPL;
+}
+
+
+// ============================================================================
+// CProcessingStream::LockRegion
+//      Standard IStream method.
+
+STDMETHODIMP
+CProcessingStream::LockRegion
+( 
+    ULARGE_INTEGER /* libOffset */,
+    ULARGE_INTEGER /* cb */,
+    DWORD /* dwLockType */
+)
+{
+    ERRORTRACE(E_NOTIMPL);
+    return E_NOTIMPL;
+}
+
+
+// ============================================================================
+// CProcessingStream::UnlockRegion
+//      Standard IStream method.
+
+STDMETHODIMP
+CProcessingStream::UnlockRegion
+( 
+    ULARGE_INTEGER /* libOffset */,
+    ULARGE_INTEGER /* cb */,
+    DWORD /* dwLockType */
+)
+{
+    ERRORTRACE(E_NOTIMPL);
+    return E_NOTIMPL;
+}
+
+
+// ============================================================================
+// CProcessingStream::Stat
+//      Standard IStream method.
+
+STDMETHODIMP
+CProcessingStream::Stat
+( 
+    STATSTG __RPC_FAR * /* pstatstg */,
+    DWORD /* grfStatFlag */
+)
+{
+    ERRORTRACE(E_NOTIMPL);
+    return E_NOTIMPL;
+}
+
+
+// ============================================================================
+// CProcessingStream::Clone
+//      Standard IStream method.
+
+STDMETHODIMP
+CProcessingStream::Clone
+( 
+    IStream __RPC_FAR *__RPC_FAR * /* ppstm */
+)
+{
+    ERRORTRACE(E_NOTIMPL);
+    return E_NOTIMPL;
+}
+
+
+// ============================================================================
+// CProcessingStream::FindStreamType
+//      Returns the processing to do for a MIME type, or NULL if it's
+//      passed through as it is.
+
+const CProcessingStream::SMIMEToStreamType *
+CProcessingStream::FindStreamType(
+    const WCHAR * pwszMIMEType)             // [in] MIME-type of stream
+{
+    for (UINT iWhichMapEntry = 0; iWhichMapEntry < g_cMIMEToStreamTypeMap; ++iWhichMapEntry)
+    {
+        if (0 == lstrcmp(pwszMIMEType, g_aMIMEToStreamTypeMap[iWhichMapEntry].pwszMIMEType))
+        {
+            return &g_aMIMEToStreamTypeMap[iWhichMapEntry];
+        }
+    }
+    return NULL;
+}
+
+// ============================================================================
+// CreateProcessingStream
+//      Create a new processing stream, with the postprocessor compiled
+//      for the MIME type's profile: the one masterConfig.xml has for it,
+//      if it has one, else the built-in one.
+
+HRESULT
+CreateProcessingStream
+(
+    IStream * pOutputStream,
+    // [in] Stream to forward output to after processing
+    asp::IResponse * pResponse,
+    // [in] Response object, used if pOutputStream is not available
+    const WCHAR * pwszStreamLanguage,
+    // [in] MIME-type of stream
+    const WCHAR * pwszProfilesConfig,
+    // [in] masterConfig.xml whose profiles apply, as Configure keeps
+    // them, or NULL for the built-in ones only
+    UINT uiCP,
+    // [in] Code page for encoding of stream
+    const WCHAR * pwszContentEncoding,
+    // [in] "gzip" or "deflate" to compress the output, or NULL
+    ULONG cbCompressMin,
+    // [in] Output shorter than this isn't compressed
+    bool * pfEncodingHeaderSent,
+    // [in, out] Whether the Content-Encoding header has been added
+    CRequestTrace * pTrace,
+    // [in] Trace to add output time and size to, or NULL
+    IStream ** ppProcessingStream
+    // [in] Storage for interface pointer to created processing stream
+    // [out] Interface pointer to created processing stream
+)
+{
+    HRESULT hr;
+    CProcessingStream * pProcessingStream = NULL;
+    const CProcessingStream::SMIMEToStreamType * pStreamType = NULL;
+    CProfileSet * pProfiles;
+
+    ASSERT(NULL != pOutputStream || NULL != pResponse);
+    ASSERT(NULL != ppProcessingStream);
+    ASSERT(NULL != pwszStreamLanguage);
+
+    // Profiles from masterConfig.xml come first.
+    pProfiles = g_processingProfiles->Acquire(pwszProfilesConfig);
+    if (pProfiles != NULL)
+    {
+        pStreamType = pProfiles->FindStreamType(pwszStreamLanguage);
+        if (pStreamType == NULL)
+        {
+            pProfiles->Release();
+            pProfiles = NULL;
+        }
+    }
+    if (pStreamType == NULL)
+    {
+        pStreamType = CProcessingStream::FindStreamType(pwszStreamLanguage);
+    }
+
+    if (pStreamType != NULL &&
+        pStreamType->pProcessingParameters == &g_HDMLProcessingParameters)
+    {
+        pProcessingStream = new CProfileProcessingStream<CHDMLProfile>(
+                                    pOutputStream,
+                                    pResponse,
+                                    pStreamType,
+                                    pProfiles,
+                                    uiCP,
+                                    pwszContentEncoding,
+                                    cbCompressMin,
+                                    pfEncodingHeaderSent,
+                                    pTrace);
+    }
+    else if (pStreamType != NULL &&
+             pStreamType->pProcessingParameters == &g_WMLProcessingParameters)
+    {
+        pProcessingStream = new CProfileProcessingStream<CWMLProfile>(
+                                    pOutputStream,
+                                    pResponse,
+                                    pStreamType,
+                                    pProfiles,
+                                    uiCP,
+                                    pwszContentEncoding,
+                                    cbCompressMin,
+                                    pfEncodingHeaderSent,
+                                    pTrace);
+    }
+    else
+    {
+        pProcessingStream = new CProfileProcessingStream<CGenericProfile>(
+                                    pOutputStream,
+                                    pResponse,
+                                    pStreamType,
+                                    pProfiles,
+                                    uiCP,
+                                    pwszContentEncoding,
+                                    cbCompressMin,
+                                    pfEncodingHeaderSent,
+                                    pTrace);
+    }
+    ERRCHECK(NULL == pProcessingStream, E_OUTOFMEMORY);
+    pProcessingStream->AddRef();
+    
+    *ppProcessingStream = pProcessingStream;
+    pProcessingStream = NULL;
+
+    hr = S_OK;
+  Error:
+    SAFERELEASE(pProcessingStream);
+    if (pProfiles != NULL)
+    {
+        pProfiles->Release();
+    }
+    return hr;
+}
+
+// ============================================================================
+// GetProfileString
+//      Reads an attribute of an element of a profile, as a BSTR for the
+//      profile's tables.  A missing attribute is an empty string.  If the
+//      value isn't between cchMin and cchMax characters long, fails with
+//      pwszError.
+
+static HRESULT
+GetProfileString(
+    IXMLDOMNode * pNode,                    // [in] Element
+    LPCWSTR pwszXPath,                      // [in] Attribute
+    int cchMin,                             // [in] Shortest value allowed
+    int cchMax,                             // [in] Longest value allowed
+    LPCWSTR pwszError,                      // [in] Error if it's neither
+    BSTR * pbstrValue,                      // [out] Value
+    CComBSTR & bstrError)                   // [out] pwszError, if it fails
+{
+    HRESULT hr;
+    CComBSTR bstrValue;
+
+    *pbstrValue = NULL;
+
+    hr = GetSingleNodeValue(pNode, pwszXPath, &bstrValue);
+    HRCHECK(FAILED(hr));
+
+    if ((int)bstrValue.Length() < cchMin || (int)bstrValue.Length() > cchMax)
+    {
+        bstrError = pwszError;
+        RETURNERR(E_INVALIDARG);
+    }
+
+    if (bstrValue.m_str == NULL)
+    {
+        bstrValue = L"";
+        ERRCHECK(bstrValue.m_str == NULL, E_OUTOFMEMORY);
+    }
+
+    *pbstrValue = bstrValue.Detach();
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CLoadedProfile::CLoadedProfile
+//      Constructor.
+
+CLoadedProfile::CLoadedProfile()
+{
+    m_pNext = NULL;
+    m_pClosingTags = NULL;
+    m_pEntities = NULL;
+    m_pChars = NULL;
+    m_pCharClasses = NULL;
+    m_pClosingTagHash = NULL;
+    m_pEntityHash = NULL;
+
+    ZeroMemory (&m_parameters, sizeof(m_parameters));
+    ZeroMemory (&m_streamType, sizeof(m_streamType));
+}
+
+CLoadedProfile::~CLoadedProfile()
+{
+    int i;
+
+    delete m_pCharClasses;
+    delete m_pClosingTagHash;
+    delete m_pEntityHash;
+
+    for (i = 0; i < m_parameters.nClosingTagsToRemove; i++)
+    {
+        SysFreeString (const_cast<BSTR> (m_pClosingTags[i]));
+    }
+    for (i = 0; i < m_parameters.nEntitiesToReplace; i++)
+    {
+        SysFreeString (const_cast<BSTR> (m_pEntities[i].pwszName));
+        SysFreeString (const_cast<BSTR> (m_pEntities[i].pwszReplace));
+    }
+    for (i = 0; i < m_parameters.nCharsToReplace; i++)
+    {
+        SysFreeString (const_cast<BSTR> (m_pChars[i].pwszReplace));
+    }
+
+    delete [] m_pClosingTags;
+    delete [] m_pEntities;
+    delete [] m_pChars;
+}
+
+// ============================================================================
+// CLoadedProfile::Load
+//      Reads a <profile> element, and builds the tables for it.
+//
+//      Returns HRESULT indicating success; if the profile can't be used,
+//      E_INVALIDARG, with the reason in bstrError.
+
+HRESULT
+CLoadedProfile::Load(
+    IXMLDOMNode * pProfileNode,             // [in] <profile> element
+    CComBSTR & bstrError)                   // [out] Why it can't be used
+{
+    HRESULT hr;
+    CComBSTR bstrValue;
+
+    hr = GetSingleNodeValue(pProfileNode, L"@mime-type", &m_bstrMIMEType);
+    HRCHECK(FAILED(hr));
+
+    if (m_bstrMIMEType.Length() == 0)
+    {
+        bstrError = L"Post-processing profile without a mime-type attribute";
+        RETURNERR(E_INVALIDARG);
+    }
+
+    hr = GetSingleNodeValue(pProfileNode, L"@expand-empty-tags", &bstrValue);
+    HRCHECK(FAILED(hr));
+
+    m_parameters.bExpandEmptyTags =
+        (bstrValue.m_str != NULL && lstrcmpiW(bstrValue, L"on") == 0);
+
+    hr = LoadClosingTags(pProfileNode, bstrError);
+    HRCHECK(FAILED(hr));
+
+    hr = LoadEntities(pProfileNode, bstrError);
+    HRCHECK(FAILED(hr));
+
+    hr = LoadCharacters(pProfileNode, bstrError);
+    HRCHECK(FAILED(hr));
+
+    // Sorted the way the built-in ones are, so that they can be checked
+    // the same way (see VerifyProcessingParameters).
+    SortArray (m_pClosingTags, m_parameters.nClosingTagsToRemove,
+               CompareClosingTags);
+    SortArray (m_pEntities, m_parameters.nEntitiesToReplace,
+               CompareEntityStructs);
+
+    m_parameters.pClosingTagsToRemove = m_pClosingTags;
+    m_parameters.pEntitiesToReplace = m_pEntities;
+    m_parameters.pCharsToReplace = m_pChars;
+
+    m_pCharClasses = new CCharClassTable(m_pChars, m_parameters.nCharsToReplace);
+    ERRCHECK(m_pCharClasses == NULL, E_OUTOFMEMORY);
+
+    m_pClosingTagHash = new CNameHash(m_pClosingTags,
+                                      m_parameters.nClosingTagsToRemove,
+                                      sizeof(CLOSING_TAG), true);
+    ERRCHECK(m_pClosingTagHash == NULL, E_OUTOFMEMORY);
+
+    m_pEntityHash = new CNameHash(m_pEntities,
+                                  m_parameters.nEntitiesToReplace,
+                                  sizeof(ENTITY_REPLACEMENT), false);
+    ERRCHECK(m_pEntityHash == NULL, E_OUTOFMEMORY);
+
+    m_streamType.pwszMIMEType = m_bstrMIMEType;
+    m_streamType.pProcessingParameters = &m_parameters;
+    m_streamType.pCharClasses = m_pCharClasses;
+    m_streamType.pClosingTagHash = m_pClosingTagHash;
+    m_streamType.pEntityHash = m_pEntityHash;
+
+    if (!CProcessingStream::VerifyProcessingParameters (&m_streamType))
+    {
+        bstrError = L"Post-processing profile tables could not be built";
+        RETURNERR(E_INVALIDARG);
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CLoadedProfile::LoadClosingTags
+//      Reads the <closing-tag name="..."/> elements of the profile.  Two
+//      names that differ only in case are the same tag.
+
+HRESULT
+CLoadedProfile::LoadClosingTags(
+    IXMLDOMNode * pProfileNode,             // [in] <profile> element
+    CComBSTR & bstrError)                   // [out] Why it can't be used
+{
+    HRESULT hr;
+    CComPtr<IXMLDOMNodeList> pcomNodes;
+    CComPtr<IXMLDOMNode> pcomNode;
+    long nNodes;
+    BSTR bstrName;
+    int i;
+
+    hr = pProfileNode->selectNodes(L"closing-tag", &pcomNodes);
+    HRCHECK(FAILED(hr));
+
+    hr = pcomNodes->get_length(&nNodes);
+    HRCHECK(FAILED(hr));
+
+    if (nNodes == 0)
+    {
+        RETURNERR(S_OK);
+    }
+
+    m_pClosingTags = new CLOSING_TAG[nNodes];
+    ERRCHECK(m_pClosingTags == NULL, E_OUTOFMEMORY);
+
+    for (;;)
+    {
+        pcomNode.Release();
+        hr = pcomNodes->nextNode(&pcomNode);
+        HRCHECK(FAILED(hr));
+
+        if (pcomNode.p == NULL ||
+            m_parameters.nClosingTagsToRemove == nNodes)
+        {
+            break;
+        }
+
+        hr = GetProfileString(pcomNode, L"@name",
+                              1, g_nMaxResidualLength - 3,
+                              L"Post-processing closing-tag name missing or too long",
+                              &bstrName, bstrError);
+        HRCHECK(FAILED(hr));
+
+        m_pClosingTags[m_parameters.nClosingTagsToRemove++] = bstrName;
+
+        for (i = 0; i < m_parameters.nClosingTagsToRemove - 1; i++)
+        {
+            if (CompareNamesIgnoreCase (m_pClosingTags[i], bstrName) == 0)
+            {
+                bstrError = L"Post-processing closing-tag given twice";
+                RETURNERR(E_INVALIDARG);
+            }
+        }
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CLoadedProfile::LoadEntities
+//      Reads the <entity name="..." replace="..."/> elements of the
+//      profile.
+
+HRESULT
+CLoadedProfile::LoadEntities(
+    IXMLDOMNode * pProfileNode,             // [in] <profile> element
+    CComBSTR & bstrError)                   // [out] Why it can't be used
+{
+    HRESULT hr;
+    CComPtr<IXMLDOMNodeList> pcomNodes;
+    CComPtr<IXMLDOMNode> pcomNode;
+    long nNodes;
+    ENTITY_REPLACEMENT * pEntity;
+    int i;
+
+    hr = pProfileNode->selectNodes(L"entity", &pcomNodes);
+    HRCHECK(FAILED(hr));
+
+    hr = pcomNodes->get_length(&nNodes);
+    HRCHECK(FAILED(hr));
+
+    if (nNodes == 0)
+    {
+        RETURNERR(S_OK);
+    }
+
+    m_pEntities = new ENTITY_REPLACEMENT[nNodes];
+    ERRCHECK(m_pEntities == NULL, E_OUTOFMEMORY);
+
+    for (;;)
+    {
+        pcomNode.Release();
+        hr = pcomNodes->nextNode(&pcomNode);
+        HRCHECK(FAILED(hr));
+
+        if (pcomNode.p == NULL ||
+            m_parameters.nEntitiesToReplace == nNodes)
+        {
+            break;
+        }
+
+        // Counted once both strings are there to free.
+        pEntity = &m_pEntities[m_parameters.nEntitiesToReplace];
+        pEntity->pwszName = NULL;
+        pEntity->pwszReplace = NULL;
+
+        hr = GetProfileString(pcomNode, L"@name",
+                              1, g_nMaxResidualLength - 2,
+                              L"Post-processing entity name missing or too long",
+                              const_cast<BSTR *> (&pEntity->pwszName), bstrError);
+        HRCHECK(FAILED(hr));
+
+        hr = GetProfileString(pcomNode, L"@replace",
+                              0, INT_MAX, NULL,
+                              const_cast<BSTR *> (&pEntity->pwszReplace), bstrError);
+        if (FAILED(hr))
+        {
+            SysFreeString (const_cast<BSTR> (pEntity->pwszName));
+            RETURNERR(hr);
+        }
+
+        m_parameters.nEntitiesToReplace++;
+
+        for (i = 0; i < m_parameters.nEntitiesToReplace - 1; i++)
+        {
+            if (lstrcmp (m_pEntities[i].pwszName, pEntity->pwszName) == 0)
+            {
+                bstrError = L"Post-processing entity given twice";
+                RETURNERR(E_INVALIDARG);
+            }
+        }
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CLoadedProfile::LoadCharacters
+//      Reads the <character match="..." replace="..."/> elements of the
+//      profile.  The character can't be < or &, which start the tags and
+//      entities the postprocessor looks for, or half a surrogate pair.
+
+HRESULT
+CLoadedProfile::LoadCharacters(
+    IXMLDOMNode * pProfileNode,             // [in] <profile> element
+    CComBSTR & bstrError)                   // [out] Why it can't be used
+{
+    HRESULT hr;
+    CComPtr<IXMLDOMNodeList> pcomNodes;
+    CComPtr<IXMLDOMNode> pcomNode;
+    long nNodes;
+    CComBSTR bstrMatch;
+    WCHAR c;
+
+    hr = pProfileNode->selectNodes(L"character", &pcomNodes);
+    HRCHECK(FAILED(hr));
+
+    hr = pcomNodes->get_length(&nNodes);
+    HRCHECK(FAILED(hr));
+
+    if (nNodes == 0)
+    {
+        RETURNERR(S_OK);
+    }
+
+    if (nNodes > 256 - CCharClassTable::CHARCLASS_REPLACE)
+    {
+        bstrError = L"Too many post-processing characters in a profile";
+        RETURNERR(E_INVALIDARG);
+    }
+
+    m_pChars = new CHARACTER_REPLACEMENT[nNodes];
+    ERRCHECK(m_pChars == NULL, E_OUTOFMEMORY);
+
+    for (;;)
+    {
+        pcomNode.Release();
+        hr = pcomNodes->nextNode(&pcomNode);
+        HRCHECK(FAILED(hr));
+
+        if (pcomNode.p == NULL ||
+            m_parameters.nCharsToReplace == nNodes)
+        {
+            break;
+        }
+
+        bstrMatch.Empty();
+        hr = GetSingleNodeValue(pcomNode, L"@match", &bstrMatch);
+        HRCHECK(FAILED(hr));
+
+        c = (bstrMatch.Length() == 1) ? bstrMatch.m_str[0] : 0;
+        if (c == 0 || c == L'<' || c == L'&' || (c >= 0xD800 && c < 0xE000))
+        {
+            bstrError = L"Post-processing character match must be one character other than < and &";
+            RETURNERR(E_INVALIDARG);
+        }
+
+        m_pChars[m_parameters.nCharsToReplace].cMatch = c;
+
+        hr = GetProfileString(pcomNode, L"@replace",
+                              0, INT_MAX, NULL,
+                              const_cast<BSTR *> (&m_pChars[m_parameters.nCharsToReplace].pwszReplace),
+                              bstrError);
+        HRCHECK(FAILED(hr));
+
+        m_parameters.nCharsToReplace++;
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CProfileSet::~CProfileSet
+
+CProfileSet::~CProfileSet()
+{
+    CLoadedProfile * pProfile;
+
+    while (m_pProfiles != NULL)
+    {
+        pProfile = m_pProfiles;
+        m_pProfiles = pProfile->m_pNext;
+        delete pProfile;
+    }
+}
+
+// ============================================================================
+// CProfileSet::FindStreamType
+//      Returns the profile for the MIME type, or NULL if there's none.
+
+const CProcessingStream::SMIMEToStreamType *
+CProfileSet::FindStreamType(
+    const WCHAR * pwszMIMEType) const       // [in] MIME-type of stream
+{
+    CLoadedProfile * pProfile;
+
+    for (pProfile = m_pProfiles; pProfile != NULL; pProfile = pProfile->m_pNext)
+    {
+        if (0 == lstrcmp(pwszMIMEType, pProfile->GetStreamType()->pwszMIMEType))
+        {
+            return pProfile->GetStreamType();
+        }
+    }
+    return NULL;
+}
+
+// ============================================================================
+// CProcessingProfiles::CProcessingProfiles
+
+CProcessingProfiles::CProcessingProfiles()
+{
+    m_pConfigs = NULL;
+    InitializeCriticalSection(&m_cs);
+}
+
+CProcessingProfiles::~CProcessingProfiles()
+{
+    Config *pConfig;
+
+    while (m_pConfigs != NULL) {
+        pConfig = m_pConfigs;
+        m_pConfigs = pConfig->pNext;
+        if (pConfig->pProfiles) {
+            pConfig->pProfiles->Release();
+        }
+        delete pConfig;
+    }
+    DeleteCriticalSection(&m_cs);
+}
+
+// ============================================================================
+// CProcessingProfiles::FindConfig
+//      Returns the profiles kept for the file, or NULL if it hasn't been
+//      configured.  Paths are compared without case, as the file system
+//      does.  Must be called with the object locked.
+
+CProcessingProfiles::Config *
+CProcessingProfiles::FindConfig(
+    const wchar_t *pwszPath)                // [in] file, or URL
+{
+    Config *pConfig;
+
+    for (pConfig = m_pConfigs; pConfig != NULL; pConfig = pConfig->pNext) {
+        if (lstrcmpi(pConfig->bstrPath, pwszPath) == 0) {
+            break;
+        }
+    }
+    return pConfig;
+}
+
+// ============================================================================
+// CProcessingProfiles::Configure
+//      Called with masterConfig.xml for every request, so the profiles
+//      are only compiled when its version changes.  Its version isn't
+//      known when the XML cache is off; then it's that of the file at
+//      pwszMappedPath, and if that can't be had either, the profiles
+//      are compiled every time.
+//
+//      A version whose profiles can't be used fails the call, and is
+//      reported to pRequester, once: after that, requests go on with
+//      the profiles that were in use until the file changes again.
+//
+//      Each file has its own profiles, versions and failed version, so
+//      sites with masterConfig.xml files of their own don't replace
+//      each other's profiles.
+
+HRESULT
+CProcessingProfiles::Configure(
+    IXMLDOMDocument *pConfig,               // [in] masterConfig.xml
+    const XmlCacheInfo & infoCached,        // [in] its version, or all 0
+    const wchar_t *pwszMappedPath,          // [in] its file, or NULL
+    wchar_t *pwszURL,                       // [in] its URL, for errors
+    CXMLServerDocument *pRequester,         // [in] to report errors to,
+                                            //      or NULL
+    XmlCacheInfo *pInfoInUse)               // [out] version of the
+                                            //      profiles in use, or all
+                                            //      0 if it isn't known;
+                                            //      may be NULL
+{
+    HRESULT                   hr;
+    CComPtr<IXMLDOMNodeList>  pcomProfileNodes;
+    CComPtr<IXMLDOMNode>      pcomProfileNode;
+    CComBSTR                  bstrError;
+    CProfileSet              *pNew = NULL;
+    CProfileSet              *pOld = NULL;
+    CLoadedProfile           *pProfile;
+    Config                   *pEntry = NULL;
+    const wchar_t            *pwszPath;
+    XmlCacheInfo              info = infoCached;
+    bool                      bKnownVersion;
+    bool                      bCurrent;
+
+    pwszPath = (pwszMappedPath != NULL) ? pwszMappedPath : pwszURL;
+
+    bKnownVersion = (info.ftLastWrite.dwLowDateTime != 0 ||
+                     info.ftLastWrite.dwHighDateTime != 0 ||
+                     info.nFileSize != 0);
+
+    if (!bKnownVersion && pwszMappedPath != NULL) {
+        bKnownVersion = (GetFileCacheInfo(pwszMappedPath, &info) == S_OK);
+    }
+
+    // Entries are only added, so pEntry stays good after this.
+    Enter();
+    pEntry = FindConfig(pwszPath);
+    if (pEntry == NULL) {
+        pEntry = new Config;
+        if (pEntry != NULL) {
+            pEntry->bstrPath = pwszPath;
+            pEntry->pProfiles = NULL;
+            ZeroMemory(&pEntry->info, sizeof(pEntry->info));
+            pEntry->bConfigured = false;
+            ZeroMemory(&pEntry->infoFailed, sizeof(pEntry->infoFailed));
+            pEntry->bFailed = false;
+            if (pEntry->bstrPath.m_str == NULL) {
+                delete pEntry;
+                pEntry = NULL;
+            } else {
+                pEntry->pNext = m_pConfigs;
+                m_pConfigs = pEntry;
+            }
+        }
+    }
+    bCurrent = pEntry != NULL && bKnownVersion &&
+               ((pEntry->bConfigured &&
+                 memcmp(&pEntry->info, &info, sizeof(info)) == 0) ||
+                (pEntry->bFailed &&
+                 memcmp(&pEntry->infoFailed, &info, sizeof(info)) == 0));
+    Leave();
+
+    ERRCHECK(pEntry == NULL, E_OUTOFMEMORY);
+
+    if (bCurrent) {
+        RETURNERR(S_OK);
+    }
+
+    hr = pConfig->selectNodes(L"/config/postprocess/profile",
+                              &pcomProfileNodes);
+    HRCHECK(FAILED(hr));
+
+    for (;;) {
+        pcomProfileNode.Release();
+        hr = pcomProfileNodes->nextNode(&pcomProfileNode);
+        HRCHECK(FAILED(hr));
+
+        if (pcomProfileNode.p == NULL) {
+            break;
+        }
+
+        if (pNew == NULL) {
+            pNew = new CProfileSet();
+            ERRCHECK(pNew == NULL, E_OUTOFMEMORY);
+        }
+
+        pProfile = new CLoadedProfile();
+        ERRCHECK(pProfile == NULL, E_OUTOFMEMORY);
+        pNew->Add(pProfile);
+
+        hr = pProfile->Load(pcomProfileNode, bstrError);
+        if (FAILED(hr)) {
+            if (pRequester != NULL && bstrError.m_str != NULL) {
+                pRequester->SetError(bstrError,
+                                     pwszURL,
+                                     L"500.100 Internal Server Error - ASP Error");
+            }
+
+            // Not again for this version.
+            Enter();
+            pEntry->infoFailed = info;
+            pEntry->bFailed = bKnownVersion;
+            Leave();
+
+            RETURNERR(hr);
+        }
+    }
+
+    // Streams already using the old set keep it until they're done.
+    Enter();
+    pOld = pEntry->pProfiles;
+    pEntry->pProfiles = pNew;
+    pEntry->info = info;
+    pEntry->bConfigured = bKnownVersion;
+    pEntry->bFailed = false;
+    Leave();
+
+    pNew = NULL;
+
+    hr = S_OK;
+  Error:
+    if (pInfoInUse != NULL) {
+        ZeroMemory(pInfoInUse, sizeof(*pInfoInUse));
+        if (pEntry != NULL) {
+            Enter();
+            if (pEntry->bConfigured) {
+                *pInfoInUse = pEntry->info;
+            }
+            Leave();
+        }
+    }
+    if (pNew) {
+        pNew->Release();
+    }
+    if (pOld) {
+        pOld->Release();
+    }
+    return hr;
+}
+
+// ============================================================================
+// CProcessingProfiles::Acquire
+
+CProfileSet *
+CProcessingProfiles::Acquire(
+    const wchar_t *pwszConfig)              // [in] masterConfig.xml's file,
+                                            //      or URL, or NULL for none
+{
+    CProfileSet *pProfiles = NULL;
+    Config      *pEntry;
+
+    if (pwszConfig == NULL) {
+        return NULL;
+    }
+
+    Enter();
+    pEntry = FindConfig(pwszConfig);
+    if (pEntry != NULL) {
+        pProfiles = pEntry->pProfiles;
+        if (pProfiles) {
+            pProfiles->AddRef();
+        }
+    }
+    Leave();
+
+    return pProfiles;
+}
+
+// ============================================================================
+// CProcessingProfiles::VerifyBuiltIn
+//      Returns true if the tables of every built-in profile can be used
+//      (see CProcessingStream::VerifyProcessingParameters).
+
+bool
+CProcessingProfiles::VerifyBuiltIn()
+{
+    for (UINT i = 0; i < g_cMIMEToStreamTypeMap; ++i)
+    {
+        if (!CProcessingStream::VerifyProcessingParameters (&g_aMIMEToStreamTypeMap[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// ============================================================================
+// CProcessingStream::ProcessorWrite
+//      Processes a chunk of data, and writes the results to the output
+//      stream. Call this once for each chunk of data to write.
+//
+//      NOTE: This function assumes it is being called by a trusted caller,
+//      and does not have the same parameter semantics and error handling as 
+//      IStream::Write. In particular, you cannot pass a length of 0,
+//      and passing bad parameters does not return error messages. (see
+//      further note below)
+//
+//      Because of the nature of processing, a call to this function
+//      may not fully write all the data passed in. After all data has
+//      been passed to this function, the caller should call ProcessorFlush
+//      to write any remaining data. 
+//
+//      Returns HRESULT indicating success.
+
+HRESULT
+CProcessingStream::ProcessorWrite(
+    LPCWSTR pwszInData,                     // [in] Pointer to data
+    long nDataLength)                       // [in] Length of data, in characters
+{
+    // We'll just do ASSERTs here - if this is being called from
+    // IStream::Write, that function should handle the cases:
+    //      pszInData == NULL (error, return STG_E_INVALIDPOINTER)
+    //      nDataLength == 0 (OK, return S_OK)
+
+    ASSERT (pwszInData != NULL);
+    ASSERT (nDataLength > 0);
+    ASSERT (!IsBadReadPtr (pwszInData, nDataLength));
+
+    // If there was a previous failure, we can't recover.
+
+    if (FAILED(m_hrLast))
+    {
+        m_hrLast = E_FAIL;
+        return m_hrLast;
+    }
+
+    // BUFFER MANAGEMENT NOTE
+    //
+    // The postprocessor can be called with buffers of arbitrary length.
+    // From this, it needs to output data in reasonably sized buffers.
+    // In order to accomplish this, the postprocessor uses a
+    // variable-length buffer, taken from the buffer pool at its largest
+    // on the first call and kept until the stream goes away.
+    //
+    // There is a limit on the size of the output buffer. To handle input
+    // buffers that are bigger than the output buffer, this function
+    // breaks the input buffer into suitable "chunks", and calls 
+    // ProcessorWriteChunk to handle each chunk. 
+    //
+    // To write to the buffer without a lot of checking, some simple
+    // heuristics are followed. At any time, the output buffer contains
+    // at least enough room to allow all remaining characters in the 
+    // input chunk to be copied unmodified. This allows simple character
+    // copies to be done without checking for buffer overflow. Whenever
+    // a more complex write or substitution is required, the more complex
+    // WriteToOutputBuffer function is used, which preserves the 
+    // above condition, flushing the buffer if necessary.
+    //
+    // Whenever the input goes into a tag or entity, the input is copied
+    // instead to a residual buffer. After the entire tag name or entity
+    // has been read in, we can write or discard the contents of the
+    // residual buffer. The state of the residual buffer is preserved
+    // across calls to ProcessorWrite, allowing tags and entities to
+    // span multiple buffers. Whenever the residual buffer is filled up,
+    // the code flushes the buffer, and effectively skips special
+    // processing for the tag or entity.
+
+    long nInputBufferChunk;
+    if (nDataLength < g_nMaxInputBufferChunk)
+        nInputBufferChunk = nDataLength;
+    else
+        nInputBufferChunk = g_nMaxInputBufferChunk;
+
+    m_nOutputBufferLength = nInputBufferChunk + 
+                                nInputBufferChunk / 2 +
+                                g_nMaxResidualLength +
+                                g_nOutputBufferPadding;
+
+    ASSERT (m_nOutputBufferLength <= g_nMaxOutputBufferLength);
+
+    if (m_pwszOutputBuffer == NULL)
+    {
+        m_hrLast = m_outputBlock.Reserve (g_nMaxOutputBufferLength * sizeof(WCHAR));
+        if (FAILED(m_hrLast))
+        {
+            return m_hrLast;
+        }
+        m_pwszOutputBuffer = (LPWSTR)m_outputBlock.GetData ();
+    }
+
+    // Go through each chunk.
+
+    HRESULT hr = S_OK;
+    for (long nChunk = (nDataLength + nInputBufferChunk - 1) / nInputBufferChunk; 
+         nChunk > 0 && hr == S_OK; 
+         nChunk--)
+    {
+        hr = ProcessorWriteChunk (pwszInData,
+                    (nChunk == 1) ? nDataLength : nInputBufferChunk);
+        pwszInData += nInputBufferChunk;
+        nDataLength -= nInputBufferChunk;
+    }
+
+    m_hrLast = hr;
+    return hr;
+}
+
+// ============================================================================
+// CProcessingStream::ProcessorFlush
+//      Writes any pending data to the output stream. Call this once after
+//      passing all data to the document, but before calling Uninitialize.
+//
+//      NOTE: Calling this function causes the postprocessor to lose state,
+//      so any subsequent calls to ProcessorWrite will have unpredictable
+//      results.
+//
+//      Returns HRESULT indicating success.
+
+HRESULT
+CProcessingStream::ProcessorFlush()
+{
+    if (FAILED (m_hrLast))
+    {
+        // If there was a previous failure, we can't recover.
+        m_hrLast = E_FAIL;
+    }
+    else if (m_nResidualUsed > 0)
+    {
+        m_hrLast = WriteToDestinationStream (m_wszResidualBuffer, 
+                        m_nResidualUsed * sizeof(WCHAR), NULL);
+        m_nResidualUsed = 0;
+    }
+    return m_hrLast;
+}
+
+// ============================================================================
+// CProfileProcessingStream::ProcessorWriteChunk
+//      Internal function that processes and writes data in chunks. For
+//      an explanation of chunks, see ProcessorWrite above.  
+//
+//      Returns HRESULT indicating success.
+
+template <class Profile>
+HRESULT 
+CProfileProcessingStream<Profile>::ProcessorWriteChunk(
+    LPCWSTR pwszChunk,                      // [in] Pointer to chunk
+    long nChunkLength)                      // [in] Length of chunk, in characters
+{
+    ASSERT (m_hrLast == S_OK);
+    ASSERT (pwszChunk != NULL);
+    ASSERT (nChunkLength < m_nOutputBufferLength);
+
+    // Initialize the output buffer, so that it is empty.
+    LPWSTR pwszBuffer = m_pwszOutputBuffer;
+    long nOutputBufferUsed = 0;
+
+    HRESULT hr = S_OK;
+
+    PROCESSORSTATE state = m_state;
+    while (hr == S_OK && nChunkLength > 0)
+    {
+        if (state == STATE_NORMAL)
+        {
+            // Copy text up to the next character that needs
+            // processing as it is.  The output buffer has room for
+            // the rest of the chunk, so it has room for this.
+            long nPlain = ScanPlainText (pwszChunk, nChunkLength);
+            if (nPlain > 0)
+            {
+                CopyMemory (pwszBuffer + nOutputBufferUsed, pwszChunk,
+                    nPlain * sizeof(WCHAR));
+                nOutputBufferUsed += nPlain;
+                pwszChunk += nPlain;
+                nChunkLength -= nPlain;
+                continue;
+            }
+        }
+
+        WCHAR c = *pwszChunk;
         bool bRepeatCharacter = false;
 
-        if (state == STATE_NORMAL || state == STATE_IN_TAG)
+        if (state == STATE_NORMAL || state == STATE_IN_TAG)
+        {
+            // Check for character replacements, and for characters
+            // that are copied as they are, with one lookup.
+            BYTE charClass = m_profile.Classify (c);
+
+            if (charClass >= CCharClassTable::CHARCLASS_REPLACE)
+            {
+                // Found a match, substitute the replacement string,
+                // skip this character, and continue.
+
+                ASSERT (m_nResidualUsed == 0);
+                hr = WriteToOutputBuffer (
+                    m_profile.CharReplacement (charClass - CCharClassTable::CHARCLASS_REPLACE),
+                    -1, nChunkLength - 1, &nOutputBufferUsed);
+                pwszChunk++;
+                nChunkLength--;
+                continue;
+            }
+
+            if (charClass == CCharClassTable::CHARCLASS_PLAIN ||
+                (charClass == CCharClassTable::CHARCLASS_TAG && state == STATE_NORMAL))
+            {
+                pwszBuffer[nOutputBufferUsed++] = c;
+                pwszChunk++;
+                nChunkLength--;
+                continue;
+            }
+        }
+
+        switch (state)
+        {
+            case STATE_NORMAL:
+                // This is the state the postprocessor is most
+                // often in. It indicates that the input is outside
+                // any tag or entity. There should also be no residual
+                // data when we are in this state.
+                ASSERT (m_nResidualUsed == 0);
+                if (c == L'<' || c == L'&')
+                {
+                    // Enter a tag or entity.
+                    m_wszResidualBuffer[0] = c;
+                    m_nResidualUsed = 1;
+                    m_nQuoteState = 0;
+                    state = c == L'<' ? STATE_STARTING_TAG : STATE_IN_ENTITY_REF;
+                    m_statePrevious = STATE_NORMAL;
+                }
+                else
+                {
+                    pwszBuffer[nOutputBufferUsed++] = c;
+                }
+                break;
+
+            case STATE_STARTING_TAG:
+                // This state indicates that we have just read a <
+                // character, indicating the start of a tag. Subsequent
+                // characters will determine the type of tag.
+                // BUGBUG - we may have to account for CDATA and comment
+                // sections here. Such sections may have a mismatched
+                // number of quotes, and the postprocessor will not
+                // pick up the tag closing.
+                ASSERT (m_nResidualUsed == 1);
+                m_wszResidualBuffer[m_nResidualUsed++] = c;
+                if (c == L'/')
+                {
+                    state = STATE_IN_CLOSING_TAG;
+                }
+                else 
+                {
+                    // We are entering a tag name. We only need special
+                    // processing for this if we are expanding empty tags.
+                    if (m_profile.ExpandEmptyTags ())
+                    {
+                        state = STATE_IN_TAG_NAME;
+                    }
+                    else
+                    {
+                        pwszBuffer[nOutputBufferUsed++] = m_wszResidualBuffer[0];
+                        pwszBuffer[nOutputBufferUsed++] = c;
+                        m_nResidualUsed = 0;
+                        state = STATE_IN_TAG;
+                    }
+                }
+                break;
+
+            case STATE_IN_CLOSING_TAG:
+                // This state indicates that we are reading a closing
+                // tag. We need to save the entire tag name in the
+                // residual buffer, so that we can check if the tag
+                // should be removed or not.
+                if (c == L'>' || m_nResidualUsed == g_nMaxResidualLength)
+                {
+                    int nLookup;
+                    if (m_nResidualUsed < g_nMaxResidualLength)
+                    {
+                        m_wszResidualBuffer[m_nResidualUsed] = L'\0';
+                        nLookup = m_profile.LookupClosingTag (m_wszResidualBuffer + 2);
+                    }
+                    else
+                    {
+                        nLookup = -1;
+                    }
+
+                    // Only write out the tag if it's not on the list
+                    // of closing tags to remove.
+                    if (nLookup == -1)
+                    {
+                        hr = WriteResidualToOutputBuffer (nChunkLength, 
+                                    &nOutputBufferUsed);
+                        bRepeatCharacter = true;
+                    }
+                    m_nResidualUsed = 0;
+                    state = STATE_NORMAL;
+                }
+                else
+                {
+                    m_wszResidualBuffer[m_nResidualUsed++] = c;
+                }
+                break;
+
+            case STATE_IN_TAG_NAME:
+                // This state indicates that we are reading the name of
+                // a tag. We need to save the tag name in the residual
+                // buffer, so that we can create a closing tag, if necessary.
+                if ((c <= L' ' && CHAR_IS_WHITESPACE(c)) || c == L'>' || c == L'/')
+                {
+                    // Save the tag name somewhere safe.
+                    m_wszClosingTag[0] = L'<';
+                    m_wszClosingTag[1] = L'/';
+                    CopyMemory (&m_wszClosingTag[2], 
+                        m_wszResidualBuffer + 1, (m_nResidualUsed - 1) * sizeof(WCHAR));
+                    m_nClosingTagLength = m_nResidualUsed - 1;
+                    hr = WriteResidualToOutputBuffer (nChunkLength, &nOutputBufferUsed);
+                    m_nResidualUsed = 0;
+                    bRepeatCharacter = true;
+                    state = STATE_IN_TAG;
+                }
+                else if (m_nResidualUsed == g_nMaxResidualLength)
+                {
+                    // Tag name is too long - skip special processing.
+                    hr = WriteResidualToOutputBuffer (nChunkLength, &nOutputBufferUsed);
+                    m_nResidualUsed = 0;
+                    m_nClosingTagLength = 0;
+                    bRepeatCharacter = true;
+                    state = STATE_IN_TAG;
+                }
+                else
+                {
+                    m_wszResidualBuffer[m_nResidualUsed++] = c;
+                }
+                break;
+
+            case STATE_IN_TAG:
+                // This state indicates that we are reading a tag.
+                // We need to do special processing to check quote state,
+                // and to look for the end of tag, either as a "/>" or a ">".
+
+                pwszBuffer[nOutputBufferUsed++] = c;
+
+                if (c == L'&')
+                {
+                    // Enter an entity.
+                    nOutputBufferUsed--;
+                    m_wszResidualBuffer[0] = c;
+                    m_nResidualUsed = 1;
+                    state = STATE_IN_ENTITY_REF;
+                    m_statePrevious = STATE_IN_TAG;
+                }
+                else if (c == L'\'')
+                {
+                    m_nQuoteState = 
+                        QUOTE_SINGLE_QUOTE_TRANSITION (m_nQuoteState);
+                }
+                else if (c == L'\"')
+                {
+                    m_nQuoteState = 
+                        QUOTE_SINGLE_QUOTE_TRANSITION (m_nQuoteState);
+                }
+                else if (c == L'/' && m_nQuoteState == 0 && m_profile.ExpandEmptyTags ())
+                {
+                    // This is an empty tag. 
+                    nOutputBufferUsed--;
+                    state = STATE_CLOSING_EMPTY_TAG;
+                }
+                else if (c == L'>' && m_nQuoteState == 0)
+                {
+                    state = STATE_NORMAL;
+                }
+                break;
+
+            case STATE_IN_ENTITY_REF:
+                // This state indicates that we are processing an entity
+                // reference. We need to store the entity name in the
+                // residual buffer, so that we can check if we need to
+                // replace it with some other string. When we reach a 
+                // semicolon, the entity is processed.
+                if (c == L';' || m_nResidualUsed == g_nMaxResidualLength)
+                {
+                    int nLookup;
+                    if (m_nResidualUsed < g_nMaxResidualLength)
+                    {
+                        m_wszResidualBuffer[m_nResidualUsed] = L'\0';
+                        nLookup = m_profile.LookupEntity (m_wszResidualBuffer + 1);
+                    }
+                    else
+                    {
+                        nLookup = -1;
+                    }
+
+                    if (nLookup != -1)
+                    {
+                        // Replace with another string.
+                        hr = WriteToOutputBuffer (
+                                m_profile.EntityReplacement (nLookup),
+                                -1, nChunkLength - 1, &nOutputBufferUsed);
+                    }
+                    else
+                    {
+                        // Just write out the entity.
+                        hr = WriteResidualToOutputBuffer (nChunkLength, 
+                                    &nOutputBufferUsed);
+                        bRepeatCharacter = true;
+                    }
+                    m_nResidualUsed = 0;
+                    state = m_statePrevious;
+                }
+                else
+                {
+                    m_wszResidualBuffer[m_nResidualUsed++] = c;
+                }
+                break;
+
+            case STATE_CLOSING_EMPTY_TAG:
+                // Closing an XML empty tag, denoted with the "/>"
+                // syntax. If requested, we can replace this with a
+                // real closing tag.
+                if (c == L'>')
+                {
+                    if (m_nClosingTagLength > 0)
+                    {
+                        pwszBuffer[nOutputBufferUsed++] = c;
+                        m_wszClosingTag[m_nClosingTagLength + 2] = L'\0';
+                        if (m_profile.LookupClosingTag (m_wszClosingTag + 2) == -1)
+                        {
+                            m_wszClosingTag[m_nClosingTagLength + 2] = L'>';
+                            hr = WriteToOutputBuffer (m_wszClosingTag, 
+                                m_nClosingTagLength + 3, 
+                                nChunkLength - 1, 
+                                &nOutputBufferUsed);
+                        }
+                    }
+                    else
+                    {
+                        // The tag name was too long, so we need to 
+                        // keep the /> syntax.
+
+                        ASSERT (false);
+                        pwszBuffer[nOutputBufferUsed++] = L'/';
+                        pwszBuffer[nOutputBufferUsed++] = c;
+                    }
+                    state = STATE_NORMAL;
+                }
+                else
+                {
+                    // Something wrong with empty tag syntax.
+                    // BUGBUG - this will also fail if comments or
+                    // CDATA sections have / characters in them!
+                    hr = E_FAIL;
+                }
+                break;
+        }
+
+        if (!bRepeatCharacter)
+        {
+            pwszChunk++;
+            nChunkLength--;
+        }
+
+        // Validate output buffer condition.
+        ASSERT (m_nOutputBufferLength - nOutputBufferUsed >= nChunkLength);
+    }
+
+    // Flush the output buffer.
+    if (hr == S_OK)
+    {
+        if (nOutputBufferUsed > 0)
+        {
+            hr = WriteToDestinationStream (m_pwszOutputBuffer, 
+                        nOutputBufferUsed * sizeof(WCHAR), NULL);
+        }
+
+        m_state = state;
+    }
+
+    return hr;
+}
+
+// ============================================================================
+// CProcessingStream::ScanPlainText
+//      Returns the number of characters at the start of the text that
+//      pass through the NORMAL state unchanged: those before the first
+//      '<', '&' or character to replace.
+
+long
+CProcessingStream::ScanPlainText(
+    LPCWSTR pwszText,                       // [in] Text to scan
+    long nLength) const                     // [in] Length of text, in characters
+{
+    long n = 0;
+
+   #ifdef SCAN_SSE2
+    if (m_bScanSSE2 && m_nScanStops > 0)
+    {
+        // Sixteen characters at a time, each narrowed to a byte: itself
+        // if it's below 0xFF, else 0xFF.  The bytes are compared with
+        // each stop below 0xFF at once; only if one is 0xFF are the
+        // characters compared with the stops from 0xFF up.  There's no
+        // unsigned 16-bit min in SSE2, so it's a signed one with the
+        // top bits flipped.
+        const __m128i flip = _mm_set1_epi16 ((short)0x8000);
+        const __m128i limit = _mm_set1_epi16 ((short)(0xFF ^ 0x8000));
+        const __m128i high = _mm_set1_epi8 ((char)0xFF);
+        const __m128i *pStops = (const __m128i *)m_pbScanStops;
+        const __m128i *pRanges = pStops + g_nMaxScanStops;
+        int i;
+
+        while (n + 16 <= nLength)
+        {
+            __m128i block1 = _mm_loadu_si128 ((const __m128i *)(pwszText + n));
+            __m128i block2 = _mm_loadu_si128 ((const __m128i *)(pwszText + n + 8));
+            __m128i narrow = _mm_packus_epi16 (
+                _mm_xor_si128 (_mm_min_epi16 (_mm_xor_si128 (block1, flip), limit), flip),
+                _mm_xor_si128 (_mm_min_epi16 (_mm_xor_si128 (block2, flip), limit), flip));
+
+            // In a range if, less its first, it's at most its length.
+            if (m_nScanRanges > 0)
+            {
+                __m128i plain = _mm_setzero_si128 ();
+
+                for (i = 0; i < m_nScanRanges; i++)
+                {
+                    __m128i offset = _mm_sub_epi8 (narrow, pRanges[2 * i]);
+                    plain = _mm_or_si128 (plain, _mm_cmpeq_epi8 (offset,
+                        _mm_min_epu8 (offset, pRanges[2 * i + 1])));
+                }
+                if (_mm_movemask_epi8 (plain) == 0xFFFF)
+                {
+                    n += 16;
+                    continue;
+                }
+            }
+
+            __m128i matches = _mm_cmpeq_epi8 (narrow, pStops[0]);
+
+            for (i = 1; i < m_nScanStops; i++)
+            {
+                matches = _mm_or_si128 (matches, _mm_cmpeq_epi8 (narrow, pStops[i]));
+            }
+
+            // A bit of the mask per character.
+            int mask = _mm_movemask_epi8 (matches);
+            if (m_nScanStopsHigh > 0 &&
+                _mm_movemask_epi8 (_mm_cmpeq_epi8 (narrow, high)) != 0)
+            {
+                __m128i matches1 = _mm_setzero_si128 ();
+                __m128i matches2 = _mm_setzero_si128 ();
+
+                for (i = 0; i < m_nScanStopsHigh; i++)
+                {
+                    __m128i stop = _mm_set1_epi16 ((short)m_awchScanStopsHigh[i]);
+                    matches1 = _mm_or_si128 (matches1, _mm_cmpeq_epi16 (block1, stop));
+                    matches2 = _mm_or_si128 (matches2, _mm_cmpeq_epi16 (block2, stop));
+                }
+                mask |= _mm_movemask_epi8 (_mm_packs_epi16 (matches1, matches2));
+            }
+            if (mask != 0)
+            {
+                while ((mask & 1) == 0)
+                {
+                    mask >>= 1;
+                    n++;
+                }
+                return n;
+            }
+            n += 16;
+        }
+    }
+   #endif
+
+    while (n < nLength &&
+           m_pCharClasses->Classify (pwszText[n]) <= CCharClassTable::CHARCLASS_TAG)
+    {
+        n++;
+    }
+    return n;
+}
+
+// ============================================================================
+// CProcessingStream::WriteToOutputBuffer
+//      Writes a variable length string to the output buffer. For an
+//      explanation of output buffering, see ProcessorWrite above. 
+//
+//      Returns HRESULT indicating success.
+
+HRESULT 
+CProcessingStream::WriteToOutputBuffer(
+    LPCWSTR pwszData,                       // [in] Data to write
+    long nLength,                           // [in] Length of data
+    long nInputDataRemaining,               // [in] Input data remaining
+    long* pnBufferUsed)                     // [in][out] Amount written
+{
+    HRESULT hr = S_OK;
+    long nBufferUsed = *pnBufferUsed;
+
+    if (nLength < 0)
+    {
+        nLength = lstrlen (pwszData);
+    }
+
+    if (nLength > 0)
+    {
+        long nBufferRemaining = m_nOutputBufferLength - nBufferUsed;
+
+        // Validate output buffer condition.
+        ASSERT (nBufferRemaining >= nInputDataRemaining);
+
+        if (nLength >= m_nOutputBufferLength)
+        {
+            // Very long strings, that wond require mntiple flushes of
+            // the buffer, are instead written out without buffering.
+            
+            // First we need to flush the buffer.
+            if (nBufferUsed > 0)
+            {
+                hr = WriteToDestinationStream (m_pwszOutputBuffer,
+                            nBufferUsed * sizeof(WCHAR), NULL);
+                HRCHECK(FAILED(hr));
+            }
+
+            // Now write the string.
+            hr = WriteToDestinationStream (pwszData,
+                        nLength * sizeof(WCHAR), NULL);
+            HRCHECK(FAILED(hr));
+
+            nBufferUsed = 0;
+        }
+        else if (nBufferRemaining >= nInputDataRemaining + nLength)
+        {
+            // String will fit without breaking buffer condition.
+            CopyMemory (m_pwszOutputBuffer + nBufferUsed, pwszData, 
+                nLength * sizeof(WCHAR));
+
+            nBufferUsed += nLength;
+        }
+        else if (nLength >= nBufferRemaining)
+        {
+            // Fill up the buffer.
+            CopyMemory (m_pwszOutputBuffer + nBufferUsed, pwszData,
+                nBufferRemaining * sizeof(WCHAR));
+
+            // Flush the buffer.
+            hr = WriteToDestinationStream (m_pwszOutputBuffer,
+                    m_nOutputBufferLength * sizeof(WCHAR), NULL);
+            HRCHECK(FAILED(hr));
+
+            nLength -= nBufferRemaining;
+
+            // Copy the rest.
+            CopyMemory (m_pwszOutputBuffer, pwszData + nBufferRemaining,
+                    nLength * sizeof(WCHAR));
+
+            nBufferUsed = nLength;
+        }
+        else
+        {
+            // The string would fit, but not with the rest of the
+            // input after it.  Flush the buffer, and start it again
+            // with the string, or write the string on its own if the
+            // rest of the input still wouldn't fit after it.
+            hr = WriteToDestinationStream (m_pwszOutputBuffer,
+                    nBufferUsed * sizeof(WCHAR), NULL);
+            HRCHECK(FAILED(hr));
+
+            if (m_nOutputBufferLength >= nInputDataRemaining + nLength)
+            {
+                CopyMemory (m_pwszOutputBuffer, pwszData,
+                    nLength * sizeof(WCHAR));
+
+                nBufferUsed = nLength;
+            }
+            else
+            {
+                hr = WriteToDestinationStream (pwszData,
+                        nLength * sizeof(WCHAR), NULL);
+                HRCHECK(FAILED(hr));
+
+                nBufferUsed = 0;
+            }
+        }
+
+        *pnBufferUsed = nBufferUsed;
+
+        // Validate output buffer condition again.
+        ASSERT (m_nOutputBufferLength - nBufferUsed >= nInputDataRemaining);
+    }
+    else
+    {
+        hr = S_OK;
+    }
+
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CProcessingStream::WriteResidualToOutputBuffer
+//      Writes any data in the residual buffer to the output buffer. For an
+//      explanation of output buffering, see ProcessorWrite above. 
+//
+//      Returns HRESULT indicating success.
+
+HRESULT 
+CProcessingStream::WriteResidualToOutputBuffer(
+   long nInputDataRemaining,
+   long* pnBufferUsed)
+{
+    return WriteToOutputBuffer (m_wszResidualBuffer, m_nResidualUsed,
+                nInputDataRemaining, pnBufferUsed);
+}
+
+// CProcessingStream::WriteToDestinationStream
+//      Writes data to the ultimate destination stream. This method provides a
+//      chokepoint for debugging.
+//
+//      Unless it's UTF-16, the text is encoded first (see WriteEncoded).
+//      A high surrogate that ends one write is held back until the next,
+//      or until Commit, so that a pair split between writes is still
+//      encoded as one character.
+//
+//      Returns HRESULT indicating success.
+
+HRESULT
+CProcessingStream::WriteToDestinationStream
+(
+    const void __RPC_FAR *pv,
+    ULONG cb,
+    ULONG __RPC_FAR *pcbWritten
+)
+{
+    HRESULT hr;
+    LPCWSTR pwch = reinterpret_cast<LPCWSTR>(pv);
+    long cch = cb / sizeof(WCHAR);
+    ULONG cbTotal = 0;
+
+    ASSERT(0 == cb % 2);
+
+    if (m_uiCP == CP_UTF16)  // Unicode is written out directly
+    {
+        hr = WriteToDestinationObject(pv, cb, pcbWritten);
+        HRCHECK(FAILED(hr));
+
+        RETURNERR(S_OK);
+    }
+
+    if (m_wchHeldSurrogate != 0 && cch > 0)
+    {
+        WCHAR awchPair[2];
+
+        awchPair[0] = m_wchHeldSurrogate;
+        awchPair[1] = *pwch;
+        m_wchHeldSurrogate = 0;
+
+        if (awchPair[1] >= 0xDC00 && awchPair[1] < 0xE000)
+        {
+            hr = WriteEncoded(awchPair, 2, &cbTotal);
+            pwch++;
+            cch--;
+        }
+        else
+        {
+            hr = WriteEncoded(awchPair, 1, &cbTotal);
+        }
+        HRCHECK(FAILED(hr));
+    }
+
+    if (cch > 0 && pwch[cch - 1] >= 0xD800 && pwch[cch - 1] < 0xDC00)
+    {
+        m_wchHeldSurrogate = pwch[cch - 1];
+        cch--;
+    }
+
+    hr = WriteEncoded(pwch, cch, &cbTotal);
+    HRCHECK(FAILED(hr));
+
+    if (pcbWritten != NULL)
+    {
+        *pcbWritten = cbTotal;
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CProcessingStream::WriteEncoded
+//      Encodes text in m_uiCP and writes it on.  It's encoded
+//      g_nMaxEncodeChunk characters at a time into m_encoded, so that
+//      however much is written at once (a whole document, when there's
+//      no postprocessing), the buffer stays the same size.  A chunk
+//      never ends between the two halves of a surrogate pair.
+//      Single-byte code pages are encoded from their tables (see
+//      CSingleByteEncoder) unless the chunk has surrogates.  Stateful
+//      code pages (see fStatefulCodePage) are encoded in one chunk, as
+//      cutting the text would change what they give for it.
+//
+//      Returns HRESULT indicating success.
+
+HRESULT
+CProcessingStream::WriteEncoded
+(
+    LPCWSTR pwch,
+    long cch,
+    ULONG *pcbTotal
+)
+{
+    HRESULT hr;
+    long cchChunkMax = fStatefulCodePage(m_uiCP) ? cch : g_nMaxEncodeChunk;
+    long cchChunk;
+    UINT cbNeeded;
+    INT iResult;
+
+    while (cch > 0)
+    {
+        cchChunk = (cch < cchChunkMax) ? cch : cchChunkMax;
+        if (cchChunk < cch &&
+            pwch[cchChunk - 1] >= 0xD800 && pwch[cchChunk - 1] < 0xDC00)
+        {
+            cchChunk--;
+        }
+
+        if (m_uiCP == CP_UTF16FFFE)  // Unicode in Big-Endian
+        {
+            cbNeeded = cchChunk * sizeof(WCHAR);
+            hr = m_encoded.Reserve(cbNeeded);
+            HRCHECK(FAILED(hr));
+
+            vLittleEndianToBigEndian(pwch, cchChunk, m_encoded.GetData());
+        }
+        else if (m_uiCP == CP_UTF8)
         {
-            // Check for character replacements.
-            // TODO: Going through a loop on each character may
-            // be too slow - could optimize by creating a lookup 
-            // table for characters less than 256.
+            hr = m_encoded.Reserve(cchChunk * CB_UTF8_PER_UTF16_MAX);
+            HRCHECK(FAILED(hr));
 
-            int i = m_nCharsToReplace; 
-            while (--i >= 0)
+            cbNeeded = cbUTF16ToUTF8(pwch, cchChunk, m_encoded.GetData());
+        }
+        else
+        {
+            cbNeeded = 0;
+            if (m_pSingleByte != NULL)
             {
-                if (m_pCharsToReplace[i].cMatch == c)
+                hr = m_encoded.Reserve(cchChunk);
+                HRCHECK(FAILED(hr));
+
+                if (m_pSingleByte->Encode(pwch, cchChunk, m_encoded.GetData()))
                 {
-                    break;
+                    cbNeeded = cchChunk;
                 }
             }
 
-            if (i >= 0)
+            if (cbNeeded == 0)
             {
-                // Found a match, substitute the replacement string,
-                // skip this character, and continue.
+                cbNeeded = WideCharToMultiByte(
+                    m_uiCP,
+                    0,
+                    pwch,
+                    cchChunk,
+                    NULL,
+                    0,
+                    NULL,
+                    NULL);
+                ERRCHECK(0 == cbNeeded, HRESULT_FROM_WIN32(GetLastError()));
+
+                hr = m_encoded.Reserve(cbNeeded);
+                HRCHECK(FAILED(hr));
 
-                ASSERT (m_nResidualUsed == 0);
-                hr = WriteToOutputBuffer (m_pCharsToReplace[i].pwszReplace,
-                    -1, nChunkLength - 1, &nOutputBufferUsed);
-                pwszChunk++;
-                nChunkLength--;
-                continue;
+                iResult = WideCharToMultiByte(
+                    m_uiCP,
+                    0,
+                    pwch,
+                    cchChunk,
+                    reinterpret_cast<LPSTR>(m_encoded.GetData()),
+                    cbNeeded,
+                    NULL,
+                    NULL);
+                ERRCHECK(0 == iResult, HRESULT_FROM_WIN32(GetLastError()));
             }
         }
 
-        switch (state)
-        {
-            case STATE_NORMAL:
-                // This is the state the postprocessor is most
-                // often in. It indicates that the input is outside
-                // any tag or entity. There should also be no residual
-                // data when we are in this state.
-                ASSERT (m_nResidualUsed == 0);
-                if (c == L'<' || c == L'&')
-                {
-                    // Enter a tag or entity.
-                    m_wszResidualBuffer[0] = c;
-                    m_nResidualUsed = 1;
-                    m_nQuoteState = 0;
-                    state = c == L'<' ? STATE_STARTING_TAG : STATE_IN_ENTITY_REF;
-                    m_statePrevious = STATE_NORMAL;
-                }
-                else
-                {
-                    pwszBuffer[nOutputBufferUsed++] = c;
-                }
-                break;
-
-            case STATE_STARTING_TAG:
-                // This state indicates that we have just read a <
-                // character, indicating the start of a tag. Subsequent
-                // characters will determine the type of tag.
-                // BUGBUG - we may have to account for CDATA and comment
-                // sections here. Such sections may have a mismatched
-                // number of quotes, and the postprocessor will not
-                // pick up the tag closing.
-                ASSERT (m_nResidualUsed == 1);
-                m_wszResidualBuffer[m_nResidualUsed++] = c;
-                if (c == L'/')
-                {
-                    state = STATE_IN_CLOSING_TAG;
-                }
-                else 
-                {
-                    // We are entering a tag name. We only need special
-                    // processing for this if we are expanding empty tags.
-                    if (m_bExpandEmptyTags)
-                    {
-                        state = STATE_IN_TAG_NAME;
-                    }
-                    else
-                    {
-                        pwszBuffer[nOutputBufferUsed++] = m_wszResidualBuffer[0];
-                        pwszBuffer[nOutputBufferUsed++] = c;
-                        m_nResidualUsed = 0;
-                        state = STATE_IN_TAG;
-                    }
-                }
-                break;
-
-            case STATE_IN_CLOSING_TAG:
-                // This state indicates that we are reading a closing
-                // tag. We need to save the entire tag name in the
-                // residual buffer, so that we can check if the tag
-                // should be removed or not.
-                if (c == L'>' || m_nResidualUsed == g_nMaxResidualLength)
-                {
-                    int nLookup;
-                    if (m_nResidualUsed < g_nMaxResidualLength)
-                    {
-                        m_wszResidualBuffer[m_nResidualUsed] = L'\0';
-                        nLookup = LookupSortedArray (m_wszResidualBuffer + 2,
-                                        m_pClosingTagsToRemove,
-                                        m_nClosingTagsToRemove,
-                                        LookupClosingTags);
-                    }
-                    else
-                    {
-                        nLookup = -1;
-                    }
-
-                    // Only write out the tag if it's not on the list
-                    // of closing tags to remove.
-                    if (nLookup == -1)
-                    {
-                        hr = WriteResidualToOutputBuffer (nChunkLength, 
-                                    &nOutputBufferUsed);
-                        bRepeatCharacter = true;
-                    }
-                    m_nResidualUsed = 0;
-                    state = STATE_NORMAL;
-                }
-                else
-                {
-                    m_wszResidualBuffer[m_nResidualUsed++] = c;
-                }
-                break;
-
-            case STATE_IN_TAG_NAME:
-                // This state indicates that we are reading the name of
-                // a tag. We need to save the tag name in the residual
-                // buffer, so that we can create a closing tag, if necessary.
-                if ((c <= L' ' && CHAR_IS_WHITESPACE(c)) || c == L'>' || c == L'/')
-                {
-                    // Save the tag name somewhere safe.
-                    m_wszClosingTag[0] = L'<';
-                    m_wszClosingTag[1] = L'/';
-                    CopyMemory (&m_wszClosingTag[2], 
-                        m_wszResidualBuffer + 1, (m_nResidualUsed - 1) * sizeof(WCHAR));
-                    m_nClosingTagLength = m_nResidualUsed - 1;
-                    hr = WriteResidualToOutputBuffer (nChunkLength, &nOutputBufferUsed);
-                    m_nResidualUsed = 0;
-                    bRepeatCharacter = true;
-                    state = STATE_IN_TAG;
-                }
-                else if (m_nResidualUsed == g_nMaxResidualLength)
-                {
-                    // Tag name is too long - skip special processing.
-                    hr = WriteResidualToOutputBuffer (nChunkLength, &nOutputBufferUsed);
-                    m_nResidualUsed = 0;
-                    m_nClosingTagLength = 0;
-                    bRepeatCharacter = true;
-                    state = STATE_IN_TAG;
-                }
-                else
-                {
-                    m_wszResidualBuffer[m_nResidualUsed++] = c;
-                }
-                break;
-
-            case STATE_IN_TAG:
-                // This state indicates that we are reading a tag.
-                // We need to do special processing to check quote state,
-                // and to look for the end of tag, either as a "/>" or a ">".
-
-                pwszBuffer[nOutputBufferUsed++] = c;
-
-                if (c == L'&')
-                {
-                    // Enter an entity.
-                    nOutputBufferUsed--;
-                    m_wszResidualBuffer[0] = c;
-                    m_nResidualUsed = 1;
-                    state = STATE_IN_ENTITY_REF;
-                    m_statePrevious = STATE_IN_TAG;
-                }
-                else if (c == L'\'')
-                {
-                    m_nQuoteState = 
-                        QUOTE_SINGLE_QUOTE_TRANSITION (m_nQuoteState);
-                }
-                else if (c == L'\"')
-                {
-                    m_nQuoteState = 
-                        QUOTE_SINGLE_QUOTE_TRANSITION (m_nQuoteState);
-                }
-                else if (c == L'/' && m_nQuoteState == 0 && m_bExpandEmptyTags)
-                {
-                    // This is an empty tag. 
-                    nOutputBufferUsed--;
-                    state = STATE_CLOSING_EMPTY_TAG;
-                }
-                else if (c == L'>' && m_nQuoteState == 0)
-                {
-                    state = STATE_NORMAL;
-                }
-                break;
-
-            case STATE_IN_ENTITY_REF:
-                // This state indicates that we are processing an entity
-                // reference. We need to store the entity name in the
-                // residual buffer, so that we can check if we need to
-                // replace it with some other string. When we reach a 
-                // semicolon, the entity is processed.
-                if (c == L';' || m_nResidualUsed == g_nMaxResidualLength)
-                {
-                    int nLookup;
-                    if (m_nResidualUsed < g_nMaxResidualLength)
-                    {
-                        m_wszResidualBuffer[m_nResidualUsed] = L'\0';
-                        nLookup = LookupSortedArray (m_wszResidualBuffer + 1,
-                                        m_pEntitiesToReplace,
-                                        m_nEntitiesToReplace,
-                                        LookupEntityStructs);
-                    }
-                    else
-                    {
-                        nLookup = -1;
-                    }
+        hr = WriteToDestinationObject(m_encoded.GetData(), cbNeeded, NULL);
+        HRCHECK(FAILED(hr));
 
-                    if (nLookup != -1)
-                    {
-                        // Replace with another string.
-                        hr = WriteToOutputBuffer (
-                                m_pEntitiesToReplace[nLookup].pwszReplace,
-                                -1, nChunkLength - 1, &nOutputBufferUsed);
-                    }
-                    else
-                    {
-                        // Just write out the entity.
-                        hr = WriteResidualToOutputBuffer (nChunkLength, 
-                                    &nOutputBufferUsed);
-                        bRepeatCharacter = true;
-                    }
-                    m_nResidualUsed = 0;
-                    state = m_statePrevious;
-                }
-                else
-                {
-                    m_wszResidualBuffer[m_nResidualUsed++] = c;
-                }
-                break;
+        *pcbTotal += cbNeeded;
+        pwch += cchChunk;
+        cch -= cchChunk;
+    }
 
-            case STATE_CLOSING_EMPTY_TAG:
-                // Closing an XML empty tag, denoted with the "/>"
-                // syntax. If requested, we can replace this with a
-                // real closing tag.
-                if (c == L'>')
-                {
-                    if (m_nClosingTagLength > 0)
-                    {
-                        pwszBuffer[nOutputBufferUsed++] = c;
-                        m_wszClosingTag[m_nClosingTagLength + 2] = L'\0';
-                        if (LookupSortedArray (m_wszClosingTag + 2,
-                                m_pClosingTagsToRemove,
-                                m_nClosingTagsToRemove,
-                                LookupClosingTags) == -1)
-                        {
-                            m_wszClosingTag[m_nClosingTagLength + 2] = L'>';
-                            hr = WriteToOutputBuffer (m_wszClosingTag, 
-                                m_nClosingTagLength + 3, 
-                                nChunkLength - 1, 
-                                &nOutputBufferUsed);
-                        }
-                    }
-                    else
-                    {
-                        // The tag name was too long, so we need to 
-                        // keep the /> syntax.
+    hr = S_OK;
+  Error:
+    return hr;
+}
 
-                        ASSERT (false);
-                        pwszBuffer[nOutputBufferUsed++] = L'/';
-                        pwszBuffer[nOutputBufferUsed++] = c;
-                    }
-                    state = STATE_NORMAL;
-                }
-                else
-                {
-                    // Something wrong with empty tag syntax.
-                    // BUGBUG - this will also fail if comments or
-                    // CDATA sections have / characters in them!
-                    hr = E_FAIL;
-                }
-                break;
-        }
+// CProcessingStream::WriteToDestinationObject
+//      Writes encoded data on to the Response, compressing it first if a
+//      Content-Encoding was negotiated.
+//
+//      Returns HRESULT indicating success.
 
-        if (!bRepeatCharacter)
-        {
-            pwszChunk++;
-            nChunkLength--;
-        }
+HRESULT
+CProcessingStream::WriteToDestinationObject
+(
+    const void __RPC_FAR *pv,
+    ULONG cb,
+    ULONG __RPC_FAR *pcbWritten
+)
+{
+    HRESULT hr;
 
-        // Validate output buffer condition.
-        ASSERT (m_nOutputBufferLength - nOutputBufferUsed >= nChunkLength);
+    if (m_encoding == ENCODING_IDENTITY)
+    {
+        hr = WriteToResponse(pv, cb, pcbWritten);
+        HRCHECK(FAILED(hr));
+
+        RETURNERR(S_OK);
     }
 
-    // Flush the output buffer.
-    if (hr == S_OK)
+    if (m_pDeflater == NULL)
     {
-        if (nOutputBufferUsed > 0)
+        // Hold on to the start of the body until we know it's big
+        // enough to be worth compressing.
+        hr = m_heldBack.Append(pv, cb);
+        HRCHECK(FAILED(hr));
+
+        if (m_heldBack.GetSize() >= m_cbCompressMin)
         {
-            hr = WriteToDestinationStream (m_pwszOutputBuffer, 
-                        nOutputBufferUsed * sizeof(WCHAR), NULL);
+            hr = StartCompression();
+            HRCHECK(FAILED(hr));
         }
+    }
+    else
+    {
+        hr = m_pDeflater->Write(pv, cb);
+        HRCHECK(FAILED(hr));
 
-        m_state = state;
+        hr = WriteCompressedOutput(false);
+        HRCHECK(FAILED(hr));
+    }
+
+    if (pcbWritten != NULL)
+    {
+        *pcbWritten = cb;
     }
 
+    hr = S_OK;
+  Error:
     return hr;
 }
 
-// ============================================================================
-// CProcessingStream::WriteToOutputBuffer
-//      Writes a variable length string to the output buffer. For an
-//      explanation of output buffering, see ProcessorWrite above. 
+// CProcessingStream::StartCompression
+//      Called once the held back output reaches m_cbCompressMin.  Adds the
+//      Content-Encoding header and compresses what's been held back.  If
+//      the header can't be added any more (the response isn't buffered and
+//      something else has been written), the output simply goes out
+//      uncompressed.
 //
 //      Returns HRESULT indicating success.
 
-HRESULT 
-CProcessingStream::WriteToOutputBuffer(
-    LPCWSTR pwszData,                       // [in] Data to write
-    long nLength,                           // [in] Length of data
-    long nInputDataRemaining,               // [in] Input data remaining
-    long* pnBufferUsed)                     // [in][out] Amount written
+HRESULT
+CProcessingStream::StartCompression
+(
+)
 {
-    HRESULT hr = S_OK;
-    long nBufferUsed = *pnBufferUsed;
+    HRESULT hr;
 
-    if (nLength < 0)
-    {
-        nLength = lstrlen (pwszData);
-    }
+    ASSERT(m_encoding != ENCODING_IDENTITY && m_pDeflater == NULL);
 
-    if (nLength > 0)
+    if (!*m_pfEncodingHeaderSent)
     {
-        long nBufferRemaining = m_nOutputBufferLength - nBufferUsed;
-
-        // Validate output buffer condition.
-        ASSERT (nBufferRemaining >= nInputDataRemaining);
-
-        if (nLength >= m_nOutputBufferLength)
+        hr = m_pcomResponse->AddHeader(L"Content-Encoding",
+                                       (m_encoding == ENCODING_GZIP) ?
+                                           L"gzip" : L"deflate");
+        if (FAILED(hr))
         {
-            // Very long strings, that wond require mntiple flushes of
-            // the buffer, are instead written out without buffering.
-            
-            // First we need to flush the buffer.
-            if (nBufferUsed > 0)
-            {
-                hr = WriteToDestinationStream (m_pwszOutputBuffer,
-                            nBufferUsed * sizeof(WCHAR), NULL);
-                HRCHECK(FAILED(hr));
-            }
+            m_encoding = ENCODING_IDENTITY;
 
-            // Now write the string.
-            hr = WriteToDestinationStream (pwszData,
-                        nLength * sizeof(WCHAR), NULL);
+            hr = WriteToResponse(m_heldBack.GetData(), m_heldBack.GetSize(), NULL);
             HRCHECK(FAILED(hr));
 
-            nBufferUsed = 0;
+            m_heldBack.Free();
+            RETURNERR(S_OK);
         }
-        else if (nBufferRemaining >= nInputDataRemaining + nLength)
-        {
-            // String will fit without breaking buffer condition.
-            CopyMemory (m_pwszOutputBuffer + nBufferUsed, pwszData, 
-                nLength * sizeof(WCHAR));
 
-            nBufferUsed += nLength;
-        }
-        else
-        {
-            // Fill up the buffer.
-            CopyMemory (m_pwszOutputBuffer + nBufferUsed, pwszData,
-                nBufferRemaining * sizeof(WCHAR));
+        *m_pfEncodingHeaderSent = true;
+    }
 
-            // Flush the buffer.
-            hr = WriteToDestinationStream (m_pwszOutputBuffer,
-                    m_nOutputBufferLength * sizeof(WCHAR), NULL);
-            HRCHECK(FAILED(hr));
+    m_pDeflater = new CDeflater();
+    ERRCHECK(NULL == m_pDeflater, E_OUTOFMEMORY);
 
-            nLength -= nBufferRemaining;
+    hr = m_pDeflater->Init((m_encoding == ENCODING_GZIP) ?
+                               CDeflater::FORMAT_GZIP : CDeflater::FORMAT_ZLIB);
+    HRCHECK(FAILED(hr));
 
-            // Copy the rest.
-            CopyMemory (m_pwszOutputBuffer, pwszData + nBufferRemaining,
-                    nLength * sizeof(WCHAR));
+    hr = m_pDeflater->Write(m_heldBack.GetData(), m_heldBack.GetSize());
+    HRCHECK(FAILED(hr));
 
-            nBufferUsed = nLength;
-        }
+    m_heldBack.Free();
 
-        *pnBufferUsed = nBufferUsed;
+    hr = WriteCompressedOutput(false);
+    HRCHECK(FAILED(hr));
 
-        // Validate output buffer condition again.
-        ASSERT (m_nOutputBufferLength - nBufferUsed >= nInputDataRemaining);
-    }
-    else
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// CProcessingStream::WriteCompressedOutput
+//      Writes the compressor's output to the Response, once there's enough
+//      of it (or all of it, if fAll).
+//
+//      Returns HRESULT indicating success.
+
+HRESULT
+CProcessingStream::WriteCompressedOutput
+(
+    bool fAll
+)
+{
+    HRESULT hr;
+    CPooledBuffer & output = m_pDeflater->GetOutput();
+
+    if (output.GetSize() > 0 &&
+        (fAll || output.GetSize() >= g_cbCompressedChunk))
     {
-        hr = S_OK;
+        hr = WriteToResponse(output.GetData(), output.GetSize(), NULL);
+        HRCHECK(FAILED(hr));
+
+        output.Empty();
     }
 
+    hr = S_OK;
   Error:
     return hr;
 }
 
-// ============================================================================
-// CProcessingStream::WriteResidualToOutputBuffer
-//      Writes any data in the residual buffer to the output buffer. For an
-//      explanation of output buffering, see ProcessorWrite above. 
+// CProcessingStream::FinishContentEncoding
+//      Called when the stream is committed.  Ends the compressed stream,
+//      or, if the body never got big enough to compress, writes it out as
+//      it is.
 //
 //      Returns HRESULT indicating success.
 
-HRESULT 
-CProcessingStream::WriteResidualToOutputBuffer(
-   long nInputDataRemaining,
-   long* pnBufferUsed)
+HRESULT
+CProcessingStream::FinishContentEncoding
+(
+)
 {
-    return WriteToOutputBuffer (m_wszResidualBuffer, m_nResidualUsed,
-                nInputDataRemaining, pnBufferUsed);
+    HRESULT hr;
+
+    if (m_encoding == ENCODING_IDENTITY)
+    {
+        RETURNERR(S_OK);
+    }
+
+    if (m_pDeflater == NULL && !*m_pfEncodingHeaderSent)
+    {
+        hr = WriteToResponse(m_heldBack.GetData(), m_heldBack.GetSize(), NULL);
+        HRCHECK(FAILED(hr));
+
+        m_heldBack.Free();
+    }
+    else
+    {
+        if (m_pDeflater == NULL)
+        {
+            hr = StartCompression();
+            HRCHECK(FAILED(hr));
+        }
+
+        hr = m_pDeflater->Finish();
+        HRCHECK(FAILED(hr));
+
+        hr = WriteCompressedOutput(true);
+        HRCHECK(FAILED(hr));
+    }
+
+    m_encoding = ENCODING_IDENTITY;
+
+    hr = S_OK;
+  Error:
+    return hr;
 }
 
-// CProcessingStream::WriteToDestinationStream
-//      Writes data to the ultimate destination stream. This method provides a
-//      chokepoint for debugging.
+// CProcessingStream::WriteToResponse
+//      Writes data to the ultimate destination object, either the stream or the
+//      Response.  The stream takes a higher priority if available.
+//
+//      With m_cbWriteBuffer set, writes are gathered in m_writeBuffer until
+//      there's that much, so that the Response gets a few large writes
+//      rather than one for every chunk; Commit writes what's left.  A
+//      write that's that big on its own goes straight through.
 //
 //      Returns HRESULT indicating success.
 
 HRESULT
-CProcessingStream::WriteToDestinationStream
+CProcessingStream::WriteToResponse
 (
     const void __RPC_FAR *pv,
     ULONG cb,
@@ -1306,85 +3595,76 @@ CProcessingStream::WriteToDestinationStream
 )
 {
     HRESULT hr;
-    UINT cbNeeded;
-    CHAR * pszBuffer = NULL;
-    INT iResult;
 
-    ASSERT(0 == cb % 2);
+    if (cb == 0)
+    {
+        if (pcbWritten != NULL)
+        {
+            *pcbWritten = 0;
+        }
+        RETURNERR(S_OK);
+    }
 
-    if (m_uiCP == CP_UTF16)  // Unicode is written out directly
+    if (m_cbWriteBuffer == 0)
     {
-        hr = WriteToDestinationObject(pv, cb, pcbWritten);
+        hr = WriteResponseNow(pv, cb);
+        HRCHECK(FAILED(hr));
+    }
+    else if (m_writeBuffer.GetSize() + cb < m_cbWriteBuffer)
+    {
+        hr = m_writeBuffer.Append(pv, cb);
         HRCHECK(FAILED(hr));
+    }
+    else if (cb >= m_cbWriteBuffer)
+    {
+        if (m_writeBuffer.GetSize() > 0)
+        {
+            hr = WriteResponseNow(m_writeBuffer.GetData(), m_writeBuffer.GetSize());
+            HRCHECK(FAILED(hr));
 
-        RETURNERR(S_OK);
+            m_writeBuffer.Empty();
+        }
+
+        hr = WriteResponseNow(pv, cb);
+        HRCHECK(FAILED(hr));
     }
-    else if (m_uiCP == CP_UTF16FFFE)  // Unicode in Big-Endian
+    else
     {
-        pszBuffer = (LPSTR) _alloca (cb);
-        ERRCHECK(NULL == pszBuffer, E_OUTOFMEMORY);
+        hr = m_writeBuffer.Append(pv, cb);
+        HRCHECK(FAILED(hr));
 
-        vLittleEndianToBigEndian(reinterpret_cast<LPCWSTR> (pv),
-                                 cb / 2,
-                                 reinterpret_cast<BYTE*> (pszBuffer));
-        hr = WriteToDestinationObject(pszBuffer, cb, pcbWritten);
+        hr = WriteResponseNow(m_writeBuffer.GetData(), m_writeBuffer.GetSize());
         HRCHECK(FAILED(hr));
 
-        RETURNERR(S_OK);
+        m_writeBuffer.Empty();
+    }
+
+    if (pcbWritten != NULL)
+    {
+        *pcbWritten = cb;
     }
 
-    // REVIEW: This may be a source of a performance problem
-    cbNeeded = WideCharToMultiByte(
-        m_uiCP,
-        0,
-        reinterpret_cast<const WCHAR *>(pv),
-        cb / sizeof(WCHAR),
-        NULL,
-        0,
-        NULL,
-        NULL);
-    ERRCHECK(0 == cbNeeded, HRESULT_FROM_WIN32(GetLastError()));
-
-    pszBuffer = (LPSTR) _alloca (cbNeeded);
-    ERRCHECK(NULL == pszBuffer, E_OUTOFMEMORY);
-
-    iResult = WideCharToMultiByte(
-        m_uiCP,
-        0,
-        reinterpret_cast<const WCHAR *>(pv),
-        cb / sizeof(WCHAR),
-        pszBuffer,
-        cbNeeded,
-        NULL,
-        NULL);
-    ERRCHECK(0 == iResult, HRESULT_FROM_WIN32(GetLastError()));
-
-    hr = WriteToDestinationObject(pszBuffer, cbNeeded, pcbWritten);
-    HRCHECK(FAILED(hr));
-    
     hr = S_OK;
   Error:
     return hr;
 }
 
-// CProcessingStream::WriteToDestinationObject
-//      Writes data to the ultimate destination object, either the stream or the
-//      Response.  The stream takes a higher priority if available.
+// CProcessingStream::WriteResponseNow
+//      Writes data to the stream, or with Response.BinaryWrite.
 //
 //      Returns HRESULT indicating success.
 
 HRESULT
-CProcessingStream::WriteToDestinationObject
+CProcessingStream::WriteResponseNow
 (
     const void __RPC_FAR *pv,
-    ULONG cb,
-    ULONG __RPC_FAR *pcbWritten
+    ULONG cb
 )
 {
     HRESULT hr;
 
     if (m_pcomDestinationStream) {
-        hr = m_pcomDestinationStream->Write(pv, cb, pcbWritten);
+        hr = m_pcomDestinationStream->Write(pv, cb, NULL);
         HRCHECK(FAILED(hr));
     } else {
         VARIANT vValue;
@@ -1403,6 +3683,11 @@ CProcessingStream::WriteToDestinationObject
         HRCHECK(FAILED(hr));
     }
 
+    if (m_pTrace != NULL)
+    {
+        m_pTrace->AddWriteOut(cb);
+    }
+
     hr = S_OK;
   Error:
     return hr;
@@ -1411,7 +3696,8 @@ CProcessingStream::WriteToDestinationObject
 
 // ============================================================================
 // CompareClosingTags
-//      Compares two closing tags (really just strings).
+//      Compares two closing tags, regardless of case, as LookupClosingTags
+//      does, so that the array is sorted the way it's searched.
 //
 //      Returns -1 if pElem1 < pElem2, 0 if pElem1 == pElem2, 
 //      and 1 if pElem1 > pElem2.
@@ -1421,7 +3707,7 @@ CompareClosingTags(
     CLOSING_TAG const* pElem1, 
     CLOSING_TAG const* pElem2)
 {
-    return lstrcmp (*pElem1, *pElem2);
+    return CompareNamesIgnoreCase (*pElem1, *pElem2);
 }
 
 // ============================================================================
@@ -1438,7 +3724,7 @@ LookupClosingTags(
     LPCWSTR pwsz,
     CLOSING_TAG const* pElem)
 {
-    return lstrcmpi (pwsz, *pElem);
+    return CompareNamesIgnoreCase (pwsz, *pElem);
 }
 
 // ============================================================================
@@ -1472,55 +3758,124 @@ LookupEntityStructs(
 
 
 // ============================================================================
-// VerifyProcessingParameters
-//      Debug-only function to validate whether the processing parameters are
-//      legitimate. If any of the asserts in this function fail, there is an
-//      error in the code.
-
-#ifdef _DEBUG
+// CProcessingStream::VerifyProcessingParameters
+//      Checks that a profile's tables are what the postprocessor takes
+//      them to be: sorted, names no longer than the residual buffer
+//      holds, every name found by its hash where the sorted array finds
+//      it, in any case for closing tags, names that aren't there not
+//      found by either, and characters the state machine can replace.
+//      Built-in profiles are checked in debug builds; loaded ones when
+//      they're loaded.
+//
+//      Returns true if the tables can be used.
 
-void 
-CProcessingStream::VerifyProcessingParameters()
+bool
+CProcessingStream::VerifyProcessingParameters(
+    const SMIMEToStreamType * pStreamType)  // [in] Profile to check
 {
-    // Verify that all lookup arrays are properly sorted.
-
-    // If this assert fails, the array of closing tags to be removed is not
-    // properly sorted!
-    ASSERT (VerifySortedArray (m_pClosingTagsToRemove,
-                m_nClosingTagsToRemove,
-                CompareClosingTags));
+    const SProcessingParameters * pParameters = pStreamType->pProcessingParameters;
+    CLOSING_TAG const * pTags = pParameters->pClosingTagsToRemove;
+    int nTags = pParameters->nClosingTagsToRemove;
+    ENTITY_REPLACEMENT const * pEntities = pParameters->pEntitiesToReplace;
+    int nEntities = pParameters->nEntitiesToReplace;
+    WCHAR wszName[g_nMaxResidualLength + 2];
+    int cch;
+    int i, j, k;
+
+    if (!VerifySortedArray (pTags, nTags, CompareClosingTags) ||
+        !VerifySortedArray (pEntities, nEntities, CompareEntityStructs))
+    {
+        return false;
+    }
 
-    // If this assert fails, the array of entities to be replaced is not
-    // properly sorted!
-    ASSERT (VerifySortedArray (m_pEntitiesToReplace,
-                m_nEntitiesToReplace,
-                CompareEntityStructs));
+    for (i = 0; i < nTags; i++)
+    {
+        cch = lstrlen (pTags[i]);
+        if (cch < 1 || cch > g_nMaxResidualLength - 3 ||
+            pStreamType->pClosingTagHash->Lookup (pTags[i]) != i ||
+            LookupSortedArray (pTags[i], pTags, nTags, LookupClosingTags) != i)
+        {
+            return false;
+        }
 
-    // Check input strings.
+        // In lower case, the same tag; in upper case (which needn't fold
+        // back to it) and one character longer and shorter, whatever the
+        // sorted array finds.
+        for (j = 0; j < 4; j++)
+        {
+            lstrcpyn (wszName, pTags[i], COUNTOF(wszName));
+            switch (j)
+            {
+            case 0: CharLowerW (wszName); break;
+            case 1: CharUpperW (wszName); break;
+            case 2: wszName[cch] = L'x'; wszName[cch + 1] = 0; break;
+            case 3: wszName[cch - 1] = 0; break;
+            }
 
-    int i;
-    
-    for (i = 0; i < m_nClosingTagsToRemove; i++)
-    {
-        // If this assert fails, the given closing tag name is too long!
-        ASSERT (lstrlen (m_pClosingTagsToRemove[i]) <= 
-            g_nMaxResidualLength - 3);
+            k = LookupSortedArray ((LPCWSTR)wszName, pTags, nTags, LookupClosingTags);
+            if (pStreamType->pClosingTagHash->Lookup (wszName) != k ||
+                (j == 0 && k != i))
+            {
+                return false;
+            }
+        }
     }
 
-    for (i = 0; i < m_nEntitiesToReplace; i++)
+    for (i = 0; i < nEntities; i++)
     {
-        // If this assert fails, the given entity name is too long!
-        ASSERT (lstrlen (m_pEntitiesToReplace[i].pwszName) <= 
-            g_nMaxResidualLength - 2);
+        cch = lstrlen (pEntities[i].pwszName);
+        if (cch < 1 || cch > g_nMaxResidualLength - 2 ||
+            pEntities[i].pwszReplace == NULL ||
+            pStreamType->pEntityHash->Lookup (pEntities[i].pwszName) != i ||
+            LookupSortedArray (pEntities[i].pwszName, pEntities, nEntities,
+                               LookupEntityStructs) != i)
+        {
+            return false;
+        }
+
+        // Entities match only in their own case.
+        for (j = 0; j < 4; j++)
+        {
+            lstrcpyn (wszName, pEntities[i].pwszName, COUNTOF(wszName));
+            switch (j)
+            {
+            case 0: CharLowerW (wszName); break;
+            case 1: CharUpperW (wszName); break;
+            case 2: wszName[cch] = L'x'; wszName[cch + 1] = 0; break;
+            case 3: wszName[cch - 1] = 0; break;
+            }
+
+            k = LookupSortedArray ((LPCWSTR)wszName, pEntities, nEntities,
+                                   LookupEntityStructs);
+            if (pStreamType->pEntityHash->Lookup (wszName) != k)
+            {
+                return false;
+            }
+        }
     }
 
-    for (i = 0; i < m_nCharsToReplace; i++)
+    // Where a character has more than one replacement, the last is used.
+    for (i = 0; i < pParameters->nCharsToReplace; i++)
     {
-        WCHAR c = m_pCharsToReplace[i].cMatch;
+        WCHAR c = pParameters->pCharsToReplace[i].cMatch;
+
+        if (c == 0 || c == L'<' || c == L'&' || (c >= 0xD800 && c < 0xE000) ||
+            pParameters->pCharsToReplace[i].pwszReplace == NULL)
+        {
+            return false;
+        }
 
-        // If this assert fails, the character is not allowed.
-        ASSERT (c != L'<' && c != L'&');
+        for (j = pParameters->nCharsToReplace - 1;
+             pParameters->pCharsToReplace[j].cMatch != c;
+             j--)
+        {
+        }
+        if (pStreamType->pCharClasses->Classify (c) !=
+            CCharClassTable::CHARCLASS_REPLACE + j)
+        {
+            return false;
+        }
     }
-}
 
-#endif
+    return true;
+}
@@ -0,0 +1,91 @@
+// ============================================================================
+// FILE: ProcessingStream.h
+//
+//      Post-processing profiles loaded from masterConfig.xml.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#pragma once
+
+class CProfileSet;
+
+// ============================================================================
+// CLASS: CProcessingProfiles
+//
+//      Post-processing profiles defined in masterConfig.xml, for markups
+//      the built-in HDML and WML profiles don't cover:
+//
+//        <postprocess>
+//          <profile mime-type="text/x-hdml" expand-empty-tags="on">
+//            <closing-tag name="BR"/>
+//            <entity name="var" replace="$"/>
+//            <character match="$" replace="&amp;dol;"/>
+//          </profile>
+//        </postprocess>
+//
+//      A profile for the MIME type of a built-in one replaces it.  Each
+//      is compiled into the same tables the built-in profiles use when
+//      the file is read, so they run as fast.  A server can host sites
+//      with masterConfig.xml files of their own, so the profiles are
+//      kept for each file, by its path.  When a file changes, the new
+//      set of profiles replaces the old one for streams created after
+//      that; streams already writing keep the set they started with
+//      (see Acquire()).
+
+class CProcessingProfiles
+{
+  public:
+    CProcessingProfiles();
+    ~CProcessingProfiles();
+
+    // Compile the profiles in pConfig, unless that version of it is
+    // the one in use.  A profile that can't be used fails the call,
+    // and is reported to pRequester, if it isn't NULL, the first time
+    // that version is seen; the profiles in use are kept.  They're
+    // kept by pwszMappedPath, or pwszURL if there's no file.  The
+    // version of the ones in use is returned, for the ETag, or all 0
+    // if it isn't known and they're compiled every time.
+    HRESULT Configure(IXMLDOMDocument *pConfig,         // [in] masterConfig.xml
+                      const XmlCacheInfo & info,        // [in] its version
+                      const wchar_t *pwszMappedPath,    // [in] its file, for
+                                                        // its version if
+                                                        // info is all 0
+                      wchar_t *pwszURL,                 // [in] its URL
+                      CXMLServerDocument *pRequester,   // [in] for errors,
+                                                        // or NULL
+                      XmlCacheInfo *pInfoInUse);        // [out] or NULL
+
+    // The profiles in use for the masterConfig.xml that Configure kept
+    // them by, AddRef'd, or NULL if there are none.
+    CProfileSet * Acquire(const wchar_t *pwszConfig);
+
+    // Whether the built-in profiles' tables are consistent; the loaded
+    // ones are checked as they're compiled.
+    static bool VerifyBuiltIn();
+
+  private:
+    // The profiles of one masterConfig.xml.
+    struct Config {
+        CComBSTR        bstrPath;               // its file, or URL
+        CProfileSet    *pProfiles;
+        XmlCacheInfo    info;                   // version pProfiles is from
+        bool            bConfigured;            // whether info is known
+        XmlCacheInfo    infoFailed;             // version that couldn't be
+        bool            bFailed;                // used, if there's one
+        Config         *pNext;
+    };
+
+    Config * FindConfig(const wchar_t *pwszPath);
+
+    void Enter() {
+        EnterCriticalSection(&m_cs);
+    }
+
+    void Leave() {
+        LeaveCriticalSection(&m_cs);
+    }
+
+    Config           *m_pConfigs;               // one per file, never freed
+                                                // before the object is
+    CRITICAL_SECTION  m_cs;
+};
@@ -38,6 +38,20 @@ using namespace msxml;
 #include "Utils.h"
 #include "xmlcache.h"
 #include "Global.h"
+#include "chaincache.h"
+#include "docpool.h"
+#include "workerpool.h"
+#include "sourcecache.h"
+#include "deflate.h"
+#include "phasestats.h"
+#include "slowlog.h"
+#include "browsercaps.h"
+#include "browscap.h"
+#include "errorpages.h"
+#include "batch.h"
+#include "arena.h"
+#include "transformpool.h"
+#include "ProcessingStream.h"
 
 #include <wininet.h>
 #include <activeds.h>
@@ -393,7 +393,7 @@ GetStylesheetPIContentsFromXMLDocument(
 // ============================================================================
 // FUNCTION: ReallyLoadXMLDocument
 //      Unconditionally load filename into pDocument.  Any errors are
-//      passed on to pRequester->SetError().
+//      passed on to pRequester->SetError(), unless pRequester is NULL.
 HRESULT
 ReallyLoadXMLDocument(
     IXMLDOMDocument *pDocument,   // doc to load to
@@ -413,9 +413,11 @@ ReallyLoadXMLDocument(
         bool filefound = (h != INVALID_HANDLE_VALUE);
         FindClose(h);
         if (!filefound) {
-            pRequester->SetError(L"Resource not found",
-                                 pwszURL,
-                                 L"404 Not Found");
+            if (pRequester) {
+                pRequester->SetError(L"Resource not found",
+                                     pwszURL,
+                                     L"404 Not Found");
+            }
             RETURNERR(E_FAIL);
         }
     }
@@ -453,6 +455,53 @@ ReallyLoadXMLDocument(
 }
 
 
+// ============================================================================
+// FUNCTION: AppendXMLText
+//      Append text to an XML document being built, escaping what needs
+//      it.  Suitable for both element content and attribute values.
+HRESULT
+AppendXMLText(CComBSTR & bstrXML,           // [in/out] document so far
+              const wchar_t *pwszText)      // [in] text, may be NULL
+{
+    HRESULT        hr;
+    const wchar_t *pwchRun = pwszText;
+    const wchar_t *pwszEntity;
+
+    if (pwszText == NULL) {
+        RETURNERR(S_OK);
+    }
+
+    for (;; pwszText++) {
+
+        switch (*pwszText) {
+        case L'&':  pwszEntity = L"&amp;";  break;
+        case L'<':  pwszEntity = L"&lt;";   break;
+        case L'>':  pwszEntity = L"&gt;";   break;
+        case L'"':  pwszEntity = L"&quot;"; break;
+        case L'\0': pwszEntity = NULL;      break;
+        default:    continue;
+        }
+
+        if (pwszText > pwchRun) {
+            hr = bstrXML.Append(pwchRun, pwszText - pwchRun);
+            HRCHECK(FAILED(hr));
+        }
+
+        if (pwszEntity == NULL) {
+            break;
+        }
+
+        hr = bstrXML.Append(pwszEntity);
+        HRCHECK(FAILED(hr));
+
+        pwchRun = pwszText + 1;
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
 // ============================================================================
 // FUNCTION: GetSingleNodeValue
 //      Given a XMLDOMNode and a XPath (XSL pattern), look for the first matched
@@ -531,10 +580,96 @@ CreateXMLDocumentOnCComPtr(CComPtr<IXMLDOMDocument> & pcomDoc)
     return hr;
 }
 
+// ============================================================================
+// GetFileCacheInfo
+//     Get the version (last write time and size, and for a cached
+//     stylesheet what it includes) of a local file, in the same form
+//     CXmlCache records for the files it caches.
+//     Returns S_FALSE, with a zeroed version, if the file can't be
+//     found.
+HRESULT
+GetFileCacheInfo(const wchar_t *pwszFilename,     // [in] full path to local file
+                 XmlCacheInfo  *pInfo)            // [out] version of the file
+{
+    HRESULT          hr;
+    WIN32_FIND_DATAW data;
+    HANDLE           h;
+
+    ASSERT(pwszFilename && pInfo);
+
+    ::memset(pInfo, 0, sizeof(*pInfo));
+
+    h = FindFirstFileW(pwszFilename, &data);
+    if (h == INVALID_HANDLE_VALUE) {
+        RETURNERR(S_FALSE);
+    }
+    FindClose(h);
+
+    pInfo->ftLastWrite = data.ftLastWriteTime;
+    pInfo->nFileSize = data.nFileSizeLow;
+
+    if (g_xmlCache) {
+        pInfo->dwIncludes = g_xmlCache->GetIncludesVersion(pwszFilename);
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CanOpenFile
+//     Open the file for reading and close it again, the way the
+//     parser would open it, to find out whether a load could get at
+//     it (it may be locked, or not readable by the impersonated user).
+bool
+CanOpenFile(const wchar_t *pwszFilename)        // [in] full path to local file
+{
+    HANDLE h;
+
+    h = CreateFileW(pwszFilename,
+                    GENERIC_READ,
+                    FILE_SHARE_READ | FILE_SHARE_WRITE,
+                    NULL,
+                    OPEN_EXISTING,
+                    FILE_ATTRIBUTE_NORMAL,
+                    NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    CloseHandle(h);
+    return true;
+}
+
+// ============================================================================
+// GetBrowscapPath
+//     MSWC.BrowserType reads browscap.ini from the inetsrv directory.
+HRESULT
+GetBrowscapPath(wchar_t *pwszPath,              // [out] full path of browscap.ini
+                UINT     cchPath)               // [in] size of pwszPath
+{
+    HRESULT hr;
+    UINT    cch;
+
+    pwszPath[0] = L'\0';
+
+    cch = GetSystemDirectoryW(pwszPath, cchPath);
+    ERRCHECK(cch == 0, HRESULT_FROM_WIN32(GetLastError()));
+    ERRCHECK(cch + 24 >= cchPath, E_FAIL);
+
+    lstrcatW(pwszPath, L"\\inetsrv\\browscap.ini");
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
 // ============================================================================
 // DealWithParseError
 //      If there's a parse error on the document, invoke
-//      pRequester->SetError() and put the error code into *pXmlHR.
+//      pRequester->SetError() (if pRequester isn't NULL) and put the
+//      error code into *pXmlHR.
 //      Else make *pXmlHR == S_OK.  Note that this function expects
 //      there to have been a parse error.  If there wasn't, this will
 //      return bad results.
@@ -556,7 +691,7 @@ DealWithParseError(IXMLDOMDocument *pDocument,
     hr = pcomParseError->get_errorCode(pXmlHR);
     HRCHECK(FAILED(hr));
         
-    if (pcomParseError.p) {
+    if (pcomParseError.p && pRequester) {
         hr = pcomParseError->get_reason(&bstrErrorInfo);
         HRCHECK(FAILED(hr));
 
@@ -573,18 +708,19 @@ DealWithParseError(IXMLDOMDocument *pDocument,
 
 
 // ============================================================================
-// GetASPServerObject
-//      Gets the ASP server object.
+// GetASPIntrinsic
+//      Gets one of the ASP intrinsic objects from the object context.
 //      Returns HRESULT indicating success.
 
-HRESULT 
-GetASPServerObject(
-    asp::IServer** ppServer)                  // [out] Receives server object
+static HRESULT 
+GetASPIntrinsic(
+    BSTR bstrName,                            // [in] "Server", "Request", ...
+    REFIID riid,                              // [in] interface wanted
+    void** ppv)                               // [out] Receives object
 {
     HRESULT hr;
     CComPtr<IObjectContext> pcomObjectContext;
     CComPtr<IGetContextProperties> pcomProps;
-    CComPtr<asp::IServer> pcomServer;
     VARIANT vt;
 
     VariantInit(&vt);
@@ -595,12 +731,11 @@ GetASPServerObject(
     hr = pcomObjectContext.QueryInterface(&pcomProps);
     HRCHECK (FAILED(hr));
 
-    hr = pcomProps->GetProperty(g_bstrServer, &vt);
+    hr = pcomProps->GetProperty(bstrName, &vt);
     HRCHECK(FAILED(hr));
     ERRCHECK (V_VT(&vt) != VT_DISPATCH || V_DISPATCH(&vt) == NULL, E_FAIL);
 
-    hr = V_DISPATCH(&vt)->QueryInterface (asp::IID_IServer, 
-            reinterpret_cast<PVOID*>(ppServer));
+    hr = V_DISPATCH(&vt)->QueryInterface (riid, ppv);
     HRCHECK (FAILED(hr));
 
     hr = S_OK;
@@ -610,44 +745,70 @@ GetASPServerObject(
 }
 
 // ============================================================================
-// GrabFromBrowserCap
-//   Grab the value of pwszAttrib from the browser capabilities object
-//   and store as a string in bstrDestination.  If none exists (or is
-//   "unknown") replace with pwszDefault (or just empty if NULL).
+// GetASPServerObject
+//      Gets the ASP server object.
+//      Returns HRESULT indicating success.
+
+HRESULT 
+GetASPServerObject(
+    asp::IServer** ppServer)                  // [out] Receives server object
+{
+    return GetASPIntrinsic(g_bstrServer,
+                           asp::IID_IServer,
+                           reinterpret_cast<PVOID*>(ppServer));
+}
+
+// ============================================================================
+// GetASPRequestObject
+//      Gets the ASP request object.
+//      Returns HRESULT indicating success.
+
+HRESULT 
+GetASPRequestObject(
+    asp::IRequest** ppRequest)                // [out] Receives request object
+{
+    return GetASPIntrinsic(g_bstrRequest,
+                           asp::IID_IRequest,
+                           reinterpret_cast<PVOID*>(ppRequest));
+}
+
+// ============================================================================
+// GetServerVariable
+//      Get a server variable (e.g. an "HTTP_..." request header) as a
+//      string.  bstrValue is left empty if the variable isn't set.
+
 HRESULT
-GrabFromBrowserCap(IDispatch *pBrowserTypeDisp,
-                   wchar_t *pwszAttrib,
-                   wchar_t *pwszDefault,
-                   CComBSTR & bstrDestination)
+GetServerVariable(
+    asp::IRequest *pRequest,                  // [in] request object
+    wchar_t *pwszName,                        // [in] variable to get
+    CComBSTR & bstrValue)                     // [out] its value
 {
-    HRESULT     hr;
-    CComVariant var;
+    HRESULT                           hr;
+    CComPtr<asp::IRequestDictionary>  pcomVariables;
+    CComVariant                       var;
 
-    bstrDestination.Empty();
-    
-    hr = GetBrowserTypeProperty(pBrowserTypeDisp, pwszAttrib, var);
-    if (hr != S_OK) {
-        // Assume no content-type was specified here, use default.
-        if (pwszDefault) {
-            bstrDestination = pwszDefault;
-        }
-    } else {
-        hr = var.ChangeType(VT_BSTR);
-        HRCHECK(FAILED(hr));
-        if (0 == lstrcmp(V_BSTR(&var), L"unknown")) {
-            if (pwszDefault) {
-                bstrDestination = pwszDefault;
-            }
-        } else {
-            bstrDestination = V_BSTR(&var);
-        }
+    bstrValue.Empty();
+
+    hr = pRequest->get_ServerVariables(&pcomVariables);
+    HRCHECK(FAILED(hr));
+
+    hr = pcomVariables->get_Item(CComVariant(pwszName), &var);
+    HRCHECK(FAILED(hr));
+
+    // The item is a string list; its default property is the value.
+    hr = var.ChangeType(VT_BSTR);
+    HRCHECK(FAILED(hr));
+
+    if (SysStringLen(V_BSTR(&var))) {
+        bstrValue = V_BSTR(&var);
+        ERRCHECK(bstrValue.m_str == NULL, E_OUTOFMEMORY);
     }
 
     hr = S_OK;
   Error:
     return hr;
 }
-    
+
 // ============================================================================
 // GetBrowserTypeProperty
 //      Get property from browser type or S_FALSE if no such property.
@@ -121,6 +121,34 @@ VerifySortedArray(
     return (0 == nElemCount) || (i == nElemCount);
 }
 
+// ============================================================================
+// SortArray
+//      Templatized function to sort a short array, with the same
+//      callback as VerifySortedArray.  An insertion sort, so it's only
+//      for arrays of a few dozen elements.
+
+template <typename Element>
+void
+SortArray(
+    Element* pElemArray,                    // [in][out] Pointer to array
+    int nElemCount,                         // [in] Number of elements in array
+    int (__fastcall* pfnCompare)(Element const* pElem1, Element const* pElem2))
+                                            // [in] Callback (see above)
+{
+    for (int i = 1; i < nElemCount; i++)
+    {
+        Element elem = pElemArray[i];
+        int j = i;
+
+        while (j > 0 && pfnCompare (&elem, pElemArray + j - 1) < 0)
+        {
+            pElemArray[j] = pElemArray[j - 1];
+            j--;
+        }
+        pElemArray[j] = elem;
+    }
+}
+
 #define SAFERELEASE(ptr)   \
   if (ptr != NULL) {       \
       ptr->Release();      \
@@ -177,14 +205,13 @@ LPCSTR __cdecl FindAttributeInTag(LPCSTR pszScan, LPCSTR pszAttr, int nAttrLen,
 ////////////////////////
 
 HRESULT GetASPServerObject(asp::IServer **ppServer);
+HRESULT GetASPRequestObject(asp::IRequest **ppRequest);
 
-// Grab the value of pwszAttrib from the browser capabilities object
-// and store as a string in bstrDestination.  If none exists (or is
-// "unknown") replace with pwszDefault (or leave untouched if NULL).
-HRESULT GrabFromBrowserCap(IDispatch *pBrowserTypeDisp,
-                           wchar_t *pwszAttrib,
-                           wchar_t *pwszDefault,
-                           CComBSTR & bstrDestination);
+// Get the value of a server variable, such as "HTTP_IF_NONE_MATCH".
+// bstrValue is left empty if it isn't set.
+HRESULT GetServerVariable(asp::IRequest *pRequest,
+                          wchar_t *pwszName,
+                          CComBSTR & bstrValue);
 
 // Get property from browser type or S_FALSE if no such property.
 HRESULT GetBrowserTypeProperty(IDispatch *pBrowserTypeDisp,
@@ -203,10 +230,17 @@ char* WideToAscii(const WCHAR* wsz);
 // Preprocessor Related
 ////////////////////////
 
+class CRequestTrace;
+
 HRESULT CreateProcessingStream(IStream * pOutputStream,
                                asp::IResponse * pResponse,
                                const WCHAR * pwszStreamLanguage,
+                               const WCHAR * pwszProfilesConfig,
                                UINT uiCP,
+                               const WCHAR * pwszContentEncoding,
+                               ULONG cbCompressMin,
+                               bool * pfEncodingHeaderSent,
+                               CRequestTrace * pTrace,
                                IStream ** ppProcessingStream);
 
 ////////////////////////
@@ -217,7 +251,7 @@ HRESULT GetStylesheetPIContentsFromXMLDocument(IXMLDOMDocument *pDocument,
                                                CComBSTR & pbstrStylesheetPIContents);
 
 // Load filename into pDocument.  Any errors are passed on to
-// pRequester. 
+// pRequester, if it isn't NULL. 
 HRESULT ReallyLoadXMLDocument(IXMLDOMDocument *pDocument,
                               wchar_t *pwszFilename,
                               wchar_t *pwszURL,
@@ -233,9 +267,24 @@ HRESULT GetSingleNodeValue(IXMLDOMNode *pNode,
                            LPCWSTR pwszXPath,
                            BSTR *pbstrValue);
 
+// Append text to an XML document being built, escaping &<>" as
+// entities.  pwszText may be NULL.
+HRESULT AppendXMLText(CComBSTR & bstrXML, const wchar_t *pwszText);
+
 // Construct either an MSXML or an MSXML3 free-threaded document,
 // favoring MSXML3 if available.
 HRESULT CreateXMLDocumentOnCComPtr(CComPtr<IXMLDOMDocument> & pcomDoc);
+
+// Get the path of browscap.ini, which MSWC.BrowserType reads.
+HRESULT GetBrowscapPath(wchar_t *pwszPath, UINT cchPath);
+
+// Get the last write time and size of a local file, as recorded by
+// the XML cache.  S_FALSE if the file can't be found.
+HRESULT GetFileCacheInfo(const wchar_t *pwszFilename,
+                         XmlCacheInfo  *pInfo);
+
+// Whether a local file can be opened for reading right now.
+bool CanOpenFile(const wchar_t *pwszFilename);
                                            
 
 ////////////////////////
@@ -10,6 +10,35 @@
 #include "XMLServerDoc.h"
 #include "charset.h"
 
+// Writes to the XML document are collected in m_xmlWriteBuffer and
+// handed to the parser in one block at Transform() time, or once this
+// many bytes are pending.  Writes of at least this size go straight
+// through.
+const ULONG XML_WRITE_HIGH_WATER = 256 * 1024;
+
+// Output smaller than this isn't compressed, unless masterConfig says
+// otherwise.  Below about a packet, compression saves nothing worth the
+// time it takes.
+const long DEFAULT_COMPRESSION_THRESHOLD = 1024;
+
+// Seconds between the log lines of phase timings, unless masterConfig
+// says otherwise.
+const long DEFAULT_TIMING_LOG_INTERVAL = 60;
+
+// Transforms allowed to wait for a thread of the transform pool, and
+// milliseconds a request waits for its transform, unless masterConfig
+// says otherwise.
+const long DEFAULT_TRANSFORM_QUEUE = 16;
+const long DEFAULT_TRANSFORM_TIMEOUT = 30000;
+
+// Seconds TransformBatch waits for its pages when not told, and at
+// most (so that it fits in a DWORD of milliseconds).
+const long DEFAULT_BATCH_TIMEOUT = 60 * 60;
+const long MAX_BATCH_TIMEOUT = LONG_MAX / 1000;
+
+// Starts the XML document when it's written as UTF-8.
+static const BYTE s_abUTF8BOM[] = { 0xEF, 0xBB, 0xBF };
+
 // ============================================================================
 // CXMLServerDocument::WriteLine
 //      Add line to current XML buffer.
@@ -67,6 +96,10 @@ CXMLServerDocument::Flush()
 STDMETHODIMP
 CXMLServerDocument::Clear()
 {
+    m_bSourceIsStatic = false;
+    m_bSourcePending = false;
+    m_cbXMLWritten = 0;
+    m_xmlWriteBuffer.Empty();
     m_pcomXMLDocumentStream.Release();
     return EnsureXMLDocumentObject(true);
 }
@@ -90,6 +123,47 @@ CXMLServerDocument::Load(BSTR bstrFileName)   // [in] local filename to load
     }
 
     ClearError();
+    m_bSourceIsStatic = false;
+    m_bSourcePending = false;
+
+    // Anything written so far is replaced by the file.
+    m_xmlWriteBuffer.Empty();
+    m_wchPendingSurrogate = 0;
+    m_cbXMLWritten = 0;
+
+    // Note the version of the file before loading it, so that results
+    // derived from the document can be cached (see
+    // ResolveChainPrefix).  It's checked again once the file has been
+    // loaded (see RecheckSourceVersion).
+    hr = GetFileCacheInfo(bstrFileName, &m_sourceInfo);
+    HRCHECK(FAILED(hr));
+
+    m_bSourceIsStatic = (hr == S_OK);
+
+    m_bstrSourcePath = bstrFileName;
+    ERRCHECK(m_bstrSourcePath.m_str == NULL, E_OUTOFMEMORY);
+
+    // If this version of the file has been parsed before, Transform
+    // has all it needs to pick the stylesheets without the DOM, so
+    // put off loading it until it's actually transformed (see
+    // EnsureSourceLoaded).  A 304 response never loads it at all.
+    // Only a file that can still be opened is put off, so that Load
+    // goes on reporting a missing or unreadable file itself.  A file
+    // rewritten without changing its time or size can't be told from
+    // the version that parsed, so its parse error comes from
+    // Transform instead, with the same error information.
+    if (m_bSourceIsStatic) {
+        hr = g_sourceInfoCache->Lookup(m_bstrSourcePath,
+                                       m_sourceInfo,
+                                       m_bstrDoctypeName,
+                                       m_bstrSourcePIContents);
+        HRCHECK(FAILED(hr));
+
+        if (hr == S_OK && CanOpenFile(m_bstrSourcePath)) {
+            m_bSourcePending = true;
+            RETURNERR(S_OK);
+        }
+    }
 
     // Make sure document is created and acquired.
     hr = EnsureXMLDocumentObject (false);
@@ -100,6 +174,12 @@ CXMLServerDocument::Load(BSTR bstrFileName)   // [in] local filename to load
                                m_bstrURL,
                                false,
                                this);
+    if (FAILED(hr)) {
+        m_bSourceIsStatic = false;
+        RETURNERR(hr);
+    }
+
+    hr = RecheckSourceVersion();
     HRCHECK(FAILED(hr));
 
     hr = S_OK;
@@ -116,16 +196,8 @@ STDMETHODIMP
 CXMLServerDocument::Transform(
     IDispatch * pdispResponse)              // [in] Response stream
 {
-    HRESULT hr;
-    const int MAX_SHEETS_TO_CHAIN = 64;
-    CComPtr<asp::IResponse>             pcomResponse;
-    CComPtr<IXMLDOMDocument>            pcomServerConfig;
-    CComBSTR                            bstrStylesheets[MAX_SHEETS_TO_CHAIN];
-    short                               nStylesheets = 0;
-    CComBSTR                            bstrPIContents;
-    CComBSTR                            bstrSpecialPIAttrib;
-
-    ClearError();
+    HRESULT                  hr;
+    CComPtr<asp::IResponse>  pcomResponse;
 
     ERRCHECK (pdispResponse == NULL, E_POINTER);
 
@@ -135,37 +207,115 @@ CXMLServerDocument::Transform(
             reinterpret_cast<void **>(&pcomResponse));
     HRCHECK (FAILED(hr));
 
-    // If we've been writing to a stream, release it
+    hr = TransformTo(pcomResponse);
+
+  Error:
+    return hr;
+}
+
+
+// ============================================================================
+// CXMLServerDocument::TransformTo
+//      Transform the accumulated XML document into the response, or
+//      into m_pcomOfflineOutput if pResponse is NULL (see
+//      RenderOffline).
+
+HRESULT
+CXMLServerDocument::TransformTo(
+    asp::IResponse * pResponse)             // [in] Response, or NULL
+{
+    HRESULT hr;
+    CComPtr<IXMLDOMDocument>            pcomServerConfig;
+    BSTR                                bstrStylesheets[MAX_SHEETS_TO_CHAIN] = { NULL };
+    short                               nStylesheets = 0;
+    CComBSTR                            bstrPIContents;
+    CComBSTR                            bstrSpecialPIAttrib;
+    CPhaseTimer                         totalTimer(&m_trace);
+    CPhaseTimer                         phaseTimer(&m_trace);
+
+    m_trace.Reset(g_slowRequestLog->IsEnabled());
+    totalTimer.Start();
+
+    // The request waits for the transform pool only so long, counting
+    // from here.
+    m_transformDeadline = GetTickCount() + g_transformPool->GetTimeout();
+
+    ClearError();
+    m_bstrServerConfigPath.Empty();
+
+    // If we've been writing to a stream, hand it what's pending and
+    // release it
     if (m_pcomXMLDocumentStream.p) {
-        m_pcomXMLDocumentStream.Release();
+        hr = FlushXMLWriteBuffer(true);
+        m_xmlWriteBuffer.Free();
+        HRCHECK(FAILED(hr));
     }
 
-    hr = GetDoctype();
-    HRCHECK(FAILED(hr));
+    if (m_parseTicks) {
+        g_phaseStats->Record(PHASE_PARSE, m_parseTicks);
+        m_trace.AddPhase(PHASE_PARSE, m_parseTicks);
+        m_parseTicks = 0;
+    }
 
-    hr = ::GetStylesheetPIContentsFromXMLDocument(m_pcomXMLDocument,
-                                                  bstrPIContents);
-    HRCHECK(FAILED(hr));
+    if (m_bSourceIsStatic) {
+        m_trace.SetSource(m_bSourcePending ?
+                              CRequestTrace::SOURCE_INFO_CACHED :
+                              CRequestTrace::SOURCE_PARSED,
+                          m_sourceInfo.nFileSize);
+    } else {
+        m_trace.SetSource(CRequestTrace::SOURCE_WRITTEN, m_cbXMLWritten);
+    }
+
+    if (m_bSourcePending) {
+
+        // Load() found these in the source info cache.
+        bstrPIContents = m_bstrSourcePIContents;
+
+    } else {
+
+        hr = GetDoctype();
+        HRCHECK(FAILED(hr));
+
+        hr = ::GetStylesheetPIContentsFromXMLDocument(m_pcomXMLDocument,
+                                                      bstrPIContents);
+        HRCHECK(FAILED(hr));
+
+        // Remember them, so that the next Load() of this version of
+        // the file needn't parse it up front.
+        if (m_bSourceIsStatic) {
+            hr = g_sourceInfoCache->Add(m_bstrSourcePath,
+                                        m_sourceInfo,
+                                        m_bstrDoctypeName,
+                                        bstrPIContents);
+            HRCHECK(FAILED(hr));
+        }
+    }
 
     if (bstrPIContents.Length() == 0) {
         // There are no PI contents, just bail out with the original.
-        hr = WriteIdentityXML(pcomResponse);
+        hr = WriteIdentityXML(pResponse);
         RETURNERR(hr);
     }
 
     hr = m_piParseInfo.Clear();
     HRCHECK(FAILED(hr));
 
-    hr = m_piParseInfo.Parse(bstrPIContents);
+    hr = m_piParseInfo.Parse(bstrPIContents, m_arena);
     HRCHECK(FAILED(hr));
 
+    phaseTimer.Start();
     hr = LoadMasterConfig(bstrSpecialPIAttrib);
+    phaseTimer.Stop(PHASE_MASTER_CONFIG);
     HRCHECK(FAILED(hr));
     
+    phaseTimer.Start();
     hr = InitializeBrowserCapAndAttribs();
+    phaseTimer.Stop(PHASE_BROWSER_CAPS);
     HRCHECK(FAILED(hr));
 
+    phaseTimer.Start();
     hr = GetServerConfig(&pcomServerConfig);
+    phaseTimer.Stop(PHASE_SERVER_CONFIG);
     HRCHECK(FAILED(hr));
 
 // BEGIN BACK COMPAT
@@ -190,7 +340,8 @@ CXMLServerDocument::Transform(
         }
 
         if (stylesheetForBackwardCompat) {
-            bstrStylesheets[0] = stylesheetForBackwardCompat;
+            bstrStylesheets[0] = m_arena.AllocBSTR(stylesheetForBackwardCompat);
+            ERRCHECK(bstrStylesheets[0] == NULL, E_OUTOFMEMORY);
             nStylesheets = 1;
         }
 
@@ -200,9 +351,11 @@ CXMLServerDocument::Transform(
 
         // We do have a server-config we're working with.
         nStylesheets = COUNTOF(bstrStylesheets);
+        phaseTimer.Start();
         hr = ExtractStylesheets(pcomServerConfig,
                                 bstrStylesheets,
                                 &nStylesheets);
+        phaseTimer.Stop(PHASE_EXTRACT_STYLESHEETS);
         HRCHECK(FAILED(hr));
 
     }
@@ -213,17 +366,29 @@ CXMLServerDocument::Transform(
         // just pass the XML back out and return.  (May also get here
         // if there is no server-config, or invocations due to
         // backwards compatability.)
-        hr = WriteIdentityXML(pcomResponse);
+        hr = WriteIdentityXML(pResponse);
         RETURNERR(hr);
     }
 
-    hr = ApplyStylesheets(pcomResponse,
+    hr = ApplyStylesheets(pResponse,
                           bstrStylesheets,
                           nStylesheets);
     HRCHECK(FAILED(hr));
     
     hr = S_OK;
   Error:
+    totalTimer.Stop(PHASE_TOTAL);
+    if (m_trace.IsEnabled()) {
+        g_slowRequestLog->WriteIfSlow(m_trace,
+                                      m_bstrURL,
+                                      bstrStylesheets,
+                                      nStylesheets,
+                                      hr);
+    }
+
+    // Everything the request allocated from the arena goes at once.
+    m_piParseInfo.Clear();
+    m_arena.Reset();
     return hr;
 }
 
@@ -275,8 +440,15 @@ CXMLServerDocument::EnsureXMLDocumentObject(
         hr = m_pcomXMLDocument.QueryInterface(&m_pcomXMLDocumentStream);
         HRCHECK(FAILED(hr));
 
-        // Write out BOM.
-        hr = m_pcomXMLDocumentStream->Write(&chBOM, sizeof(chBOM), NULL);
+        // Write out BOM, which tells the parser which encoding the
+        // writes are in.
+        m_bUTF8Input = g_bUTF8Input;
+        m_wchPendingSurrogate = 0;
+        if (m_bUTF8Input) {
+            hr = m_xmlWriteBuffer.Append(s_abUTF8BOM, sizeof(s_abUTF8BOM));
+        } else {
+            hr = m_xmlWriteBuffer.Append(&chBOM, sizeof(chBOM));
+        }
         HRCHECK(FAILED(hr));
     }
 
@@ -303,6 +475,93 @@ CXMLServerDocument::EnsureAspServerObject()
     return hr;
 }
 
+// ============================================================================
+// CXMLServerDocument::EnsureAspRequestObject
+//      Makes sure that the AspRequest object is created
+HRESULT
+CXMLServerDocument::EnsureAspRequestObject()
+{
+    HRESULT hr;
+
+    if (m_pcomASPRequest.p == NULL) {
+        hr = ::GetASPRequestObject(&m_pcomASPRequest);
+        HRCHECK(FAILED(hr));
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CXMLServerDocument::EnsureSourceLoaded
+//      Load the source document if Load() put it off.  Anything that
+//      uses m_pcomXMLDocument for the source must call this first.
+HRESULT
+CXMLServerDocument::EnsureSourceLoaded()
+{
+    HRESULT hr;
+
+    if (!m_bSourcePending) {
+        RETURNERR(S_OK);
+    }
+
+    m_bSourcePending = false;
+
+    hr = EnsureXMLDocumentObject(false);
+    HRCHECK(FAILED(hr));
+
+    // On failure the error is set just as Load would have set it, so
+    // the error page is the same.  The next Load of the file doesn't
+    // put it off again.
+    hr = ReallyLoadXMLDocument(m_pcomXMLDocument,
+                               m_bstrSourcePath,
+                               m_bstrURL,
+                               false,
+                               this);
+    if (FAILED(hr)) {
+        g_sourceInfoCache->Remove(m_bstrSourcePath);
+        m_bSourceIsStatic = false;
+        RETURNERR(hr);
+    }
+
+    hr = RecheckSourceVersion();
+    HRCHECK(FAILED(hr));
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CXMLServerDocument::RecheckSourceVersion
+//      Called once the source file has been loaded.  Its version was
+//      noted before loading, so if the file has changed since, what
+//      was loaded may be either version: the document is then no
+//      longer treated as static, and nothing derived from it is cached
+//      or given an entity tag.
+HRESULT
+CXMLServerDocument::RecheckSourceVersion()
+{
+    HRESULT       hr;
+    XmlCacheInfo  info;
+
+    if (!m_bSourceIsStatic) {
+        RETURNERR(S_OK);
+    }
+
+    hr = GetFileCacheInfo(m_bstrSourcePath, &info);
+    HRCHECK(FAILED(hr));
+
+    if (hr != S_OK || ::memcmp(&info, &m_sourceInfo, sizeof(info)) != 0) {
+        m_bSourceIsStatic = false;
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
 // ============================================================================
 // CXMLServerDocument::WriteToXML
 //      Writes data, with optional carriage return, to XML buffer.
@@ -329,25 +588,138 @@ CXMLServerDocument::WriteToXML(
         hr = EnsureXMLDocumentObject (true);
         HRCHECK (FAILED(hr));
 
-        if (NULL != bstrLine && L'\0' != *bstrLine) {
-            hr = m_pcomXMLDocumentStream->Write(
-                bstrLine,
-                lstrlen(bstrLine) * sizeof(bstrLine[0]),
-                NULL);
+        // The document no longer matches any file on disk.
+        m_bSourceIsStatic = false;
+        m_bSourcePending = false;
+
+        if (NULL != bstrLine && L'\0' != *bstrLine && m_bUTF8Input) {
+            hr = AppendUTF8ToXML(bstrLine, lstrlen(bstrLine));
             HRCHECK(FAILED(hr));
+        } else if (NULL != bstrLine && L'\0' != *bstrLine) {
+            ULONG cb = lstrlen(bstrLine) * sizeof(bstrLine[0]);
+
+            m_cbXMLWritten += cb;
+
+            if (cb >= XML_WRITE_HIGH_WATER) {
+                // Too big to be worth copying; write it as is.
+                hr = FlushXMLWriteBuffer(false, bstrLine, cb);
+                HRCHECK(FAILED(hr));
+            } else {
+                hr = m_xmlWriteBuffer.Append(bstrLine, cb);
+                HRCHECK(FAILED(hr));
+            }
         }
         
-        if (bAddCR) {
-            hr = m_pcomXMLDocumentStream->Write(
-                L"\r\n",
-                2 * sizeof(WCHAR),
-                NULL);
+        if (bAddCR && m_bUTF8Input) {
+            hr = AppendUTF8ToXML(L"\r\n", 2);
+            HRCHECK(FAILED(hr));
+        } else if (bAddCR) {
+            hr = m_xmlWriteBuffer.Append(L"\r\n", 2 * sizeof(WCHAR));
             HRCHECK(FAILED(hr));
         }
+
+        if (m_xmlWriteBuffer.GetSize() >= XML_WRITE_HIGH_WATER) {
+            hr = FlushXMLWriteBuffer();
+            HRCHECK(FAILED(hr));
+        }
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CXMLServerDocument::AppendUTF8ToXML
+//      Adds text to the XML buffer in UTF-8.  Writes are encoded one at
+//      a time, so a surrogate pair split between two of them is held
+//      back until the second arrives.
+
+HRESULT
+CXMLServerDocument::AppendUTF8ToXML(
+    const wchar_t *pwch,                    // [in] Text to add
+    ULONG cch)                              // [in] Its length
+{
+    HRESULT hr;
+    ULONG   cbBefore = m_xmlWriteBuffer.GetSize();
+
+    if (m_wchPendingSurrogate && cch) {
+        wchar_t awchPair[2] = { m_wchPendingSurrogate, *pwch };
+
+        m_wchPendingSurrogate = 0;
+        if (*pwch >= 0xDC00 && *pwch < 0xE000) {
+            hr = m_xmlWriteBuffer.AppendUTF8(awchPair, 2);
+            pwch++;
+            cch--;
+        } else {
+            hr = m_xmlWriteBuffer.AppendUTF8(awchPair, 1);
+        }
+        HRCHECK(FAILED(hr));
+    }
+
+    if (cch && pwch[cch - 1] >= 0xD800 && pwch[cch - 1] < 0xDC00) {
+        m_wchPendingSurrogate = pwch[cch - 1];
+        cch--;
+    }
+
+    hr = m_xmlWriteBuffer.AppendUTF8(pwch, cch);
+    HRCHECK(FAILED(hr));
+
+    hr = S_OK;
+  Error:
+    m_cbXMLWritten += m_xmlWriteBuffer.GetSize() - cbBefore;
+    return hr;
+}
+
+// ============================================================================
+// CXMLServerDocument::FlushXMLWriteBuffer
+//      Hands any buffered writes to the XML document's stream, then
+//      pvMore, which is written as is.  With bLast, the document is
+//      complete: the stream is released, which ends it.  The time the
+//      parser takes over it is added to m_parseTicks.
+
+HRESULT
+CXMLServerDocument::FlushXMLWriteBuffer(
+    bool bLast,                             // [in] End of the document?
+    const void *pvMore,                     // [in] Unbuffered write, or NULL
+    ULONG cbMore)                           // [in] Its size in bytes
+{
+    HRESULT        hr;
+    LARGE_INTEGER  start;
+    LARGE_INTEGER  end;
+    bool           bTimed = g_phaseStats->IsEnabled() ||
+                            g_slowRequestLog->IsEnabled();
+
+    ASSERT(m_pcomXMLDocumentStream.p);
+
+    if (bTimed) {
+        QueryPerformanceCounter(&start);
+    }
+
+    // Nothing follows a surrogate left over from the last write.
+    if (bLast && m_wchPendingSurrogate) {
+        hr = m_xmlWriteBuffer.AppendUTF8(&m_wchPendingSurrogate, 1);
+        HRCHECK(FAILED(hr));
+        m_wchPendingSurrogate = 0;
+    }
+
+    hr = m_xmlWriteBuffer.WriteTo(m_pcomXMLDocumentStream);
+    HRCHECK(FAILED(hr));
+
+    if (pvMore) {
+        hr = m_pcomXMLDocumentStream->Write(pvMore, cbMore, NULL);
+        HRCHECK(FAILED(hr));
     }
 
     hr = S_OK;
   Error:
+    if (bLast) {
+        m_pcomXMLDocumentStream.Release();
+    }
+    if (bTimed) {
+        QueryPerformanceCounter(&end);
+        m_parseTicks += end.QuadPart - start.QuadPart;
+    }
     return hr;
 }
 
@@ -400,347 +772,315 @@ CXMLServerDocument::put_UserAgent(
 // END BACK COMPAT
 
 // ============================================================================
-// CXMLServerDocument::WriteIdentityXML
-//      Simply write out the XML document to the response (setting the
-//      content type along the way)
+// CXMLServerDocument::get_Statistics
+//      Returns process-wide cache statistics as an XML string.
 
-HRESULT
-CXMLServerDocument::WriteIdentityXML(asp::IResponse *pResponse)
+STDMETHODIMP
+CXMLServerDocument::get_Statistics(
+    BSTR *pbstrStatistics)                  // [out, retval] statistics XML
 {
-    HRESULT hr;
-    
-    hr = pResponse->put_ContentType(L"text/xml");
+    HRESULT  hr;
+    CComBSTR bstrStats;
+
+    ERRCHECK(pbstrStatistics == NULL, E_POINTER);
+    *pbstrStatistics = NULL;
+
+    hr = bstrStats.Append(L"<statistics>");
     HRCHECK(FAILED(hr));
 
-    // It's possible we got here because of a bad XML document.  If
-    // attempting to save here returns an error it may be that there's
-    // a parse error.  Check for it. 
-    hr = m_pcomXMLDocument->save(CComVariant(pResponse));
-    if (FAILED(hr)) {
-        HRESULT parseError;
-        
-        hr = DealWithParseError(m_pcomXMLDocument,
-                                m_bstrURL,
-                                this,
-                                &parseError);
-        HRCHECK(FAILED(hr));
+    hr = g_chainCache->AppendStatistics(bstrStats);
+    HRCHECK(FAILED(hr));
 
-        hr = parseError;
-        HRCHECK(FAILED(hr));
-    }
+    hr = g_documentPool->AppendStatistics(bstrStats);
+    HRCHECK(FAILED(hr));
+
+    hr = g_phaseStats->AppendStatistics(bstrStats);
+    HRCHECK(FAILED(hr));
+
+    hr = g_arenaBlocks->AppendStatistics(bstrStats);
+    HRCHECK(FAILED(hr));
+
+    hr = g_transformPool->AppendStatistics(bstrStats);
+    HRCHECK(FAILED(hr));
+
+    hr = bstrStats.Append(L"</statistics>");
+    HRCHECK(FAILED(hr));
+
+    *pbstrStatistics = bstrStats.Detach();
 
     hr = S_OK;
   Error:
     return hr;
 }
 
-
-// BEGIN BACK COMPAT
-
 // ============================================================================
-// CXMLServerDocument::LoadMasterConfig
-//      Loads in the /xslisapi/masterConfig.xml file.  If there's a
-//      special ProcessingInstruction attribute to use based upon the
-//      <client> element matching the user-agent string, set it.
+// CXMLServerDocument::TransformBatch
+//      Render a list of pages to files (see CBatchRenderer).
 
-HRESULT
-CXMLServerDocument::LoadMasterConfig(CComBSTR & bstrSpecialPIAttrib)
+STDMETHODIMP
+CXMLServerDocument::TransformBatch(
+    BSTR bstrJobs,                          // [in] <batch> of <job>s
+    BSTR bstrRootDirectory,                 // [in] directory of the site
+    long nThreads,                          // [in] threads to render on
+    long nTimeoutSeconds,                   // [in] 0 for the default
+    BSTR *pbstrReport)                      // [out, retval] report XML
 {
-    HRESULT                  hr;
-    CComPtr<IXMLDOMDocument> pcomMasterConfig;
-    CComPtr<IXMLDOMNodeList> pcomClientNodes;
-    CComPtr<IXMLDOMNode>     pcomClientNode;
-    CComBSTR                 tempStr;
-    bool                     foundMatch;
-    wchar_t                  pwszConfigFilename[] = L"/xslisapi/masterConfig.xml";
-
-    if (m_bInErrorHandling) {
-        // Don't do anything with the master config when we're
-        // handling an error.
-        RETURNERR(S_OK);
+    HRESULT                   hr;
+    CComPtr<IXMLDOMDocument>  pcomJobs;
+    CComPtr<IXMLDOMNodeList>  pcomJobList;
+    CComPtr<IXMLDOMNode>      pcomJob;
+    VARIANT_BOOL              result;
+    CComBSTR                  bstrURL;
+    CComBSTR                  bstrUserAgent;
+    CComBSTR                  bstrOutput;
+    CComBSTR                  bstrOutputDirectory;
+    CBatchRenderer           *pBatch = NULL;
+
+    ERRCHECK(pbstrReport == NULL, E_POINTER);
+    *pbstrReport = NULL;
+
+    ERRCHECK(SysStringLen(bstrRootDirectory) == 0, E_INVALIDARG);
+
+    if (nTimeoutSeconds <= 0) {
+        nTimeoutSeconds = DEFAULT_BATCH_TIMEOUT;
+    } else if (nTimeoutSeconds > MAX_BATCH_TIMEOUT) {
+        nTimeoutSeconds = MAX_BATCH_TIMEOUT;
     }
-    
-    // TODO: Note that this entire processing doesn't really need to
-    // happen for each transform that occurs.  But since it's mostly
-    // for backwards compatability with version 1.1, we don't optimize
-    // it.  Also, it's not so bad because the config file is likely to
-    // be in the cache.
-    
-    hr = LoadXMLFromRelativeLoc(pwszConfigFilename,
-                                NULL,
-                                false,
-                                &pcomMasterConfig,
-                                NULL);
 
-    // This config file is optional.
-    if (FAILED(hr)) {
-        ClearError();
-        RETURNERR(S_OK);
-    }
+    pBatch = new CBatchRenderer();
+    ERRCHECK(pBatch == NULL, E_OUTOFMEMORY);
 
-    // Deal with cache timeout
-    hr = GetSingleNodeValue(pcomMasterConfig,
-                            L"/config/cache/@cleanup",
-                            &tempStr);
+    hr = GetBatchOutputDirectory(bstrRootDirectory, bstrOutputDirectory);
     HRCHECK(FAILED(hr));
 
-    hr = g_xmlCache->SetMinutes(_wtoi(tempStr));
+    hr = pBatch->SetOutputDirectory(bstrOutputDirectory);
     HRCHECK(FAILED(hr));
-                            
-    // Look for encoding if it hasn't been set
-    if (!m_bstrEncoding.Length()) {
-        hr = GetSingleNodeValue(pcomMasterConfig,
-                                L"/config/output/@encoding",
-                                &m_bstrEncoding);
-        HRCHECK(FAILED(hr));
-    }
 
-    // Deal with <client> elements
-    hr = pcomMasterConfig->selectNodes(L"/config/client",
-                                       &pcomClientNodes);
+    hr = CreateXMLDocumentOnCComPtr(pcomJobs);
     HRCHECK(FAILED(hr));
 
-    foundMatch = false;
-    hr = pcomClientNodes->nextNode(&pcomClientNode);
+    hr = pcomJobs->loadXML(bstrJobs, &result);
     HRCHECK(FAILED(hr));
+    ERRCHECK(result == VARIANT_FALSE, E_INVALIDARG);
 
-    while (!foundMatch && pcomClientNode.p != NULL) {
+    hr = pcomJobs->selectNodes(L"/batch/job", &pcomJobList);
+    HRCHECK(FAILED(hr));
 
-        tempStr.Empty();
-        hr = GetSingleNodeValue(pcomClientNode,
-                                L"@name",
-                                &tempStr);
+    for (;;) {
+        pcomJob.Release();
+        hr = pcomJobList->nextNode(&pcomJob);
         HRCHECK(FAILED(hr));
 
-        if (wcsstr(m_bstrUserAgent, tempStr)) {
+        if (pcomJob.p == NULL) {
+            break;
+        }
 
-            hr = GetSingleNodeValue(pcomClientNode,
-                                    L"@href",
-                                    &bstrSpecialPIAttrib);
-            HRCHECK(FAILED(hr));
+        bstrURL.Empty();
+        hr = GetSingleNodeValue(pcomJob, L"@url", &bstrURL);
+        HRCHECK(FAILED(hr));
 
-            if (bstrSpecialPIAttrib.m_str == NULL) {
-                SetError(L"Matching <client> element found without 'href' attribute",
-                         pwszConfigFilename,
-                         L"500.100 Internal Server Error - ASP Error");
-                RETURNERR(E_FAIL);
-            }
-            
-            foundMatch = true;
-            
-        }
-        
-        pcomClientNode.Release();
-        hr = pcomClientNodes->nextNode(&pcomClientNode);
+        bstrUserAgent.Empty();
+        hr = GetSingleNodeValue(pcomJob, L"@user-agent", &bstrUserAgent);
+        HRCHECK(FAILED(hr));
+
+        bstrOutput.Empty();
+        hr = GetSingleNodeValue(pcomJob, L"@output", &bstrOutput);
+        HRCHECK(FAILED(hr));
+
+        ERRCHECK(bstrURL.m_str == NULL || bstrOutput.m_str == NULL,
+                 E_INVALIDARG);
+
+        // A file outside the output directory fails the whole batch,
+        // before anything's written.
+        hr = pBatch->AddJob(bstrURL, bstrUserAgent, bstrOutput);
         HRCHECK(FAILED(hr));
     }
 
+    hr = pBatch->Run(bstrRootDirectory, nThreads, nTimeoutSeconds * 1000);
+    HRCHECK(FAILED(hr));
+
+    hr = pBatch->GetReport(pbstrReport);
+    HRCHECK(FAILED(hr));
+
     hr = S_OK;
   Error:
+    if (pBatch) {
+        pBatch->Release();
+    }
     return hr;
 }
-// END BACK COMPAT
 
 // ============================================================================
-// CXMLServerDocument::GetServerConfig
-//      Pulls the server-config attribute out of the <?xml-stylesheet>
-//      processing instruction, if there is one.  Else returns NULL.
+// CXMLServerDocument::GetBatchOutputDirectory
+//      Where TransformBatch may write files: the directory named by
+//      /config/batch/@output-directory in the site's masterConfig.xml,
+//      or else the application's, when called from an ASP page, or else
+//      the site's.
+
 HRESULT
-CXMLServerDocument::GetServerConfig(IXMLDOMDocument **ppServerConfig)
+CXMLServerDocument::GetBatchOutputDirectory(
+    BSTR bstrRootDirectory,                 // [in] directory of the site
+    CComBSTR & bstrDirectory)               // [out] full local path
 {
-    HRESULT   hr;
-    CComBSTR  bstrPIContents;
+    HRESULT                          hr;
+    CComObject<CXMLServerDocument>  *pSite = NULL;
+    CComPtr<IXMLDOMDocument>         pcomMasterConfig;
+    wchar_t                          pwszConfigFilename[] = L"/xslisapi/masterConfig.xml";
 
-    wchar_t *serverConfigFilename = m_piParseInfo.Find(L"server-config");
+    bstrDirectory.Empty();
 
-    if (serverConfigFilename == NULL) {
-        
-        *ppServerConfig = NULL;
-        
-    } else {
+    // The site's masterConfig.xml is found as its pages would find it,
+    // by a document rendering offline.  It's optional.
+    hr = CComObject<CXMLServerDocument>::CreateInstance(&pSite);
+    HRCHECK(FAILED(hr));
+    pSite->AddRef();
+
+    pSite->m_bstrRootDirectory = bstrRootDirectory;
+    ERRCHECK(pSite->m_bstrRootDirectory.m_str == NULL, E_OUTOFMEMORY);
+
+    hr = pSite->LoadXMLFromRelativeLoc(pwszConfigFilename,
+                                       NULL,
+                                       false,
+                                       &pcomMasterConfig,
+                                       NULL,
+                                       NULL,
+                                       NULL);
+    if (SUCCEEDED(hr)) {
+        hr = GetSingleNodeValue(pcomMasterConfig,
+                                L"/config/batch/@output-directory",
+                                &bstrDirectory);
+        HRCHECK(FAILED(hr));
+    }
 
-        m_bstrURLServerConfig = serverConfigFilename;
-        ERRCHECK(m_bstrURLServerConfig.m_str == NULL, E_OUTOFMEMORY);
-        
-        hr = LoadXMLFromRelativeLoc(m_bstrURLServerConfig,
-                                    m_bstrURLDirectory,
-                                    true,
-                                    ppServerConfig,
-                                    NULL);
+    if (bstrDirectory.Length() == 0 && SUCCEEDED(EnsureAspRequestObject())) {
+        bstrDirectory.Empty();
+        hr = ::GetServerVariable(m_pcomASPRequest,
+                                 L"APPL_PHYSICAL_PATH",
+                                 bstrDirectory);
         HRCHECK(FAILED(hr));
     }
 
+    if (bstrDirectory.Length() == 0) {
+        bstrDirectory = bstrRootDirectory;
+        ERRCHECK(bstrDirectory.m_str == NULL, E_OUTOFMEMORY);
+    }
+
     hr = S_OK;
   Error:
+    if (pSite) {
+        pSite->Release();
+    }
     return hr;
 }
 
-enum PathDisposition {
-    pathDispositionRelativePath,
-    pathDispositionAbsolutePath,
-    pathDispositionAbsolutePathWithDriveSpec,
-    pathDispositionHttpPath
-};
-
 // ============================================================================
-// GetPathDisposition
-//     Figure out the type of path the parameter represents.
-//
-PathDisposition
-GetPathDisposition(BSTR localName)
+// CXMLServerDocument::RenderOffline
+//      Load a page of the site and transform it into pOutput, as if it
+//      had been requested by bstrUserAgent.  Without a request there's
+//      no BrowserType object, so browser capabilities come from the
+//      native browscap.ini reader, or from what's been recorded for
+//      the User-Agent by earlier requests.
+
+HRESULT
+CXMLServerDocument::RenderOffline(
+    BSTR     bstrRootDirectory,             // [in] directory of the site
+    BSTR     bstrURL,                       // [in] page, e.g. "/a/b.xml"
+    BSTR     bstrUserAgent,                 // [in] browser, or NULL
+    IStream *pOutput)                       // [in] where to write it
 {
-    PathDisposition pathDisposition;
-    const wchar_t   wszHttpPrefix[] = L"http://";
-    const UINT      nHttpPrefix = COUNTOF(wszHttpPrefix);
-    
-    if (SysStringLen(localName) >= nHttpPrefix &&
-        wcsncmp(localName, wszHttpPrefix, nHttpPrefix-1) == 0) {
+    HRESULT  hr;
+    CComBSTR bstrPath;
 
-        // http:// path
-        pathDisposition = pathDispositionHttpPath;
-        
-    } else if (localName[0] == L'/' ||
-               localName[0] == L'\\') {
+    ASSERT(pOutput);
 
-        // absolute local path
-        pathDisposition = pathDispositionAbsolutePath;
+    m_bstrRootDirectory = bstrRootDirectory;
+    ERRCHECK(m_bstrRootDirectory.m_str == NULL, E_OUTOFMEMORY);
 
-    } else if (localName[1] == L':' &&
-               (localName[2] == L'/' ||
-                localName[2] == L'\\')) {
+    hr = put_URL(bstrURL);
+    HRCHECK(FAILED(hr));
 
-        // absolute local path with drive spec
-        pathDisposition = pathDispositionAbsolutePathWithDriveSpec;
-            
-    } else {
+    m_bstrUserAgent = bstrUserAgent;
 
-        // relative local path
-        pathDisposition = pathDispositionRelativePath;
-    }
+    hr = MapVirtualPath(bstrURL, &bstrPath);
+    HRCHECK(FAILED(hr));
 
-    return pathDisposition;
-    
+    hr = Load(bstrPath);
+    HRCHECK(FAILED(hr));
+
+    m_pcomOfflineOutput = pOutput;
+    hr = TransformTo(NULL);
+    m_pcomOfflineOutput.Release();
+    HRCHECK(FAILED(hr));
+
+    hr = S_OK;
+  Error:
+    return hr;
 }
 
-    
 // ============================================================================
-// CXMLServerDocument::LoadXMLFromRelativeLoc
-//     Loads in an XML document from a file specification, possibly
-//     relative to the provided path.  XML document is created,
-//     loaded, and returned.
-HRESULT
-CXMLServerDocument::LoadXMLFromRelativeLoc(
-    BSTR localName,             // [in] specified local name
-    BSTR pathName,              // [in] relative to this path
-    bool isConfigXML,           // [in] true when loading
-                                // server-config only.
+// CXMLServerDocument::WriteIdentityXML
+//      Simply write out the XML document to the response (setting the
+//      content type along the way), or to m_pcomOfflineOutput if
+//      pResponse is NULL
 
-    // Only one of the next two will actually be loaded.  If the
-    // incoming ppTemplate != NULL, we'll see if we can create an XSL
-    // Template out of whatever we find.
-    IXMLDOMDocument **ppXMLDoc,   // [out] XML document that's been
-                                  // populated.  May have been in
-                                  // cache. 
-    IXSLTemplate    **ppTemplate  // [out] XSL template that's been
-                                  // populated.  May have been in
-                                  // cache. 
-    )
+HRESULT
+CXMLServerDocument::WriteIdentityXML(asp::IResponse *pResponse)
 {
-    HRESULT hr;
-    CComBSTR                 bstrResolvedPath;
-    CComBSTR                 bstrServerMappedPath;
-    CComPtr<IXMLDOMDocument> pcomXMLDoc;
-    char                    *pszServerMappedPath;
-    bool                     bIsHTTPPath = false;
-
-    ASSERT(*ppXMLDoc == NULL);
-    ASSERT(!ppTemplate || (*ppTemplate == NULL));
-
-    switch (GetPathDisposition(localName)) {
-      case pathDispositionHttpPath:
-      case pathDispositionAbsolutePath:
-        bstrResolvedPath = localName;
-        break;
+    HRESULT     hr;
+    CComBSTR    bstrETag;
+    bool        bNotModified;
+    CComVariant varOutput;
+
+    // An error page is only reused if it came from stylesheets.
+    if (m_pCapturePage) {
+        RETURNERR(S_FALSE);
+    }
 
-      case pathDispositionAbsolutePathWithDriveSpec:
-        SetError(L"File specifications with drive references are not allowed.",
-                 localName,
-                 L"403.2 - Forbidden - Read Access Forbidden");
-        RETURNERR(E_FAIL);
-        break;
+    if (pResponse) {
+        hr = ComputeETag(NULL, NULL, 0, L"text/xml", NULL, 0, NULL, bstrETag);
+        HRCHECK(FAILED(hr));
 
-      case pathDispositionRelativePath:
-        hr = g_fileSystemObject->BuildPath(pathName,
-                                           localName,
-                                           &bstrResolvedPath);
+        hr = CheckNotModified(pResponse, bstrETag, &bNotModified);
         HRCHECK(FAILED(hr));
-        break;
 
-      default:
-        RETURNERR(E_FAIL);
-        break;
+        if (bNotModified) {
+            RETURNERR(S_OK);
+        }
     }
 
-    // Only for the server-config xml...
-    if (isConfigXML) {
-        // Stash away the directory that the server-config file is
-        // in.  Stylesheets will be loaded relative to this
-        // directory.
-        m_bstrConfigDirectory.Empty();
-        hr = g_fileSystemObject->GetParentFolderName(bstrResolvedPath,
-                                                     &m_bstrConfigDirectory);
+    hr = EnsureSourceLoaded();
+    HRCHECK(FAILED(hr));
+    
+    if (pResponse) {
+        hr = pResponse->put_ContentType(L"text/xml");
         HRCHECK(FAILED(hr));
-    }
 
-    hr = EnsureAspServerObject();
-    HRCHECK(FAILED(hr));
+        varOutput = pResponse;
+    } else {
+        varOutput = m_pcomOfflineOutput;
+    }
 
-    switch (GetPathDisposition(bstrResolvedPath)) {
+    // It's possible we got here because of a bad XML document.  If
+    // attempting to save here returns an error it may be that there's
+    // a parse error.  Check for it. 
+    hr = m_pcomXMLDocument->save(varOutput);
+    if (FAILED(hr)) {
+        HRESULT parseError;
         
-      case pathDispositionHttpPath:
-        bstrServerMappedPath = bstrResolvedPath;
-        break;
-
-      case pathDispositionAbsolutePathWithDriveSpec:
-        SetError(L"File specifications with drive references are not allowed.",
-                 localName,
-                 L"403.2 - Forbidden - Read Access Forbidden");
-        RETURNERR(E_FAIL);
-        break;
+        hr = DealWithParseError(m_pcomXMLDocument,
+                                m_bstrURL,
+                                this,
+                                &parseError);
+        HRCHECK(FAILED(hr));
 
-      case pathDispositionAbsolutePath:
-      case pathDispositionRelativePath:
-        hr = m_pcomASPServer->MapPath(bstrResolvedPath,
-                                      &bstrServerMappedPath);
-        if (FAILED(hr)) {
-            SetError(L"Unsupported path specification",
-                     localName,
-                     L"404 - Not Found");
-            RETURNERR(hr);
-        }
-        break;
-        
-      default:
-        RETURNERR(E_FAIL);
-        break;
+        hr = parseError;
+        HRCHECK(FAILED(hr));
     }
 
-    // TODO: Could modify cache/hashtable to work over wide strings,
-    // so we don't need to convert.
-    pszServerMappedPath = WideToAscii(bstrServerMappedPath);
-
-    // Note: ->Lookup does an AddRef().  Note that it also loads the
-    // file if not present in the cache, and adds it to the cache.
-    // Therefore, the only client call that needs to be made into the
-    // cache is Lookup().
-    hr = g_xmlCache->Lookup(pszServerMappedPath,
-                            localName,
-                            bIsHTTPPath,
-                            this,
-                            ppXMLDoc,
-                            ppTemplate);
-    delete [] pszServerMappedPath;
-    HRCHECK(FAILED(hr));
+    if (pResponse) {
+        hr = SendValidators(pResponse, bstrETag, true);
+        HRCHECK(FAILED(hr));
+    }
 
     hr = S_OK;
   Error:
@@ -748,546 +1088,2377 @@ CXMLServerDocument::LoadXMLFromRelativeLoc(
 }
 
 
+// BEGIN BACK COMPAT
+
 // ============================================================================
-// CXMLServerDocument::GetBrowserCap
-//      Get the browser capabilities object from the IIS environment
-//      and stash away in a member variable.  Also grab the content
-//      type, charset and encoding here (if they're specified in
-//      browscap.ini) 
+// CXMLServerDocument::LoadMasterConfig
+//      Loads in the /xslisapi/masterConfig.xml file.  If there's a
+//      special ProcessingInstruction attribute to use based upon the
+//      <client> element matching the user-agent string, set it.
+
 HRESULT
-CXMLServerDocument::InitializeBrowserCapAndAttribs()
+CXMLServerDocument::LoadMasterConfig(CComBSTR & bstrSpecialPIAttrib)
 {
-    HRESULT hr;
+    HRESULT                  hr;
+    CComPtr<IXMLDOMDocument> pcomMasterConfig;
+    XmlCacheInfo             masterConfigInfo;
+    CComBSTR                 bstrMasterConfigPath;
+    CComPtr<IXMLDOMNodeList> pcomClientNodes;
+    CComPtr<IXMLDOMNode>     pcomClientNode;
+    CComBSTR                 tempStr;
+    bool                     foundMatch;
+    wchar_t                  pwszConfigFilename[] = L"/xslisapi/masterConfig.xml";
+
+    if (m_bInErrorHandling) {
+        // Don't do anything with the master config when we're
+        // handling an error.
+        RETURNERR(S_OK);
+    }
+
+    m_cbCompressMin = -1;
+    m_bstrProfilesConfig.Empty();
+    ZeroMemory(&m_profilesInfo, sizeof(m_profilesInfo));
+    
+    // TODO: Note that this entire processing doesn't really need to
+    // happen for each transform that occurs.  But since it's mostly
+    // for backwards compatability with version 1.1, we don't optimize
+    // it.  Also, it's not so bad because the config file is likely to
+    // be in the cache.
+    
+    hr = LoadXMLFromRelativeLoc(pwszConfigFilename,
+                                NULL,
+                                false,
+                                &pcomMasterConfig,
+                                NULL,
+                                &bstrMasterConfigPath,
+                                &masterConfigInfo);
+
+    // This config file is optional.
+    if (FAILED(hr)) {
+        ClearError();
+        RETURNERR(S_OK);
+    }
+
+    // Deal with cache timeout
+    hr = GetSingleNodeValue(pcomMasterConfig,
+                            L"/config/cache/@cleanup",
+                            &tempStr);
+    HRCHECK(FAILED(hr));
+
+    hr = g_xmlCache->SetMinutes(_wtoi(tempStr));
+    HRCHECK(FAILED(hr));
+
+    hr = g_chainCache->SetMinutes(_wtoi(tempStr));
+    HRCHECK(FAILED(hr));
+
+    // Bound on the number of intermediate chain results to keep
+    tempStr.Empty();
+    hr = GetSingleNodeValue(pcomMasterConfig,
+                            L"/config/cache/@chain-entries",
+                            &tempStr);
+    HRCHECK(FAILED(hr));
+
+    if (tempStr.m_str != NULL) {
+        hr = g_chainCache->SetMaxEntries(_wtoi(tempStr));
+        HRCHECK(FAILED(hr));
+    }
+
+    // Number of intermediate documents to keep for reuse
+    tempStr.Empty();
+    hr = GetSingleNodeValue(pcomMasterConfig,
+                            L"/config/cache/@documents",
+                            &tempStr);
+    HRCHECK(FAILED(hr));
+
+    if (tempStr.m_str != NULL) {
+        hr = g_documentPool->SetMaxDocuments(_wtoi(tempStr));
+        HRCHECK(FAILED(hr));
+    }
+
+    // Number of threads for loading stylesheets in parallel (0 disables)
+    tempStr.Empty();
+    hr = GetSingleNodeValue(pcomMasterConfig,
+                            L"/config/cache/@prefetch-threads",
+                            &tempStr);
+    HRCHECK(FAILED(hr));
+
+    if (tempStr.m_str != NULL) {
+        hr = g_workerPool->SetMaxThreads(_wtoi(tempStr));
+        HRCHECK(FAILED(hr));
+    }
+
+    // Threads to run transforms on (0 runs them on the request), how
+    // many may wait for one before requests are turned away, and how
+    // long a request waits
+    tempStr.Empty();
+    hr = GetSingleNodeValue(pcomMasterConfig,
+                            L"/config/transform/@threads",
+                            &tempStr);
+    HRCHECK(FAILED(hr));
+
+    if (tempStr.m_str != NULL) {
+        long nThreads = _wtol(tempStr);
+
+        tempStr.Empty();
+        hr = GetSingleNodeValue(pcomMasterConfig,
+                                L"/config/transform/@max-queue",
+                                &tempStr);
+        HRCHECK(FAILED(hr));
+
+        long maxQueue = (tempStr.m_str != NULL) ?
+                            _wtol(tempStr) : DEFAULT_TRANSFORM_QUEUE;
+
+        tempStr.Empty();
+        hr = GetSingleNodeValue(pcomMasterConfig,
+                                L"/config/transform/@timeout-ms",
+                                &tempStr);
+        HRCHECK(FAILED(hr));
+
+        hr = g_transformPool->Configure(nThreads,
+                                        maxQueue,
+                                        (tempStr.m_str != NULL) ?
+                                            _wtol(tempStr) :
+                                            DEFAULT_TRANSFORM_TIMEOUT);
+        HRCHECK(FAILED(hr));
+    }
+
+    // Whether to remember browser capabilities across requests
+    tempStr.Empty();
+    hr = GetSingleNodeValue(pcomMasterConfig,
+                            L"/config/cache/@browser-caps",
+                            &tempStr);
+    HRCHECK(FAILED(hr));
+
+    if (tempStr.m_str != NULL) {
+        g_browserCapsCache->SetEnabled(lstrcmpiW(tempStr, L"off") != 0);
+    }
+
+    // Whether to reuse the error pages HandleError renders
+    tempStr.Empty();
+    hr = GetSingleNodeValue(pcomMasterConfig,
+                            L"/config/cache/@error-pages",
+                            &tempStr);
+    HRCHECK(FAILED(hr));
+
+    if (tempStr.m_str != NULL) {
+        g_errorPageCache->SetEnabled(lstrcmpiW(tempStr, L"off") != 0);
+    }
+
+    // Encoding to give written XML to the parser in, UTF-16 unless
+    // the config says otherwise (now, not just when it was last read)
+    tempStr.Empty();
+    hr = GetSingleNodeValue(pcomMasterConfig,
+                            L"/config/input/@encoding",
+                            &tempStr);
+    HRCHECK(FAILED(hr));
+
+    g_bUTF8Input = (tempStr.m_str != NULL &&
+                    lstrcmpiW(tempStr, L"UTF-8") == 0);
+
+    // Whether to read browscap.ini ourselves instead of asking
+    // MSWC.BrowserType, and a file of sections to add to it
+    tempStr.Empty();
+    hr = GetSingleNodeValue(pcomMasterConfig,
+                            L"/config/browscap/@native",
+                            &tempStr);
+    HRCHECK(FAILED(hr));
+
+    {
+        bool     bNative = (tempStr.m_str != NULL &&
+                            lstrcmpiW(tempStr, L"on") == 0);
+        CComBSTR bstrAdditions;
+
+        if (bNative) {
+            hr = GetSingleNodeValue(pcomMasterConfig,
+                                    L"/config/browscap/@additions",
+                                    &bstrAdditions);
+            HRCHECK(FAILED(hr));
+        }
+
+        hr = g_browscap->Configure(bNative, bstrAdditions);
+        HRCHECK(FAILED(hr));
+    }
+
+    // Timing of the phases of Transform
+    tempStr.Empty();
+    hr = GetSingleNodeValue(pcomMasterConfig,
+                            L"/config/statistics/@timing",
+                            &tempStr);
+    HRCHECK(FAILED(hr));
+
+    if (tempStr.m_str != NULL) {
+        bool bTiming = (lstrcmpiW(tempStr, L"on") == 0);
+
+        tempStr.Empty();
+        hr = GetSingleNodeValue(pcomMasterConfig,
+                                L"/config/statistics/@log-interval",
+                                &tempStr);
+        HRCHECK(FAILED(hr));
+
+        g_phaseStats->Configure(bTiming,
+                                (tempStr.m_str != NULL) ?
+                                    _wtol(tempStr) :
+                                    DEFAULT_TIMING_LOG_INTERVAL);
+    }
+
+    // Log of slow requests
+    tempStr.Empty();
+    hr = GetSingleNodeValue(pcomMasterConfig,
+                            L"/config/statistics/@slow-request-ms",
+                            &tempStr);
+    HRCHECK(FAILED(hr));
+
+    if (tempStr.m_str != NULL) {
+        CComBSTR bstrLogPath;
+        long     thresholdMs = _wtol(tempStr);
+
+        hr = GetSingleNodeValue(pcomMasterConfig,
+                                L"/config/statistics/@slow-request-log",
+                                &bstrLogPath);
+        HRCHECK(FAILED(hr));
+
+        tempStr.Empty();
+        hr = GetSingleNodeValue(pcomMasterConfig,
+                                L"/config/statistics/@slow-request-log-kb",
+                                &tempStr);
+        HRCHECK(FAILED(hr));
+
+        hr = g_slowRequestLog->Configure(thresholdMs,
+                                         bstrLogPath,
+                                         (tempStr.m_str != NULL) ?
+                                             _wtol(tempStr) : 0);
+        HRCHECK(FAILED(hr));
+    }
+
+    // Compression of the output, for clients that accept it
+    tempStr.Empty();
+    hr = GetSingleNodeValue(pcomMasterConfig,
+                            L"/config/output/@compression",
+                            &tempStr);
+    HRCHECK(FAILED(hr));
+
+    if (tempStr.m_str != NULL && lstrcmpiW(tempStr, L"on") == 0) {
+        m_cbCompressMin = DEFAULT_COMPRESSION_THRESHOLD;
+
+        tempStr.Empty();
+        hr = GetSingleNodeValue(pcomMasterConfig,
+                                L"/config/output/@compression-threshold",
+                                &tempStr);
+        HRCHECK(FAILED(hr));
+
+        if (tempStr.m_str != NULL && _wtol(tempStr) >= 0) {
+            m_cbCompressMin = _wtol(tempStr);
+        }
+    }
+
+    // Size of the writes to a Response without IStream, the default
+    // again if the attribute has been taken out
+    tempStr.Empty();
+    hr = GetSingleNodeValue(pcomMasterConfig,
+                            L"/config/output/@write-buffer-kb",
+                            &tempStr);
+    HRCHECK(FAILED(hr));
+
+    g_cbResponseWriteBuffer = (tempStr.m_str != NULL && _wtol(tempStr) >= 0) ?
+                                  _wtol(tempStr) * 1024 :
+                                  DEFAULT_RESPONSE_WRITE_BUFFER;
+
+    // Post-processing profiles, compiled when the file changes, and
+    // kept by its path, so that each site gets its own
+    m_bstrProfilesConfig = (bstrMasterConfigPath.m_str != NULL) ?
+                               bstrMasterConfigPath.m_str :
+                               pwszConfigFilename;
+    ERRCHECK(m_bstrProfilesConfig.m_str == NULL, E_OUTOFMEMORY);
+
+    hr = g_processingProfiles->Configure(pcomMasterConfig,
+                                         masterConfigInfo,
+                                         bstrMasterConfigPath,
+                                         pwszConfigFilename,
+                                         this,
+                                         &m_profilesInfo);
+    HRCHECK(FAILED(hr));
+                            
+    // Look for encoding if it hasn't been set
+    if (!m_bstrEncoding.Length()) {
+        hr = GetSingleNodeValue(pcomMasterConfig,
+                                L"/config/output/@encoding",
+                                &m_bstrEncoding);
+        HRCHECK(FAILED(hr));
+    }
+
+    // Deal with <client> elements
+    hr = pcomMasterConfig->selectNodes(L"/config/client",
+                                       &pcomClientNodes);
+    HRCHECK(FAILED(hr));
+
+    foundMatch = false;
+    hr = pcomClientNodes->nextNode(&pcomClientNode);
+    HRCHECK(FAILED(hr));
+
+    while (!foundMatch && pcomClientNode.p != NULL) {
+
+        tempStr.Empty();
+        hr = GetSingleNodeValue(pcomClientNode,
+                                L"@name",
+                                &tempStr);
+        HRCHECK(FAILED(hr));
+
+        if (wcsstr(m_bstrUserAgent, tempStr)) {
+
+            hr = GetSingleNodeValue(pcomClientNode,
+                                    L"@href",
+                                    &bstrSpecialPIAttrib);
+            HRCHECK(FAILED(hr));
+
+            if (bstrSpecialPIAttrib.m_str == NULL) {
+                SetError(L"Matching <client> element found without 'href' attribute",
+                         pwszConfigFilename,
+                         L"500.100 Internal Server Error - ASP Error");
+                RETURNERR(E_FAIL);
+            }
+            
+            foundMatch = true;
+            
+        }
+        
+        pcomClientNode.Release();
+        hr = pcomClientNodes->nextNode(&pcomClientNode);
+        HRCHECK(FAILED(hr));
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+// END BACK COMPAT
+
+// ============================================================================
+// CXMLServerDocument::GetServerConfig
+//      Pulls the server-config attribute out of the <?xml-stylesheet>
+//      processing instruction, if there is one.  Else returns NULL.
+HRESULT
+CXMLServerDocument::GetServerConfig(IXMLDOMDocument **ppServerConfig)
+{
+    HRESULT   hr;
+    CComBSTR  bstrPIContents;
+
+    wchar_t *serverConfigFilename = m_piParseInfo.Find(L"server-config");
+
+    if (serverConfigFilename == NULL) {
+        
+        *ppServerConfig = NULL;
+        
+    } else {
+
+        m_bstrURLServerConfig = serverConfigFilename;
+        ERRCHECK(m_bstrURLServerConfig.m_str == NULL, E_OUTOFMEMORY);
+        
+        hr = LoadXMLFromRelativeLoc(m_bstrURLServerConfig,
+                                    m_bstrURLDirectory,
+                                    true,
+                                    ppServerConfig,
+                                    NULL,
+                                    &m_bstrServerConfigPath,
+                                    &m_serverConfigInfo);
+        HRCHECK(FAILED(hr));
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+enum PathDisposition {
+    pathDispositionRelativePath,
+    pathDispositionAbsolutePath,
+    pathDispositionAbsolutePathWithDriveSpec,
+    pathDispositionHttpPath
+};
+
+// ============================================================================
+// GetPathDisposition
+//     Figure out the type of path the parameter represents.
+//
+PathDisposition
+GetPathDisposition(BSTR localName)
+{
+    PathDisposition pathDisposition;
+    const wchar_t   wszHttpPrefix[] = L"http://";
+    const UINT      nHttpPrefix = COUNTOF(wszHttpPrefix);
+    
+    if (SysStringLen(localName) >= nHttpPrefix &&
+        wcsncmp(localName, wszHttpPrefix, nHttpPrefix-1) == 0) {
+
+        // http:// path
+        pathDisposition = pathDispositionHttpPath;
+        
+    } else if (localName[0] == L'/' ||
+               localName[0] == L'\\') {
+
+        // absolute local path
+        pathDisposition = pathDispositionAbsolutePath;
+
+    } else if (localName[1] == L':' &&
+               (localName[2] == L'/' ||
+                localName[2] == L'\\')) {
+
+        // absolute local path with drive spec
+        pathDisposition = pathDispositionAbsolutePathWithDriveSpec;
+            
+    } else {
+
+        // relative local path
+        pathDisposition = pathDispositionRelativePath;
+    }
+
+    return pathDisposition;
+    
+}
+
+    
+// ============================================================================
+// CXMLServerDocument::MapVirtualPath
+//     Turn a path on the web site into a local file path, as
+//     Server.MapPath does.  When rendering offline, the site is the
+//     directory given to RenderOffline instead, and paths that go up
+//     out of it aren't allowed.
+HRESULT
+CXMLServerDocument::MapVirtualPath(
+    BSTR bstrPath,                          // [in] path on the site
+    BSTR *pbstrMappedPath)                  // [out] local file path
+{
+    HRESULT   hr;
+    CComBSTR  bstrMappedPath;
+    UINT      ichStart;
+    wchar_t  *pwch;
+
+    if (!IsOffline()) {
+        hr = EnsureAspServerObject();
+        HRCHECK(FAILED(hr));
+
+        hr = m_pcomASPServer->MapPath(bstrPath, pbstrMappedPath);
+        RETURNERR(hr);
+    }
+
+    ERRCHECK(wcsstr(bstrPath, L"..") != NULL, E_INVALIDARG);
+
+    bstrMappedPath = m_bstrRootDirectory;
+    ERRCHECK(bstrMappedPath.m_str == NULL, E_OUTOFMEMORY);
+
+    ichStart = bstrMappedPath.Length();
+    if (bstrPath[0] != L'/' && bstrPath[0] != L'\\') {
+        hr = bstrMappedPath.Append(L"\\");
+        HRCHECK(FAILED(hr));
+    }
+
+    hr = bstrMappedPath.Append(bstrPath);
+    HRCHECK(FAILED(hr));
+
+    for (pwch = bstrMappedPath.m_str + ichStart; *pwch; pwch++) {
+        if (*pwch == L'/') {
+            *pwch = L'\\';
+        }
+    }
+
+    *pbstrMappedPath = bstrMappedPath.Detach();
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CXMLServerDocument::ResolveServerMappedPath
+//     Turns a file specification, possibly relative to the provided
+//     path, into the server-mapped path that the XML cache is keyed
+//     on.  Needs the ASP Server object unless rendering offline, so
+//     this must be called on the request thread.
+HRESULT
+CXMLServerDocument::ResolveServerMappedPath(
+    BSTR localName,             // [in] specified local name
+    BSTR pathName,              // [in] relative to this path
+    bool isConfigXML,           // [in] true when loading
+                                // server-config only.
+    BSTR *pbstrServerMappedPath // [out] server-mapped path
+    )
+{
+    HRESULT hr;
+    CComBSTR                 bstrResolvedPath;
+    CComBSTR                 bstrServerMappedPath;
+
+    ASSERT(pbstrServerMappedPath && *pbstrServerMappedPath == NULL);
+
+    switch (GetPathDisposition(localName)) {
+      case pathDispositionHttpPath:
+      case pathDispositionAbsolutePath:
+        bstrResolvedPath = localName;
+        break;
+
+      case pathDispositionAbsolutePathWithDriveSpec:
+        SetError(L"File specifications with drive references are not allowed.",
+                 localName,
+                 L"403.2 - Forbidden - Read Access Forbidden");
+        RETURNERR(E_FAIL);
+        break;
+
+      case pathDispositionRelativePath:
+        hr = g_fileSystemObject->BuildPath(pathName,
+                                           localName,
+                                           &bstrResolvedPath);
+        HRCHECK(FAILED(hr));
+        break;
+
+      default:
+        RETURNERR(E_FAIL);
+        break;
+    }
+
+    // Only for the server-config xml...
+    if (isConfigXML) {
+        // Stash away the directory that the server-config file is
+        // in.  Stylesheets will be loaded relative to this
+        // directory.
+        m_bstrConfigDirectory.Empty();
+        hr = g_fileSystemObject->GetParentFolderName(bstrResolvedPath,
+                                                     &m_bstrConfigDirectory);
+        HRCHECK(FAILED(hr));
+    }
+
+    switch (GetPathDisposition(bstrResolvedPath)) {
+        
+      case pathDispositionHttpPath:
+        bstrServerMappedPath = bstrResolvedPath;
+        break;
+
+      case pathDispositionAbsolutePathWithDriveSpec:
+        SetError(L"File specifications with drive references are not allowed.",
+                 localName,
+                 L"403.2 - Forbidden - Read Access Forbidden");
+        RETURNERR(E_FAIL);
+        break;
+
+      case pathDispositionAbsolutePath:
+      case pathDispositionRelativePath:
+        hr = MapVirtualPath(bstrResolvedPath, &bstrServerMappedPath);
+        if (FAILED(hr)) {
+            SetError(L"Unsupported path specification",
+                     localName,
+                     L"404 - Not Found");
+            RETURNERR(hr);
+        }
+        break;
+        
+      default:
+        RETURNERR(E_FAIL);
+        break;
+    }
+
+    *pbstrServerMappedPath = bstrServerMappedPath.Detach();
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CXMLServerDocument::LoadXMLFromRelativeLoc
+//     Loads in an XML document from a file specification, possibly
+//     relative to the provided path.  XML document is created,
+//     loaded, and returned.
+HRESULT
+CXMLServerDocument::LoadXMLFromRelativeLoc(
+    BSTR localName,             // [in] specified local name
+    BSTR pathName,              // [in] relative to this path
+    bool isConfigXML,           // [in] true when loading
+                                // server-config only.
+
+    // Only one of the next two will actually be loaded.  If the
+    // incoming ppTemplate != NULL, we'll see if we can create an XSL
+    // Template out of whatever we find.
+    IXMLDOMDocument **ppXMLDoc,   // [out] XML document that's been
+                                  // populated.  May have been in
+                                  // cache. 
+    IXSLTemplate    **ppTemplate, // [out] XSL template that's been
+                                  // populated.  May have been in
+                                  // cache. 
+    BSTR             *pbstrMappedPath, // [out] optional, server-mapped
+                                       // path of what was loaded
+    XmlCacheInfo     *pInfo,      // [out] optional, version of what
+                                  // was loaded
+    bool             *pbCacheHit  // [out] optional, whether it came
+                                  // from the cache
+    )
+{
+    HRESULT hr;
+    CComBSTR                 bstrServerMappedPath;
+    char                    *pszServerMappedPath;
+    bool                     bIsHTTPPath = false;
+
+    ASSERT(*ppXMLDoc == NULL);
+    ASSERT(!ppTemplate || (*ppTemplate == NULL));
+
+    hr = ResolveServerMappedPath(localName,
+                                 pathName,
+                                 isConfigXML,
+                                 &bstrServerMappedPath);
+    HRCHECK(FAILED(hr));
+
+    // TODO: Could modify cache/hashtable to work over wide strings,
+    // so we don't need to convert.
+    pszServerMappedPath = m_arena.WideToAscii(bstrServerMappedPath);
+    ERRCHECK(pszServerMappedPath == NULL, E_OUTOFMEMORY);
+
+    // Note: ->Lookup does an AddRef().  Note that it also loads the
+    // file if not present in the cache, and adds it to the cache.
+    // Therefore, the only client call that needs to be made into the
+    // cache is Lookup().
+    hr = g_xmlCache->Lookup(pszServerMappedPath,
+                            localName,
+                            bIsHTTPPath,
+                            this,
+                            ppXMLDoc,
+                            ppTemplate,
+                            pInfo,
+                            pbCacheHit);
+    HRCHECK(FAILED(hr));
+
+    if (pbstrMappedPath) {
+        hr = bstrServerMappedPath.CopyTo(pbstrMappedPath);
+        HRCHECK(FAILED(hr));
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+
+// ============================================================================
+// CXMLServerDocument::InitializeBrowserCapAndAttribs
+//      Find the capabilities recorded for this browser's User-Agent
+//      and stash them away in a member variable.  Also grab the content
+//      type, charset and encoding here (if they're specified in
+//      browscap.ini) 
+HRESULT
+CXMLServerDocument::InitializeBrowserCapAndAttribs()
+{
+    HRESULT  hr;
+    CComBSTR bstrUserAgent;
+
+    if (!m_bBrowserCapsInitialized) {
+
+        if (g_browscap->IsEnabled() || g_browserCapsCache->IsEnabled()) {
+
+            if (IsOffline()) {
+                bstrUserAgent = m_bstrUserAgent;
+            } else {
+                hr = EnsureAspRequestObject();
+                HRCHECK(FAILED(hr));
+
+                hr = ::GetServerVariable(m_pcomASPRequest,
+                                         L"HTTP_USER_AGENT",
+                                         bstrUserAgent);
+                HRCHECK(FAILED(hr));
+            }
+
+            // Answer from browscap.ini directly if we can, else from
+            // what's been recorded for this User-Agent.
+            hr = g_browscap->Match(bstrUserAgent, m_browscapMatch);
+            HRCHECK(FAILED(hr));
+
+            if (!m_browscapMatch.IsValid()) {
+                hr = g_browserCapsCache->Lookup(bstrUserAgent, &m_pBrowserCaps);
+                HRCHECK(FAILED(hr));
+            }
+        }
+
+        hr = GrabBrowserCap(L"content-type",
+                            L"text/html",
+                            m_bstrContentType);
+        HRCHECK(FAILED(hr));
+
+        hr = GrabBrowserCap(L"charset",
+                            NULL,
+                            m_bstrCharset);
+        HRCHECK(FAILED(hr));
+
+        hr = GrabBrowserCap(L"encoding",
+                            NULL,
+                            m_bstrEncoding);
+        HRCHECK(FAILED(hr));
+
+        m_bBrowserCapsInitialized = true;
+
+    } else {
+        
+        // Already done, be sure content type is also. 
+        ASSERT(m_bstrContentType.m_str != NULL);
+        
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+
+// ============================================================================
+// CXMLServerDocument::EnsureBrowserTypeObject
+//      Makes sure that the MSWC.BrowserType object is created.  Only
+//      needed for properties this browser hasn't been asked about.
+HRESULT
+CXMLServerDocument::EnsureBrowserTypeObject()
+{
+    HRESULT hr;
+
+    if (m_pcomBrowserTypeDisp.p == NULL) {
+
+        hr = EnsureAspServerObject();
+        HRCHECK(FAILED(hr));
+    
+        hr = m_pcomASPServer->CreateObject(g_bstrBrowserType, 
+                                           &m_pcomBrowserTypeDisp);
+        HRCHECK(FAILED(hr));
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+
+// ============================================================================
+// CXMLServerDocument::GetBrowserCap
+//      Get a property of the browser, or S_FALSE if it has no such
+//      property (or it can't be read).  With the native browscap.ini
+//      reader, the BrowserType object is never needed.  Otherwise
+//      properties already recorded for this User-Agent are answered
+//      without it; others are asked of it and recorded for later
+//      requests.  When rendering offline there's no BrowserType object,
+//      so anything else is S_FALSE.  Fails only if the BrowserType
+//      object can't be created.
+HRESULT
+CXMLServerDocument::GetBrowserCap(
+    const wchar_t *pwszName,                // [in] property name
+    CComVariant & varValue)                 // [out] its value
+{
+    HRESULT hr;
+    bool    bFound = false;
+
+    if (m_browscapMatch.IsValid()) {
+        hr = m_browscapMatch.GetProperty(pwszName, varValue);
+        RETURNERR(hr);
+    }
+
+    if (m_pBrowserCaps) {
+        hr = m_pBrowserCaps->Lookup(pwszName, varValue, &bFound);
+        if (bFound) {
+            RETURNERR(hr);
+        }
+    }
+
+    // The BrowserType object needs a request to look at.
+    if (IsOffline()) {
+        RETURNERR(S_FALSE);
+    }
+
+    hr = EnsureBrowserTypeObject();
+    HRCHECK(FAILED(hr));
+
+    hr = GetBrowserTypeProperty(m_pcomBrowserTypeDisp, pwszName, varValue);
+    if (hr == DISP_E_UNKNOWNNAME) {
+        hr = S_FALSE;
+    }
+
+    // Don't remember failures that may not happen next time.
+    if (SUCCEEDED(hr)) {
+        if (m_pBrowserCaps) {
+            m_pBrowserCaps->Add(pwszName, varValue, hr);
+        }
+    } else {
+        varValue.Clear();
+        hr = S_FALSE;
+    }
+
+  Error:
+    return hr;
+}
+
+
+// ============================================================================
+// CXMLServerDocument::GrabBrowserCap
+//   Grab the value of pwszName from the browser capabilities and store
+//   as a string in bstrDestination.  If none exists (or is "unknown")
+//   replace with pwszDefault (or just empty if NULL).
+HRESULT
+CXMLServerDocument::GrabBrowserCap(
+    const wchar_t *pwszName,                // [in] property name
+    const wchar_t *pwszDefault,             // [in] value if none, or NULL
+    CComBSTR & bstrDestination)             // [out] the value
+{
+    HRESULT     hr;
+    CComVariant var;
+
+    bstrDestination.Empty();
+    
+    hr = GetBrowserCap(pwszName, var);
+    HRCHECK(FAILED(hr));
+
+    if (hr != S_OK) {
+        // Assume no content-type was specified here, use default.
+        if (pwszDefault) {
+            bstrDestination = pwszDefault;
+        }
+    } else {
+        hr = var.ChangeType(VT_BSTR);
+        HRCHECK(FAILED(hr));
+        bstrDestination = V_BSTR(&var);
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+
+// ============================================================================
+// CXMLServerDocument::ExtractStylesheets
+//      Pull appropriate stylesheet names out of the <server-config>
+//      XML schema based on the browser capabilities object.
+//
+//      If there are no matches, return -1 in *pNumStylesheets.  Else
+//      return the number of array elements filled in by the matching
+//      <device> element (could be 0).
+HRESULT
+CXMLServerDocument::ExtractStylesheets(
+    IXMLDOMDocument  *pServerConfig,      // [in] server-config XML document
+    BSTR              arrStylesheets[],   // [in] array of strings of URLs for XSLs,
+                                          // [out] filled in array
+    short            *pNumStylesheets)    // [in] ptr to size of array
+                                          // [out] ptr to num of array slots filled in. 
+{
+    HRESULT                  hr;
+    CComPtr<IXMLDOMNodeList> pcomDeviceNodes;
+    CComPtr<IXMLDOMNode>     pcomDeviceNode;
+    bool                     gotStylesheets;
+    short                    device = 0;
+
+    hr = pServerConfig->selectNodes(L"/server-styles-config/device",
+                                    &pcomDeviceNodes);
+    HRCHECK(FAILED(hr));
+
+    hr = pcomDeviceNodes->nextNode(&pcomDeviceNode);
+    HRCHECK(FAILED(hr));
+
+    // Loop through each device element
+    gotStylesheets = false;
+    while (!gotStylesheets && pcomDeviceNode.p != NULL) {
+
+        CComPtr<IXMLDOMNamedNodeMap>  pcomAttrs;
+        CComPtr<IXMLDOMNode>          pcomAttr;
+        bool                          foundMatch;
+
+        device++;
+
+        hr = pcomDeviceNode->get_attributes(&pcomAttrs);
+        HRCHECK(FAILED(hr));
+
+        hr = pcomAttrs->nextNode(&pcomAttr);
+        HRCHECK(FAILED(hr));
+
+        // Loop through all the attributes in the device element,
+        // comparing to the browser capabilities. 
+        foundMatch = true;
+        while (pcomAttr.p != NULL) {
+
+            ASSERT(foundMatch);
+            
+            CComBSTR    propertyName;
+            CComVariant varPropertyValue;
+            CComVariant varBrowserCapValue;
+            
+            hr = pcomAttr->get_nodeName(&propertyName);
+            HRCHECK(FAILED(hr));
+
+            hr = pcomAttr->get_nodeValue(&varPropertyValue);
+            HRCHECK(FAILED(hr));
+
+            // Test the name/value pair against the browser
+            // capabilities.
+            hr = GetBrowserCap(propertyName, varBrowserCapValue);
+            HRCHECK(FAILED(hr));
+
+            if (hr != S_OK  || varBrowserCapValue != varPropertyValue) {
+                // we interpret any sort of failure here as the
+                // property not existing. 
+                foundMatch = false;
+                break;
+            }
+
+            pcomAttr.Release();
+            hr = pcomAttrs->nextNode(&pcomAttr);
+            HRCHECK(FAILED(hr));
+        }
+
+        if (foundMatch) {
+
+            CComBSTR                 bstrTemp;
+
+            m_trace.SetDevice(device);
+
+            // First look for an overriding "content-type" element.
+            hr = GetSingleNodeValue(pcomDeviceNode,
+                                    L"content-type/@type",
+                                    &bstrTemp);
+            HRCHECK(FAILED(hr));
+            if (bstrTemp) {
+                m_bstrContentType = bstrTemp;
+                bstrTemp.Empty();
+            }
+
+            // Always override encoding in masterConfig.xml if handling error
+            hr = GetSingleNodeValue(pcomDeviceNode,
+                                    L"output/@encoding",
+                                    &bstrTemp);
+            HRCHECK(FAILED(hr));
+            if (bstrTemp || m_bInErrorHandling) {
+                m_bstrEncoding = bstrTemp;
+                bstrTemp.Empty();
+            }
+
+            // Look for an overriding "charset" element
+            hr = GetSingleNodeValue(pcomDeviceNode,
+                                    L"output/@charset",
+                                    &bstrTemp);
+            HRCHECK(FAILED(hr));
+            if (bstrTemp) {
+                m_bstrCharset = bstrTemp;
+                bstrTemp.Empty();
+            }
+
+            hr = PullStylesheetsFromDeviceInfo(pcomDeviceNode,
+                                               arrStylesheets,
+                                               pNumStylesheets);
+            HRCHECK(FAILED(hr));
+
+            gotStylesheets = true;
+        }
+
+        pcomDeviceNode.Release();
+        hr = pcomDeviceNodes->nextNode(&pcomDeviceNode);
+        HRCHECK(FAILED(hr));
+    }
+
+    if (!gotStylesheets) {
+        // Indicate that there were no matches.
+        *pNumStylesheets = -1;
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// DoesDoctypeMatch
+//      Check a string to see if a doctype string is contained in a
+//      list of doctypes.
+HRESULT
+DoesDoctypeMatch(CComVariant & varDoctypeListInConfig,
+                 CComBSTR    & bstrDoctypeNameInDoc,
+                 bool        * pResult)
+{
+    ASSERT(*pResult == false && "Expected to start out as false");
+    
+    HRESULT       hr;
+    CComBSTR      bstrDoctypeListInConfig;
+
+    hr = varDoctypeListInConfig.ChangeType(VT_BSTR);
+    HRCHECK(FAILED(hr));
+
+    bstrDoctypeListInConfig = V_BSTR(&varDoctypeListInConfig);
+    ERRCHECK(bstrDoctypeListInConfig.m_str == NULL,
+             E_OUTOFMEMORY);
+
+    wchar_t *pwEnd;
+    wchar_t *pwTokenStart;
+    bool     foundIt;
+    
+    pwEnd = bstrDoctypeListInConfig.m_str +
+            bstrDoctypeListInConfig.Length();
+    pwTokenStart = bstrDoctypeListInConfig.m_str;
+    foundIt = false;
 
-    if (m_pcomBrowserTypeDisp.p == NULL) {
+    // Search through the list for the document's doctype.  We could
+    // use the CRT function wcstok here, but that brings in too much
+    // of the CRT and results in link problems when using _ATL_MIN_CRT
+    // as we are here.
+    while (!foundIt && pwTokenStart < pwEnd) {
 
-        hr = EnsureAspServerObject();
+        // Skip whitespace
+        while (pwTokenStart < pwEnd &&
+               (*pwTokenStart == L' ' || *pwTokenStart == L',' || *pwTokenStart == L'\t')) {
+            pwTokenStart++;
+        }
+
+        // Skip over token to next whitespace
+        wchar_t *pwTokenEnd = pwTokenStart;
+        while (pwTokenEnd < pwEnd &&
+               (*pwTokenEnd != L' ' && *pwTokenEnd != L',' && *pwTokenEnd != L'\t')) {
+            pwTokenEnd++;
+        }
+
+        size_t len = pwTokenEnd - pwTokenStart;
+        if (len == bstrDoctypeNameInDoc.Length() &&
+            (wcsncmp(pwTokenStart, bstrDoctypeNameInDoc, len) == 0)) {
+
+            foundIt = true;
+            
+        } else {
+
+            // Go on to next token.
+            pwTokenStart = pwTokenEnd;
+        }
+    }
+
+    if (foundIt) {
+        *pResult = true;
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CXMLServerDocument::PullStylesheetsFromDeviceInfo
+//      Given that we have the root of the proper device node, yank
+//      out the stylesheet names to use.  Will also take "doctype"
+//      into account.
+//
+//      If there are no matches, return -1 in *pNumStylesheets.  Else
+//      return the number of array elements filled in by the matching
+//      <device> element (could be 0).
+
+HRESULT
+CXMLServerDocument::PullStylesheetsFromDeviceInfo(
+    IXMLDOMNode  *pDeviceNode,      // [in] node in tree pointing to chosen device
+    BSTR          arrStylesheets[], // [in] array of strings of URLs for XSLs,
+                                    // [out] filled in array
+    short        *pNumStylesheets)  // [in] ptr to size of array
+                                    // [out] ptr to num of array slots filled in. 
+{
+    HRESULT hr;
+    CComPtr<IXMLDOMNodeList> pcomHREFs;
+    CComPtr<IXMLDOMNode>     pcomHREF;
+    CComPtr<IXMLDOMNodeList> pcomDoctypeNodes;
+    CComPtr<IXMLDOMNode>     pcomDoctypeNode;
+    wchar_t                  stylesheetPattern[] = L"stylesheet/@href";
+    wchar_t                  doctypePattern[] = L"doctype";
+    wchar_t                  doctypeNamePattern[] = L"@name";
+    bool                     foundDoctypeMatch = false;
+    const short              maxStylesheets = *pNumStylesheets;
+
+    *pNumStylesheets = 0;
+
+    // Grab both the top-level stylesheet/@href nodes and the top
+    // level doctype nodes.  They shouldn't both simultaneously
+    // exist. 
+    hr = pDeviceNode->selectNodes(stylesheetPattern, &pcomHREFs);
+    HRCHECK(FAILED(hr));
+
+    hr = pcomHREFs->nextNode(&pcomHREF);
+    HRCHECK(FAILED(hr));
+
+    hr = pDeviceNode->selectNodes(doctypePattern, &pcomDoctypeNodes);
+    HRCHECK(FAILED(hr));
+
+    hr = pcomDoctypeNodes->nextNode(&pcomDoctypeNode);
+    HRCHECK(FAILED(hr));
+
+    if (pcomHREF.p != NULL && pcomDoctypeNode.p != NULL) {
+        SetError(L"Cannot have both a stylesheet node and a doctype node contained within a device node",
+                 m_bstrURLServerConfig,
+                 L"500.100 Internal Server Error - ASP Error");
+        RETURNERR(E_FAIL);
+    }
+
+    if (pcomDoctypeNode.p != NULL) {
+
+        // Have doctypes, so change our context based upon the doctype
+        // match.
+        while (!foundDoctypeMatch && pcomDoctypeNode.p != NULL) {
+
+            // Now have the "<doctype>" node, need to get to the
+            // "name" attribute of it.  If there is a <doctype>
+            // element without a name attribute, consider it to be the
+            // default and allow it to match.
+            
+            CComPtr<IXMLDOMNode> pcomDoctypeNameNode;
+
+            hr = pcomDoctypeNode->selectSingleNode(doctypeNamePattern,
+                                                   &pcomDoctypeNameNode);
+            HRCHECK(FAILED(hr));
+
+            if (pcomDoctypeNameNode.p == NULL) {
+
+                // <doctype> element without a "name" attribute.
+                foundDoctypeMatch = true;
+                
+            } else if (m_bstrDoctypeName.m_str != NULL) {
+            
+                CComVariant varDoctypeNameInConfig;
+                
+                hr = pcomDoctypeNameNode->get_nodeValue(&varDoctypeNameInConfig);
+                HRCHECK(FAILED(hr));
+
+                hr = DoesDoctypeMatch(varDoctypeNameInConfig,
+                                      m_bstrDoctypeName,
+                                      &foundDoctypeMatch);
+                HRCHECK(FAILED(hr));
+                
+            }
+
+            if (!foundDoctypeMatch) {
+                pcomDoctypeNode.Release();
+                hr = pcomDoctypeNodes->nextNode(&pcomDoctypeNode);
+                HRCHECK(FAILED(hr));
+            }
+        }
+    }
+
+    if (foundDoctypeMatch) {
+        // This part actually switches the souce of the pcomHREF
+        // node to be underneath the matching doctype.
+        pcomHREFs.Release();
+        hr = pcomDoctypeNode->selectNodes(stylesheetPattern,
+                                          &pcomHREFs);
         HRCHECK(FAILED(hr));
-    
-        hr = m_pcomASPServer->CreateObject(g_bstrBrowserType, 
-                                           &m_pcomBrowserTypeDisp);
+
+        hr = pcomHREFs->nextNode(&pcomHREF);
+        HRCHECK(FAILED(hr));
+    }
+
+    // Now loop through the stylesheets.
+    while (pcomHREF.p != NULL) {
+
+        CComVariant varHREFValue;
+                
+        // Just grab the value out of here and put it in the
+        // results.
+        hr = pcomHREF->get_nodeValue(&varHREFValue);
+        HRCHECK(FAILED(hr));
+
+        hr = varHREFValue.ChangeType(VT_BSTR);
+        HRCHECK(FAILED(hr));
+
+        // Didn't pass in enough stylesheets to fill up.
+        if (*pNumStylesheets >= maxStylesheets) {
+            SetError(L"Attempting to chain too many stylesheets",
+                     m_bstrURL,
+                     L"500.100 Internal Server Error - ASP Error");
+            RETURNERR(E_FAIL);
+        }
+                    
+        arrStylesheets[*pNumStylesheets] = m_arena.AllocBSTR(V_BSTR(&varHREFValue));
+        ERRCHECK(arrStylesheets[*pNumStylesheets] == NULL, E_OUTOFMEMORY);
+        (*pNumStylesheets)++;
+
+        pcomHREF.Release();
+        hr = pcomHREFs->nextNode(&pcomHREF);
+        HRCHECK(FAILED(hr));
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CXMLServerDocument::ApplyStylesheets
+//      Sequentially apply given stylesheets, writing the final
+//      response to provided response object.
+HRESULT
+CXMLServerDocument::ApplyStylesheets(asp::IResponse *pResponse,
+                                     BSTR            arrStylesheets[],
+                                     short           numStylesheets)
+{
+    HRESULT hr;
+    CComPtr<IStream> pcomResponseStream;
+    CComPtr<IStream> pcomProcessedResponseStream;
+    CTransformJob            *pTransformJob = NULL;
+    CComPtr<IXMLDOMDocument>  pcomXslDocs[MAX_SHEETS_TO_CHAIN];
+    CComPtr<IXSLTemplate>     pcomXslTemplates[MAX_SHEETS_TO_CHAIN];
+    CComBSTR                  bstrMappedPaths[MAX_SHEETS_TO_CHAIN];
+    XmlCacheInfo              sheetInfo[MAX_SHEETS_TO_CHAIN];
+    CComBSTR                  bstrETag;
+    bool                      bNotModified;
+    CPhaseTimer               phaseTimer(&m_trace);
+    UINT uiCP;
+
+    ASSERT(numStylesheets <= MAX_SHEETS_TO_CHAIN);
+
+    hr = VerifyEncodingAndCharset(&uiCP);
+    HRCHECK(FAILED(hr));
+
+    // Charset should be set in VerifyEncodingAndCharset() if not configured
+    ASSERT(m_bstrCharset.Length());
+
+    // A client that already has the output needn't wait for the chain
+    // to be loaded and compiled.
+    if (pResponse && !m_pCapturePage && !m_bInErrorHandling) {
+        hr = CheckChainNotModified(pResponse,
+                                   arrStylesheets,
+                                   numStylesheets,
+                                   uiCP,
+                                   &bNotModified);
+        HRCHECK(FAILED(hr));
+
+        if (bNotModified) {
+            RETURNERR(S_OK);
+        }
+
+        // Turn the request away now if the transform pool is backed
+        // up, before loading the chain adds to the load, rather than
+        // leave it waiting for a thread.
+        if (!g_transformPool->Admit()) {
+            hr = WriteServiceUnavailable(pResponse);
+            RETURNERR(hr);
+        }
+    }
+
+    // Load and compile the whole chain before running any of it.  The
+    // versions of the stylesheets are part of the entity tag.
+    phaseTimer.Start();
+    hr = LoadStylesheetChain(arrStylesheets,
+                             numStylesheets,
+                             pcomXslDocs,
+                             pcomXslTemplates,
+                             bstrMappedPaths,
+                             sheetInfo);
+    phaseTimer.Stop(PHASE_LOAD_STYLESHEETS);
+
+    // Stylesheets that took too long to load on the worker pool: the
+    // request is turned away rather than given the error stylesheets.
+    if (hr == HRESULT_FROM_WIN32(ERROR_TIMEOUT) &&
+        pResponse &&
+        !m_pCapturePage &&
+        !m_bInErrorHandling) {
+        ClearError();
+        hr = WriteServiceUnavailable(pResponse);
+        RETURNERR(hr);
+    }
+    HRCHECK(FAILED(hr));
+
+    if (m_pCapturePage) {
+
+        // Rendering an error page to reuse (see HandleError).  Note
+        // what it's made from and how it's to be sent, and keep the
+        // stylesheets' output as it comes.
+        hr = m_pCapturePage->AddDependency(m_bstrServerConfigPath,
+                                           m_serverConfigInfo);
+        HRCHECK(FAILED(hr));
+
+        for (short stage = 0; stage < numStylesheets; stage++) {
+            hr = m_pCapturePage->AddDependency(bstrMappedPaths[stage],
+                                               sheetInfo[stage]);
+            HRCHECK(FAILED(hr));
+        }
+
+        hr = m_pCapturePage->SetOutput(m_bstrContentType, m_bstrCharset, uiCP);
+        HRCHECK(FAILED(hr));
+
+        pcomProcessedResponseStream = m_pcomErrorCapture;
+
+    } else if (pResponse == NULL) {
+
+        // Rendering offline (see RenderOffline).  There are no headers
+        // to send and nothing to negotiate with a client.
+        hr = CreateProcessingStream(m_pcomOfflineOutput,
+                                    NULL,
+                                    m_bstrContentType,
+                                    m_bstrProfilesConfig,
+                                    uiCP,
+                                    NULL,
+                                    m_cbCompressMin,
+                                    &m_bContentEncodingSent,
+                                    &m_trace,
+                                    &pcomProcessedResponseStream);
+        HRCHECK(FAILED(hr));
+
+    } else {
+
+        hr = NegotiateContentEncoding();
+        HRCHECK(FAILED(hr));
+
+        hr = ComputeETag(bstrMappedPaths,
+                         sheetInfo,
+                         numStylesheets,
+                         m_bstrContentType,
+                         m_bstrCharset,
+                         uiCP,
+                         m_bstrContentEncoding,
+                         bstrETag);
+        HRCHECK(FAILED(hr));
+
+        hr = CheckNotModified(pResponse, bstrETag, &bNotModified);
+        HRCHECK(FAILED(hr));
+
+        if (bNotModified) {
+            RETURNERR(S_OK);
+        }
+
+        hr = pResponse->put_ContentType(m_bstrContentType);
+        HRCHECK(FAILED(hr));
+
+        hr = pResponse->put_CharSet(m_bstrCharset);
+        HRCHECK(FAILED(hr));
+
+        // No failure check is needed when retrieving IStream since it is not
+        // required, just nice to have it.  Note that the Response object in
+        // NT4/IIS4 doesn't support IStream.
+        hr = pResponse->QueryInterface(IID_IStream,
+                                       reinterpret_cast<void**>(&pcomResponseStream));
+
+        // Both IStream and IResponse interfaces are passed in.  ProcessingStream
+        // object will pick the right interface to use.
+        hr = CreateProcessingStream(pcomResponseStream,
+                                    pResponse,
+                                    m_bstrContentType,
+                                    m_bstrProfilesConfig,
+                                    uiCP,
+                                    m_bstrContentEncoding,
+                                    m_cbCompressMin,
+                                    &m_bContentEncodingSent,
+                                    &m_trace,
+                                    &pcomProcessedResponseStream);
+        HRCHECK(FAILED(hr));
+
+    }
+
+    phaseTimer.Start();
+
+    if (numStylesheets == 0) {
+        
+        hr = EnsureSourceLoaded();
         HRCHECK(FAILED(hr));
 
-        hr = GrabFromBrowserCap(m_pcomBrowserTypeDisp,
-                                L"content-type",
-                                L"text/html",
-                                m_bstrContentType);
-        HRCHECK(FAILED(hr));
+        // Changed while it was loaded (see RecheckSourceVersion).
+        if (!m_bSourceIsStatic) {
+            bstrETag.Empty();
+        }
 
-        hr = GrabFromBrowserCap(m_pcomBrowserTypeDisp,
-                                L"charset",
-                                NULL,
-                                m_bstrCharset);
+        hr = m_pcomXMLDocument->save(CComVariant(pcomProcessedResponseStream));
         HRCHECK(FAILED(hr));
+        
+    } else {
 
-        hr = GrabFromBrowserCap(m_pcomBrowserTypeDisp,
-                                L"encoding",
-                                NULL,
-                                m_bstrEncoding);
+        // Run the stylesheets of the chain, the last one writing to
+        // the post-processing response stream.
+        CTransformJob            *pJob;
+        CComPtr<IXMLDOMDocument>  pcomCachedDoc;
+        short                     stylesheetIndex = 0;
+
+        pJob = new CTransformJob();
+        ERRCHECK(pJob == NULL, E_OUTOFMEMORY);
+        pTransformJob = pJob;
+
+        // Skip over any prefix of the chain whose result has already
+        // been computed for this version of the source.
+        hr = ResolveChainPrefix(bstrMappedPaths,
+                                sheetInfo,
+                                numStylesheets,
+                                pJob->m_bstrChainKeys,
+                                &stylesheetIndex,
+                                &pcomCachedDoc);
         HRCHECK(FAILED(hr));
 
-    } else {
-        
-        // m_pcomASPServer already set, be sure content type is also. 
-        ASSERT(m_bstrContentType.m_str != NULL);
-        
+        m_trace.SetChainCacheStages(stylesheetIndex);
+
+        if (pcomCachedDoc.p) {
+            pJob->m_pcomSrcDoc = pcomCachedDoc;
+        } else {
+            hr = EnsureSourceLoaded();
+            HRCHECK(FAILED(hr));
+
+            // Changed while it was loaded (see RecheckSourceVersion).
+            if (!m_bSourceIsStatic) {
+                bstrETag.Empty();
+                for (short stage = 0; stage < numStylesheets; stage++) {
+                    pJob->m_bstrChainKeys[stage].Empty();
+                }
+            }
+
+            pJob->m_pcomSrcDoc = m_pcomXMLDocument;
+        }
+
+        pJob->m_firstStage = stylesheetIndex;
+        pJob->m_numStages = numStylesheets;
+        for (short stage = stylesheetIndex; stage < numStylesheets; stage++) {
+            pJob->m_pcomXslDocs[stage] = pcomXslDocs[stage];
+            pJob->m_pcomXslTemplates[stage] = pcomXslTemplates[stage];
+        }
+
+        if (g_transformPool->IsEnabled() &&
+            pResponse &&
+            !m_pCapturePage &&
+            !m_bInErrorHandling) {
+
+            // On the transform pool, so that the stylesheets don't hold
+            // up an ASP thread past the deadline.  The ASP objects stay
+            // on this thread: the output is kept until the chain is
+            // done, then written here.
+            hr = g_transformPool->Run(pJob, m_transformDeadline);
+            if (hr == HRESULT_FROM_WIN32(ERROR_TIMEOUT)) {
+
+                // The job may still be using the source document, so
+                // it's let go.  Nothing has been written yet.
+                m_pcomXMLDocument.Release();
+
+                hr = WriteServiceUnavailable(pResponse);
+                RETURNERR(hr);
+            }
+            HRCHECK(FAILED(hr));
+
+            if (SUCCEEDED(pJob->m_hr)) {
+                hr = pJob->CopyOutputTo(pcomProcessedResponseStream);
+                HRCHECK(FAILED(hr));
+            }
+
+        } else {
+
+            pJob->m_pcomOutput = pcomProcessedResponseStream;
+            pJob->Execute();
+
+        }
+
+        if (FAILED(pJob->m_hr)) {
+            if (pJob->m_bstrError.m_str != NULL) {
+                SetError(pJob->m_bstrError,
+                         arrStylesheets[pJob->m_failedStage],
+                         L"500.100 Internal Server Error - ASP Error");
+            }
+            RETURNERR(pJob->m_hr);
+        }
+    }
+
+    phaseTimer.Stop(PHASE_TRANSFORM);
+
+    hr = pcomProcessedResponseStream->Commit(STGC_DEFAULT);
+    HRCHECK(FAILED(hr));
+
+    if (pResponse) {
+        hr = SendValidators(pResponse, bstrETag, true);
+        HRCHECK(FAILED(hr));
     }
 
     hr = S_OK;
   Error:
+    if (pTransformJob) {
+        pTransformJob->Release();
+    }
     return hr;
 }
 
 
+// Most milliseconds a request waits for its stylesheets to be loaded
+// on the worker pool, when the transform pool's deadline doesn't say
+// sooner.
+const DWORD MAX_PREFETCH_WAIT = 30000;
+
+class CPrefetchSet;
+
 // ============================================================================
-// CXMLServerDocument::ExtractStylesheets
-//      Pull appropriate stylesheet names out of the <server-config>
-//      XML schema based on the browser capabilities object.
-//
-//      If there are no matches, return -1 in *pNumStylesheets.  Else
-//      return the number of array elements filled in by the matching
-//      <device> element (could be 0).
-HRESULT
-CXMLServerDocument::ExtractStylesheets(
-    IXMLDOMDocument  *pServerConfig,      // [in] server-config XML document
-    CComBSTR          arrStylesheets[],   // [in] array of strings of URLs for XSLs,
-                                          // [out] filled in array
-    short            *pNumStylesheets)    // [in] ptr to size of array
-                                          // [out] ptr to num of array slots filled in. 
+// CLASS: CStylesheetPrefetch
+//      Work item that loads one stylesheet into the XML cache on a
+//      worker thread.  Errors are only recorded in m_hr; the request
+//      thread loads anything that failed again so that the error is
+//      reported against the request.
+
+class CStylesheetPrefetch : public CWorkItem
 {
-    HRESULT                  hr;
-    CComPtr<IXMLDOMNodeList> pcomDeviceNodes;
-    CComPtr<IXMLDOMNode>     pcomDeviceNode;
-    bool                     gotStylesheets;
+  public:
+    CStylesheetPrefetch() : m_pszServerMappedPath(NULL),
+                            m_hr(E_FAIL),
+                            m_bQueued(false),
+                            m_pSet(NULL) {
+        ::memset(&m_info, 0, sizeof(m_info));
+    }
 
-    hr = pServerConfig->selectNodes(L"/server-styles-config/device",
-                                    &pcomDeviceNodes);
-    HRCHECK(FAILED(hr));
+    ~CStylesheetPrefetch() {
+        delete [] m_pszServerMappedPath;
+    }
 
-    hr = pcomDeviceNodes->nextNode(&pcomDeviceNode);
-    HRCHECK(FAILED(hr));
+    // On a worker thread.
+    virtual void Run();
+
+    // Load the stylesheet into the XML cache.
+    void Load();
+
+    // Count the item as done and drop its reference to the set (and
+    // so maybe the item itself).
+    void Complete();
+
+    CComBSTR                  m_bstrServerMappedPath;
+    char                     *m_pszServerMappedPath;
+    CComBSTR                  m_bstrURL;
+    CComPtr<IXMLDOMDocument>  m_pcomXslDoc;
+    CComPtr<IXSLTemplate>     m_pcomXslTemplate;
+    XmlCacheInfo              m_info;
+    HRESULT                   m_hr;
+    bool                      m_bQueued;
+    CPrefetchSet             *m_pSet;
+};
 
-    // Loop through each device element
-    gotStylesheets = false;
-    while (!gotStylesheets && pcomDeviceNode.p != NULL) {
+// ============================================================================
+// CLASS: CPrefetchSet
+//      The prefetches for one chain, and what they share: the count of
+//      those still running, the event set when they're all done, and
+//      the token of the user the request runs as.  Everything the items
+//      use is held here rather than borrowed from the request, and it's
+//      reference counted, so that a request that stops waiting for them
+//      can go away while they finish.
+
+class CPrefetchSet
+{
+  public:
+    CPrefetchSet() : m_pItems(NULL),
+                     m_lPending(0),
+                     m_hDone(NULL),
+                     m_hToken(NULL),
+                     m_ref(1) {}
+
+    void AddRef() {
+        InterlockedIncrement(&m_ref);
+    }
 
-        CComPtr<IXMLDOMNamedNodeMap>  pcomAttrs;
-        CComPtr<IXMLDOMNode>          pcomAttr;
-        bool                          foundMatch;
+    void Release() {
+        if (InterlockedDecrement(&m_ref) == 0) {
+            delete this;
+        }
+    }
 
-        hr = pcomDeviceNode->get_attributes(&pcomAttrs);
-        HRCHECK(FAILED(hr));
+    CStylesheetPrefetch      *m_pItems;
+    LONG                      m_lPending;
+    HANDLE                    m_hDone;
+    HANDLE                    m_hToken;     // impersonation token, or NULL
 
-        hr = pcomAttrs->nextNode(&pcomAttr);
-        HRCHECK(FAILED(hr));
+  private:
+    ~CPrefetchSet() {
+        delete [] m_pItems;
+        if (m_hDone) {
+            CloseHandle(m_hDone);
+        }
+        if (m_hToken) {
+            CloseHandle(m_hToken);
+        }
+    }
 
-        // Loop through all the attributes in the device element,
-        // comparing to the browser capabilities. 
-        foundMatch = true;
-        while (pcomAttr.p != NULL) {
+    LONG                      m_ref;
+};
 
-            ASSERT(foundMatch);
-            
-            CComBSTR    propertyName;
-            CComVariant varPropertyValue;
-            CComVariant varBrowserCapValue;
-            
-            hr = pcomAttr->get_nodeName(&propertyName);
-            HRCHECK(FAILED(hr));
+// ============================================================================
+// CStylesheetPrefetch::Run
+//      Load as the user the request runs as, so that a worker thread
+//      can't read a stylesheet the request couldn't.
 
-            hr = pcomAttr->get_nodeValue(&varPropertyValue);
-            HRCHECK(FAILED(hr));
+void
+CStylesheetPrefetch::Run()
+{
+    if (m_pSet->m_hToken == NULL) {
+        Load();
+    } else if (SetThreadToken(NULL, m_pSet->m_hToken)) {
+        Load();
+        SetThreadToken(NULL, NULL);
+    } else {
+        m_hr = HRESULT_FROM_WIN32(GetLastError());
+    }
 
-            // Test the name/value pair against the browser
-            // capabilities.
-            hr = GetBrowserTypeProperty(m_pcomBrowserTypeDisp,
-                                        propertyName,
-                                        varBrowserCapValue);
+    Complete();
+}
 
-            if (hr != S_OK  || varBrowserCapValue != varPropertyValue) {
-                // we interpret any sort of failure here as the
-                // property not existing. 
-                foundMatch = false;
-                break;
-            }
+// ============================================================================
+// CStylesheetPrefetch::Load
 
-            pcomAttr.Release();
-            hr = pcomAttrs->nextNode(&pcomAttr);
+void
+CStylesheetPrefetch::Load()
+{
+    m_hr = g_xmlCache->Lookup(m_pszServerMappedPath,
+                              m_bstrURL,
+                              false,
+                              NULL,
+                              &m_pcomXslDoc,
+                              &m_pcomXslTemplate,
+                              &m_info);
+}
+
+// ============================================================================
+// CStylesheetPrefetch::Complete
+
+void
+CStylesheetPrefetch::Complete()
+{
+    CPrefetchSet *pSet = m_pSet;
+
+    if (InterlockedDecrement(&pSet->m_lPending) == 0) {
+        SetEvent(pSet->m_hDone);
+    }
+    pSet->Release();
+}
+
+// ============================================================================
+// CXMLServerDocument::LoadStylesheetChain
+//      Load every stylesheet of the chain before any transform runs.
+//      Paths are resolved here on the request thread, since that needs
+//      the ASP Server object.  When more than one stylesheet isn't in
+//      the XML cache yet, those are loaded and compiled concurrently on
+//      the worker pool, so that a cold chain costs about as much as its
+//      slowest stylesheet instead of the sum of all of them.  Returns
+//      HRESULT_FROM_WIN32(ERROR_TIMEOUT) if they take too long.
+HRESULT
+CXMLServerDocument::LoadStylesheetChain(
+    BSTR                      arrStylesheets[],    // [in] stylesheet chain
+    short                     numStylesheets,      // [in] length of chain
+    CComPtr<IXMLDOMDocument>  arrXslDocs[],        // [out] loaded stylesheets
+    CComPtr<IXSLTemplate>     arrXslTemplates[],   // [out] loaded stylesheets
+    CComBSTR                  arrMappedPaths[],    // [out] server-mapped paths
+    XmlCacheInfo              arrInfo[])           // [out] stylesheet versions
+{
+    HRESULT               hr;
+    CPrefetchSet         *pSet = NULL;
+    CStylesheetPrefetch  *pPrefetches = NULL;
+    DWORD                 wait;
+    long                  remaining;
+    short                 stage;
+    short                 numMissing = 0;
+
+    if (numStylesheets > 1 && g_workerPool->IsEnabled()) {
+
+        pSet = new CPrefetchSet();
+        ERRCHECK(pSet == NULL, E_OUTOFMEMORY);
+
+        pSet->m_pItems = new CStylesheetPrefetch[numStylesheets];
+        ERRCHECK(pSet->m_pItems == NULL, E_OUTOFMEMORY);
+
+        pPrefetches = pSet->m_pItems;
+
+        for (stage = 0; stage < numStylesheets; stage++) {
+
+            pPrefetches[stage].m_pSet = pSet;
+
+            hr = ResolveServerMappedPath(arrStylesheets[stage],
+                                         m_bstrConfigDirectory,
+                                         false,
+                                         &pPrefetches[stage].m_bstrServerMappedPath);
             HRCHECK(FAILED(hr));
+
+            pPrefetches[stage].m_pszServerMappedPath =
+                ::WideToAscii(pPrefetches[stage].m_bstrServerMappedPath);
+            ERRCHECK(pPrefetches[stage].m_pszServerMappedPath == NULL,
+                     E_OUTOFMEMORY);
+
+            if (!g_xmlCache->Contains(pPrefetches[stage].m_pszServerMappedPath)) {
+                pPrefetches[stage].m_bstrURL = arrStylesheets[stage];
+                ERRCHECK(pPrefetches[stage].m_bstrURL.m_str == NULL,
+                         E_OUTOFMEMORY);
+                pPrefetches[stage].m_bQueued = true;
+                numMissing++;
+            }
         }
 
-        if (foundMatch) {
+        // The worker threads run as the process; the stylesheets are
+        // loaded as whoever this thread is impersonating.  If that
+        // can't be found out, they're all loaded here.
+        if (numMissing > 1 &&
+            !OpenThreadToken(GetCurrentThread(),
+                             TOKEN_IMPERSONATE,
+                             TRUE,
+                             &pSet->m_hToken)) {
+            pSet->m_hToken = NULL;
+            if (GetLastError() != ERROR_NO_TOKEN) {
+                numMissing = 0;
+            }
+        }
 
-            CComBSTR                 bstrTemp;
+        // A single missing stylesheet isn't worth the thread switch.
+        if (numMissing > 1) {
+
+            pSet->m_hDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+            ERRCHECK(pSet->m_hDone == NULL, HRESULT_FROM_WIN32(GetLastError()));
+
+            pSet->m_lPending = numMissing;
+            for (stage = 0; stage < numStylesheets; stage++) {
+                if (pPrefetches[stage].m_bQueued) {
+                    // The item's reference, dropped by Complete().  If
+                    // no thread can take it, it's loaded here, as this
+                    // thread already is.
+                    pSet->AddRef();
+                    if (g_workerPool->Queue(&pPrefetches[stage]) != S_OK) {
+                        pPrefetches[stage].Load();
+                        pPrefetches[stage].Complete();
+                    }
+                }
+            }
 
-            // First look for an overriding "content-type" element.
-            hr = GetSingleNodeValue(pcomDeviceNode,
-                                    L"content-type/@type",
-                                    &bstrTemp);
-            HRCHECK(FAILED(hr));
-            if (bstrTemp) {
-                m_bstrContentType = bstrTemp;
-                bstrTemp.Empty();
+            wait = MAX_PREFETCH_WAIT;
+            if (g_transformPool->GetTimeout() != INFINITE) {
+                remaining = static_cast<long>(m_transformDeadline - GetTickCount());
+                if (remaining < static_cast<long>(wait)) {
+                    wait = (remaining > 0) ? remaining : 0;
+                }
             }
 
-            // Always override encoding in masterConfig.xml if handling error
-            hr = GetSingleNodeValue(pcomDeviceNode,
-                                    L"output/@encoding",
-                                    &bstrTemp);
-            HRCHECK(FAILED(hr));
-            if (bstrTemp || m_bInErrorHandling) {
-                m_bstrEncoding = bstrTemp;
-                bstrTemp.Empty();
+            // On time out, the items finish on their own, and their
+            // set goes with the last of them.
+            if (WaitForSingleObject(pSet->m_hDone, wait) != WAIT_OBJECT_0) {
+                SetError(L"The stylesheets took too long to load",
+                         m_bstrURL,
+                         L"503 Service Unavailable");
+                RETURNERR(HRESULT_FROM_WIN32(ERROR_TIMEOUT));
             }
 
-            // Look for an overriding "charset" element
-            hr = GetSingleNodeValue(pcomDeviceNode,
-                                    L"output/@charset",
-                                    &bstrTemp);
+        } else {
+
+            for (stage = 0; stage < numStylesheets; stage++) {
+                pPrefetches[stage].m_bQueued = false;
+            }
+        }
+    }
+
+    // Pick up the results, and load in order whatever wasn't (or
+    // couldn't be) prefetched.  These are mostly cache hits by now.
+    for (stage = 0; stage < numStylesheets; stage++) {
+
+        if (pPrefetches &&
+            pPrefetches[stage].m_bQueued &&
+            SUCCEEDED(pPrefetches[stage].m_hr)) {
+
+            arrXslDocs[stage] = pPrefetches[stage].m_pcomXslDoc;
+            arrXslTemplates[stage] = pPrefetches[stage].m_pcomXslTemplate;
+            arrInfo[stage] = pPrefetches[stage].m_info;
+
+            arrMappedPaths[stage].Attach(
+                pPrefetches[stage].m_bstrServerMappedPath.Detach());
+
+            m_trace.SetSheetLoad(stage, CRequestTrace::LOAD_PREFETCHED);
+
+        } else {
+
+            bool bCacheHit;
+
+            arrMappedPaths[stage].Empty();
+            hr = LoadXMLFromRelativeLoc(arrStylesheets[stage],
+                                        m_bstrConfigDirectory,
+                                        false,
+                                        &arrXslDocs[stage],
+                                        &arrXslTemplates[stage],
+                                        &arrMappedPaths[stage],
+                                        &arrInfo[stage],
+                                        &bCacheHit);
             HRCHECK(FAILED(hr));
-            if (bstrTemp) {
-                m_bstrCharset = bstrTemp;
-                bstrTemp.Empty();
+
+            m_trace.SetSheetLoad(stage,
+                                 bCacheHit ? CRequestTrace::LOAD_HIT :
+                                             CRequestTrace::LOAD_MISS);
+        }
+    }
+
+    hr = S_OK;
+  Error:
+    if (pSet) {
+        pSet->Release();
+    }
+    return hr;
+}
+
+// ============================================================================
+// CXMLServerDocument::ResolveChainPrefix
+//      When the source document was loaded from a file, build the
+//      chain cache key for each stage from the versions of the source
+//      and stylesheets, and find the longest prefix of the chain whose
+//      result is already in the chain cache.  On return
+//      *pFirstStylesheet is the first stylesheet still to be applied,
+//      and *ppCachedDoc is the document to apply it to (NULL for the
+//      source document).  arrChainKeys[i] is left NULL for stages that
+//      can't be cached.
+HRESULT
+CXMLServerDocument::ResolveChainPrefix(
+    CComBSTR                  arrMappedPaths[],    // [in] server-mapped paths
+    XmlCacheInfo              arrInfo[],           // [in] stylesheet versions
+    short                     numStylesheets,      // [in] length of chain
+    CComBSTR                  arrChainKeys[],      // [out] cache key per stage
+    short                    *pFirstStylesheet,    // [out] first stylesheet to apply
+    IXMLDOMDocument         **ppCachedDoc)         // [out] cached input, AddRef'd
+{
+    HRESULT   hr;
+    CComBSTR  bstrKey;
+    short     stage;
+    short     numKeys = 0;
+
+    *pFirstStylesheet = 0;
+    *ppCachedDoc = NULL;
+
+    // The last stylesheet writes to the response, so there's nothing
+    // to cache for a chain of one.
+    if (!m_bSourceIsStatic ||
+        numStylesheets < 2 ||
+        !g_chainCache->IsEnabled()) {
+        RETURNERR(S_OK);
+    }
+
+    hr = CChainCache::AppendToKey(bstrKey, m_bstrSourcePath, m_sourceInfo);
+    HRCHECK(FAILED(hr));
+
+    if (hr == S_FALSE) {
+        RETURNERR(S_OK);
+    }
+
+    for (stage = 0; stage < numStylesheets - 1; stage++) {
+
+        hr = CChainCache::AppendToKey(bstrKey,
+                                      arrMappedPaths[stage],
+                                      arrInfo[stage]);
+        HRCHECK(FAILED(hr));
+
+        if (hr == S_FALSE) {
+            // Version unknown (e.g. an http:// stylesheet), so neither
+            // this stage nor any after it can be cached.
+            break;
+        }
+
+        arrChainKeys[stage] = bstrKey;
+        ERRCHECK(arrChainKeys[stage].m_str == NULL, E_OUTOFMEMORY);
+        numKeys = static_cast<short>(stage + 1);
+    }
+
+    // Look for the longest prefix that's already been computed.
+    for (stage = static_cast<short>(numKeys - 1); stage >= 0; stage--) {
+
+        hr = g_chainCache->Lookup(arrChainKeys[stage], stage, ppCachedDoc);
+        HRCHECK(FAILED(hr));
+
+        if (hr == S_OK) {
+            *pFirstStylesheet = static_cast<short>(stage + 1);
+            break;
+        }
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+
+// ============================================================================
+// FormatETag
+//      Hash the validator key down to a strong entity tag: two
+//      different 32-bit hashes of the key, as a quoted string of 16 hex
+//      digits.
+static HRESULT
+FormatETag(BSTR bstrKey,            // [in] everything the output depends on
+           CComBSTR & bstrETag)     // [out] quoted entity tag
+{
+    HRESULT  hr;
+    DWORD    hash1 = 2166136261;    // FNV-1a
+    DWORD    hash2 = 0x9747b28c;
+    UINT     len = SysStringLen(bstrKey);
+    wchar_t  wszETag[24];
+
+    for (UINT i = 0; i < len; i++) {
+        hash1 = (hash1 ^ bstrKey[i]) * 16777619;
+        hash2 = (hash2 ^ bstrKey[i]) * 0x5bd1e995;
+        hash2 ^= hash2 >> 15;
+    }
+
+    wsprintf(wszETag, L"\"%08lx%08lx\"", hash1, hash2);
+
+    bstrETag = wszETag;
+    ERRCHECK(bstrETag.m_str == NULL, E_OUTOFMEMORY);
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// ETagListMatches
+//      Whether an If-None-Match header value matches bstrETag.  The
+//      header is "*" or a comma-separated list of entity tags; weak
+//      tags (W/"...") are compared as though they were strong, as
+//      If-None-Match calls for.
+static bool
+ETagListMatches(const wchar_t *pwszList,    // [in] If-None-Match value
+                BSTR bstrETag)              // [in] our entity tag
+{
+    const wchar_t *pwsz = pwszList;
+    const wchar_t *pwszEnd;
+    UINT           lenETag = SysStringLen(bstrETag);
+
+    while (*pwsz) {
+
+        if (*pwsz == L' ' || *pwsz == L'\t' || *pwsz == L',') {
+            pwsz++;
+            continue;
+        }
+
+        if (*pwsz == L'*') {
+            return true;
+        }
+
+        if (pwsz[0] == L'W' && pwsz[1] == L'/') {
+            pwsz += 2;
+        }
+
+        if (*pwsz != L'"') {
+            // Not an entity tag; skip to the next one.
+            while (*pwsz && *pwsz != L',') {
+                pwsz++;
             }
+            continue;
+        }
 
-            hr = PullStylesheetsFromDeviceInfo(pcomDeviceNode,
-                                               arrStylesheets,
-                                               pNumStylesheets);
-            HRCHECK(FAILED(hr));
+        pwszEnd = wcschr(pwsz + 1, L'"');
+        if (pwszEnd == NULL) {
+            break;
+        }
+        pwszEnd++;
 
-            gotStylesheets = true;
+        if (static_cast<UINT>(pwszEnd - pwsz) == lenETag &&
+            wcsncmp(pwsz, bstrETag, lenETag) == 0) {
+            return true;
         }
 
-        pcomDeviceNode.Release();
-        hr = pcomDeviceNodes->nextNode(&pcomDeviceNode);
-        HRCHECK(FAILED(hr));
+        pwsz = pwszEnd;
     }
 
-    if (!gotStylesheets) {
-        // Indicate that there were no matches.
-        *pNumStylesheets = -1;
+    return false;
+}
+
+// ============================================================================
+// AcceptsContentCoding
+//      Whether an Accept-Encoding header value allows pwszCoding: it
+//      has to be listed, or covered by "*", with a non-zero q value.
+static bool
+AcceptsContentCoding(const wchar_t *pwszAccept, // [in] Accept-Encoding value
+                     const wchar_t *pwszCoding) // [in] content coding
+{
+    const wchar_t *pwsz = pwszAccept;
+    const wchar_t *pwszToken;
+    UINT           lenToken;
+    UINT           lenCoding = wcslen(pwszCoding);
+    bool           bStar = false;
+
+    while (*pwsz) {
+
+        double q = 1;
+
+        if (*pwsz == L' ' || *pwsz == L'\t' || *pwsz == L',') {
+            pwsz++;
+            continue;
+        }
+
+        pwszToken = pwsz;
+        while (*pwsz && *pwsz != L',' && *pwsz != L';' &&
+               *pwsz != L' ' && *pwsz != L'\t') {
+            pwsz++;
+        }
+        lenToken = pwsz - pwszToken;
+
+        // Parameters; only q matters.
+        while (*pwsz && *pwsz != L',') {
+            if (*pwsz == L';') {
+                do {
+                    pwsz++;
+                } while (*pwsz == L' ' || *pwsz == L'\t');
+
+                if ((*pwsz == L'q' || *pwsz == L'Q') && pwsz[1] == L'=') {
+                    q = wcstod(pwsz + 2, NULL);
+                }
+                continue;
+            }
+            pwsz++;
+        }
+
+        // An explicit entry overrides "*", wherever it is.
+        if (lenToken == lenCoding &&
+            _wcsnicmp(pwszToken, pwszCoding, lenCoding) == 0) {
+            return q > 0;
+        }
+
+        if (lenToken == 1 && *pwszToken == L'*') {
+            bStar = q > 0;
+        }
     }
 
-    hr = S_OK;
-  Error:
-    return hr;
+    return bStar;
 }
 
 // ============================================================================
-// DoesDoctypeMatch
-//      Check a string to see if a doctype string is contained in a
-//      list of doctypes.
+// CXMLServerDocument::ComputeETag
+//      Build the entity tag for the response from the versions of
+//      everything it's made from: the source file, the server-config,
+//      the masterConfig.xml whose post-processing profiles the stream
+//      uses and each stylesheet of the chain, plus the output
+//      parameters and the content coding NegotiateContentEncoding
+//      picked.  (The user agent only matters through which stylesheets
+//      and output parameters it picks, so it's covered by those;
+//      SendValidators adds the Vary header caches need for it and the
+//      coding.)
+//      bstrETag is left empty when the output can't be validated: for
+//      generated XML, when some version is unknown (e.g. an http://
+//      stylesheet), and when reporting an error.
 HRESULT
-DoesDoctypeMatch(CComVariant & varDoctypeListInConfig,
-                 CComBSTR    & bstrDoctypeNameInDoc,
-                 bool        * pResult)
+CXMLServerDocument::ComputeETag(
+    CComBSTR      arrMappedPaths[],     // [in] server-mapped stylesheet paths
+    XmlCacheInfo  arrInfo[],            // [in] stylesheet versions
+    short         numStylesheets,       // [in] length of chain
+    BSTR          bstrContentType,      // [in] content type of the output
+    BSTR          bstrCharset,          // [in] charset of the output, or NULL
+    UINT          uiCP,                 // [in] code page of the output
+    BSTR          bstrContentEncoding,  // [in] content coding, or NULL
+    CComBSTR    & bstrETag)             // [out] quoted entity tag
 {
-    ASSERT(*pResult == false && "Expected to start out as false");
-    
-    HRESULT       hr;
-    CComBSTR      bstrDoctypeListInConfig;
+    HRESULT   hr;
+    CComBSTR  bstrKey;
+    wchar_t   wszCP[16];
+    short     stage;
 
-    hr = varDoctypeListInConfig.ChangeType(VT_BSTR);
-    HRCHECK(FAILED(hr));
+    bstrETag.Empty();
 
-    bstrDoctypeListInConfig = V_BSTR(&varDoctypeListInConfig);
-    ERRCHECK(bstrDoctypeListInConfig.m_str == NULL,
-             E_OUTOFMEMORY);
+    if (m_bInErrorHandling || !m_bSourceIsStatic) {
+        RETURNERR(S_OK);
+    }
 
-    wchar_t *pwEnd;
-    wchar_t *pwTokenStart;
-    bool     foundIt;
-    
-    pwEnd = bstrDoctypeListInConfig.m_str +
-            bstrDoctypeListInConfig.Length();
-    pwTokenStart = bstrDoctypeListInConfig.m_str;
-    foundIt = false;
+    hr = CChainCache::AppendToKey(bstrKey, m_bstrSourcePath, m_sourceInfo);
+    if (hr != S_OK) {
+        RETURNERR(FAILED(hr) ? hr : S_OK);
+    }
 
-    // Search through the list for the document's doctype.  We could
-    // use the CRT function wcstok here, but that brings in too much
-    // of the CRT and results in link problems when using _ATL_MIN_CRT
-    // as we are here.
-    while (!foundIt && pwTokenStart < pwEnd) {
+    if (m_bstrServerConfigPath.m_str) {
+        hr = CChainCache::AppendToKey(bstrKey,
+                                      m_bstrServerConfigPath,
+                                      m_serverConfigInfo);
+        if (hr != S_OK) {
+            RETURNERR(FAILED(hr) ? hr : S_OK);
+        }
+    }
 
-        // Skip whitespace
-        while (pwTokenStart < pwEnd &&
-               (*pwTokenStart == L' ' || *pwTokenStart == L',' || *pwTokenStart == L'\t')) {
-            pwTokenStart++;
+    // The version of the profiles, rather than of the file, in case
+    // the file changed and its profiles couldn't be used.
+    if (m_bstrProfilesConfig.m_str) {
+        hr = CChainCache::AppendToKey(bstrKey,
+                                      m_bstrProfilesConfig,
+                                      m_profilesInfo);
+        if (hr != S_OK) {
+            RETURNERR(FAILED(hr) ? hr : S_OK);
         }
+    }
 
-        // Skip over token to next whitespace
-        wchar_t *pwTokenEnd = pwTokenStart;
-        while (pwTokenEnd < pwEnd &&
-               (*pwTokenEnd != L' ' && *pwTokenEnd != L',' && *pwTokenEnd != L'\t')) {
-            pwTokenEnd++;
+    for (stage = 0; stage < numStylesheets; stage++) {
+        hr = CChainCache::AppendToKey(bstrKey,
+                                      arrMappedPaths[stage],
+                                      arrInfo[stage]);
+        if (hr != S_OK) {
+            RETURNERR(FAILED(hr) ? hr : S_OK);
         }
+    }
 
-        size_t len = pwTokenEnd - pwTokenStart;
-        if (len == bstrDoctypeNameInDoc.Length() &&
-            (wcsncmp(pwTokenStart, bstrDoctypeNameInDoc, len) == 0)) {
+    wsprintf(wszCP, L"%u|", uiCP);
 
-            foundIt = true;
-            
-        } else {
+    if (bstrContentType) {
+        hr = bstrKey.Append(bstrContentType);
+        HRCHECK(FAILED(hr));
+    }
 
-            // Go on to next token.
-            pwTokenStart = pwTokenEnd;
-        }
+    hr = bstrKey.Append(L"|");
+    HRCHECK(FAILED(hr));
+
+    if (bstrCharset) {
+        hr = bstrKey.Append(bstrCharset);
+        HRCHECK(FAILED(hr));
     }
 
-    if (foundIt) {
-        *pResult = true;
+    hr = bstrKey.Append(L"|");
+    HRCHECK(FAILED(hr));
+
+    hr = bstrKey.Append(wszCP);
+    HRCHECK(FAILED(hr));
+
+    if (bstrContentEncoding) {
+        hr = bstrKey.Append(bstrContentEncoding);
+        HRCHECK(FAILED(hr));
     }
 
+    hr = FormatETag(bstrKey, bstrETag);
+    HRCHECK(FAILED(hr));
+
     hr = S_OK;
   Error:
     return hr;
 }
 
 // ============================================================================
-// CXMLServerDocument::PullStylesheetsFromDeviceInfo
-//      Given that we have the root of the proper device node, yank
-//      out the stylesheet names to use.  Will also take "doctype"
-//      into account.
-//
-//      If there are no matches, return -1 in *pNumStylesheets.  Else
-//      return the number of array elements filled in by the matching
-//      <device> element (could be 0).
-
+// CXMLServerDocument::CheckChainNotModified
+//      CheckNotModified, before the stylesheets have been loaded.  If
+//      the request is conditional and every stylesheet of the chain is
+//      in the XML cache and up-to-date, the entity tag is computed from
+//      the cached versions (which include what each stylesheet
+//      includes or imports), exactly as it would be after loading.
+//      Otherwise nothing is sent, and ApplyStylesheets checks again
+//      once the chain is loaded.
 HRESULT
-CXMLServerDocument::PullStylesheetsFromDeviceInfo(
-    IXMLDOMNode  *pDeviceNode,      // [in] node in tree pointing to chosen device
-    CComBSTR      arrStylesheets[], // [in] array of strings of URLs for XSLs,
-                                    // [out] filled in array
-    short        *pNumStylesheets)  // [in] ptr to size of array
-                                    // [out] ptr to num of array slots filled in. 
+CXMLServerDocument::CheckChainNotModified(
+    asp::IResponse *pResponse,          // [in] response for this request
+    BSTR            arrStylesheets[],   // [in] stylesheet chain
+    short           numStylesheets,     // [in] length of chain
+    UINT            uiCP,               // [in] output code page
+    bool           *pbNotModified)      // [out] whether 304 was sent
 {
-    HRESULT hr;
-    CComPtr<IXMLDOMNodeList> pcomHREFs;
-    CComPtr<IXMLDOMNode>     pcomHREF;
-    CComPtr<IXMLDOMNodeList> pcomDoctypeNodes;
-    CComPtr<IXMLDOMNode>     pcomDoctypeNode;
-    wchar_t                  stylesheetPattern[] = L"stylesheet/@href";
-    wchar_t                  doctypePattern[] = L"doctype";
-    wchar_t                  doctypeNamePattern[] = L"@name";
-    bool                     foundDoctypeMatch = false;
-    const short              maxStylesheets = *pNumStylesheets;
+    HRESULT         hr;
+    CComBSTR        bstrIfNoneMatch;
+    CComBSTR        bstrMappedPaths[MAX_SHEETS_TO_CHAIN];
+    XmlCacheInfo    sheetInfo[MAX_SHEETS_TO_CHAIN];
+    CComBSTR        bstrETag;
+    char           *pszMappedPath = NULL;
+    short           stage;
 
-    *pNumStylesheets = 0;
-
-    // Grab both the top-level stylesheet/@href nodes and the top
-    // level doctype nodes.  They shouldn't both simultaneously
-    // exist. 
-    hr = pDeviceNode->selectNodes(stylesheetPattern, &pcomHREFs);
-    HRCHECK(FAILED(hr));
+    *pbNotModified = false;
 
-    hr = pcomHREFs->nextNode(&pcomHREF);
-    HRCHECK(FAILED(hr));
+    if (!m_bSourceIsStatic) {
+        RETURNERR(S_OK);
+    }
 
-    hr = pDeviceNode->selectNodes(doctypePattern, &pcomDoctypeNodes);
+    hr = EnsureAspRequestObject();
     HRCHECK(FAILED(hr));
 
-    hr = pcomDoctypeNodes->nextNode(&pcomDoctypeNode);
+    hr = ::GetServerVariable(m_pcomASPRequest,
+                             L"HTTP_IF_NONE_MATCH",
+                             bstrIfNoneMatch);
     HRCHECK(FAILED(hr));
 
-    if (pcomHREF.p != NULL && pcomDoctypeNode.p != NULL) {
-        SetError(L"Cannot have both a stylesheet node and a doctype node contained within a device node",
-                 m_bstrURLServerConfig,
-                 L"500.100 Internal Server Error - ASP Error");
-        RETURNERR(E_FAIL);
+    if (bstrIfNoneMatch.m_str == NULL) {
+        RETURNERR(S_OK);
     }
 
-    if (pcomDoctypeNode.p != NULL) {
-
-        // Have doctypes, so change our context based upon the doctype
-        // match.
-        while (!foundDoctypeMatch && pcomDoctypeNode.p != NULL) {
-
-            // Now have the "<doctype>" node, need to get to the
-            // "name" attribute of it.  If there is a <doctype>
-            // element without a name attribute, consider it to be the
-            // default and allow it to match.
-            
-            CComPtr<IXMLDOMNode> pcomDoctypeNameNode;
+    for (stage = 0; stage < numStylesheets; stage++) {
 
-            hr = pcomDoctypeNode->selectSingleNode(doctypeNamePattern,
-                                                   &pcomDoctypeNameNode);
-            HRCHECK(FAILED(hr));
+        hr = ResolveServerMappedPath(arrStylesheets[stage],
+                                     m_bstrConfigDirectory,
+                                     false,
+                                     &bstrMappedPaths[stage]);
+        HRCHECK(FAILED(hr));
 
-            if (pcomDoctypeNameNode.p == NULL) {
+        pszMappedPath = ::WideToAscii(bstrMappedPaths[stage]);
+        ERRCHECK(pszMappedPath == NULL, E_OUTOFMEMORY);
 
-                // <doctype> element without a "name" attribute.
-                foundDoctypeMatch = true;
-                
-            } else if (m_bstrDoctypeName.m_str != NULL) {
-            
-                CComVariant varDoctypeNameInConfig;
-                
-                hr = pcomDoctypeNameNode->get_nodeValue(&varDoctypeNameInConfig);
-                HRCHECK(FAILED(hr));
+        hr = g_xmlCache->GetCurrentInfo(pszMappedPath, &sheetInfo[stage]);
+        HRCHECK(FAILED(hr));
 
-                hr = DoesDoctypeMatch(varDoctypeNameInConfig,
-                                      m_bstrDoctypeName,
-                                      &foundDoctypeMatch);
-                HRCHECK(FAILED(hr));
-                
-            }
+        delete [] pszMappedPath;
+        pszMappedPath = NULL;
 
-            if (!foundDoctypeMatch) {
-                pcomDoctypeNode.Release();
-                hr = pcomDoctypeNodes->nextNode(&pcomDoctypeNode);
-                HRCHECK(FAILED(hr));
-            }
+        if (hr != S_OK) {
+            RETURNERR(S_OK);
         }
     }
 
-    if (foundDoctypeMatch) {
-        // This part actually switches the souce of the pcomHREF
-        // node to be underneath the matching doctype.
-        pcomHREFs.Release();
-        hr = pcomDoctypeNode->selectNodes(stylesheetPattern,
-                                          &pcomHREFs);
-        HRCHECK(FAILED(hr));
+    hr = NegotiateContentEncoding();
+    HRCHECK(FAILED(hr));
 
-        hr = pcomHREFs->nextNode(&pcomHREF);
-        HRCHECK(FAILED(hr));
-    }
+    hr = ComputeETag(bstrMappedPaths,
+                     sheetInfo,
+                     numStylesheets,
+                     m_bstrContentType,
+                     m_bstrCharset,
+                     uiCP,
+                     m_bstrContentEncoding,
+                     bstrETag);
+    HRCHECK(FAILED(hr));
 
-    // Now loop through the stylesheets.
-    while (pcomHREF.p != NULL) {
+    hr = CheckNotModified(pResponse, bstrETag, pbNotModified);
+    HRCHECK(FAILED(hr));
 
-        CComVariant varHREFValue;
-                
-        // Just grab the value out of here and put it in the
-        // results.
-        hr = pcomHREF->get_nodeValue(&varHREFValue);
-        HRCHECK(FAILED(hr));
+    hr = S_OK;
+  Error:
+    delete [] pszMappedPath;
+    return hr;
+}
 
-        hr = varHREFValue.ChangeType(VT_BSTR);
-        HRCHECK(FAILED(hr));
+// ============================================================================
+// CXMLServerDocument::CheckNotModified
+//      If the client already has the output with this entity tag, send
+//      304 Not Modified (with the validators, but no body) and set
+//      *pbNotModified.  Nothing is done if bstrETag is empty.
+HRESULT
+CXMLServerDocument::CheckNotModified(
+    asp::IResponse *pResponse,          // [in] response for this request
+    BSTR            bstrETag,           // [in] entity tag of the output
+    bool           *pbNotModified)      // [out] whether 304 was sent
+{
+    HRESULT                 hr;
+    CComBSTR                bstrIfNoneMatch;
 
-        // Didn't pass in enough stylesheets to fill up.
-        if (*pNumStylesheets >= maxStylesheets) {
-            SetError(L"Attempting to chain too many stylesheets",
-                     m_bstrURL,
-                     L"500.100 Internal Server Error - ASP Error");
-            RETURNERR(E_FAIL);
-        }
-                    
-        arrStylesheets[*pNumStylesheets] = V_BSTR(&varHREFValue);
-        (*pNumStylesheets)++;
+    *pbNotModified = false;
 
-        pcomHREF.Release();
-        hr = pcomHREFs->nextNode(&pcomHREF);
-        HRCHECK(FAILED(hr));
+    if (SysStringLen(bstrETag) == 0) {
+        RETURNERR(S_OK);
     }
 
+    hr = EnsureAspRequestObject();
+    HRCHECK(FAILED(hr));
+
+    hr = ::GetServerVariable(m_pcomASPRequest,
+                             L"HTTP_IF_NONE_MATCH",
+                             bstrIfNoneMatch);
+    HRCHECK(FAILED(hr));
+
+    if (bstrIfNoneMatch.m_str == NULL ||
+        !ETagListMatches(bstrIfNoneMatch, bstrETag)) {
+        RETURNERR(S_OK);
+    }
+
+    hr = pResponse->put_Status(L"304 Not Modified");
+    HRCHECK(FAILED(hr));
+
+    m_trace.SetNotModified();
+
+    hr = SendValidators(pResponse, bstrETag, false);
+    HRCHECK(FAILED(hr));
+
+    *pbNotModified = true;
+
     hr = S_OK;
   Error:
     return hr;
 }
 
 // ============================================================================
-// CXMLServerDocument::ApplyStylesheets
-//      Sequentially apply given stylesheets, writing the final
-//      response to provided response object.
+// CXMLServerDocument::WriteServiceUnavailable
+//      Send a short 503 response, without going through the error
+//      stylesheets, which would only add to the load.
+
 HRESULT
-CXMLServerDocument::ApplyStylesheets(asp::IResponse *pResponse,
-                                     CComBSTR        arrStylesheets[],
-                                     short           numStylesheets)
-{
-    HRESULT hr;
-    CComPtr<IStream> pcomResponseStream;
-    CComPtr<IStream> pcomProcessedResponseStream;
-    UINT uiCP;
+CXMLServerDocument::WriteServiceUnavailable(
+    asp::IResponse *pResponse)          // [in] response for this request
+{
+    HRESULT hr;
 
-    hr = pResponse->put_ContentType(m_bstrContentType);
+    hr = pResponse->Clear();
     HRCHECK(FAILED(hr));
 
-    hr = VerifyEncodingAndCharset(&uiCP);
+    hr = pResponse->put_Status(L"503 Service Unavailable");
     HRCHECK(FAILED(hr));
 
-    // Charset should be set in VerifyEncodingAndCharset() if not configured
-    ASSERT(m_bstrCharset.Length());
-    hr = pResponse->put_CharSet(m_bstrCharset);
+    hr = pResponse->AddHeader(L"Retry-After", L"5");
     HRCHECK(FAILED(hr));
 
-    // No failure check is needed when retrieving IStream since it is not
-    // required, just nice to have it.  Note that the Response object in
-    // NT4/IIS4 doesn't support IStream.
-    hr = pResponse->QueryInterface(IID_IStream,
-                                   reinterpret_cast<void**>(&pcomResponseStream));
-
-    // Both IStream and IResponse interfaces are passed in.  ProcessingStream
-    // object will pick the right interface to use.
-    hr = CreateProcessingStream(pcomResponseStream,
-                                pResponse,
-                                m_bstrContentType,
-                                uiCP,
-                                &pcomProcessedResponseStream);
+    hr = pResponse->put_ContentType(L"text/html");
     HRCHECK(FAILED(hr));
 
-    if (numStylesheets == 0) {
-        
-        hr = m_pcomXMLDocument->save(CComVariant(pcomProcessedResponseStream));
-        HRCHECK(FAILED(hr));
-        
-    } else {
-
-        // Go through each of the stylesheets, transforming into a new
-        // XML document, until the last one, when we transform into
-        // the post-processing response stream.
-        short                     stylesheetsLeft = numStylesheets;
-        short                     stylesheetIndex = 0;
-        IXMLDOMDocument          *pSrcDoc = m_pcomXMLDocument;
-        CComPtr<IXMLDOMDocument>  pcomXslDoc;
-        CComPtr<IXSLTemplate>     pcomXslTemplate;
-        CComPtr<IXMLDOMDocument>  pcomDstDocs[2];
-        int                       dstDocIndex = 0;
-        CComVariant               varDstDoc;
+    hr = pResponse->Write(CComVariant(L"<html><body><h1>Service Unavailable</h1>"
+                                      L"<p>The server is too busy to handle "
+                                      L"this request.  Please try again "
+                                      L"shortly.</p></body></html>"));
+    HRCHECK(FAILED(hr));
 
-        while (stylesheetsLeft > 0) {
+    hr = S_OK;
+  Error:
+    return hr;
+}
 
-            // Load in XSL
-            pcomXslDoc.Release();
-            pcomXslTemplate.Release();
+// ============================================================================
+// CXMLServerDocument::SendValidators
+//      Add the ETag and Vary headers.  This is done only once the
+//      output has been produced, so that an error page sent in its
+//      place (see HandleError) never carries the entity tag.  After
+//      the output, that needs response buffering: if it's off, the
+//      headers have already gone out, and S_FALSE is returned without
+//      trying to add them.
+HRESULT
+CXMLServerDocument::SendValidators(
+    asp::IResponse *pResponse,          // [in] response for this request
+    BSTR            bstrETag,           // [in] entity tag of the output
+    bool            bAfterOutput)       // [in] whether output was written
+{
+    HRESULT      hr;
+    VARIANT_BOOL vbBuffer;
 
-            hr = LoadXMLFromRelativeLoc(arrStylesheets[stylesheetIndex],
-                                        m_bstrConfigDirectory,
-                                        false,
-                                        &pcomXslDoc,
-                                        &pcomXslTemplate);
-            HRCHECK(FAILED(hr));
+    if (SysStringLen(bstrETag) == 0) {
+        RETURNERR(S_FALSE);
+    }
 
-            if (stylesheetsLeft == 1) {
+    if (bAfterOutput) {
+        hr = pResponse->get_Buffer(&vbBuffer);
+        HRCHECK(FAILED(hr));
 
-                // Write to the stream for the last one
-                varDstDoc = pcomProcessedResponseStream;
-                
-            } else {
+        if (vbBuffer == VARIANT_FALSE) {
+            RETURNERR(S_FALSE);
+        }
+    }
 
-                // Else write to a DOM document, but make sure the
-                // ping-pong buffers we use are set up initially.
+    hr = pResponse->AddHeader(L"ETag", bstrETag);
+    HRCHECK(FAILED(hr));
 
-                // TODO: This is place where perf can be improved by
-                // maintaining a pool of XML document objects for use
-                // by multiple threads and instances of this filter.
-                if (pcomDstDocs[dstDocIndex].p == NULL) {
-                    hr = CreateXMLDocumentOnCComPtr(pcomDstDocs[dstDocIndex]);
-                    HRCHECK(FAILED(hr));
-                }
+    hr = pResponse->AddHeader(L"Vary",
+                              (m_cbCompressMin >= 0) ?
+                                  L"User-Agent, Accept-Encoding" :
+                                  L"User-Agent");
+    HRCHECK(FAILED(hr));
 
-                varDstDoc = pcomDstDocs[dstDocIndex];
+    hr = S_OK;
+  Error:
+    return hr;
+}
 
-            }
+// ============================================================================
+// CXMLServerDocument::NegotiateContentEncoding
+//      Pick the content coding to compress the output with, from what
+//      the client says it accepts: gzip if possible, deflate otherwise.
+//      m_bstrContentEncoding is left empty if the output isn't to be
+//      compressed.  When reporting an error, whatever was picked for
+//      the page it replaces stays, if it has already been announced
+//      (see CreateProcessingStream).
+HRESULT
+CXMLServerDocument::NegotiateContentEncoding()
+{
+    HRESULT   hr;
+    CComBSTR  bstrAcceptEncoding;
 
-            if (pcomXslTemplate.p) {
+    if (m_bInErrorHandling) {
+        if (!m_bContentEncodingSent) {
+            m_bstrContentEncoding.Empty();
+        }
+        RETURNERR(S_OK);
+    }
 
-                CComPtr<IXSLProcessor> pcomXslProc;
-                VARIANT_BOOL           done;
-                bool                   failed = false;
-                
-                hr = pcomXslTemplate->createProcessor(&pcomXslProc);
-                HRCHECK(FAILED(hr));
+    m_bstrContentEncoding.Empty();
+    m_bContentEncodingSent = false;
 
-                hr = pcomXslProc->put_input(CComVariant(pSrcDoc));
-                HRCHECK(FAILED(hr));
+    if (m_cbCompressMin < 0) {
+        RETURNERR(S_OK);
+    }
 
-                hr = pcomXslProc->put_output(varDstDoc);
-                HRCHECK(FAILED(hr));
+    hr = EnsureAspRequestObject();
+    HRCHECK(FAILED(hr));
 
-                done = VARIANT_FALSE;
-                while (!failed && done == VARIANT_FALSE) {
-                    hr = pcomXslProc->transform(&done);
-                    if (FAILED(hr)) {
-                        failed = true;
-                    }
-                }
-                
-            } else {
-                
-                hr = pSrcDoc->transformNodeToObject(pcomXslDoc,
-                                                    varDstDoc);
-                
-            }
-            
-            if (FAILED(hr)) {
-                SetErrorToLastCOMError(arrStylesheets[stylesheetIndex]);
-                RETURNERR(hr);
-            }
+    hr = ::GetServerVariable(m_pcomASPRequest,
+                             L"HTTP_ACCEPT_ENCODING",
+                             bstrAcceptEncoding);
+    HRCHECK(FAILED(hr));
 
-            // Previous dest is source for the next one...
-            pSrcDoc = pcomDstDocs[dstDocIndex];
-            
-            stylesheetIndex++;
-            stylesheetsLeft--;
-            dstDocIndex = 1 - dstDocIndex; // toggle between 0 and 1.
-            
-        }
+    if (bstrAcceptEncoding.m_str == NULL) {
+        RETURNERR(S_OK);
     }
 
-    hr = pcomProcessedResponseStream->Commit(STGC_DEFAULT);
-    HRCHECK(FAILED(hr));
+    if (AcceptsContentCoding(bstrAcceptEncoding, L"gzip") ||
+        AcceptsContentCoding(bstrAcceptEncoding, L"x-gzip")) {
+        m_bstrContentEncoding = L"gzip";
+    } else if (AcceptsContentCoding(bstrAcceptEncoding, L"deflate")) {
+        m_bstrContentEncoding = L"deflate";
+    } else {
+        RETURNERR(S_OK);
+    }
+    ERRCHECK(m_bstrContentEncoding.m_str == NULL, E_OUTOFMEMORY);
 
     hr = S_OK;
   Error:
@@ -1410,6 +3581,59 @@ CXMLServerDocument::VerifyEncodingAndCharset(UINT *puiCP)
 }
 
 
+// ============================================================================
+// CXMLServerDocument::LoadErrorDocument
+//      Replace the document with one describing the current error, to
+//      be transformed by the error stylesheets.
+
+HRESULT
+CXMLServerDocument::LoadErrorDocument(
+    BSTR bstrURL,                           // [in] <url> of the error
+    BSTR bstrInfo)                          // [in] <info> of the error
+{
+    HRESULT       hr;
+    CComBSTR      bstrXML;
+    VARIANT_BOOL  result;
+
+    hr = bstrXML.Append(
+        L"<?xml version=\"1.0\"?>"
+        L"<?xml-stylesheet type=\"text/xsl\" server-config=\"/xslisapi/errorConfig.xml\"?>"
+        L"<error><status-code>");
+    HRCHECK(FAILED(hr));
+
+    hr = AppendXMLText(bstrXML, m_bstrErrorHTTPCode);
+    HRCHECK(FAILED(hr));
+
+    hr = bstrXML.Append(L"</status-code><url>");
+    HRCHECK(FAILED(hr));
+
+    hr = AppendXMLText(bstrXML, bstrURL);
+    HRCHECK(FAILED(hr));
+
+    hr = bstrXML.Append(L"</url><info>");
+    HRCHECK(FAILED(hr));
+
+    hr = AppendXMLText(bstrXML, bstrInfo);
+    HRCHECK(FAILED(hr));
+
+    hr = bstrXML.Append(L"</info></error>");
+    HRCHECK(FAILED(hr));
+
+    hr = EnsureXMLDocumentObject(false);
+    HRCHECK(FAILED(hr));
+    
+    m_bSourceIsStatic = false;
+    m_bSourcePending = false;
+    m_xmlWriteBuffer.Empty();
+    hr = m_pcomXMLDocument->loadXML(bstrXML, &result);
+    HRCHECK(FAILED(hr));
+    ERRCHECK(result == VARIANT_FALSE, E_FAIL);
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
 // ============================================================================
 // CXMLServerDocument::HandleError
 //      Handles errors generated in the process
@@ -1420,20 +3644,6 @@ CXMLServerDocument::HandleError(
 {
     HRESULT                  hr = S_OK;
     CComPtr<asp::IResponse>  pcomResponse;
-    VARIANT_BOOL             result;
-    long                     len;
-    wchar_t                 *buffer;
-
-    const wchar_t *part1 =
-        L"<?xml version=\"1.0\"?>"
-        L"<?xml-stylesheet type=\"text/xsl\" server-config=\"/xslisapi/errorConfig.xml\"?>"
-        L"<error><status-code>";
-    
-    const wchar_t *part2 = L"</status-code><url>";
-    const wchar_t *part3 = L"</url><info><![CDATA[";
-    const wchar_t *part4 = L"]]></info></error>";
-    const long constantLength = wcslen(part1) + wcslen(part2) +
-                                wcslen(part3) + wcslen(part4);
 
     ERRCHECK (pdispResponse == NULL, E_POINTER);
  
@@ -1448,36 +3658,27 @@ CXMLServerDocument::HandleError(
                  L"500.100 Internal Server Error - ASP Error");
     }
 
-    // refill document with error schema
-    len = constantLength +
-          m_bstrErrorDescrip.Length() +
-          m_bstrErrorHTTPCode.Length() +
-          m_bstrErrorURL.Length() + 1;
-
-    buffer = static_cast<wchar_t*>(_alloca(len * sizeof(wchar_t)));
-    ERRCHECK(buffer == NULL, E_OUTOFMEMORY);
-    
-    wcscpy(buffer, part1);
-    wcscat(buffer, m_bstrErrorHTTPCode);
-    wcscat(buffer, part2);
-    wcscat(buffer, m_bstrErrorURL);
-    wcscat(buffer, part3);
-    wcscat(buffer, m_bstrErrorDescrip);
-    wcscat(buffer, part4);
-
-    hr = EnsureXMLDocumentObject(false);
-    HRCHECK(FAILED(hr));
-    
-    hr = m_pcomXMLDocument->loadXML(CComBSTR(buffer), &result);
-    HRCHECK(FAILED(hr));
-    ERRCHECK(result == VARIANT_FALSE, E_FAIL);
-    
     // Make sure we've been given a real response object.
     hr = pdispResponse->QueryInterface (
             asp::IID_IResponse,
             reinterpret_cast<void **>(&pcomResponse));
     HRCHECK (FAILED(hr));
 
+    // Send the page rendered for an earlier error of this kind if
+    // there is one.
+    if (g_errorPageCache->IsEnabled()) {
+        hr = WritePrerenderedError(pdispResponse, pcomResponse);
+        HRCHECK(FAILED(hr));
+
+        if (hr == S_OK) {
+            RETURNERR(S_OK);
+        }
+    }
+
+    // refill document with error schema
+    hr = LoadErrorDocument(m_bstrErrorURL, m_bstrErrorDescrip);
+    HRCHECK(FAILED(hr));
+
     hr = pcomResponse->Clear();
     HRCHECK(FAILED(hr));
 
@@ -1493,6 +3694,246 @@ CXMLServerDocument::HandleError(
     return hr;
 }
 
+// ============================================================================
+// CXMLServerDocument::GetBrowserProfileKey
+//      What a page depends on of the browser, for keys.  That's only
+//      its properties, so with the native browscap.ini reader it's the
+//      section the User-Agent matched, which many User-Agents share.
+//      Properties from the BrowserType component don't say where they
+//      came from, so then it's the User-Agent itself.
+HRESULT
+CXMLServerDocument::GetBrowserProfileKey(
+    CComBSTR & bstrProfile)                 // [out] key for the browser
+{
+    HRESULT  hr;
+    CComBSTR bstrUserAgent;
+
+    bstrProfile.Empty();
+
+    hr = InitializeBrowserCapAndAttribs();
+    HRCHECK(FAILED(hr));
+
+    if (m_browscapMatch.IsValid()) {
+        hr = bstrProfile.Append(L"s:");
+        HRCHECK(FAILED(hr));
+
+        hr = m_browscapMatch.AppendKey(bstrProfile);
+        HRCHECK(FAILED(hr));
+
+        RETURNERR(S_OK);
+    }
+
+    hr = EnsureAspRequestObject();
+    HRCHECK(FAILED(hr));
+
+    hr = ::GetServerVariable(m_pcomASPRequest,
+                             L"HTTP_USER_AGENT",
+                             bstrUserAgent);
+    HRCHECK(FAILED(hr));
+
+    hr = bstrProfile.Append(L"u:");
+    HRCHECK(FAILED(hr));
+
+    if (bstrUserAgent.m_str) {
+        hr = bstrProfile.Append(bstrUserAgent);
+        HRCHECK(FAILED(hr));
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CXMLServerDocument::WritePrerenderedError
+//      Send the error page from the error page cache, rendering it
+//      first if it isn't there.  Error pages differ by status code and
+//      browser profile, and by the settings carried over from the page
+//      that failed; the URL and description are filled in here.
+//      S_FALSE if the error stylesheets' output can't be reused (as
+//      found now or by an earlier error of the kind), in which case
+//      nothing has been sent.
+
+HRESULT
+CXMLServerDocument::WritePrerenderedError(
+    IDispatch      *pdispResponse,          // [in] Response object
+    asp::IResponse *pResponse)              // [in] its IResponse
+{
+    HRESULT           hr;
+    CComBSTR          bstrKey;
+    CComBSTR          bstrProfile;
+    CErrorPage       *pPage = NULL;
+    CPooledBuffer     output;
+    CComPtr<IStream>  pcomResponseStream;
+    CComPtr<IStream>  pcomProcessedResponseStream;
+    const WCHAR       chBOM = L'\xFEFF';
+    BSTR              arrKeyParts[6];
+
+    hr = GetBrowserProfileKey(bstrProfile);
+    HRCHECK(FAILED(hr));
+
+    arrKeyParts[0] = m_bstrErrorHTTPCode;
+    arrKeyParts[1] = bstrProfile;
+    arrKeyParts[2] = m_bstrContentType;
+    arrKeyParts[3] = m_bstrCharset;
+    arrKeyParts[4] = m_bstrEncoding;
+    arrKeyParts[5] = m_bContentEncodingSent ? m_bstrContentEncoding.m_str : NULL;
+
+    for (UINT i = 0; i < COUNTOF(arrKeyParts); i++) {
+        if (arrKeyParts[i]) {
+            hr = bstrKey.Append(arrKeyParts[i]);
+            HRCHECK(FAILED(hr));
+        }
+
+        hr = bstrKey.Append(L"|");
+        HRCHECK(FAILED(hr));
+    }
+
+    hr = g_errorPageCache->Lookup(bstrKey, &pPage);
+    HRCHECK(FAILED(hr));
+
+    if (pPage == NULL) {
+        hr = RenderErrorPage(pdispResponse, bstrKey, &pPage);
+        HRCHECK(FAILED(hr));
+    }
+
+    if (pPage == NULL || !pPage->HasTemplate()) {
+        RETURNERR(S_FALSE);
+    }
+
+    hr = pPage->Render(m_bstrErrorURL, m_bstrErrorDescrip, output);
+    HRCHECK(FAILED(hr));
+
+    hr = pResponse->Clear();
+    HRCHECK(FAILED(hr));
+
+    hr = NegotiateContentEncoding();
+    HRCHECK(FAILED(hr));
+
+    m_bstrContentType = pPage->GetContentType();
+    m_bstrCharset = pPage->GetCharset();
+
+    hr = pResponse->put_ContentType(m_bstrContentType);
+    HRCHECK(FAILED(hr));
+
+    hr = pResponse->put_CharSet(m_bstrCharset);
+    HRCHECK(FAILED(hr));
+
+    // As in ApplyStylesheets, IStream is optional.
+    hr = pResponse->QueryInterface(IID_IStream,
+                                   reinterpret_cast<void**>(&pcomResponseStream));
+
+    hr = CreateProcessingStream(pcomResponseStream,
+                                pResponse,
+                                m_bstrContentType,
+                                m_bstrProfilesConfig,
+                                pPage->GetCodePage(),
+                                m_bstrContentEncoding,
+                                m_cbCompressMin,
+                                &m_bContentEncodingSent,
+                                &m_trace,
+                                &pcomProcessedResponseStream);
+    HRCHECK(FAILED(hr));
+
+    // The processing stream expects the byte-order mark on its own,
+    // as the first write.
+    hr = pcomProcessedResponseStream->Write(&chBOM, sizeof(chBOM), NULL);
+    HRCHECK(FAILED(hr));
+
+    hr = output.WriteTo(pcomProcessedResponseStream);
+    HRCHECK(FAILED(hr));
+
+    hr = pcomProcessedResponseStream->Commit(STGC_DEFAULT);
+    HRCHECK(FAILED(hr));
+
+    hr = S_OK;
+  Error:
+    if (pPage) {
+        pPage->Release();
+    }
+    return hr;
+}
+
+// ============================================================================
+// CXMLServerDocument::RenderErrorPage
+//      Run the error stylesheets on a document whose URL and
+//      description are placeholders, into a new CErrorPage, and add it
+//      to the cache.  If the output can't be reused, the page goes in
+//      without a template, so that later errors of the kind go straight
+//      to the error stylesheets.
+
+HRESULT
+CXMLServerDocument::RenderErrorPage(
+    IDispatch   *pdispResponse,             // [in] Response object
+    BSTR         bstrKey,                   // [in] key for the cache
+    CErrorPage **ppPage)                    // [out] the page, AddRef'd
+{
+    HRESULT      hr;
+    CComBSTR     bstrURL(m_bstrErrorURL);
+    CComBSTR     bstrInfo(m_bstrErrorDescrip);
+    CComBSTR     bstrHTTPCode(m_bstrErrorHTTPCode);
+    CErrorPage  *pPage = NULL;
+    HGLOBAL      hGlobal;
+    STATSTG      statstg;
+    wchar_t     *pwchOutput;
+
+    *ppPage = NULL;
+
+    pPage = new CErrorPage();
+    ERRCHECK(pPage == NULL, E_OUTOFMEMORY);
+
+    hr = pPage->SetKey(bstrKey);
+    HRCHECK(FAILED(hr));
+
+    hr = LoadErrorDocument(CComBSTR(CErrorPage::GetPlaceholder(CErrorPage::VALUE_URL)),
+                           CComBSTR(CErrorPage::GetPlaceholder(CErrorPage::VALUE_INFO)));
+    HRCHECK(FAILED(hr));
+
+    hr = CreateStreamOnHGlobal(NULL, TRUE, &m_pcomErrorCapture);
+    HRCHECK(FAILED(hr));
+
+    // Transform() clears the error, so it's put back afterwards.
+    m_pCapturePage = pPage;
+    hr = Transform(pdispResponse);
+    m_pCapturePage = NULL;
+    SetError(bstrInfo, bstrURL, bstrHTTPCode);
+    HRCHECK(FAILED(hr));
+
+    // S_FALSE if the document wasn't transformed (see WriteIdentityXML).
+    // That's down to the server-config.
+    if (hr != S_OK) {
+        hr = pPage->AddDependency(m_bstrServerConfigPath, m_serverConfigInfo);
+        HRCHECK(FAILED(hr));
+    } else {
+        hr = m_pcomErrorCapture->Stat(&statstg, STATFLAG_NONAME);
+        HRCHECK(FAILED(hr));
+
+        hr = GetHGlobalFromStream(m_pcomErrorCapture, &hGlobal);
+        HRCHECK(FAILED(hr));
+
+        pwchOutput = static_cast<wchar_t *>(GlobalLock(hGlobal));
+        ERRCHECK(pwchOutput == NULL && statstg.cbSize.LowPart, E_OUTOFMEMORY);
+
+        hr = pPage->Build(pwchOutput, statstg.cbSize.LowPart / sizeof(wchar_t));
+        GlobalUnlock(hGlobal);
+        HRCHECK(FAILED(hr));
+    }
+
+    // Failing to cache the page doesn't fail the request.
+    g_errorPageCache->Add(pPage);
+
+    *ppPage = pPage;
+    pPage = NULL;
+
+    hr = S_OK;
+  Error:
+    m_pcomErrorCapture.Release();
+    if (pPage) {
+        pPage->Release();
+    }
+    return hr;
+}
+
 // ============================================================================
 // CXMLServerDocument::ClearError
 //      Clears out error structures
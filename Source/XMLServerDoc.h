@@ -8,7 +8,15 @@
 
 #pragma once
 
+#include "arena.h"
 #include "PIParse.h"
+#include "xmlcache.h"
+#include "bufferpool.h"
+#include "Global.h"
+#include "phasestats.h"
+#include "browsercaps.h"
+#include "browscap.h"
+#include "errorpages.h"
 
 // ============================================================================
 // CLASS: CXMLServerDocument
@@ -19,7 +27,7 @@
 class ATL_NO_VTABLE CXMLServerDocument : 
     public CComObjectRootEx<CComMultiThreadModel>,
     public CComCoClass<CXMLServerDocument, &CLSID_XMLServerDocument>,
-    public IDispatchImpl<IXMLServerDocument, &IID_IXMLServerDocument, &LIBID_XSLISAPI2Lib>
+    public IDispatchImpl<IXMLServerDocument3, &IID_IXMLServerDocument3, &LIBID_XSLISAPI2Lib>
 {
 public:
 
@@ -28,15 +36,47 @@ DECLARE_REGISTRY_RESOURCEID(IDR_XMLSERVERDOCUMENT)
 DECLARE_PROTECT_FINAL_CONSTRUCT()
 
 BEGIN_COM_MAP(CXMLServerDocument)
+    COM_INTERFACE_ENTRY(IXMLServerDocument3)
+    COM_INTERFACE_ENTRY(IXMLServerDocument2)
     COM_INTERFACE_ENTRY(IXMLServerDocument)
     COM_INTERFACE_ENTRY(IDispatch)
 END_COM_MAP()
 
   public:
     CXMLServerDocument() : m_bInErrorHandling(false),
-                           m_bResponseEndCalled(false) {}
+                           m_bResponseEndCalled(false),
+                           m_bSourceIsStatic(false),
+                           m_bSourcePending(false),
+                           m_bContentEncodingSent(false),
+                           m_bBrowserCapsInitialized(false),
+                           m_cbCompressMin(-1),
+                           m_cbXMLWritten(0),
+                           m_bUTF8Input(false),
+                           m_wchPendingSurrogate(0),
+                           m_parseTicks(0),
+                           m_transformDeadline(0),
+                           m_pBrowserCaps(NULL),
+                           m_pCapturePage(NULL) {}
+    ~CXMLServerDocument() {
+        if (m_pBrowserCaps) {
+            m_pBrowserCaps->Release();
+        }
+    }
     HRESULT SetErrorToLastCOMError(wchar_t *pwszURL);
 
+    // Render a page of the site to a stream, without a request: the
+    // site is the directory bstrRootDirectory, and the page is
+    // rendered for bstrUserAgent (which may be NULL).  After a
+    // failure, GetErrorDescription() may say why.
+    HRESULT RenderOffline(BSTR     bstrRootDirectory,
+                          BSTR     bstrURL,
+                          BSTR     bstrUserAgent,
+                          IStream *pOutput);
+
+    BSTR GetErrorDescription() const {
+        return m_bstrErrorDescrip;
+    }
+
 // IXMLServerDocument
     STDMETHOD(put_URL)(/*[in]*/ BSTR bstrURL);
     STDMETHOD(put_UserAgent)(/*[in]*/ BSTR bstrUserAgent);
@@ -55,31 +95,108 @@ END_COM_MAP()
                         BSTR errorURL,
                         BSTR errorHTTPCode);
     STDMETHOD(ClearError());
+
+// IXMLServerDocument2
+    STDMETHOD(get_Statistics)(/*[out, retval]*/ BSTR *pbstrStatistics);
+
+// IXMLServerDocument3
+    STDMETHOD(TransformBatch)(/*[in]*/ BSTR bstrJobs,
+                              /*[in]*/ BSTR bstrRootDirectory,
+                              /*[in]*/ long nThreads,
+                              /*[in]*/ long nTimeoutSeconds,
+                              /*[out, retval]*/ BSTR *pbstrReport);
     
   private:
     HRESULT EnsureXMLDocumentObject(bool bAcquireStream);
     HRESULT EnsureAspServerObject();
+    HRESULT EnsureAspRequestObject();
+    HRESULT EnsureSourceLoaded();
+    HRESULT RecheckSourceVersion();
     HRESULT WriteToXML(BSTR bstrLine, bool bAddCR);
+    HRESULT AppendUTF8ToXML(const wchar_t *pwch, ULONG cch);
+    HRESULT FlushXMLWriteBuffer(bool bLast = false,
+                                const void *pvMore = NULL,
+                                ULONG cbMore = 0);
+    HRESULT TransformTo(asp::IResponse *pResponse);
     HRESULT WriteIdentityXML(asp::IResponse *pResponse);
     HRESULT LoadMasterConfig(CComBSTR & bstrSpecialPIAttrib);
     HRESULT GetServerConfig(IXMLDOMDocument **pServerConfig);
     HRESULT GetDoctype();
     HRESULT InitializeBrowserCapAndAttribs();
+    HRESULT EnsureBrowserTypeObject();
+    HRESULT GetBrowserCap(const wchar_t *pwszName, CComVariant & varValue);
+    HRESULT GrabBrowserCap(const wchar_t *pwszName,
+                           const wchar_t *pwszDefault,
+                           CComBSTR & bstrDestination);
     HRESULT ExtractStylesheets(IXMLDOMDocument  *pServerConfig,
-                               CComBSTR          arrStylesheets[],
+                               BSTR              arrStylesheets[],
                                short            *pNumStylesheets);
     HRESULT PullStylesheetsFromDeviceInfo(IXMLDOMNode  *pServerConfig,
-                                          CComBSTR      arrStylesheets[],
+                                          BSTR          arrStylesheets[],
                                           short        *pNumStylesheets);
     HRESULT ApplyStylesheets(asp::IResponse *pResponse,
-                             CComBSTR        arrStylesheets[],
+                             BSTR            arrStylesheets[],
                              short           numStylesheets);
+    HRESULT LoadStylesheetChain(BSTR                      arrStylesheets[],
+                                short                     numStylesheets,
+                                CComPtr<IXMLDOMDocument>  arrXslDocs[],
+                                CComPtr<IXSLTemplate>     arrXslTemplates[],
+                                CComBSTR                  arrMappedPaths[],
+                                XmlCacheInfo              arrInfo[]);
+    HRESULT ResolveChainPrefix(CComBSTR                  arrMappedPaths[],
+                               XmlCacheInfo              arrInfo[],
+                               short                     numStylesheets,
+                               CComBSTR                  arrChainKeys[],
+                               short                    *pFirstStylesheet,
+                               IXMLDOMDocument         **ppCachedDoc);
+    HRESULT MapVirtualPath(BSTR bstrPath, BSTR *pbstrMappedPath);
+    HRESULT ResolveServerMappedPath(BSTR localName,
+                                    BSTR pathName,
+                                    bool isConfigXML,
+                                    BSTR *pbstrServerMappedPath);
     HRESULT LoadXMLFromRelativeLoc(BSTR localName,
                                    BSTR pathName,
                                    bool isConfigXML,
                                    IXMLDOMDocument **ppXMLDoc,
-                                   IXSLTemplate    **ppXSLTemplate);
+                                   IXSLTemplate    **ppXSLTemplate,
+                                   BSTR             *pbstrMappedPath = NULL,
+                                   XmlCacheInfo     *pInfo = NULL,
+                                   bool             *pbCacheHit = NULL);
+    HRESULT ComputeETag(CComBSTR      arrMappedPaths[],
+                        XmlCacheInfo  arrInfo[],
+                        short         numStylesheets,
+                        BSTR          bstrContentType,
+                        BSTR          bstrCharset,
+                        UINT          uiCP,
+                        BSTR          bstrContentEncoding,
+                        CComBSTR    & bstrETag);
+    HRESULT CheckChainNotModified(asp::IResponse *pResponse,
+                                  BSTR            arrStylesheets[],
+                                  short           numStylesheets,
+                                  UINT            uiCP,
+                                  bool           *pbNotModified);
+    HRESULT CheckNotModified(asp::IResponse *pResponse,
+                             BSTR            bstrETag,
+                             bool           *pbNotModified);
+    HRESULT SendValidators(asp::IResponse *pResponse,
+                           BSTR            bstrETag,
+                           bool            bAfterOutput);
+    HRESULT WriteServiceUnavailable(asp::IResponse *pResponse);
+    HRESULT NegotiateContentEncoding();
+
+    bool IsOffline() const {
+        return m_bstrRootDirectory.m_str != NULL;
+    }
     HRESULT VerifyEncodingAndCharset(UINT *puiCP);
+    HRESULT LoadErrorDocument(BSTR bstrURL, BSTR bstrInfo);
+    HRESULT GetBatchOutputDirectory(BSTR bstrRootDirectory,
+                                    CComBSTR & bstrDirectory);
+    HRESULT GetBrowserProfileKey(CComBSTR & bstrProfile);
+    HRESULT WritePrerenderedError(IDispatch      *pdispResponse,
+                                  asp::IResponse *pResponse);
+    HRESULT RenderErrorPage(IDispatch   *pdispResponse,
+                            BSTR         bstrKey,
+                            CErrorPage **ppPage);
     
   private:
     CComBSTR                        m_bstrURL;
@@ -94,11 +211,58 @@ END_COM_MAP()
     CComBSTR                        m_bstrErrorURL;
     CComBSTR                        m_bstrErrorHTTPCode;
     CComBSTR                        m_bstrUserAgent;
+    CComBSTR                        m_bstrSourcePath;
+    XmlCacheInfo                    m_sourceInfo;
+    CComBSTR                        m_bstrSourcePIContents; // while m_bSourcePending
+    CComBSTR                        m_bstrServerConfigPath;
+    XmlCacheInfo                    m_serverConfigInfo;
+    CComBSTR                        m_bstrProfilesConfig;   // masterConfig.xml's
+                                                            // file, or URL, if
+                                                            // there's one
+    XmlCacheInfo                    m_profilesInfo;         // version of its
+                                                            // profiles in use
     CComPtr<IXMLDOMDocument>        m_pcomXMLDocument;
     CComPtr<IStream>                m_pcomXMLDocumentStream;
+    CPooledBuffer                   m_xmlWriteBuffer;   // pending writes to the above
     CComPtr<asp::IServer>           m_pcomASPServer;
+    CComPtr<asp::IRequest>          m_pcomASPRequest;
+    CComBSTR                        m_bstrContentEncoding;  // empty if none
     CComPtr<IDispatch>              m_pcomBrowserTypeDisp;
-    PIParseInfo                     m_piParseInfo;
+    PIParseInfo                     m_piParseInfo;      // in m_arena
+    CArena                          m_arena;            // working state of the
+                                                        // request, reset when
+                                                        // the transform ends
     bool                            m_bInErrorHandling;
     bool                            m_bResponseEndCalled;
+    bool                            m_bSourceIsStatic;  // loaded from m_bstrSourcePath
+                                                        // and not written to since
+    bool                            m_bSourcePending;   // Load() put off loading
+                                                        // m_bstrSourcePath
+    bool                            m_bContentEncodingSent; // header is in the
+                                                            // response
+    bool                            m_bBrowserCapsInitialized;
+    long                            m_cbCompressMin;    // -1 if not compressing
+    ULONG                           m_cbXMLWritten;     // by Write/WriteLine
+    bool                            m_bUTF8Input;       // m_pcomXMLDocumentStream
+                                                        // is given UTF-8
+    wchar_t                         m_wchPendingSurrogate;  // end of the last
+                                                            // write, or 0
+    LONGLONG                        m_parseTicks;       // handing writes to
+                                                        // the parser
+    DWORD                           m_transformDeadline; // GetTickCount() at which
+                                                         // to give up waiting for
+                                                         // the transform pool
+    CRequestTrace                   m_trace;            // for the slow request log
+    CBrowserCaps                   *m_pBrowserCaps;     // cached for this User-Agent,
+                                                        // or NULL
+    CBrowscapMatch                  m_browscapMatch;    // from the native
+                                                        // browscap.ini reader
+    CErrorPage                     *m_pCapturePage;     // error page being
+                                                        // rendered, or NULL
+    CComPtr<IStream>                m_pcomErrorCapture; // its text, as written
+                                                        // by the stylesheets
+    CComBSTR                        m_bstrRootDirectory; // where "/" is, when
+                                                         // rendering offline
+    CComPtr<IStream>                m_pcomOfflineOutput; // output, when
+                                                         // rendering offline
 };
@@ -0,0 +1,364 @@
+// ============================================================================
+// FILE: arena.cpp
+//
+//      Implementation of the request arena.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#include "StdAfx.h"
+
+// Allocations are rounded up to this, which suits any type.
+const ULONG ARENA_ALIGNMENT = 8;
+
+// Where a block's memory starts, after its header.
+const ULONG ARENA_HEADER_SIZE =
+    (sizeof(ArenaBlock) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+// ============================================================================
+// CArena::Alloc
+
+void *
+CArena::Alloc(ULONG cb)                     // [in] bytes wanted
+{
+    ArenaBlock *pBlock;
+    BYTE       *pb;
+
+    cb = (cb + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+    if (cb > MAX_SMALL_ALLOCATION) {
+        pBlock = reinterpret_cast<ArenaBlock *>(new BYTE[ARENA_HEADER_SIZE + cb]);
+        if (pBlock == NULL) {
+            return NULL;
+        }
+
+        pBlock->m_pNext = m_pLarge;
+        m_pLarge = pBlock;
+        m_numLarge++;
+        m_numAllocations++;
+        return reinterpret_cast<BYTE *>(pBlock) + ARENA_HEADER_SIZE;
+    }
+
+    if (static_cast<ULONG>(m_pbEnd - m_pbNext) < cb) {
+        pBlock = g_arenaBlocks->Acquire();
+        if (pBlock == NULL) {
+            return NULL;
+        }
+
+        pBlock->m_pNext = m_pBlocks;
+        m_pBlocks = pBlock;
+        m_pbNext = reinterpret_cast<BYTE *>(pBlock) + ARENA_HEADER_SIZE;
+        m_pbEnd = reinterpret_cast<BYTE *>(pBlock) + BLOCK_SIZE;
+    }
+
+    pb = m_pbNext;
+    m_pbNext += cb;
+    m_numAllocations++;
+    return pb;
+}
+
+// ============================================================================
+// CArena::CopyString
+
+wchar_t *
+CArena::CopyString(
+    const wchar_t *pwch,                    // [in] characters to copy
+    ULONG cch)                              // [in] how many
+{
+    wchar_t *pwszCopy = static_cast<wchar_t *>(Alloc((cch + 1) * sizeof(wchar_t)));
+
+    if (pwszCopy) {
+        ::memcpy(pwszCopy, pwch, cch * sizeof(wchar_t));
+        pwszCopy[cch] = L'\0';
+    }
+    return pwszCopy;
+}
+
+// ============================================================================
+// CArena::AllocBSTR
+//      Lay the string out as SysAllocString would: the length in bytes,
+//      then the characters, then a terminator.
+
+BSTR
+CArena::AllocBSTR(const wchar_t *pwsz)      // [in] string to copy
+{
+    ULONG  cch;
+    DWORD *pcb;
+
+    if (pwsz == NULL) {
+        return NULL;
+    }
+
+    cch = lstrlenW(pwsz);
+    pcb = static_cast<DWORD *>(Alloc(sizeof(DWORD) + (cch + 1) * sizeof(wchar_t)));
+    if (pcb == NULL) {
+        return NULL;
+    }
+
+    *pcb = cch * sizeof(wchar_t);
+    ::memcpy(pcb + 1, pwsz, (cch + 1) * sizeof(wchar_t));
+    return reinterpret_cast<BSTR>(pcb + 1);
+}
+
+// ============================================================================
+// CArena::WideToAscii
+
+char *
+CArena::WideToAscii(const wchar_t *pwsz)    // [in] string to convert
+{
+    int   len = ::WideCharToMultiByte(CP_ACP, 0, pwsz, -1, NULL, 0, 0, 0);
+    char *psz = static_cast<char *>(Alloc(len + 1));
+
+    if (psz) {
+        ::WideCharToMultiByte(CP_ACP, 0, pwsz, -1, psz, len, 0, 0);
+        psz[len] = 0;
+    }
+    return psz;
+}
+
+// ============================================================================
+// CArena::Reset
+
+void
+CArena::Reset()
+{
+    ArenaBlock *pBlock;
+
+    if (m_numAllocations == 0) {
+        return;
+    }
+
+    g_arenaBlocks->RecordRequest(m_numAllocations, m_numLarge);
+
+    while (m_pLarge) {
+        pBlock = m_pLarge;
+        m_pLarge = pBlock->m_pNext;
+        delete [] reinterpret_cast<BYTE *>(pBlock);
+    }
+
+    if (m_pBlocks) {
+        g_arenaBlocks->Release(m_pBlocks);
+    }
+
+    m_pBlocks = NULL;
+    m_pbNext = NULL;
+    m_pbEnd = NULL;
+    m_numAllocations = 0;
+    m_numLarge = 0;
+}
+
+// ============================================================================
+// CArenaBlockCache::CArenaBlockCache
+
+CArenaBlockCache::CArenaBlockCache()
+{
+    InitializeCriticalSection(&m_cs);
+    m_tlsIndex = TlsAlloc();
+    m_pLists = NULL;
+    m_blocksAllocated = 0;
+    m_blocksReused = 0;
+    m_blocksReclaimed = 0;
+    m_requests = 0;
+    m_allocations = 0;
+    m_largeAllocations = 0;
+}
+
+// ============================================================================
+// CArenaBlockCache::~CArenaBlockCache
+//      Runs when the process detaches (see ModuleGlobalUninitialize),
+//      so no arena will use the lists again, even those of threads
+//      that are still running.
+
+CArenaBlockCache::~CArenaBlockCache()
+{
+    ThreadList *pList;
+
+    while (m_pLists) {
+        pList = m_pLists;
+        m_pLists = pList->m_pNext;
+        FreeList(pList);
+    }
+
+    if (m_tlsIndex != TLS_OUT_OF_INDEXES) {
+        TlsFree(m_tlsIndex);
+    }
+    DeleteCriticalSection(&m_cs);
+}
+
+// ============================================================================
+// CArenaBlockCache::FreeList
+//      Free a list, its blocks and its thread handle.
+
+void
+CArenaBlockCache::FreeList(ThreadList *pList)   // [in] unlinked list
+{
+    ArenaBlock *pBlock;
+
+    while (pList->m_pFree) {
+        pBlock = pList->m_pFree;
+        pList->m_pFree = pBlock->m_pNext;
+        delete [] reinterpret_cast<BYTE *>(pBlock);
+    }
+
+    CloseHandle(pList->m_hThread);
+    delete pList;
+}
+
+// ============================================================================
+// CArenaBlockCache::GetThreadList
+//      This thread's free list, made on first use.  NULL if there's no
+//      thread local storage or memory for it, or no handle to tell when
+//      the thread exits.
+
+CArenaBlockCache::ThreadList *
+CArenaBlockCache::GetThreadList()
+{
+    ThreadList *pList;
+
+    if (m_tlsIndex == TLS_OUT_OF_INDEXES) {
+        return NULL;
+    }
+
+    pList = static_cast<ThreadList *>(TlsGetValue(m_tlsIndex));
+    if (pList == NULL) {
+        pList = new ThreadList;
+        if (pList == NULL) {
+            return NULL;
+        }
+
+        pList->m_pFree = NULL;
+        pList->m_count = 0;
+
+        if (!DuplicateHandle(GetCurrentProcess(),
+                             GetCurrentThread(),
+                             GetCurrentProcess(),
+                             &pList->m_hThread,
+                             SYNCHRONIZE,
+                             FALSE,
+                             0)) {
+            delete pList;
+            return NULL;
+        }
+
+        // A new thread is as likely a time as any for old ones to
+        // have gone.
+        EnterCriticalSection(&m_cs);
+        ReclaimExitedThreads();
+        pList->m_pNext = m_pLists;
+        m_pLists = pList;
+        LeaveCriticalSection(&m_cs);
+
+        TlsSetValue(m_tlsIndex, pList);
+    }
+
+    return pList;
+}
+
+// ============================================================================
+// CArenaBlockCache::ReclaimExitedThreads
+//      Free the lists of threads that have exited.  Nothing else can
+//      be using them.  Must be called with m_cs held.
+
+void
+CArenaBlockCache::ReclaimExitedThreads()
+{
+    ThreadList **ppList = &m_pLists;
+    ThreadList  *pList;
+
+    while (*ppList) {
+        pList = *ppList;
+        if (WaitForSingleObject(pList->m_hThread, 0) == WAIT_OBJECT_0) {
+            *ppList = pList->m_pNext;
+            InterlockedExchangeAdd(&m_blocksReclaimed, pList->m_count);
+            FreeList(pList);
+        } else {
+            ppList = &pList->m_pNext;
+        }
+    }
+}
+
+// ============================================================================
+// CArenaBlockCache::Acquire
+
+ArenaBlock *
+CArenaBlockCache::Acquire()
+{
+    ThreadList *pList = GetThreadList();
+    ArenaBlock *pBlock;
+
+    if (pList && pList->m_pFree) {
+        pBlock = pList->m_pFree;
+        pList->m_pFree = pBlock->m_pNext;
+        pList->m_count--;
+        InterlockedIncrement(&m_blocksReused);
+        return pBlock;
+    }
+
+    pBlock = reinterpret_cast<ArenaBlock *>(new BYTE[CArena::BLOCK_SIZE]);
+    if (pBlock) {
+        InterlockedIncrement(&m_blocksAllocated);
+    }
+    return pBlock;
+}
+
+// ============================================================================
+// CArenaBlockCache::Release
+
+void
+CArenaBlockCache::Release(ArenaBlock *pBlocks)  // [in] chain of blocks
+{
+    ThreadList *pList = GetThreadList();
+    ArenaBlock *pBlock;
+
+    while (pBlocks) {
+        pBlock = pBlocks;
+        pBlocks = pBlock->m_pNext;
+
+        if (pList && pList->m_count < MAX_FREE_PER_THREAD) {
+            pBlock->m_pNext = pList->m_pFree;
+            pList->m_pFree = pBlock;
+            pList->m_count++;
+        } else {
+            delete [] reinterpret_cast<BYTE *>(pBlock);
+        }
+    }
+}
+
+// ============================================================================
+// CArenaBlockCache::RecordRequest
+
+void
+CArenaBlockCache::RecordRequest(
+    long numAllocations,                    // [in] from the arena
+    long numLarge)                          // [in] of those, from the heap
+{
+    InterlockedIncrement(&m_requests);
+    InterlockedExchangeAdd(&m_allocations, numAllocations);
+    InterlockedExchangeAdd(&m_largeAllocations, numLarge);
+}
+
+// ============================================================================
+// CArenaBlockCache::AppendStatistics
+//      Appends <arena requests="n" allocations="n" large="n"
+//      blocks-allocated="n" blocks-reused="n" blocks-reclaimed="n"/> to
+//      bstrStats.  Heap allocations per request are (large +
+//      blocks-allocated) / requests.
+
+HRESULT
+CArenaBlockCache::AppendStatistics(CComBSTR & bstrStats)
+{
+    HRESULT hr;
+    wchar_t wszBuffer[200];
+
+    wsprintf(wszBuffer,
+             L"<arena requests=\"%ld\" allocations=\"%ld\" large=\"%ld\" "
+             L"blocks-allocated=\"%ld\" blocks-reused=\"%ld\" "
+             L"blocks-reclaimed=\"%ld\"/>",
+             m_requests, m_allocations, m_largeAllocations,
+             m_blocksAllocated, m_blocksReused, m_blocksReclaimed);
+    hr = bstrStats.Append(wszBuffer);
+    HRCHECK(FAILED(hr));
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
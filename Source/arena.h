@@ -0,0 +1,131 @@
+// ============================================================================
+// FILE: arena.h
+//
+//      Allocation of the short-lived working state of a request from
+//      blocks that are all given back at once.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#pragma once
+
+struct ArenaBlock
+{
+    ArenaBlock  *m_pNext;
+};
+
+// ============================================================================
+// CLASS: CArena
+//
+//      Bump allocator for what a request needs only while it's being
+//      handled: the attributes of the xml-stylesheet PI, the stylesheet
+//      hrefs of the chain, paths converted for the XML cache.  Nothing
+//      is freed on its own; Reset() hands every block back at once.
+//      Blocks come from, and go back to, the free list of the thread
+//      that's running (see CArenaBlockCache), so a thread that handles
+//      one request after another doesn't go to the heap for them.
+//      Allocations too big to share a block get one of their own, which
+//      goes back to the heap on Reset().
+//
+//      Not thread safe: only the thread handling the request allocates,
+//      though others may read what it allocated.
+
+class CArena
+{
+  public:
+    enum {
+        BLOCK_SIZE = 8 * 1024,
+        MAX_SMALL_ALLOCATION = BLOCK_SIZE / 4
+    };
+
+    CArena() : m_pBlocks(NULL),
+               m_pLarge(NULL),
+               m_pbNext(NULL),
+               m_pbEnd(NULL),
+               m_numAllocations(0),
+               m_numLarge(0) {}
+
+    ~CArena() {
+        Reset();
+    }
+
+    // cb bytes, aligned for any type, or NULL if out of memory.
+    void * Alloc(ULONG cb);
+
+    // A copy of cch characters, terminated.
+    wchar_t * CopyString(const wchar_t *pwch, ULONG cch);
+
+    // A BSTR holding a copy of the string, for passing as an [in]
+    // parameter.  It must not be freed, and mustn't be kept by anything
+    // past Reset().  NULL if pwsz is NULL or out of memory.
+    BSTR AllocBSTR(const wchar_t *pwsz);
+
+    // pwsz in the ANSI code page, as WideToAscii() does.
+    char * WideToAscii(const wchar_t *pwsz);
+
+    // Give back everything allocated.
+    void Reset();
+
+  private:
+    ArenaBlock  *m_pBlocks;                 // current block first
+    ArenaBlock  *m_pLarge;                  // allocations of their own
+    BYTE        *m_pbNext;                  // free space in m_pBlocks
+    BYTE        *m_pbEnd;
+    long         m_numAllocations;          // since the last Reset()
+    long         m_numLarge;                // of those, in m_pLarge
+};
+
+// ============================================================================
+// CLASS: CArenaBlockCache
+//
+//      Per-thread free lists of arena blocks.  Each thread keeps up to
+//      MAX_FREE_PER_THREAD blocks; any more go back to the heap.  With
+//      DisableThreadLibraryCalls, threads don't tell the DLL when they
+//      exit, so each list keeps a handle to its thread, and the lists
+//      of threads that have gone are freed when a new thread makes one.
+//
+//      Documents may outlive the filter, and give their arenas back
+//      when they go, so this is only deleted when the process detaches.
+
+class CArenaBlockCache
+{
+  public:
+    enum { MAX_FREE_PER_THREAD = 8 };
+
+    CArenaBlockCache();
+    ~CArenaBlockCache();
+
+    // A block of CArena::BLOCK_SIZE bytes, or NULL if out of memory.
+    ArenaBlock * Acquire();
+
+    // Put a chain of blocks (linked by m_pNext) on this thread's list.
+    void Release(ArenaBlock *pBlocks);
+
+    // Note an arena being reset after numAllocations allocations, of
+    // which numLarge needed their own memory.
+    void RecordRequest(long numAllocations, long numLarge);
+
+    // Append <arena> statistics to bstrStats.
+    HRESULT AppendStatistics(CComBSTR & bstrStats);
+
+  private:
+    struct ThreadList {
+        ArenaBlock  *m_pFree;
+        long         m_count;
+        HANDLE       m_hThread;             // signalled when it exits
+        ThreadList  *m_pNext;               // all threads' lists
+    };
+
+    ThreadList * GetThreadList();
+    void ReclaimExitedThreads();
+    static void FreeList(ThreadList *pList);
+
+    DWORD             m_tlsIndex;
+    ThreadList       *m_pLists;
+    LONG              m_blocksAllocated;    // from the heap
+    LONG              m_blocksReused;       // from a free list
+    LONG              m_blocksReclaimed;    // from exited threads' lists
+    LONG              m_requests;
+    LONG              m_allocations;
+    LONG              m_largeAllocations;
+    CRITICAL_SECTION  m_cs;                 // for m_pLists
+};
@@ -0,0 +1,472 @@
+// ============================================================================
+// FILE: batch.cpp
+//
+//      Implementation of batch rendering.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#include "StdAfx.h"
+#include "XMLServerDoc.h"
+
+// Jobs are kept in an array grown by this many at a time.
+const long JOB_ARRAY_INCREMENT = 64;
+
+// ============================================================================
+// CLASS: CBatchRenderer::CRunner
+//      Work item that runs jobs until there are none left, or the batch
+//      stops.  Each holds a reference to the batch until it's done.
+
+class CBatchRenderer::CRunner : public CWorkItem
+{
+  public:
+    CRunner() : m_pRenderer(NULL), m_claims(0) {}
+
+    // Called on a pool thread, or by CBatchRenderer::Run() if it
+    // couldn't be queued.
+    virtual void Run() {
+        if (InterlockedIncrement(&m_claims) == 1) {
+            m_pRenderer->RunJobs();
+        }
+        m_pRenderer->RunnerDone();
+    }
+
+    CBatchRenderer  *m_pRenderer;
+    LONG             m_claims;              // first to claim it runs
+                                            // or cancels it
+};
+
+// ============================================================================
+// CBatchRenderer::CBatchRenderer
+
+CBatchRenderer::CBatchRenderer()
+{
+    m_ref = 1;
+    m_jobs = NULL;
+    m_numJobs = 0;
+    m_maxJobs = 0;
+    m_nextJob = 0;
+    m_bStopped = FALSE;
+    m_runners = NULL;
+    m_numPending = 0;
+    m_hDone = NULL;
+    m_nThreads = 0;
+    m_elapsed = 0;
+}
+
+CBatchRenderer::~CBatchRenderer()
+{
+    for (long i = 0; i < m_numJobs; i++) {
+        SysFreeString(m_jobs[i].m_bstrURL);
+        SysFreeString(m_jobs[i].m_bstrUserAgent);
+        SysFreeString(m_jobs[i].m_bstrOutputFile);
+        SysFreeString(m_jobs[i].m_bstrError);
+    }
+    delete [] m_jobs;
+    delete [] m_runners;
+    if (m_hDone) {
+        CloseHandle(m_hDone);
+    }
+}
+
+// ============================================================================
+// CBatchRenderer::SetOutputDirectory
+
+HRESULT
+CBatchRenderer::SetOutputDirectory(
+    BSTR bstrDirectory)                     // [in] full local path
+{
+    HRESULT   hr;
+    wchar_t   wszFullPath[MAX_PATH];
+    wchar_t  *pwszFilePart;
+    DWORD     cch;
+
+    ERRCHECK(SysStringLen(bstrDirectory) == 0, E_INVALIDARG);
+
+    cch = GetFullPathNameW(bstrDirectory,
+                           COUNTOF(wszFullPath),
+                           wszFullPath,
+                           &pwszFilePart);
+    ERRCHECK(cch == 0 || cch >= COUNTOF(wszFullPath), E_INVALIDARG);
+
+    m_bstrOutputDirectory = wszFullPath;
+    ERRCHECK(m_bstrOutputDirectory.m_str == NULL, E_OUTOFMEMORY);
+
+    if (wszFullPath[cch - 1] != L'\\') {
+        hr = m_bstrOutputDirectory.Append(L"\\");
+        HRCHECK(FAILED(hr));
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CBatchRenderer::AddJob
+
+HRESULT
+CBatchRenderer::AddJob(
+    BSTR bstrURL,                           // [in] page on the site
+    BSTR bstrUserAgent,                     // [in] browser, or NULL
+    BSTR bstrOutputFile)                    // [in] file to write
+{
+    HRESULT   hr;
+    Job      *pJob;
+    CComBSTR  bstrPath;
+    wchar_t   wszFullPath[MAX_PATH];
+    wchar_t  *pwszFilePart;
+    DWORD     cch;
+    UINT      cchDirectory = m_bstrOutputDirectory.Length();
+
+    ASSERT(cchDirectory);
+    ERRCHECK(SysStringLen(bstrOutputFile) == 0, E_INVALIDARG);
+
+    // The path is made full, with any ".." resolved, before it's
+    // checked.
+    if (bstrOutputFile[0] != L'\\' &&
+        bstrOutputFile[0] != L'/' &&
+        bstrOutputFile[1] != L':') {
+        bstrPath = m_bstrOutputDirectory;
+        hr = bstrPath.Append(bstrOutputFile);
+        HRCHECK(FAILED(hr));
+    } else {
+        bstrPath = bstrOutputFile;
+        ERRCHECK(bstrPath.m_str == NULL, E_OUTOFMEMORY);
+    }
+
+    cch = GetFullPathNameW(bstrPath,
+                           COUNTOF(wszFullPath),
+                           wszFullPath,
+                           &pwszFilePart);
+    ERRCHECK(cch == 0 || cch >= COUNTOF(wszFullPath), E_INVALIDARG);
+
+    ERRCHECK(cch <= cchDirectory ||
+             _wcsnicmp(wszFullPath, m_bstrOutputDirectory, cchDirectory) != 0,
+             E_ACCESSDENIED);
+
+    if (m_numJobs == m_maxJobs) {
+        Job *newJobs = new Job[m_maxJobs + JOB_ARRAY_INCREMENT];
+        ERRCHECK(newJobs == NULL, E_OUTOFMEMORY);
+
+        if (m_jobs) {
+            ::memcpy(newJobs, m_jobs, m_numJobs * sizeof(Job));
+            delete [] m_jobs;
+        }
+        m_jobs = newJobs;
+        m_maxJobs += JOB_ARRAY_INCREMENT;
+    }
+
+    pJob = &m_jobs[m_numJobs];
+    ::memset(pJob, 0, sizeof(*pJob));
+
+    pJob->m_bstrURL = SysAllocString(bstrURL);
+    pJob->m_bstrUserAgent = SysAllocString(bstrUserAgent);
+    pJob->m_bstrOutputFile = SysAllocString(wszFullPath);
+    pJob->m_hr = E_PENDING;
+
+    if (pJob->m_bstrURL == NULL ||
+        pJob->m_bstrOutputFile == NULL ||
+        (bstrUserAgent && pJob->m_bstrUserAgent == NULL)) {
+
+        SysFreeString(pJob->m_bstrURL);
+        SysFreeString(pJob->m_bstrUserAgent);
+        SysFreeString(pJob->m_bstrOutputFile);
+        RETURNERR(E_OUTOFMEMORY);
+    }
+
+    m_numJobs++;
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CBatchRenderer::Run
+//      Queue one runner per thread and wait for them all to finish, or
+//      the timeout.  A runner that can't be queued runs here instead,
+//      and isn't bound by the timeout.
+
+HRESULT
+CBatchRenderer::Run(
+    BSTR bstrRootDirectory,                 // [in] directory of the site
+    long nThreads,                          // [in] threads to use
+    DWORD timeout)                          // [in] ms to wait
+{
+    HRESULT   hr;
+    DWORD     start;
+    long      i;
+
+    ASSERT(m_runners == NULL);
+
+    if (nThreads < 1) {
+        nThreads = 1;
+    } else if (nThreads > CWorkerPool::MAX_WORKER_THREADS) {
+        nThreads = CWorkerPool::MAX_WORKER_THREADS;
+    }
+
+    m_bstrRootDirectory = bstrRootDirectory;
+    ERRCHECK(m_bstrRootDirectory.m_str == NULL, E_OUTOFMEMORY);
+
+    m_nThreads = nThreads;
+    m_nextJob = 0;
+    m_bStopped = FALSE;
+
+    m_runners = new CRunner[nThreads];
+    ERRCHECK(m_runners == NULL, E_OUTOFMEMORY);
+
+    m_hDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+    ERRCHECK(m_hDone == NULL, HRESULT_FROM_WIN32(GetLastError()));
+
+    // The pool's threads stay around once started, so it only ever
+    // needs raising.
+    if (g_batchPool->GetThreadCount() < nThreads) {
+        g_batchPool->SetMaxThreads(nThreads);
+    }
+
+    start = GetTickCount();
+
+    m_numPending = nThreads;
+    for (i = 0; i < nThreads; i++) {
+        m_runners[i].m_pRenderer = this;
+
+        // The runner's reference, dropped by RunnerDone().
+        AddRef();
+
+        if (g_batchPool->Queue(&m_runners[i]) != S_OK) {
+            m_runners[i].Run();
+        }
+    }
+
+    if (WaitForSingleObject(m_hDone, timeout) != WAIT_OBJECT_0) {
+
+        // No more jobs are taken, and runners that haven't started
+        // won't.
+        InterlockedExchange(&m_bStopped, TRUE);
+        for (i = 0; i < nThreads; i++) {
+            InterlockedIncrement(&m_runners[i].m_claims);
+        }
+    }
+
+    m_elapsed = GetTickCount() - start;
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CBatchRenderer::RunJobs
+//      Called on each runner's thread.
+
+void
+CBatchRenderer::RunJobs()
+{
+    long i;
+
+    while (!m_bStopped &&
+           (i = InterlockedIncrement(&m_nextJob) - 1) < m_numJobs) {
+        RunJob(&m_jobs[i]);
+    }
+}
+
+// ============================================================================
+// CBatchRenderer::RunnerDone
+//      Called by each runner when it's done, whether it ran or was
+//      cancelled.  The batch may be deleted here.
+
+void
+CBatchRenderer::RunnerDone()
+{
+    if (InterlockedDecrement(&m_numPending) == 0) {
+        SetEvent(m_hDone);
+    }
+    Release();
+}
+
+// ============================================================================
+// CBatchRenderer::RunJob
+//      Render one page into memory with a document object of its own,
+//      then write it out.
+
+void
+CBatchRenderer::RunJob(Job *pJob)           // [in] the job to run
+{
+    HRESULT                          hr;
+    CComObject<CXMLServerDocument>  *pDoc = NULL;
+    CComPtr<IStream>                 pcomOutput;
+
+    hr = CComObject<CXMLServerDocument>::CreateInstance(&pDoc);
+    HRCHECK(FAILED(hr));
+    pDoc->AddRef();
+
+    hr = CreateStreamOnHGlobal(NULL, TRUE, &pcomOutput);
+    HRCHECK(FAILED(hr));
+
+    hr = pDoc->RenderOffline(m_bstrRootDirectory,
+                             pJob->m_bstrURL,
+                             pJob->m_bstrUserAgent,
+                             pcomOutput);
+    if (FAILED(hr) && pDoc->GetErrorDescription()) {
+        pJob->m_bstrError = SysAllocString(pDoc->GetErrorDescription());
+    }
+    HRCHECK(FAILED(hr));
+
+    hr = WriteOutputFile(pJob->m_bstrOutputFile, pcomOutput);
+    HRCHECK(FAILED(hr));
+
+    hr = S_OK;
+  Error:
+    // Last, since GetReport() may be looking.
+    InterlockedExchange(&pJob->m_hr, hr);
+    if (pDoc) {
+        pDoc->Release();
+    }
+}
+
+// ============================================================================
+// CBatchRenderer::WriteOutputFile
+//      Write what's been rendered into a memory stream to a file,
+//      replacing it.
+
+HRESULT
+CBatchRenderer::WriteOutputFile(
+    BSTR bstrPath,                          // [in] file to write
+    IStream *pStream)                       // [in] from CreateStreamOnHGlobal
+{
+    HRESULT   hr;
+    HGLOBAL   hGlobal;
+    STATSTG   statstg;
+    void     *pv = NULL;
+    HANDLE    hFile = INVALID_HANDLE_VALUE;
+    DWORD     cbWritten;
+
+    hr = pStream->Stat(&statstg, STATFLAG_NONAME);
+    HRCHECK(FAILED(hr));
+
+    hr = GetHGlobalFromStream(pStream, &hGlobal);
+    HRCHECK(FAILED(hr));
+
+    hFile = CreateFileW(bstrPath,
+                        GENERIC_WRITE,
+                        0,
+                        NULL,
+                        CREATE_ALWAYS,
+                        FILE_ATTRIBUTE_NORMAL,
+                        NULL);
+    ERRCHECK(hFile == INVALID_HANDLE_VALUE, HRESULT_FROM_WIN32(GetLastError()));
+
+    if (statstg.cbSize.LowPart) {
+        pv = GlobalLock(hGlobal);
+        ERRCHECK(pv == NULL, E_OUTOFMEMORY);
+
+        ERRCHECK(!WriteFile(hFile, pv, statstg.cbSize.LowPart, &cbWritten, NULL),
+                 HRESULT_FROM_WIN32(GetLastError()));
+    }
+
+    hr = S_OK;
+  Error:
+    if (pv) {
+        GlobalUnlock(hGlobal);
+    }
+    if (hFile != INVALID_HANDLE_VALUE) {
+        CloseHandle(hFile);
+    }
+    return hr;
+}
+
+// ============================================================================
+// CBatchRenderer::GetReport
+//      Jobs still running after a timeout may finish while this looks,
+//      so each job's result is read once.
+
+HRESULT
+CBatchRenderer::GetReport(BSTR *pbstrReport)    // [out] report XML
+{
+    HRESULT   hr;
+    HRESULT   hrJob;
+    CComBSTR  bstrReport;
+    CComBSTR  bstrJobs;
+    wchar_t   wszNumber[200];
+    DWORD     elapsed = m_elapsed ? m_elapsed : 1;
+    long      numDone = 0;
+    long      numFailed = 0;
+    long      numTimedOut = 0;
+    long      rate10;
+    long      i;
+
+    for (i = 0; i < m_numJobs; i++) {
+
+        hrJob = m_jobs[i].m_hr;
+
+        if (hrJob == E_PENDING) {
+            numTimedOut++;
+            hr = bstrJobs.Append(L"<timed-out url=\"");
+            HRCHECK(FAILED(hr));
+        } else if (SUCCEEDED(hrJob)) {
+            numDone++;
+            continue;
+        } else {
+            numDone++;
+            numFailed++;
+            hr = bstrJobs.Append(L"<failed url=\"");
+            HRCHECK(FAILED(hr));
+        }
+
+        hr = AppendXMLText(bstrJobs, m_jobs[i].m_bstrURL);
+        HRCHECK(FAILED(hr));
+
+        hr = bstrJobs.Append(L"\" user-agent=\"");
+        HRCHECK(FAILED(hr));
+
+        hr = AppendXMLText(bstrJobs, m_jobs[i].m_bstrUserAgent);
+        HRCHECK(FAILED(hr));
+
+        if (hrJob == E_PENDING) {
+            hr = bstrJobs.Append(L"\"/>");
+            HRCHECK(FAILED(hr));
+            continue;
+        }
+
+        wsprintf(wszNumber, L"\" hr=\"0x%08lx\">", hrJob);
+        hr = bstrJobs.Append(wszNumber);
+        HRCHECK(FAILED(hr));
+
+        hr = AppendXMLText(bstrJobs, m_jobs[i].m_bstrError);
+        HRCHECK(FAILED(hr));
+
+        hr = bstrJobs.Append(L"</failed>");
+        HRCHECK(FAILED(hr));
+    }
+
+    rate10 = MulDiv(numDone, 10000, elapsed);   // per 10 s
+
+    wsprintf(wszNumber,
+             L"<batch jobs=\"%ld\" failed=\"%ld\" timed-out=\"%ld\" "
+             L"threads=\"%ld\" milliseconds=\"%lu\" "
+             L"pages-per-second=\"%ld.%ld\">",
+             m_numJobs,
+             numFailed,
+             numTimedOut,
+             m_nThreads,
+             m_elapsed,
+             rate10 / 10,
+             rate10 % 10);
+
+    hr = bstrReport.Append(wszNumber);
+    HRCHECK(FAILED(hr));
+
+    if (bstrJobs.m_str) {
+        hr = bstrReport.Append(bstrJobs);
+        HRCHECK(FAILED(hr));
+    }
+
+    hr = bstrReport.Append(L"</batch>");
+    HRCHECK(FAILED(hr));
+
+    *pbstrReport = bstrReport.Detach();
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
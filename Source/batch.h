@@ -0,0 +1,100 @@
+// ============================================================================
+// FILE: batch.h
+//
+//      Rendering many pages to files at once, without requests.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#pragma once
+
+// ============================================================================
+// CLASS: CBatchRenderer
+//
+//      A list of jobs, each a page of the site, the User-Agent to render
+//      it for and the file to write it to, run on threads of the batch
+//      worker pool.  Jobs take the next job from the list as they
+//      finish, so the pool is kept busy however long each page takes.
+//
+//      Jobs go through the same caches as requests do: compiled
+//      stylesheets, server-config documents, browser capabilities and
+//      chain results are shared by every job (and with requests), so
+//      after the first pages of a kind most of the time is spent
+//      running the stylesheets.
+//
+//      It's reference counted, so that a batch that's given up waiting
+//      for its jobs can go away while they finish.
+
+class CBatchRenderer
+{
+  public:
+    CBatchRenderer();
+
+    void AddRef() {
+        InterlockedIncrement(&m_ref);
+    }
+
+    void Release() {
+        if (InterlockedDecrement(&m_ref) == 0) {
+            delete this;
+        }
+    }
+
+    // The directory output files must be in.  Called before AddJob.
+    HRESULT SetOutputDirectory(BSTR bstrDirectory);  // [in] full local path
+
+    // E_ACCESSDENIED if the output file isn't in the output directory.
+    // A relative path is taken to be in it.
+    HRESULT AddJob(BSTR bstrURL,                    // [in] page on the site
+                   BSTR bstrUserAgent,              // [in] browser, or NULL
+                   BSTR bstrOutputFile);            // [in] file to write
+
+    // Run all the jobs, on up to nThreads threads, and wait for them
+    // for up to timeout milliseconds.  Jobs that fail are recorded in
+    // the report; they don't fail the batch.  Jobs not started by the
+    // timeout aren't, and those still running are left to finish on
+    // their own, holding a reference to the batch.
+    HRESULT Run(BSTR bstrRootDirectory,             // [in] directory of the site
+                long nThreads,                      // [in] threads to use
+                DWORD timeout);                     // [in] ms to wait
+
+    // How it went, as XML:
+    //   <batch jobs= failed= timed-out= threads= milliseconds=
+    //          pages-per-second=>
+    //     <failed url= user-agent= hr=>description</failed>...
+    //   </batch>
+    HRESULT GetReport(BSTR *pbstrReport);
+
+  private:
+    class CRunner;
+    friend class CRunner;
+
+    struct Job {
+        BSTR      m_bstrURL;
+        BSTR      m_bstrUserAgent;
+        BSTR      m_bstrOutputFile;           // full path
+        LONG      m_hr;                       // E_PENDING until it's done;
+                                              // set last
+        BSTR      m_bstrError;                // description, if it failed
+    };
+
+    ~CBatchRenderer();
+
+    void RunJobs();
+    void RunJob(Job *pJob);
+    void RunnerDone();
+    static HRESULT WriteOutputFile(BSTR bstrPath, IStream *pStream);
+
+    LONG        m_ref;
+    Job        *m_jobs;
+    long        m_numJobs;
+    long        m_maxJobs;
+    long        m_nextJob;                    // next to be taken
+    LONG        m_bStopped;                   // no more jobs are taken
+    CRunner    *m_runners;
+    LONG        m_numPending;                 // runners still to finish
+    HANDLE      m_hDone;                      // set when they have
+    long        m_nThreads;
+    DWORD       m_elapsed;                    // milliseconds taken by Run()
+    CComBSTR    m_bstrRootDirectory;
+    CComBSTR    m_bstrOutputDirectory;        // ends with a backslash
+};
@@ -0,0 +1,352 @@
+// ============================================================================
+// FILE: browscap.cpp
+//
+//      Implementation of the native browscap.ini reader.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#include "StdAfx.h"
+
+// Don't look at the files more than once every this many ms.
+const DWORD BROWSCAP_RELOAD_CHECK_INTERVAL = 2000;
+
+// ============================================================================
+// CBrowscapDatabase::CBrowscapDatabase
+
+CBrowscapDatabase::CBrowscapDatabase(DWORD generation)
+{
+    m_ref = 1;
+    m_generation = generation;
+}
+
+// ============================================================================
+// CBrowscapDatabase::Load
+//      The additions go in first: of the sections a User-Agent matches,
+//      the first wins, and browscap.ini ends with [*].
+
+HRESULT
+CBrowscapDatabase::Load(
+    const wchar_t *pwszBrowscap,            // [in] path of browscap.ini
+    const wchar_t *pwszAdditions)           // [in] additions, or NULL
+{
+    HRESULT hr;
+
+    if (pwszAdditions && *pwszAdditions) {
+        hr = AddFile(pwszAdditions);
+        HRCHECK(FAILED(hr));
+    }
+
+    hr = AddFile(pwszBrowscap);
+    HRCHECK(FAILED(hr));
+
+    ERRCHECK(!m_ini.Compile(), E_OUTOFMEMORY);
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CBrowscapDatabase::AddFile
+//      Add the text of an ANSI file to m_ini.
+
+HRESULT
+CBrowscapDatabase::AddFile(
+    const wchar_t *pwszPath)                // [in] file to read
+{
+    HRESULT   hr;
+    HANDLE    hFile = INVALID_HANDLE_VALUE;
+    DWORD     cbFile;
+    DWORD     cbRead;
+    char     *pchFile = NULL;
+    wchar_t  *pwchText = NULL;
+    int       cch = 0;
+
+    hFile = CreateFile(pwszPath,
+                       GENERIC_READ,
+                       FILE_SHARE_READ | FILE_SHARE_WRITE,
+                       NULL,
+                       OPEN_EXISTING,
+                       FILE_ATTRIBUTE_NORMAL,
+                       NULL);
+    ERRCHECK(hFile == INVALID_HANDLE_VALUE,
+             HRESULT_FROM_WIN32(GetLastError()));
+
+    cbFile = GetFileSize(hFile, NULL);
+    ERRCHECK(cbFile == 0xFFFFFFFF, HRESULT_FROM_WIN32(GetLastError()));
+
+    pchFile = new char[cbFile + 1];
+    ERRCHECK(pchFile == NULL, E_OUTOFMEMORY);
+
+    ERRCHECK(!ReadFile(hFile, pchFile, cbFile, &cbRead, NULL),
+             HRESULT_FROM_WIN32(GetLastError()));
+
+    // An ANSI file never takes more characters than bytes.
+    pwchText = new wchar_t[cbRead + 1];
+    ERRCHECK(pwchText == NULL, E_OUTOFMEMORY);
+
+    if (cbRead) {
+        cch = MultiByteToWideChar(CP_ACP, 0,
+                                  pchFile, cbRead,
+                                  pwchText, cbRead);
+        ERRCHECK(cch == 0, HRESULT_FROM_WIN32(GetLastError()));
+    }
+
+    ERRCHECK(!m_ini.AddText(pwchText, cch), E_OUTOFMEMORY);
+
+    hr = S_OK;
+  Error:
+    if (hFile != INVALID_HANDLE_VALUE) {
+        CloseHandle(hFile);
+    }
+    delete [] pchFile;
+    delete [] pwchText;
+    return hr;
+}
+
+// ============================================================================
+// CBrowscapDatabase::GetProperty
+
+HRESULT
+CBrowscapDatabase::GetProperty(
+    int section,                            // [in] from Match()
+    const wchar_t *pwszName,                // [in] property name
+    CComVariant & varValue) const           // [out] its value
+{
+    HRESULT         hr;
+    const wchar_t  *pwszValue;
+
+    varValue.Clear();
+
+    pwszValue = m_ini.GetProperty(section, pwszName);
+    if (pwszValue == NULL ||
+        CBrowscapIni::CompareNoCase(pwszValue, L"unknown") == 0) {
+        RETURNERR(S_FALSE);
+    }
+
+    if (CBrowscapIni::CompareNoCase(pwszValue, L"true") == 0) {
+        varValue = true;
+    } else if (CBrowscapIni::CompareNoCase(pwszValue, L"false") == 0) {
+        varValue = false;
+    } else {
+        varValue = pwszValue;
+        ERRCHECK(V_BSTR(&varValue) == NULL, E_OUTOFMEMORY);
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CBrowscapMatch::Set
+
+void
+CBrowscapMatch::Set(CBrowscapDatabase *pDatabase, int section)
+{
+    pDatabase->AddRef();
+    Clear();
+    m_pDatabase = pDatabase;
+    m_section = section;
+}
+
+// ============================================================================
+// CBrowscapMatch::AppendKey
+
+HRESULT
+CBrowscapMatch::AppendKey(CComBSTR & bstrKey) const
+{
+    HRESULT  hr;
+    wchar_t  wszSection[32];
+
+    ASSERT(IsValid());
+
+    wsprintf(wszSection, L"%lu.%d", m_pDatabase->GetGeneration(), m_section);
+    hr = bstrKey.Append(wszSection);
+    HRCHECK(FAILED(hr));
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+void
+CBrowscapMatch::Clear()
+{
+    if (m_pDatabase) {
+        m_pDatabase->Release();
+        m_pDatabase = NULL;
+    }
+    m_section = -1;
+}
+
+// ============================================================================
+// CBrowscap::CBrowscap
+
+CBrowscap::CBrowscap()
+{
+    InitializeCriticalSection(&m_cs);
+    m_bEnabled = false;
+    m_pDatabase = NULL;
+    m_wszAdditionsPath[0] = L'\0';
+    ::memset(&m_browscapInfo, 0, sizeof(m_browscapInfo));
+    ::memset(&m_additionsInfo, 0, sizeof(m_additionsInfo));
+    m_lastCheck = GetTickCount();
+    m_generation = 0;
+
+    if (FAILED(GetBrowscapPath(m_wszBrowscapPath, COUNTOF(m_wszBrowscapPath)))) {
+        m_wszBrowscapPath[0] = L'\0';
+    }
+}
+
+CBrowscap::~CBrowscap()
+{
+    if (m_pDatabase) {
+        m_pDatabase->Release();
+    }
+    DeleteCriticalSection(&m_cs);
+}
+
+// ============================================================================
+// CBrowscap::Configure
+//      Called for every request, so does nothing unless the settings
+//      have changed.  The settings are only read under the lock, since
+//      another request may be changing them.
+
+HRESULT
+CBrowscap::Configure(
+    bool bEnabled,                          // [in] use the native reader
+    const wchar_t *pwszAdditions)           // [in] additions file, or NULL
+{
+    const wchar_t *pwszPath = pwszAdditions ? pwszAdditions : L"";
+
+    Enter();
+
+    if (bEnabled != m_bEnabled ||
+        lstrcmpiW(pwszPath, m_wszAdditionsPath) != 0) {
+
+        m_bEnabled = bEnabled;
+        lstrcpyn(m_wszAdditionsPath, pwszPath, COUNTOF(m_wszAdditionsPath));
+
+        if (bEnabled) {
+            Reload();
+        } else if (m_pDatabase) {
+            m_pDatabase->Release();
+            m_pDatabase = NULL;
+        }
+    }
+
+    Leave();
+
+    return S_OK;
+}
+
+// ============================================================================
+// CBrowscap::Reload
+//      Load the files again.  Must be called with the lock held;
+//      requests wait for the load, which only happens when the files
+//      or the settings change.
+
+void
+CBrowscap::Reload()
+{
+    CBrowscapDatabase *pDatabase;
+
+    if (m_pDatabase) {
+        m_pDatabase->Release();
+        m_pDatabase = NULL;
+    }
+
+    GetFileCacheInfo(m_wszBrowscapPath, &m_browscapInfo);
+    if (m_wszAdditionsPath[0]) {
+        GetFileCacheInfo(m_wszAdditionsPath, &m_additionsInfo);
+    } else {
+        ::memset(&m_additionsInfo, 0, sizeof(m_additionsInfo));
+    }
+    m_lastCheck = GetTickCount();
+
+    if (m_wszBrowscapPath[0] == L'\0') {
+        return;
+    }
+
+    pDatabase = new CBrowscapDatabase(++m_generation);
+    if (pDatabase == NULL) {
+        return;
+    }
+
+    if (SUCCEEDED(pDatabase->Load(m_wszBrowscapPath,
+                                  m_wszAdditionsPath[0] ? m_wszAdditionsPath : NULL))) {
+        m_pDatabase = pDatabase;
+    } else {
+        pDatabase->Release();
+    }
+}
+
+// ============================================================================
+// CBrowscap::CheckVersion
+//      Reload if either file has changed.  Must be called with the lock
+//      held.
+
+void
+CBrowscap::CheckVersion()
+{
+    XmlCacheInfo  browscapInfo;
+    XmlCacheInfo  additionsInfo;
+    DWORD         now = GetTickCount();
+
+    if (now - m_lastCheck < BROWSCAP_RELOAD_CHECK_INTERVAL) {
+        return;
+    }
+    m_lastCheck = now;
+
+    GetFileCacheInfo(m_wszBrowscapPath, &browscapInfo);
+    ::memset(&additionsInfo, 0, sizeof(additionsInfo));
+    if (m_wszAdditionsPath[0]) {
+        GetFileCacheInfo(m_wszAdditionsPath, &additionsInfo);
+    }
+
+    if (::memcmp(&browscapInfo, &m_browscapInfo, sizeof(browscapInfo)) != 0 ||
+        ::memcmp(&additionsInfo, &m_additionsInfo, sizeof(additionsInfo)) != 0) {
+        Reload();
+    }
+}
+
+// ============================================================================
+// CBrowscap::Match
+
+HRESULT
+CBrowscap::Match(
+    BSTR bstrUserAgent,                     // [in] User-Agent, may be NULL
+    CBrowscapMatch & match)                 // [out] its section
+{
+    HRESULT             hr;
+    CBrowscapDatabase  *pDatabase = NULL;
+
+    match.Clear();
+
+    Enter();
+
+    if (m_bEnabled) {
+        CheckVersion();
+
+        pDatabase = m_pDatabase;
+        if (pDatabase) {
+            pDatabase->AddRef();
+        }
+    }
+
+    Leave();
+
+    if (pDatabase == NULL) {
+        RETURNERR(S_FALSE);
+    }
+
+    match.Set(pDatabase, pDatabase->Match(bstrUserAgent ? bstrUserAgent : L""));
+
+    hr = S_OK;
+  Error:
+    if (pDatabase) {
+        pDatabase->Release();
+    }
+    return hr;
+}
@@ -0,0 +1,159 @@
+// ============================================================================
+// FILE: browscap.h
+//
+//      Native reader of browscap.ini, answering the same questions as
+//      the MSWC.BrowserType component without creating it.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#pragma once
+
+#include "browscapini.h"
+
+// ============================================================================
+// CLASS: CBrowscapDatabase
+//
+//      browscap.ini (plus any additions file), read from disk and
+//      compiled for matching by CBrowscapIni.  Properties are handed
+//      out as GetBrowserTypeProperty would.
+//
+//      Never changes once loaded; reference counted so a request can
+//      keep using it after a newer version has been loaded.
+
+class CBrowscapDatabase
+{
+  public:
+    CBrowscapDatabase(DWORD generation);
+
+    long AddRef() {
+        return InterlockedIncrement(&m_ref);
+    }
+
+    long Release() {
+        long result = InterlockedDecrement(&m_ref);
+        if (result == 0) {
+            delete this;
+        }
+        return result;
+    }
+
+    // Load browscap.ini and, if pwszAdditions isn't NULL, a file of
+    // more sections (e.g. browscap-add.ini).  Those in the additions
+    // file take priority over browscap.ini's.
+    HRESULT Load(const wchar_t *pwszBrowscap,       // [in] path of browscap.ini
+                 const wchar_t *pwszAdditions);     // [in] additions, or NULL
+
+    // The section for a User-Agent, or -1 if nothing matches and
+    // there are no default settings.
+    int Match(const wchar_t *pwszUserAgent) const {
+        return m_ini.Match(pwszUserAgent);
+    }
+
+    // Which load of the files this is; no two share a number.
+    DWORD GetGeneration() const {
+        return m_generation;
+    }
+
+    // Get a property of a section as GetBrowserTypeProperty would:
+    // S_FALSE if it's not there or is "unknown".  "TRUE" and "FALSE"
+    // are returned as booleans, anything else as a string.
+    HRESULT GetProperty(int section,                // [in] from Match()
+                        const wchar_t *pwszName,    // [in] property name
+                        CComVariant & varValue) const; // [out] its value
+
+  private:
+    ~CBrowscapDatabase() {}
+
+    HRESULT AddFile(const wchar_t *pwszPath);
+
+    long          m_ref;
+    DWORD         m_generation;
+    CBrowscapIni  m_ini;
+};
+
+// ============================================================================
+// CLASS: CBrowscapMatch
+//
+//      The section a request's User-Agent matched, holding on to the
+//      database it came from.
+
+class CBrowscapMatch
+{
+  public:
+    CBrowscapMatch() : m_pDatabase(NULL), m_section(-1) {}
+
+    ~CBrowscapMatch() {
+        Clear();
+    }
+
+    void Set(CBrowscapDatabase *pDatabase, int section);
+    void Clear();
+
+    bool IsValid() const {
+        return m_pDatabase != NULL;
+    }
+
+    HRESULT GetProperty(const wchar_t *pwszName,
+                        CComVariant & varValue) const {
+        return m_pDatabase->GetProperty(m_section, pwszName, varValue);
+    }
+
+    // Append what identifies the section (and the load of the files
+    // it's from), for keys of anything that depends only on the
+    // browser's properties.  Many User-Agents share one.
+    HRESULT AppendKey(CComBSTR & bstrKey) const;
+
+  private:
+    CBrowscapDatabase  *m_pDatabase;
+    int                 m_section;
+};
+
+// ============================================================================
+// CLASS: CBrowscap
+//
+//      The browscap.ini currently in use, when the native reader is
+//      turned on.  The files are reloaded when they change; if they
+//      can't be read, requests go back to the BrowserType component.
+
+class CBrowscap
+{
+  public:
+    CBrowscap();
+    ~CBrowscap();
+
+    // Turn the native reader on or off, with the additions file to
+    // load with browscap.ini (NULL or empty for none).
+    HRESULT Configure(bool bEnabled, const wchar_t *pwszAdditions);
+
+    // Only a hint, read without the lock; Match checks again.
+    bool IsEnabled() const {
+        return m_bEnabled;
+    }
+
+    // Find the section for a User-Agent.  S_FALSE, leaving match
+    // invalid, if the native reader is off or couldn't load the files.
+    HRESULT Match(BSTR bstrUserAgent,               // [in] User-Agent, may be NULL
+                  CBrowscapMatch & match);          // [out] its section
+
+  private:
+    void CheckVersion();
+    void Reload();
+
+    void Enter() {
+        EnterCriticalSection(&m_cs);
+    }
+
+    void Leave() {
+        LeaveCriticalSection(&m_cs);
+    }
+
+    bool                m_bEnabled;
+    CBrowscapDatabase  *m_pDatabase;        // NULL if not loaded
+    wchar_t             m_wszBrowscapPath[MAX_PATH];
+    wchar_t             m_wszAdditionsPath[MAX_PATH];
+    XmlCacheInfo        m_browscapInfo;     // versions loaded
+    XmlCacheInfo        m_additionsInfo;
+    DWORD               m_lastCheck;        // GetTickCount() of last check
+    DWORD               m_generation;       // loads so far
+    CRITICAL_SECTION    m_cs;
+};
@@ -0,0 +1,615 @@
+// ============================================================================
+// FILE: browscapini.cpp
+//
+//      Implementation of CBrowscapIni.  Doesn't use the precompiled
+//      header: nothing here depends on Windows or ATL.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#include <string.h>
+#include <wctype.h>
+#include "browscapini.h"
+
+// Section whose properties every other section inherits.
+static const wchar_t g_wszDefaultSection[] = L"Default Browser Capability Settings";
+
+// Longest chain of parent= followed, in case of a loop.
+const int MAX_PARENT_DEPTH = 32;
+
+// ============================================================================
+// CBrowscapIni::CBrowscapIni
+
+CBrowscapIni::CBrowscapIni()
+{
+    m_pwchText = NULL;
+    m_cchText = 0;
+    m_sections = NULL;
+    m_numSections = 0;
+    m_properties = NULL;
+    m_numProperties = 0;
+    m_resolved = NULL;
+    m_numResolved = 0;
+    m_nodes = NULL;
+    m_numNodes = 0;
+    m_nameTable = NULL;
+    m_nameTableSize = 0;
+    m_defaultSection = -1;
+}
+
+CBrowscapIni::~CBrowscapIni()
+{
+    delete [] m_pwchText;
+    delete [] m_sections;
+    delete [] m_properties;
+    delete [] m_resolved;
+    delete [] m_nodes;
+    delete [] m_nameTable;
+}
+
+// ============================================================================
+// CBrowscapIni::CompareNoCase
+
+int
+CBrowscapIni::CompareNoCase(const wchar_t *pwsz1, const wchar_t *pwsz2)
+{
+    wint_t ch1;
+    wint_t ch2;
+
+    do {
+        ch1 = towlower(*pwsz1++);
+        ch2 = towlower(*pwsz2++);
+    } while (ch1 == ch2 && ch1 != L'\0');
+
+    return (ch1 < ch2) ? -1 : (ch1 > ch2) ? 1 : 0;
+}
+
+// ============================================================================
+// CBrowscapIni::AddText
+//      Add the text, and a line break, to m_pwchText.
+
+bool
+CBrowscapIni::AddText(
+    const wchar_t *pwchText,                // [in] text, any line breaks
+    unsigned       cchText)                 // [in] its length
+{
+    wchar_t *pwchNew;
+
+    pwchNew = new wchar_t[m_cchText + cchText + 2];
+    if (pwchNew == NULL) {
+        return false;
+    }
+
+    if (m_cchText) {
+        ::memcpy(pwchNew, m_pwchText, m_cchText * sizeof(wchar_t));
+    }
+    if (cchText) {
+        ::memcpy(pwchNew + m_cchText, pwchText, cchText * sizeof(wchar_t));
+    }
+
+    m_cchText += cchText;
+    pwchNew[m_cchText++] = L'\n';
+    pwchNew[m_cchText] = L'\0';
+
+    delete [] m_pwchText;
+    m_pwchText = pwchNew;
+    return true;
+}
+
+// ============================================================================
+// CBrowscapIni::Compile
+
+bool
+CBrowscapIni::Compile()
+{
+    return Parse() &&
+           LinkParents() &&
+           BuildTrie() &&
+           ResolveProperties();
+}
+
+// ============================================================================
+// CBrowscapIni::Parse
+//      Split the text into sections and properties, in place.  Section
+//      names are lower-cased for matching.
+
+bool
+CBrowscapIni::Parse()
+{
+    wchar_t  *pwch;
+    wchar_t  *pwchEnd = m_pwchText + m_cchText;
+    wchar_t  *pwchLine;
+    wchar_t  *pwchLast;
+    wchar_t  *pwchEquals;
+    wchar_t  *pwchValue;
+    unsigned  maxLines = 1;
+    Section  *pSection = NULL;
+
+    // Every section or property takes a line of its own.
+    for (pwch = m_pwchText; pwch < pwchEnd; pwch++) {
+        if (*pwch == L'\n') {
+            maxLines++;
+        }
+    }
+
+    m_sections = new Section[maxLines];
+    if (m_sections == NULL) {
+        return false;
+    }
+
+    m_properties = new Property[maxLines];
+    if (m_properties == NULL) {
+        return false;
+    }
+
+    for (pwch = m_pwchText; pwch < pwchEnd; pwch++) {
+
+        pwchLine = pwch;
+        while (pwch < pwchEnd && *pwch != L'\n' && *pwch != L'\r') {
+            pwch++;
+        }
+        *pwch = L'\0';
+
+        while (iswspace(*pwchLine)) {
+            pwchLine++;
+        }
+        if (*pwchLine == L'\0' || *pwchLine == L';') {
+            continue;
+        }
+
+        pwchLast = pwch - 1;
+        while (pwchLast > pwchLine && iswspace(*pwchLast)) {
+            *pwchLast-- = L'\0';
+        }
+
+        if (*pwchLine == L'[') {
+
+            pwchLast = wcsrchr(pwchLine, L']');
+            if (pwchLast == NULL) {
+                continue;
+            }
+            *pwchLast = L'\0';
+
+            pSection = &m_sections[m_numSections++];
+            ::memset(pSection, 0, sizeof(*pSection));
+            pSection->m_pwszName = pwchLine + 1;
+            pSection->m_pwszWildcard = wcspbrk(pwchLine + 1, L"*?");
+            pSection->m_parent = -1;
+            pSection->m_nextInNode = -1;
+            pSection->m_firstProperty = m_numProperties;
+
+            for (pwchLast = pwchLine + 1; *pwchLast; pwchLast++) {
+                *pwchLast = static_cast<wchar_t>(towlower(*pwchLast));
+            }
+
+        } else if (pSection != NULL &&
+                   (pwchEquals = wcschr(pwchLine, L'=')) != NULL) {
+
+            *pwchEquals = L'\0';
+            pwchLast = pwchEquals;
+            while (pwchLast > pwchLine && iswspace(pwchLast[-1])) {
+                *--pwchLast = L'\0';
+            }
+
+            pwchValue = pwchEquals + 1;
+            while (iswspace(*pwchValue)) {
+                pwchValue++;
+            }
+
+            if (CompareNoCase(pwchLine, L"parent") == 0) {
+                pSection->m_pwszParent = pwchValue;
+            } else {
+                m_properties[m_numProperties].m_pwszName = pwchLine;
+                m_properties[m_numProperties].m_pwszValue = pwchValue;
+                m_numProperties++;
+                pSection->m_numProperties++;
+            }
+        }
+    }
+
+    return true;
+}
+
+// ============================================================================
+// CBrowscapIni::HashName
+//      Section names are compared without regard to case, so hash them
+//      that way too.
+
+unsigned
+CBrowscapIni::HashName(const wchar_t *pwszName)
+{
+    unsigned       hash = 2166136261U;
+    const wchar_t *pwch;
+
+    for (pwch = pwszName; *pwch; pwch++) {
+        hash = (hash ^ static_cast<unsigned>(towlower(*pwch))) * 16777619U;
+    }
+
+    return hash;
+}
+
+// ============================================================================
+// CBrowscapIni::FindSection
+//      The first section with the given name, or -1.
+
+int
+CBrowscapIni::FindSection(const wchar_t *pwszName) const
+{
+    unsigned mask = m_nameTableSize - 1;
+    unsigned i;
+
+    for (i = HashName(pwszName) & mask;
+         m_nameTable[i] != -1;
+         i = (i + 1) & mask) {
+        if (CompareNoCase(m_sections[m_nameTable[i]].m_pwszName, pwszName) == 0) {
+            return m_nameTable[i];
+        }
+    }
+
+    return -1;
+}
+
+// ============================================================================
+// CBrowscapIni::LinkParents
+//      Index the section names, and find each section's parent and the
+//      default settings.
+
+bool
+CBrowscapIni::LinkParents()
+{
+    unsigned mask;
+    unsigned i;
+    int      section;
+
+    m_nameTableSize = 16;
+    while (m_nameTableSize < 2 * static_cast<unsigned>(m_numSections)) {
+        m_nameTableSize *= 2;
+    }
+    mask = m_nameTableSize - 1;
+
+    m_nameTable = new int[m_nameTableSize];
+    if (m_nameTable == NULL) {
+        return false;
+    }
+
+    for (i = 0; i < m_nameTableSize; i++) {
+        m_nameTable[i] = -1;
+    }
+
+    for (section = 0; section < m_numSections; section++) {
+        if (FindSection(m_sections[section].m_pwszName) != -1) {
+            continue;
+        }
+        for (i = HashName(m_sections[section].m_pwszName) & mask;
+             m_nameTable[i] != -1;
+             i = (i + 1) & mask) {
+        }
+        m_nameTable[i] = section;
+    }
+
+    for (section = 0; section < m_numSections; section++) {
+        if (m_sections[section].m_pwszParent) {
+            m_sections[section].m_parent =
+                FindSection(m_sections[section].m_pwszParent);
+        }
+    }
+
+    m_defaultSection = FindSection(g_wszDefaultSection);
+
+    return true;
+}
+
+// ============================================================================
+// CBrowscapIni::FindChild
+
+int
+CBrowscapIni::FindChild(int node, wchar_t ch) const
+{
+    int child;
+
+    for (child = m_nodes[node].m_firstChild;
+         child != -1;
+         child = m_nodes[child].m_nextSibling) {
+        if (m_nodes[child].m_ch == ch) {
+            break;
+        }
+    }
+
+    return child;
+}
+
+// ============================================================================
+// CBrowscapIni::BuildTrie
+//      Put each section at the node for the part of its name before
+//      the first wildcard (all of it if there's none).  The sections
+//      at a node stay in the order they were added.
+
+bool
+CBrowscapIni::BuildTrie()
+{
+    unsigned       maxNodes = 1;
+    int            section;
+    int            node;
+    int            child;
+    int           *pLink;
+    const wchar_t *pwch;
+    const wchar_t *pwchEnd;
+
+    for (section = 0; section < m_numSections; section++) {
+        maxNodes += m_sections[section].m_pwszWildcard
+                  ? static_cast<unsigned>(m_sections[section].m_pwszWildcard -
+                                          m_sections[section].m_pwszName)
+                  : static_cast<unsigned>(wcslen(m_sections[section].m_pwszName));
+    }
+
+    m_nodes = new Node[maxNodes];
+    if (m_nodes == NULL) {
+        return false;
+    }
+
+    ::memset(&m_nodes[0], 0, sizeof(Node));
+    m_nodes[0].m_firstChild = -1;
+    m_nodes[0].m_nextSibling = -1;
+    m_nodes[0].m_firstSection = -1;
+    m_numNodes = 1;
+
+    for (section = 0; section < m_numSections; section++) {
+
+        pwch = m_sections[section].m_pwszName;
+        pwchEnd = m_sections[section].m_pwszWildcard;
+        if (pwchEnd == NULL) {
+            pwchEnd = pwch + wcslen(pwch);
+        }
+
+        for (node = 0; pwch < pwchEnd; pwch++, node = child) {
+            child = FindChild(node, *pwch);
+            if (child == -1) {
+                child = m_numNodes++;
+                m_nodes[child].m_ch = *pwch;
+                m_nodes[child].m_firstChild = -1;
+                m_nodes[child].m_firstSection = -1;
+                m_nodes[child].m_nextSibling = m_nodes[node].m_firstChild;
+                m_nodes[node].m_firstChild = child;
+            }
+        }
+
+        for (pLink = &m_nodes[node].m_firstSection;
+             *pLink != -1;
+             pLink = &m_sections[*pLink].m_nextInNode) {
+        }
+        *pLink = section;
+    }
+
+    return true;
+}
+
+// ============================================================================
+// CBrowscapIni::Resolve
+//      Collect a section's properties: its own, then those of its
+//      parents, then the default settings, each name only once.  Sorted
+//      by name.  Returns how many there are.
+
+unsigned
+CBrowscapIni::Resolve(
+    int section,                            // [in] section to resolve
+    Property *pResolved) const              // [out] its properties
+{
+    unsigned  numResolved = 0;
+    unsigned  i;
+    unsigned  j;
+    int       depth;
+    int       pass;
+    int       s;
+    Property  property;
+
+    for (pass = 0; pass < 2; pass++) {
+
+        s = (pass == 0) ? section : m_defaultSection;
+
+        for (depth = 0; s != -1 && depth < MAX_PARENT_DEPTH; depth++) {
+            for (i = 0; i < m_sections[s].m_numProperties; i++) {
+
+                property = m_properties[m_sections[s].m_firstProperty + i];
+
+                for (j = 0; j < numResolved; j++) {
+                    if (CompareNoCase(pResolved[j].m_pwszName,
+                                      property.m_pwszName) == 0) {
+                        break;
+                    }
+                }
+                if (j == numResolved) {
+                    pResolved[numResolved++] = property;
+                }
+            }
+            s = m_sections[s].m_parent;
+        }
+    }
+
+    // Insertion sort; there are a few dozen at most.
+    for (i = 1; i < numResolved; i++) {
+        property = pResolved[i];
+        for (j = i;
+             j > 0 && CompareNoCase(pResolved[j - 1].m_pwszName,
+                                    property.m_pwszName) > 0;
+             j--) {
+            pResolved[j] = pResolved[j - 1];
+        }
+        pResolved[j] = property;
+    }
+
+    return numResolved;
+}
+
+// ============================================================================
+// CBrowscapIni::ResolveProperties
+
+bool
+CBrowscapIni::ResolveProperties()
+{
+    Property  *pScratch;
+    unsigned   total = 0;
+    int        section;
+
+    // No section can end up with more properties than the files have.
+    pScratch = new Property[m_numProperties + 1];
+    if (pScratch == NULL) {
+        return false;
+    }
+
+    for (section = 0; section < m_numSections; section++) {
+        total += Resolve(section, pScratch);
+    }
+
+    delete [] pScratch;
+
+    m_resolved = new Property[total + 1];
+    if (m_resolved == NULL) {
+        return false;
+    }
+
+    for (section = 0; section < m_numSections; section++) {
+        m_sections[section].m_firstResolved = m_numResolved;
+        m_sections[section].m_numResolved =
+            Resolve(section, m_resolved + m_numResolved);
+        m_numResolved += m_sections[section].m_numResolved;
+    }
+
+    return true;
+}
+
+// ============================================================================
+// CBrowscapIni::WildcardMatch
+//      Whether the text matches a lower-case pattern in which '*' is
+//      any run of characters and '?' any one character.  On a mismatch
+//      after a '*', only the last '*' needs to take one more
+//      character, so this never backtracks further than that.
+
+bool
+CBrowscapIni::WildcardMatch(
+    const wchar_t *pwszPattern,             // [in] pattern, lower case
+    const wchar_t *pwszText)                // [in] text, any case
+{
+    const wchar_t *pwchStar = NULL;         // last '*' seen
+    const wchar_t *pwchStarText = NULL;     // where it's matched up to
+
+    while (*pwszText) {
+        if (*pwszPattern == L'*') {
+            pwchStar = pwszPattern++;
+            pwchStarText = pwszText;
+        } else if (*pwszPattern == L'?' ||
+                   static_cast<wint_t>(*pwszPattern) == towlower(*pwszText)) {
+            pwszPattern++;
+            pwszText++;
+        } else if (pwchStar) {
+            pwszPattern = pwchStar + 1;
+            pwszText = ++pwchStarText;
+        } else {
+            return false;
+        }
+    }
+
+    while (*pwszPattern == L'*') {
+        pwszPattern++;
+    }
+
+    return *pwszPattern == L'\0';
+}
+
+// ============================================================================
+// CBrowscapIni::Match
+//      Walk the trie along the User-Agent.  At each node, the sections
+//      with wildcards are tried against the rest of the User-Agent;
+//      the sections without are exact matches if the User-Agent ends
+//      there.
+
+int
+CBrowscapIni::Match(const wchar_t *pwszUserAgent) const
+{
+    const wchar_t *pwch = pwszUserAgent;
+    int            node = 0;
+    int            best = -1;
+    int            section;
+
+    if (m_nodes == NULL) {
+        return -1;
+    }
+
+    for (;;) {
+
+        for (section = m_nodes[node].m_firstSection;
+             section != -1;
+             section = m_sections[section].m_nextInNode) {
+
+            if (m_sections[section].m_pwszWildcard == NULL) {
+                if (*pwch == L'\0') {
+                    return section;
+                }
+            } else if (best == -1 || section < best) {
+                if (WildcardMatch(m_sections[section].m_pwszWildcard, pwch)) {
+                    best = section;
+                }
+            }
+        }
+
+        if (*pwch == L'\0') {
+            break;
+        }
+
+        node = FindChild(node, static_cast<wchar_t>(towlower(*pwch)));
+        if (node == -1) {
+            break;
+        }
+        pwch++;
+    }
+
+    return (best != -1) ? best : m_defaultSection;
+}
+
+// ============================================================================
+// CBrowscapIni::GetSectionName
+
+const wchar_t *
+CBrowscapIni::GetSectionName(int section) const
+{
+    if (section < 0 || section >= m_numSections) {
+        return NULL;
+    }
+
+    return m_sections[section].m_pwszName;
+}
+
+// ============================================================================
+// CBrowscapIni::GetProperty
+
+const wchar_t *
+CBrowscapIni::GetProperty(
+    int section,                            // [in] from Match()
+    const wchar_t *pwszName) const          // [in] property name
+{
+    const Property *pResolved;
+    int             low;
+    int             high;
+    int             mid;
+    int             cmp;
+
+    if (section < 0 || section >= m_numSections) {
+        return NULL;
+    }
+
+    pResolved = m_resolved + m_sections[section].m_firstResolved;
+    low = 0;
+    high = static_cast<int>(m_sections[section].m_numResolved) - 1;
+
+    while (low <= high) {
+        mid = (low + high) / 2;
+        cmp = CompareNoCase(pResolved[mid].m_pwszName, pwszName);
+        if (cmp == 0) {
+            return pResolved[mid].m_pwszValue;
+        } else if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    return NULL;
+}
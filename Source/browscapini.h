@@ -0,0 +1,117 @@
+// ============================================================================
+// FILE: browscapini.h
+//
+//      Parsing and matching of browscap.ini sections.  Uses nothing
+//      but the C library, so that it can be built and tested on its
+//      own; reading the files and handing out properties as VARIANTs
+//      is left to browscap.cpp.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#pragma once
+
+#include <wchar.h>
+
+// ============================================================================
+// CLASS: CBrowscapIni
+//
+//      The text of browscap.ini (plus any additions file), compiled for
+//      matching.  Each section name is a pattern in which '*' and '?'
+//      are wildcards.  The part of each name before its first wildcard
+//      goes into a trie, so matching a User-Agent walks the trie once
+//      and only tries the wildcard part of the sections found along
+//      the way.  As with BrowserType, a section named exactly by the
+//      User-Agent wins; otherwise it's the first matching section.
+//      Text added first comes first, so the additions file is added
+//      before browscap.ini for its sections to take priority (over
+//      [*], for one).  Each section's properties, with those inherited
+//      through parent= and from [Default Browser Capability Settings],
+//      are resolved and sorted by Compile.  Names are compared without
+//      regard to case, folded with towlower throughout.
+
+class CBrowscapIni
+{
+  public:
+    CBrowscapIni();
+    ~CBrowscapIni();
+
+    // Add the text of a file.  Returns false if out of memory.
+    bool AddText(const wchar_t *pwchText,           // [in] text, any line breaks
+                 unsigned       cchText);           // [in] its length
+
+    // Compile the text added so far for matching.  Called once, after
+    // the last AddText.  Returns false if out of memory.
+    bool Compile();
+
+    // The section for a User-Agent, or -1 if nothing matches and
+    // there are no default settings.
+    int Match(const wchar_t *pwszUserAgent) const;
+
+    // The name of a section, lower case.
+    const wchar_t *GetSectionName(int section) const;
+
+    // The value of a property of a section, its own or inherited, or
+    // NULL if it has none by that name.
+    const wchar_t *GetProperty(int section,           // [in] from Match()
+                               const wchar_t *pwszName) const;
+
+    // Compare as the names of sections and properties are compared.
+    static int CompareNoCase(const wchar_t *pwsz1, const wchar_t *pwsz2);
+
+  private:
+    struct Property {
+        const wchar_t  *m_pwszName;
+        const wchar_t  *m_pwszValue;
+    };
+
+    struct Section {
+        const wchar_t  *m_pwszName;         // lower case
+        const wchar_t  *m_pwszWildcard;     // first '*' or '?', or NULL
+        const wchar_t  *m_pwszParent;       // parent= value, or NULL
+        int             m_parent;           // index of parent, or -1
+        int             m_nextInNode;       // next section in trie node
+        unsigned        m_firstProperty;    // own properties
+        unsigned        m_numProperties;
+        unsigned        m_firstResolved;    // own and inherited, sorted
+        unsigned        m_numResolved;
+    };
+
+    struct Node {
+        wchar_t         m_ch;
+        int             m_firstChild;
+        int             m_nextSibling;
+        int             m_firstSection;     // sections whose literal
+                                            // prefix ends here
+    };
+
+    bool Parse();
+    bool LinkParents();
+    bool BuildTrie();
+    bool ResolveProperties();
+    unsigned Resolve(int section, Property *pResolved) const;
+    int FindSection(const wchar_t *pwszName) const;
+    int FindChild(int node, wchar_t ch) const;
+
+    static unsigned HashName(const wchar_t *pwszName);
+    static bool WildcardMatch(const wchar_t *pwszPattern,
+                              const wchar_t *pwszText);
+
+    // Not copied.
+    CBrowscapIni(const CBrowscapIni &);
+    CBrowscapIni & operator=(const CBrowscapIni &);
+
+    wchar_t    *m_pwchText;                 // the files; names and values
+                                            // point into it
+    unsigned    m_cchText;
+    Section    *m_sections;
+    int         m_numSections;
+    Property   *m_properties;
+    unsigned    m_numProperties;
+    Property   *m_resolved;
+    unsigned    m_numResolved;
+    Node       *m_nodes;
+    int         m_numNodes;
+    int        *m_nameTable;                // open hash of section names
+    unsigned    m_nameTableSize;            // a power of two
+    int         m_defaultSection;           // defaults for everything, or -1
+};
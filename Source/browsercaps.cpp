@@ -0,0 +1,258 @@
+//+---------------------------------------------------------------------------
+//
+//  Copyright (C) Microsoft Corporation, 1999-2000.
+//
+//  File:       browsercaps.cpp
+//
+//  Contents:   Implementation of CBrowserCaps and CBrowserCapsCache.
+//----------------------------------------------------------------------------
+#include "StdAfx.h"
+
+// Don't look at browscap.ini more than once every this many ms.
+const DWORD BROWSCAP_CHECK_INTERVAL = 2000;
+
+CBrowserCaps::CBrowserCaps()
+{
+    m_ref = 1;
+    m_count = 0;
+    ::memset(m_properties, 0, sizeof(m_properties));
+    InitializeCriticalSection(&m_cs);
+}
+
+CBrowserCaps::~CBrowserCaps()
+{
+    for (LONG i = 0; i < m_count; i++) {
+        SysFreeString(m_properties[i].m_bstrName);
+        VariantClear(&m_properties[i].m_value);
+    }
+    DeleteCriticalSection(&m_cs);
+}
+
+HRESULT
+CBrowserCaps::Lookup(const wchar_t *pwszName,
+                     CComVariant & varValue,
+                     bool *pbFound)
+{
+    HRESULT  hr;
+    LONG     count = m_count;
+
+    *pbFound = false;
+    varValue.Clear();
+
+    for (LONG i = 0; i < count; i++) {
+        if (lstrcmpiW(m_properties[i].m_bstrName, pwszName) == 0) {
+
+            *pbFound = true;
+
+            if (m_properties[i].m_hr == S_OK) {
+                hr = varValue.Copy(&m_properties[i].m_value);
+                HRCHECK(FAILED(hr));
+            }
+            RETURNERR(m_properties[i].m_hr);
+        }
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+HRESULT
+CBrowserCaps::Add(const wchar_t *pwszName,
+                  const VARIANT & varValue,
+                  HRESULT hrLookup)
+{
+    HRESULT   hr;
+    Property  property;
+    LONG      i;
+
+    ::memset(&property, 0, sizeof(property));
+
+    property.m_bstrName = SysAllocString(pwszName);
+    ERRCHECK(property.m_bstrName == NULL, E_OUTOFMEMORY);
+
+    property.m_hr = hrLookup;
+    if (hrLookup == S_OK) {
+        hr = VariantCopy(&property.m_value, const_cast<VARIANT *>(&varValue));
+        HRCHECK(FAILED(hr));
+    }
+
+    EnterCriticalSection(&m_cs);
+
+    for (i = 0; i < m_count; i++) {
+        if (lstrcmpiW(m_properties[i].m_bstrName, pwszName) == 0) {
+            break;
+        }
+    }
+
+    // Fill in the slot before the count makes it visible to Lookup.
+    if (i == m_count && m_count < MAX_PROPERTIES) {
+        m_properties[m_count] = property;
+        ::memset(&property, 0, sizeof(property));
+        InterlockedIncrement(const_cast<LONG *>(&m_count));
+    }
+
+    LeaveCriticalSection(&m_cs);
+
+    hr = S_OK;
+  Error:
+    SysFreeString(property.m_bstrName);
+    VariantClear(&property.m_value);
+    return hr;
+}
+
+CBrowserCapsCache::CBrowserCapsCache()
+{
+    InitializeCriticalSection(&m_cs);
+    m_bEnabled = true;
+    ::memset(m_slots, 0, sizeof(m_slots));
+    ::memset(&m_browscapInfo, 0, sizeof(m_browscapInfo));
+    m_lastCheck = GetTickCount();
+
+    if (SUCCEEDED(GetBrowscapPath(m_wszBrowscapPath, COUNTOF(m_wszBrowscapPath)))) {
+        GetFileCacheInfo(m_wszBrowscapPath, &m_browscapInfo);
+    } else {
+        m_wszBrowscapPath[0] = L'\0';
+    }
+}
+
+CBrowserCapsCache::~CBrowserCapsCache()
+{
+    ClearCache();
+    DeleteCriticalSection(&m_cs);
+}
+
+void
+CBrowserCapsCache::SetEnabled(bool bEnabled)
+{
+    Enter();
+    if (!bEnabled) {
+        ClearCache();
+    }
+    m_bEnabled = bEnabled;
+    Leave();
+}
+
+// CBrowserCapsCache::SlotFromUserAgent
+//     User-Agents are compared exactly, so hash them that way too.
+
+UINT
+CBrowserCapsCache::SlotFromUserAgent(const wchar_t *pwszUserAgent)
+{
+    DWORD          hash = 2166136261;
+    const wchar_t *pwch;
+
+    for (pwch = pwszUserAgent; *pwch; pwch++) {
+        hash = (hash ^ *pwch) * 16777619;
+    }
+
+    return hash % NUM_SLOTS;
+}
+
+// CBrowserCapsCache::ClearCache
+//     Must be called with the table locked (or from the destructor).
+
+void
+CBrowserCapsCache::ClearCache()
+{
+    for (UINT i = 0; i < NUM_SLOTS; i++) {
+        SysFreeString(m_slots[i].m_bstrUserAgent);
+        if (m_slots[i].m_pCaps) {
+            m_slots[i].m_pCaps->Release();
+        }
+    }
+    ::memset(m_slots, 0, sizeof(m_slots));
+}
+
+// CBrowserCapsCache::CheckBrowscapVersion
+//     Throw everything away if browscap.ini has changed.  Must be
+//     called with the table locked.
+
+void
+CBrowserCapsCache::CheckBrowscapVersion()
+{
+    XmlCacheInfo  info;
+    DWORD         now = GetTickCount();
+
+    if (m_wszBrowscapPath[0] == L'\0' ||
+        now - m_lastCheck < BROWSCAP_CHECK_INTERVAL) {
+        return;
+    }
+    m_lastCheck = now;
+
+    GetFileCacheInfo(m_wszBrowscapPath, &info);
+    if (::memcmp(&info, &m_browscapInfo, sizeof(info)) != 0) {
+        ClearCache();
+        m_browscapInfo = info;
+    }
+}
+
+HRESULT
+CBrowserCapsCache::Lookup(BSTR bstrUserAgent,
+                          CBrowserCaps **ppCaps)
+{
+    HRESULT        hr;
+    const wchar_t *pwszUserAgent = bstrUserAgent ? bstrUserAgent : L"";
+    BSTR           bstrNewUserAgent = NULL;
+    CBrowserCaps  *pNewCaps = NULL;
+    Slot          *pSlot;
+
+    *ppCaps = NULL;
+
+    if (!m_bEnabled) {
+        RETURNERR(S_OK);
+    }
+
+    pSlot = &m_slots[SlotFromUserAgent(pwszUserAgent)];
+
+    Enter();
+
+    CheckBrowscapVersion();
+
+    if (pSlot->m_bstrUserAgent &&
+        lstrcmpW(pSlot->m_bstrUserAgent, pwszUserAgent) == 0) {
+        *ppCaps = pSlot->m_pCaps;
+        (*ppCaps)->AddRef();
+    }
+
+    Leave();
+
+    if (*ppCaps) {
+        RETURNERR(S_OK);
+    }
+
+    // A new browser; build its (empty) record outside the lock.
+    bstrNewUserAgent = SysAllocString(pwszUserAgent);
+    ERRCHECK(bstrNewUserAgent == NULL, E_OUTOFMEMORY);
+
+    pNewCaps = new CBrowserCaps();
+    ERRCHECK(pNewCaps == NULL, E_OUTOFMEMORY);
+
+    Enter();
+
+    if (m_bEnabled) {
+        // Either this is still free or another request just filled it
+        // in; replacing it is harmless either way.
+        SysFreeString(pSlot->m_bstrUserAgent);
+        if (pSlot->m_pCaps) {
+            pSlot->m_pCaps->Release();
+        }
+        pSlot->m_bstrUserAgent = bstrNewUserAgent;
+        pSlot->m_pCaps = pNewCaps;
+        pNewCaps->AddRef();
+        bstrNewUserAgent = NULL;
+    }
+
+    Leave();
+
+    *ppCaps = pNewCaps;
+    pNewCaps = NULL;
+
+    hr = S_OK;
+  Error:
+    SysFreeString(bstrNewUserAgent);
+    if (pNewCaps) {
+        pNewCaps->Release();
+    }
+    return hr;
+}
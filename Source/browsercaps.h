@@ -0,0 +1,124 @@
+//+---------------------------------------------------------------------------
+//
+//  Copyright (C) Microsoft Corporation, 1999-2000
+//
+//  File:       browsercaps.h
+//
+//  Contents:   Defines CBrowserCaps, the browser capabilities resolved
+//              for one User-Agent string, and CBrowserCapsCache, which
+//              keeps them across requests.  What MSWC.BrowserType says
+//              about a browser depends only on its User-Agent (and on
+//              browscap.ini), so once a property has been asked for,
+//              later requests from the same browser don't need to
+//              create the object or make the late-bound call again.
+//----------------------------------------------------------------------------
+
+#pragma once
+
+// ============================================================================
+// CLASS: CBrowserCaps
+//
+//      Properties of one browser, filled in as requests ask for them.
+//      Properties are only ever added, so looking one up takes no lock;
+//      adding one is serialized.  Reference counted, since a request
+//      keeps using its record after the cache has replaced it.
+
+class CBrowserCaps
+{
+  public:
+    enum { MAX_PROPERTIES = 32 };
+
+    CBrowserCaps();
+
+    long AddRef() {
+        return InterlockedIncrement(&m_ref);
+    }
+
+    long Release() {
+        long result = InterlockedDecrement(&m_ref);
+        if (result == 0) {
+            delete this;
+        }
+        return result;
+    }
+
+    // Get a property as GetBrowserTypeProperty returned it: S_OK with
+    // the value, or S_FALSE or an error if the browser doesn't have
+    // it.  *pbFound is false if the property hasn't been recorded.
+    HRESULT Lookup(const wchar_t *pwszName,         // [in] property name
+                   CComVariant & varValue,          // [out] its value
+                   bool *pbFound);                  // [out] whether recorded
+
+    // Record what GetBrowserTypeProperty returned for a property.
+    // Does nothing once MAX_PROPERTIES have been recorded.
+    HRESULT Add(const wchar_t *pwszName,            // [in] property name
+                const VARIANT & varValue,           // [in] its value
+                HRESULT hrLookup);                  // [in] S_OK, S_FALSE, etc.
+
+  private:
+    ~CBrowserCaps();
+
+    struct Property {
+        BSTR     m_bstrName;
+        VARIANT  m_value;
+        HRESULT  m_hr;
+    };
+
+    long              m_ref;
+    Property          m_properties[MAX_PROPERTIES];
+    LONG volatile     m_count;              // published properties
+    CRITICAL_SECTION  m_cs;                 // serializes Add
+};
+
+// ============================================================================
+// CLASS: CBrowserCapsCache
+//
+//      Fixed-size, direct-mapped table from User-Agent to CBrowserCaps,
+//      like CSourceInfoCache: a new browser simply replaces whatever
+//      shared its slot.  Everything is thrown away when browscap.ini
+//      changes.
+
+class CBrowserCapsCache
+{
+  public:
+    enum { NUM_SLOTS = 256 };
+
+    CBrowserCapsCache();
+    ~CBrowserCapsCache();
+
+    void SetEnabled(bool bEnabled);
+
+    bool IsEnabled() const {
+        return m_bEnabled;
+    }
+
+    // Get the record for a User-Agent, creating an empty one if there
+    // isn't one.  *ppCaps is AddRef'd; NULL if the cache is disabled.
+    HRESULT Lookup(BSTR bstrUserAgent,              // [in] User-Agent, may be NULL
+                   CBrowserCaps **ppCaps);          // [out] its record
+
+  private:
+    struct Slot {
+        BSTR           m_bstrUserAgent;
+        CBrowserCaps  *m_pCaps;
+    };
+
+    static UINT SlotFromUserAgent(const wchar_t *pwszUserAgent);
+    void CheckBrowscapVersion();
+    void ClearCache();
+
+    void Enter() {
+        EnterCriticalSection(&m_cs);
+    }
+
+    void Leave() {
+        LeaveCriticalSection(&m_cs);
+    }
+
+    bool              m_bEnabled;
+    Slot              m_slots[NUM_SLOTS];
+    wchar_t           m_wszBrowscapPath[MAX_PATH];
+    XmlCacheInfo      m_browscapInfo;       // version the table is for
+    DWORD             m_lastCheck;          // GetTickCount() of last check
+    CRITICAL_SECTION  m_cs;
+};
@@ -0,0 +1,235 @@
+// ============================================================================
+// FILE: bufferpool.cpp
+//
+//      Implementation of the block pool and pooled buffer.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#include "StdAfx.h"
+#include "charset.h"
+
+// ============================================================================
+// CBufferPool::CBufferPool
+
+CBufferPool::CBufferPool(
+    long maxFreePerClass)                   // [in] Free blocks kept per size
+{
+    InitializeCriticalSection(&m_cs);
+    ::memset(m_freeLists, 0, sizeof(m_freeLists));
+    ::memset(m_freeCounts, 0, sizeof(m_freeCounts));
+    m_maxFreePerClass = maxFreePerClass;
+}
+
+// ============================================================================
+// CBufferPool::~CBufferPool
+
+CBufferPool::~CBufferPool()
+{
+    for (int i = 0; i < NUM_BLOCK_CLASSES; i++) {
+        while (m_freeLists[i]) {
+            FreeBlock *pBlock = m_freeLists[i];
+            m_freeLists[i] = pBlock->m_pNext;
+            delete [] reinterpret_cast<BYTE*>(pBlock);
+        }
+    }
+    DeleteCriticalSection(&m_cs);
+}
+
+// ============================================================================
+// CBufferPool::ClassFromSize
+//      Returns the index of the smallest block class that holds cb bytes,
+//      or -1 if cb is bigger than MAX_BLOCK.
+
+int
+CBufferPool::ClassFromSize(ULONG cb)
+{
+    int i = 0;
+
+    while (i < NUM_BLOCK_CLASSES && (1UL << (MIN_BLOCK_SHIFT + i)) < cb) {
+        i++;
+    }
+    return (i < NUM_BLOCK_CLASSES) ? i : -1;
+}
+
+// ============================================================================
+// CBufferPool::Alloc
+//      Returns a block of at least cbMin bytes, from the free lists when
+//      possible.
+
+void *
+CBufferPool::Alloc(
+    ULONG  cbMin,                           // [in] Minimum size needed
+    ULONG *pcbBlock)                        // [out] Actual size of block
+{
+    int   iClass = ClassFromSize(cbMin);
+    void *pv = NULL;
+
+    ASSERT(pcbBlock);
+
+    if (iClass < 0) {
+        *pcbBlock = cbMin;
+        return new BYTE[cbMin];
+    }
+
+    *pcbBlock = 1UL << (MIN_BLOCK_SHIFT + iClass);
+
+    EnterCriticalSection(&m_cs);
+    if (m_freeLists[iClass]) {
+        pv = m_freeLists[iClass];
+        m_freeLists[iClass] = m_freeLists[iClass]->m_pNext;
+        m_freeCounts[iClass]--;
+    }
+    LeaveCriticalSection(&m_cs);
+
+    if (!pv) {
+        pv = new BYTE[*pcbBlock];
+    }
+    return pv;
+}
+
+// ============================================================================
+// CBufferPool::Free
+//      Puts a block back on its free list, or frees it if the list is
+//      full or the block is outside the pooled sizes.
+
+void
+CBufferPool::Free(
+    void  *pv,                              // [in] Block from Alloc()
+    ULONG  cbBlock)                         // [in] Size returned by Alloc()
+{
+    int iClass = ClassFromSize(cbBlock);
+
+    if (!pv) {
+        return;
+    }
+
+    if (iClass >= 0 && (1UL << (MIN_BLOCK_SHIFT + iClass)) == cbBlock) {
+        EnterCriticalSection(&m_cs);
+        if (m_freeCounts[iClass] < m_maxFreePerClass) {
+            FreeBlock *pBlock = static_cast<FreeBlock*>(pv);
+            pBlock->m_pNext = m_freeLists[iClass];
+            m_freeLists[iClass] = pBlock;
+            m_freeCounts[iClass]++;
+            pv = NULL;
+        }
+        LeaveCriticalSection(&m_cs);
+    }
+
+    delete [] static_cast<BYTE*>(pv);
+}
+
+// ============================================================================
+// CPooledBuffer::Append
+//      Adds bytes to the end of the buffer, growing it as needed.
+
+HRESULT
+CPooledBuffer::Append(
+    const void *pv,                         // [in] Data to add
+    ULONG       cb)                         // [in] Number of bytes
+{
+    HRESULT hr;
+
+    if (m_cb + cb > m_cbBlock) {
+        hr = Grow(m_cb + cb);
+        HRCHECK(FAILED(hr));
+    }
+
+    ::memcpy(m_pb + m_cb, pv, cb);
+    m_cb += cb;
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CPooledBuffer::AppendUTF8
+//      Encodes straight into the buffer, after growing it to hold the
+//      longest the text could be.
+
+HRESULT
+CPooledBuffer::AppendUTF8(
+    const wchar_t *pwch,                    // [in] Characters to add
+    ULONG          cch)                     // [in] Number of characters
+{
+    HRESULT hr;
+
+    hr = Reserve(m_cb + cch * CB_UTF8_PER_UTF16_MAX);
+    HRCHECK(FAILED(hr));
+
+    m_cb += cbUTF16ToUTF8(pwch, cch, m_pb + m_cb);
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CPooledBuffer::Grow
+//      Moves the contents into a block of at least twice the current size
+//      (and at least cbMin bytes).
+
+HRESULT
+CPooledBuffer::Grow(ULONG cbMin)            // [in] Minimum size needed
+{
+    HRESULT  hr;
+    ULONG    cbNewBlock;
+    BYTE    *pbNew;
+
+    if (cbMin < 2 * m_cbBlock) {
+        cbMin = 2 * m_cbBlock;
+    }
+
+    pbNew = static_cast<BYTE*>(g_bufferPool->Alloc(cbMin, &cbNewBlock));
+    ERRCHECK(pbNew == NULL, E_OUTOFMEMORY);
+
+    if (m_pb) {
+        ::memcpy(pbNew, m_pb, m_cb);
+        g_bufferPool->Free(m_pb, m_cbBlock);
+    }
+
+    m_pb = pbNew;
+    m_cbBlock = cbNewBlock;
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CPooledBuffer::WriteTo
+//      Writes the whole contents to the stream in one call, then empties
+//      the buffer.
+
+HRESULT
+CPooledBuffer::WriteTo(IStream *pStream)    // [in] Destination
+{
+    HRESULT hr;
+
+    ASSERT(pStream);
+
+    if (m_cb) {
+        hr = pStream->Write(m_pb, m_cb, NULL);
+        HRCHECK(FAILED(hr));
+        m_cb = 0;
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CPooledBuffer::Free
+//      Discards the contents and returns the block to the pool.
+
+void
+CPooledBuffer::Free()
+{
+    if (m_pb) {
+        g_bufferPool->Free(m_pb, m_cbBlock);
+    }
+    m_pb = NULL;
+    m_cb = 0;
+    m_cbBlock = 0;
+}
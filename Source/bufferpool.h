@@ -0,0 +1,90 @@
+// ============================================================================
+// FILE: bufferpool.h
+//
+//      Process-wide pool of heap blocks, and a growable buffer that draws
+//      its storage from the pool so that it's reused across requests.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#pragma once
+
+// ============================================================================
+// CLASS: CBufferPool
+//
+//      Keeps freed blocks on per-size free lists.  Block sizes are powers
+//      of two from MIN_BLOCK to MAX_BLOCK; larger requests go straight to
+//      the heap.
+
+class CBufferPool
+{
+  public:
+    enum {
+        MIN_BLOCK_SHIFT = 12,               // 4K
+        MAX_BLOCK_SHIFT = 20,               // 1M
+        NUM_BLOCK_CLASSES = MAX_BLOCK_SHIFT - MIN_BLOCK_SHIFT + 1
+    };
+
+    CBufferPool(long maxFreePerClass);
+    ~CBufferPool();
+
+    // Returns a block of at least cbMin bytes (NULL if out of memory).
+    // Its actual size is returned in *pcbBlock and must be passed back
+    // to Free().
+    void *Alloc(ULONG cbMin, ULONG *pcbBlock);
+    void Free(void *pv, ULONG cbBlock);
+
+  private:
+    struct FreeBlock {
+        FreeBlock *m_pNext;
+    };
+
+    static int ClassFromSize(ULONG cb);
+
+    FreeBlock        *m_freeLists[NUM_BLOCK_CLASSES];
+    long              m_freeCounts[NUM_BLOCK_CLASSES];
+    long              m_maxFreePerClass;
+    CRITICAL_SECTION  m_cs;
+};
+
+// ============================================================================
+// CLASS: CPooledBuffer
+//
+//      Growable byte buffer whose storage comes from g_bufferPool.  The
+//      block is kept between uses until Free() is called.
+
+class CPooledBuffer
+{
+  public:
+    CPooledBuffer() : m_pb(NULL), m_cb(0), m_cbBlock(0) {}
+    ~CPooledBuffer() { Free(); }
+
+    HRESULT Append(const void *pv, ULONG cb);
+
+    // Append cch UTF-16 characters encoded as UTF-8.  A surrogate
+    // without its other half is encoded on its own.
+    HRESULT AppendUTF8(const wchar_t *pwch, ULONG cch);
+
+    // Write the contents to pStream in one call and empty the buffer.
+    HRESULT WriteTo(IStream *pStream);
+
+    // Make room for at least cb bytes in all, keeping the contents.
+    HRESULT Reserve(ULONG cb) {
+        return (cb > m_cbBlock) ? Grow(cb) : S_OK;
+    }
+
+    // Discard the contents, keeping the block.
+    void Empty() { m_cb = 0; }
+
+    // Discard the contents and give the block back to the pool.
+    void Free();
+
+    ULONG GetSize() const { return m_cb; }
+    BYTE *GetData() const { return m_pb; }
+
+  private:
+    HRESULT Grow(ULONG cbMin);
+
+    BYTE  *m_pb;
+    ULONG  m_cb;
+    ULONG  m_cbBlock;
+};
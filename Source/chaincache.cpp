@@ -0,0 +1,394 @@
+//+---------------------------------------------------------------------------
+//
+//  Copyright (C) Microsoft Corporation, 1999-2000.
+//
+//  File:       chaincache.cpp
+//
+//  Contents:   Implementation of CChainCache which is a cache of the
+//              intermediate documents produced while applying a chain
+//              of stylesheets.
+//----------------------------------------------------------------------------
+#include "StdAfx.h"
+
+/////////////////////////////////////////
+// CChainCacheEntry
+/////////////////////////////////////////
+
+class CChainCacheEntry : public IUnknown
+{
+  public:
+    CChainCacheEntry(IXMLDOMDocument *pDOM) {
+        m_ref = 1;
+        m_pDOM = pDOM;
+        SAFEADDREF(m_pDOM);
+        m_lastUsed = ::GetTickCount();
+    }
+
+    ~CChainCacheEntry() {
+        SAFERELEASE(m_pDOM);
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(
+        /* [in] */ REFIID /*riid*/,
+        /* [iid_is][out] */ void __RPC_FAR *__RPC_FAR * /*ppvObject*/) {
+        return E_NOTIMPL;
+    }
+
+    // Entries are released outside of the table lock, so the
+    // reference count must be maintained atomically.
+    virtual ULONG STDMETHODCALLTYPE AddRef(void) {
+        return InterlockedIncrement(&m_ref);
+    }
+
+    virtual ULONG STDMETHODCALLTYPE Release(void) {
+        long result = InterlockedDecrement(&m_ref);
+        if (result == 0)
+            delete this;
+        return result;
+    }
+
+  private:
+    friend class CChainCache;
+
+    long                    m_ref;
+    IXMLDOMDocument        *m_pDOM;
+    DWORD                   m_lastUsed;
+};
+
+/////////////////////////////////////////
+// CChainCache
+/////////////////////////////////////////
+
+CChainCache::CChainCache(long minutes, long maxEntries)
+{
+    InitializeCriticalSection(&m_cs);
+    SetMinutes(minutes);
+    m_maxEntries = maxEntries;
+    m_table.init(17,0.8,1.5);
+    m_lastCleanup = ::GetTickCount();
+    m_lastRecordedTime = ::GetTickCount();
+    ::memset(m_hits, 0, sizeof(m_hits));
+    ::memset(m_misses, 0, sizeof(m_misses));
+}
+
+CChainCache::~CChainCache()
+{
+    DeleteCriticalSection(&m_cs);
+}
+
+HRESULT
+CChainCache::SetMinutes(long minutes)
+{
+    Enter();
+    if (minutes == 0) {
+        m_bCacheDisabled = true;
+        m_table.clear();
+    } else {
+        m_bCacheDisabled = false;
+        m_ticksBeforeDispose = minutes * 60 * 1000;
+    }
+    Leave();
+    return S_OK;
+}
+
+HRESULT
+CChainCache::SetMaxEntries(long maxEntries)
+{
+    Enter();
+    m_maxEntries = maxEntries < 0 ? 0 : maxEntries;
+    while (m_table.getCount() > m_maxEntries) {
+        long count = m_table.getCount();
+
+        EvictOldest();
+        if (m_table.getCount() >= count) {
+            break;
+        }
+    }
+    Leave();
+    return S_OK;
+}
+
+// CChainCache::AppendToKey
+//     Append "path*version|" for one document of the chain to the
+//     key.  Versions are the last write time, size and includes, as
+//     in CXmlCache; an all-zero version means it's unknown.
+
+HRESULT
+CChainCache::AppendToKey(CComBSTR & bstrKey,             // [in/out] key being built
+                         BSTR bstrPath,                  // [in] full path of document
+                         const XmlCacheInfo & info)      // [in] version of document
+{
+    HRESULT hr;
+    wchar_t wszVersion[48];
+
+    if (bstrPath == NULL ||
+        (info.ftLastWrite.dwHighDateTime == 0 &&
+         info.ftLastWrite.dwLowDateTime == 0 &&
+         info.nFileSize == 0)) {
+        RETURNERR(S_FALSE);
+    }
+
+    wsprintf(wszVersion,
+             L"*%08lx%08lx.%lx.%lx|",
+             info.ftLastWrite.dwHighDateTime,
+             info.ftLastWrite.dwLowDateTime,
+             info.nFileSize,
+             info.dwIncludes);
+
+    hr = bstrKey.Append(bstrPath);
+    HRCHECK(FAILED(hr));
+
+    hr = bstrKey.Append(wszVersion);
+    HRCHECK(FAILED(hr));
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// CChainCache::KeyToMultiByte
+//     Keys are stored as UTF-8 rather than through WideToAscii, since
+//     two paths that differ only in characters outside the ANSI code
+//     page must never share an intermediate result.  Caller is
+//     responsible for calling 'delete[]'.
+
+char *
+CChainCache::KeyToMultiByte(BSTR bstrKey)
+{
+    int len = ::WideCharToMultiByte(CP_UTF8, 0, bstrKey, -1, NULL, 0, 0, 0);
+    char* psz = new char[len+1];
+    if (psz) {
+        ::WideCharToMultiByte(CP_UTF8, 0, bstrKey, -1, psz, len, 0, 0);
+        psz[len] = 0;
+    }
+    return psz;
+}
+
+// CChainCache::Lookup
+//     Lookup the result of a chain prefix.  Outgoing pointer is
+//     addref'd.  Returns S_FALSE if it's not in the cache.
+
+HRESULT
+CChainCache::Lookup(BSTR bstrKey,                    // [in] key for the chain prefix
+                    short stage,                     // [in] index of last stylesheet in prefix
+                    IXMLDOMDocument **ppDOMResult)   // [out] result, AddRef'd
+{
+    HRESULT           hr;
+    CChainCacheEntry *entry = NULL;
+    char             *pszKey = NULL;
+
+    ASSERT(stage >= 0 && stage < MAX_SHEETS_TO_CHAIN);
+
+    *ppDOMResult = NULL;
+
+    if (!IsEnabled()) {
+        RETURNERR(S_FALSE);
+    }
+
+    CleanupCache();
+
+    pszKey = KeyToMultiByte(bstrKey);
+    ERRCHECK(pszKey == NULL, E_OUTOFMEMORY);
+
+    Enter(); // lock table for lookup
+    entry = (CChainCacheEntry*)m_table.find(pszKey);
+    if (entry) {
+        entry->m_lastUsed = ::GetTickCount();
+    }
+    Leave();
+
+    if (!entry) {
+        InterlockedIncrement(&m_misses[stage]);
+        RETURNERR(S_FALSE);
+    }
+
+    InterlockedIncrement(&m_hits[stage]);
+
+    *ppDOMResult = entry->m_pDOM;
+    (*ppDOMResult)->AddRef();
+
+    hr = S_OK;
+  Error:
+    delete [] pszKey;
+    SAFERELEASE(entry);
+    return hr;
+}
+
+// CChainCache::Add
+//     Add the result of a chain prefix to the cache, making room for
+//     it if the cache is full.
+
+HRESULT
+CChainCache::Add(BSTR bstrKey,                       // [in] key for the chain prefix
+                 IXMLDOMDocument *pDOM)              // [in] transform result
+{
+    HRESULT           hr;
+    CChainCacheEntry *entry = NULL;
+    IUnknown         *pExisting = NULL;
+    char             *pszKey = NULL;
+    bool              bAdded;
+
+    ASSERT(pDOM != NULL);
+
+    if (!IsEnabled()) {
+        RETURNERR(S_FALSE);
+    }
+
+    pszKey = KeyToMultiByte(bstrKey);
+    ERRCHECK(pszKey == NULL, E_OUTOFMEMORY);
+
+    entry = new CChainCacheEntry(pDOM);
+    ERRCHECK(entry == NULL, E_OUTOFMEMORY);
+
+    // Need to lock the table while we update it.  If another request
+    // got here first, the newer result simply replaces it.  The bound
+    // may have been lowered (even to 0) since IsEnabled was checked,
+    // and if nothing could be evicted there's no point trying again.
+    Enter();
+    pExisting = m_table.find(pszKey);
+    while (pExisting == NULL &&
+           m_maxEntries > 0 &&
+           m_table.getCount() >= m_maxEntries) {
+        long count = m_table.getCount();
+
+        EvictOldest();
+        if (m_table.getCount() >= count) {
+            break;
+        }
+    }
+    bAdded = (m_maxEntries <= 0) || m_table.add(pszKey, entry);
+    Leave();
+    ERRCHECK(!bAdded, E_OUTOFMEMORY);
+
+    hr = S_OK;
+  Error:
+    delete [] pszKey;
+    SAFERELEASE(pExisting);
+    SAFERELEASE(entry); // the table holds its own reference
+    return hr;
+}
+
+// CChainCache::AppendStatistics
+//     Appends an XML fragment of the form
+//       <chain-cache entries="n">
+//         <stage index="i" hits="h" misses="m"/>...
+//       </chain-cache>
+//     Stages that have never been looked up are omitted.
+
+HRESULT
+CChainCache::AppendStatistics(CComBSTR & bstrStats)
+{
+    HRESULT hr;
+    wchar_t wszBuffer[128];
+    long    count;
+
+    Enter();
+    count = m_table.getCount();
+    Leave();
+
+    wsprintf(wszBuffer, L"<chain-cache entries=\"%ld\" max-entries=\"%ld\">",
+             count, m_maxEntries);
+    hr = bstrStats.Append(wszBuffer);
+    HRCHECK(FAILED(hr));
+
+    for (int stage = 0; stage < MAX_SHEETS_TO_CHAIN; stage++) {
+        LONG hits = m_hits[stage];
+        LONG misses = m_misses[stage];
+
+        if (hits || misses) {
+            wsprintf(wszBuffer, L"<stage index=\"%d\" hits=\"%ld\" misses=\"%ld\"/>",
+                     stage, hits, misses);
+            hr = bstrStats.Append(wszBuffer);
+            HRCHECK(FAILED(hr));
+        }
+    }
+
+    hr = bstrStats.Append(L"</chain-cache>");
+    HRCHECK(FAILED(hr));
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+void
+CChainCache::ClearCache()
+{
+    // Need to lock the table while we update it.
+    Enter();
+    m_table.clear();
+    Leave();
+}
+
+// CChainCache::EvictOldest
+//     Remove the least recently used entry.  Table must be locked.
+
+void
+CChainCache::EvictOldest()
+{
+    DWORD      now = ::GetTickCount();
+    HashEntry *oldest = NULL;
+    DWORD      oldestAge = 0;
+    long       size = m_table.getCapacity();
+
+    for (long i = 0; i < size; i++)
+    {
+        for (HashEntry* e = m_table.get(i); e; e = e->m_pNext)
+        {
+            CChainCacheEntry* cache = (CChainCacheEntry*)e->m_pUnk;
+            if (!oldest || (now - cache->m_lastUsed) >= oldestAge)
+            {
+                oldest = e;
+                oldestAge = now - cache->m_lastUsed;
+            }
+        }
+    }
+
+    if (oldest) {
+        m_table.remove(oldest->m_szKey);
+    }
+}
+
+void
+CChainCache::CleanupCache()
+{
+    DWORD now = ::GetTickCount();
+    DWORD lastTime = m_lastRecordedTime;
+    m_lastRecordedTime = now;
+    if (now < lastTime) {
+        // We've wrapped around (happens after ~50 days).  Clear out
+        // the cache, since lastUsed times are now meaningless.
+        this->ClearCache();
+    }
+
+    // If we haven't done a cleanup since m_ticksBeforeDispose ago
+    // then do one and throw away any results that haven't been used
+    // since m_ticksBeforeDispose ago.
+    if ((now - m_lastCleanup) > m_ticksBeforeDispose)
+    {
+        // Need to lock the table while we update it.
+        Enter();
+
+        // time to do a cleanup sweep.
+        long size = m_table.getCapacity();
+        for (long i = 0; i < size; i++)
+        {
+            HashEntry* e = m_table.get(i);
+            // walk the bucket list.
+            while (e)
+            {
+                HashEntry* next = e->m_pNext;
+                CChainCacheEntry* cache = (CChainCacheEntry*)e->m_pUnk;
+                if ((now - cache->m_lastUsed) >= m_ticksBeforeDispose)
+                {
+                    m_table.remove(e->m_szKey);
+                }
+                e = next;
+            }
+        }
+        m_lastCleanup = now;
+
+        Leave();
+    }
+
+}
@@ -0,0 +1,80 @@
+//+---------------------------------------------------------------------------
+//
+//  Copyright (C) Microsoft Corporation, 1999-2000
+//
+//  File:       chaincache.h
+//
+//  Contents:   Defines CChainCache which is a cache of the intermediate
+//              documents produced while applying a chain of stylesheets.
+//              Entries are keyed by the version of the source document
+//              and of each stylesheet applied so far, so requests whose
+//              chains share a prefix only need to run the remaining
+//              stylesheets.  Uses the same Least Recently Used cleanup
+//              as CXmlCache, plus an upper bound on the number of entries.
+//----------------------------------------------------------------------------
+
+#pragma once
+
+#include "hashtable.h"
+
+class CChainCache
+{
+  public:
+    CChainCache(long minutes, long maxEntries);
+    ~CChainCache();
+
+    HRESULT SetMinutes(long minutes);
+    HRESULT SetMaxEntries(long maxEntries);
+
+    bool IsEnabled() const {
+        return !m_bCacheDisabled && m_maxEntries > 0;
+    }
+
+    // Append the key component for one document (the source, or a
+    // stylesheet) to bstrKey.  Returns S_FALSE, leaving bstrKey
+    // untouched, when the version is unknown and the chain therefore
+    // can't be cached from this point on.
+    static HRESULT AppendToKey(CComBSTR & bstrKey,              // [in/out] key being built
+                               BSTR bstrPath,                   // [in] full path of document
+                               const XmlCacheInfo & info);      // [in] version of document
+
+    // Lookup the result of applying stylesheets 0..stage of a chain.
+    // Returns S_FALSE (and a NULL document) when it's not cached.
+    // Outgoing pointer is addref'd; the document is shared with other
+    // requests and must only be used as transform input.
+    HRESULT Lookup(BSTR bstrKey,                    // [in] key for the chain prefix
+                   short stage,                     // [in] index of last stylesheet in prefix
+                   IXMLDOMDocument **ppDOMResult);  // [out] result, AddRef'd
+
+    // Remember the result of applying stylesheets 0..stage.  The
+    // document must not be modified once it's been added.
+    HRESULT Add(BSTR bstrKey,                       // [in] key for the chain prefix
+                IXMLDOMDocument *pDOM);             // [in] transform result
+
+    // Append <chain-cache> statistics, with hit/miss counts for each
+    // chain stage, to bstrStats.
+    HRESULT AppendStatistics(CComBSTR & bstrStats);
+
+  private:
+    void ClearCache();
+    void CleanupCache();
+    void EvictOldest();
+    static char *KeyToMultiByte(BSTR bstrKey);
+    void Enter() {
+        EnterCriticalSection(&m_cs);
+    }
+
+    void Leave() {
+        LeaveCriticalSection(&m_cs);
+    }
+
+    HashTable        m_table;
+    DWORD            m_ticksBeforeDispose;
+    DWORD            m_lastCleanup;
+    DWORD            m_lastRecordedTime;
+    long             m_maxEntries;
+    bool             m_bCacheDisabled;
+    LONG             m_hits[MAX_SHEETS_TO_CHAIN];
+    LONG             m_misses[MAX_SHEETS_TO_CHAIN];
+    CRITICAL_SECTION m_cs; // need to lock cache on updates.
+};
@@ -8,6 +8,23 @@
 #include "StdAfx.h"
 #include "charset.h"
 
+// ASCII is encoded sixteen characters at a time, and big-endian UTF-16
+// byte swapped eight at a time, with SSE2 where the compiler has it (VC6
+// needs the processor pack).
+#if defined(_M_X64) || (defined(_M_IX86) && _MSC_FULL_VER >= 12008804)
+#define CHARSET_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifndef PF_XMMI64_INSTRUCTIONS_AVAILABLE
+#define PF_XMMI64_INSTRUCTIONS_AVAILABLE 10
+#endif
+
+#ifdef CHARSET_SSE2
+static const bool g_bCharsetSSE2 =
+    IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE) != FALSE;
+#endif
+
 //
 // We handle Windows code pages using NLS functions.  This table provides a
 // mapping from charset string to windows code page, where the charset strings
@@ -208,17 +225,340 @@ uiCodePageFromCharset(LPCWSTR pwszCharset)
 }
 
 
+// ============================================================================
+// fStatefulCodePage
+//      Whether the encoder of a code page keeps state from one character
+//      to the next: UTF-7 and its base64 runs, the ISO-2022 and HZ
+//      escapes, the shifts of ISCII and of the EBCDIC double-byte code
+//      pages.  Text cut in two and encoded a piece at a time comes out
+//      different for these (each piece closes its run or shifts back),
+//      so it has to be encoded in one go.
+
+BOOL
+fStatefulCodePage(UINT uiCP)
+{
+    switch (uiCP)
+    {
+    case CP_UTF7:
+    case 50220: case 50221: case 50222:     // ISO-2022-JP
+    case 50225:                             // ISO-2022-KR
+    case 50227: case 50229:                 // ISO-2022-CN
+    case 52936:                             // HZ-GB2312
+    case 50930: case 50931: case 50933:     // EBCDIC DBCS
+    case 50935: case 50936: case 50937:
+    case 50939:
+        return TRUE;
+    }
+    return (uiCP >= 57002 && uiCP <= 57011); // ISCII
+}
+
 // ============================================================================
 // vLittleEndianToBigEndian
 //      Convert Unicode string from Little-Endian format to Big-Endian format.
-//      Assume the caller provides a sufficient return buffer
+//      Assume the caller provides a sufficient return buffer, which may be
+//      the string itself.  With SSE2, eight characters are swapped at a
+//      time.
 
 void
 vLittleEndianToBigEndian(LPCWSTR pwszLittleEndian, UINT cch, BYTE *pbBigEndian)
 {
+#ifdef CHARSET_SSE2
+    if (g_bCharsetSSE2)
+    {
+        for (; cch >= 8; cch -= 8)
+        {
+            __m128i xmm = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pwszLittleEndian));
+
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(pbBigEndian),
+                             _mm_or_si128(_mm_slli_epi16(xmm, 8),
+                                          _mm_srli_epi16(xmm, 8)));
+            pwszLittleEndian += 8;
+            pbBigEndian += 16;
+        }
+    }
+#endif
+
     for (UINT i = cch; i > 0; i--)
     {
-        *pbBigEndian++ = static_cast<BYTE> ((*pwszLittleEndian) >> 8);
-        *pbBigEndian++ = static_cast<BYTE> ((*pwszLittleEndian++) & 0xFF);
+        WCHAR wch = *pwszLittleEndian++;
+
+        *pbBigEndian++ = static_cast<BYTE> (wch >> 8);
+        *pbBigEndian++ = static_cast<BYTE> (wch & 0xFF);
+    }
+}
+
+
+// ============================================================================
+// cbUTF16ToUTF8
+//      Convert UTF-16 to UTF-8 in one pass, for output.  The caller
+//      provides CB_UTF8_PER_UTF16_MAX bytes per character, which is
+//      enough for anything (a surrogate pair takes four bytes for two
+//      characters).  A surrogate without its other half is encoded on
+//      its own, so split pairs must be kept together by the caller.
+//
+//      Runs of ASCII are the bulk of most pages, and are narrowed
+//      sixteen characters at a time with SSE2; anything else, and the
+//      block of sixteen it's in, is encoded a character at a time.
+//
+//      Returns the number of bytes written.
+
+ULONG
+cbUTF16ToUTF8(LPCWSTR pwch, ULONG cch, BYTE *pbUTF8)
+{
+    LPCWSTR  pwchEnd = pwch + cch;
+    LPCWSTR  pwchBlockEnd;
+    BYTE    *pb = pbUTF8;
+    ULONG    wc;
+
+    while (pwch < pwchEnd)
+    {
+#ifdef CHARSET_SSE2
+        if (g_bCharsetSSE2)
+        {
+            const __m128i xmmNonASCII = _mm_set1_epi16(static_cast<short>(0xFF80));
+            const __m128i xmmZero = _mm_setzero_si128();
+
+            while (pwchEnd - pwch >= 16)
+            {
+                __m128i xmmLow = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pwch));
+                __m128i xmmHigh = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pwch + 8));
+                __m128i xmmBits = _mm_and_si128(_mm_or_si128(xmmLow, xmmHigh), xmmNonASCII);
+
+                if (_mm_movemask_epi8(_mm_cmpeq_epi16(xmmBits, xmmZero)) != 0xFFFF)
+                {
+                    break;
+                }
+
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(pb),
+                                 _mm_packus_epi16(xmmLow, xmmHigh));
+                pwch += 16;
+                pb += 16;
+            }
+        }
+#endif
+
+        pwchBlockEnd = (pwchEnd - pwch > 16) ? pwch + 16 : pwchEnd;
+        while (pwch < pwchBlockEnd)
+        {
+            wc = *pwch++;
+            if (wc < 0x80)
+            {
+                *pb++ = static_cast<BYTE>(wc);
+            }
+            else if (wc < 0x800)
+            {
+                *pb++ = static_cast<BYTE>(0xC0 | (wc >> 6));
+                *pb++ = static_cast<BYTE>(0x80 | (wc & 0x3F));
+            }
+            else if (wc >= 0xD800 && wc < 0xDC00 &&
+                     pwch < pwchEnd && *pwch >= 0xDC00 && *pwch < 0xE000)
+            {
+                wc = 0x10000 + ((wc - 0xD800) << 10) + (*pwch++ - 0xDC00);
+                *pb++ = static_cast<BYTE>(0xF0 | (wc >> 18));
+                *pb++ = static_cast<BYTE>(0x80 | ((wc >> 12) & 0x3F));
+                *pb++ = static_cast<BYTE>(0x80 | ((wc >> 6) & 0x3F));
+                *pb++ = static_cast<BYTE>(0x80 | (wc & 0x3F));
+            }
+            else
+            {
+                *pb++ = static_cast<BYTE>(0xE0 | (wc >> 12));
+                *pb++ = static_cast<BYTE>(0x80 | ((wc >> 6) & 0x3F));
+                *pb++ = static_cast<BYTE>(0x80 | (wc & 0x3F));
+            }
+        }
+    }
+
+    return static_cast<ULONG>(pb - pbUTF8);
+}
+
+
+// ============================================================================
+// CSingleByteEncoder::CSingleByteEncoder
+
+CSingleByteEncoder::CSingleByteEncoder(UINT uiCP)   // [in] code page
+{
+    m_uiCP = uiCP;
+    m_pbPages = NULL;
+    ::memset(m_apbPages, 0, sizeof(m_apbPages));
+}
+
+CSingleByteEncoder::~CSingleByteEncoder()
+{
+    delete [] m_pbPages;
+}
+
+// ============================================================================
+// CSingleByteEncoder::Init
+//      Has WideCharToMultiByte encode the whole BMP at once, then keeps
+//      the distinct pages of the result.  Surrogates are left out (see
+//      Encode).
+
+HRESULT
+CSingleByteEncoder::Init()
+{
+    HRESULT  hr;
+    CPINFO   cpInfo;
+    WCHAR   *pwchAll = NULL;
+    BYTE    *pbAll = NULL;
+    int      aiPage[256];
+    int      numPages = 0;
+    int      iPage;
+    int      i;
+
+    if (!GetCPInfo(m_uiCP, &cpInfo) || cpInfo.MaxCharSize != 1) {
+        RETURNERR(S_FALSE);
+    }
+
+    pwchAll = new WCHAR[0x10000];
+    pbAll = new BYTE[0x10000];
+    ERRCHECK(pwchAll == NULL || pbAll == NULL, E_OUTOFMEMORY);
+
+    for (i = 0; i < 0x10000; i++) {
+        pwchAll[i] = (i >= 0xD800 && i < 0xE000) ? 0 : static_cast<WCHAR>(i);
+    }
+
+    if (WideCharToMultiByte(m_uiCP, 0, pwchAll, 0x10000,
+                            reinterpret_cast<LPSTR>(pbAll), 0x10000,
+                            NULL, NULL) != 0x10000) {
+        RETURNERR(S_FALSE);
+    }
+
+    for (iPage = 0; iPage < 256; iPage++) {
+        for (i = 0; i < numPages; i++) {
+            if (::memcmp(pbAll + aiPage[i] * 256, pbAll + iPage * 256, 256) == 0) {
+                break;
+            }
+        }
+        if (i == numPages) {
+            aiPage[numPages++] = iPage;
+        }
+    }
+
+    m_pbPages = new BYTE[numPages * 256];
+    ERRCHECK(m_pbPages == NULL, E_OUTOFMEMORY);
+
+    for (i = 0; i < numPages; i++) {
+        ::memcpy(m_pbPages + i * 256, pbAll + aiPage[i] * 256, 256);
+    }
+
+    for (iPage = 0; iPage < 256; iPage++) {
+        for (i = 0; i < numPages; i++) {
+            if (::memcmp(m_pbPages + i * 256, pbAll + iPage * 256, 256) == 0) {
+                m_apbPages[iPage] = m_pbPages + i * 256;
+                break;
+            }
+        }
+    }
+
+   #ifdef _DEBUG
+    // Every byte the code page decodes must encode back to itself.
+    {
+        char  ach[256];
+        WCHAR awch[256];
+
+        for (i = 0; i < 256; i++) {
+            ach[i] = static_cast<char>(i);
+        }
+        ASSERT(MultiByteToWideChar(m_uiCP, 0, ach, 256, awch, 256) == 256);
+        for (i = 0; i < 256; i++) {
+            ASSERT(m_apbPages[awch[i] >> 8][awch[i] & 0xFF] == i);
+        }
+    }
+   #endif
+
+    hr = S_OK;
+  Error:
+    delete [] pwchAll;
+    delete [] pbAll;
+    return hr;
+}
+
+// ============================================================================
+// CSingleByteEncoder::Encode
+//      One lookup per character, with no branches on it: surrogates are
+//      only noted, and checked for at the end.
+
+bool
+CSingleByteEncoder::Encode(
+    LPCWSTR pwch,                           // [in] characters to encode
+    ULONG cch,                              // [in] how many
+    BYTE *pb) const                         // [out] cch bytes
+{
+    const BYTE *const *apbPages = m_apbPages;
+    UINT uSurrogates = 0;
+    ULONG i;
+
+    for (i = 0; i < cch; i++) {
+        UINT wc = pwch[i];
+
+        pb[i] = apbPages[wc >> 8][wc & 0xFF];
+        uSurrogates |= ((wc & 0xF800) == 0xD800);
+    }
+
+    return uSurrogates == 0;
+}
+
+// ============================================================================
+// CSingleByteEncoderCache::CSingleByteEncoderCache
+
+CSingleByteEncoderCache::CSingleByteEncoderCache()
+{
+    InitializeCriticalSection(&m_cs);
+    m_numEntries = 0;
+}
+
+CSingleByteEncoderCache::~CSingleByteEncoderCache()
+{
+    for (long i = 0; i < m_numEntries; i++) {
+        delete m_entries[i].m_pEncoder;
     }
+    DeleteCriticalSection(&m_cs);
+}
+
+// ============================================================================
+// CSingleByteEncoderCache::Get
+
+const CSingleByteEncoder *
+CSingleByteEncoderCache::Get(UINT uiCP)     // [in] code page of output
+{
+    CSingleByteEncoder *pEncoder = NULL;
+    HRESULT hr;
+    long i;
+
+    EnterCriticalSection(&m_cs);
+
+    for (i = 0; i < m_numEntries; i++) {
+        if (m_entries[i].m_uiCP == uiCP) {
+            pEncoder = m_entries[i].m_pEncoder;
+            goto Done;
+        }
+    }
+
+    if (m_numEntries == MAX_CODE_PAGES) {
+        goto Done;
+    }
+
+    pEncoder = new CSingleByteEncoder(uiCP);
+    if (pEncoder == NULL) {
+        goto Done;
+    }
+
+    // Not remembered if it failed for want of memory, so that it's
+    // tried again.
+    hr = pEncoder->Init();
+    if (hr != S_OK) {
+        delete pEncoder;
+        pEncoder = NULL;
+        if (FAILED(hr)) {
+            goto Done;
+        }
+    }
+
+    m_entries[m_numEntries].m_uiCP = uiCP;
+    m_entries[m_numEntries].m_pEncoder = pEncoder;
+    m_numEntries++;
+
+  Done:
+    LeaveCriticalSection(&m_cs);
+    return pEncoder;
 }
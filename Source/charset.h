@@ -13,6 +13,80 @@ const UINT CP_UTF16FFFE = 1201;  // Big Endian
 
 extern UINT uiCodePageFromCharset(LPCWSTR pwszCharset);
 
+extern BOOL fStatefulCodePage(UINT uiCP);
+
 extern void vLittleEndianToBigEndian(LPCWSTR pwszLittleEndian,
                                      UINT cch,
                                      BYTE *pbBigEndian);
+
+// Largest number of UTF-8 bytes cbUTF16ToUTF8 writes per UTF-16 character.
+const UINT CB_UTF8_PER_UTF16_MAX = 3;
+
+extern ULONG cbUTF16ToUTF8(LPCWSTR pwch,
+                           ULONG cch,
+                           BYTE *pbUTF8);
+
+// ============================================================================
+// CLASS: CSingleByteEncoder
+//
+//      UTF-16 to one single-byte code page (Windows-125x and the like),
+//      by table lookup.  The table is what WideCharToMultiByte gives for
+//      every character of the BMP, so the output is the same as its,
+//      best-fit mappings and default character included.  It's kept as
+//      256 pages of 256 bytes, pages that are the same shared, so most
+//      code pages take a few KB.
+
+class CSingleByteEncoder
+{
+  public:
+    CSingleByteEncoder(UINT uiCP);
+    ~CSingleByteEncoder();
+
+    // Build the table.  S_FALSE if the code page isn't single-byte.
+    HRESULT Init();
+
+    UINT GetCodePage() const {
+        return m_uiCP;
+    }
+
+    // Encode cch characters into cch bytes.  Returns false, having
+    // written something undefined, if the text has surrogates, which
+    // WideCharToMultiByte encodes as pairs and so must be left to it.
+    bool Encode(LPCWSTR pwch, ULONG cch, BYTE *pb) const;
+
+  private:
+    UINT         m_uiCP;
+    const BYTE  *m_apbPages[256];           // by high byte of character
+    BYTE        *m_pbPages;                 // the distinct pages
+};
+
+// ============================================================================
+// CLASS: CSingleByteEncoderCache
+//
+//      The encoders of the single-byte code pages output has been asked
+//      for, built on first use and kept until the DLL is unloaded.  Code
+//      pages that aren't single-byte are remembered too, so they're only
+//      looked at once.
+
+class CSingleByteEncoderCache
+{
+  public:
+    enum { MAX_CODE_PAGES = 64 };
+
+    CSingleByteEncoderCache();
+    ~CSingleByteEncoderCache();
+
+    // The encoder for uiCP, or NULL if it isn't single-byte (or there's
+    // no memory for it), in which case WideCharToMultiByte is used.
+    const CSingleByteEncoder * Get(UINT uiCP);
+
+  private:
+    struct Entry {
+        UINT                 m_uiCP;
+        CSingleByteEncoder  *m_pEncoder;    // NULL if not single-byte
+    };
+
+    Entry             m_entries[MAX_CODE_PAGES];
+    long              m_numEntries;
+    CRITICAL_SECTION  m_cs;
+};
@@ -0,0 +1,588 @@
+// ============================================================================
+// FILE: deflate.cpp
+//
+//      Implementation of the streaming deflate compressor.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#include "StdAfx.h"
+
+// ============================================================================
+// Deflate tables (RFC 1951, section 3.2.5)
+
+static const WORD g_lengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const BYTE g_lengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const WORD g_distBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
+
+static const BYTE g_distExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+const WORD END_OF_BLOCK = 256;
+
+// ============================================================================
+// CLASS: CDeflateTables
+//      Lookup tables derived from the ones above, built once when the DLL
+//      is loaded.  Huffman codes are stored bit-reversed, since deflate
+//      packs them starting from the most significant bit.
+
+class CDeflateTables
+{
+  public:
+    CDeflateTables();
+
+    static DWORD Reverse(DWORD code, int nBits);
+
+    WORD   m_litCode[288];          // fixed literal/length codes
+    BYTE   m_litBits[288];
+    WORD   m_distCode[30];          // fixed distance codes (5 bits)
+    BYTE   m_lengthSym[259];        // match length -> length code - 257
+    BYTE   m_distSym[512];          // see DistanceSymbol()
+    DWORD  m_crc[256];
+
+    // Distance code for a distance of dist + 1, as zlib does it: the
+    // first 256 entries are indexed directly, the rest by dist / 128.
+    UINT DistanceSymbol(ULONG dist) const {
+        return (dist < 256) ? m_distSym[dist] : m_distSym[256 + (dist >> 7)];
+    }
+};
+
+static CDeflateTables g_deflateTables;
+
+CDeflateTables::CDeflateTables()
+{
+    UINT i;
+    UINT j;
+
+    // Fixed Huffman code lengths (RFC 1951, 3.2.6).
+    for (i = 0; i < 288; i++) {
+        DWORD code;
+        int   nBits;
+
+        if (i < 144) {
+            code = 0x30 + i;
+            nBits = 8;
+        } else if (i < 256) {
+            code = 0x190 + (i - 144);
+            nBits = 9;
+        } else if (i < 280) {
+            code = i - 256;
+            nBits = 7;
+        } else {
+            code = 0xC0 + (i - 280);
+            nBits = 8;
+        }
+        m_litCode[i] = static_cast<WORD>(Reverse(code, nBits));
+        m_litBits[i] = static_cast<BYTE>(nBits);
+    }
+
+    for (i = 0; i < 30; i++) {
+        m_distCode[i] = static_cast<WORD>(Reverse(i, 5));
+    }
+
+    for (i = 0; i < 28; i++) {
+        for (j = 0; j < (1U << g_lengthExtra[i]); j++) {
+            m_lengthSym[g_lengthBase[i] + j] = static_cast<BYTE>(i);
+        }
+    }
+    // 258 has a code of its own, rather than being 227 + 31.
+    m_lengthSym[258] = 28;
+
+    for (i = 0; i < 30; i++) {
+        for (j = 0; j < (1U << g_distExtra[i]); j++) {
+            ULONG dist = g_distBase[i] - 1 + j;
+
+            if (dist < 256) {
+                m_distSym[dist] = static_cast<BYTE>(i);
+            } else {
+                m_distSym[256 + (dist >> 7)] = static_cast<BYTE>(i);
+            }
+        }
+    }
+
+    for (i = 0; i < 256; i++) {
+        DWORD c = i;
+
+        for (j = 0; j < 8; j++) {
+            c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+        }
+        m_crc[i] = c;
+    }
+}
+
+DWORD
+CDeflateTables::Reverse(DWORD code, int nBits)
+{
+    DWORD result = 0;
+
+    while (nBits-- > 0) {
+        result = (result << 1) | (code & 1);
+        code >>= 1;
+    }
+    return result;
+}
+
+// ============================================================================
+// CDeflater::CDeflater
+
+CDeflater::CDeflater()
+{
+    m_format = FORMAT_GZIP;
+    m_bInitialized = false;
+    m_bFinished = false;
+    m_hrLast = S_OK;
+    m_pWindow = NULL;
+    m_cbWindowBlock = 0;
+    m_pHead = NULL;
+    m_cbHeadBlock = 0;
+    m_pPrev = NULL;
+    m_cbPrevBlock = 0;
+    m_strStart = 0;
+    m_lookahead = 0;
+    m_bitBuffer = 0;
+    m_nBits = 0;
+    m_cbStage = 0;
+    m_crc = 0xFFFFFFFF;
+    m_adlerA = 1;
+    m_adlerB = 0;
+    m_cbTotalIn = 0;
+}
+
+// ============================================================================
+// CDeflater::~CDeflater
+
+CDeflater::~CDeflater()
+{
+    if (m_pWindow) {
+        g_bufferPool->Free(m_pWindow, m_cbWindowBlock);
+    }
+    if (m_pHead) {
+        g_bufferPool->Free(m_pHead, m_cbHeadBlock);
+    }
+    if (m_pPrev) {
+        g_bufferPool->Free(m_pPrev, m_cbPrevBlock);
+    }
+}
+
+// ============================================================================
+// CDeflater::Init
+//      Get the window and hash tables (from the buffer pool, since a
+//      compressor is needed for every compressed response), and start the
+//      stream with the container header and the header of the one
+//      fixed-Huffman block.
+
+HRESULT
+CDeflater::Init(Format format)              // [in] container to write
+{
+    HRESULT hr;
+
+    ASSERT(!m_bInitialized);
+
+    m_format = format;
+
+    m_pWindow = static_cast<BYTE*>(
+        g_bufferPool->Alloc(2 * WINDOW_SIZE, &m_cbWindowBlock));
+    ERRCHECK(m_pWindow == NULL, E_OUTOFMEMORY);
+
+    m_pHead = static_cast<WORD*>(
+        g_bufferPool->Alloc(HASH_SIZE * sizeof(WORD), &m_cbHeadBlock));
+    ERRCHECK(m_pHead == NULL, E_OUTOFMEMORY);
+
+    m_pPrev = static_cast<WORD*>(
+        g_bufferPool->Alloc(WINDOW_SIZE * sizeof(WORD), &m_cbPrevBlock));
+    ERRCHECK(m_pPrev == NULL, E_OUTOFMEMORY);
+
+    // Position 0 doubles as "no previous string", so only the head
+    // table needs clearing; m_pPrev is always written before it's read.
+    ::memset(m_pHead, 0, HASH_SIZE * sizeof(WORD));
+
+    if (m_format == FORMAT_GZIP) {
+        static const BYTE gzipHeader[10] = {
+            0x1F, 0x8B,             // magic
+            8,                      // CM = deflate
+            0,                      // FLG
+            0, 0, 0, 0,             // MTIME (none)
+            4,                      // XFL = fastest
+            11                      // OS = NTFS
+        };
+
+        for (UINT i = 0; i < COUNTOF(gzipHeader); i++) {
+            PutByte(gzipHeader[i]);
+        }
+    } else {
+        // CMF: deflate, 32K window; FLG: fastest, no dictionary, and
+        // check bits making CMF * 256 + FLG a multiple of 31.
+        PutByte(0x78);
+        PutByte(0x01);
+    }
+
+    PutBits(0, 1);                          // BFINAL
+    PutBits(1, 2);                          // BTYPE = fixed Huffman
+
+    m_bInitialized = true;
+
+    hr = S_OK;
+  Error:
+    m_hrLast = hr;
+    return hr;
+}
+
+// ============================================================================
+// CDeflater::Write
+//      Add input to the window and compress as much of it as can be
+//      without seeing what comes next.
+
+HRESULT
+CDeflater::Write(
+    const void *pv,                         // [in] data to compress
+    ULONG       cb)                         // [in] number of bytes
+{
+    const BYTE *pb = static_cast<const BYTE*>(pv);
+
+    ASSERT(m_bInitialized && !m_bFinished);
+
+    while (cb > 0 && SUCCEEDED(m_hrLast)) {
+        ULONG cbFree;
+        ULONG cbCopy;
+        BYTE *pbDest;
+
+        if (m_strStart >= WINDOW_SIZE + MAX_DIST) {
+            SlideWindow();
+        }
+
+        cbFree = 2 * WINDOW_SIZE - (m_strStart + m_lookahead);
+        cbCopy = (cb < cbFree) ? cb : cbFree;
+        pbDest = m_pWindow + m_strStart + m_lookahead;
+
+        ::memcpy(pbDest, pb, cbCopy);
+
+        // Check values are computed over the uncompressed data.
+        if (m_format == FORMAT_GZIP) {
+            DWORD crc = m_crc;
+
+            for (ULONG i = 0; i < cbCopy; i++) {
+                crc = g_deflateTables.m_crc[(crc ^ pbDest[i]) & 0xFF] ^ (crc >> 8);
+            }
+            m_crc = crc;
+        } else {
+            ULONG i = 0;
+
+            while (i < cbCopy) {
+                // 5552 is the most bytes that can be summed before
+                // m_adlerB might overflow.
+                ULONG n = cbCopy - i;
+
+                if (n > 5552) {
+                    n = 5552;
+                }
+                while (n-- > 0) {
+                    m_adlerA += pbDest[i++];
+                    m_adlerB += m_adlerA;
+                }
+                m_adlerA %= 65521;
+                m_adlerB %= 65521;
+            }
+        }
+
+        m_cbTotalIn += cbCopy;
+        m_lookahead += cbCopy;
+        pb += cbCopy;
+        cb -= cbCopy;
+
+        Compress(false);
+    }
+
+    return m_hrLast;
+}
+
+// ============================================================================
+// CDeflater::Finish
+//      Compress the rest of the input, close the block, and add an empty
+//      final block (the first one didn't know it was the last) and the
+//      container trailer.
+
+HRESULT
+CDeflater::Finish()
+{
+    ASSERT(m_bInitialized && !m_bFinished);
+
+    m_bFinished = true;
+
+    Compress(true);
+
+    PutBits(g_deflateTables.m_litCode[END_OF_BLOCK],
+            g_deflateTables.m_litBits[END_OF_BLOCK]);
+
+    PutBits(1, 1);                          // BFINAL
+    PutBits(1, 2);                          // BTYPE = fixed Huffman
+    PutBits(g_deflateTables.m_litCode[END_OF_BLOCK],
+            g_deflateTables.m_litBits[END_OF_BLOCK]);
+    AlignToByte();
+
+    if (m_format == FORMAT_GZIP) {
+        DWORD crc = m_crc ^ 0xFFFFFFFF;
+
+        PutByte(static_cast<BYTE>(crc));
+        PutByte(static_cast<BYTE>(crc >> 8));
+        PutByte(static_cast<BYTE>(crc >> 16));
+        PutByte(static_cast<BYTE>(crc >> 24));
+        PutByte(static_cast<BYTE>(m_cbTotalIn));
+        PutByte(static_cast<BYTE>(m_cbTotalIn >> 8));
+        PutByte(static_cast<BYTE>(m_cbTotalIn >> 16));
+        PutByte(static_cast<BYTE>(m_cbTotalIn >> 24));
+    } else {
+        PutByte(static_cast<BYTE>(m_adlerB >> 8));
+        PutByte(static_cast<BYTE>(m_adlerB));
+        PutByte(static_cast<BYTE>(m_adlerA >> 8));
+        PutByte(static_cast<BYTE>(m_adlerA));
+    }
+
+    if (SUCCEEDED(m_hrLast)) {
+        m_hrLast = FlushStage();
+    }
+
+    return m_hrLast;
+}
+
+// ============================================================================
+// CDeflater::Compress
+//      Greedy LZ77: at each position, take the longest match found in the
+//      history (if any), else emit a literal.  Until the input is
+//      finished, stop while there's less than a maximal match (plus the
+//      bytes needed to hash) left to look at.
+
+void
+CDeflater::Compress(bool bFinishing)        // [in] true if no more input
+{
+    const CDeflateTables & t = g_deflateTables;
+    ULONG minLookahead = bFinishing ? 1 : MIN_LOOKAHEAD;
+
+    while (m_lookahead >= minLookahead && SUCCEEDED(m_hrLast)) {
+
+        ULONG matchLength = 0;
+        ULONG distance = 0;
+
+        if (m_lookahead >= MIN_MATCH) {
+            const BYTE *p = m_pWindow + m_strStart;
+            UINT        hash = ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & HASH_MASK;
+            ULONG       curMatch = m_pHead[hash];
+
+            m_pPrev[m_strStart & WINDOW_MASK] = static_cast<WORD>(curMatch);
+            m_pHead[hash] = static_cast<WORD>(m_strStart);
+
+            if (curMatch != 0 && m_strStart - curMatch <= MAX_DIST) {
+                matchLength = LongestMatch(curMatch,
+                                           (m_lookahead < MAX_MATCH) ?
+                                               m_lookahead :
+                                               static_cast<ULONG>(MAX_MATCH),
+                                           &distance);
+            }
+        }
+
+        if (matchLength >= MIN_MATCH) {
+            UINT lengthSym = t.m_lengthSym[matchLength];
+            UINT distSym = t.DistanceSymbol(distance - 1);
+
+            PutBits(t.m_litCode[257 + lengthSym], t.m_litBits[257 + lengthSym]);
+            if (g_lengthExtra[lengthSym]) {
+                PutBits(matchLength - g_lengthBase[lengthSym],
+                        g_lengthExtra[lengthSym]);
+            }
+
+            PutBits(t.m_distCode[distSym], 5);
+            if (g_distExtra[distSym]) {
+                PutBits(distance - g_distBase[distSym], g_distExtra[distSym]);
+            }
+
+            // Hashing every string inside a long match costs more than
+            // the matches it finds later are worth.
+            if (matchLength <= MAX_INSERT) {
+                for (ULONG i = 1; i < matchLength; i++) {
+                    if (m_lookahead - i >= MIN_MATCH) {
+                        InsertString(m_strStart + i);
+                    }
+                }
+            }
+
+            m_strStart += matchLength;
+            m_lookahead -= matchLength;
+
+        } else {
+
+            BYTE b = m_pWindow[m_strStart];
+
+            PutBits(t.m_litCode[b], t.m_litBits[b]);
+
+            m_strStart++;
+            m_lookahead--;
+        }
+    }
+}
+
+// ============================================================================
+// CDeflater::LongestMatch
+//      Follow the hash chain from curMatch, returning the length of the
+//      longest match with the string at m_strStart (0 if none is at least
+//      MIN_MATCH long) and its distance in *pDistance.
+
+ULONG
+CDeflater::LongestMatch(
+    ULONG  curMatch,                        // [in] most recent candidate
+    ULONG  maxLength,                       // [in] longest match allowed
+    ULONG *pDistance)                       // [out] distance of match
+{
+    const BYTE *scan = m_pWindow + m_strStart;
+    ULONG       limit = (m_strStart > MAX_DIST) ? m_strStart - MAX_DIST : 0;
+    ULONG       bestLength = MIN_MATCH - 1;
+    UINT        chain = MAX_CHAIN;
+
+    ASSERT(maxLength >= MIN_MATCH && maxLength <= MAX_MATCH);
+
+    do {
+        const BYTE *match = m_pWindow + curMatch;
+
+        // Check the byte that would make this match better first;
+        // it's the one most likely to differ.
+        if (match[bestLength] == scan[bestLength] &&
+            match[0] == scan[0] &&
+            match[1] == scan[1] &&
+            match[2] == scan[2]) {
+
+            ULONG length = MIN_MATCH;
+
+            while (length < maxLength && match[length] == scan[length]) {
+                length++;
+            }
+
+            if (length > bestLength) {
+                bestLength = length;
+                *pDistance = m_strStart - curMatch;
+                if (length >= maxLength || length >= NICE_MATCH) {
+                    break;
+                }
+            }
+        }
+
+        curMatch = m_pPrev[curMatch & WINDOW_MASK];
+
+    } while (curMatch > limit && curMatch < m_strStart && --chain != 0);
+
+    return (bestLength >= MIN_MATCH) ? bestLength : 0;
+}
+
+// ============================================================================
+// CDeflater::InsertString
+//      Add the string at pos to its hash chain.
+
+void
+CDeflater::InsertString(ULONG pos)          // [in] window position
+{
+    const BYTE *p = m_pWindow + pos;
+    UINT        hash = ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & HASH_MASK;
+
+    m_pPrev[pos & WINDOW_MASK] = m_pHead[hash];
+    m_pHead[hash] = static_cast<WORD>(pos);
+}
+
+// ============================================================================
+// CDeflater::SlideWindow
+//      Move the upper half of the window down to make room for more
+//      input, and rebase the hash chains.  Positions that fall off the
+//      bottom become 0, i.e. "none".
+
+void
+CDeflater::SlideWindow()
+{
+    UINT i;
+
+    ::memcpy(m_pWindow, m_pWindow + WINDOW_SIZE, WINDOW_SIZE);
+    m_strStart -= WINDOW_SIZE;
+
+    for (i = 0; i < HASH_SIZE; i++) {
+        m_pHead[i] = static_cast<WORD>(
+            (m_pHead[i] >= WINDOW_SIZE) ? m_pHead[i] - WINDOW_SIZE : 0);
+    }
+
+    for (i = 0; i < WINDOW_SIZE; i++) {
+        m_pPrev[i] = static_cast<WORD>(
+            (m_pPrev[i] >= WINDOW_SIZE) ? m_pPrev[i] - WINDOW_SIZE : 0);
+    }
+}
+
+// ============================================================================
+// CDeflater::PutBits
+//      Append nBits (at most 16) bits of value, least significant first.
+
+void
+CDeflater::PutBits(DWORD value, int nBits)
+{
+    m_bitBuffer |= value << m_nBits;
+    m_nBits += nBits;
+
+    while (m_nBits >= 8) {
+        PutByte(static_cast<BYTE>(m_bitBuffer));
+        m_bitBuffer >>= 8;
+        m_nBits -= 8;
+    }
+}
+
+// ============================================================================
+// CDeflater::PutByte
+
+void
+CDeflater::PutByte(BYTE b)
+{
+    m_stage[m_cbStage++] = b;
+
+    if (m_cbStage == STAGE_SIZE) {
+        if (SUCCEEDED(m_hrLast)) {
+            m_hrLast = FlushStage();
+        }
+        // After a failure the output is lost anyway.
+        m_cbStage = 0;
+    }
+}
+
+// ============================================================================
+// CDeflater::AlignToByte
+//      Pad the last partial byte with zero bits.
+
+void
+CDeflater::AlignToByte()
+{
+    if (m_nBits > 0) {
+        PutBits(0, 8 - m_nBits);
+    }
+}
+
+// ============================================================================
+// CDeflater::FlushStage
+//      Move completed bytes to the output buffer.
+
+HRESULT
+CDeflater::FlushStage()
+{
+    HRESULT hr;
+
+    hr = m_output.Append(m_stage, m_cbStage);
+    HRCHECK(FAILED(hr));
+
+    m_cbStage = 0;
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
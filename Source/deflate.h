@@ -0,0 +1,103 @@
+// ============================================================================
+// FILE: deflate.h
+//
+//      Streaming deflate compressor, for compressing output as it's
+//      written to the Response.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#pragma once
+
+// ============================================================================
+// CLASS: CDeflater
+//
+//      Compresses a stream of bytes into deflate format (RFC 1951), wrapped
+//      in either a gzip (RFC 1952) or a zlib (RFC 1950, HTTP "deflate")
+//      container.  Input can be passed in any number of pieces; it's
+//      compressed as it arrives, keeping only the 32K history window
+//      deflate needs.  Compressed bytes accumulate in GetOutput() until
+//      the caller takes them.
+//
+//      This favours speed over ratio: one fixed-Huffman block, and a
+//      greedy match search with a short hash chain.  Markup compresses
+//      well enough that way, at a fraction of the cost of a full
+//      compressor.
+
+class CDeflater
+{
+  public:
+    enum Format {
+        FORMAT_GZIP,
+        FORMAT_ZLIB
+    };
+
+    CDeflater();
+    ~CDeflater();
+
+    // Must be called, once, before anything is written.
+    HRESULT Init(Format format);
+
+    HRESULT Write(const void *pv, ULONG cb);
+
+    // Compress whatever is still buffered and end the stream.  Nothing
+    // may be written afterwards.
+    HRESULT Finish();
+
+    // Compressed bytes produced so far that the caller hasn't taken.
+    // Call Empty() on it after writing them out.
+    CPooledBuffer & GetOutput() {
+        return m_output;
+    }
+
+  private:
+    enum {
+        WINDOW_SIZE     = 1 << 15,
+        WINDOW_MASK     = WINDOW_SIZE - 1,
+        HASH_SIZE       = 1 << 15,
+        HASH_MASK       = HASH_SIZE - 1,
+        MIN_MATCH       = 3,
+        MAX_MATCH       = 258,
+        MIN_LOOKAHEAD   = MAX_MATCH + MIN_MATCH + 1,
+        MAX_DIST        = WINDOW_SIZE - MIN_LOOKAHEAD,
+        MAX_CHAIN       = 32,       // hash chain links to follow
+        NICE_MATCH      = 128,      // stop looking at a match this long
+        MAX_INSERT      = 16,       // longest match whose strings are hashed
+        STAGE_SIZE      = 4096
+    };
+
+    void Compress(bool bFinishing);
+    ULONG LongestMatch(ULONG curMatch, ULONG maxLength, ULONG *pDistance);
+    void InsertString(ULONG pos);
+    void SlideWindow();
+
+    void PutBits(DWORD value, int nBits);
+    void PutByte(BYTE b);
+    void AlignToByte();
+    HRESULT FlushStage();
+
+    Format          m_format;
+    bool            m_bInitialized;
+    bool            m_bFinished;
+    HRESULT         m_hrLast;
+
+    BYTE           *m_pWindow;      // 2 * WINDOW_SIZE bytes of input
+    ULONG           m_cbWindowBlock;
+    WORD           *m_pHead;        // most recent position for each hash
+    ULONG           m_cbHeadBlock;
+    WORD           *m_pPrev;        // previous position with the same hash
+    ULONG           m_cbPrevBlock;
+    ULONG           m_strStart;     // next position in m_pWindow to compress
+    ULONG           m_lookahead;    // bytes at m_strStart not yet compressed
+
+    DWORD           m_bitBuffer;
+    int             m_nBits;
+    BYTE            m_stage[STAGE_SIZE];    // complete bytes not yet in m_output
+    ULONG           m_cbStage;
+
+    DWORD           m_crc;          // gzip check value
+    DWORD           m_adlerA;       // zlib check value
+    DWORD           m_adlerB;
+    DWORD           m_cbTotalIn;
+
+    CPooledBuffer   m_output;
+};
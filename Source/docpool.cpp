@@ -0,0 +1,159 @@
+// ============================================================================
+// FILE: docpool.cpp
+//
+//      Implementation of the pool of intermediate XML documents.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#include "StdAfx.h"
+
+// ============================================================================
+// CDocumentPool::CDocumentPool
+
+CDocumentPool::CDocumentPool(
+    long maxDocuments)                      // [in] Documents to keep
+{
+    InitializeCriticalSection(&m_cs);
+    ::memset(m_pDocs, 0, sizeof(m_pDocs));
+    m_count = 0;
+    m_created = 0;
+    m_reused = 0;
+    m_maxDocuments = 0;
+    SetMaxDocuments(maxDocuments);
+}
+
+// ============================================================================
+// CDocumentPool::~CDocumentPool
+
+CDocumentPool::~CDocumentPool()
+{
+    SetMaxDocuments(0);
+    DeleteCriticalSection(&m_cs);
+}
+
+// ============================================================================
+// CDocumentPool::SetMaxDocuments
+//      Change the number of documents kept, releasing any over the limit.
+
+HRESULT
+CDocumentPool::SetMaxDocuments(long maxDocuments)
+{
+    if (maxDocuments < 0) {
+        maxDocuments = 0;
+    } else if (maxDocuments > MAX_POOLED_DOCUMENTS) {
+        maxDocuments = MAX_POOLED_DOCUMENTS;
+    }
+
+    Enter();
+    m_maxDocuments = maxDocuments;
+    while (m_count > m_maxDocuments) {
+        m_count--;
+        SAFERELEASE(m_pDocs[m_count]);
+    }
+    Leave();
+
+    return S_OK;
+}
+
+// ============================================================================
+// CDocumentPool::Acquire
+//      Hand out a pooled document, creating a new one if none is free.
+
+HRESULT
+CDocumentPool::Acquire(CComPtr<IXMLDOMDocument> & pcomDoc)   // [out] document
+{
+    HRESULT          hr;
+    IXMLDOMDocument *pDoc = NULL;
+
+    ASSERT(pcomDoc.p == NULL);
+
+    Enter();
+    if (m_count > 0) {
+        m_count--;
+        pDoc = m_pDocs[m_count];
+        m_pDocs[m_count] = NULL;
+    }
+    Leave();
+
+    if (pDoc) {
+        InterlockedIncrement(&m_reused);
+        pcomDoc.Attach(pDoc);
+    } else {
+        InterlockedIncrement(&m_created);
+        hr = CreateXMLDocumentOnCComPtr(pcomDoc);
+        HRCHECK(FAILED(hr));
+    }
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CDocumentPool::Return
+//      Empty the document, so it doesn't hold on to the last result, and
+//      keep it if the pool has room.  Documents that can't be emptied are
+//      simply dropped.
+
+void
+CDocumentPool::Return(IXMLDOMDocument *pDoc)    // [in] document to recycle
+{
+    HRESULT              hr;
+    CComPtr<IXMLDOMNode> pcomChild;
+
+    // Don't bother emptying it if the pool is already full.  (Not
+    // locked; at worst we empty a document and then drop it.)
+    if (pDoc == NULL || m_count >= m_maxDocuments) {
+        RETURNERR(S_OK);
+    }
+
+    // Documents have only a handful of top-level nodes, so this is
+    // cheap; removing the document element frees the whole tree.
+    hr = pDoc->get_lastChild(&pcomChild);
+    HRCHECK(FAILED(hr));
+
+    while (pcomChild.p) {
+        CComPtr<IXMLDOMNode> pcomOldChild;
+
+        hr = pDoc->removeChild(pcomChild, &pcomOldChild);
+        HRCHECK(FAILED(hr));
+
+        pcomChild.Release();
+        hr = pDoc->get_lastChild(&pcomChild);
+        HRCHECK(FAILED(hr));
+    }
+
+    Enter();
+    if (m_count < m_maxDocuments) {
+        pDoc->AddRef();
+        m_pDocs[m_count] = pDoc;
+        m_count++;
+    }
+    Leave();
+
+  Error:
+    return;
+}
+
+// ============================================================================
+// CDocumentPool::AppendStatistics
+//      Appends <document-pool pooled="n" max-documents="n" created="n"
+//      reused="n"/> to bstrStats.
+
+HRESULT
+CDocumentPool::AppendStatistics(CComBSTR & bstrStats)
+{
+    HRESULT hr;
+    wchar_t wszBuffer[128];
+
+    wsprintf(wszBuffer,
+             L"<document-pool pooled=\"%ld\" max-documents=\"%ld\" "
+             L"created=\"%ld\" reused=\"%ld\"/>",
+             m_count, m_maxDocuments, m_created, m_reused);
+    hr = bstrStats.Append(wszBuffer);
+    HRCHECK(FAILED(hr));
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
@@ -0,0 +1,53 @@
+// ============================================================================
+// FILE: docpool.h
+//
+//      Pool of XML document objects used for the intermediate results of
+//      stylesheet chains.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#pragma once
+
+// ============================================================================
+// CLASS: CDocumentPool
+//
+//      Keeps emptied free-threaded documents around so that each stage of a
+//      stylesheet chain doesn't have to create a new document object on
+//      every request.
+
+class CDocumentPool
+{
+  public:
+    enum { MAX_POOLED_DOCUMENTS = 64 };
+
+    CDocumentPool(long maxDocuments);
+    ~CDocumentPool();
+
+    HRESULT SetMaxDocuments(long maxDocuments);
+
+    // Take a document from the pool, or create one if it's empty.
+    HRESULT Acquire(CComPtr<IXMLDOMDocument> & pcomDoc);
+
+    // Empty the document and keep it for reuse if there's room.  The
+    // caller must not be sharing the document with anyone else.
+    void Return(IXMLDOMDocument *pDoc);
+
+    // Append <document-pool> statistics to bstrStats.
+    HRESULT AppendStatistics(CComBSTR & bstrStats);
+
+  private:
+    void Enter() {
+        EnterCriticalSection(&m_cs);
+    }
+
+    void Leave() {
+        LeaveCriticalSection(&m_cs);
+    }
+
+    IXMLDOMDocument  *m_pDocs[MAX_POOLED_DOCUMENTS];
+    long              m_count;
+    long              m_maxDocuments;
+    LONG              m_created;
+    LONG              m_reused;
+    CRITICAL_SECTION  m_cs;
+};
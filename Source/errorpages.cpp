@@ -0,0 +1,561 @@
+// ============================================================================
+// FILE: errorpages.cpp
+//
+//      Implementation of the rendered error page cache.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#include "StdAfx.h"
+
+// Placeholders start and end with characters from the private use
+// area, which no real URL or description will contain.
+const wchar_t PLACEHOLDER_START = L'\xE000';
+const wchar_t PLACEHOLDER_END = L'\xE001';
+
+static const wchar_t * const s_placeholders[CErrorPage::NUM_VALUES] =
+{
+    L"\xE000" L"u&<>\"\t\n" L"\xE001",
+    L"\xE000" L"i&<>\"\t\n" L"\xE001"
+};
+
+// Characters a placeholder holds, in the order of Slot::m_wszEscapes.
+static const wchar_t s_wszEscaped[] = L"&<>\"\t\n";
+
+// PLACEHOLDER_START in UTF-8, %-escaped, as the HTML output method
+// writes it in a URL attribute.
+static const wchar_t s_wszEscapedStart[] = L"%EE%80%80";
+
+// ============================================================================
+// CErrorPage::CErrorPage
+
+CErrorPage::CErrorPage()
+{
+    m_ref = 1;
+    m_uiCP = 0;
+    ::memset(m_dependencies, 0, sizeof(m_dependencies));
+    m_numDependencies = 0;
+    m_pwchText = NULL;
+    m_cchText = 0;
+    m_slots = NULL;
+    m_numSlots = 0;
+    m_bHasTemplate = false;
+}
+
+CErrorPage::~CErrorPage()
+{
+    for (int i = 0; i < m_numDependencies; i++) {
+        SysFreeString(m_dependencies[i].m_bstrPath);
+    }
+    delete [] m_pwchText;
+    delete [] m_slots;
+}
+
+const wchar_t *
+CErrorPage::GetPlaceholder(int value)
+{
+    ASSERT(value >= 0 && value < NUM_VALUES);
+    return s_placeholders[value];
+}
+
+// ============================================================================
+// CErrorPage::SetKey
+
+HRESULT
+CErrorPage::SetKey(BSTR bstrKey)
+{
+    HRESULT hr;
+
+    m_bstrKey = bstrKey;
+    ERRCHECK(m_bstrKey.m_str == NULL, E_OUTOFMEMORY);
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CErrorPage::SetOutput
+
+HRESULT
+CErrorPage::SetOutput(
+    BSTR bstrContentType,                   // [in] content type sent
+    BSTR bstrCharset,                       // [in] charset sent
+    UINT uiCP)                              // [in] code page of output
+{
+    HRESULT hr;
+
+    m_bstrContentType = bstrContentType;
+    ERRCHECK(bstrContentType && m_bstrContentType.m_str == NULL, E_OUTOFMEMORY);
+
+    m_bstrCharset = bstrCharset;
+    ERRCHECK(bstrCharset && m_bstrCharset.m_str == NULL, E_OUTOFMEMORY);
+
+    m_uiCP = uiCP;
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CErrorPage::AddDependency
+
+HRESULT
+CErrorPage::AddDependency(
+    BSTR bstrPath,                          // [in] full path of the file
+    const XmlCacheInfo & info)              // [in] version used
+{
+    HRESULT hr;
+
+    if (bstrPath == NULL || m_numDependencies >= MAX_DEPENDENCIES) {
+        RETURNERR(S_OK);
+    }
+
+    m_dependencies[m_numDependencies].m_bstrPath = SysAllocString(bstrPath);
+    ERRCHECK(m_dependencies[m_numDependencies].m_bstrPath == NULL,
+             E_OUTOFMEMORY);
+
+    m_dependencies[m_numDependencies].m_info = info;
+    m_numDependencies++;
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CErrorPage::ParseReference
+//      The character an entity or character reference stands for, or 0
+//      if it's not one of the predefined entities or a character
+//      reference.
+
+wchar_t
+CErrorPage::ParseReference(
+    const wchar_t *pwchStart,               // [in] after the &
+    const wchar_t *pwchEnd)                 // [in] at the ;
+{
+    static const struct {
+        const wchar_t  *m_pwszName;
+        wchar_t         m_ch;
+    } s_entities[] = {
+        { L"amp",  L'&'  },
+        { L"lt",   L'<'  },
+        { L"gt",   L'>'  },
+        { L"quot", L'"'  },
+        { L"apos", L'\'' }
+    };
+
+    const wchar_t *pwch;
+    ULONG          ch = 0;
+    ULONG          base = 10;
+    int            digit;
+    int            i;
+
+    if (pwchStart < pwchEnd && *pwchStart != L'#') {
+        for (i = 0; i < COUNTOF(s_entities); i++) {
+            if (static_cast<int>(pwchEnd - pwchStart) ==
+                    lstrlenW(s_entities[i].m_pwszName) &&
+                ::memcmp(pwchStart,
+                         s_entities[i].m_pwszName,
+                         (pwchEnd - pwchStart) * sizeof(wchar_t)) == 0) {
+                return s_entities[i].m_ch;
+            }
+        }
+        return 0;
+    }
+
+    pwch = pwchStart + 1;
+    if (pwch < pwchEnd && (*pwch == L'x' || *pwch == L'X')) {
+        base = 16;
+        pwch++;
+    }
+    if (pwch == pwchEnd) {
+        return 0;
+    }
+
+    for (; pwch < pwchEnd; pwch++) {
+        if (*pwch >= L'0' && *pwch <= L'9') {
+            digit = *pwch - L'0';
+        } else if (base == 16 && *pwch >= L'a' && *pwch <= L'f') {
+            digit = *pwch - L'a' + 10;
+        } else if (base == 16 && *pwch >= L'A' && *pwch <= L'F') {
+            digit = *pwch - L'A' + 10;
+        } else {
+            return 0;
+        }
+        ch = ch * base + digit;
+        if (ch > 0xFFFF) {
+            return 0;
+        }
+    }
+
+    return static_cast<wchar_t>(ch);
+}
+
+// ============================================================================
+// CErrorPage::ParseEscapes
+//      Work out what each of the characters of a placeholder became,
+//      from what's between its markers.  Each either came through as
+//      is or as a reference to that same character.
+
+bool
+CErrorPage::ParseEscapes(
+    const wchar_t *pwchStart,               // [in] placeholder contents
+    const wchar_t *pwchEnd,                 // [in] end of them
+    Slot *pSlot)                            // [out] the escapes
+{
+    const wchar_t *pwch = pwchStart;
+    const wchar_t *pwchName;
+    int            i;
+
+    for (i = 0; s_wszEscaped[i]; i++) {
+
+        if (pwch >= pwchEnd) {
+            return false;
+        }
+
+        if (*pwch == L'&') {
+
+            // A reference is & followed by a name or #number and ;
+            pwchName = pwch + 1;
+            while (pwchName < pwchEnd &&
+                   pwchName - pwch < COUNTOF(pSlot->m_wszEscapes[i]) - 1 &&
+                   (iswalnum(*pwchName) || *pwchName == L'#')) {
+                pwchName++;
+            }
+
+            if (pwchName < pwchEnd && *pwchName == L';' &&
+                ParseReference(pwch + 1, pwchName) == s_wszEscaped[i]) {
+                lstrcpyn(pSlot->m_wszEscapes[i], pwch, pwchName - pwch + 2);
+                pwch = pwchName + 1;
+                continue;
+            }
+        }
+
+        if (*pwch != s_wszEscaped[i]) {
+            return false;
+        }
+
+        pSlot->m_wszEscapes[i][0] = *pwch++;
+        pSlot->m_wszEscapes[i][1] = L'\0';
+    }
+
+    return pwch == pwchEnd;
+}
+
+// ============================================================================
+// CErrorPage::Build
+//      Only output in which every placeholder is whole, and which has
+//      at least one of each, makes a template: a value left out may
+//      have been tested or taken apart instead of copied.
+
+HRESULT
+CErrorPage::Build(
+    const wchar_t *pwchOutput,              // [in] stylesheet output
+    ULONG cchOutput)                        // [in] its length
+{
+    HRESULT        hr;
+    const wchar_t *pwch = pwchOutput;
+    const wchar_t *pwchEnd = pwchOutput + cchOutput;
+    const wchar_t *pwchClose;
+    UINT           maxSlots = 0;
+    Slot          *pSlot;
+    bool           bSeen[NUM_VALUES] = { false };
+    int            value;
+
+    ASSERT(m_pwchText == NULL);
+
+    // The output starts with a byte-order mark.
+    if (pwch < pwchEnd && *pwch == L'\xFEFF') {
+        pwch++;
+    }
+
+    for (pwchClose = pwch; pwchClose < pwchEnd; pwchClose++) {
+        if (*pwchClose == PLACEHOLDER_START) {
+            maxSlots++;
+        } else if (*pwchClose == L'%' &&
+                   pwchEnd - pwchClose >= COUNTOF(s_wszEscapedStart) - 1 &&
+                   _wcsnicmp(pwchClose,
+                             s_wszEscapedStart,
+                             COUNTOF(s_wszEscapedStart) - 1) == 0) {
+            RETURNERR(S_FALSE);
+        }
+    }
+
+    if (maxSlots == 0) {
+        RETURNERR(S_FALSE);
+    }
+
+    m_pwchText = new wchar_t[pwchEnd - pwch + 1];
+    ERRCHECK(m_pwchText == NULL, E_OUTOFMEMORY);
+
+    m_slots = new Slot[maxSlots];
+    ERRCHECK(m_slots == NULL, E_OUTOFMEMORY);
+
+    while (pwch < pwchEnd) {
+
+        if (*pwch == PLACEHOLDER_END) {
+            RETURNERR(S_FALSE);
+        }
+
+        if (*pwch != PLACEHOLDER_START) {
+            m_pwchText[m_cchText++] = *pwch++;
+            continue;
+        }
+
+        pwchClose = pwch + 1;
+        while (pwchClose < pwchEnd && *pwchClose != PLACEHOLDER_END) {
+            pwchClose++;
+        }
+        if (pwchClose == pwchEnd || pwchClose - pwch < 2) {
+            RETURNERR(S_FALSE);
+        }
+
+        for (value = 0; value < NUM_VALUES; value++) {
+            if (pwch[1] == s_placeholders[value][1]) {
+                break;
+            }
+        }
+        if (value == NUM_VALUES) {
+            RETURNERR(S_FALSE);
+        }
+
+        pSlot = &m_slots[m_numSlots];
+        pSlot->m_ich = m_cchText;
+        pSlot->m_value = value;
+
+        if (!ParseEscapes(pwch + 2, pwchClose, pSlot)) {
+            RETURNERR(S_FALSE);
+        }
+
+        bSeen[value] = true;
+        m_numSlots++;
+        pwch = pwchClose + 1;
+    }
+
+    for (value = 0; value < NUM_VALUES; value++) {
+        if (!bSeen[value]) {
+            RETURNERR(S_FALSE);
+        }
+    }
+
+    m_bHasTemplate = true;
+
+    hr = S_OK;
+  Error:
+    if (hr != S_OK) {
+        delete [] m_pwchText;
+        m_pwchText = NULL;
+        m_cchText = 0;
+        delete [] m_slots;
+        m_slots = NULL;
+        m_numSlots = 0;
+    }
+    return hr;
+}
+
+// ============================================================================
+// CErrorPage::IsCurrent
+
+bool
+CErrorPage::IsCurrent() const
+{
+    XmlCacheInfo info;
+
+    for (int i = 0; i < m_numDependencies; i++) {
+        GetFileCacheInfo(m_dependencies[i].m_bstrPath, &info);
+        if (::memcmp(&info, &m_dependencies[i].m_info, sizeof(info)) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// ============================================================================
+// CErrorPage::Render
+
+HRESULT
+CErrorPage::Render(
+    BSTR bstrURL,                           // [in] URL of the request
+    BSTR bstrInfo,                          // [in] error description
+    CPooledBuffer & output) const           // [out] the page
+{
+    HRESULT         hr;
+    ULONG           ich = 0;
+    UINT            slot;
+    const wchar_t  *pwchValue;
+    const wchar_t  *pwchRun;
+    const wchar_t  *pwchEscape;
+    int             i;
+
+    ASSERT(m_bHasTemplate);
+
+    output.Empty();
+
+    for (slot = 0; slot < m_numSlots; slot++) {
+
+        const Slot & s = m_slots[slot];
+
+        hr = output.Append(m_pwchText + ich,
+                           (s.m_ich - ich) * sizeof(wchar_t));
+        HRCHECK(FAILED(hr));
+        ich = s.m_ich;
+
+        pwchValue = (s.m_value == VALUE_URL) ? bstrURL : bstrInfo;
+        if (pwchValue == NULL) {
+            continue;
+        }
+
+        // Copy runs of characters that need no escaping in one go.
+        // Line breaks come out as the parser would have left them in
+        // the error document: CR LF or CR alone as LF.
+        pwchRun = pwchValue;
+        for (;; pwchValue++) {
+
+            pwchEscape = NULL;
+            if (*pwchValue == L'\r') {
+                pwchEscape = wcschr(s_wszEscaped, L'\n');
+            } else if (*pwchValue) {
+                pwchEscape = wcschr(s_wszEscaped, *pwchValue);
+                if (pwchEscape == NULL) {
+                    continue;
+                }
+            }
+
+            hr = output.Append(pwchRun, (pwchValue - pwchRun) * sizeof(wchar_t));
+            HRCHECK(FAILED(hr));
+
+            if (*pwchValue == L'\0') {
+                break;
+            }
+
+            if (pwchValue[0] == L'\r' && pwchValue[1] == L'\n') {
+                pwchValue++;
+            }
+
+            i = pwchEscape - s_wszEscaped;
+            hr = output.Append(s.m_wszEscapes[i],
+                               lstrlenW(s.m_wszEscapes[i]) * sizeof(wchar_t));
+            HRCHECK(FAILED(hr));
+
+            pwchRun = pwchValue + 1;
+        }
+    }
+
+    hr = output.Append(m_pwchText + ich, (m_cchText - ich) * sizeof(wchar_t));
+    HRCHECK(FAILED(hr));
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CErrorPageCache::CErrorPageCache
+
+CErrorPageCache::CErrorPageCache()
+{
+    InitializeCriticalSection(&m_cs);
+    m_bEnabled = true;
+    ::memset(m_slots, 0, sizeof(m_slots));
+}
+
+CErrorPageCache::~CErrorPageCache()
+{
+    ClearCache();
+    DeleteCriticalSection(&m_cs);
+}
+
+void
+CErrorPageCache::SetEnabled(bool bEnabled)
+{
+    Enter();
+    if (!bEnabled) {
+        ClearCache();
+    }
+    m_bEnabled = bEnabled;
+    Leave();
+}
+
+// CErrorPageCache::ClearCache
+//     Must be called with the table locked (or from the destructor).
+
+void
+CErrorPageCache::ClearCache()
+{
+    for (UINT i = 0; i < NUM_SLOTS; i++) {
+        if (m_slots[i]) {
+            m_slots[i]->Release();
+            m_slots[i] = NULL;
+        }
+    }
+}
+
+UINT
+CErrorPageCache::SlotFromKey(BSTR bstrKey)
+{
+    DWORD    hash = 2166136261;
+    wchar_t *pwch;
+
+    for (pwch = bstrKey; *pwch; pwch++) {
+        hash = (hash ^ *pwch) * 16777619;
+    }
+
+    return hash % NUM_SLOTS;
+}
+
+// ============================================================================
+// CErrorPageCache::Lookup
+
+HRESULT
+CErrorPageCache::Lookup(
+    BSTR bstrKey,                           // [in] status, browser, settings
+    CErrorPage **ppPage)                    // [out] the page, or NULL
+{
+    HRESULT       hr;
+    CErrorPage  **ppSlot = &m_slots[SlotFromKey(bstrKey)];
+
+    *ppPage = NULL;
+
+    Enter();
+
+    if (*ppSlot && lstrcmpW((*ppSlot)->GetKey(), bstrKey) == 0) {
+        *ppPage = *ppSlot;
+        (*ppPage)->AddRef();
+    }
+
+    Leave();
+
+    // Checking the files is left out of the lock.
+    if (*ppPage && !(*ppPage)->IsCurrent()) {
+        (*ppPage)->Release();
+        *ppPage = NULL;
+    }
+
+    hr = S_OK;
+    return hr;
+}
+
+// ============================================================================
+// CErrorPageCache::Add
+
+HRESULT
+CErrorPageCache::Add(CErrorPage *pPage)
+{
+    CErrorPage **ppSlot = &m_slots[SlotFromKey(pPage->GetKey())];
+
+    Enter();
+
+    if (m_bEnabled) {
+        if (*ppSlot) {
+            (*ppSlot)->Release();
+        }
+        *ppSlot = pPage;
+        pPage->AddRef();
+    }
+
+    Leave();
+
+    return S_OK;
+}
@@ -0,0 +1,171 @@
+// ============================================================================
+// FILE: errorpages.h
+//
+//      Error pages rendered once and reused, with only the URL and the
+//      description filled in for each error.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#pragma once
+
+// ============================================================================
+// CLASS: CErrorPage
+//
+//      The output of the error stylesheets for one status code and
+//      browser, as a template.  It's made by transforming an error
+//      document whose URL and description are placeholders, and finding
+//      the placeholders in the output.  Each placeholder holds the
+//      characters that may need escaping (&<>", and tab and newline,
+//      which are escaped in attributes), so how they come out says how
+//      to escape the real value at that spot.  If the stylesheet
+//      did anything else with a placeholder (e.g. took a substring of
+//      it, or left one out), the output can't be used as a template.
+//      The page is then kept without one, so that the error stylesheets
+//      aren't run twice for every error of the kind.
+//
+//      Output is kept as the text the stylesheet wrote, before
+//      post-processing, encoding and compression, so that a page made
+//      from it goes through the same processing stream as any other.
+
+class CErrorPage
+{
+  public:
+    enum {
+        VALUE_URL = 0,
+        VALUE_INFO,
+        NUM_VALUES,
+        MAX_DEPENDENCIES = MAX_SHEETS_TO_CHAIN + 1
+    };
+
+    CErrorPage();
+
+    long AddRef() {
+        return InterlockedIncrement(&m_ref);
+    }
+
+    long Release() {
+        long result = InterlockedDecrement(&m_ref);
+        if (result == 0) {
+            delete this;
+        }
+        return result;
+    }
+
+    // Text to put in the error document in place of a value.  The
+    // caller escapes it as needed for where it goes.
+    static const wchar_t * GetPlaceholder(int value);
+
+    // The key the page is cached under.
+    HRESULT SetKey(BSTR bstrKey);
+
+    // Remember the settings the page was rendered with.
+    HRESULT SetOutput(BSTR bstrContentType,         // [in] content type sent
+                      BSTR bstrCharset,             // [in] charset sent
+                      UINT uiCP);                   // [in] code page of output
+
+    // Record a file the page was made from (server-config, stylesheet).
+    // Has no effect once MAX_DEPENDENCIES have been recorded.
+    HRESULT AddDependency(BSTR bstrPath, const XmlCacheInfo & info);
+
+    // Make the template from the stylesheets' output.  S_FALSE, and
+    // the page stays without a template, unless every placeholder came
+    // through intact and each value has at least one.
+    HRESULT Build(const wchar_t *pwchOutput,        // [in] stylesheet output
+                  ULONG cchOutput);                 // [in] its length
+
+    // Whether Build made a template.  A page without one only records
+    // that the error stylesheets' output can't be reused.
+    bool HasTemplate() const        { return m_bHasTemplate; }
+
+    // Whether none of the files the page was made from has changed.
+    bool IsCurrent() const;
+
+    // The page for an error, as text for the processing stream.
+    HRESULT Render(BSTR bstrURL,                    // [in] URL of the request
+                   BSTR bstrInfo,                   // [in] error description
+                   CPooledBuffer & output) const;   // [out] the page
+
+    BSTR GetKey() const             { return m_bstrKey; }
+    BSTR GetContentType() const     { return m_bstrContentType; }
+    BSTR GetCharset() const         { return m_bstrCharset; }
+    UINT GetCodePage() const        { return m_uiCP; }
+
+  private:
+    ~CErrorPage();
+
+    struct Slot {
+        ULONG    m_ich;                     // where in m_pwchText
+        int      m_value;                   // VALUE_URL or VALUE_INFO
+        wchar_t  m_wszEscapes[6][12];       // what &<>" tab, newline became
+    };
+
+    struct Dependency {
+        BSTR          m_bstrPath;
+        XmlCacheInfo  m_info;
+    };
+
+    static bool ParseEscapes(const wchar_t *pwchStart,
+                             const wchar_t *pwchEnd,
+                             Slot *pSlot);
+    static wchar_t ParseReference(const wchar_t *pwchStart,
+                                  const wchar_t *pwchEnd);
+
+    long         m_ref;
+    CComBSTR     m_bstrKey;
+    CComBSTR     m_bstrContentType;
+    CComBSTR     m_bstrCharset;
+    UINT         m_uiCP;
+    Dependency   m_dependencies[MAX_DEPENDENCIES];
+    int          m_numDependencies;
+    wchar_t     *m_pwchText;                // output without placeholders
+    ULONG        m_cchText;
+    Slot        *m_slots;
+    UINT         m_numSlots;
+    bool         m_bHasTemplate;
+};
+
+// ============================================================================
+// CLASS: CErrorPageCache
+//
+//      Rendered error pages, by status code, browser profile and the
+//      settings carried over from the page that failed.  A fixed-size,
+//      direct-mapped table like CSourceInfoCache.
+
+class CErrorPageCache
+{
+  public:
+    enum { NUM_SLOTS = 64 };
+
+    CErrorPageCache();
+    ~CErrorPageCache();
+
+    void SetEnabled(bool bEnabled);
+
+    bool IsEnabled() const {
+        return m_bEnabled;
+    }
+
+    // Get the page for a key, if it's still current.  *ppPage is
+    // AddRef'd, or NULL.  It may be without a template (see
+    // CErrorPage::HasTemplate).
+    HRESULT Lookup(BSTR bstrKey, CErrorPage **ppPage);
+
+    // Add a page, replacing whatever was in its slot.
+    HRESULT Add(CErrorPage *pPage);
+
+  private:
+    static UINT SlotFromKey(BSTR bstrKey);
+    void ClearCache();
+
+    void Enter() {
+        EnterCriticalSection(&m_cs);
+    }
+
+    void Leave() {
+        LeaveCriticalSection(&m_cs);
+    }
+
+    bool              m_bEnabled;
+    CErrorPage       *m_slots[NUM_SLOTS];
+    CRITICAL_SECTION  m_cs;
+};
@@ -0,0 +1,275 @@
+// ============================================================================
+// FILE: phasestats.cpp
+//
+//      Implementation of the transform phase latency histograms.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#include "StdAfx.h"
+
+const wchar_t * const CPhaseStatistics::s_phaseNames[NUM_PHASES] =
+{
+    L"master-config",
+    L"browser-caps",
+    L"server-config",
+    L"extract-stylesheets",
+    L"load-stylesheets",
+    L"transform",
+    L"output",
+    L"total",
+    L"parse"
+};
+
+// ============================================================================
+// CPhaseStatistics::CPhaseStatistics
+
+CPhaseStatistics::CPhaseStatistics()
+{
+    LARGE_INTEGER frequency;
+
+    m_bEnabled = false;
+    m_frequency = QueryPerformanceFrequency(&frequency) ? frequency.QuadPart : 0;
+    m_logInterval = 0;
+    m_lastLog = 0;
+    ::memset(m_counts, 0, sizeof(m_counts));
+    ::memset(m_max, 0, sizeof(m_max));
+}
+
+// ============================================================================
+// CPhaseStatistics::Configure
+//      Timing can't be turned on without a high-resolution counter.
+
+void
+CPhaseStatistics::Configure(
+    bool bEnabled,                          // [in] Whether to time phases
+    long logSeconds)                        // [in] Log line interval, or 0
+{
+    m_logInterval = (logSeconds > 0) ? logSeconds * 1000 : 0;
+
+    if (bEnabled && m_frequency != 0) {
+        if (!m_bEnabled) {
+            m_lastLog = GetTickCount();
+        }
+        m_bEnabled = true;
+    } else {
+        m_bEnabled = false;
+    }
+}
+
+// ============================================================================
+// CPhaseStatistics::BucketFromValue
+//      Values below 2 * SUB_BUCKETS have a bucket each.  Above that, a
+//      value whose top bit is bit n goes in one of the SUB_BUCKETS
+//      buckets for [2^n, 2^(n+1)), by its SUB_BUCKET_BITS bits below
+//      the top one.
+
+UINT
+CPhaseStatistics::BucketFromValue(DWORD us)
+{
+    UINT shift = 0;
+
+    while ((us >> shift) >= 2 * SUB_BUCKETS) {
+        shift++;
+    }
+
+    return shift * SUB_BUCKETS + (us >> shift);
+}
+
+// ============================================================================
+// CPhaseStatistics::ValueFromBucket
+//      The middle of the range of values that go in the bucket.
+
+DWORD
+CPhaseStatistics::ValueFromBucket(UINT bucket)
+{
+    UINT  shift = (bucket < 2 * SUB_BUCKETS) ? 0 : bucket / SUB_BUCKETS - 1;
+    DWORD low = static_cast<DWORD>(bucket - shift * SUB_BUCKETS) << shift;
+
+    return low + ((1UL << shift) - 1) / 2;
+}
+
+// ============================================================================
+// CPhaseStatistics::Record
+
+void
+CPhaseStatistics::Record(
+    TransformPhase phase,                   // [in] Phase timed
+    LONGLONG ticks)                         // [in] How long it took
+{
+    LONGLONG us;
+    DWORD    dwUs;
+
+    ASSERT(phase >= 0 && phase < NUM_PHASES);
+
+    if (!m_bEnabled) {
+        return;
+    }
+
+    us = ticks * 1000000 / m_frequency;
+    if (us < 0) {
+        dwUs = 0;
+    } else if (us > MAXDWORD) {
+        dwUs = MAXDWORD;
+    } else {
+        dwUs = static_cast<DWORD>(us);
+    }
+
+    InterlockedIncrement(&m_counts[phase][BucketFromValue(dwUs)]);
+
+    // Racing updates can lose a new maximum, but the histogram has it.
+    if (dwUs > m_max[phase]) {
+        m_max[phase] = dwUs;
+    }
+
+    LogIfDue();
+}
+
+// ============================================================================
+// CPhaseStatistics::Summarize
+//      Percentiles of one phase.  The counts are read without stopping
+//      anyone recording, so they're only as exact as a snapshot can be.
+
+void
+CPhaseStatistics::Summarize(
+    TransformPhase phase,                   // [in] Phase to summarize
+    Summary *pSummary)                      // [out] Its percentiles
+{
+    DWORD    counts[NUM_BUCKETS];
+    DWORD    total = 0;
+    DWORD    seen = 0;
+    DWORD    rank50;
+    DWORD    rank99;
+    DWORD    rank999;
+    bool     bHave50 = false;
+    bool     bHave99 = false;
+    UINT     bucket;
+
+    ::memset(pSummary, 0, sizeof(*pSummary));
+
+    for (bucket = 0; bucket < NUM_BUCKETS; bucket++) {
+        counts[bucket] = m_counts[phase][bucket];
+        total += counts[bucket];
+    }
+
+    if (total == 0) {
+        return;
+    }
+
+    // The smallest value that at least this share of times are at or
+    // below.
+    rank50 = static_cast<DWORD>((static_cast<DWORDLONG>(total) * 500 + 999) / 1000);
+    rank99 = static_cast<DWORD>((static_cast<DWORDLONG>(total) * 990 + 999) / 1000);
+    rank999 = static_cast<DWORD>((static_cast<DWORDLONG>(total) * 999 + 999) / 1000);
+
+    for (bucket = 0; bucket < NUM_BUCKETS; bucket++) {
+        if (counts[bucket] == 0) {
+            continue;
+        }
+
+        seen += counts[bucket];
+
+        if (!bHave50 && seen >= rank50) {
+            pSummary->p50 = ValueFromBucket(bucket);
+            bHave50 = true;
+        }
+        if (!bHave99 && seen >= rank99) {
+            pSummary->p99 = ValueFromBucket(bucket);
+            bHave99 = true;
+        }
+        if (seen >= rank999) {
+            pSummary->p999 = ValueFromBucket(bucket);
+            break;
+        }
+    }
+
+    pSummary->count = total;
+    pSummary->max = m_max[phase];
+}
+
+// ============================================================================
+// CPhaseStatistics::LogIfDue
+//      Write the log line if the interval is up, unless another thread
+//      has just claimed it.
+
+void
+CPhaseStatistics::LogIfDue()
+{
+    DWORD    now = GetTickCount();
+    LONG     last = m_lastLog;
+    wchar_t  wszLine[1024];
+    int      cch;
+    Summary  summary;
+
+    if (m_logInterval == 0 ||
+        now - static_cast<DWORD>(last) < m_logInterval) {
+        return;
+    }
+
+    if (InterlockedExchange(&m_lastLog, static_cast<LONG>(now)) != last) {
+        return;
+    }
+
+    cch = wsprintf(wszLine, L"XSLISAPI phase times, us (n p50/p99/p99.9/max):");
+
+    for (int phase = 0; phase < NUM_PHASES; phase++) {
+        Summarize(static_cast<TransformPhase>(phase), &summary);
+        if (summary.count) {
+            cch += wsprintf(wszLine + cch,
+                            L" %s %lu %lu/%lu/%lu/%lu;",
+                            s_phaseNames[phase],
+                            summary.count,
+                            summary.p50,
+                            summary.p99,
+                            summary.p999,
+                            summary.max);
+        }
+    }
+
+    lstrcpy(wszLine + cch, L"\n");
+    OutputDebugString(wszLine);
+}
+
+// ============================================================================
+// CPhaseStatistics::AppendStatistics
+//      Appends an XML fragment of the form
+//        <phase-timing enabled="0|1" units="us">
+//          <phase name="..." count="n" p50="" p99="" p999="" max=""/>...
+//        </phase-timing>
+//      Phases that have never been timed are omitted.
+
+HRESULT
+CPhaseStatistics::AppendStatistics(CComBSTR & bstrStats)
+{
+    HRESULT hr;
+    wchar_t wszBuffer[192];
+    Summary summary;
+
+    wsprintf(wszBuffer, L"<phase-timing enabled=\"%d\" units=\"us\">",
+             m_bEnabled ? 1 : 0);
+    hr = bstrStats.Append(wszBuffer);
+    HRCHECK(FAILED(hr));
+
+    for (int phase = 0; phase < NUM_PHASES; phase++) {
+        Summarize(static_cast<TransformPhase>(phase), &summary);
+        if (summary.count) {
+            wsprintf(wszBuffer,
+                     L"<phase name=\"%s\" count=\"%lu\" p50=\"%lu\" "
+                     L"p99=\"%lu\" p999=\"%lu\" max=\"%lu\"/>",
+                     s_phaseNames[phase],
+                     summary.count,
+                     summary.p50,
+                     summary.p99,
+                     summary.p999,
+                     summary.max);
+            hr = bstrStats.Append(wszBuffer);
+            HRCHECK(FAILED(hr));
+        }
+    }
+
+    hr = bstrStats.Append(L"</phase-timing>");
+    HRCHECK(FAILED(hr));
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
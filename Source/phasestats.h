@@ -0,0 +1,235 @@
+// ============================================================================
+// FILE: phasestats.h
+//
+//      Latency histograms for the phases of a transform.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#pragma once
+
+// Phases of CXMLServerDocument::Transform that are timed.  PHASE_OUTPUT
+// is the time spent in the processing stream (post-processing, encoding,
+// compression and writing to the Response); for the last stylesheet of a
+// chain that happens inside PHASE_TRANSFORM.  PHASE_PARSE counts the
+// parser's time over all of a written document, including the parts
+// handed to it before Transform was called.
+enum TransformPhase
+{
+    PHASE_MASTER_CONFIG = 0,                // LoadMasterConfig
+    PHASE_BROWSER_CAPS,                     // InitializeBrowserCapAndAttribs
+    PHASE_SERVER_CONFIG,                    // GetServerConfig
+    PHASE_EXTRACT_STYLESHEETS,              // ExtractStylesheets
+    PHASE_LOAD_STYLESHEETS,                 // LoadStylesheetChain
+    PHASE_TRANSFORM,                        // running the chain
+    PHASE_OUTPUT,                           // the processing stream
+    PHASE_TOTAL,                            // all of Transform
+    PHASE_PARSE,                            // parsing what Write/WriteLine wrote
+    NUM_PHASES
+};
+
+// ============================================================================
+// CLASS: CPhaseStatistics
+//
+//      One histogram per phase, of durations in microseconds.  Buckets
+//      are log-linear: exact below 64us, and above that 32 buckets per
+//      power of two, so a value is reported to within 2%.
+//      Recording is an interlocked increment; nothing is locked.
+//
+//      While enabled, a line with the percentiles of each phase is
+//      written with OutputDebugString every so often.  It's written by
+//      whichever request happens to record a time once the interval is
+//      up, so nothing is logged while the server is idle.
+
+class CPhaseStatistics
+{
+  public:
+    enum {
+        SUB_BUCKET_BITS = 5,
+        SUB_BUCKETS     = 1 << SUB_BUCKET_BITS,
+        NUM_BUCKETS     = (32 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS
+    };
+
+    CPhaseStatistics();
+
+    bool IsEnabled() const {
+        return m_bEnabled;
+    }
+
+    // Turn timing on or off, and set how often (in seconds) the log
+    // line is written; 0 means never.
+    void Configure(bool bEnabled, long logSeconds);
+
+    // Record one duration, in QueryPerformanceCounter ticks.
+    void Record(TransformPhase phase, LONGLONG ticks);
+
+    // Append <phase-timing> statistics to bstrStats.
+    HRESULT AppendStatistics(CComBSTR & bstrStats);
+
+    static const wchar_t * GetPhaseName(TransformPhase phase) {
+        return s_phaseNames[phase];
+    }
+
+  private:
+    struct Summary {
+        DWORD count;
+        DWORD p50;
+        DWORD p99;
+        DWORD p999;
+        DWORD max;
+    };
+
+    static UINT BucketFromValue(DWORD us);
+    static DWORD ValueFromBucket(UINT bucket);
+    void Summarize(TransformPhase phase, Summary *pSummary);
+    void LogIfDue();
+
+    static const wchar_t * const s_phaseNames[NUM_PHASES];
+
+    bool      m_bEnabled;
+    LONGLONG  m_frequency;                  // QueryPerformanceCounter ticks/s
+    DWORD     m_logInterval;                // ms between log lines, or 0
+    LONG      m_lastLog;                    // GetTickCount() of last line
+    LONG      m_counts[NUM_PHASES][NUM_BUCKETS];
+    DWORD     m_max[NUM_PHASES];            // longest time seen, us
+};
+
+// ============================================================================
+// CLASS: CRequestTrace
+//
+//      What one request did: how long each phase took, which device
+//      matched, where the source and each stylesheet came from, and how
+//      many bytes went in and out.  It's kept with the request's
+//      XMLServerDocument, so filling it in allocates nothing; it's only
+//      formatted if the request turns out to be slow (see
+//      CSlowRequestLog).
+
+class CRequestTrace
+{
+  public:
+    // Where a stylesheet came from.
+    enum SheetLoad {
+        LOAD_NONE = 0,                      // not loaded (e.g. failed before)
+        LOAD_HIT,                           // XML cache
+        LOAD_MISS,                          // loaded by the request
+        LOAD_PREFETCHED                     // loaded by the worker pool
+    };
+
+    // Where the source document came from.
+    enum SourceLoad {
+        SOURCE_WRITTEN = 0,                 // built with Write/WriteLine
+        SOURCE_PARSED,                      // file parsed up front
+        SOURCE_INFO_CACHED                  // file's PI was cached
+    };
+
+    CRequestTrace() {
+        Reset(false);
+    }
+
+    // Start a new request; bEnabled says whether it's to be traced.
+    void Reset(bool bEnabled) {
+        ::memset(this, 0, sizeof(*this));
+        m_bEnabled = bEnabled;
+    }
+
+    bool IsEnabled() const {
+        return m_bEnabled;
+    }
+
+    void AddPhase(TransformPhase phase, LONGLONG ticks) {
+        m_ticks[phase] += ticks;
+    }
+
+    void SetDevice(short device) {
+        m_device = device;
+    }
+
+    void SetSource(SourceLoad source, ULONG cbIn) {
+        m_source = source;
+        m_cbIn = cbIn;
+    }
+
+    void SetSheetLoad(short stage, SheetLoad load) {
+        if (stage >= 0 && stage < MAX_SHEETS_TO_CHAIN) {
+            m_sheetLoads[stage] = static_cast<BYTE>(load);
+        }
+    }
+
+    void SetChainCacheStages(short numStages) {
+        m_chainCacheStages = numStages;
+    }
+
+    void SetNotModified() {
+        m_bNotModified = true;
+    }
+
+    // A write of cb bytes to the Response.
+    void AddWriteOut(ULONG cb) {
+        m_cbOut += cb;
+        m_numWritesOut++;
+    }
+
+  private:
+    friend class CSlowRequestLog;
+
+    bool      m_bEnabled;
+    bool      m_bNotModified;               // answered with 304
+    short     m_device;                     // 1-based <device>, 0 if none
+    short     m_chainCacheStages;           // stages taken from chain cache
+    BYTE      m_source;                     // SourceLoad
+    BYTE      m_sheetLoads[MAX_SHEETS_TO_CHAIN];  // SheetLoad per stage
+    ULONG     m_cbIn;                       // size of the source
+    ULONG     m_cbOut;                      // bytes written to the Response
+    ULONG     m_numWritesOut;               // in this many writes
+    LONGLONG  m_ticks[NUM_PHASES];
+};
+
+// ============================================================================
+// CLASS: CPhaseTimer
+//
+//      Times one phase, for the histograms and for the request's trace,
+//      if given.  When neither wants times, Start() and Stop() cost no
+//      more than a test of a flag or two.
+
+class CPhaseTimer
+{
+  public:
+    CPhaseTimer(CRequestTrace *pTrace = NULL) : m_start(0),
+                                                m_pTrace(pTrace) {}
+
+    void Start() {
+        m_start = 0;
+        if (g_phaseStats->IsEnabled() ||
+            (m_pTrace != NULL && m_pTrace->IsEnabled())) {
+            LARGE_INTEGER now;
+            QueryPerformanceCounter(&now);
+            m_start = now.QuadPart;
+        }
+    }
+
+    // Ticks since Start(), or 0 if no one wanted times then.
+    LONGLONG Elapsed() const {
+        LARGE_INTEGER now;
+
+        if (m_start == 0) {
+            return 0;
+        }
+        QueryPerformanceCounter(&now);
+        return now.QuadPart - m_start;
+    }
+
+    void Stop(TransformPhase phase) {
+        if (m_start != 0) {
+            LONGLONG ticks = Elapsed();
+
+            g_phaseStats->Record(phase, ticks);
+            if (m_pTrace != NULL) {
+                m_pTrace->AddPhase(phase, ticks);
+            }
+            m_start = 0;
+        }
+    }
+
+  private:
+    LONGLONG        m_start;
+    CRequestTrace  *m_pTrace;
+};
@@ -0,0 +1,300 @@
+// ============================================================================
+// FILE: slowlog.cpp
+//
+//      Implementation of the slow request log.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#include "StdAfx.h"
+
+static const wchar_t * const s_sheetLoadNames[] =
+{
+    L"none", L"hit", L"miss", L"prefetched"
+};
+
+static const wchar_t * const s_sourceLoadNames[] =
+{
+    L"written", L"parsed", L"info-cached"
+};
+
+// ============================================================================
+// CSlowRequestLog::CSlowRequestLog
+
+CSlowRequestLog::CSlowRequestLog()
+{
+    LARGE_INTEGER frequency;
+    wchar_t      *pwszSlash;
+
+    InitializeCriticalSection(&m_cs);
+    m_frequency = QueryPerformanceFrequency(&frequency) ? frequency.QuadPart : 0;
+    m_thresholdTicks = 0;
+    m_wszPath[0] = L'\0';
+    m_cbMax = DEFAULT_MAX_KB * 1024;
+
+    // The default log goes next to the DLL.
+    m_wszDefaultPath[0] = L'\0';
+    if (GetModuleFileName(_Module.GetModuleInstance(),
+                          m_wszDefaultPath,
+                          COUNTOF(m_wszDefaultPath))) {
+        pwszSlash = wcsrchr(m_wszDefaultPath, L'\\');
+        if (pwszSlash &&
+            (pwszSlash - m_wszDefaultPath) + 20 < COUNTOF(m_wszDefaultPath)) {
+            lstrcpy(pwszSlash + 1, L"slowrequests.log");
+        } else {
+            m_wszDefaultPath[0] = L'\0';
+        }
+    }
+}
+
+CSlowRequestLog::~CSlowRequestLog()
+{
+    DeleteCriticalSection(&m_cs);
+}
+
+// ============================================================================
+// CSlowRequestLog::Configure
+
+HRESULT
+CSlowRequestLog::Configure(
+    long thresholdMs,                       // [in] Slowest request not logged
+    const wchar_t *pwszPath,                // [in] Log file, or NULL
+    long maxKB)                             // [in] Size to start a new file
+{
+    const wchar_t *pwszLog = (pwszPath && *pwszPath) ? pwszPath : m_wszDefaultPath;
+
+    Enter();
+
+    lstrcpyn(m_wszPath, pwszLog, COUNTOF(m_wszPath));
+    m_cbMax = ((maxKB > 0) ? maxKB : DEFAULT_MAX_KB) * 1024;
+
+    if (thresholdMs > 0 && m_frequency != 0 && m_wszPath[0]) {
+        m_thresholdTicks = thresholdMs * m_frequency / 1000;
+        if (m_thresholdTicks == 0) {
+            m_thresholdTicks = 1;
+        }
+    } else {
+        m_thresholdTicks = 0;
+    }
+
+    Leave();
+
+    return S_OK;
+}
+
+// ============================================================================
+// CSlowRequestLog::TicksToMicroseconds
+
+DWORD
+CSlowRequestLog::TicksToMicroseconds(LONGLONG ticks) const
+{
+    LONGLONG us = ticks * 1000000 / m_frequency;
+
+    return (us > LONG_MAX) ? LONG_MAX : static_cast<DWORD>(us);
+}
+
+// ============================================================================
+// CSlowRequestLog::WriteIfSlow
+
+HRESULT
+CSlowRequestLog::WriteIfSlow(
+    const CRequestTrace & trace,            // [in] What the request did
+    BSTR bstrURL,                           // [in] URL of the request
+    BSTR arrStylesheets[],                  // [in] Chain applied
+    short numStylesheets,                   // [in] Length of chain
+    HRESULT hrRequest)                      // [in] How the request ended
+{
+    HRESULT   hr;
+    CComBSTR  bstrLine;
+    char     *pszLine = NULL;
+    int       cbLine;
+
+    if (!trace.IsEnabled() ||
+        m_thresholdTicks == 0 ||
+        trace.m_ticks[PHASE_TOTAL] < m_thresholdTicks) {
+        RETURNERR(S_OK);
+    }
+
+    hr = FormatLine(trace,
+                    bstrURL,
+                    arrStylesheets,
+                    numStylesheets,
+                    hrRequest,
+                    bstrLine);
+    HRCHECK(FAILED(hr));
+
+    cbLine = WideCharToMultiByte(CP_UTF8, 0,
+                                 bstrLine, bstrLine.Length(),
+                                 NULL, 0,
+                                 NULL, NULL);
+    ERRCHECK(cbLine == 0, HRESULT_FROM_WIN32(GetLastError()));
+
+    pszLine = new char[cbLine];
+    ERRCHECK(pszLine == NULL, E_OUTOFMEMORY);
+
+    WideCharToMultiByte(CP_UTF8, 0,
+                        bstrLine, bstrLine.Length(),
+                        pszLine, cbLine,
+                        NULL, NULL);
+
+    hr = AppendToFile(pszLine, cbLine);
+    HRCHECK(FAILED(hr));
+
+    hr = S_OK;
+  Error:
+    delete [] pszLine;
+    return hr;
+}
+
+// ============================================================================
+// CSlowRequestLog::FormatLine
+//      One line of space-separated name=value pairs, times in
+//      microseconds:
+//        2000-01-31 12:34:56.789 total=... hr=... url=... device=...
+//        status=... source=... bytes-in=... bytes-out=... writes-out=...
+//        chain-cache=... sheets=a.xsl:hit,b.xsl:miss <phase>=...
+
+HRESULT
+CSlowRequestLog::FormatLine(
+    const CRequestTrace & trace,            // [in] What the request did
+    BSTR bstrURL,                           // [in] URL of the request
+    BSTR arrStylesheets[],                  // [in] Chain applied
+    short numStylesheets,                   // [in] Length of chain
+    HRESULT hrRequest,                      // [in] How the request ended
+    CComBSTR & bstrLine)                    // [out] Line to log
+{
+    HRESULT     hr;
+    SYSTEMTIME  st;
+    wchar_t     wszBuffer[160];
+    short       stage;
+    int         phase;
+
+    GetLocalTime(&st);
+
+    wsprintf(wszBuffer,
+             L"%04d-%02d-%02d %02d:%02d:%02d.%03d total=%lu hr=0x%08lx url=",
+             st.wYear, st.wMonth, st.wDay,
+             st.wHour, st.wMinute, st.wSecond, st.wMilliseconds,
+             TicksToMicroseconds(trace.m_ticks[PHASE_TOTAL]),
+             hrRequest);
+    hr = bstrLine.Append(wszBuffer);
+    HRCHECK(FAILED(hr));
+
+    if (bstrURL) {
+        hr = bstrLine.Append(bstrURL);
+        HRCHECK(FAILED(hr));
+    }
+
+    wsprintf(wszBuffer,
+             L" device=%d status=%s source=%s bytes-in=%lu bytes-out=%lu"
+             L" writes-out=%lu chain-cache=%d sheets=",
+             trace.m_device,
+             trace.m_bNotModified ? L"304" : L"200",
+             s_sourceLoadNames[trace.m_source],
+             trace.m_cbIn,
+             trace.m_cbOut,
+             trace.m_numWritesOut,
+             trace.m_chainCacheStages);
+    hr = bstrLine.Append(wszBuffer);
+    HRCHECK(FAILED(hr));
+
+    for (stage = 0; stage < numStylesheets; stage++) {
+        if (stage > 0) {
+            hr = bstrLine.Append(L",");
+            HRCHECK(FAILED(hr));
+        }
+
+        if (arrStylesheets[stage]) {
+            hr = bstrLine.Append(arrStylesheets[stage]);
+            HRCHECK(FAILED(hr));
+        }
+
+        hr = bstrLine.Append(L":");
+        HRCHECK(FAILED(hr));
+
+        hr = bstrLine.Append(s_sheetLoadNames[trace.m_sheetLoads[stage]]);
+        HRCHECK(FAILED(hr));
+    }
+
+    // PHASE_TOTAL went first.
+    for (phase = 0; phase < NUM_PHASES; phase++) {
+        if (phase == PHASE_TOTAL) {
+            continue;
+        }
+
+        wsprintf(wszBuffer,
+                 L" %s=%lu",
+                 CPhaseStatistics::GetPhaseName(static_cast<TransformPhase>(phase)),
+                 TicksToMicroseconds(trace.m_ticks[phase]));
+        hr = bstrLine.Append(wszBuffer);
+        HRCHECK(FAILED(hr));
+    }
+
+    hr = bstrLine.Append(L"\r\n");
+    HRCHECK(FAILED(hr));
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CSlowRequestLog::AppendToFile
+//      Starts a new file first if this line would take the current one
+//      past its size limit.
+
+HRESULT
+CSlowRequestLog::AppendToFile(
+    const char *pszLine,                    // [in] UTF-8 line
+    DWORD cbLine)                           // [in] Its length
+{
+    HRESULT  hr;
+    HANDLE   hFile = INVALID_HANDLE_VALUE;
+    DWORD    cbFile;
+    DWORD    cbWritten;
+    wchar_t  wszOld[MAX_PATH + 2];
+
+    Enter();
+
+    hFile = CreateFile(m_wszPath,
+                       GENERIC_WRITE,
+                       FILE_SHARE_READ,
+                       NULL,
+                       OPEN_ALWAYS,
+                       FILE_ATTRIBUTE_NORMAL,
+                       NULL);
+    ERRCHECK(hFile == INVALID_HANDLE_VALUE,
+             HRESULT_FROM_WIN32(GetLastError()));
+
+    cbFile = GetFileSize(hFile, NULL);
+    if (cbFile != 0xFFFFFFFF && cbFile > 0 && cbFile + cbLine > m_cbMax) {
+
+        CloseHandle(hFile);
+        hFile = INVALID_HANDLE_VALUE;
+
+        wsprintf(wszOld, L"%s.1", m_wszPath);
+        MoveFileEx(m_wszPath, wszOld, MOVEFILE_REPLACE_EXISTING);
+
+        hFile = CreateFile(m_wszPath,
+                           GENERIC_WRITE,
+                           FILE_SHARE_READ,
+                           NULL,
+                           OPEN_ALWAYS,
+                           FILE_ATTRIBUTE_NORMAL,
+                           NULL);
+        ERRCHECK(hFile == INVALID_HANDLE_VALUE,
+                 HRESULT_FROM_WIN32(GetLastError()));
+    }
+
+    SetFilePointer(hFile, 0, NULL, FILE_END);
+
+    ERRCHECK(!WriteFile(hFile, pszLine, cbLine, &cbWritten, NULL),
+             HRESULT_FROM_WIN32(GetLastError()));
+
+    hr = S_OK;
+  Error:
+    if (hFile != INVALID_HANDLE_VALUE) {
+        CloseHandle(hFile);
+    }
+    Leave();
+    return hr;
+}
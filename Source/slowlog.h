@@ -0,0 +1,68 @@
+// ============================================================================
+// FILE: slowlog.h
+//
+//      Log of requests that took longer than a threshold.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#pragma once
+
+// ============================================================================
+// CLASS: CSlowRequestLog
+//
+//      Writes one line per slow request, giving its CRequestTrace, to a
+//      text file.  When the file reaches its size limit it's renamed to
+//      <name>.1 (replacing the previous one) and a new file is started.
+//      Only slow requests pay for formatting and writing.
+
+class CSlowRequestLog
+{
+  public:
+    enum { DEFAULT_MAX_KB = 1024 };
+
+    CSlowRequestLog();
+    ~CSlowRequestLog();
+
+    // Log requests that take at least thresholdMs (0 turns the log
+    // off) to pwszPath (NULL for slowrequests.log next to the DLL),
+    // starting a new file once it reaches maxKB.
+    HRESULT Configure(long thresholdMs,
+                      const wchar_t *pwszPath,
+                      long maxKB);
+
+    bool IsEnabled() const {
+        return m_thresholdTicks != 0;
+    }
+
+    // Write the line for a request if it was slow.
+    HRESULT WriteIfSlow(const CRequestTrace & trace,
+                        BSTR bstrURL,
+                        BSTR arrStylesheets[],
+                        short numStylesheets,
+                        HRESULT hrRequest);
+
+  private:
+    HRESULT FormatLine(const CRequestTrace & trace,
+                       BSTR bstrURL,
+                       BSTR arrStylesheets[],
+                       short numStylesheets,
+                       HRESULT hrRequest,
+                       CComBSTR & bstrLine);
+    HRESULT AppendToFile(const char *pszLine, DWORD cbLine);
+    DWORD TicksToMicroseconds(LONGLONG ticks) const;
+
+    void Enter() {
+        EnterCriticalSection(&m_cs);
+    }
+
+    void Leave() {
+        LeaveCriticalSection(&m_cs);
+    }
+
+    LONGLONG          m_frequency;          // QueryPerformanceCounter ticks/s
+    LONGLONG          m_thresholdTicks;     // 0 if not logging
+    wchar_t           m_wszPath[MAX_PATH];
+    wchar_t           m_wszDefaultPath[MAX_PATH];
+    DWORD             m_cbMax;
+    CRITICAL_SECTION  m_cs;                 // serializes writes and Configure
+};
@@ -0,0 +1,165 @@
+//+---------------------------------------------------------------------------
+//
+//  Copyright (C) Microsoft Corporation, 1999-2000.
+//
+//  File:       sourcecache.cpp
+//
+//  Contents:   Implementation of CSourceInfoCache.  It's a fixed-size,
+//              direct-mapped table: each path hashes to one slot, and a
+//              new file simply replaces whatever was there.  A miss only
+//              costs a DOM load, so there's no need for anything
+//              smarter.
+//----------------------------------------------------------------------------
+#include "StdAfx.h"
+
+CSourceInfoCache::CSourceInfoCache()
+{
+    InitializeCriticalSection(&m_cs);
+    ::memset(m_slots, 0, sizeof(m_slots));
+}
+
+CSourceInfoCache::~CSourceInfoCache()
+{
+    for (UINT i = 0; i < NUM_SLOTS; i++) {
+        EmptySlot(&m_slots[i]);
+    }
+    DeleteCriticalSection(&m_cs);
+}
+
+// CSourceInfoCache::SlotFromPath
+//     Paths are compared without regard to case, so hash them that way
+//     too.
+
+UINT
+CSourceInfoCache::SlotFromPath(BSTR bstrPath)
+{
+    DWORD   hash = 2166136261;
+    wchar_t *pwch;
+
+    for (pwch = bstrPath; *pwch; pwch++) {
+        hash = (hash ^ towlower(*pwch)) * 16777619;
+    }
+
+    return hash % NUM_SLOTS;
+}
+
+void
+CSourceInfoCache::EmptySlot(Slot *pSlot)
+{
+    SysFreeString(pSlot->m_bstrPath);
+    SysFreeString(pSlot->m_bstrDoctypeName);
+    SysFreeString(pSlot->m_bstrPIContents);
+    ::memset(pSlot, 0, sizeof(*pSlot));
+}
+
+HRESULT
+CSourceInfoCache::Lookup(BSTR bstrPath,
+                         const XmlCacheInfo & info,
+                         CComBSTR & bstrDoctypeName,
+                         CComBSTR & bstrPIContents)
+{
+    HRESULT  hr = S_FALSE;
+    Slot    *pSlot;
+
+    ASSERT(bstrPath);
+
+    bstrDoctypeName.Empty();
+    bstrPIContents.Empty();
+
+    pSlot = &m_slots[SlotFromPath(bstrPath)];
+
+    Enter();
+
+    if (pSlot->m_bstrPath &&
+        lstrcmpiW(pSlot->m_bstrPath, bstrPath) == 0 &&
+        ::memcmp(&pSlot->m_info, &info, sizeof(info)) == 0) {
+
+        hr = S_OK;
+
+        if (pSlot->m_bstrDoctypeName) {
+            bstrDoctypeName = pSlot->m_bstrDoctypeName;
+            if (bstrDoctypeName.m_str == NULL) {
+                hr = E_OUTOFMEMORY;
+            }
+        }
+
+        if (pSlot->m_bstrPIContents) {
+            bstrPIContents = pSlot->m_bstrPIContents;
+            if (bstrPIContents.m_str == NULL) {
+                hr = E_OUTOFMEMORY;
+            }
+        }
+    }
+
+    Leave();
+
+    return hr;
+}
+
+HRESULT
+CSourceInfoCache::Add(BSTR bstrPath,
+                      const XmlCacheInfo & info,
+                      BSTR bstrDoctypeName,
+                      BSTR bstrPIContents)
+{
+    HRESULT  hr;
+    Slot     slot;
+    Slot     oldSlot;
+    Slot    *pSlot;
+
+    ASSERT(bstrPath);
+
+    // Build the new slot outside the lock.
+    ::memset(&slot, 0, sizeof(slot));
+    slot.m_info = info;
+
+    slot.m_bstrPath = SysAllocString(bstrPath);
+    ERRCHECK(slot.m_bstrPath == NULL, E_OUTOFMEMORY);
+
+    if (bstrDoctypeName) {
+        slot.m_bstrDoctypeName = SysAllocString(bstrDoctypeName);
+        ERRCHECK(slot.m_bstrDoctypeName == NULL, E_OUTOFMEMORY);
+    }
+
+    if (bstrPIContents) {
+        slot.m_bstrPIContents = SysAllocString(bstrPIContents);
+        ERRCHECK(slot.m_bstrPIContents == NULL, E_OUTOFMEMORY);
+    }
+
+    pSlot = &m_slots[SlotFromPath(bstrPath)];
+
+    Enter();
+    oldSlot = *pSlot;
+    *pSlot = slot;
+    Leave();
+
+    // The old contents are freed below, as though this had failed.
+    slot = oldSlot;
+
+    hr = S_OK;
+  Error:
+    EmptySlot(&slot);
+    return hr;
+}
+
+void
+CSourceInfoCache::Remove(BSTR bstrPath)
+{
+    Slot     slot;
+    Slot    *pSlot;
+
+    ASSERT(bstrPath);
+
+    ::memset(&slot, 0, sizeof(slot));
+    pSlot = &m_slots[SlotFromPath(bstrPath)];
+
+    Enter();
+    if (pSlot->m_bstrPath &&
+        lstrcmpiW(pSlot->m_bstrPath, bstrPath) == 0) {
+        slot = *pSlot;
+        ::memset(pSlot, 0, sizeof(*pSlot));
+    }
+    Leave();
+
+    EmptySlot(&slot);
+}
@@ -0,0 +1,63 @@
+//+---------------------------------------------------------------------------
+//
+//  Copyright (C) Microsoft Corporation, 1999-2000
+//
+//  File:       sourcecache.h
+//
+//  Contents:   Defines CSourceInfoCache, which remembers what Transform
+//              needs to know about a static XML file (its doctype and
+//              the contents of its <?xml-stylesheet?> processing
+//              instruction) for the version of the file last parsed.
+//              This lets a request be answered, e.g. with 304 Not
+//              Modified, without loading the file into a DOM.
+//----------------------------------------------------------------------------
+
+#pragma once
+
+class CSourceInfoCache
+{
+  public:
+    enum { NUM_SLOTS = 256 };
+
+    CSourceInfoCache();
+    ~CSourceInfoCache();
+
+    // Get the doctype and PI contents recorded for this version of the
+    // file.  Returns S_FALSE if nothing is known about this version.
+    HRESULT Lookup(BSTR bstrPath,                   // [in] full path of file
+                   const XmlCacheInfo & info,       // [in] version of file
+                   CComBSTR & bstrDoctypeName,      // [out] doctype, may be NULL
+                   CComBSTR & bstrPIContents);      // [out] PI contents, may be NULL
+
+    // Record the doctype and PI contents of this version of the file,
+    // replacing whatever shared its slot.
+    HRESULT Add(BSTR bstrPath,                      // [in] full path of file
+                const XmlCacheInfo & info,          // [in] version of file
+                BSTR bstrDoctypeName,               // [in] doctype, may be NULL
+                BSTR bstrPIContents);               // [in] PI contents, may be NULL
+
+    // Forget the file, e.g. because the version recorded for it could
+    // no longer be loaded.
+    void Remove(BSTR bstrPath);                     // [in] full path of file
+
+  private:
+    struct Slot {
+        BSTR          m_bstrPath;
+        XmlCacheInfo  m_info;
+        BSTR          m_bstrDoctypeName;
+        BSTR          m_bstrPIContents;
+    };
+
+    static UINT SlotFromPath(BSTR bstrPath);
+    static void EmptySlot(Slot *pSlot);
+    void Enter() {
+        EnterCriticalSection(&m_cs);
+    }
+
+    void Leave() {
+        LeaveCriticalSection(&m_cs);
+    }
+
+    Slot              m_slots[NUM_SLOTS];
+    CRITICAL_SECTION  m_cs;
+};
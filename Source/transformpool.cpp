@@ -0,0 +1,345 @@
+// ============================================================================
+// FILE: transformpool.cpp
+//
+//      Implementation of transform jobs and the transform pool.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#include "StdAfx.h"
+
+// ============================================================================
+// CTransformJob::CTransformJob
+
+CTransformJob::CTransformJob()
+{
+    m_firstStage = 0;
+    m_numStages = 0;
+    m_hr = E_PENDING;
+    m_failedStage = -1;
+    m_ref = 1;
+    m_claims = 0;
+    m_hDone = NULL;
+}
+
+CTransformJob::~CTransformJob()
+{
+    if (m_hDone) {
+        CloseHandle(m_hDone);
+    }
+}
+
+// ============================================================================
+// CTransformJob::Execute
+//      Go through each of the stylesheets, transforming into a new XML
+//      document, until the last one, when we transform into the output
+//      stream.
+//
+//      Each stage's result has to be a whole tree, however it's handed
+//      on: the next stylesheet's XPath can select anything in its
+//      input, from anywhere, so MSXML's processor works on a tree of
+//      it.  With a document as its output, the processor builds that
+//      tree as it goes, with nothing serialized and parsed again, which
+//      is all a SAX bridge between stages (IMXWriter into the next
+//      stage's ISAXContentHandler) could give; it would have to build
+//      the same tree.  What's left to save is creating the documents,
+//      so they come from the pool.
+
+void
+CTransformJob::Execute()
+{
+    HRESULT                   hr;
+    CComPtr<IXMLDOMDocument>  pcomDstDocs[2];
+    bool                      bDstDocShared[2] = { false, false };
+    IXMLDOMDocument          *pSrcDoc = m_pcomSrcDoc;
+    int                       dstDocIndex = 0;
+    CComVariant               varDstDoc;
+    short                     stylesheetIndex;
+
+    for (stylesheetIndex = m_firstStage;
+         stylesheetIndex < m_numStages;
+         stylesheetIndex++) {
+
+        ASSERT(m_pcomXslDocs[stylesheetIndex].p ||
+               m_pcomXslTemplates[stylesheetIndex].p);
+
+        if (stylesheetIndex == m_numStages - 1) {
+
+            // Write to the stream for the last one
+            varDstDoc = m_pcomOutput;
+
+        } else {
+
+            // Else write to a DOM document, but make sure the
+            // ping-pong buffers we use are set up initially.  They
+            // come from the document pool, so that we don't create
+            // new document objects on every request.  A document
+            // that went into the chain cache is shared with other
+            // requests, so it's replaced rather than overwritten.
+            if (pcomDstDocs[dstDocIndex].p == NULL ||
+                bDstDocShared[dstDocIndex]) {
+
+                pcomDstDocs[dstDocIndex].Release();
+                hr = g_documentPool->Acquire(pcomDstDocs[dstDocIndex]);
+                HRCHECK(FAILED(hr));
+            }
+
+            bDstDocShared[dstDocIndex] =
+                (m_bstrChainKeys[stylesheetIndex].m_str != NULL);
+            varDstDoc = pcomDstDocs[dstDocIndex];
+
+        }
+
+        if (m_pcomXslTemplates[stylesheetIndex].p) {
+
+            CComPtr<IXSLProcessor> pcomXslProc;
+            VARIANT_BOOL           done;
+            bool                   failed = false;
+
+            hr = m_pcomXslTemplates[stylesheetIndex]->createProcessor(&pcomXslProc);
+            HRCHECK(FAILED(hr));
+
+            hr = pcomXslProc->put_input(CComVariant(pSrcDoc));
+            HRCHECK(FAILED(hr));
+
+            hr = pcomXslProc->put_output(varDstDoc);
+            HRCHECK(FAILED(hr));
+
+            done = VARIANT_FALSE;
+            while (!failed && done == VARIANT_FALSE) {
+                hr = pcomXslProc->transform(&done);
+                if (FAILED(hr)) {
+                    failed = true;
+                }
+            }
+
+        } else {
+
+            hr = pSrcDoc->transformNodeToObject(m_pcomXslDocs[stylesheetIndex],
+                                                varDstDoc);
+
+        }
+
+        if (FAILED(hr)) {
+            // The error info is this thread's, so it's picked up here.
+            CComPtr<IErrorInfo> pcomErrInfo;
+
+            m_failedStage = stylesheetIndex;
+            if (::GetErrorInfo(0, &pcomErrInfo) == S_OK) {
+                pcomErrInfo->GetDescription(&m_bstrError);
+            }
+            RETURNERR(hr);
+        }
+
+        if (m_bstrChainKeys[stylesheetIndex].m_str != NULL) {
+            // Failing to cache the result doesn't fail the request.
+            g_chainCache->Add(m_bstrChainKeys[stylesheetIndex],
+                              pcomDstDocs[dstDocIndex]);
+        }
+
+        // Previous dest is source for the next one...
+        pSrcDoc = pcomDstDocs[dstDocIndex];
+
+        dstDocIndex = 1 - dstDocIndex; // toggle between 0 and 1.
+    }
+
+    hr = S_OK;
+  Error:
+    for (UINT i = 0; i < COUNTOF(pcomDstDocs); i++) {
+        if (!bDstDocShared[i]) {
+            g_documentPool->Return(pcomDstDocs[i]);
+        }
+    }
+    m_hr = hr;
+}
+
+// ============================================================================
+// CTransformJob::Run
+//      Unless the request has already given up on it.  Drops the pool's
+//      reference.
+
+void
+CTransformJob::Run()
+{
+    if (InterlockedIncrement(&m_claims) == 1) {
+        Execute();
+        SetEvent(m_hDone);
+    }
+    Release();
+}
+
+// ============================================================================
+// CTransformJob::CopyOutputTo
+//      The output is UTF-16, starting with a byte-order mark, which the
+//      processing stream expects on its own, as the first write.
+
+HRESULT
+CTransformJob::CopyOutputTo(IStream *pStream)   // [in] where it goes
+{
+    HRESULT   hr;
+    HGLOBAL   hGlobal;
+    STATSTG   statstg;
+    BYTE     *pb = NULL;
+    ULONG     cb;
+    ULONG     cbFirst = 0;
+
+    hr = m_pcomOutput->Stat(&statstg, STATFLAG_NONAME);
+    HRCHECK(FAILED(hr));
+
+    hr = GetHGlobalFromStream(m_pcomOutput, &hGlobal);
+    HRCHECK(FAILED(hr));
+
+    cb = statstg.cbSize.LowPart;
+    if (cb == 0) {
+        RETURNERR(S_OK);
+    }
+
+    pb = static_cast<BYTE *>(GlobalLock(hGlobal));
+    ERRCHECK(pb == NULL, E_OUTOFMEMORY);
+
+    if (cb >= sizeof(WCHAR) && *reinterpret_cast<WCHAR *>(pb) == L'\xFEFF') {
+        cbFirst = sizeof(WCHAR);
+        hr = pStream->Write(pb, cbFirst, NULL);
+        HRCHECK(FAILED(hr));
+    }
+
+    if (cb > cbFirst) {
+        hr = pStream->Write(pb + cbFirst, cb - cbFirst, NULL);
+        HRCHECK(FAILED(hr));
+    }
+
+    hr = S_OK;
+  Error:
+    if (pb) {
+        GlobalUnlock(hGlobal);
+    }
+    return hr;
+}
+
+// ============================================================================
+// CTransformPool::CTransformPool
+
+CTransformPool::CTransformPool() : m_pool(0)
+{
+    m_maxQueue = 1;
+    m_timeout = INFINITE;
+    m_numRun = 0;
+    m_numRejected = 0;
+    m_numCancelled = 0;
+    m_numAbandoned = 0;
+}
+
+// ============================================================================
+// CTransformPool::Configure
+
+HRESULT
+CTransformPool::Configure(
+    long nThreads,                          // [in] 0 to run on the request
+    long maxQueue,                          // [in] jobs allowed to wait (1 or more)
+    long timeout)                           // [in] ms a request waits, 0 for
+                                            //      as long as it takes
+{
+    m_maxQueue = (maxQueue > 0) ? maxQueue : 1;
+    m_timeout = (timeout > 0) ? timeout : INFINITE;
+    return m_pool.SetMaxThreads(nThreads);
+}
+
+// ============================================================================
+// CTransformPool::Admit
+
+bool
+CTransformPool::Admit()
+{
+    if (m_pool.IsEnabled() && m_pool.GetQueueLength() >= m_maxQueue) {
+        InterlockedIncrement(&m_numRejected);
+        return false;
+    }
+    return true;
+}
+
+// ============================================================================
+// CTransformPool::Run
+
+HRESULT
+CTransformPool::Run(
+    CTransformJob *pJob,                    // [in] the job
+    DWORD deadline)                         // [in] GetTickCount() to give up at
+{
+    HRESULT  hr;
+    long     remaining;
+    DWORD    wait = INFINITE;
+
+    hr = CreateStreamOnHGlobal(NULL, TRUE, &pJob->m_pcomOutput);
+    HRCHECK(FAILED(hr));
+
+    pJob->m_hDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+    ERRCHECK(pJob->m_hDone == NULL, HRESULT_FROM_WIN32(GetLastError()));
+
+    // The pool's reference, dropped by CTransformJob::Run().
+    pJob->AddRef();
+
+    if (m_pool.Queue(pJob) != S_OK) {
+        pJob->Release();
+        pJob->m_claims = 1;
+        pJob->Execute();
+        RETURNERR(S_OK);
+    }
+
+    if (m_timeout != INFINITE) {
+        remaining = static_cast<long>(deadline - GetTickCount());
+        wait = (remaining > 0) ? remaining : 0;
+    }
+
+    if (WaitForSingleObject(pJob->m_hDone, wait) != WAIT_OBJECT_0) {
+
+        // Cancel it if it hasn't started, and take it off the queue
+        // unless a thread has just taken it; if it has started, it
+        // finishes on its own, unless it just has.
+        if (InterlockedIncrement(&pJob->m_claims) == 1) {
+            if (m_pool.Remove(pJob)) {
+                pJob->Release();            // the pool's
+            }
+            InterlockedIncrement(&m_numCancelled);
+            RETURNERR(HRESULT_FROM_WIN32(ERROR_TIMEOUT));
+        }
+
+        if (WaitForSingleObject(pJob->m_hDone, 0) != WAIT_OBJECT_0) {
+            InterlockedIncrement(&m_numAbandoned);
+            RETURNERR(HRESULT_FROM_WIN32(ERROR_TIMEOUT));
+        }
+    }
+
+    InterlockedIncrement(&m_numRun);
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// ============================================================================
+// CTransformPool::AppendStatistics
+//      Appends <transform-pool threads="n" max-queue="n" queue="n"
+//      run="n" rejected="n" cancelled="n" abandoned="n"/> to bstrStats.
+
+HRESULT
+CTransformPool::AppendStatistics(CComBSTR & bstrStats)
+{
+    HRESULT hr;
+    wchar_t wszBuffer[200];
+
+    wsprintf(wszBuffer,
+             L"<transform-pool threads=\"%ld\" max-queue=\"%ld\" queue=\"%ld\" "
+             L"run=\"%ld\" rejected=\"%ld\" cancelled=\"%ld\" abandoned=\"%ld\"/>",
+             m_pool.GetThreadCount(),
+             m_maxQueue,
+             m_pool.GetQueueLength(),
+             m_numRun,
+             m_numRejected,
+             m_numCancelled,
+             m_numAbandoned);
+    hr = bstrStats.Append(wszBuffer);
+    HRCHECK(FAILED(hr));
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
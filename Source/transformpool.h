@@ -0,0 +1,134 @@
+// ============================================================================
+// FILE: transformpool.h
+//
+//      Running the stylesheets of a chain off the ASP request thread, on
+//      a bounded pool of threads, with a deadline.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#pragma once
+
+// ============================================================================
+// CLASS: CTransformJob
+//
+//      The stylesheets of a chain from m_firstStage on, applied to
+//      m_pcomSrcDoc, the last of them writing to m_pcomOutput.  It runs
+//      on the request thread with Execute(), or on the transform pool
+//      (see CTransformPool::Run).  It holds references to all it uses,
+//      so that a request that gives up waiting for it can go away while
+//      it finishes; it's reference counted for the same reason.
+//
+//      Nothing here touches the ASP objects or the XMLServerDocument,
+//      which belong to the request thread.  A failure is recorded in
+//      m_hr, with the stage that failed and the description from its
+//      error info, for the request to report.
+
+class CTransformJob : public CWorkItem
+{
+  public:
+    CTransformJob();
+
+    void AddRef() {
+        InterlockedIncrement(&m_ref);
+    }
+
+    void Release() {
+        if (InterlockedDecrement(&m_ref) == 0) {
+            delete this;
+        }
+    }
+
+    // Run the chain on this thread.
+    void Execute();
+
+    // Called on a pool thread.
+    virtual void Run();
+
+    // Write what the chain wrote to an in-memory m_pcomOutput (see
+    // CTransformPool::Run) to pStream, as the transform would have.
+    HRESULT CopyOutputTo(IStream *pStream);
+
+    // Inputs.
+    CComPtr<IXMLDOMDocument>  m_pcomSrcDoc;
+    short                     m_firstStage;
+    short                     m_numStages;     // the whole chain
+    CComPtr<IXMLDOMDocument>  m_pcomXslDocs[MAX_SHEETS_TO_CHAIN];
+    CComPtr<IXSLTemplate>     m_pcomXslTemplates[MAX_SHEETS_TO_CHAIN];
+    CComBSTR                  m_bstrChainKeys[MAX_SHEETS_TO_CHAIN];
+    CComPtr<IStream>          m_pcomOutput;
+
+    // Results.
+    HRESULT                   m_hr;
+    short                     m_failedStage;
+    CComBSTR                  m_bstrError;     // description, or NULL
+
+  private:
+    friend class CTransformPool;
+
+    ~CTransformJob();
+
+    LONG      m_ref;
+    LONG      m_claims;                        // first to claim it runs
+                                               // or cancels it
+    HANDLE    m_hDone;                         // set when run on the pool
+};
+
+// ============================================================================
+// CLASS: CTransformPool
+//
+//      Threads for running transforms, so that a few pathological
+//      stylesheets tie up these threads rather than all of ASP's.  Off
+//      (no threads) unless masterConfig turns it on.
+//
+//      Requests are turned away while more than the maximum number of
+//      jobs are waiting for a thread (see Admit()), and a request waits
+//      for its job only until its deadline.  A job that hasn't started
+//      by then is taken off the queue, so it no longer counts against
+//      admission; one that has is left to finish on its own, still
+//      holding its thread, which keeps admission honest about how busy
+//      the pool is.
+
+class CTransformPool
+{
+  public:
+    CTransformPool();
+
+    HRESULT Configure(long nThreads,        // 0 runs transforms on the request
+                      long maxQueue,        // jobs waiting before Admit() refuses
+                      long timeout);        // milliseconds a request waits
+
+    bool IsEnabled() const {
+        return m_pool.IsEnabled();
+    }
+
+    DWORD GetTimeout() const {
+        return m_timeout;
+    }
+
+    // Whether there's room for another request's job.  Requests that
+    // aren't are counted.
+    bool Admit();
+
+    // Run pJob on the pool, its output kept in memory, and wait for it
+    // until deadline (a GetTickCount() value).  S_OK once it's run, and
+    // HRESULT_FROM_WIN32(ERROR_TIMEOUT) if the deadline passed first.
+    // If no thread could take it, it's run here.
+    HRESULT Run(CTransformJob *pJob, DWORD deadline);
+
+    // Append <transform-pool> statistics to bstrStats.
+    HRESULT AppendStatistics(CComBSTR & bstrStats);
+
+    // See CWorkerPool::Shutdown.
+    bool Shutdown(DWORD timeout) {
+        return m_pool.Shutdown(timeout);
+    }
+
+  private:
+    CWorkerPool  m_pool;
+    long         m_maxQueue;
+    DWORD        m_timeout;
+    LONG         m_numRun;                  // jobs run on the pool
+    LONG         m_numRejected;             // requests Admit() refused
+    LONG         m_numCancelled;            // timed out before starting
+    LONG         m_numAbandoned;            // timed out while running
+};
@@ -0,0 +1,278 @@
+// ============================================================================
+// FILE: workerpool.cpp
+//
+//      Implementation of the worker thread pool.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#include "StdAfx.h"
+
+// ============================================================================
+// CWorkerPool::CWorkerPool
+
+CWorkerPool::CWorkerPool(
+    long maxThreads)                        // [in] Most threads to start
+{
+    InitializeCriticalSection(&m_cs);
+    m_pHead = NULL;
+    m_pTail = NULL;
+    m_queueLength = 0;
+    m_hSemaphore = CreateSemaphore(NULL, 0, LONG_MAX, NULL);
+    ::memset(m_hThreads, 0, sizeof(m_hThreads));
+    m_nThreads = 0;
+    m_maxThreads = 0;
+    m_bShutdown = false;
+    m_hModulePinned = NULL;
+    SetMaxThreads(maxThreads);
+}
+
+// ============================================================================
+// CWorkerPool::~CWorkerPool
+//      When the filter is terminated, ModuleGlobalUninitialize has
+//      already joined the threads with Shutdown().  Otherwise this is
+//      process detach: the loader lock is held, so the threads can't be
+//      waited for, but since they keep the DLL loaded that only happens
+//      when the process is exiting, and they're gone already.
+
+CWorkerPool::~CWorkerPool()
+{
+    Enter();
+    m_bShutdown = true;
+    Leave();
+
+    for (long i = 0; i < m_nThreads; i++) {
+        CloseHandle(m_hThreads[i]);
+    }
+
+    if (m_hSemaphore) {
+        CloseHandle(m_hSemaphore);
+    }
+    DeleteCriticalSection(&m_cs);
+}
+
+// ============================================================================
+// CWorkerPool::SetMaxThreads
+
+HRESULT
+CWorkerPool::SetMaxThreads(long maxThreads)
+{
+    if (maxThreads < 0) {
+        maxThreads = 0;
+    } else if (maxThreads > MAX_WORKER_THREADS) {
+        maxThreads = MAX_WORKER_THREADS;
+    }
+
+    Enter();
+    m_maxThreads = maxThreads;
+    Leave();
+
+    return S_OK;
+}
+
+// ============================================================================
+// CWorkerPool::Queue
+//      Add an item to the end of the queue and wake up a thread for it.
+//      Returns S_FALSE, without queueing the item, if no thread could be
+//      started.
+
+HRESULT
+CWorkerPool::Queue(CWorkItem *pItem)        // [in] Item to run
+{
+    HRESULT hr;
+
+    ASSERT(pItem);
+
+    Enter();
+
+    if (!m_bShutdown) {
+        EnsureThreads();
+    }
+
+    if (m_nThreads == 0 || m_bShutdown || m_hSemaphore == NULL) {
+        hr = S_FALSE;
+    } else {
+        pItem->m_pNextWorkItem = NULL;
+        if (m_pTail) {
+            m_pTail->m_pNextWorkItem = pItem;
+        } else {
+            m_pHead = pItem;
+        }
+        m_pTail = pItem;
+        m_queueLength++;
+        hr = S_OK;
+    }
+
+    Leave();
+
+    if (hr == S_OK) {
+        ReleaseSemaphore(m_hSemaphore, 1, NULL);
+    }
+
+    return hr;
+}
+
+// ============================================================================
+// CWorkerPool::Remove
+//      The item's wakeup is left; the thread it wakes finds nothing for
+//      it and waits again.
+
+bool
+CWorkerPool::Remove(CWorkItem *pItem)       // [in] Item to take off
+{
+    CWorkItem  *pPrev = NULL;
+    CWorkItem  *pCur;
+    bool        bRemoved = false;
+
+    Enter();
+
+    for (pCur = m_pHead; pCur; pCur = pCur->m_pNextWorkItem) {
+        if (pCur == pItem) {
+            if (pPrev) {
+                pPrev->m_pNextWorkItem = pCur->m_pNextWorkItem;
+            } else {
+                m_pHead = pCur->m_pNextWorkItem;
+            }
+            if (m_pTail == pCur) {
+                m_pTail = pPrev;
+            }
+            m_queueLength--;
+            bRemoved = true;
+            break;
+        }
+        pPrev = pCur;
+    }
+
+    Leave();
+
+    return bRemoved;
+}
+
+// ============================================================================
+// CWorkerPool::Shutdown
+
+bool
+CWorkerPool::Shutdown(DWORD timeout)        // [in] ms to wait for the threads
+{
+    DWORD dwWait;
+
+    Enter();
+    m_bShutdown = true;
+    Leave();
+
+    if (m_nThreads == 0) {
+        return true;
+    }
+
+    // One wakeup for each thread to find the queue empty and exit.
+    ReleaseSemaphore(m_hSemaphore, m_nThreads, NULL);
+
+    dwWait = WaitForMultipleObjects(m_nThreads, m_hThreads, TRUE, timeout);
+    if (dwWait == WAIT_TIMEOUT || dwWait == WAIT_FAILED) {
+        return false;
+    }
+
+    for (long i = 0; i < m_nThreads; i++) {
+        CloseHandle(m_hThreads[i]);
+        m_hThreads[i] = NULL;
+    }
+    m_nThreads = 0;
+
+    // Nothing is running in the DLL for the threads any more.
+    if (m_hModulePinned) {
+        FreeLibrary(m_hModulePinned);
+        m_hModulePinned = NULL;
+    }
+
+    return true;
+}
+
+// ============================================================================
+// CWorkerPool::EnsureThreads
+//      Start threads up to the current limit.  Must be called with the
+//      pool locked.
+
+void
+CWorkerPool::EnsureThreads()
+{
+    // The threads live until Shutdown() joins them, or if it's never
+    // called (or times out), until the process exits; either way the
+    // DLL mustn't be unloaded out from under them.  Shutdown() gives
+    // the reference back.
+    if (m_hModulePinned == NULL && m_nThreads < m_maxThreads) {
+        TCHAR szModule[MAX_PATH];
+
+        if (GetModuleFileName(_Module.GetModuleInstance(),
+                              szModule,
+                              COUNTOF(szModule))) {
+            m_hModulePinned = LoadLibrary(szModule);
+        }
+    }
+
+    while (m_hModulePinned != NULL && m_nThreads < m_maxThreads) {
+        DWORD  dwThreadId;
+        HANDLE hThread = CreateThread(NULL,
+                                      0,
+                                      ThreadProc,
+                                      this,
+                                      0,
+                                      &dwThreadId);
+        if (hThread == NULL) {
+            break;
+        }
+        m_hThreads[m_nThreads++] = hThread;
+    }
+}
+
+// ============================================================================
+// CWorkerPool::ThreadProc
+
+DWORD WINAPI
+CWorkerPool::ThreadProc(void *pv)           // [in] The pool
+{
+    HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+    static_cast<CWorkerPool*>(pv)->WorkerLoop();
+
+    if (SUCCEEDED(hr)) {
+        CoUninitialize();
+    }
+    return 0;
+}
+
+// ============================================================================
+// CWorkerPool::WorkerLoop
+//      Run queued items until the pool shuts down and the queue is
+//      empty.  Whoever queued an item is waiting for it, so the items
+//      left at shutdown are still run.  A wakeup with nothing queued
+//      before then is one left by Remove().
+
+void
+CWorkerPool::WorkerLoop()
+{
+    for (;;) {
+        CWorkItem *pItem = NULL;
+        bool       bExit;
+
+        WaitForSingleObject(m_hSemaphore, INFINITE);
+
+        Enter();
+        if (m_pHead) {
+            pItem = m_pHead;
+            m_pHead = pItem->m_pNextWorkItem;
+            if (m_pHead == NULL) {
+                m_pTail = NULL;
+            }
+            m_queueLength--;
+        }
+        bExit = (pItem == NULL && m_bShutdown);
+        Leave();
+
+        if (bExit) {
+            break;
+        }
+
+        if (pItem) {
+            pItem->Run();
+        }
+    }
+}
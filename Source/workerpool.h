@@ -0,0 +1,102 @@
+// ============================================================================
+// FILE: workerpool.h
+//
+//      Simple pool of worker threads for running work items in the
+//      background.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#pragma once
+
+// ============================================================================
+// CLASS: CWorkItem
+//
+//      Unit of work queued to a CWorkerPool.  Run() is called on a pool
+//      thread that has joined the multi-threaded apartment.  The item is
+//      owned by whoever queued it, and must stay alive until Run() has
+//      signalled its completion.
+
+class CWorkItem
+{
+  public:
+    CWorkItem() : m_pNextWorkItem(NULL) {}
+    virtual ~CWorkItem() {}
+
+    virtual void Run() = 0;
+
+  private:
+    friend class CWorkerPool;
+
+    CWorkItem *m_pNextWorkItem;             // queue link
+};
+
+// ============================================================================
+// CLASS: CWorkerPool
+//
+//      FIFO queue served by up to MAX_WORKER_THREADS threads.  Threads are
+//      started on first use and live until Shutdown(), or for the rest
+//      of the process.  While there are any, they hold a reference to
+//      the DLL, which Shutdown() releases once they've exited.
+
+class CWorkerPool
+{
+  public:
+    enum { MAX_WORKER_THREADS = 32 };
+
+    CWorkerPool(long maxThreads);
+    ~CWorkerPool();
+
+    // Raising the limit starts more threads on the next Queue(); lowering
+    // it doesn't stop threads that are already running.
+    HRESULT SetMaxThreads(long maxThreads);
+
+    bool IsEnabled() const {
+        return m_maxThreads > 0;
+    }
+
+    // Queue pItem to be run.  Returns S_FALSE if there are no threads to
+    // run it, in which case the caller should run it itself.
+    HRESULT Queue(CWorkItem *pItem);
+
+    // Take pItem off the queue, if it's still there.  Returns false if
+    // a thread has taken it already, in which case it's run.
+    bool Remove(CWorkItem *pItem);
+
+    // Stop taking items, run what's already queued, and wait up to
+    // timeout milliseconds for the threads to exit.  Returns false if
+    // some are still running, in which case neither the pool nor
+    // anything its items use may be deleted.  Must not be called with
+    // the loader lock held.
+    bool Shutdown(DWORD timeout);
+
+    long GetQueueLength() const {
+        return m_queueLength;
+    }
+
+    long GetThreadCount() const {
+        return m_nThreads;
+    }
+
+  private:
+    static DWORD WINAPI ThreadProc(void *pv);
+    void WorkerLoop();
+    void EnsureThreads();
+    void Enter() {
+        EnterCriticalSection(&m_cs);
+    }
+
+    void Leave() {
+        LeaveCriticalSection(&m_cs);
+    }
+
+    CWorkItem        *m_pHead;
+    CWorkItem        *m_pTail;
+    long              m_queueLength;
+    HANDLE            m_hSemaphore;
+    HANDLE            m_hThreads[MAX_WORKER_THREADS];
+    long              m_nThreads;
+    long              m_maxThreads;
+    bool              m_bShutdown;
+    HMODULE           m_hModulePinned;      // for the threads, or NULL
+    CRITICAL_SECTION  m_cs;
+};
@@ -11,10 +11,23 @@
 #include "StdAfx.h"
 #include "xmlcache.h"
 
+const long MAX_STYLESHEET_INCLUDES = 32;     // files followed per stylesheet
+const long MAX_INCLUDE_DEPTH = 8;            // nesting of includes followed
+
+static const wchar_t s_wszXSLTNamespace[] = L"http://www.w3.org/1999/XSL/Transform";
+
 /////////////////////////////////////////
 // CXmlCacheEntry
 /////////////////////////////////////////
 
+// A file that a cached stylesheet includes or imports, and the version
+// of it that was compiled in.
+struct XmlCacheInclude {
+    char     *m_pszPath;
+    FILETIME  m_ftLastWrite;
+    DWORD     m_nFileSize;
+};
+
 class CXmlCacheEntry : public IUnknown
 {
   public:
@@ -24,10 +37,17 @@ class CXmlCacheEntry : public IUnknown
         ::memset(&m_ftLastWrite, 0, sizeof(FILETIME));
         m_nFileSize = 0;
         m_lastUsed = ::GetTickCount();
+        m_pIncludes = NULL;
+        m_numIncludes = 0;
+        m_bIncludesUnknown = false;
     }
     
     CXmlCacheEntry::~CXmlCacheEntry() {
         SAFERELEASE(m_pUnk);
+        for (long i = 0; i < m_numIncludes; i++) {
+            delete [] m_pIncludes[i].m_pszPath;
+        }
+        delete [] m_pIncludes;
     }
 
     virtual HRESULT STDMETHODCALLTYPE QueryInterface( 
@@ -37,12 +57,12 @@ class CXmlCacheEntry : public IUnknown
     }
     
     virtual ULONG STDMETHODCALLTYPE AddRef(void) {
-        return ++m_ref;
+        return InterlockedIncrement(&m_ref);
     }
     
     virtual ULONG STDMETHODCALLTYPE Release(void) {
-        long result = --m_ref;
-        if (m_ref == 0) 
+        long result = InterlockedDecrement(&m_ref);
+        if (result == 0) 
             delete this;
         return result;
     }
@@ -50,13 +70,408 @@ class CXmlCacheEntry : public IUnknown
   private:
     friend class CXmlCache;
 
+    bool HasInclude(const char *pszPath) const;
+    HRESULT AddInclude(char *pszPath, const WIN32_FIND_DATAA & data);
+    HRESULT CollectIncludes(IXMLDOMDocument *pDoc, const char *pszPath, long depth);
+    HRESULT FollowInclude(IXMLDOMNode *pNode, const char *pszPath, long depth);
+    bool WrittenSince(const FILETIME & ft) const;
+    bool IncludesAreCurrent() const;
+    DWORD HashIncludes(bool bOnDisk) const;
+    void GetInfo(XmlCacheInfo *pInfo) const;
+
     long                    m_ref;
     IUnknown               *m_pUnk;
     FILETIME                m_ftLastWrite;
     DWORD                   m_nFileSize;
     DWORD                   m_lastUsed;
+    XmlCacheInclude        *m_pIncludes;
+    long                    m_numIncludes;
+    bool                    m_bIncludesUnknown; // some weren't followed
 };
 
+// ResolveInclude
+//     Turn the href of an xsl:include or xsl:import into the path of
+//     the file it names, relative to the directory of the including
+//     file.  Only plain relative paths are followed; returns S_FALSE
+//     for anything else (URLs, absolute paths, escapes, wildcards, or
+//     names outside the ANSI code page).  Caller is responsible for
+//     calling 'delete[]'.
+
+static HRESULT
+ResolveInclude(const char *pszBase,            // [in] path of including file
+               BSTR bstrHref,                  // [in] href attribute
+               char **ppszPath)                // [out] path of included file
+{
+    HRESULT     hr;
+    const char *pch;
+    char       *psz = NULL;
+    char       *pchPath;
+    int         cchDir = 0;
+    int         cchHref;
+    BOOL        bUsedDefault = FALSE;
+
+    *ppszPath = NULL;
+
+    if (bstrHref == NULL ||
+        bstrHref[0] == 0 ||
+        bstrHref[0] == L'/' ||
+        bstrHref[0] == L'\\' ||
+        wcspbrk(bstrHref, L":%#?*") != NULL) {
+        RETURNERR(S_FALSE);
+    }
+
+    for (pch = pszBase; *pch; pch++) {
+        if (*pch == '\\' || *pch == '/') {
+            cchDir = pch - pszBase + 1;
+        }
+    }
+
+    cchHref = ::WideCharToMultiByte(CP_ACP, 0, bstrHref, -1, NULL, 0, 0, 0);
+    ERRCHECK(cchHref == 0, HRESULT_FROM_WIN32(GetLastError()));
+
+    psz = new char[cchDir + cchHref + 1];
+    ERRCHECK(psz == NULL, E_OUTOFMEMORY);
+
+    ::memcpy(psz, pszBase, cchDir);
+    ::WideCharToMultiByte(CP_ACP, 0, bstrHref, -1,
+                          psz + cchDir, cchHref, NULL, &bUsedDefault);
+    psz[cchDir + cchHref] = 0;
+
+    if (bUsedDefault) {
+        RETURNERR(S_FALSE);
+    }
+
+    for (pchPath = psz + cchDir; *pchPath; pchPath++) {
+        if (*pchPath == '/') {
+            *pchPath = '\\';
+        }
+    }
+
+    *ppszPath = psz;
+    psz = NULL;
+
+    hr = S_OK;
+  Error:
+    delete [] psz;
+    return hr;
+}
+
+bool
+CXmlCacheEntry::HasInclude(const char *pszPath) const
+{
+    for (long i = 0; i < m_numIncludes; i++) {
+        if (lstrcmpiA(m_pIncludes[i].m_pszPath, pszPath) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// CXmlCacheEntry::AddInclude
+//     Record an included file and its version.  Takes ownership of
+//     pszPath.
+
+HRESULT
+CXmlCacheEntry::AddInclude(char *pszPath,                   // [in] path of included file
+                           const WIN32_FIND_DATAA & data)   // [in] its version
+{
+    HRESULT hr;
+
+    ASSERT(m_numIncludes < MAX_STYLESHEET_INCLUDES);
+
+    if (m_pIncludes == NULL) {
+        m_pIncludes = new XmlCacheInclude[MAX_STYLESHEET_INCLUDES];
+        if (m_pIncludes == NULL) {
+            delete [] pszPath;
+            RETURNERR(E_OUTOFMEMORY);
+        }
+    }
+
+    m_pIncludes[m_numIncludes].m_pszPath = pszPath;
+    m_pIncludes[m_numIncludes].m_ftLastWrite = data.ftLastWriteTime;
+    m_pIncludes[m_numIncludes].m_nFileSize = data.nFileSizeLow;
+    m_numIncludes++;
+
+    hr = S_OK;
+  Error:
+    return hr;
+}
+
+// CXmlCacheEntry::CollectIncludes
+//     Record every file the stylesheet pDoc (loaded from pszPath)
+//     includes or imports, and the files those include in turn, with
+//     the version of each.  Documents that aren't stylesheets have
+//     nothing to record.  Returns S_FALSE when some include can't be
+//     followed, so the version of what the stylesheet compiled from
+//     isn't known.
+
+HRESULT
+CXmlCacheEntry::CollectIncludes(IXMLDOMDocument *pDoc,      // [in] loaded document
+                                const char *pszPath,        // [in] file it came from
+                                long depth)                 // [in] nesting of pDoc
+{
+    HRESULT                 hr;
+    CComPtr<IXMLDOMElement> pcomRoot;
+    CComPtr<IXMLDOMNode>    pcomChild;
+    CComPtr<IXMLDOMNode>    pcomNext;
+    CComBSTR                bstrNamespace;
+    bool                    bAllFollowed = true;
+
+    hr = pDoc->get_documentElement(&pcomRoot);
+    HRCHECK(FAILED(hr));
+
+    if (pcomRoot.p == NULL) {
+        RETURNERR(S_OK);
+    }
+
+    hr = pcomRoot->get_namespaceURI(&bstrNamespace);
+    HRCHECK(FAILED(hr));
+
+    if (bstrNamespace.m_str == NULL ||
+        lstrcmpW(bstrNamespace, s_wszXSLTNamespace) != 0) {
+        RETURNERR(S_OK);
+    }
+
+    // xsl:include and xsl:import are only allowed at the top level.
+    hr = pcomRoot->get_firstChild(&pcomChild);
+    HRCHECK(FAILED(hr));
+
+    while (pcomChild.p != NULL) {
+
+        hr = FollowInclude(pcomChild, pszPath, depth);
+        HRCHECK(FAILED(hr));
+
+        if (hr == S_FALSE) {
+            bAllFollowed = false;
+        }
+
+        pcomNext.Release();
+        hr = pcomChild->get_nextSibling(&pcomNext);
+        HRCHECK(FAILED(hr));
+
+        pcomChild = pcomNext;
+    }
+
+    hr = bAllFollowed ? S_OK : S_FALSE;
+  Error:
+    return hr;
+}
+
+// CXmlCacheEntry::FollowInclude
+//     If pNode is an xsl:include or xsl:import, record the file it
+//     names and whatever that includes.  Returns S_FALSE if it can't
+//     be followed.
+
+HRESULT
+CXmlCacheEntry::FollowInclude(IXMLDOMNode *pNode,           // [in] top-level node
+                              const char *pszPath,          // [in] file it's in
+                              long depth)                   // [in] nesting of that file
+{
+    HRESULT                  hr;
+    DOMNodeType              nodeType;
+    CComBSTR                 bstrNamespace;
+    CComBSTR                 bstrName;
+    CComPtr<IXMLDOMElement>  pcomElement;
+    CComVariant              varHref;
+    char                    *pszIncluded = NULL;
+    WIN32_FIND_DATAA         data;
+    HANDLE                   h;
+    CComPtr<IXMLDOMDocument> pcomIncluded;
+
+    hr = pNode->get_nodeType(&nodeType);
+    HRCHECK(FAILED(hr));
+
+    if (nodeType != NODE_ELEMENT) {
+        RETURNERR(S_OK);
+    }
+
+    hr = pNode->get_namespaceURI(&bstrNamespace);
+    HRCHECK(FAILED(hr));
+
+    hr = pNode->get_baseName(&bstrName);
+    HRCHECK(FAILED(hr));
+
+    if (bstrNamespace.m_str == NULL ||
+        bstrName.m_str == NULL ||
+        lstrcmpW(bstrNamespace, s_wszXSLTNamespace) != 0 ||
+        (lstrcmpW(bstrName, L"include") != 0 &&
+         lstrcmpW(bstrName, L"import") != 0)) {
+        RETURNERR(S_OK);
+    }
+
+    hr = pNode->QueryInterface(IID_IXMLDOMElement,
+                               reinterpret_cast<void**>(&pcomElement));
+    HRCHECK(FAILED(hr));
+
+    hr = pcomElement->getAttribute(L"href", &varHref);
+    HRCHECK(FAILED(hr));
+
+    if (varHref.vt != VT_BSTR) {
+        RETURNERR(S_FALSE);
+    }
+
+    hr = ResolveInclude(pszPath, varHref.bstrVal, &pszIncluded);
+    if (hr != S_OK) {
+        RETURNERR(hr);
+    }
+
+    // Already recorded (which also stops include cycles).
+    if (HasInclude(pszIncluded)) {
+        RETURNERR(S_OK);
+    }
+
+    if (m_numIncludes >= MAX_STYLESHEET_INCLUDES ||
+        depth >= MAX_INCLUDE_DEPTH) {
+        RETURNERR(S_FALSE);
+    }
+
+    h = FindFirstFileA(pszIncluded, &data);
+    if (h == INVALID_HANDLE_VALUE) {
+        RETURNERR(S_FALSE);
+    }
+    FindClose(h);
+
+    hr = AddInclude(pszIncluded, data);
+    pszIncluded = NULL;
+    HRCHECK(FAILED(hr));
+
+    // The included file has to be parsed again to find what it
+    // includes; this only happens when the stylesheet is loaded.
+    hr = CreateXMLDocumentOnCComPtr(pcomIncluded);
+    HRCHECK(FAILED(hr));
+
+    hr = ReallyLoadXMLDocument(pcomIncluded,
+                               CComBSTR(m_pIncludes[m_numIncludes - 1].m_pszPath),
+                               varHref.bstrVal,
+                               false,
+                               NULL);
+    if (FAILED(hr)) {
+        RETURNERR(S_FALSE);
+    }
+
+    hr = CollectIncludes(pcomIncluded,
+                         m_pIncludes[m_numIncludes - 1].m_pszPath,
+                         depth + 1);
+    HRCHECK(FAILED(hr));
+
+  Error:
+    delete [] pszIncluded;
+    return hr;
+}
+
+// CXmlCacheEntry::WrittenSince
+//     Whether the stylesheet or any of its includes was last written
+//     at or after ft.
+
+bool
+CXmlCacheEntry::WrittenSince(const FILETIME & ft) const
+{
+    if (CompareFileTime(&m_ftLastWrite, &ft) >= 0) {
+        return true;
+    }
+
+    for (long i = 0; i < m_numIncludes; i++) {
+        if (CompareFileTime(&m_pIncludes[i].m_ftLastWrite, &ft) >= 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// CXmlCacheEntry::IncludesAreCurrent
+//     Whether every included file is still the version compiled in.
+
+bool
+CXmlCacheEntry::IncludesAreCurrent() const
+{
+    WIN32_FIND_DATAA data;
+    HANDLE           h;
+
+    for (long i = 0; i < m_numIncludes; i++) {
+
+        h = FindFirstFileA(m_pIncludes[i].m_pszPath, &data);
+        if (h == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        FindClose(h);
+
+        if (memcmp(&m_pIncludes[i].m_ftLastWrite,
+                   &data.ftLastWriteTime,
+                   sizeof(FILETIME)) != 0 ||
+            m_pIncludes[i].m_nFileSize != data.nFileSizeLow) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// CXmlCacheEntry::HashIncludes
+//     Hash the versions of the included files, either as recorded or
+//     as they are on disk now, into the dwIncludes of XmlCacheInfo.
+//     0 only when there are no includes.
+
+DWORD
+CXmlCacheEntry::HashIncludes(bool bOnDisk) const    // [in] versions on disk
+{
+    DWORD            hash = 2166136261;              // FNV-1a
+    WIN32_FIND_DATAA data;
+    HANDLE           h;
+    const BYTE      *pb;
+    UINT             cb;
+
+    if (m_numIncludes == 0) {
+        return 0;
+    }
+
+    for (long i = 0; i < m_numIncludes; i++) {
+
+        if (bOnDisk) {
+            h = FindFirstFileA(m_pIncludes[i].m_pszPath, &data);
+            if (h == INVALID_HANDLE_VALUE) {
+                ::memset(&data, 0, sizeof(data));
+            } else {
+                FindClose(h);
+            }
+        } else {
+            data.ftLastWriteTime = m_pIncludes[i].m_ftLastWrite;
+            data.nFileSizeLow = m_pIncludes[i].m_nFileSize;
+        }
+
+        pb = reinterpret_cast<const BYTE *>(&data.ftLastWriteTime);
+        for (cb = 0; cb < sizeof(FILETIME); cb++) {
+            hash = (hash ^ pb[cb]) * 16777619;
+        }
+
+        pb = reinterpret_cast<const BYTE *>(&data.nFileSizeLow);
+        for (cb = 0; cb < sizeof(DWORD); cb++) {
+            hash = (hash ^ pb[cb]) * 16777619;
+        }
+    }
+
+    return hash ? hash : 1;
+}
+
+// CXmlCacheEntry::GetInfo
+//     The version to report for what's cached: all zero when it isn't
+//     known.
+
+void
+CXmlCacheEntry::GetInfo(XmlCacheInfo *pInfo) const
+{
+    ::memset(pInfo, 0, sizeof(*pInfo));
+
+    if (m_bIncludesUnknown ||
+        (m_ftLastWrite.dwLowDateTime == 0 &&
+         m_ftLastWrite.dwHighDateTime == 0 &&
+         m_nFileSize == 0)) {
+        return;
+    }
+
+    pInfo->ftLastWrite = m_ftLastWrite;
+    pInfo->nFileSize = m_nFileSize;
+    pInfo->dwIncludes = HashIncludes(false);
+}
+
 /////////////////////////////////////////
 // CXmlCache
 /////////////////////////////////////////
@@ -90,6 +505,119 @@ CXmlCache::SetMinutes(long minutes)
     return S_OK;
 }
 
+// CXmlCache::Contains
+//     Whether there's an entry for the file.  Doesn't check whether
+//     the entry is up-to-date.
+
+bool
+CXmlCache::Contains(char *pszStylesheet)       // [in] full path to local file
+{
+    IUnknown *pUnk;
+    bool      bFound;
+
+    if (m_bCacheDisabled) {
+        return false;
+    }
+
+    Enter();
+    pUnk = m_table.find(pszStylesheet);
+    Leave();
+
+    bFound = (pUnk != NULL);
+    SAFERELEASE(pUnk);
+    return bFound;
+}
+
+// CXmlCache::GetIncludesVersion
+//     The dwIncludes part of the version Lookup would report for the
+//     file as it is on disk now, so that versions read with
+//     GetFileCacheInfo compare equal to those from Lookup.  0 unless
+//     the file is a cached stylesheet with includes.
+
+DWORD
+CXmlCache::GetIncludesVersion(const wchar_t *pwszFilename)  // [in] full path to local file
+{
+    CXmlCacheEntry *entry;
+    char           *pszFilename;
+    DWORD           dwIncludes;
+
+    if (m_bCacheDisabled) {
+        return 0;
+    }
+
+    pszFilename = WideToAscii(pwszFilename);
+    if (pszFilename == NULL) {
+        return 0;
+    }
+
+    Enter();
+    entry = (CXmlCacheEntry*)m_table.find(pszFilename);
+    Leave();
+
+    delete [] pszFilename;
+
+    if (entry == NULL) {
+        return 0;
+    }
+
+    dwIncludes = entry->HashIncludes(true);
+    SAFERELEASE(entry);
+    return dwIncludes;
+}
+
+// CXmlCache::GetCurrentInfo
+//     The version Lookup would report for the file, if the entry for
+//     it is up-to-date with what's on disk (including what it
+//     includes) and its version is known.  Returns S_FALSE, with a
+//     zeroed version, otherwise; nothing is loaded either way.
+
+HRESULT
+CXmlCache::GetCurrentInfo(char         *pszStylesheet,  // [in] full path to local file
+                          XmlCacheInfo *pInfo)          // [out] version of cached file
+{
+    HRESULT          hr;
+    CXmlCacheEntry  *entry = NULL;
+    WIN32_FIND_DATAA data;
+    HANDLE           h;
+
+    ::memset(pInfo, 0, sizeof(*pInfo));
+
+    if (m_bCacheDisabled) {
+        RETURNERR(S_FALSE);
+    }
+
+    Enter();
+    entry = (CXmlCacheEntry*)m_table.find(pszStylesheet);
+    Leave();
+
+    if (entry == NULL) {
+        RETURNERR(S_FALSE);
+    }
+
+    h = FindFirstFileA(pszStylesheet, &data);
+    if (h == INVALID_HANDLE_VALUE) {
+        RETURNERR(S_FALSE);
+    }
+    FindClose(h);
+
+    if (memcmp(&entry->m_ftLastWrite,
+               &data.ftLastWriteTime,
+               sizeof(FILETIME)) != 0 ||
+        entry->m_nFileSize != data.nFileSizeLow ||
+        !entry->IncludesAreCurrent()) {
+        RETURNERR(S_FALSE);
+    }
+
+    entry->GetInfo(pInfo);
+
+    hr = (pInfo->nFileSize != 0 ||
+          pInfo->ftLastWrite.dwLowDateTime != 0 ||
+          pInfo->ftLastWrite.dwHighDateTime != 0) ? S_OK : S_FALSE;
+  Error:
+    SAFERELEASE(entry);
+    return hr;
+}
+
 // CXmlCache::Lookup
 //     Lookup XML file in cache.  Be sure it's up-to-date.  If not, or 
 //     nonexistent, read from file.  Outgoing pointer is addref'd.
@@ -104,19 +632,30 @@ HRESULT
 CXmlCache::Lookup(char *pszStylesheet,                 // [in] full path to local file
                   wchar_t *pwszURL,                    // [in] user-meaningful URL
                   bool     bIsHTTPPath,                // [in] whether this is an http:// path
-                  CXMLServerDocument *pRequester,      // [in] request server object
+                  CXMLServerDocument *pRequester,      // [in] request server object,
+                                                       // or NULL not to report errors
 
                   // Only one of these two will be filled in.  If
                   // ppTemplateResult is non-NULL, we'll QI for an
                   // IXSLTemplate.  If that fails, or ppTemplateResult
                   // is NULL, we'll QI for the IXMLDOMDocument.
                   IXMLDOMDocument **ppDOMResult,        // [out] result, AddRef'd
-                  IXSLTemplate    **ppTemplateResult)   // [out] result, AddRef'd
+                  IXSLTemplate    **ppTemplateResult,   // [out] result, AddRef'd
+                  XmlCacheInfo     *pInfo,              // [out] optional, version of
+                                                        // the returned object
+                  bool             *pbCacheHit)         // [out] optional, whether it
+                                                        // came from the cache
 {
     HRESULT                         hr = S_OK;
     CComPtr<IUnknown>               pcomNewUnk;
+    CComPtr<IXMLDOMDocument>        pcomNewXML;
     WIN32_FIND_DATAA                data;
+    WIN32_FIND_DATAA                dataAfter;
+    FILETIME                        ftLoadStart;
     CXmlCacheEntry                 *entry = NULL;
+    CXmlCacheEntry                 *newEntry;
+    XmlCacheInfo                    info;
+    bool                            bAdded;
 
     bool bDoNotUseCache = bIsHTTPPath || m_bCacheDisabled;
 
@@ -124,6 +663,10 @@ CXmlCache::Lookup(char *pszStylesheet,                 // [in] full path to loca
     if (ppTemplateResult) {
         *ppTemplateResult = NULL;
     }
+    if (pbCacheHit) {
+        *pbCacheHit = false;
+    }
+    ::memset(&info, 0, sizeof(info));
 
     if (!bDoNotUseCache) {
 
@@ -143,9 +686,11 @@ CXmlCache::Lookup(char *pszStylesheet,                 // [in] full path to loca
         if (!filefound) {
             // Even if it's in the cache, say it's not there, since it's
             // no longer on disk.
-            pRequester->SetError(L"Resource not found",
-                                 pwszURL,
-                                 L"404 Not Found");
+            if (pRequester) {
+                pRequester->SetError(L"Resource not found",
+                                     pwszURL,
+                                     L"404 Not Found");
+            }
             RETURNERR(E_FAIL);
         }
     
@@ -156,8 +701,13 @@ CXmlCache::Lookup(char *pszStylesheet,                 // [in] full path to loca
             // ping more than once every 2 seconds.
             DWORD t = ::GetTickCount();
             if (entry->m_lastUsed + 2000 >= t) {
-                // use what we have !
+                // use what we have !  Report the version we loaded,
+                // which may be older than what's on disk now.
                 pcomNewUnk = entry->m_pUnk; // addref's, but will be released on destruction
+                entry->GetInfo(&info);
+                if (pbCacheHit) {
+                    *pbCacheHit = true;
+                }
                 RETURNERR(S_OK);  
             }
 
@@ -166,10 +716,15 @@ CXmlCache::Lookup(char *pszStylesheet,                 // [in] full path to loca
             if (memcmp(&entry->m_ftLastWrite,
                        &data.ftLastWriteTime,
                        sizeof(FILETIME)) == 0 &&
-                entry->m_nFileSize == data.nFileSizeLow) {
+                entry->m_nFileSize == data.nFileSizeLow &&
+                entry->IncludesAreCurrent()) {
 
                 // use what we have !
                 pcomNewUnk = entry->m_pUnk; // addref's, but will be released on destruction
+                entry->GetInfo(&info);
+                if (pbCacheHit) {
+                    *pbCacheHit = true;
+                }
                 RETURNERR(S_OK);
             }
 
@@ -180,9 +735,8 @@ CXmlCache::Lookup(char *pszStylesheet,                 // [in] full path to loca
 
     // Need a new object (so we don't clobber the existing
     // document in case it is still being used)
+    GetSystemTimeAsFileTime(&ftLoadStart);
     {
-        CComPtr<IXMLDOMDocument> pcomNewXML;
-        
         hr = CreateXMLDocumentOnCComPtr(pcomNewXML);
         HRCHECK(FAILED(hr));
 
@@ -204,7 +758,9 @@ CXmlCache::Lookup(char *pszStylesheet,                 // [in] full path to loca
                 hr = pcomTemplate->putref_stylesheet(pcomNewXML);
 
                 if (FAILED(hr)) {
-                    pRequester->SetErrorToLastCOMError(pwszURL);
+                    if (pRequester) {
+                        pRequester->SetErrorToLastCOMError(pwszURL);
+                    }
                     RETURNERR(hr);
                 }
                 
@@ -215,35 +771,56 @@ CXmlCache::Lookup(char *pszStylesheet,                 // [in] full path to loca
     }
 
     if (!bDoNotUseCache) {
-        
-        if (! entry) {
-            entry = new CXmlCacheEntry();
-            ERRCHECK(entry == NULL, E_OUTOFMEMORY);
 
-            entry->m_lastUsed = ::GetTickCount();
-            entry->m_pUnk = pcomNewUnk;
-            entry->m_pUnk->AddRef(); // addref for the hashtable entry
-        
-            // Need to lock the table while we update it.
-            Enter();
-            m_table.add(pszStylesheet, entry);
-            Leave();
-        
-        } else {
-        
-            // Now we are finished with old object.  Put the new one in, and
-            // release the old one.
-            IUnknown *pOldUnk =
-                reinterpret_cast<IUnknown *>(InterlockedExchange(
-                    reinterpret_cast<long*>(&entry->m_pUnk),
-                    reinterpret_cast<long>(pcomNewUnk.p)));
-            SAFERELEASE(pOldUnk);
-            entry->m_pUnk->AddRef(); // addref for the hashtable entry
+        // A new entry rather than updating the old one in place, since
+        // other requests may be reading it.
+        newEntry = new CXmlCacheEntry();
+        ERRCHECK(newEntry == NULL, E_OUTOFMEMORY);
+
+        SAFERELEASE(entry);
+        entry = newEntry;
+
+        entry->m_pUnk = pcomNewUnk;
+        entry->m_pUnk->AddRef(); // addref for the hashtable entry
+
+        // A stylesheet is only as fresh as what it includes.
+        hr = entry->CollectIncludes(pcomNewXML, pszStylesheet, 0);
+        HRCHECK(FAILED(hr));
+
+        entry->m_bIncludesUnknown = (hr == S_FALSE);
+
+        // Check the version again now that the load is done.  If the
+        // file changed, or it or anything it includes was written
+        // after the load began, what was loaded may not be the version
+        // on disk: the version is left unknown, so that nothing is
+        // cached against it and it's loaded again next time.
+        HANDLE h = FindFirstFileA(pszStylesheet, &dataAfter);
+        if (h != INVALID_HANDLE_VALUE) {
+            FindClose(h);
+
+            if (memcmp(&dataAfter.ftLastWriteTime,
+                       &data.ftLastWriteTime,
+                       sizeof(FILETIME)) == 0 &&
+                dataAfter.nFileSizeLow == data.nFileSizeLow) {
+
+                entry->m_ftLastWrite = data.ftLastWriteTime;
+                entry->m_nFileSize = data.nFileSizeLow;
+
+                if (entry->WrittenSince(ftLoadStart)) {
+                    ::memset(&entry->m_ftLastWrite, 0, sizeof(FILETIME));
+                    entry->m_nFileSize = 0;
+                }
+            }
         }
 
-        entry->m_ftLastWrite = data.ftLastWriteTime;
-        entry->m_nFileSize = data.nFileSizeLow;
+        // Need to lock the table while we update it.  This replaces
+        // any out of date entry.
+        Enter();
+        bAdded = m_table.add(pszStylesheet, entry);
+        Leave();
+        ERRCHECK(!bAdded, E_OUTOFMEMORY);
 
+        entry->GetInfo(&info);
     }
 
     hr = S_OK;
@@ -267,6 +844,10 @@ CXmlCache::Lookup(char *pszStylesheet,                 // [in] full path to loca
             HRCHECK(FAILED(hr));
             
         }
+
+        if (pInfo) {
+            *pInfo = info;
+        }
     }
     SAFERELEASE(entry);
     return hr;
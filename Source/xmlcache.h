@@ -13,6 +13,20 @@
 
 #include "hashtable.h"
 
+class CXMLServerDocument;
+
+// Version of a cached file: its last write time and size, and for a
+// stylesheet a hash of the versions of the files it xsl:include's or
+// xsl:import's (0 when there are none).  An all-zero ftLastWrite and
+// nFileSize means the version is unknown (http:// paths, includes that
+// can't be followed, files that changed while being loaded, or when
+// the cache is disabled).
+struct XmlCacheInfo {
+    FILETIME ftLastWrite;
+    DWORD    nFileSize;
+    DWORD    dwIncludes;
+};
+
 class CXmlCache
 {
   public:
@@ -21,19 +35,37 @@ class CXmlCache
 
     HRESULT SetMinutes(long minutes);
 
+    // Whether there's an entry for the file, without checking whether
+    // it's up-to-date.
+    bool Contains(char *pszStylesheet);
+
+    // The dwIncludes part of the version Lookup would report for the
+    // file as it is on disk now: 0 unless it's a cached stylesheet
+    // with includes.
+    DWORD GetIncludesVersion(const wchar_t *pwszFilename);
+
+    // The version Lookup would report for the file if it's cached and
+    // up-to-date, without loading anything.  S_FALSE otherwise.
+    HRESULT GetCurrentInfo(char *pszStylesheet, XmlCacheInfo *pInfo);
+
     // Lookup XML file in cache.  Be sure it's up-to-date.  If not, or
     // nonexistent, read from file.  Outgoing pointer is addref'd.
     HRESULT Lookup(char *stylesheet,                    // [in] full path to local file
                    wchar_t *pwszURL,                    // [in] user-meaningful URL
                    bool bIsHTTPPath,                    // [in] whether this is a http:// path
-                   CXMLServerDocument *pRequester,      // [in] request server object
+                   CXMLServerDocument *pRequester,      // [in] request server object,
+                                                        // or NULL not to report errors
 
                    // One of the next two will be output, the other
                    // NULL, depending on what's in the cache.  If the
                    // incoming ppTemplateResult is not NULL, we'll try
                    // to create a IXSLTemplate out of the document.
                    IXMLDOMDocument **ppDOMResult,     // [out] result, AddRef'd
-                   IXSLTemplate    **ppTemplateResult // [out] result, AddRef'd
+                   IXSLTemplate    **ppTemplateResult,// [out] result, AddRef'd
+                   XmlCacheInfo     *pInfo = NULL,    // [out] optional, version of
+                                                      // the returned object
+                   bool             *pbCacheHit = NULL// [out] optional, whether it
+                                                      // came from the cache
                    );  
 
   private:
@@ -39,7 +39,7 @@ BOOL WINAPI DllMain(HINSTANCE hInstance, DWORD dwReason, LPVOID /*lpReserved*/)
     } else if (dwReason == DLL_PROCESS_DETACH) {
         
         _Module.Term();
-        ModuleGlobalUninitialize();
+        ModuleGlobalUninitialize(true);
         
     }
     
@@ -122,14 +122,55 @@ SOURCE="$(InputPath)"
 # PROP Default_Filter "cpp;c;cxx;rc;def;r;odl;idl;hpj;bat"
 # Begin Source File
 
+SOURCE=.\arena.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\ASPPreprocessor.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\batch.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\browscap.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\browscapini.cpp
+# SUBTRACT CPP /YX /Yc /Yu
+# End Source File
+# Begin Source File
+
+SOURCE=.\browsercaps.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\bufferpool.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\chaincache.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\charset.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\deflate.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\docpool.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\errorpages.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\Global.cpp
 # End Source File
 # Begin Source File
@@ -142,6 +183,10 @@ SOURCE=.\IISFilter.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\phasestats.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\PIParse.cpp
 # End Source File
 # Begin Source File
@@ -154,16 +199,32 @@ SOURCE=.\ProcessingStream.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\slowlog.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\sourcecache.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\StdAfx.cpp
 # ADD BASE CPP /Yc"stdafx.h"
 # ADD CPP /Yc"stdafx.h"
 # End Source File
 # Begin Source File
 
+SOURCE=.\transformpool.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\Utils.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\workerpool.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\xmlcache.cpp
 # End Source File
 # Begin Source File
@@ -193,14 +254,54 @@ SOURCE=.\xslisapi2.rc
 # PROP Default_Filter "h;hpp;hxx;hm;inl"
 # Begin Source File
 
+SOURCE=.\arena.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\ASPPreprocessor.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\batch.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\browscap.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\browscapini.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\browsercaps.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\bufferpool.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\chaincache.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\charset.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\deflate.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\docpool.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\errorpages.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\Global.h
 # End Source File
 # Begin Source File
@@ -209,6 +310,10 @@ SOURCE=.\hashtable.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\phasestats.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\PIParse.h
 # End Source File
 # Begin Source File
@@ -217,18 +322,38 @@ SOURCE=.\PreProcessor.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\ProcessingStream.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\Resource.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\slowlog.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\sourcecache.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\StdAfx.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\transformpool.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\Utils.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\workerpool.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\xmlcache.h
 # End Source File
 # Begin Source File
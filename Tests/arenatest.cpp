@@ -0,0 +1,319 @@
+// ============================================================================
+// FILE: arenatest.cpp
+//
+//      Tests of CArena and CArenaBlockCache, and a count of the heap
+//      allocations a request's working state takes with and without
+//      them.
+//
+//      arenatest
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#include <new>
+#include <pthread.h>
+#include "StdAfx.h"
+#include "PIParse.h"
+
+// Freed when the test exits, as at process detach.
+static CArenaBlockCache s_arenaBlocks;
+CArenaBlockCache *g_arenaBlocks = &s_arenaBlocks;
+
+static int g_failures = 0;
+
+#define CHECK(expr)                                                     \
+    if (!(expr)) {                                                      \
+        printf("%s(%d): CHECK(%s) failed\n", __FILE__, __LINE__, #expr); \
+        g_failures++;                                                   \
+    }
+
+// ============================================================================
+// Heap allocations, counted
+
+static volatile LONG g_heapAllocations = 0;
+
+void *
+operator new(size_t cb) throw (std::bad_alloc)
+{
+    void *pv = malloc(cb ? cb : 1);
+
+    if (pv == NULL) {
+        throw std::bad_alloc();
+    }
+    InterlockedIncrement(&g_heapAllocations);
+    return pv;
+}
+
+void *
+operator new[](size_t cb) throw (std::bad_alloc)
+{
+    return operator new(cb);
+}
+
+void
+operator delete(void *pv) throw ()
+{
+    free(pv);
+}
+
+void
+operator delete[](void *pv) throw ()
+{
+    free(pv);
+}
+
+// A statistic from <arena .../>.
+static long
+GetArenaStatistic(const char *pszName)
+{
+    CComBSTR    bstrStats;
+    char        szStats[200];
+    const char *psz;
+
+    g_arenaBlocks->AppendStatistics(bstrStats);
+    WideCharToMultiByte(CP_ACP, 0, bstrStats.m_str, -1,
+                        szStats, sizeof(szStats), NULL, NULL);
+    psz = strstr(szStats, pszName);
+    if (psz == NULL) {
+        return -1;
+    }
+    return strtol(psz + strlen(pszName) + 2, NULL, 10);
+}
+
+// ============================================================================
+// TestArena
+
+static void
+TestArena()
+{
+    CArena      arena;
+    void       *pv;
+    wchar_t    *pwsz;
+    BSTR        bstr;
+    char       *psz;
+    LONG        before;
+    int         i;
+
+    // Alignment, and strings laid out as they should be.
+    for (i = 1; i < 40; i++) {
+        pv = arena.Alloc(i);
+        CHECK(pv != NULL && reinterpret_cast<size_t>(pv) % 8 == 0);
+    }
+
+    pwsz = arena.CopyString(L"stylesheet.xsl and more", 14);
+    CHECK(lstrcmp(pwsz, L"stylesheet.xsl") == 0);
+
+    bstr = arena.AllocBSTR(L"href");
+    CHECK(bstr != NULL && reinterpret_cast<DWORD *>(bstr)[-1] == 4 * sizeof(wchar_t));
+    CHECK(lstrcmp(bstr, L"href") == 0);
+    CHECK(arena.AllocBSTR(NULL) == NULL);
+
+    psz = arena.WideToAscii(L"c:\\inetpub\\wwwroot\\a.xsl");
+    CHECK(strcmp(psz, "c:\\inetpub\\wwwroot\\a.xsl") == 0);
+
+    // Enough to need more blocks, and one too big to share a block.
+    for (i = 0; i < 10; i++) {
+        CHECK(arena.Alloc(CArena::MAX_SMALL_ALLOCATION) != NULL);
+    }
+    pv = arena.Alloc(CArena::BLOCK_SIZE * 2);
+    CHECK(pv != NULL);
+    memset(pv, 0xCC, CArena::BLOCK_SIZE * 2);
+
+    arena.Reset();
+
+    // The blocks are on this thread's list now, so another round like
+    // the first doesn't go to the heap.
+    before = g_heapAllocations;
+    for (i = 0; i < 4; i++) {
+        CHECK(arena.Alloc(CArena::MAX_SMALL_ALLOCATION) != NULL);
+    }
+    CHECK(g_heapAllocations == before);
+    arena.Reset();
+}
+
+// ============================================================================
+// TestExitedThreads
+//      The lists of threads that have exited are freed when another
+//      thread makes one.
+
+static void *
+UseArena(void *)
+{
+    CArena arena;
+    int    i;
+
+    for (i = 0; i < 12; i++) {
+        arena.Alloc(CArena::MAX_SMALL_ALLOCATION);
+    }
+    arena.Reset();
+    return NULL;
+}
+
+static void
+TestExitedThreads()
+{
+    pthread_t   thread;
+    long        reclaimed = GetArenaStatistic("blocks-reclaimed");
+    long        blocks = GetArenaStatistic("blocks-allocated") +
+                         GetArenaStatistic("blocks-reused");
+
+    pthread_create(&thread, NULL, UseArena, NULL);
+    pthread_join(thread, NULL);
+
+    // All of them on its list, still.
+    blocks = GetArenaStatistic("blocks-allocated") +
+             GetArenaStatistic("blocks-reused") - blocks;
+    CHECK(blocks > 1 && blocks <= CArenaBlockCache::MAX_FREE_PER_THREAD);
+    CHECK(GetArenaStatistic("blocks-reclaimed") == reclaimed);
+
+    // This one's list sweeps up the first's.
+    pthread_create(&thread, NULL, UseArena, NULL);
+    pthread_join(thread, NULL);
+
+    CHECK(GetArenaStatistic("blocks-reclaimed") == reclaimed + blocks);
+}
+
+// ============================================================================
+// Allocations per request
+//      The working state of a request for a page whose PI has three
+//      attributes and whose chain has three stylesheets: the PI's
+//      names and values, the stylesheet hrefs, and the paths converted
+//      for the XML cache (the server-config, twice, and each
+//      stylesheet).
+
+static wchar_t s_wszPI[] =
+    L"type=\"text/xsl\" server-config=\"sampleB-Config.xml\" href=\"sampleB-IE5.xsl\"";
+
+static const wchar_t *s_apwszStylesheets[] = {
+    L"removeApples.xsl", L"removeBananas.xsl", L"sampleB-IE5.xsl"
+};
+
+static const wchar_t *s_apwszPaths[] = {
+    L"c:\\inetpub\\wwwroot\\xslisapi\\Samples\\sampleB\\sampleB-Config.xml",
+    L"c:\\inetpub\\wwwroot\\xslisapi\\Samples\\sampleB\\sampleB-Config.xml",
+    L"c:\\inetpub\\wwwroot\\xslisapi\\Samples\\sampleB\\removeApples.xsl",
+    L"c:\\inetpub\\wwwroot\\xslisapi\\Samples\\sampleB\\removeBananas.xsl",
+    L"c:\\inetpub\\wwwroot\\xslisapi\\Samples\\sampleB\\sampleB-IE5.xsl"
+};
+
+// As the request did it before the arena: a heap block for each PI
+// name and value and for the attribute array (PIParseInfo), for each
+// href (a CComBSTR each), and for each path (WideToAscii).
+static void
+RequestWithoutArena()
+{
+    wchar_t    *apwszPI[7];
+    wchar_t    *apwszHrefs[COUNTOF(s_apwszStylesheets)];
+    char       *apszPaths[COUNTOF(s_apwszPaths)];
+    size_t      i;
+
+    apwszPI[0] = new wchar_t[5];            // the attribute array
+    for (i = 1; i < COUNTOF(apwszPI); i++) {
+        apwszPI[i] = new wchar_t[32];
+    }
+
+    for (i = 0; i < COUNTOF(apwszHrefs); i++) {
+        apwszHrefs[i] = new wchar_t[lstrlen(s_apwszStylesheets[i]) + 3];
+        lstrcpy(apwszHrefs[i] + 2, s_apwszStylesheets[i]);
+    }
+
+    for (i = 0; i < COUNTOF(apszPaths); i++) {
+        apszPaths[i] = new char[lstrlen(s_apwszPaths[i]) + 1];
+        WideCharToMultiByte(CP_ACP, 0, s_apwszPaths[i], -1,
+                            apszPaths[i], lstrlen(s_apwszPaths[i]) + 1,
+                            NULL, NULL);
+    }
+
+    for (i = 0; i < COUNTOF(apwszPI); i++) {
+        delete [] apwszPI[i];
+    }
+    for (i = 0; i < COUNTOF(apwszHrefs); i++) {
+        delete [] apwszHrefs[i];
+    }
+    for (i = 0; i < COUNTOF(apszPaths); i++) {
+        delete [] apszPaths[i];
+    }
+}
+
+// As CXMLServerDocument::TransformTo does it now.
+static void
+RequestWithArena(CArena & arena, PIParseInfo & piParseInfo)
+{
+    size_t i;
+
+    CHECK(piParseInfo.Parse(s_wszPI, arena) == S_OK);
+    CHECK(piParseInfo.Find(const_cast<wchar_t *>(L"server-config")) != NULL);
+
+    for (i = 0; i < COUNTOF(s_apwszStylesheets); i++) {
+        CHECK(arena.AllocBSTR(s_apwszStylesheets[i]) != NULL);
+    }
+
+    for (i = 0; i < COUNTOF(s_apwszPaths); i++) {
+        CHECK(arena.WideToAscii(s_apwszPaths[i]) != NULL);
+    }
+
+    piParseInfo.Clear();
+    arena.Reset();
+}
+
+static void *
+ReportAllocationsPerRequest(void *)
+{
+    const int   numRequests = 1000;
+    CArena      arena;
+    PIParseInfo piParseInfo;
+    LONG        start;
+    LONG        first;
+    LONG        without;
+    LONG        with;
+    int         i;
+
+    start = g_heapAllocations;
+    for (i = 0; i < numRequests; i++) {
+        RequestWithoutArena();
+    }
+    without = g_heapAllocations - start;
+
+    start = g_heapAllocations;
+    RequestWithArena(arena, piParseInfo);
+    first = g_heapAllocations - start;
+
+    start = g_heapAllocations;
+    for (i = 1; i < numRequests; i++) {
+        RequestWithArena(arena, piParseInfo);
+    }
+    with = g_heapAllocations - start;
+
+    printf("arenatest: heap allocations per request (PI of 3 attributes, "
+           "3 stylesheets, 5 paths):\n"
+           "    without the arena         %.2f\n"
+           "    with it, thread's first   %ld\n"
+           "    with it, after that       %.2f\n",
+           static_cast<double>(without) / numRequests,
+           static_cast<long>(first),
+           static_cast<double>(with) / (numRequests - 1));
+
+    CHECK(with == 0);
+    return NULL;
+}
+
+int
+main()
+{
+    pthread_t thread;
+
+    TestArena();
+    TestExitedThreads();
+
+    // On a thread of its own, which starts without blocks, as a
+    // request thread does.
+    pthread_create(&thread, NULL, ReportAllocationsPerRequest, NULL);
+    pthread_join(thread, NULL);
+
+    if (g_failures) {
+        printf("arenatest: %d failed\n", g_failures);
+        return 1;
+    }
+
+    printf("arenatest: passed\n");
+    return 0;
+}
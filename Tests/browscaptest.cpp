@@ -0,0 +1,240 @@
+// ============================================================================
+// FILE: browscaptest.cpp
+//
+//      Tests of CBrowscapIni against browscap.ini (a cut-down copy, in
+//      this directory) and the browscap-add.ini shipped with XSLISAPI.
+//
+//      browscaptest <browscap.ini> <browscap-add.ini>
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+#include "browscapini.h"
+
+static int g_failures = 0;
+
+#define CHECK(expr)                                                     \
+    if (!(expr)) {                                                      \
+        printf("%s(%d): CHECK(%s) failed\n", __FILE__, __LINE__, #expr); \
+        g_failures++;                                                   \
+    }
+
+// ============================================================================
+// AddFile
+//      Add an ASCII file to the database, as CBrowscapDatabase does with
+//      CP_ACP.
+
+static bool
+AddFile(CBrowscapIni & ini, const char *pszPath)
+{
+    FILE     *pFile;
+    wchar_t  *pwchText;
+    long      cb;
+    long      i;
+    int       ch;
+    bool      bAdded;
+
+    pFile = fopen(pszPath, "rb");
+    if (pFile == NULL) {
+        printf("can't open %s\n", pszPath);
+        return false;
+    }
+
+    fseek(pFile, 0, SEEK_END);
+    cb = ftell(pFile);
+    fseek(pFile, 0, SEEK_SET);
+
+    pwchText = new wchar_t[cb + 1];
+    for (i = 0; i < cb && (ch = fgetc(pFile)) != EOF; i++) {
+        pwchText[i] = static_cast<wchar_t>(static_cast<unsigned char>(ch));
+    }
+    fclose(pFile);
+
+    bAdded = ini.AddText(pwchText, static_cast<unsigned>(i));
+    delete [] pwchText;
+    return bAdded;
+}
+
+static bool
+AddString(CBrowscapIni & ini, const wchar_t *pwszText)
+{
+    return ini.AddText(pwszText, static_cast<unsigned>(wcslen(pwszText)));
+}
+
+// Whether the User-Agent's section has the property, with that value.
+static bool
+HasProperty(const CBrowscapIni & ini,
+            const wchar_t *pwszUserAgent,
+            const wchar_t *pwszName,
+            const wchar_t *pwszValue)
+{
+    const wchar_t *pwszFound;
+
+    pwszFound = ini.GetProperty(ini.Match(pwszUserAgent), pwszName);
+    if (pwszValue == NULL) {
+        return pwszFound == NULL;
+    }
+    return pwszFound != NULL && wcscmp(pwszFound, pwszValue) == 0;
+}
+
+// ============================================================================
+// TestShippedFiles
+//      browscap-add.ini loaded ahead of browscap.ini, as CBrowscapDatabase
+//      loads them.
+
+static void
+TestShippedFiles(const char *pszBrowscap, const char *pszAdditions)
+{
+    CBrowscapIni ini;
+
+    CHECK(AddFile(ini, pszAdditions));
+    CHECK(AddFile(ini, pszBrowscap));
+    CHECK(ini.Compile());
+
+    // Sections of the additions file, named exactly.
+    CHECK(HasProperty(ini, L"UP.Browser/3.1-UPG1 UP.Link/3.2",
+                      L"browser", L"Phone.com simulator"));
+    CHECK(HasProperty(ini, L"UP.Browser/3.1-UPG1 UP.Link/3.2",
+                      L"content-type", L"text/vnd.wap.wml"));
+    CHECK(HasProperty(ini, L"UP.Browser/3.0-UPG1 UP.Link/3.1",
+                      L"target-markup", L"HDML 3.0"));
+    CHECK(HasProperty(ini, L"WapIDE-SDK/2.0; (R320s (Arial))",
+                      L"browser", L"Ericsson R320s"));
+
+    // Without regard to case, in the User-Agent and property names.
+    CHECK(HasProperty(ini, L"up.browser/3.0-upg1 UP.LINK/3.2",
+                      L"TARGET-MARKUP", L"WML1.0"));
+
+    // What the additions don't say comes from the default settings.
+    CHECK(HasProperty(ini, L"UP.Browser/3.1-UPG1 UP.Link/3.2",
+                      L"frames", L"FALSE"));
+
+    // A section's own properties win over its parent's.
+    CHECK(HasProperty(ini, L"Mozilla/4.0 (compatible; MSIE 5.01; Windows NT 5.0)",
+                      L"minorver", L"01"));
+    CHECK(HasProperty(ini, L"Mozilla/4.0 (compatible; MSIE 5.01; Windows NT 5.0)",
+                      L"platform", L"Win2000"));
+    CHECK(HasProperty(ini, L"Mozilla/4.0 (compatible; MSIE 5.01; Windows NT 5.0)",
+                      L"javascript", L"TRUE"));
+
+    // '*' and '?' wildcards.
+    CHECK(HasProperty(ini, L"Mozilla/4.0 (compatible; MSIE 5.5; Windows NT 4.0)",
+                      L"platform", L"WinNT"));
+    CHECK(HasProperty(ini, L"Mozilla/4.0 (compatible; MSIE 5.5; Windows NT 4.0)",
+                      L"browser", L"IE"));
+    CHECK(HasProperty(ini, L"Mozilla/4.7 [en] (Win95; I)",
+                      L"version", L"4.7"));
+    CHECK(HasProperty(ini, L"Mozilla/4.7 [en] (Win95; I)",
+                      L"tables", L"TRUE"));
+    CHECK(HasProperty(ini, L"Mozilla/4.7 [en] (Win95; II)",
+                      L"browser", L"Unknown"));
+
+    // Anything else, even nothing at all, falls to [*].
+    CHECK(HasProperty(ini, L"Lynx/2.8", L"browser", L"Unknown"));
+    CHECK(HasProperty(ini, L"Lynx/2.8", L"content-type", L"text/html"));
+    CHECK(HasProperty(ini, L"", L"browser", L"Unknown"));
+    CHECK(HasProperty(ini, L"Lynx/2.8", L"no-such-property", NULL));
+
+    CHECK(ini.GetProperty(-1, L"browser") == NULL);
+    CHECK(ini.GetSectionName(-1) == NULL);
+    CHECK(wcscmp(ini.GetSectionName(ini.Match(L"UP.Browser/3.0-UPG1 UP.Link/3.1")),
+                 L"up.browser/3.0-upg1 up.link/3.1") == 0);
+}
+
+// ============================================================================
+// TestAdditionsFirst
+//      A wildcard section of the additions file has to be tried before
+//      browscap.ini's [*], or it would never match anything.
+
+static void
+TestAdditionsFirst(const char *pszBrowscap)
+{
+    static const wchar_t s_wszAdditions[] =
+        L"[Nokia7110/1.0 *]\r\n"
+        L"browser=Nokia 7110\r\n"
+        L"target-markup=WML1.1\r\n"
+        L"[IE 5.0]\r\n"
+        L"browser=IE (patched)\r\n";
+
+    CBrowscapIni ini;
+    CBrowscapIni iniAfter;
+
+    CHECK(AddString(ini, s_wszAdditions));
+    CHECK(AddFile(ini, pszBrowscap));
+    CHECK(ini.Compile());
+
+    CHECK(HasProperty(ini, L"Nokia7110/1.0 (04.94)", L"browser", L"Nokia 7110"));
+    CHECK(HasProperty(ini, L"Nokia7110/1.0 (04.94)", L"frames", L"FALSE"));
+
+    // A section the additions file redefines is theirs, parent= too.
+    CHECK(HasProperty(ini, L"Mozilla/4.0 (compatible; MSIE 5.5; Windows NT 4.0)",
+                      L"browser", L"IE (patched)"));
+    CHECK(HasProperty(ini, L"Mozilla/4.0 (compatible; MSIE 5.5; Windows NT 4.0)",
+                      L"tables", L"TRUE"));
+
+    // Added the other way round, [*] gets there first.
+    CHECK(AddFile(iniAfter, pszBrowscap));
+    CHECK(AddString(iniAfter, s_wszAdditions));
+    CHECK(iniAfter.Compile());
+
+    CHECK(HasProperty(iniAfter, L"Nokia7110/1.0 (04.94)", L"browser", L"Unknown"));
+}
+
+// ============================================================================
+// TestOddFiles
+
+static void
+TestOddFiles()
+{
+    CBrowscapIni ini;
+    CBrowscapIni iniEmpty;
+
+    // Sections that are each other's parent, lines that aren't
+    // properties, and properties before any section.
+    CHECK(AddString(ini,
+                    L"orphan=1\n"
+                    L"  [A]  \n"
+                    L"parent=B\n"
+                    L"a = 1 \n"
+                    L"not a property\n"
+                    L"; a = 2\n"
+                    L"[B]\n"
+                    L"parent=A\n"
+                    L"b=2\n"
+                    L"[C\n"
+                    L"c=3\n"));
+    CHECK(ini.Compile());
+
+    CHECK(HasProperty(ini, L"a", L"a", L"1"));
+    CHECK(HasProperty(ini, L"a", L"b", L"2"));
+    CHECK(HasProperty(ini, L"b", L"a", L"1"));
+    CHECK(HasProperty(ini, L"a", L"orphan", NULL));
+    CHECK(HasProperty(ini, L"b", L"c", L"3"));
+    CHECK(ini.Match(L"c") == -1);
+
+    CHECK(iniEmpty.Compile());
+    CHECK(iniEmpty.Match(L"Mozilla/4.0") == -1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc != 3) {
+        printf("usage: browscaptest <browscap.ini> <browscap-add.ini>\n");
+        return 2;
+    }
+
+    TestShippedFiles(argv[1], argv[2]);
+    TestAdditionsFirst(argv[1]);
+    TestOddFiles();
+
+    if (g_failures) {
+        printf("browscaptest: %d failed\n", g_failures);
+        return 1;
+    }
+
+    printf("browscaptest: passed\n");
+    return 0;
+}
@@ -0,0 +1,286 @@
+// ============================================================================
+// FILE: deflatetest.cpp
+//
+//      Tests of CDeflater: what it compresses, in gzip and in zlib
+//      format, written whole and in random pieces, is inflated by zlib
+//      and compared, byte for byte, with what was written.  The inputs
+//      include empty ones, incompressible ones, and ones longer than
+//      the 32K window, with repeats nearer and further than it.
+//
+//      deflatetest
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#include "StdAfx.h"
+#include "deflate.h"
+#include <zlib.h>
+
+// As in Global.cpp.
+static CBufferPool s_bufferPool(16);
+CBufferPool *g_bufferPool = &s_bufferPool;
+
+static int g_failures = 0;
+
+#define CHECK(expr)                                                     \
+    if (!(expr)) {                                                      \
+        printf("%s(%d): CHECK(%s) failed\n", __FILE__, __LINE__, #expr); \
+        g_failures++;                                                   \
+    }
+
+// As in deflate.h.
+static const ULONG WINDOW_SIZE = 1 << 15;
+
+static unsigned long s_ulRandom = 1;
+
+static ULONG
+Random(ULONG n)
+{
+    s_ulRandom = s_ulRandom * 1103515245 + 12345;
+    return ((s_ulRandom >> 16) & 0x7FFF) % n;
+}
+
+// ============================================================================
+// Inputs
+
+static const char * const s_apszWords[] = {
+    "<p>", "</p>", "<a href=\"/default.asp\">", "</a>", "<br/>",
+    "<td class=\"price\">", "</td>", "the ", "catalog ", "item ",
+    "description ", "&amp; ", "XSLISAPI ", "stylesheet ", "\r\n"
+};
+
+// Markup, from a small vocabulary, so that it has matches at every
+// distance.
+static void
+MakeMarkup(CPooledBuffer & input, ULONG cb)
+{
+    const char *psz;
+
+    input.Empty();
+    while (input.GetSize() < cb) {
+        psz = s_apszWords[Random(COUNTOF(s_apszWords))];
+        input.Append(psz, strlen(psz));
+    }
+}
+
+// Random bytes, which deflate can't make any smaller.
+static void
+MakeRandom(CPooledBuffer & input, ULONG cb)
+{
+    BYTE b;
+
+    input.Empty();
+    while (input.GetSize() < cb) {
+        b = static_cast<BYTE>(Random(256));
+        input.Append(&b, 1);
+    }
+}
+
+// One byte, over and over: every match is as long as deflate allows.
+static void
+MakeRun(CPooledBuffer & input, ULONG cb)
+{
+    BYTE ab[1024];
+
+    memset(ab, 'a', sizeof(ab));
+    input.Empty();
+    while (input.GetSize() < cb) {
+        input.Append(ab, (cb - input.GetSize() < sizeof(ab)) ?
+                             cb - input.GetSize() : sizeof(ab));
+    }
+}
+
+// Random bytes, then the same bytes again, cbRepeat further on: a
+// match only when that's inside the window.
+static void
+MakeRepeat(CPooledBuffer & input, ULONG cbRepeat)
+{
+    CPooledBuffer block;
+
+    MakeRandom(block, cbRepeat);
+    input.Empty();
+    input.Append(block.GetData(), block.GetSize());
+    input.Append(block.GetData(), block.GetSize());
+}
+
+// ============================================================================
+// Compressing and inflating
+
+// Compress the input in pieces of up to cbPieceMax bytes, or whole if
+// it's 0, taking the output after each piece when bTakeOutput is set.
+static bool
+Compress(CDeflater::Format format,
+         const CPooledBuffer & input,
+         ULONG cbPieceMax,
+         bool bTakeOutput,
+         CPooledBuffer & output)
+{
+    CDeflater   deflater;
+    const BYTE *pb = input.GetData();
+    ULONG       cb = input.GetSize();
+    ULONG       cbPiece;
+
+    output.Empty();
+    if (FAILED(deflater.Init(format))) {
+        return false;
+    }
+
+    for (; cb > 0; pb += cbPiece, cb -= cbPiece) {
+        cbPiece = (cbPieceMax == 0) ? cb : 1 + Random(cbPieceMax);
+        if (cbPiece > cb) {
+            cbPiece = cb;
+        }
+        if (FAILED(deflater.Write(pb, cbPiece))) {
+            return false;
+        }
+        if (bTakeOutput) {
+            output.Append(deflater.GetOutput().GetData(),
+                          deflater.GetOutput().GetSize());
+            deflater.GetOutput().Empty();
+        }
+    }
+
+    if (FAILED(deflater.Finish())) {
+        return false;
+    }
+    output.Append(deflater.GetOutput().GetData(),
+                  deflater.GetOutput().GetSize());
+    return true;
+}
+
+// Whether zlib inflates the whole of the compressed stream, checking
+// its header and check value, to exactly the input.
+static bool
+Inflates(CDeflater::Format format,
+         const CPooledBuffer & compressed,
+         const CPooledBuffer & input)
+{
+    z_stream    z;
+    BYTE       *pbOut;
+    ULONG       cbOut = input.GetSize() + 1;
+    int         err;
+    bool        bSame;
+
+    pbOut = new BYTE[cbOut];
+    memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, (format == CDeflater::FORMAT_GZIP) ? 16 + 15 : 15) != Z_OK) {
+        delete [] pbOut;
+        return false;
+    }
+
+    z.next_in = const_cast<BYTE *>(compressed.GetData());
+    z.avail_in = compressed.GetSize();
+    z.next_out = pbOut;
+    z.avail_out = cbOut;
+    err = inflate(&z, Z_FINISH);
+
+    bSame = err == Z_STREAM_END &&
+            z.avail_in == 0 &&
+            z.total_out == input.GetSize() &&
+            memcmp(pbOut, input.GetData(), input.GetSize()) == 0;
+
+    inflateEnd(&z);
+    delete [] pbOut;
+    return bSame;
+}
+
+// Compress the input, in each format, whole, in large and small random
+// pieces, and a byte at a time if it's short, and inflate it again.
+// Returns the size of the gzip stream, written whole.
+static ULONG
+TestInput(const char *pszName, const CPooledBuffer & input)
+{
+    static const ULONG s_acbPieceMax[] = { 0, 5000, 17, 1 };
+    static const CDeflater::Format s_aFormats[] = {
+        CDeflater::FORMAT_GZIP, CDeflater::FORMAT_ZLIB
+    };
+    CPooledBuffer   compressed;
+    ULONG           cbGzip = 0;
+    UINT            iFormat;
+    UINT            iPiece;
+    int             bTakeOutput;
+
+    for (iFormat = 0; iFormat < COUNTOF(s_aFormats); iFormat++) {
+        for (iPiece = 0; iPiece < COUNTOF(s_acbPieceMax); iPiece++) {
+            if (s_acbPieceMax[iPiece] == 1 && input.GetSize() > 100000) {
+                continue;
+            }
+            for (bTakeOutput = 0; bTakeOutput < 2; bTakeOutput++) {
+                if (!Compress(s_aFormats[iFormat], input,
+                              s_acbPieceMax[iPiece], bTakeOutput != 0,
+                              compressed) ||
+                    !Inflates(s_aFormats[iFormat], compressed, input)) {
+                    printf("deflatetest: %s, format %u, pieces of up to %lu: "
+                           "not inflated to the input\n",
+                           pszName, iFormat,
+                           static_cast<unsigned long>(s_acbPieceMax[iPiece]));
+                    g_failures++;
+                }
+                if (iFormat == 0 && iPiece == 0) {
+                    cbGzip = compressed.GetSize();
+                }
+            }
+        }
+    }
+    return cbGzip;
+}
+
+static void
+TestInputs()
+{
+    CPooledBuffer   input;
+    ULONG           cb;
+
+    input.Empty();
+    TestInput("empty", input);
+
+    input.Append("x", 1);
+    TestInput("one byte", input);
+
+    MakeRandom(input, 3);
+    TestInput("three bytes", input);
+
+    // Random bytes come out larger, but not by more than fixed-Huffman
+    // literals of up to 9 bits cost.
+    MakeRandom(input, 100000);
+    cb = TestInput("random", input);
+    CHECK(cb < input.GetSize() + input.GetSize() / 8 + 64);
+
+    MakeMarkup(input, 20000);
+    cb = TestInput("markup within the window", input);
+    CHECK(cb < input.GetSize() / 2);
+
+    MakeMarkup(input, 300000);
+    cb = TestInput("markup beyond the window", input);
+    CHECK(cb < input.GetSize() / 2);
+
+    MakeMarkup(input, 2 * WINDOW_SIZE);
+    TestInput("markup of two windows", input);
+
+    MakeMarkup(input, 2 * WINDOW_SIZE + 1);
+    TestInput("markup of two windows and a byte", input);
+
+    MakeRun(input, 200000);
+    cb = TestInput("run", input);
+    CHECK(cb < input.GetSize() / 50);
+
+    MakeRepeat(input, WINDOW_SIZE - 300);
+    cb = TestInput("repeat within the window", input);
+    CHECK(cb < input.GetSize() * 3 / 4);
+
+    MakeRepeat(input, WINDOW_SIZE + 300);
+    TestInput("repeat beyond the window", input);
+}
+
+int
+main()
+{
+    TestInputs();
+
+    if (g_failures) {
+        printf("deflatetest: %d failed\n", g_failures);
+        return 1;
+    }
+
+    printf("deflatetest: passed\n");
+    return 0;
+}
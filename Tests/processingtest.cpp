@@ -0,0 +1,1844 @@
+// ============================================================================
+// FILE: processingtest.cpp
+//
+//      Tests of the post-processing stream (see CProcessingStream) for
+//      the HDML and WML profiles, built in and, through the generic
+//      state machine, loaded from masterConfig.xml: its output, byte for
+//      byte, against the state machine it replaced, which went a
+//      character at a time, for generated pages and for random markup
+//      written in random pieces, with the SSE2 scan of plain text and
+//      without; and a measure of each for large generated pages.
+//
+//      processingtest [megabytes]
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#include "StdAfx.h"
+#include "charset.h"
+#include <unistd.h>
+
+// As in Global.cpp.
+static CBufferPool s_bufferPool(16);
+CBufferPool *g_bufferPool = &s_bufferPool;
+static CPhaseStatistics s_phaseStats;
+CPhaseStatistics *g_phaseStats = &s_phaseStats;
+static CSingleByteEncoderCache s_singleByteEncoders;
+CSingleByteEncoderCache *g_singleByteEncoders = &s_singleByteEncoders;
+static CProcessingProfiles s_processingProfiles;
+CProcessingProfiles *g_processingProfiles = &s_processingProfiles;
+ULONG g_cbResponseWriteBuffer = DEFAULT_RESPONSE_WRITE_BUFFER;
+
+// As in ProcessingStream.cpp.
+static const long MAX_RESIDUAL_LENGTH = 32;
+
+static int g_failures = 0;
+
+#define CHECK(expr)                                                     \
+    if (!(expr)) {                                                      \
+        printf("%s(%d): CHECK(%s) failed\n", __FILE__, __LINE__, #expr); \
+        g_failures++;                                                   \
+    }
+
+// Whether the SSE2 scan can be tried: the processor has it, and the
+// environment doesn't turn it off.
+static bool s_bHaveSSE2 = false;
+
+static unsigned long s_ulRandom = 1;
+
+static ULONG
+Random(ULONG n)
+{
+    s_ulRandom = s_ulRandom * 1103515245 + 12345;
+    return ((s_ulRandom >> 16) & 0x7FFF) % n;
+}
+
+// ============================================================================
+// Profiles
+//      The built-in ones, as ProcessingStream.cpp has them.
+
+struct TestEntity {
+    LPCWSTR     pwszName;
+    LPCWSTR     pwszReplace;
+};
+
+struct TestChar {
+    WCHAR       cMatch;
+    LPCWSTR     pwszReplace;
+};
+
+struct TestProfile {
+    const char         *pszName;
+    LPCWSTR             pwszMIMEType;
+    const LPCWSTR      *ppwszTags;          // sorted
+    int                 nTags;
+    const TestEntity   *pEntities;          // sorted
+    int                 nEntities;
+    const TestChar     *pChars;
+    int                 nChars;
+    bool                bExpandEmptyTags;
+};
+
+static const LPCWSTR s_apwszHDMLTags[] = {
+    L"ACTION", L"BR", L"CE", L"CENTER", L"IMG", L"LINE", L"RIGHT", L"TAB", L"WRAP"
+};
+static const TestEntity s_aHDMLEntities[] = { { L"var", L"$" } };
+static const TestChar s_aHDMLChars[] = { { L'$', L"&dol;" } };
+
+static const TestEntity s_aWMLEntities[] = { { L"var", L"$" } };
+static const TestChar s_aWMLChars[] = { { L'$', L"$$" } };
+
+static const TestProfile s_HDMLProfile = {
+    "HDML", L"text/x-hdml",
+    s_apwszHDMLTags, COUNTOF(s_apwszHDMLTags),
+    s_aHDMLEntities, COUNTOF(s_aHDMLEntities),
+    s_aHDMLChars, COUNTOF(s_aHDMLChars),
+    true
+};
+
+static const TestProfile s_WMLProfile = {
+    "WML", L"text/vnd.wap.wml",
+    NULL, 0,
+    s_aWMLEntities, COUNTOF(s_aWMLEntities),
+    s_aWMLChars, COUNTOF(s_aWMLChars),
+    false
+};
+
+// Only in masterConfig.xml (see UseLoadedProfiles), so that what's
+// loaded can be told from what's built in.  Its closing tag is matched
+// in either case, outside ASCII too.
+static const LPCWSTR s_apwszLoadedTags[] = { L"\xC9T\xC9" };
+static const TestChar s_aLoadedChars[] = { { L'$', L"dollar" } };
+
+static const TestProfile s_LoadedProfile = {
+    "loaded", L"text/x-loaded",
+    s_apwszLoadedTags, COUNTOF(s_apwszLoadedTags),
+    NULL, 0,
+    s_aLoadedChars, COUNTOF(s_aLoadedChars),
+    false
+};
+
+// Only in masterConfig.xml too, with more characters to replace than
+// the built-in ones: as many as the SSE2 scan looks for at once, and
+// more than that.
+static const TestChar s_aManyChars[] = {
+    { L'$', L"&dol;" }, { L'#', L"&#35;" }, { L'%', L"%%" }, { L'*', L"" },
+    { L'+', L"plus" }, { L'@', L"(at)" }, { L'^', L"^^" }, { L'~', L"-" },
+    { L'|', L"&#124;" }, { L'\\', L"/" }, { L'`', L"'" }, { L'!', L"!!" },
+    { 0x00A0, L"&nbsp;" }, { 0x2014, L"--" }, { L'?', L"&#63;" }, { 0x00BF, L"?" },
+};
+
+static const TestChar s_aTooManyChars[] = {
+    { L'$', L"$$" }, { L'#', L"&#35;" }, { L'%', L"%%" }, { L'*', L"" },
+    { L'+', L"plus" }, { L'@', L"(at)" }, { L'^', L"^^" }, { L'~', L"-" },
+    { L'|', L"&#124;" }, { L'\\', L"/" }, { L'`', L"'" }, { L'!', L"!!" },
+    { 0x00A0, L"&nbsp;" }, { 0x2014, L"--" }, { 0x00C0, L"A" }, { 0x00C1, L"A" },
+    { 0x00C2, L"A" }, { 0x00C7, L"C" }, { 0x00C8, L"E" }, { 0x00C9, L"E" },
+    { 0x00D1, L"N" }, { 0x00D6, L"O" }, { 0x00DC, L"U" }, { L'$', L"$$$" },
+};
+
+static const TestProfile s_ManyProfile = {
+    "16 chars", L"text/x-many",
+    s_apwszHDMLTags, COUNTOF(s_apwszHDMLTags),
+    s_aHDMLEntities, COUNTOF(s_aHDMLEntities),
+    s_aManyChars, COUNTOF(s_aManyChars),
+    true
+};
+
+static const TestProfile s_TooManyProfile = {
+    "23 chars", L"text/x-too-many",
+    NULL, 0,
+    s_aWMLEntities, COUNTOF(s_aWMLEntities),
+    s_aTooManyChars, COUNTOF(s_aTooManyChars),
+    false
+};
+
+// One that can't be loaded.
+static const TestChar s_aBadChars[] = { { L'<', L"&lt;" } };
+
+static const TestProfile s_BadProfile = {
+    "bad", L"text/x-bad",
+    NULL, 0,
+    NULL, 0,
+    s_aBadChars, COUNTOF(s_aBadChars),
+    false
+};
+
+static bool
+IsBuiltIn(const TestProfile & profile)
+{
+    return &profile == &s_HDMLProfile || &profile == &s_WMLProfile;
+}
+
+// ============================================================================
+// CReferenceProcessor
+//      The state machine as it was before it was specialized by profile
+//      and plain text was scanned: a character at a time, character
+//      replacements searched for one by one, names looked up in the
+//      sorted arrays.  Output is UTF-16, as the stream gives for
+//      CP_UTF16 after its byte-order mark.
+
+static int __fastcall
+LookupTestTag(LPCWSTR pwsz, LPCWSTR const *ppwszTag)
+{
+    return lstrcmpi(pwsz, *ppwszTag);
+}
+
+static int __fastcall
+LookupTestEntity(LPCWSTR pwsz, TestEntity const *pEntity)
+{
+    return lstrcmp(pwsz, pEntity->pwszName);
+}
+
+class CReferenceProcessor
+{
+  public:
+    CReferenceProcessor(const TestProfile & profile, CPooledBuffer & output)
+        : m_profile(profile), m_output(output), m_state(STATE_NORMAL),
+          m_statePrevious(STATE_NORMAL), m_hrLast(S_OK), m_nQuoteState(0),
+          m_nResidualUsed(0), m_nClosingTagLength(0) {}
+
+    HRESULT Write(LPCWSTR pwch, long cch);
+    HRESULT Flush();
+
+  private:
+    enum PROCESSORSTATE {
+        STATE_NORMAL = 0,
+        STATE_STARTING_TAG,
+        STATE_IN_ENTITY_REF,
+        STATE_IN_CLOSING_TAG,
+        STATE_IN_TAG_NAME,
+        STATE_IN_TAG,
+        STATE_CLOSING_EMPTY_TAG
+    };
+
+    void Out(LPCWSTR pwch, long cch) {
+        m_output.Append(pwch, cch * sizeof(WCHAR));
+    }
+
+    void Out(WCHAR c) {
+        m_output.Append(&c, sizeof(c));
+    }
+
+    void OutResidual() {
+        Out(m_wszResidualBuffer, m_nResidualUsed);
+    }
+
+    int LookupTag(LPCWSTR pwszName) const {
+        return LookupSortedArray(pwszName, m_profile.ppwszTags, m_profile.nTags,
+                                 LookupTestTag);
+    }
+
+    const TestProfile  &m_profile;
+    CPooledBuffer      &m_output;
+    PROCESSORSTATE      m_state;
+    PROCESSORSTATE      m_statePrevious;
+    HRESULT             m_hrLast;
+    int                 m_nQuoteState;
+    WCHAR               m_wszResidualBuffer[MAX_RESIDUAL_LENGTH + 1];
+    long                m_nResidualUsed;
+    WCHAR               m_wszClosingTag[MAX_RESIDUAL_LENGTH + 3];
+    long                m_nClosingTagLength;
+};
+
+HRESULT
+CReferenceProcessor::Write(LPCWSTR pwch, long cch)
+{
+    int i;
+
+    if (FAILED(m_hrLast)) {
+        return m_hrLast;
+    }
+
+    while (cch > 0) {
+        WCHAR c = *pwch;
+        bool bRepeatCharacter = false;
+
+        if (m_state == STATE_NORMAL || m_state == STATE_IN_TAG) {
+            i = m_profile.nChars;
+            while (--i >= 0) {
+                if (m_profile.pChars[i].cMatch == c) {
+                    break;
+                }
+            }
+            if (i >= 0) {
+                Out(m_profile.pChars[i].pwszReplace,
+                    lstrlen(m_profile.pChars[i].pwszReplace));
+                pwch++;
+                cch--;
+                continue;
+            }
+        }
+
+        switch (m_state) {
+          case STATE_NORMAL:
+            if (c == L'<' || c == L'&') {
+                m_wszResidualBuffer[0] = c;
+                m_nResidualUsed = 1;
+                m_nQuoteState = 0;
+                m_state = (c == L'<') ? STATE_STARTING_TAG : STATE_IN_ENTITY_REF;
+                m_statePrevious = STATE_NORMAL;
+            } else {
+                Out(c);
+            }
+            break;
+
+          case STATE_STARTING_TAG:
+            m_wszResidualBuffer[m_nResidualUsed++] = c;
+            if (c == L'/') {
+                m_state = STATE_IN_CLOSING_TAG;
+            } else if (m_profile.bExpandEmptyTags) {
+                m_state = STATE_IN_TAG_NAME;
+            } else {
+                Out(m_wszResidualBuffer[0]);
+                Out(c);
+                m_nResidualUsed = 0;
+                m_state = STATE_IN_TAG;
+            }
+            break;
+
+          case STATE_IN_CLOSING_TAG:
+            if (c == L'>' || m_nResidualUsed == MAX_RESIDUAL_LENGTH) {
+                int nLookup = -1;
+
+                if (m_nResidualUsed < MAX_RESIDUAL_LENGTH) {
+                    m_wszResidualBuffer[m_nResidualUsed] = L'\0';
+                    nLookup = LookupTag(m_wszResidualBuffer + 2);
+                }
+                if (nLookup == -1) {
+                    OutResidual();
+                    bRepeatCharacter = true;
+                }
+                m_nResidualUsed = 0;
+                m_state = STATE_NORMAL;
+            } else {
+                m_wszResidualBuffer[m_nResidualUsed++] = c;
+            }
+            break;
+
+          case STATE_IN_TAG_NAME:
+            if ((c <= L' ' && CHAR_IS_WHITESPACE(c)) || c == L'>' || c == L'/') {
+                m_wszClosingTag[0] = L'<';
+                m_wszClosingTag[1] = L'/';
+                memcpy(&m_wszClosingTag[2], m_wszResidualBuffer + 1,
+                       (m_nResidualUsed - 1) * sizeof(WCHAR));
+                m_nClosingTagLength = m_nResidualUsed - 1;
+                OutResidual();
+                m_nResidualUsed = 0;
+                bRepeatCharacter = true;
+                m_state = STATE_IN_TAG;
+            } else if (m_nResidualUsed == MAX_RESIDUAL_LENGTH) {
+                OutResidual();
+                m_nResidualUsed = 0;
+                m_nClosingTagLength = 0;
+                bRepeatCharacter = true;
+                m_state = STATE_IN_TAG;
+            } else {
+                m_wszResidualBuffer[m_nResidualUsed++] = c;
+            }
+            break;
+
+          case STATE_IN_TAG:
+            if (c == L'&') {
+                m_wszResidualBuffer[0] = c;
+                m_nResidualUsed = 1;
+                m_state = STATE_IN_ENTITY_REF;
+                m_statePrevious = STATE_IN_TAG;
+            } else if (c == L'/' && m_nQuoteState == 0 && m_profile.bExpandEmptyTags) {
+                m_state = STATE_CLOSING_EMPTY_TAG;
+            } else {
+                Out(c);
+                if (c == L'\'' || c == L'\"') {
+                    m_nQuoteState = QUOTE_SINGLE_QUOTE_TRANSITION(m_nQuoteState);
+                } else if (c == L'>' && m_nQuoteState == 0) {
+                    m_state = STATE_NORMAL;
+                }
+            }
+            break;
+
+          case STATE_IN_ENTITY_REF:
+            if (c == L';' || m_nResidualUsed == MAX_RESIDUAL_LENGTH) {
+                int nLookup = -1;
+
+                if (m_nResidualUsed < MAX_RESIDUAL_LENGTH) {
+                    m_wszResidualBuffer[m_nResidualUsed] = L'\0';
+                    nLookup = LookupSortedArray(m_wszResidualBuffer + 1,
+                                                m_profile.pEntities,
+                                                m_profile.nEntities,
+                                                LookupTestEntity);
+                }
+                if (nLookup != -1) {
+                    Out(m_profile.pEntities[nLookup].pwszReplace,
+                        lstrlen(m_profile.pEntities[nLookup].pwszReplace));
+                } else {
+                    OutResidual();
+                    bRepeatCharacter = true;
+                }
+                m_nResidualUsed = 0;
+                m_state = m_statePrevious;
+            } else {
+                m_wszResidualBuffer[m_nResidualUsed++] = c;
+            }
+            break;
+
+          case STATE_CLOSING_EMPTY_TAG:
+            if (c != L'>') {
+                m_hrLast = E_FAIL;
+                return m_hrLast;
+            }
+            if (m_nClosingTagLength > 0) {
+                Out(c);
+                m_wszClosingTag[m_nClosingTagLength + 2] = L'\0';
+                if (LookupTag(m_wszClosingTag + 2) == -1) {
+                    m_wszClosingTag[m_nClosingTagLength + 2] = L'>';
+                    Out(m_wszClosingTag, m_nClosingTagLength + 3);
+                }
+            } else {
+                Out(L'/');
+                Out(c);
+            }
+            m_state = STATE_NORMAL;
+            break;
+        }
+
+        if (!bRepeatCharacter) {
+            pwch++;
+            cch--;
+        }
+    }
+    return S_OK;
+}
+
+HRESULT
+CReferenceProcessor::Flush()
+{
+    if (SUCCEEDED(m_hrLast) && m_nResidualUsed > 0) {
+        OutResidual();
+        m_nResidualUsed = 0;
+    }
+    return m_hrLast;
+}
+
+// ============================================================================
+// CMemoryStream and CMemoryResponse
+//      Stand in for the Response, with IStream and without it: keep
+//      what's written, or just count it.  The stream counts references,
+//      which are all given back once the processing stream is released.
+
+class CMemoryStream : public IStream
+{
+  public:
+    CMemoryStream(bool bKeep) : m_bKeep(bKeep), m_cb(0), m_cRefs(0) {}
+
+    ULONG AddRef() {
+        return ++m_cRefs;
+    }
+
+    ULONG Release() {
+        return --m_cRefs;
+    }
+
+    HRESULT Write(const void *pv, ULONG cb, ULONG *pcbWritten) {
+        if (m_bKeep) {
+            m_buffer.Append(pv, cb);
+        }
+        m_cb += cb;
+        if (pcbWritten) {
+            *pcbWritten = cb;
+        }
+        return S_OK;
+    }
+
+    CPooledBuffer   m_buffer;
+    bool            m_bKeep;
+    double          m_cb;
+    ULONG           m_cRefs;
+};
+
+class CMemoryResponse : public asp::IResponse
+{
+  public:
+    CMemoryResponse() : m_numWrites(0) {}
+
+    HRESULT BinaryWrite(VARIANT varData) {
+        SAFEARRAY *psa = V_ARRAY(&varData);
+
+        m_buffer.Append(psa->pvData, psa->rgsabound[0].cElements);
+        m_numWrites++;
+        return S_OK;
+    }
+
+    CPooledBuffer   m_buffer;
+    ULONG           m_numWrites;
+};
+
+// ============================================================================
+// CTestNode and CTestNodeList
+//      A masterConfig.xml built by hand, for loading the profiles above
+//      through CProcessingProfiles: elements and attributes are nodes
+//      whose children are selected by name ("@name" for attributes),
+//      and the document's profiles are named by the path Configure
+//      selects them by.  Nodes come from s_aNodes, and the shim's
+//      IUnknown doesn't count references, so they aren't freed.
+
+class CTestNode : public IXMLDOMDocument
+{
+  public:
+    enum { MAX_CHILDREN = 32, MAX_TEXT = 64 };
+
+    void Init(LPCWSTR pwszName, LPCWSTR pwszText) {
+        lstrcpynW(m_wszName, pwszName, MAX_TEXT);
+        lstrcpynW(m_wszText, pwszText ? pwszText : L"", MAX_TEXT);
+        m_numChildren = 0;
+    }
+
+    CTestNode * Add(LPCWSTR pwszName, LPCWSTR pwszText);
+
+    HRESULT selectNodes(LPCWSTR pwszName, IXMLDOMNodeList **ppList);
+
+    HRESULT selectSingleNode(LPCWSTR pwszName, IXMLDOMNode **ppNode) {
+        int i;
+
+        *ppNode = NULL;
+        for (i = 0; i < m_numChildren; i++) {
+            if (lstrcmp(m_apChildren[i]->m_wszName, pwszName) == 0) {
+                *ppNode = m_apChildren[i];
+                return S_OK;
+            }
+        }
+        return S_FALSE;
+    }
+
+    HRESULT get_text(BSTR *pbstrText) {
+        *pbstrText = SysAllocString(m_wszText);
+        return *pbstrText ? S_OK : E_OUTOFMEMORY;
+    }
+
+    WCHAR       m_wszName[MAX_TEXT];
+    WCHAR       m_wszText[MAX_TEXT];
+    CTestNode  *m_apChildren[MAX_CHILDREN];
+    int         m_numChildren;
+};
+
+class CTestNodeList : public IXMLDOMNodeList
+{
+  public:
+    CTestNodeList(CTestNode *pParent, LPCWSTR pwszName)
+        : m_cRefs(0), m_pParent(pParent), m_pwszName(pwszName), m_iNext(0) {}
+
+    ULONG AddRef() {
+        return ++m_cRefs;
+    }
+
+    ULONG Release() {
+        ULONG cRefs = --m_cRefs;
+
+        if (cRefs == 0) {
+            delete this;
+        }
+        return cRefs;
+    }
+
+    HRESULT get_length(long *pnLength) {
+        int i;
+
+        *pnLength = 0;
+        for (i = 0; i < m_pParent->m_numChildren; i++) {
+            if (lstrcmp(m_pParent->m_apChildren[i]->m_wszName, m_pwszName) == 0) {
+                (*pnLength)++;
+            }
+        }
+        return S_OK;
+    }
+
+    HRESULT nextNode(IXMLDOMNode **ppNode) {
+        *ppNode = NULL;
+        while (m_iNext < m_pParent->m_numChildren) {
+            CTestNode *pNode = m_pParent->m_apChildren[m_iNext++];
+
+            if (lstrcmp(pNode->m_wszName, m_pwszName) == 0) {
+                *ppNode = pNode;
+                return S_OK;
+            }
+        }
+        return S_FALSE;
+    }
+
+  private:
+    ULONG       m_cRefs;
+    CTestNode  *m_pParent;
+    LPCWSTR     m_pwszName;
+    int         m_iNext;
+};
+
+static CTestNode s_aNodes[512];
+static int s_numNodes = 0;
+
+CTestNode *
+CTestNode::Add(LPCWSTR pwszName, LPCWSTR pwszText)
+{
+    CTestNode *pNode;
+
+    ASSERT(m_numChildren < MAX_CHILDREN && s_numNodes < (int)COUNTOF(s_aNodes));
+    pNode = &s_aNodes[s_numNodes++];
+    pNode->Init(pwszName, pwszText);
+    m_apChildren[m_numChildren++] = pNode;
+    return pNode;
+}
+
+HRESULT
+CTestNode::selectNodes(LPCWSTR pwszName, IXMLDOMNodeList **ppList)
+{
+    *ppList = new CTestNodeList(this, pwszName);
+    (*ppList)->AddRef();
+    return S_OK;
+}
+
+// A new masterConfig.xml, with no profiles.
+static CTestNode *
+NewConfig()
+{
+    s_numNodes = 0;
+    s_aNodes[s_numNodes].Init(L"#document", NULL);
+    return &s_aNodes[s_numNodes++];
+}
+
+// The profile, as a <profile> element of the config.
+static void
+AddProfile(CTestNode *pConfig, const TestProfile & profile)
+{
+    CTestNode  *pProfile;
+    CTestNode  *pNode;
+    WCHAR       wszMatch[2];
+    int         i;
+
+    pProfile = pConfig->Add(L"/config/postprocess/profile", NULL);
+    pProfile->Add(L"@mime-type", profile.pwszMIMEType);
+    pProfile->Add(L"@expand-empty-tags", profile.bExpandEmptyTags ? L"on" : L"off");
+
+    for (i = 0; i < profile.nTags; i++) {
+        pNode = pProfile->Add(L"closing-tag", NULL);
+        pNode->Add(L"@name", profile.ppwszTags[i]);
+    }
+    for (i = 0; i < profile.nEntities; i++) {
+        pNode = pProfile->Add(L"entity", NULL);
+        pNode->Add(L"@name", profile.pEntities[i].pwszName);
+        pNode->Add(L"@replace", profile.pEntities[i].pwszReplace);
+    }
+    for (i = 0; i < profile.nChars; i++) {
+        wszMatch[0] = profile.pChars[i].cMatch;
+        wszMatch[1] = 0;
+        pNode = pProfile->Add(L"character", NULL);
+        pNode->Add(L"@match", wszMatch);
+        pNode->Add(L"@replace", profile.pChars[i].pwszReplace);
+    }
+}
+
+// The config streams use the profiles of, unless they're given another.
+static WCHAR s_wszConfigURL[] = L"/masterConfig.xml";
+
+// Load the HDML and WML profiles from a config, for streams created
+// after this, so that they use the generic state machine with the same
+// tables as the built-in ones, and the profiles that are only loaded;
+// or go back to the built-in ones.  Each config is given a new version.
+static void
+UseLoadedProfiles(bool bLoaded)
+{
+    static DWORD    s_nVersion = 0;
+    CTestNode      *pConfig;
+    XmlCacheInfo    info;
+
+    pConfig = NewConfig();
+    if (bLoaded) {
+        AddProfile(pConfig, s_HDMLProfile);
+        AddProfile(pConfig, s_WMLProfile);
+        AddProfile(pConfig, s_LoadedProfile);
+        AddProfile(pConfig, s_ManyProfile);
+        AddProfile(pConfig, s_TooManyProfile);
+    }
+
+    ZeroMemory(&info, sizeof(info));
+    info.nFileSize = ++s_nVersion;
+    CHECK(g_processingProfiles->Configure(pConfig, info, NULL, s_wszConfigURL,
+                                          NULL, NULL) == S_OK);
+}
+
+// ============================================================================
+// Running text through the stream and the reference
+
+// Turn the SSE2 scan on or off for streams created after this.
+static void
+UseSSE2(bool bSSE2)
+{
+    if (bSSE2) {
+        if (s_bHaveSSE2) {
+            unsetenv("XSLISAPI_NO_SSE2");
+        }
+    } else {
+        setenv("XSLISAPI_NO_SSE2", "1", 1);
+    }
+}
+
+// Write the text, after its byte-order mark, in random pieces of up to
+// cchPieceMax characters, to a stream for the profile on pOutput or
+// pResponse, and commit.
+static HRESULT
+Process(LPCWSTR pwszMIMEType,
+        UINT uiCP,
+        LPCWSTR pwch,
+        ULONG cch,
+        ULONG cchPieceMax,
+        IStream *pOutput,
+        asp::IResponse *pResponse,
+        LPCWSTR pwszConfig = s_wszConfigURL)
+{
+    const WCHAR chBOM = 0xFEFF;
+    IStream    *pStream = NULL;
+    HRESULT     hr;
+    ULONG       ich;
+    ULONG       cchPiece;
+
+    hr = CreateProcessingStream(pOutput, pResponse, pwszMIMEType, pwszConfig,
+                                uiCP, NULL, 0, NULL, NULL, &pStream);
+    HRCHECK(FAILED(hr));
+
+    hr = pStream->Write(&chBOM, sizeof(chBOM), NULL);
+    HRCHECK(FAILED(hr));
+
+    for (ich = 0; ich < cch; ich += cchPiece) {
+        cchPiece = 1 + Random(cchPieceMax);
+        if (cchPiece > cch - ich) {
+            cchPiece = cch - ich;
+        }
+        hr = pStream->Write(pwch + ich, cchPiece * sizeof(WCHAR), NULL);
+        HRCHECK(FAILED(hr));
+    }
+
+    hr = pStream->Commit(0);
+    HRCHECK(FAILED(hr));
+
+  Error:
+    SAFERELEASE(pStream);
+    return hr;
+}
+
+// The reference's output for the text, after a UTF-16 byte-order mark.
+static HRESULT
+ProcessReference(const TestProfile & profile,
+                 LPCWSTR pwch,
+                 ULONG cch,
+                 CPooledBuffer & output)
+{
+    static const BYTE   s_abBOM[] = { 0xFF, 0xFE };
+    CReferenceProcessor reference(profile, output);
+    HRESULT             hr;
+
+    output.Empty();
+    output.Append(s_abBOM, sizeof(s_abBOM));
+
+    hr = reference.Write(pwch, cch);
+    if (SUCCEEDED(hr)) {
+        hr = reference.Flush();
+    }
+    return hr;
+}
+
+static bool
+SameBytes(const CPooledBuffer & buffer1, const CPooledBuffer & buffer2)
+{
+    return buffer1.GetSize() == buffer2.GetSize() &&
+           memcmp(buffer1.GetData(), buffer2.GetData(), buffer1.GetSize()) == 0;
+}
+
+// The text through the stream, with the built-in profile (if it is
+// one) and with it loaded, with and without SSE2, in pieces of every
+// size up to cchPieceMax, on a stream and on a Response: the same as
+// the reference, and failing where it does.
+static void
+CheckAgainstReference(const TestProfile & profile,
+                      LPCWSTR pwch,
+                      ULONG cch,
+                      ULONG cchPieceMax,
+                      int *pnFailed)
+{
+    CPooledBuffer   expected;
+    HRESULT         hrExpected;
+    HRESULT         hr;
+    int             mode;
+
+    hrExpected = ProcessReference(profile, pwch, cch, expected);
+    if (FAILED(hrExpected)) {
+        (*pnFailed)++;
+    }
+
+    for (mode = 0; mode < 8; mode++) {
+        CMemoryStream   stream(true);
+        CMemoryResponse response;
+        bool            bResponse = (mode % 4 >= 2);
+
+        if (mode < 4 && !IsBuiltIn(profile)) {
+            continue;
+        }
+        if (mode % 4 == 0) {
+            UseLoadedProfiles(mode >= 4);
+        }
+        UseSSE2(mode % 2 == 1);
+        hr = Process(profile.pwszMIMEType, CP_UTF16, pwch, cch, cchPieceMax,
+                     bResponse ? NULL : &stream, bResponse ? &response : NULL);
+        CHECK(FAILED(hr) == FAILED(hrExpected));
+        if (SUCCEEDED(hr) && SUCCEEDED(hrExpected)) {
+            CHECK(SameBytes(bResponse ? response.m_buffer : stream.m_buffer, expected));
+        }
+    }
+    UseLoadedProfiles(false);
+    UseSSE2(true);
+}
+
+// ============================================================================
+// Generated text
+
+class CText
+{
+  public:
+    void Add(WCHAR c) {
+        m_buffer.Append(&c, sizeof(c));
+    }
+
+    void Add(const char *psz) {
+        while (*psz) {
+            Add(static_cast<WCHAR>(static_cast<BYTE>(*psz++)));
+        }
+    }
+
+    LPCWSTR GetText() const {
+        return reinterpret_cast<LPCWSTR>(m_buffer.GetData());
+    }
+
+    ULONG GetLength() const {
+        return m_buffer.GetSize() / sizeof(WCHAR);
+    }
+
+    void Empty() {
+        m_buffer.Empty();
+    }
+
+  private:
+    CPooledBuffer   m_buffer;
+};
+
+// A page, shaped like a deck of HDML or WML cards: mostly text, some
+// tags (empty ones among them), entities, dollar signs, a little
+// Latin-1 and the odd surrogate pair.
+static void
+GeneratePage(CText & text, bool bHDML, ULONG cch)
+{
+    static const char * const s_apszWords[] = {
+        "catalog", "price", "the", "item", "available", "order", "shipping", "colour"
+    };
+    ULONG   n;
+    ULONG   i;
+
+    text.Empty();
+    text.Add(bHDML ? "<HDML VERSION=3.0>" : "<wml><card id=\"c\">");
+    while (text.GetLength() < cch) {
+        n = Random(100);
+        if (n < 70) {
+            for (i = 1 + Random(40); i > 0; i--) {
+                text.Add(s_apszWords[Random(COUNTOF(s_apszWords))]);
+                text.Add(L' ');
+            }
+            if (Random(10) == 0) {
+                text.Add(0x00E9);
+            }
+            if (Random(50) == 0) {
+                text.Add(0xD83D);
+                text.Add(0xDE00);
+            }
+        } else if (n < 78) {
+            text.Add(bHDML ? "<BR/>" : "<br/>");
+        } else if (n < 84) {
+            text.Add(bHDML ? "<A TASK=GO DEST=\"#x\">go</A>" :
+                             "<a href=\"#x\" title='q$'>go</a>");
+        } else if (n < 88) {
+            text.Add("&amp;");
+        } else if (n < 91) {
+            text.Add("&var;");
+        } else if (n < 94) {
+            text.Add("$5.00 ");
+        } else if (n < 97) {
+            text.Add(bHDML ? "</CE>" : "</p><p>");
+        } else {
+            text.Add(bHDML ? "<IMG SRC=\"a.bmp\"/>" : "<img src=\"a.wbmp\" alt=\"a\"/>");
+        }
+    }
+    text.Add(bHDML ? "</HDML>" : "</card></wml>");
+}
+
+// Random markup, made to reach every state: pieces of tags, entities
+// and names in either case, quotes, names too long to look up, and
+// plain text long enough to scan.  A tag name is cut short with a
+// space before it's too long to keep, since an empty tag with such a
+// name is asserted not to happen.
+static void
+GenerateMarkup(CText & text, ULONG numTokens)
+{
+    static const char * const s_apszTokens[] = {
+        "<", ">", "/>", "</BR>", "</ce>", "</p", "&", ";", "$", "'", "\"", " ", "\t", "=",
+        "BR", "br", "ce", "CENTER", "A", "var", "VAR", "amp", "x", "p",
+        "\xE9", "\xA0", "nnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnn",
+        "plain text running on for a while, past a block or two"
+    };
+    const char *psz;
+    long        cchName = -1;               // of the tag name, after a '<'
+    WCHAR       c;
+    ULONG       i;
+
+    text.Empty();
+    for (i = 0; i < numTokens; i++) {
+        for (psz = s_apszTokens[Random(COUNTOF(s_apszTokens))]; *psz; psz++) {
+            c = static_cast<BYTE>(*psz);
+            if (c == L'<' && cchName < 0) {
+                cchName = 0;
+            } else if (cchName == 0 && c != L'/') {
+                cchName = 1;                // whatever it is
+            } else if (c == L'>' || c == L'/' || c <= L' ') {
+                cchName = -1;
+            } else if (cchName >= 0 && ++cchName == MAX_RESIDUAL_LENGTH - 4) {
+                text.Add(L' ');
+                cchName = -1;
+            }
+            text.Add(c);
+        }
+        if (Random(50) == 0) {
+            text.Add(0xD83D);
+            text.Add(0xDE00);
+        }
+    }
+}
+
+// The text with some of its letters (never a tag's delimiters, so that
+// names stay as long as they were) replaced by characters the profile
+// replaces, about one in nOneIn.
+static void
+AddReplacedChars(const CText & in, CText & out, const TestProfile & profile, ULONG nOneIn)
+{
+    LPCWSTR pwch = in.GetText();
+    ULONG   i;
+
+    out.Empty();
+    for (i = 0; i < in.GetLength(); i++) {
+        if ((pwch[i] == L'n' || pwch[i] == L'e' || pwch[i] == L't') && Random(nOneIn) == 0) {
+            out.Add(profile.pChars[Random(profile.nChars)].cMatch);
+        } else {
+            out.Add(pwch[i]);
+        }
+    }
+}
+
+// ============================================================================
+// Tests
+
+struct GoldenCase {
+    const TestProfile  *pProfile;
+    LPCWSTR             pwszIn;
+    LPCWSTR             pwszOut;
+};
+
+static const GoldenCase s_aGoldenCases[] = {
+    { &s_HDMLProfile, L"a$b", L"a&dol;b" },
+    { &s_HDMLProfile, L"&var;&amp;&VAR;", L"$&amp;&VAR;" },
+    { &s_HDMLProfile, L"<BR/>x<br/>", L"<BR>x<br>" },
+    { &s_HDMLProfile, L"<A TASK=GO/>", L"<A TASK=GO></A>" },
+    { &s_HDMLProfile, L"<A DEST='$' TITLE=\"a/b\">", L"<A DEST='&dol;' TITLE=\"a/b\">" },
+    { &s_HDMLProfile, L"</ce>x</Wrap></P>", L"x</P>" },
+    { &s_HDMLProfile, L"<A TITLE=&var;/>", L"<A TITLE=$></A>" },
+    { &s_WMLProfile, L"a$b", L"a$$b" },
+    { &s_WMLProfile, L"<br/>&var;x</p>", L"<br/>$x</p>" },
+    { &s_WMLProfile, L"<a title='$'>&amp;</a>", L"<a title='$$'>&amp;</a>" },
+};
+
+static void
+TestGolden()
+{
+    CPooledBuffer   expected;
+    CPooledBuffer   reference;
+    ULONG           i;
+    int             mode;
+
+    for (i = 0; i < COUNTOF(s_aGoldenCases); i++) {
+        const GoldenCase   &golden = s_aGoldenCases[i];
+        ULONG               cchIn = lstrlen(golden.pwszIn);
+
+        expected.Empty();
+        expected.Append("\xFF\xFE", 2);
+        expected.Append(golden.pwszOut, lstrlen(golden.pwszOut) * sizeof(WCHAR));
+
+        CHECK(ProcessReference(*golden.pProfile, golden.pwszIn, cchIn, reference) == S_OK);
+        CHECK(SameBytes(reference, expected));
+
+        for (mode = 0; mode < 4; mode++) {
+            CMemoryStream stream(true);
+
+            if (mode % 2 == 0) {
+                UseLoadedProfiles(mode >= 2);
+            }
+            UseSSE2(mode % 2 == 1);
+            CHECK(Process(golden.pProfile->pwszMIMEType, CP_UTF16,
+                          golden.pwszIn, cchIn, 1 + i % 3, &stream, NULL) == S_OK);
+            CHECK(SameBytes(stream.m_buffer, expected));
+        }
+        UseLoadedProfiles(false);
+        UseSSE2(true);
+    }
+
+    // A profile that's only loaded: passed through as it is until it is.
+    for (mode = 0; mode < 2; mode++) {
+        static const WCHAR  s_wszIn[] = L"</\xE9t\xE9>a$b</\xC9T\xC9></\xC9T>";
+        LPCWSTR             pwszOut = mode ? L"adollarb</\xC9T>" : s_wszIn;
+        CMemoryStream       stream(true);
+
+        expected.Empty();
+        expected.Append("\xFF\xFE", 2);
+        expected.Append(pwszOut, lstrlen(pwszOut) * sizeof(WCHAR));
+
+        UseLoadedProfiles(mode == 1);
+        CHECK(Process(s_LoadedProfile.pwszMIMEType, CP_UTF16,
+                      s_wszIn, lstrlen(s_wszIn), 3, &stream, NULL) == S_OK);
+        CHECK(SameBytes(stream.m_buffer, expected));
+    }
+    UseLoadedProfiles(false);
+}
+
+// Output in UTF-7, which keeps state from one character to the next,
+// is what encoding a write in one go gives, however long it is; and
+// the stream is freed when it's released.
+static void
+TestStatefulEncoding()
+{
+    const WCHAR     chBOM = 0xFEFF;
+    CText           text;
+    CPooledBuffer   expected;
+    CMemoryStream   output(true);
+    IStream        *pStream = NULL;
+    int             cbExpected;
+    ULONG           i;
+
+    for (i = 0; i < 3 * 8192 + 100; i++) {
+        text.Add((i % 1000 == 999) ? L'a' : (WCHAR)(0xE0 + i % 16));
+    }
+
+    cbExpected = WideCharToMultiByte(CP_UTF7, 0, text.GetText(), text.GetLength(),
+                                     NULL, 0, NULL, NULL);
+    CHECK(cbExpected > 0 && expected.Reserve(cbExpected) == S_OK);
+    WideCharToMultiByte(CP_UTF7, 0, text.GetText(), text.GetLength(),
+                        reinterpret_cast<LPSTR>(expected.GetData()), cbExpected,
+                        NULL, NULL);
+
+    CHECK(CreateProcessingStream(&output, NULL, L"text/plain", NULL, CP_UTF7,
+                                 NULL, 0, NULL, NULL, &pStream) == S_OK);
+    CHECK(pStream->Write(&chBOM, sizeof(chBOM), NULL) == S_OK);
+    CHECK(pStream->Write(text.GetText(), text.GetLength() * sizeof(WCHAR), NULL) == S_OK);
+    CHECK(pStream->Commit(0) == S_OK);
+    SAFERELEASE(pStream);
+
+    CHECK(output.m_buffer.GetSize() == (ULONG)cbExpected &&
+          memcmp(output.m_buffer.GetData(), expected.GetData(), cbExpected) == 0);
+    CHECK(output.m_cRefs == 0);
+}
+
+// ============================================================================
+// Single-byte code pages
+//      CSingleByteEncoder against fixed vectors of what Windows'
+//      WideCharToMultiByte gives, for each code page win32.cpp has:
+//      characters of the code page, bytes it leaves undefined, best-fit
+//      mappings, and the default character for the rest; then against
+//      WideCharToMultiByte for the whole BMP, and in the stream.
+
+struct SingleByteVector {
+    WCHAR   wch;
+    BYTE    b;
+};
+
+static const SingleByteVector s_a1252Vectors[] = {
+    { L'A', 'A' }, { 0x007F, 0x7F }, { 0x20AC, 0x80 }, { 0x201A, 0x82 },
+    { 0x0192, 0x83 }, { 0x2026, 0x85 }, { 0x02C6, 0x88 }, { 0x0152, 0x8C },
+    { 0x017D, 0x8E }, { 0x2018, 0x91 }, { 0x201D, 0x94 }, { 0x2014, 0x97 },
+    { 0x02DC, 0x98 }, { 0x2122, 0x99 }, { 0x0178, 0x9F }, { 0x00A0, 0xA0 },
+    { 0x00E9, 0xE9 }, { 0x00FF, 0xFF },
+    // Undefined, so the C1 control of the same value.
+    { 0x0081, 0x81 }, { 0x008D, 0x8D }, { 0x008F, 0x8F }, { 0x0090, 0x90 },
+    { 0x009D, 0x9D },
+    // Best fit.
+    { 0x0100, 'A' }, { 0x0141, 'L' }, { 0x221E, '8' }, { 0x2264, '=' },
+    { 0xFF21, 'A' },
+    // The default.
+    { 0x0080, '?' }, { 0x0410, '?' }, { 0x4E00, '?' }, { 0xFFFF, '?' }
+};
+
+static const SingleByteVector s_a1251Vectors[] = {
+    { L'A', 'A' }, { 0x0402, 0x80 }, { 0x201A, 0x82 }, { 0x20AC, 0x88 },
+    { 0x040F, 0x8F }, { 0x2122, 0x99 }, { 0x045F, 0x9F }, { 0x00A0, 0xA0 },
+    { 0x0401, 0xA8 }, { 0x0490, 0xA5 }, { 0x0491, 0xB4 }, { 0x0451, 0xB8 },
+    { 0x2116, 0xB9 }, { 0x0410, 0xC0 }, { 0x042F, 0xDF }, { 0x0430, 0xE0 },
+    { 0x044F, 0xFF },
+    // Undefined.
+    { 0x0098, 0x98 },
+    // The default.
+    { 0x00E9, '?' }, { 0x0152, '?' }, { 0x4E00, '?' }, { 0xFFFF, '?' }
+};
+
+static void
+TestSingleByteVectors(UINT uiCP, const SingleByteVector *pVectors, UINT nVectors)
+{
+    const CSingleByteEncoder   *pEncoder = g_singleByteEncoders->Get(uiCP);
+    BYTE                        b;
+    UINT                        i;
+
+    CHECK(pEncoder != NULL && pEncoder->GetCodePage() == uiCP);
+    if (pEncoder == NULL) {
+        return;
+    }
+
+    for (i = 0; i < nVectors; i++) {
+        b = 0;
+        CHECK(pEncoder->Encode(&pVectors[i].wch, 1, &b));
+        if (b != pVectors[i].b) {
+            printf("processingtest: code page %u encodes U+%04X as 0x%02X, "
+                   "not 0x%02X\n", uiCP, pVectors[i].wch, b, pVectors[i].b);
+            g_failures++;
+        }
+    }
+}
+
+// Every character of the BMP but surrogates, as WideCharToMultiByte
+// encodes it; and false, for WideCharToMultiByte, with a surrogate.
+static void
+TestSingleByteBMP(UINT uiCP)
+{
+    const CSingleByteEncoder   *pEncoder = g_singleByteEncoders->Get(uiCP);
+    static WCHAR                s_awch[0x10000];
+    static BYTE                 s_abExpected[0x10000];
+    static BYTE                 s_abActual[0x10000];
+    const WCHAR                 awchPair[] = { L'a', 0xD83D, 0xDE00 };
+    BYTE                        ab[3];
+    ULONG                       i;
+
+    if (pEncoder == NULL) {
+        return;
+    }
+
+    for (i = 0; i < 0x10000; i++) {
+        s_awch[i] = (i >= 0xD800 && i < 0xE000) ? L'x' : static_cast<WCHAR>(i);
+    }
+    CHECK(WideCharToMultiByte(uiCP, 0, s_awch, 0x10000,
+                              reinterpret_cast<LPSTR>(s_abExpected), 0x10000,
+                              NULL, NULL) == 0x10000);
+    CHECK(pEncoder->Encode(s_awch, 0x10000, s_abActual));
+    CHECK(memcmp(s_abActual, s_abExpected, 0x10000) == 0);
+
+    CHECK(!pEncoder->Encode(awchPair, 3, ab));
+    CHECK(!pEncoder->Encode(awchPair + 2, 1, ab));
+}
+
+// Output in 1252, through the stream, of text with characters it has,
+// best-fit ones and unmappable ones, in chunks with and without a
+// surrogate pair, is what WideCharToMultiByte gives for it.
+static void
+TestSingleByteStream()
+{
+    const WCHAR     chBOM = 0xFEFF;
+    CText           text;
+    CPooledBuffer   expected;
+    CMemoryStream   output(true);
+    IStream        *pStream = NULL;
+    int             cbExpected;
+    ULONG           i;
+
+    for (i = 0; i < 3 * 8192 + 100; i++) {
+        switch (i % 7) {
+          case 0:   text.Add(L'a' + i % 26); break;
+          case 1:   text.Add(static_cast<WCHAR>(0x2018 + i % 8)); break;
+          case 2:   text.Add(static_cast<WCHAR>(0x00C0 + i % 64)); break;
+          case 3:   text.Add(static_cast<WCHAR>(0x0100 + i % 128)); break;
+          case 4:   text.Add(static_cast<WCHAR>(0x4E00 + i % 256)); break;
+          case 5:   text.Add(0x221E); break;
+          default:  text.Add(L' '); break;
+        }
+        if (i == 8192 + 500) {
+            text.Add(0xD83D);
+            text.Add(0xDE00);
+        }
+    }
+
+    cbExpected = WideCharToMultiByte(1252, 0, text.GetText(), text.GetLength(),
+                                     NULL, 0, NULL, NULL);
+    CHECK(cbExpected > 0 && expected.Reserve(cbExpected) == S_OK);
+    WideCharToMultiByte(1252, 0, text.GetText(), text.GetLength(),
+                        reinterpret_cast<LPSTR>(expected.GetData()), cbExpected,
+                        NULL, NULL);
+
+    CHECK(CreateProcessingStream(&output, NULL, L"text/plain", NULL, 1252,
+                                 NULL, 0, NULL, NULL, &pStream) == S_OK);
+    CHECK(pStream->Write(&chBOM, sizeof(chBOM), NULL) == S_OK);
+    CHECK(pStream->Write(text.GetText(), text.GetLength() * sizeof(WCHAR), NULL) == S_OK);
+    CHECK(pStream->Commit(0) == S_OK);
+    SAFERELEASE(pStream);
+
+    CHECK(output.m_buffer.GetSize() == (ULONG)cbExpected &&
+          memcmp(output.m_buffer.GetData(), expected.GetData(), cbExpected) == 0);
+}
+
+static void
+TestSingleByteEncoders()
+{
+    TestSingleByteVectors(1252, s_a1252Vectors, COUNTOF(s_a1252Vectors));
+    TestSingleByteVectors(1251, s_a1251Vectors, COUNTOF(s_a1251Vectors));
+    TestSingleByteBMP(1252);
+    TestSingleByteBMP(1251);
+    CHECK(g_singleByteEncoders->Get(CP_UTF8) == NULL);
+    TestSingleByteStream();
+}
+
+// UTF-8 output of a surrogate pair split between writes, which has to
+// be one four-byte character, and of a high surrogate held back at the
+// end of a write and never followed by its other half, which goes out
+// on its own (as cbUTF16ToUTF8 encodes a lone surrogate) with the next
+// write or on Commit.  With and without post-processing, whose output
+// is split again by its own buffering.
+static void
+TestSplitSurrogates()
+{
+    struct SurrogateCase {
+        LPCWSTR     pwszMIMEType;
+        LPCWSTR     apwszPieces[3];         // NULL if fewer
+        const char *pszExpected;
+        ULONG       cbExpected;
+    };
+    static const SurrogateCase s_aCases[] = {
+        { L"text/plain", { L"a\xD83D", L"\xDE00" L"b" },
+          "a\xF0\x9F\x98\x80" "b", 6 },
+        { L"text/plain", { L"a", L"\xD83D", L"\xDE00" },
+          "a\xF0\x9F\x98\x80", 5 },
+        { L"text/plain", { L"a\xD83D" },
+          "a\xED\xA0\xBD", 4 },
+        { L"text/plain", { L"\xD83D", L"x\xD83D" },
+          "\xED\xA0\xBD" "x\xED\xA0\xBD", 7 },
+        { L"text/x-hdml", { L"$\xD83D", L"\xDE00$" },
+          "&dol;\xF0\x9F\x98\x80&dol;", 14 },
+        { L"text/x-hdml", { L"x\xD83D" },
+          "x\xED\xA0\xBD", 4 },
+    };
+    const WCHAR chBOM = 0xFEFF;
+    CText       text;
+    int         iCase;
+    int         iPiece;
+    ULONG       i;
+
+    for (iCase = 0; iCase < (int)COUNTOF(s_aCases); iCase++) {
+        const SurrogateCase & test = s_aCases[iCase];
+        CMemoryStream   output(true);
+        IStream        *pStream = NULL;
+
+        CHECK(CreateProcessingStream(&output, NULL, test.pwszMIMEType, NULL,
+                                     CP_UTF8, NULL, 0, NULL, NULL,
+                                     &pStream) == S_OK);
+        CHECK(pStream->Write(&chBOM, sizeof(chBOM), NULL) == S_OK);
+        for (iPiece = 0; iPiece < 3 && test.apwszPieces[iPiece] != NULL; iPiece++) {
+            CHECK(pStream->Write(test.apwszPieces[iPiece],
+                                 lstrlen(test.apwszPieces[iPiece]) * sizeof(WCHAR),
+                                 NULL) == S_OK);
+        }
+        CHECK(pStream->Commit(0) == S_OK);
+        SAFERELEASE(pStream);
+
+        CHECK(output.m_buffer.GetSize() == test.cbExpected &&
+              memcmp(output.m_buffer.GetData(), test.pszExpected, test.cbExpected) == 0);
+    }
+
+    // A pair across the end of a chunk WriteEncoded encodes at once.
+    for (i = 0; i < 8191; i++) {
+        text.Add(L'a');
+    }
+    text.Add(0xD83D);
+    text.Add(0xDE00);
+    {
+        CMemoryStream   output(true);
+        IStream        *pStream = NULL;
+        const BYTE     *pb;
+
+        CHECK(CreateProcessingStream(&output, NULL, L"text/plain", NULL,
+                                     CP_UTF8, NULL, 0, NULL, NULL,
+                                     &pStream) == S_OK);
+        CHECK(pStream->Write(&chBOM, sizeof(chBOM), NULL) == S_OK);
+        CHECK(pStream->Write(text.GetText(), text.GetLength() * sizeof(WCHAR), NULL) == S_OK);
+        CHECK(pStream->Commit(0) == S_OK);
+        SAFERELEASE(pStream);
+
+        pb = output.m_buffer.GetData();
+        CHECK(output.m_buffer.GetSize() == 8191 + 4 &&
+              pb[8190] == 'a' && memcmp(pb + 8191, "\xF0\x9F\x98\x80", 4) == 0);
+    }
+}
+
+// Writes to a Response without IStream: one BinaryWrite per write of
+// the text (plus the byte-order mark) without gathering; with it, one
+// each time g_cbResponseWriteBuffer bytes have built up, one for a
+// write that big on its own (after one for what was gathered before
+// it), and one for the rest on Commit.  The bytes are the same.
+static void
+TestResponseWrites()
+{
+    struct WritesCase {
+        ULONG   cbWriteBuffer;
+        ULONG   acbPieces[4];               // sizes, 0 if fewer
+        ULONG   numPieces[4];               // times each is written
+        ULONG   numWrites;
+    };
+    static const WritesCase s_aCases[] = {
+        { 0,         { 1000 },             { 40 },       1 + 40 },
+        { 32 * 1024, { 1000 },             { 40 },       2 },
+        { 32 * 1024, { 1000 },             { 20 },       1 },
+        { 1024,      { 300, 3000, 300 },   { 3, 1, 1 },  3 },
+        { 0,         { 300, 3000, 300 },   { 3, 1, 1 },  1 + 5 },
+        { 1024,      { 40000 },            { 1 },        2 },
+    };
+    const WCHAR     chBOM = 0xFEFF;
+    CText           text;
+    int             iCase;
+    int             iPiece;
+    ULONG           i;
+
+    for (i = 0; i < 40000; i++) {
+        text.Add((WCHAR)(L'a' + i % 26));
+    }
+
+    for (iCase = 0; iCase < (int)COUNTOF(s_aCases); iCase++) {
+        const WritesCase & test = s_aCases[iCase];
+        CMemoryResponse response;
+        CPooledBuffer   expected;
+        IStream        *pStream = NULL;
+
+        g_cbResponseWriteBuffer = test.cbWriteBuffer;
+        CHECK(CreateProcessingStream(NULL, &response, L"text/html", NULL,
+                                     CP_UTF16, NULL, 0, NULL, NULL,
+                                     &pStream) == S_OK);
+        CHECK(pStream->Write(&chBOM, sizeof(chBOM), NULL) == S_OK);
+        expected.Append(&chBOM, sizeof(chBOM));
+        for (iPiece = 0; iPiece < 4 && test.acbPieces[iPiece] != 0; iPiece++) {
+            for (i = 0; i < test.numPieces[iPiece]; i++) {
+                CHECK(pStream->Write(text.GetText(), test.acbPieces[iPiece], NULL) == S_OK);
+                expected.Append(text.GetText(), test.acbPieces[iPiece]);
+            }
+        }
+        CHECK(pStream->Commit(0) == S_OK);
+        SAFERELEASE(pStream);
+
+        CHECK(response.m_numWrites == test.numWrites);
+        CHECK(SameBytes(response.m_buffer, expected));
+    }
+    g_cbResponseWriteBuffer = DEFAULT_RESPONSE_WRITE_BUFFER;
+}
+
+static void
+TestGeneratedPages()
+{
+    CText   text;
+    int     nFailed = 0;
+    int     i;
+
+    for (i = 0; i < 8; i++) {
+        GeneratePage(text, i % 2 == 0, 64 * 1024);
+        CheckAgainstReference((i % 2 == 0) ? s_HDMLProfile : s_WMLProfile,
+                              text.GetText(), text.GetLength(),
+                              (i < 4) ? 20000 : 7, &nFailed);
+    }
+    CHECK(nFailed == 0);
+}
+
+static void
+TestRandomMarkup()
+{
+    CText   text;
+    int     nFailed[2] = { 0, 0 };
+    int     i;
+
+    for (i = 0; i < 1000; i++) {
+        GenerateMarkup(text, 50);
+        CheckAgainstReference((i % 2 == 0) ? s_HDMLProfile : s_WMLProfile,
+                              text.GetText(), text.GetLength(),
+                              1 + i % 64, &nFailed[i % 2]);
+    }
+
+    // HDML fails on a '/' in a tag that isn't followed by '>', as it
+    // always has, but enough of the markup has to get through to be of
+    // any use.
+    CHECK(nFailed[0] < 350);
+    CHECK(nFailed[1] == 0);
+}
+
+// Loaded profiles with more characters to replace than the built-in
+// ones, as many as the SSE2 scan takes and more.
+static void
+TestManyChars()
+{
+    static const TestProfile * const s_apProfiles[] = { &s_ManyProfile, &s_TooManyProfile };
+    CText   text;
+    CText   replaced;
+    int     nPageFailed = 0;
+    int     nFailed[2] = { 0, 0 };
+    int     iProfile;
+    int     i;
+
+    for (iProfile = 0; iProfile < 2; iProfile++) {
+        const TestProfile & profile = *s_apProfiles[iProfile];
+
+        for (i = 0; i < 4; i++) {
+            GeneratePage(text, profile.bExpandEmptyTags, 64 * 1024);
+            AddReplacedChars(text, replaced, profile, 16);
+            CheckAgainstReference(profile, replaced.GetText(), replaced.GetLength(),
+                                  (i < 2) ? 20000 : 7, &nPageFailed);
+        }
+
+        for (i = 0; i < 200; i++) {
+            GenerateMarkup(text, 50);
+            AddReplacedChars(text, replaced, profile, 4);
+            CheckAgainstReference(profile, replaced.GetText(), replaced.GetLength(),
+                                  1 + i % 64, &nFailed[iProfile]);
+        }
+    }
+
+    // As in TestRandomMarkup: the first expands empty tags, as HDML does.
+    CHECK(nPageFailed == 0);
+    CHECK(nFailed[0] < 140);
+    CHECK(nFailed[1] == 0);
+}
+
+// ============================================================================
+// Versions of masterConfig.xml
+//      A config whose profiles can't be used is reported once, and the
+//      profiles in use are kept; without the XML cache's version of it,
+//      the file's is used, and without either it's compiled every time.
+
+static int s_numErrors = 0;
+
+HRESULT
+CXMLServerDocument::SetError(LPCWSTR, LPCWSTR, LPCWSTR)
+{
+    s_numErrors++;
+    return S_OK;
+}
+
+// Whether text/x-loaded is post-processed (see UseLoadedProfiles), with
+// the profiles of the config.
+static bool
+LoadedProfileInUse(LPCWSTR pwszConfig = s_wszConfigURL)
+{
+    CMemoryStream stream(true);
+
+    CHECK(Process(s_LoadedProfile.pwszMIMEType, CP_UTF16, L"a$b", 3, 3,
+                  &stream, NULL, pwszConfig) == S_OK);
+    return stream.m_buffer.GetSize() == 2 + 8 * sizeof(WCHAR);
+}
+
+static HRESULT
+ConfigureTest(bool bLoaded, bool bBad, DWORD nVersion, LPCWSTR pwszMappedPath,
+              XmlCacheInfo *pInfoInUse = NULL)
+{
+    CXMLServerDocument  requester;
+    CTestNode          *pConfig;
+    XmlCacheInfo        info;
+
+    pConfig = NewConfig();
+    if (bLoaded) {
+        AddProfile(pConfig, s_LoadedProfile);
+    }
+    if (bBad) {
+        AddProfile(pConfig, s_BadProfile);
+    }
+
+    // Apart from UseLoadedProfiles' versions.
+    ZeroMemory(&info, sizeof(info));
+    if (nVersion != 0) {
+        info.ftLastWrite.dwHighDateTime = 1;
+        info.nFileSize = nVersion;
+    }
+    return g_processingProfiles->Configure(pConfig, info, pwszMappedPath,
+                                           s_wszConfigURL, &requester,
+                                           pInfoInUse);
+}
+
+static void
+TestConfigure()
+{
+    char            szPath[] = "/tmp/processingtestXXXXXX";
+    WCHAR           wszPath[sizeof(szPath)];
+    XmlCacheInfo    infoInUse;
+    int             fd;
+    ULONG           i;
+
+    // Failing once.
+    s_numErrors = 0;
+    CHECK(ConfigureTest(true, false, 1, NULL) == S_OK);
+    CHECK(LoadedProfileInUse());
+    CHECK(FAILED(ConfigureTest(true, true, 2, NULL)));
+    CHECK(s_numErrors == 1);
+    CHECK(ConfigureTest(true, true, 2, NULL) == S_OK);
+    CHECK(ConfigureTest(false, true, 2, NULL) == S_OK);
+    CHECK(s_numErrors == 1);
+    CHECK(LoadedProfileInUse());
+    CHECK(ConfigureTest(false, false, 3, NULL) == S_OK);
+    CHECK(!LoadedProfileInUse());
+    CHECK(FAILED(ConfigureTest(true, true, 2, NULL)));
+    CHECK(s_numErrors == 2);
+
+    // By the file's version, while it's the same.
+    fd = mkstemp(szPath);
+    CHECK(fd >= 0 && write(fd, "<config/>", 9) == 9);
+    for (i = 0; i < sizeof(szPath); i++) {
+        wszPath[i] = static_cast<BYTE>(szPath[i]);
+    }
+
+    CHECK(ConfigureTest(true, false, 0, wszPath) == S_OK);
+    CHECK(LoadedProfileInUse(wszPath));
+    CHECK(ConfigureTest(false, false, 0, wszPath) == S_OK);
+    CHECK(LoadedProfileInUse(wszPath));
+    CHECK(ConfigureTest(true, true, 0, wszPath) == S_OK);
+    CHECK(LoadedProfileInUse(wszPath));
+    CHECK(write(fd, "\n", 1) == 1);
+    CHECK(ConfigureTest(false, false, 0, wszPath) == S_OK);
+    CHECK(!LoadedProfileInUse(wszPath));
+
+    s_numErrors = 0;
+    CHECK(write(fd, "\n", 1) == 1);
+    CHECK(FAILED(ConfigureTest(false, true, 0, wszPath)));
+    CHECK(ConfigureTest(false, true, 0, wszPath) == S_OK);
+    CHECK(s_numErrors == 1);
+
+    close(fd);
+    unlink(szPath);
+
+    // Every time, when there's no version.
+    CHECK(ConfigureTest(true, false, 0, wszPath) == S_OK);
+    CHECK(LoadedProfileInUse(wszPath));
+    CHECK(ConfigureTest(false, false, 0, NULL) == S_OK);
+    CHECK(!LoadedProfileInUse());
+    s_numErrors = 0;
+    CHECK(FAILED(ConfigureTest(false, true, 0, NULL)));
+    CHECK(FAILED(ConfigureTest(false, true, 0, NULL)));
+    CHECK(s_numErrors == 2);
+
+    // Each site's own, even at the same version.
+    CHECK(ConfigureTest(true, false, 7, L"C:\\SiteA\\masterConfig.xml") == S_OK);
+    CHECK(ConfigureTest(false, false, 7, L"C:\\SiteB\\masterConfig.xml") == S_OK);
+    CHECK(LoadedProfileInUse(L"C:\\SiteA\\masterConfig.xml"));
+    CHECK(LoadedProfileInUse(L"c:\\sitea\\MASTERCONFIG.XML"));
+    CHECK(!LoadedProfileInUse(L"C:\\SiteB\\masterConfig.xml"));
+    CHECK(ConfigureTest(true, false, 7, L"C:\\SiteA\\masterConfig.xml") == S_OK);
+    CHECK(!LoadedProfileInUse(L"C:\\SiteB\\masterConfig.xml"));
+    CHECK(!LoadedProfileInUse(L"C:\\SiteC\\masterConfig.xml"));
+    CHECK(!LoadedProfileInUse(NULL));
+    CHECK(ConfigureTest(false, false, 8, L"C:\\SiteA\\masterConfig.xml") == S_OK);
+    CHECK(!LoadedProfileInUse(L"C:\\SiteA\\masterConfig.xml"));
+
+    // The version in use, which the ETag is computed from: a new one
+    // when the profiles change, and not when they're kept.
+    CHECK(ConfigureTest(true, false, 9, L"C:\\SiteD\\masterConfig.xml",
+                        &infoInUse) == S_OK);
+    CHECK(infoInUse.nFileSize == 9);
+    CHECK(ConfigureTest(true, false, 9, L"C:\\SiteD\\masterConfig.xml",
+                        &infoInUse) == S_OK);
+    CHECK(infoInUse.nFileSize == 9);
+    CHECK(ConfigureTest(false, false, 10, L"C:\\SiteD\\masterConfig.xml",
+                        &infoInUse) == S_OK);
+    CHECK(infoInUse.nFileSize == 10);
+    CHECK(FAILED(ConfigureTest(true, true, 11, L"C:\\SiteD\\masterConfig.xml",
+                               &infoInUse)));
+    CHECK(infoInUse.nFileSize == 10);
+    CHECK(ConfigureTest(true, true, 11, L"C:\\SiteD\\masterConfig.xml",
+                        &infoInUse) == S_OK);
+    CHECK(infoInUse.nFileSize == 10);
+    CHECK(ConfigureTest(true, false, 9, L"C:\\SiteE\\masterConfig.xml",
+                        &infoInUse) == S_OK);
+    CHECK(infoInUse.nFileSize == 9);
+    CHECK(ConfigureTest(true, false, 0, L"C:\\SiteE\\masterConfig.xml",
+                        &infoInUse) == S_OK);
+    CHECK(infoInUse.nFileSize == 0 &&
+          infoInUse.ftLastWrite.dwHighDateTime == 0);
+}
+
+// ============================================================================
+// Big-endian UTF-16
+//      vLittleEndianToBigEndian against the loop it replaced, at every
+//      alignment, out of place and in place; and the stream's UTF-16BE
+//      output against the reference's, swapped.
+
+// As vLittleEndianToBigEndian was: a character at a time, and only out
+// of place.
+static void
+SwapBytesBaseline(LPCWSTR pwch, UINT cch, BYTE *pb)
+{
+    for (UINT i = cch; i > 0; i--) {
+        *pb++ = static_cast<BYTE>((*pwch) >> 8);
+        *pb++ = static_cast<BYTE>((*pwch++) & 0xFF);
+    }
+}
+
+// Output in UTF-16, after its byte-order mark, as UTF-16BE.
+static void
+SwapOutput(const CPooledBuffer & little, CPooledBuffer & big)
+{
+    LPCWSTR pwch = reinterpret_cast<LPCWSTR>(little.GetData() + 2);
+    ULONG   cch = (little.GetSize() - 2) / sizeof(WCHAR);
+    BYTE    ab[2 * 1024];
+    ULONG   cchPiece;
+
+    big.Empty();
+    big.Append("\xFE\xFF", 2);
+    for (; cch > 0; pwch += cchPiece, cch -= cchPiece) {
+        cchPiece = (cch < 1024) ? cch : 1024;
+        SwapBytesBaseline(pwch, cchPiece, ab);
+        big.Append(ab, cchPiece * sizeof(WCHAR));
+    }
+}
+
+static void
+TestByteSwap()
+{
+    static const UINT s_acch[] = { 1000, 1024, 4096 + 7 };
+    static WCHAR    s_awch[4096 + 16];
+    static WCHAR    s_awchInPlace[4096 + 16];
+    static BYTE     s_abExpected[2 * (4096 + 16)];
+    static BYTE     s_abActual[2 * (4096 + 16) + 16];
+    CText           text;
+    CPooledBuffer   little;
+    CPooledBuffer   big;
+    UINT            cch;
+    UINT            iLength;
+    UINT            offset;
+    UINT            i;
+    int             mode;
+
+    for (i = 0; i < COUNTOF(s_awch); i++) {
+        s_awch[i] = static_cast<WCHAR>(Random(0x8000) * 2 + Random(2));
+    }
+
+    for (iLength = 0; iLength < 41 + COUNTOF(s_acch); iLength++) {
+        cch = (iLength < 41) ? iLength : s_acch[iLength - 41];
+
+        for (offset = 0; offset < 16; offset++) {
+            LPCWSTR pwch = s_awch + offset % 8;
+
+            SwapBytesBaseline(pwch, cch, s_abExpected);
+
+            memset(s_abActual, 0xCC, sizeof(s_abActual));
+            vLittleEndianToBigEndian(pwch, cch, s_abActual + offset);
+            CHECK(memcmp(s_abActual + offset, s_abExpected, cch * sizeof(WCHAR)) == 0);
+            CHECK(s_abActual[offset + cch * sizeof(WCHAR)] == 0xCC);
+            CHECK(offset == 0 || s_abActual[offset - 1] == 0xCC);
+
+            memcpy(s_awchInPlace, pwch, cch * sizeof(WCHAR));
+            vLittleEndianToBigEndian(s_awchInPlace, cch,
+                                     reinterpret_cast<BYTE *>(s_awchInPlace));
+            CHECK(memcmp(s_awchInPlace, s_abExpected, cch * sizeof(WCHAR)) == 0);
+        }
+    }
+
+    // Passed through, and post-processed, in pieces.
+    GeneratePage(text, false, 64 * 1024);
+    for (mode = 0; mode < 4; mode++) {
+        CMemoryStream stream(true);
+
+        if (mode < 2) {
+            little.Empty();
+            little.Append("\xFF\xFE", 2);
+            little.Append(text.GetText(), text.GetLength() * sizeof(WCHAR));
+        } else {
+            CHECK(ProcessReference(s_WMLProfile, text.GetText(), text.GetLength(),
+                                   little) == S_OK);
+        }
+        SwapOutput(little, big);
+
+        CHECK(Process((mode < 2) ? L"text/plain" : s_WMLProfile.pwszMIMEType,
+                      CP_UTF16FFFE, text.GetText(), text.GetLength(),
+                      (mode % 2) ? 7 : 20000, &stream, NULL) == S_OK);
+        CHECK(SameBytes(stream.m_buffer, big));
+    }
+}
+
+// ============================================================================
+// Throughput
+//      Large generated pages in pieces of up to 20000 characters, through
+//      the reference, and through the stream for the built-in profile and
+//      for the same profile loaded from masterConfig.xml (the generic
+//      state machine), without SSE2 and with it, to a stream that only
+//      counts; and the same for the profiles that are only loaded, with
+//      more characters to replace, on the same pages.  MB/s is of UTF-16
+//      in.
+
+static double
+Seconds(const LARGE_INTEGER & start)
+{
+    LARGE_INTEGER   now;
+    LARGE_INTEGER   frequency;
+
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&frequency);
+    return static_cast<double>(now.QuadPart - start.QuadPart) / frequency.QuadPart;
+}
+
+static void
+ReportThroughput(ULONG cch)
+{
+    static const TestProfile * const s_apProfiles[] = {
+        &s_HDMLProfile, &s_WMLProfile, &s_ManyProfile, &s_TooManyProfile
+    };
+    CText           text;
+    CPooledBuffer   output;
+    LARGE_INTEGER   start;
+    double          best[5];
+    int             iProfile;
+    int             mode;
+    int             rep;
+
+    printf("processingtest: a %lu KB page in pieces of up to 20000 characters, in MB/s:\n"
+           "                       ------ built-in -----   ------ loaded -------\n"
+           "              reference     scalar       SSE2     scalar       SSE2\n",
+           static_cast<unsigned long>(cch * sizeof(WCHAR) / 1024));
+
+    for (iProfile = 0; iProfile < (int)COUNTOF(s_apProfiles); iProfile++) {
+        const TestProfile & profile = *s_apProfiles[iProfile];
+
+        GeneratePage(text, profile.bExpandEmptyTags, cch);
+        for (mode = 0; mode < 5; mode++) {
+            best[mode] = 1e9;
+        }
+
+        for (rep = 0; rep < 5; rep++) {
+            QueryPerformanceCounter(&start);
+            ProcessReference(profile, text.GetText(), text.GetLength(), output);
+            if (Seconds(start) < best[0]) {
+                best[0] = Seconds(start);
+            }
+
+            // 1 and 2 built-in, 3 and 4 loaded; 2 and 4 with SSE2.
+            for (mode = 1; mode < 5; mode++) {
+                CMemoryStream stream(false);
+
+                if ((mode % 2 == 0 && !s_bHaveSSE2) ||
+                    (mode < 3 && !IsBuiltIn(profile))) {
+                    continue;
+                }
+                if (mode % 2 == 1) {
+                    UseLoadedProfiles(mode >= 3);
+                }
+                UseSSE2(mode % 2 == 0);
+                QueryPerformanceCounter(&start);
+                Process(profile.pwszMIMEType, CP_UTF16, text.GetText(),
+                        text.GetLength(), 20000, &stream, NULL);
+                if (Seconds(start) < best[mode]) {
+                    best[mode] = Seconds(start);
+                }
+            }
+            UseLoadedProfiles(false);
+            UseSSE2(true);
+        }
+
+        printf("    %-8s", profile.pszName);
+        for (mode = 0; mode < 5; mode++) {
+            if ((mode % 2 == 0 && mode > 0 && !s_bHaveSSE2) ||
+                (mode > 0 && mode < 3 && !IsBuiltIn(profile))) {
+                printf("          -");
+            } else {
+                printf(" %10.0f", text.GetLength() * sizeof(WCHAR) / best[mode] / 1e6);
+            }
+        }
+        printf("\n");
+    }
+}
+
+// The byte swap of UTF-16BE output, of a large generated page, by the
+// loop vLittleEndianToBigEndian replaced and by it, 8192 characters at
+// a time as the stream encodes.  MB/s is of UTF-16 in.
+static void
+ReportByteSwap(ULONG cch)
+{
+    const ULONG     cchChunk = 8192;
+    CText           text;
+    CPooledBuffer   baseline;
+    CPooledBuffer   swapped;
+    LARGE_INTEGER   start;
+    double          best[2];
+    ULONG           ich;
+    ULONG           cchPiece;
+    int             rep;
+
+    GeneratePage(text, false, cch);
+    CHECK(baseline.Reserve(text.GetLength() * sizeof(WCHAR)) == S_OK);
+    CHECK(swapped.Reserve(text.GetLength() * sizeof(WCHAR)) == S_OK);
+    best[0] = best[1] = 1e9;
+
+    for (rep = 0; rep < 5; rep++) {
+        QueryPerformanceCounter(&start);
+        for (ich = 0; ich < text.GetLength(); ich += cchPiece) {
+            cchPiece = (text.GetLength() - ich < cchChunk) ? text.GetLength() - ich : cchChunk;
+            SwapBytesBaseline(text.GetText() + ich, cchPiece,
+                              baseline.GetData() + ich * sizeof(WCHAR));
+        }
+        if (Seconds(start) < best[0]) {
+            best[0] = Seconds(start);
+        }
+
+        QueryPerformanceCounter(&start);
+        for (ich = 0; ich < text.GetLength(); ich += cchPiece) {
+            cchPiece = (text.GetLength() - ich < cchChunk) ? text.GetLength() - ich : cchChunk;
+            vLittleEndianToBigEndian(text.GetText() + ich, cchPiece,
+                                     swapped.GetData() + ich * sizeof(WCHAR));
+        }
+        if (Seconds(start) < best[1]) {
+            best[1] = Seconds(start);
+        }
+    }
+    CHECK(memcmp(baseline.GetData(), swapped.GetData(),
+                 text.GetLength() * sizeof(WCHAR)) == 0);
+
+    printf("processingtest: UTF-16BE byte swap, %lu characters at a time, in MB/s:\n"
+           "             %10s %10s\n"
+           "    %-8s %10.0f %10.0f\n",
+           static_cast<unsigned long>(cchChunk),
+           "baseline", s_bHaveSSE2 ? "SSE2" : "scalar", "swap",
+           text.GetLength() * sizeof(WCHAR) / best[0] / 1e6,
+           text.GetLength() * sizeof(WCHAR) / best[1] / 1e6);
+}
+
+int
+main(int argc, char **argv)
+{
+    ULONG cbPage = 16 * 1024 * 1024;
+
+    if (argc > 1) {
+        cbPage = static_cast<ULONG>(atoi(argv[1])) * 1024 * 1024;
+    }
+
+    s_bHaveSSE2 = IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE) != FALSE;
+
+    CHECK(CProcessingProfiles::VerifyBuiltIn());
+    TestGolden();
+    TestStatefulEncoding();
+    TestSingleByteEncoders();
+    TestResponseWrites();
+    TestSplitSurrogates();
+    TestGeneratedPages();
+    TestRandomMarkup();
+    TestManyChars();
+    TestConfigure();
+    TestByteSwap();
+    ReportThroughput(cbPage / sizeof(WCHAR));
+    ReportByteSwap(cbPage / sizeof(WCHAR));
+
+    if (g_failures) {
+        printf("processingtest: %d failed\n", g_failures);
+        return 1;
+    }
+
+    printf("processingtest: passed\n");
+    return 0;
+}
@@ -0,0 +1,664 @@
+// ============================================================================
+// FILE: StdAfx.h
+//
+//      Stands in for Source/StdAfx.h when building parts of XSLISAPI
+//      for the tests: just enough of Win32, COM and ATL, on the C
+//      library and POSIX threads, for the files the tests use.  Only
+//      what they call is here, and it behaves only as far as they rely
+//      on it (see win32.cpp).
+//
+//      Built with -fshort-wchar, so that WCHAR is UTF-16 as on Windows.
+//      The C library's wide string functions then don't work, so
+//      <wchar.h> mustn't be included; the ones XSLISAPI uses are here.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#pragma once
+
+#include <assert.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ============================================================================
+// Types
+
+typedef int                 HRESULT;
+typedef int                 BOOL;
+typedef long                LONG;
+typedef unsigned int        ULONG;
+typedef unsigned int        DWORD;
+typedef unsigned int        UINT;
+typedef int                 INT;
+typedef unsigned short      WORD;
+typedef unsigned short      USHORT;
+typedef unsigned char       BYTE;
+typedef long long           LONGLONG;
+typedef unsigned long long  DWORDLONG;
+typedef void               *LPVOID;
+typedef wchar_t             WCHAR;
+typedef WCHAR               OLECHAR;
+typedef WCHAR              *BSTR;
+typedef WCHAR              *LPWSTR;
+typedef const WCHAR        *LPCWSTR;
+typedef char               *LPSTR;
+typedef const char         *LPCSTR;
+typedef void               *HANDLE;
+typedef HANDLE              HINSTANCE;
+typedef HINSTANCE           HMODULE;
+typedef char                TCHAR;
+
+union LARGE_INTEGER {
+    LONGLONG    QuadPart;
+};
+
+union ULARGE_INTEGER {
+    DWORDLONG   QuadPart;
+};
+
+struct FILETIME {
+    DWORD   dwLowDateTime;
+    DWORD   dwHighDateTime;
+};
+
+// The compiler has SSE2, as VC does for x64.
+#if defined(__x86_64__) && !defined(_M_X64)
+#define _M_X64
+#endif
+
+#define TRUE                1
+#define FALSE               0
+#define INFINITE            0xFFFFFFFF
+#define MAXDWORD            0xFFFFFFFF
+#define WAIT_OBJECT_0       0
+#define WAIT_TIMEOUT        258
+#define WAIT_FAILED         ((DWORD)0xFFFFFFFF)
+#define MAX_PATH            260
+#define COINIT_MULTITHREADED 0
+#define TLS_OUT_OF_INDEXES  ((DWORD)0xFFFFFFFF)
+#define SYNCHRONIZE         0x00100000L
+#define CP_ACP              0
+#define CP_UTF7             65000
+#define CP_UTF8             65001
+#define MAX_LEADBYTES       12
+#define MAX_DEFAULTCHAR     2
+
+#define S_OK                ((HRESULT)0)
+#define S_FALSE             ((HRESULT)1)
+#define E_FAIL              ((HRESULT)0x80004005L)
+#define E_OUTOFMEMORY       ((HRESULT)0x8007000EL)
+#define E_INVALIDARG        ((HRESULT)0x80070057L)
+#define E_NOTIMPL           ((HRESULT)0x80004001L)
+#define E_NOINTERFACE       ((HRESULT)0x80004002L)
+#define E_POINTER           ((HRESULT)0x80004003L)
+#define STG_E_INVALIDPOINTER ((HRESULT)0x80030009L)
+#define STG_E_CANTSAVE      ((HRESULT)0x80030103L)
+#define HRESULT_FROM_WIN32(x) ((HRESULT)(x) <= 0 ? (HRESULT)(x) : \
+                               (HRESULT)(((x) & 0x0000FFFF) | 0x80070000))
+#define FAILED(hr)          (((HRESULT)(hr)) < 0)
+#define SUCCEEDED(hr)       (((HRESULT)(hr)) >= 0)
+
+// ============================================================================
+// Error handling and debugging, as in Utils.h
+
+#define ASSERT(exp)         assert(exp)
+#define ERRORTRACE(hr)
+
+#define RETURNERR(hrToReturn) \
+  {                     \
+      hr = hrToReturn;  \
+      goto Error;       \
+  }
+
+#define ERRCHECK(cond, hrToReturn) \
+  if (cond) {           \
+      hr = hrToReturn;  \
+      goto Error;       \
+  }
+
+#define HRCHECK(cond) \
+  if (cond) {         \
+      goto Error;     \
+  }
+
+#ifndef COUNTOF
+#define COUNTOF(x) (sizeof(x)/sizeof(x[0]))
+#endif
+
+#define SAFERELEASE(ptr)   \
+  if (ptr != NULL) {       \
+      ptr->Release();      \
+      ptr = NULL;          \
+  }
+
+#define CopyMemory(pvTo, pvFrom, cb)    memcpy((pvTo), (pvFrom), (cb))
+#define ZeroMemory(pv, cb)              memset((pv), 0, (cb))
+
+// Always there.
+#define IsBadReadPtr(pv, cb)            FALSE
+
+// The last error is never set.
+#define GetLastError()                  0
+
+#define __fastcall
+#define FAR
+#define __RPC_FAR
+
+// ============================================================================
+// Kernel
+
+LONG InterlockedIncrement(LONG volatile *plValue);
+LONG InterlockedDecrement(LONG volatile *plValue);
+LONG InterlockedExchange(LONG volatile *plTarget, LONG lValue);
+LONG InterlockedExchangeAdd(LONG volatile *plAddend, LONG lValue);
+
+struct CRITICAL_SECTION {
+    void   *m_pMutex;
+};
+
+void InitializeCriticalSection(CRITICAL_SECTION *pcs);
+void DeleteCriticalSection(CRITICAL_SECTION *pcs);
+void EnterCriticalSection(CRITICAL_SECTION *pcs);
+void LeaveCriticalSection(CRITICAL_SECTION *pcs);
+
+DWORD TlsAlloc();
+BOOL TlsFree(DWORD dwTlsIndex);
+void * TlsGetValue(DWORD dwTlsIndex);
+BOOL TlsSetValue(DWORD dwTlsIndex, void *pvValue);
+
+typedef DWORD (*LPTHREAD_START_ROUTINE)(void *pvParameter);
+#define WINAPI
+
+HANDLE CreateThread(void *pSecurity,
+                    DWORD cbStack,
+                    LPTHREAD_START_ROUTINE pfnStart,
+                    void *pvParameter,
+                    DWORD dwFlags,
+                    DWORD *pdwThreadId);
+HANDLE CreateEvent(void *pSecurity,
+                   BOOL bManualReset,
+                   BOOL bInitialState,
+                   LPCSTR pszName);
+BOOL SetEvent(HANDLE hEvent);
+BOOL ResetEvent(HANDLE hEvent);
+HANDLE CreateSemaphore(void *pSecurity,
+                       LONG lInitialCount,
+                       LONG lMaximumCount,
+                       LPCSTR pszName);
+BOOL ReleaseSemaphore(HANDLE hSemaphore, LONG lReleaseCount, LONG *plPreviousCount);
+DWORD WaitForSingleObject(HANDLE hHandle, DWORD dwMilliseconds);
+DWORD WaitForMultipleObjects(DWORD nCount,
+                             const HANDLE *phHandles,
+                             BOOL bWaitAll,
+                             DWORD dwMilliseconds);
+BOOL CloseHandle(HANDLE hObject);
+
+// Only GetCurrentThread() can be duplicated.
+HANDLE GetCurrentProcess();
+HANDLE GetCurrentThread();
+BOOL DuplicateHandle(HANDLE hSourceProcess,
+                     HANDLE hSource,
+                     HANDLE hTargetProcess,
+                     HANDLE *phTarget,
+                     DWORD dwDesiredAccess,
+                     BOOL bInheritHandle,
+                     DWORD dwOptions);
+
+void Sleep(DWORD dwMilliseconds);
+DWORD GetTickCount();
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER *pCount);
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *pFrequency);
+
+// PF_XMMI64_INSTRUCTIONS_AVAILABLE is there unless XSLISAPI_NO_SSE2 is
+// set in the environment, so that the tests can try both ways.
+#define PF_XMMI64_INSTRUCTIONS_AVAILABLE 10
+BOOL IsProcessorFeaturePresent(DWORD dwProcessorFeature);
+
+// ============================================================================
+// Strings
+
+int lstrlenW(LPCWSTR pwsz);
+int lstrcmpW(LPCWSTR pwsz1, LPCWSTR pwsz2);
+int lstrcmpiW(LPCWSTR pwsz1, LPCWSTR pwsz2);   // folds ASCII only
+LPWSTR lstrcpyW(LPWSTR pwszTo, LPCWSTR pwszFrom);
+#define lstrlen  lstrlenW
+
+LPWSTR lstrcpynW(LPWSTR pwszTo, LPCWSTR pwszFrom, int cchMax);
+
+// ASCII only.
+int wcscmp(const wchar_t *pwsz1, const wchar_t *pwsz2);
+wchar_t towlower(wchar_t wch);
+
+// ASCII and Latin-1.
+LPWSTR CharUpperW(LPWSTR pwsz);
+LPWSTR CharLowerW(LPWSTR pwsz);
+DWORD CharLowerBuffW(LPWSTR pwsz, DWORD cch);
+
+#define lstrcmp  lstrcmpW
+#define lstrcmpi lstrcmpiW
+#define lstrcpy  lstrcpyW
+#define lstrcpyn lstrcpynW
+
+// CP_ACP is Latin-1.  CP_UTF8 is as Windows 2000 has it: an unpaired
+// surrogate is encoded on its own.  CP_UTF7 encodes only letters,
+// digits and space directly, and ends each run of base64 with '-'.
+// 1252 and 1251 are single-byte, from their tables, with some of the
+// best-fit mappings and '?' for the rest.  No others.
+int WideCharToMultiByte(UINT CodePage,
+                        DWORD dwFlags,
+                        LPCWSTR pwch,
+                        int cwch,
+                        char *pch,
+                        int cb,
+                        LPCSTR pszDefault,
+                        BOOL *pbUsedDefault);
+int MultiByteToWideChar(UINT CodePage,
+                        DWORD dwFlags,
+                        LPCSTR pch,
+                        int cb,
+                        LPWSTR pwch,
+                        int cwch);
+
+struct CPINFO {
+    UINT    MaxCharSize;
+    BYTE    DefaultChar[MAX_DEFAULTCHAR];
+    BYTE    LeadByte[MAX_LEADBYTES];
+};
+
+// Only 1252 and 1251, which are single-byte.
+BOOL GetCPInfo(UINT CodePage, CPINFO *pCPInfo);
+
+// %[0][width][l]{d,u,x,s,c}; l is 32 bits, as on Windows, and %s a
+// WCHAR string.
+int wsprintfW(WCHAR *pwszOut, LPCWSTR pwszFormat, ...);
+#define wsprintf wsprintfW
+
+// Thrown away.
+void OutputDebugStringW(LPCWSTR pwszOutput);
+#define OutputDebugString OutputDebugStringW
+
+BSTR SysAllocString(LPCWSTR pwsz);
+BSTR SysAllocStringLen(LPCWSTR pwch, UINT cch);
+void SysFreeString(BSTR bstr);
+UINT SysStringLen(BSTR bstr);
+
+// ============================================================================
+// Modules and COM
+
+class CComModule
+{
+  public:
+    HINSTANCE GetModuleInstance();
+};
+
+extern CComModule _Module;
+
+DWORD GetModuleFileName(HINSTANCE hModule, TCHAR *pszFileName, DWORD cchFileName);
+HINSTANCE LoadLibrary(const TCHAR *pszFileName);
+BOOL FreeLibrary(HMODULE hModule);
+
+// LoadLibrary calls FreeLibrary hasn't balanced yet.
+extern LONG g_numModuleLoads;
+
+HRESULT CoInitializeEx(void *pvReserved, DWORD dwCoInit);
+void CoUninitialize();
+
+// ============================================================================
+// COM interfaces
+//      Only the methods XSLISAPI calls.  Each fails with E_NOTIMPL (or
+//      counts nothing) unless a test's class overrides it, so that a
+//      test only writes the ones it uses.
+
+struct GUID {
+    DWORD   Data1;
+    WORD    Data2;
+    WORD    Data3;
+    BYTE    Data4[8];
+};
+
+typedef GUID        IID;
+typedef const IID & REFIID;
+
+extern const IID IID_IUnknown;
+extern const IID IID_ISequentialStream;
+extern const IID IID_IStream;
+
+inline bool
+InlineIsEqualGUID(REFIID riid1, REFIID riid2)
+{
+    return memcmp(&riid1, &riid2, sizeof(IID)) == 0;
+}
+
+inline bool
+InlineIsEqualUnknown(REFIID riid)
+{
+    return InlineIsEqualGUID(riid, IID_IUnknown);
+}
+
+#define STDMETHOD(method)           virtual HRESULT method
+#define STDMETHOD_(type, method)    virtual type method
+#define STDMETHODIMP                HRESULT
+#define STDMETHODIMP_(type)         type
+
+struct IUnknown
+{
+    virtual ~IUnknown() {}
+
+    STDMETHOD(QueryInterface)(REFIID, LPVOID *) { return E_NOINTERFACE; }
+    STDMETHOD_(ULONG, AddRef)() { return 1; }
+    STDMETHOD_(ULONG, Release)() { return 1; }
+};
+
+struct ISequentialStream : public IUnknown
+{
+    STDMETHOD(Read)(void *, ULONG, ULONG *) { return E_NOTIMPL; }
+    STDMETHOD(Write)(const void *, ULONG, ULONG *) { return E_NOTIMPL; }
+};
+
+struct STATSTG;
+
+struct IStream : public ISequentialStream
+{
+    STDMETHOD(Seek)(LARGE_INTEGER, DWORD, ULARGE_INTEGER *) { return E_NOTIMPL; }
+    STDMETHOD(SetSize)(ULARGE_INTEGER) { return E_NOTIMPL; }
+    STDMETHOD(CopyTo)(IStream *, ULARGE_INTEGER, ULARGE_INTEGER *, ULARGE_INTEGER *) { return E_NOTIMPL; }
+    STDMETHOD(Commit)(DWORD) { return E_NOTIMPL; }
+    STDMETHOD(Revert)() { return E_NOTIMPL; }
+    STDMETHOD(LockRegion)(ULARGE_INTEGER, ULARGE_INTEGER, DWORD) { return E_NOTIMPL; }
+    STDMETHOD(UnlockRegion)(ULARGE_INTEGER, ULARGE_INTEGER, DWORD) { return E_NOTIMPL; }
+    STDMETHOD(Stat)(STATSTG *, DWORD) { return E_NOTIMPL; }
+    STDMETHOD(Clone)(IStream **) { return E_NOTIMPL; }
+};
+
+// A VARIANT holds only a SAFEARRAY, for Response.BinaryWrite.
+struct SAFEARRAYBOUND {
+    ULONG   cElements;
+    LONG    lLbound;
+};
+
+struct SAFEARRAY {
+    USHORT          cDims;
+    USHORT          fFeatures;
+    ULONG           cbElements;
+    ULONG           cLocks;
+    void           *pvData;
+    SAFEARRAYBOUND  rgsabound[1];
+};
+
+#define FADF_FIXEDSIZE      0x0010
+#define VT_UI1              17
+#define VT_ARRAY            0x2000
+
+struct VARIANT {
+    USHORT      vt;
+    SAFEARRAY  *parray;
+};
+
+#define V_VT(pvar)          ((pvar)->vt)
+#define V_ARRAY(pvar)       ((pvar)->parray)
+
+namespace asp {
+    struct IResponse : public IUnknown
+    {
+        STDMETHOD(AddHeader)(LPCWSTR, LPCWSTR) { return E_NOTIMPL; }
+        STDMETHOD(BinaryWrite)(VARIANT) { return E_NOTIMPL; }
+    };
+}
+
+// The DOM, as far as post-processing profiles are read from it.  The
+// value GetSingleNodeValue gives is the selected node's text.
+struct IXMLDOMNodeList;
+
+struct IXMLDOMNode : public IUnknown
+{
+    STDMETHOD(selectNodes)(LPCWSTR, IXMLDOMNodeList **) { return E_NOTIMPL; }
+    STDMETHOD(selectSingleNode)(LPCWSTR, IXMLDOMNode **) { return E_NOTIMPL; }
+    STDMETHOD(get_text)(BSTR *) { return E_NOTIMPL; }
+};
+
+struct IXMLDOMNodeList : public IUnknown
+{
+    STDMETHOD(get_length)(long *) { return E_NOTIMPL; }
+    STDMETHOD(nextNode)(IXMLDOMNode **) { return E_NOTIMPL; }
+};
+
+struct IXMLDOMDocument : public IXMLDOMNode
+{
+};
+
+// ============================================================================
+// CComPtr
+
+template <class T>
+class CComPtr
+{
+  public:
+    CComPtr() : p(NULL) {}
+
+    CComPtr(T *lp) : p(lp) {
+        if (p) {
+            p->AddRef();
+        }
+    }
+
+    ~CComPtr() {
+        if (p) {
+            p->Release();
+        }
+    }
+
+    void Release() {
+        T *pTemp = p;
+
+        if (pTemp) {
+            p = NULL;
+            pTemp->Release();
+        }
+    }
+
+    T * operator=(T *lp) {
+        if (lp) {
+            lp->AddRef();
+        }
+        if (p) {
+            p->Release();
+        }
+        p = lp;
+        return p;
+    }
+
+    operator T *() const {
+        return p;
+    }
+
+    T * operator->() const {
+        return p;
+    }
+
+    T ** operator&() {
+        ASSERT(p == NULL);
+        return &p;
+    }
+
+    T      *p;
+
+  private:
+    CComPtr(const CComPtr &);
+    CComPtr & operator=(const CComPtr &);
+};
+
+// ============================================================================
+// CComBSTR
+
+class CComBSTR
+{
+  public:
+    CComBSTR() : m_str(NULL) {}
+    CComBSTR(LPCWSTR pwsz) : m_str(SysAllocString(pwsz)) {}
+    ~CComBSTR() {
+        SysFreeString(m_str);
+    }
+
+    CComBSTR & operator=(LPCWSTR pwsz);
+    HRESULT Append(LPCWSTR pwsz);
+
+    UINT Length() const {
+        return SysStringLen(m_str);
+    }
+
+    void Empty() {
+        SysFreeString(m_str);
+        m_str = NULL;
+    }
+
+    BSTR Detach() {
+        BSTR str = m_str;
+
+        m_str = NULL;
+        return str;
+    }
+
+    operator BSTR() const {
+        return m_str;
+    }
+
+    BSTR * operator&() {
+        return &m_str;
+    }
+
+    BSTR    m_str;
+
+  private:
+    CComBSTR(const CComBSTR &);
+    CComBSTR & operator=(const CComBSTR &);
+};
+
+// ============================================================================
+// XSLISAPI
+
+// As in xmlcache.h, which needs more of MSXML than is here.
+struct XmlCacheInfo {
+    FILETIME ftLastWrite;
+    DWORD    nFileSize;
+    DWORD    dwIncludes;
+};
+
+// Only what's reported to it.  A test that reports errors defines
+// SetError.
+class CXMLServerDocument
+{
+  public:
+    HRESULT SetError(LPCWSTR pwszError, LPCWSTR pwszURL, LPCWSTR pwszStatus);
+};
+
+// Declared by Global.h, not used here.
+namespace fso { struct IFileSystem; }
+class CXmlCache;
+
+#include "arena.h"
+#include "bufferpool.h"
+#include "Global.h"
+#include "workerpool.h"
+#include "deflate.h"
+#include "phasestats.h"
+#include "ProcessingStream.h"
+
+// ============================================================================
+// As in Utils.h (which needs ASP and more of MSXML)
+
+template <typename Element, typename Key>
+int
+LookupSortedArray(
+    Key const* pKey,
+    Element const* pElemArray,
+    int nElemCount,
+    int (__fastcall* pfnCompare)(Key const* pKey, Element const* pElem))
+{
+    int nLeft = 0;
+    int nRight = nElemCount - 1;
+
+    while (nLeft <= nRight)
+    {
+        int nPivot = (nLeft + nRight) / 2;
+        int nCmp = pfnCompare (pKey, pElemArray + nPivot);
+        if (nCmp == 0)
+        {
+            return nPivot;
+        }
+        else if (nCmp < 0)
+        {
+            nRight = nPivot - 1;
+        }
+        else
+        {
+            nLeft = nPivot + 1;
+        }
+    }
+    return -1;
+}
+
+template <typename Element>
+bool
+VerifySortedArray(
+    Element const* pElemArray,
+    int nElemCount,
+    int (__fastcall* pfnCompare)(Element const* pElem1, Element const* pElem2))
+{
+    for (int i = 1; i < nElemCount; i++)
+    {
+        if (pfnCompare (pElemArray + i - 1, pElemArray + i) > 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename Element>
+void
+SortArray(
+    Element* pElemArray,
+    int nElemCount,
+    int (__fastcall* pfnCompare)(Element const* pElem1, Element const* pElem2))
+{
+    for (int i = 1; i < nElemCount; i++)
+    {
+        Element elem = pElemArray[i];
+        int j = i;
+
+        while (j > 0 && pfnCompare (&elem, pElemArray + j - 1) < 0)
+        {
+            pElemArray[j] = pElemArray[j - 1];
+            j--;
+        }
+        pElemArray[j] = elem;
+    }
+}
+
+extern const BYTE g_bIsWhitespace[];
+extern const int g_nSingleQuoteTransition[];
+
+#define CHAR_IS_WHITESPACE(c) (g_bIsWhitespace[c] != 0)
+#define QUOTE_SINGLE_QUOTE_TRANSITION(curstate) (g_nSingleQuoteTransition[curstate])
+
+HRESULT CreateProcessingStream(IStream * pOutputStream,
+                               asp::IResponse * pResponse,
+                               const WCHAR * pwszStreamLanguage,
+                               const WCHAR * pwszProfilesConfig,
+                               UINT uiCP,
+                               const WCHAR * pwszContentEncoding,
+                               ULONG cbCompressMin,
+                               bool * pfEncodingHeaderSent,
+                               CRequestTrace * pTrace,
+                               IStream ** ppProcessingStream);
+
+// The text of the node pwszXPath selects, or NULL if there's none.
+HRESULT GetSingleNodeValue(IXMLDOMNode *pNode,
+                           LPCWSTR pwszXPath,
+                           BSTR *pbstrValue);
+
+HRESULT GetFileCacheInfo(const wchar_t *pwszFilename,
+                         XmlCacheInfo  *pInfo);
@@ -0,0 +1,1159 @@
+// ============================================================================
+// FILE: win32.cpp
+//
+//      What StdAfx.h in this directory declares, on the C library and
+//      POSIX threads.
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "StdAfx.h"
+
+// ============================================================================
+// Interfaces
+
+const IID IID_IUnknown =
+    { 0x00000000, 0x0000, 0x0000, { 0xC0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46 } };
+const IID IID_ISequentialStream =
+    { 0x0C733A30, 0x2A1C, 0x11CE, { 0xAD, 0xE5, 0x00, 0xAA, 0x00, 0x44, 0x77, 0x3D } };
+const IID IID_IStream =
+    { 0x0000000C, 0x0000, 0x0000, { 0xC0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46 } };
+
+// ============================================================================
+// Interlocked
+
+LONG
+InterlockedIncrement(LONG volatile *plValue)
+{
+    return __sync_add_and_fetch(plValue, 1);
+}
+
+LONG
+InterlockedDecrement(LONG volatile *plValue)
+{
+    return __sync_sub_and_fetch(plValue, 1);
+}
+
+LONG
+InterlockedExchange(LONG volatile *plTarget, LONG lValue)
+{
+    return __sync_lock_test_and_set(plTarget, lValue);
+}
+
+LONG
+InterlockedExchangeAdd(LONG volatile *plAddend, LONG lValue)
+{
+    return __sync_fetch_and_add(plAddend, lValue);
+}
+
+// ============================================================================
+// Critical sections
+
+void
+InitializeCriticalSection(CRITICAL_SECTION *pcs)
+{
+    pthread_mutexattr_t attr;
+
+    pcs->m_pMutex = new pthread_mutex_t;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(static_cast<pthread_mutex_t *>(pcs->m_pMutex), &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void
+DeleteCriticalSection(CRITICAL_SECTION *pcs)
+{
+    pthread_mutex_destroy(static_cast<pthread_mutex_t *>(pcs->m_pMutex));
+    delete static_cast<pthread_mutex_t *>(pcs->m_pMutex);
+}
+
+void
+EnterCriticalSection(CRITICAL_SECTION *pcs)
+{
+    pthread_mutex_lock(static_cast<pthread_mutex_t *>(pcs->m_pMutex));
+}
+
+void
+LeaveCriticalSection(CRITICAL_SECTION *pcs)
+{
+    pthread_mutex_unlock(static_cast<pthread_mutex_t *>(pcs->m_pMutex));
+}
+
+// ============================================================================
+// Thread local storage
+
+DWORD
+TlsAlloc()
+{
+    pthread_key_t key;
+
+    if (pthread_key_create(&key, NULL) != 0) {
+        return TLS_OUT_OF_INDEXES;
+    }
+    return static_cast<DWORD>(key);
+}
+
+BOOL
+TlsFree(DWORD dwTlsIndex)
+{
+    return pthread_key_delete(static_cast<pthread_key_t>(dwTlsIndex)) == 0;
+}
+
+void *
+TlsGetValue(DWORD dwTlsIndex)
+{
+    return pthread_getspecific(static_cast<pthread_key_t>(dwTlsIndex));
+}
+
+BOOL
+TlsSetValue(DWORD dwTlsIndex, void *pvValue)
+{
+    return pthread_setspecific(static_cast<pthread_key_t>(dwTlsIndex), pvValue) == 0;
+}
+
+// ============================================================================
+// Kernel objects
+//      Threads, events and semaphores, all waited for under one lock and
+//      condition, which is plenty for tests.  An object is signalled
+//      while m_count is above 0: a thread once it has exited, an event
+//      while it's set, a semaphore while it has a count.  A thread's
+//      object is made when it's created, or when it first asks for a
+//      handle to itself, and signalled by the destructor of a
+//      thread-specific key.
+
+struct KernelObject {
+    enum Type { THREAD, EVENT, SEMAPHORE };
+
+    Type    m_type;
+    LONG    m_ref;                          // handles, and a thread's own
+    LONG    m_count;
+    LONG    m_maxCount;                     // semaphore
+    bool    m_bManualReset;                 // event
+};
+
+static pthread_mutex_t  s_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   s_changed = PTHREAD_COND_INITIALIZER;
+
+static pthread_once_t   s_threadKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t    s_threadKey;
+
+static HANDLE const     s_hCurrentProcess = reinterpret_cast<HANDLE>(-1);
+static HANDLE const     s_hCurrentThread = reinterpret_cast<HANDLE>(-2);
+
+static KernelObject *
+NewObject(KernelObject::Type type, LONG ref, LONG count)
+{
+    KernelObject *pObject = new KernelObject;
+
+    pObject->m_type = type;
+    pObject->m_ref = ref;
+    pObject->m_count = count;
+    pObject->m_maxCount = LONG_MAX;
+    pObject->m_bManualReset = false;
+    return pObject;
+}
+
+static void
+ReleaseObject(KernelObject *pObject)
+{
+    bool bLast;
+
+    pthread_mutex_lock(&s_lock);
+    bLast = (--pObject->m_ref == 0);
+    pthread_mutex_unlock(&s_lock);
+
+    if (bLast) {
+        delete pObject;
+    }
+}
+
+static void
+ThreadExited(void *pv)
+{
+    KernelObject *pThread = static_cast<KernelObject *>(pv);
+
+    pthread_mutex_lock(&s_lock);
+    pThread->m_count = 1;
+    pthread_cond_broadcast(&s_changed);
+    pthread_mutex_unlock(&s_lock);
+
+    ReleaseObject(pThread);
+}
+
+static void
+CreateThreadKey()
+{
+    pthread_key_create(&s_threadKey, ThreadExited);
+}
+
+// This thread's object, made if it hasn't one.
+static KernelObject *
+GetThreadObject()
+{
+    KernelObject *pThread;
+
+    pthread_once(&s_threadKeyOnce, CreateThreadKey);
+
+    pThread = static_cast<KernelObject *>(pthread_getspecific(s_threadKey));
+    if (pThread == NULL) {
+        pThread = NewObject(KernelObject::THREAD, 1, 0);
+        pthread_setspecific(s_threadKey, pThread);
+    }
+    return pThread;
+}
+
+struct ThreadStart {
+    LPTHREAD_START_ROUTINE   m_pfnStart;
+    void                    *m_pvParameter;
+    KernelObject            *m_pThread;
+};
+
+static void *
+StartThread(void *pv)
+{
+    ThreadStart start = *static_cast<ThreadStart *>(pv);
+
+    delete static_cast<ThreadStart *>(pv);
+
+    pthread_once(&s_threadKeyOnce, CreateThreadKey);
+    pthread_setspecific(s_threadKey, start.m_pThread);
+
+    start.m_pfnStart(start.m_pvParameter);
+    return NULL;
+}
+
+HANDLE
+CreateThread(void * /*pSecurity*/,
+             DWORD /*cbStack*/,
+             LPTHREAD_START_ROUTINE pfnStart,
+             void *pvParameter,
+             DWORD /*dwFlags*/,
+             DWORD *pdwThreadId)
+{
+    ThreadStart    *pStart = new ThreadStart;
+    KernelObject   *pThread = NewObject(KernelObject::THREAD, 2, 0);  // the handle's
+                                                                     // and its own
+    pthread_t       thread;
+
+    pStart->m_pfnStart = pfnStart;
+    pStart->m_pvParameter = pvParameter;
+    pStart->m_pThread = pThread;
+
+    if (pthread_create(&thread, NULL, StartThread, pStart) != 0) {
+        delete pThread;
+        delete pStart;
+        return NULL;
+    }
+    pthread_detach(thread);
+
+    if (pdwThreadId) {
+        *pdwThreadId = 0;
+    }
+    return pThread;
+}
+
+HANDLE
+CreateEvent(void * /*pSecurity*/,
+            BOOL bManualReset,
+            BOOL bInitialState,
+            LPCSTR /*pszName*/)
+{
+    KernelObject *pEvent = NewObject(KernelObject::EVENT, 1, bInitialState ? 1 : 0);
+
+    pEvent->m_bManualReset = (bManualReset != FALSE);
+    return pEvent;
+}
+
+BOOL
+SetEvent(HANDLE hEvent)
+{
+    pthread_mutex_lock(&s_lock);
+    static_cast<KernelObject *>(hEvent)->m_count = 1;
+    pthread_cond_broadcast(&s_changed);
+    pthread_mutex_unlock(&s_lock);
+    return TRUE;
+}
+
+BOOL
+ResetEvent(HANDLE hEvent)
+{
+    pthread_mutex_lock(&s_lock);
+    static_cast<KernelObject *>(hEvent)->m_count = 0;
+    pthread_mutex_unlock(&s_lock);
+    return TRUE;
+}
+
+HANDLE
+CreateSemaphore(void * /*pSecurity*/,
+                LONG lInitialCount,
+                LONG lMaximumCount,
+                LPCSTR /*pszName*/)
+{
+    KernelObject *pSemaphore = NewObject(KernelObject::SEMAPHORE, 1, lInitialCount);
+
+    pSemaphore->m_maxCount = lMaximumCount;
+    return pSemaphore;
+}
+
+BOOL
+ReleaseSemaphore(HANDLE hSemaphore, LONG lReleaseCount, LONG *plPreviousCount)
+{
+    KernelObject   *pSemaphore = static_cast<KernelObject *>(hSemaphore);
+    BOOL            bOK = FALSE;
+
+    pthread_mutex_lock(&s_lock);
+    if (plPreviousCount) {
+        *plPreviousCount = pSemaphore->m_count;
+    }
+    if (lReleaseCount > 0 &&
+        pSemaphore->m_count <= pSemaphore->m_maxCount - lReleaseCount) {
+        pSemaphore->m_count += lReleaseCount;
+        pthread_cond_broadcast(&s_changed);
+        bOK = TRUE;
+    }
+    pthread_mutex_unlock(&s_lock);
+    return bOK;
+}
+
+// What a wait that's satisfied does to the object.
+static void
+Satisfy(KernelObject *pObject)
+{
+    if (pObject->m_type == KernelObject::SEMAPHORE ||
+        (pObject->m_type == KernelObject::EVENT && !pObject->m_bManualReset)) {
+        pObject->m_count--;
+    }
+}
+
+DWORD
+WaitForMultipleObjects(DWORD nCount,
+                       const HANDLE *phHandles,
+                       BOOL bWaitAll,
+                       DWORD dwMilliseconds)
+{
+    struct timespec deadline;
+    DWORD           numSignalled;
+    DWORD           iFirst = 0;
+    DWORD           i;
+    DWORD           dwResult;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    if (dwMilliseconds != INFINITE) {
+        deadline.tv_sec += dwMilliseconds / 1000;
+        deadline.tv_nsec += (dwMilliseconds % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&s_lock);
+    for (;;) {
+        numSignalled = 0;
+        for (i = nCount; i-- > 0; ) {
+            if (static_cast<KernelObject *>(phHandles[i])->m_count > 0) {
+                numSignalled++;
+                iFirst = i;
+            }
+        }
+
+        if (bWaitAll ? (numSignalled == nCount) : (numSignalled > 0)) {
+            if (bWaitAll) {
+                for (i = 0; i < nCount; i++) {
+                    Satisfy(static_cast<KernelObject *>(phHandles[i]));
+                }
+                dwResult = WAIT_OBJECT_0;
+            } else {
+                Satisfy(static_cast<KernelObject *>(phHandles[iFirst]));
+                dwResult = WAIT_OBJECT_0 + iFirst;
+            }
+            break;
+        }
+
+        if (dwMilliseconds == INFINITE) {
+            pthread_cond_wait(&s_changed, &s_lock);
+        } else if (pthread_cond_timedwait(&s_changed, &s_lock, &deadline) != 0) {
+            dwResult = WAIT_TIMEOUT;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s_lock);
+
+    return dwResult;
+}
+
+DWORD
+WaitForSingleObject(HANDLE hHandle, DWORD dwMilliseconds)
+{
+    return WaitForMultipleObjects(1, &hHandle, TRUE, dwMilliseconds);
+}
+
+BOOL
+CloseHandle(HANDLE hObject)
+{
+    ReleaseObject(static_cast<KernelObject *>(hObject));
+    return TRUE;
+}
+
+HANDLE
+GetCurrentProcess()
+{
+    return s_hCurrentProcess;
+}
+
+HANDLE
+GetCurrentThread()
+{
+    return s_hCurrentThread;
+}
+
+BOOL
+DuplicateHandle(HANDLE /*hSourceProcess*/,
+                HANDLE hSource,
+                HANDLE /*hTargetProcess*/,
+                HANDLE *phTarget,
+                DWORD /*dwDesiredAccess*/,
+                BOOL /*bInheritHandle*/,
+                DWORD /*dwOptions*/)
+{
+    KernelObject *pThread;
+
+    if (hSource != s_hCurrentThread) {
+        return FALSE;
+    }
+
+    pThread = GetThreadObject();
+
+    pthread_mutex_lock(&s_lock);
+    pThread->m_ref++;
+    pthread_mutex_unlock(&s_lock);
+
+    *phTarget = pThread;
+    return TRUE;
+}
+
+void
+Sleep(DWORD dwMilliseconds)
+{
+    struct timespec ts;
+
+    ts.tv_sec = dwMilliseconds / 1000;
+    ts.tv_nsec = (dwMilliseconds % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+}
+
+DWORD
+GetTickCount()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<DWORD>(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+// ============================================================================
+// Modules and COM
+//      The module can always be pinned, and COM is always there.
+
+CComModule _Module;
+
+HINSTANCE
+CComModule::GetModuleInstance()
+{
+    return reinterpret_cast<HINSTANCE>(this);
+}
+
+DWORD
+GetModuleFileName(HINSTANCE /*hModule*/, TCHAR *pszFileName, DWORD cchFileName)
+{
+    const char szName[] = "xslisapi2.dll";
+
+    if (cchFileName < sizeof(szName)) {
+        return 0;
+    }
+    memcpy(pszFileName, szName, sizeof(szName));
+    return sizeof(szName) - 1;
+}
+
+LONG g_numModuleLoads = 0;
+
+HINSTANCE
+LoadLibrary(const TCHAR * /*pszFileName*/)
+{
+    InterlockedIncrement(&g_numModuleLoads);
+    return reinterpret_cast<HINSTANCE>(&_Module);
+}
+
+BOOL
+FreeLibrary(HMODULE /*hModule*/)
+{
+    InterlockedDecrement(&g_numModuleLoads);
+    return TRUE;
+}
+
+HRESULT
+CoInitializeEx(void * /*pvReserved*/, DWORD /*dwCoInit*/)
+{
+    return S_OK;
+}
+
+void
+CoUninitialize()
+{
+}
+
+// ============================================================================
+// Timing and the processor
+
+BOOL
+QueryPerformanceCounter(LARGE_INTEGER *pCount)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    pCount->QuadPart = static_cast<LONGLONG>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    return TRUE;
+}
+
+BOOL
+QueryPerformanceFrequency(LARGE_INTEGER *pFrequency)
+{
+    pFrequency->QuadPart = 1000000000;
+    return TRUE;
+}
+
+BOOL
+IsProcessorFeaturePresent(DWORD dwProcessorFeature)
+{
+    if (dwProcessorFeature == PF_XMMI64_INSTRUCTIONS_AVAILABLE) {
+#ifdef __SSE2__
+        return getenv("XSLISAPI_NO_SSE2") == NULL;
+#endif
+    }
+    return FALSE;
+}
+
+// ============================================================================
+// Strings
+
+int
+lstrlenW(LPCWSTR pwsz)
+{
+    int cch = 0;
+
+    if (pwsz) {
+        while (pwsz[cch]) {
+            cch++;
+        }
+    }
+    return cch;
+}
+
+int
+lstrcmpW(LPCWSTR pwsz1, LPCWSTR pwsz2)
+{
+    while (*pwsz1 && *pwsz1 == *pwsz2) {
+        pwsz1++;
+        pwsz2++;
+    }
+    return static_cast<int>(*pwsz1) - static_cast<int>(*pwsz2);
+}
+
+int
+lstrcmpiW(LPCWSTR pwsz1, LPCWSTR pwsz2)
+{
+    while (*pwsz1 && towlower(*pwsz1) == towlower(*pwsz2)) {
+        pwsz1++;
+        pwsz2++;
+    }
+    return static_cast<int>(towlower(*pwsz1)) - static_cast<int>(towlower(*pwsz2));
+}
+
+int
+wcscmp(const wchar_t *pwsz1, const wchar_t *pwsz2)
+{
+    return lstrcmpW(pwsz1, pwsz2);
+}
+
+wchar_t
+towlower(wchar_t wch)
+{
+    return (wch >= L'A' && wch <= L'Z') ? static_cast<wchar_t>(wch + (L'a' - L'A')) : wch;
+}
+
+LPWSTR
+lstrcpyW(LPWSTR pwszTo, LPCWSTR pwszFrom)
+{
+    memcpy(pwszTo, pwszFrom, (lstrlenW(pwszFrom) + 1) * sizeof(WCHAR));
+    return pwszTo;
+}
+
+LPWSTR
+lstrcpynW(LPWSTR pwszTo, LPCWSTR pwszFrom, int cchMax)
+{
+    int i;
+
+    if (cchMax <= 0) {
+        return pwszTo;
+    }
+    for (i = 0; i < cchMax - 1 && pwszFrom[i]; i++) {
+        pwszTo[i] = pwszFrom[i];
+    }
+    pwszTo[i] = L'\0';
+    return pwszTo;
+}
+
+// Latin-1 capitals are U+00C0 to U+00DE, bar U+00D7, each 0x20 below
+// its small letter.
+static WCHAR
+CharToUpper(WCHAR wch)
+{
+    if ((wch >= L'a' && wch <= L'z') ||
+        (wch >= 0xE0 && wch <= 0xFE && wch != 0xF7)) {
+        return static_cast<WCHAR>(wch - 0x20);
+    }
+    return wch;
+}
+
+static WCHAR
+CharToLower(WCHAR wch)
+{
+    if ((wch >= L'A' && wch <= L'Z') ||
+        (wch >= 0xC0 && wch <= 0xDE && wch != 0xD7)) {
+        return static_cast<WCHAR>(wch + 0x20);
+    }
+    return wch;
+}
+
+LPWSTR
+CharUpperW(LPWSTR pwsz)
+{
+    WCHAR *pwch;
+
+    for (pwch = pwsz; *pwch; pwch++) {
+        *pwch = CharToUpper(*pwch);
+    }
+    return pwsz;
+}
+
+LPWSTR
+CharLowerW(LPWSTR pwsz)
+{
+    CharLowerBuffW(pwsz, lstrlenW(pwsz));
+    return pwsz;
+}
+
+DWORD
+CharLowerBuffW(LPWSTR pwsz, DWORD cch)
+{
+    DWORD i;
+
+    for (i = 0; i < cch; i++) {
+        pwsz[i] = CharToLower(pwsz[i]);
+    }
+    return cch;
+}
+
+// One character, or surrogate pair, in UTF-8.  Returns the number of
+// bytes, and the number of characters taken in *pcwchUsed.
+static int
+EncodeUTF8(LPCWSTR pwch, int cwch, BYTE *pb, int *pcwchUsed)
+{
+    unsigned int ch = pwch[0];
+
+    *pcwchUsed = 1;
+    if (ch < 0x80) {
+        pb[0] = static_cast<BYTE>(ch);
+        return 1;
+    }
+    if (ch < 0x800) {
+        pb[0] = static_cast<BYTE>(0xC0 | (ch >> 6));
+        pb[1] = static_cast<BYTE>(0x80 | (ch & 0x3F));
+        return 2;
+    }
+    if (ch >= 0xD800 && ch < 0xDC00 && cwch > 1 &&
+        pwch[1] >= 0xDC00 && pwch[1] < 0xE000) {
+        ch = 0x10000 + ((ch - 0xD800) << 10) + (pwch[1] - 0xDC00);
+        *pcwchUsed = 2;
+        pb[0] = static_cast<BYTE>(0xF0 | (ch >> 18));
+        pb[1] = static_cast<BYTE>(0x80 | ((ch >> 12) & 0x3F));
+        pb[2] = static_cast<BYTE>(0x80 | ((ch >> 6) & 0x3F));
+        pb[3] = static_cast<BYTE>(0x80 | (ch & 0x3F));
+        return 4;
+    }
+    pb[0] = static_cast<BYTE>(0xE0 | (ch >> 12));
+    pb[1] = static_cast<BYTE>(0x80 | ((ch >> 6) & 0x3F));
+    pb[2] = static_cast<BYTE>(0x80 | (ch & 0x3F));
+    return 3;
+}
+
+// ============================================================================
+// Single-byte code pages
+//      1252 and 1251, as Windows has them: the character each byte from
+//      0x80 up decodes to (those Windows leaves undefined decode to the
+//      C1 control of the same value, and back), and some of the
+//      best-fit mappings WideCharToMultiByte uses for characters the
+//      code page doesn't have.  Anything else is the default, '?'.
+
+struct BestFit {
+    WCHAR   wch;
+    BYTE    b;
+};
+
+struct SingleByteCodePage {
+    UINT            uiCP;
+    WCHAR           awchHigh[128];          // bytes 0x80 to 0xFF
+    const BestFit  *pBestFit;
+    int             nBestFit;
+};
+
+static const BestFit s_aBestFit1252[] = {
+    { 0x0100, 'A' }, { 0x0101, 'a' }, { 0x0141, 'L' }, { 0x0142, 'l' },
+    { 0x2264, '=' }, { 0x2265, '=' }, { 0x221E, '8' }, { 0xFF21, 'A' }
+};
+
+static const SingleByteCodePage s_aSingleByteCodePages[] = {
+    { 1252, {
+        0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+        0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+        0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+        0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178,
+        0x00A0, 0x00A1, 0x00A2, 0x00A3, 0x00A4, 0x00A5, 0x00A6, 0x00A7,
+        0x00A8, 0x00A9, 0x00AA, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x00AF,
+        0x00B0, 0x00B1, 0x00B2, 0x00B3, 0x00B4, 0x00B5, 0x00B6, 0x00B7,
+        0x00B8, 0x00B9, 0x00BA, 0x00BB, 0x00BC, 0x00BD, 0x00BE, 0x00BF,
+        0x00C0, 0x00C1, 0x00C2, 0x00C3, 0x00C4, 0x00C5, 0x00C6, 0x00C7,
+        0x00C8, 0x00C9, 0x00CA, 0x00CB, 0x00CC, 0x00CD, 0x00CE, 0x00CF,
+        0x00D0, 0x00D1, 0x00D2, 0x00D3, 0x00D4, 0x00D5, 0x00D6, 0x00D7,
+        0x00D8, 0x00D9, 0x00DA, 0x00DB, 0x00DC, 0x00DD, 0x00DE, 0x00DF,
+        0x00E0, 0x00E1, 0x00E2, 0x00E3, 0x00E4, 0x00E5, 0x00E6, 0x00E7,
+        0x00E8, 0x00E9, 0x00EA, 0x00EB, 0x00EC, 0x00ED, 0x00EE, 0x00EF,
+        0x00F0, 0x00F1, 0x00F2, 0x00F3, 0x00F4, 0x00F5, 0x00F6, 0x00F7,
+        0x00F8, 0x00F9, 0x00FA, 0x00FB, 0x00FC, 0x00FD, 0x00FE, 0x00FF },
+      s_aBestFit1252, sizeof(s_aBestFit1252) / sizeof(s_aBestFit1252[0]) },
+    { 1251, {
+        0x0402, 0x0403, 0x201A, 0x0453, 0x201E, 0x2026, 0x2020, 0x2021,
+        0x20AC, 0x2030, 0x0409, 0x2039, 0x040A, 0x040C, 0x040B, 0x040F,
+        0x0452, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+        0x0098, 0x2122, 0x0459, 0x203A, 0x045A, 0x045C, 0x045B, 0x045F,
+        0x00A0, 0x040E, 0x045E, 0x0408, 0x00A4, 0x0490, 0x00A6, 0x00A7,
+        0x0401, 0x00A9, 0x0404, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x0407,
+        0x00B0, 0x00B1, 0x0406, 0x0456, 0x0491, 0x00B5, 0x00B6, 0x00B7,
+        0x0451, 0x2116, 0x0454, 0x00BB, 0x0458, 0x0405, 0x0455, 0x0457,
+        0x0410, 0x0411, 0x0412, 0x0413, 0x0414, 0x0415, 0x0416, 0x0417,
+        0x0418, 0x0419, 0x041A, 0x041B, 0x041C, 0x041D, 0x041E, 0x041F,
+        0x0420, 0x0421, 0x0422, 0x0423, 0x0424, 0x0425, 0x0426, 0x0427,
+        0x0428, 0x0429, 0x042A, 0x042B, 0x042C, 0x042D, 0x042E, 0x042F,
+        0x0430, 0x0431, 0x0432, 0x0433, 0x0434, 0x0435, 0x0436, 0x0437,
+        0x0438, 0x0439, 0x043A, 0x043B, 0x043C, 0x043D, 0x043E, 0x043F,
+        0x0440, 0x0441, 0x0442, 0x0443, 0x0444, 0x0445, 0x0446, 0x0447,
+        0x0448, 0x0449, 0x044A, 0x044B, 0x044C, 0x044D, 0x044E, 0x044F },
+      NULL, 0 }
+};
+
+static const SingleByteCodePage *
+FindSingleByteCodePage(UINT CodePage)
+{
+    int i;
+
+    for (i = 0; i < static_cast<int>(sizeof(s_aSingleByteCodePages) /
+                                     sizeof(s_aSingleByteCodePages[0])); i++) {
+        if (s_aSingleByteCodePages[i].uiCP == CodePage) {
+            return &s_aSingleByteCodePages[i];
+        }
+    }
+    return NULL;
+}
+
+static BYTE
+EncodeSingleByte(const SingleByteCodePage *pCodePage, WCHAR wch)
+{
+    int i;
+
+    if (wch < 0x80) {
+        return static_cast<BYTE>(wch);
+    }
+    for (i = 0; i < 128; i++) {
+        if (pCodePage->awchHigh[i] == wch) {
+            return static_cast<BYTE>(0x80 + i);
+        }
+    }
+    for (i = 0; i < pCodePage->nBestFit; i++) {
+        if (pCodePage->pBestFit[i].wch == wch) {
+            return pCodePage->pBestFit[i].b;
+        }
+    }
+    return '?';
+}
+
+// The text in UTF-7: letters, digits and space as they are, '+' as
+// "+-", and every run of anything else as '+', the base64 of its
+// UTF-16BE, and '-'.  So where a run starts and ends depends on the
+// characters around it, as with any stateful code page.
+static int
+EncodeUTF7(LPCWSTR pwch, int cwch, char *pch, int cb)
+{
+    static const char s_achBase64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    char            ach[8];
+    unsigned int    bits = 0;
+    int             numBits = 0;
+    bool            bInRun = false;
+    bool            bDirect;
+    int             cbChar;
+    int             cbOut = 0;
+    int             i;
+
+    for (i = 0; i <= cwch; i++) {
+        cbChar = 0;
+        bDirect = (i == cwch ||
+                   (pwch[i] >= L'a' && pwch[i] <= L'z') ||
+                   (pwch[i] >= L'A' && pwch[i] <= L'Z') ||
+                   (pwch[i] >= L'0' && pwch[i] <= L'9') ||
+                   pwch[i] == L' ');
+
+        if (bDirect && bInRun) {
+            if (numBits > 0) {
+                ach[cbChar++] = s_achBase64[(bits << (6 - numBits)) & 0x3F];
+            }
+            ach[cbChar++] = '-';
+            bits = 0;
+            numBits = 0;
+            bInRun = false;
+        }
+
+        if (i == cwch) {
+            // Only to end the run.
+        } else if (bDirect) {
+            ach[cbChar++] = static_cast<char>(pwch[i]);
+        } else if (pwch[i] == L'+' && !bInRun) {
+            ach[cbChar++] = '+';
+            ach[cbChar++] = '-';
+        } else {
+            if (!bInRun) {
+                ach[cbChar++] = '+';
+                bInRun = true;
+            }
+            bits = (bits << 16) | pwch[i];
+            numBits += 16;
+            while (numBits >= 6) {
+                numBits -= 6;
+                ach[cbChar++] = s_achBase64[(bits >> numBits) & 0x3F];
+            }
+            bits &= (1 << numBits) - 1;
+        }
+
+        if (cb != 0) {
+            if (cbOut + cbChar > cb) {
+                return 0;
+            }
+            memcpy(pch + cbOut, ach, cbChar);
+        }
+        cbOut += cbChar;
+    }
+    return cbOut;
+}
+
+int
+WideCharToMultiByte(UINT CodePage,
+                    DWORD /*dwFlags*/,
+                    LPCWSTR pwch,
+                    int cwch,
+                    char *pch,
+                    int cb,
+                    LPCSTR /*pszDefault*/,
+                    BOOL * /*pbUsedDefault*/)
+{
+    const SingleByteCodePage *pCodePage = FindSingleByteCodePage(CodePage);
+    BYTE    abChar[4];
+    int     cbChar;
+    int     cwchUsed;
+    int     cbOut = 0;
+    int     i;
+
+    if (cwch < 0) {
+        cwch = lstrlenW(pwch) + 1;
+    }
+    if (CodePage == CP_UTF7) {
+        return EncodeUTF7(pwch, cwch, pch, cb);
+    }
+
+    for (i = 0; i < cwch; i += cwchUsed) {
+        if (CodePage == CP_UTF8) {
+            cbChar = EncodeUTF8(pwch + i, cwch - i, abChar, &cwchUsed);
+        } else if (pCodePage != NULL) {
+            abChar[0] = EncodeSingleByte(pCodePage, pwch[i]);
+            cbChar = 1;
+            cwchUsed = 1;
+        } else {
+            assert(CodePage == CP_ACP);
+            abChar[0] = (pwch[i] < 0x100) ? static_cast<BYTE>(pwch[i]) : '?';
+            cbChar = 1;
+            cwchUsed = 1;
+        }
+
+        if (cb != 0) {
+            if (cbOut + cbChar > cb) {
+                return 0;
+            }
+            memcpy(pch + cbOut, abChar, cbChar);
+        }
+        cbOut += cbChar;
+    }
+    return cbOut;
+}
+
+int
+MultiByteToWideChar(UINT CodePage,
+                    DWORD /*dwFlags*/,
+                    LPCSTR pch,
+                    int cb,
+                    LPWSTR pwch,
+                    int cwch)
+{
+    const SingleByteCodePage *pCodePage = FindSingleByteCodePage(CodePage);
+    BYTE    b;
+    int     i;
+
+    assert(CodePage == CP_ACP || pCodePage != NULL);
+
+    if (cb < 0) {
+        cb = static_cast<int>(strlen(pch)) + 1;
+    }
+    if (cwch != 0) {
+        if (cb > cwch) {
+            return 0;
+        }
+        for (i = 0; i < cb; i++) {
+            b = static_cast<BYTE>(pch[i]);
+            pwch[i] = (pCodePage != NULL && b >= 0x80) ?
+                          pCodePage->awchHigh[b - 0x80] : b;
+        }
+    }
+    return cb;
+}
+
+BOOL
+GetCPInfo(UINT CodePage, CPINFO *pCPInfo)
+{
+    if (FindSingleByteCodePage(CodePage) == NULL) {
+        return FALSE;
+    }
+    memset(pCPInfo, 0, sizeof(*pCPInfo));
+    pCPInfo->MaxCharSize = 1;
+    pCPInfo->DefaultChar[0] = '?';
+    return TRUE;
+}
+
+int
+wsprintfW(WCHAR *pwszOut, LPCWSTR pwszFormat, ...)
+{
+    va_list     args;
+    char        szSpec[16];
+    char        szValue[64];
+    LPCWSTR     pwszValue;
+    WCHAR      *pwch = pwszOut;
+    int         cchSpec;
+    int         i;
+
+    va_start(args, pwszFormat);
+    while (*pwszFormat) {
+        if (*pwszFormat != L'%') {
+            *pwch++ = *pwszFormat++;
+            continue;
+        }
+
+        // The spec as printf has it, with l dropped since LONG is an int.
+        cchSpec = 0;
+        szSpec[cchSpec++] = '%';
+        pwszFormat++;
+        while (*pwszFormat == L'0' ||
+               (*pwszFormat >= L'1' && *pwszFormat <= L'9')) {
+            if (cchSpec < 12) {
+                szSpec[cchSpec++] = static_cast<char>(*pwszFormat);
+            }
+            pwszFormat++;
+        }
+        if (*pwszFormat == L'l') {
+            pwszFormat++;
+        }
+        szSpec[cchSpec++] = static_cast<char>(*pwszFormat);
+        szSpec[cchSpec] = '\0';
+
+        switch (*pwszFormat) {
+          case L'd':
+            snprintf(szValue, sizeof(szValue), szSpec, va_arg(args, int));
+            break;
+          case L'u':
+          case L'x':
+            snprintf(szValue, sizeof(szValue), szSpec, va_arg(args, unsigned int));
+            break;
+          case L'c':
+            *pwch++ = static_cast<WCHAR>(va_arg(args, int));
+            szValue[0] = '\0';
+            break;
+          case L's':
+            pwszValue = va_arg(args, LPCWSTR);
+            while (*pwszValue) {
+                *pwch++ = *pwszValue++;
+            }
+            szValue[0] = '\0';
+            break;
+          default:
+            assert(*pwszFormat == L'%');
+            szValue[0] = '%';
+            szValue[1] = '\0';
+            break;
+        }
+        pwszFormat++;
+
+        for (i = 0; szValue[i]; i++) {
+            *pwch++ = static_cast<WCHAR>(szValue[i]);
+        }
+    }
+    va_end(args);
+
+    *pwch = L'\0';
+    return static_cast<int>(pwch - pwszOut);
+}
+
+void
+OutputDebugStringW(LPCWSTR /*pwszOutput*/)
+{
+}
+
+// ============================================================================
+// BSTRs
+//      The length, in bytes, is kept in the DWORD before the characters.
+
+BSTR
+SysAllocStringLen(LPCWSTR pwch, UINT cch)
+{
+    DWORD  *pdw = static_cast<DWORD *>(malloc(sizeof(DWORD) + (cch + 1) * sizeof(WCHAR)));
+    BSTR    bstr;
+
+    if (pdw == NULL) {
+        return NULL;
+    }
+    pdw[0] = cch * sizeof(WCHAR);
+    bstr = reinterpret_cast<BSTR>(pdw + 1);
+    if (pwch) {
+        memcpy(bstr, pwch, cch * sizeof(WCHAR));
+    }
+    bstr[cch] = L'\0';
+    return bstr;
+}
+
+BSTR
+SysAllocString(LPCWSTR pwsz)
+{
+    if (pwsz == NULL) {
+        return NULL;
+    }
+    return SysAllocStringLen(pwsz, lstrlenW(pwsz));
+}
+
+void
+SysFreeString(BSTR bstr)
+{
+    if (bstr) {
+        free(reinterpret_cast<DWORD *>(bstr) - 1);
+    }
+}
+
+UINT
+SysStringLen(BSTR bstr)
+{
+    if (bstr == NULL) {
+        return 0;
+    }
+    return (reinterpret_cast<DWORD *>(bstr) - 1)[0] / sizeof(WCHAR);
+}
+
+// ============================================================================
+// CComBSTR
+
+CComBSTR &
+CComBSTR::operator=(LPCWSTR pwsz)
+{
+    SysFreeString(m_str);
+    m_str = SysAllocString(pwsz);
+    return *this;
+}
+
+HRESULT
+CComBSTR::Append(LPCWSTR pwsz)
+{
+    UINT    cchOld = SysStringLen(m_str);
+    UINT    cchNew = lstrlenW(pwsz);
+    BSTR    str = SysAllocStringLen(NULL, cchOld + cchNew);
+
+    if (str == NULL) {
+        return E_OUTOFMEMORY;
+    }
+    if (m_str) {
+        memcpy(str, m_str, cchOld * sizeof(WCHAR));
+    }
+    memcpy(str + cchOld, pwsz, cchNew * sizeof(WCHAR));
+
+    SysFreeString(m_str);
+    m_str = str;
+    return S_OK;
+}
+
+// ============================================================================
+// XSLISAPI
+//      What Utils.cpp gives, which needs ASP and MSXML to build.
+
+const BYTE g_bIsWhitespace[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 1, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1,
+};
+
+const int g_nSingleQuoteTransition[] = { 1, 0, 2 };
+
+HRESULT
+GetSingleNodeValue(IXMLDOMNode *pNode,
+                   LPCWSTR pwszXPath,
+                   BSTR *pbstrValue)
+{
+    CComPtr<IXMLDOMNode> pcomNode;
+    HRESULT              hr;
+
+    *pbstrValue = NULL;
+
+    hr = pNode->selectSingleNode(pwszXPath, &pcomNode);
+    if (FAILED(hr) || !pcomNode) {
+        return FAILED(hr) ? hr : S_OK;
+    }
+    return pcomNode->get_text(pbstrValue);
+}
+
+// By stat(), of the path as Latin-1; nothing is included.
+HRESULT
+GetFileCacheInfo(LPCWSTR pwszPath, XmlCacheInfo *pInfo)
+{
+    char        szPath[MAX_PATH];
+    struct stat st;
+    int         i;
+
+    for (i = 0; pwszPath[i] && i < MAX_PATH - 1; i++) {
+        szPath[i] = static_cast<char>(pwszPath[i]);
+    }
+    szPath[i] = '\0';
+
+    memset(pInfo, 0, sizeof(*pInfo));
+    if (stat(szPath, &st) != 0) {
+        return S_FALSE;
+    }
+    pInfo->ftLastWrite.dwLowDateTime = static_cast<DWORD>(st.st_mtime);
+    pInfo->ftLastWrite.dwHighDateTime = static_cast<DWORD>(st.st_mtim.tv_nsec);
+    pInfo->nFileSize = static_cast<DWORD>(st.st_size);
+    return S_OK;
+}
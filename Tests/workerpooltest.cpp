@@ -0,0 +1,187 @@
+// ============================================================================
+// FILE: workerpooltest.cpp
+//
+//      Tests of CWorkerPool: items are run in order, taken off the queue
+//      by Remove() without costing a thread, and run or joined at
+//      Shutdown().
+//
+//      workerpooltest
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#include "StdAfx.h"
+
+static int g_failures = 0;
+
+#define CHECK(expr)                                                     \
+    if (!(expr)) {                                                      \
+        printf("%s(%d): CHECK(%s) failed\n", __FILE__, __LINE__, #expr); \
+        g_failures++;                                                   \
+    }
+
+// How long a test waits for something that should happen at once.
+static const DWORD WAIT_LIMIT = 10000;
+
+// ============================================================================
+// CTestItem
+//      Notes that it ran, and in what order; with a gate, waits for it to
+//      be opened first.
+
+static LONG g_numRun = 0;
+
+class CTestItem : public CWorkItem
+{
+  public:
+    CTestItem(HANDLE hGate = NULL) : m_hGate(hGate), m_order(0) {
+        m_hStarted = CreateEvent(NULL, TRUE, FALSE, NULL);
+        m_hDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+    }
+
+    ~CTestItem() {
+        CloseHandle(m_hStarted);
+        CloseHandle(m_hDone);
+    }
+
+    virtual void Run() {
+        SetEvent(m_hStarted);
+        if (m_hGate) {
+            WaitForSingleObject(m_hGate, INFINITE);
+        }
+        m_order = InterlockedIncrement(&g_numRun);
+        SetEvent(m_hDone);
+    }
+
+    bool HasRun() {
+        return WaitForSingleObject(m_hDone, 0) == WAIT_OBJECT_0;
+    }
+
+    HANDLE  m_hGate;
+    HANDLE  m_hStarted;
+    HANDLE  m_hDone;
+    LONG    m_order;
+};
+
+// ============================================================================
+// TestRemove
+//      With the one thread held up, items wait on the queue, and one of
+//      them is taken off.  The others run in order, and the wakeup the
+//      removed one left doesn't stop the thread.
+
+static void
+TestRemove()
+{
+    CWorkerPool pool(1);
+    HANDLE      hGate = CreateEvent(NULL, TRUE, FALSE, NULL);
+    CTestItem   blocker(hGate);
+    CTestItem   first;
+    CTestItem   removed;
+    CTestItem   last;
+    CTestItem   after;
+
+    CHECK(pool.Queue(&blocker) == S_OK);
+    CHECK(WaitForSingleObject(blocker.m_hStarted, WAIT_LIMIT) == WAIT_OBJECT_0);
+
+    CHECK(pool.Queue(&first) == S_OK);
+    CHECK(pool.Queue(&removed) == S_OK);
+    CHECK(pool.Queue(&last) == S_OK);
+    CHECK(pool.GetQueueLength() == 3);
+
+    CHECK(pool.Remove(&removed));
+    CHECK(pool.GetQueueLength() == 2);
+    CHECK(!pool.Remove(&removed));
+    CHECK(!pool.Remove(&blocker));          // running
+
+    // Off the end, so the tail has to move back.
+    CHECK(pool.Remove(&last));
+    CHECK(pool.Queue(&last) == S_OK);
+    CHECK(pool.GetQueueLength() == 2);
+
+    SetEvent(hGate);
+    CHECK(WaitForSingleObject(last.m_hDone, WAIT_LIMIT) == WAIT_OBJECT_0);
+    CHECK(first.HasRun() && last.HasRun() && !removed.HasRun());
+    CHECK(blocker.m_order < first.m_order && first.m_order < last.m_order);
+    CHECK(pool.GetQueueLength() == 0);
+
+    // Two wakeups were left with nothing to run.
+    CHECK(pool.Queue(&after) == S_OK);
+    CHECK(WaitForSingleObject(after.m_hDone, WAIT_LIMIT) == WAIT_OBJECT_0);
+    CHECK(pool.GetThreadCount() == 1);
+
+    CHECK(pool.Shutdown(WAIT_LIMIT));
+    CHECK(!removed.HasRun());
+
+    CloseHandle(hGate);
+}
+
+// ============================================================================
+// TestShutdown
+//      What's queued when the pool shuts down is still run, and then
+//      nothing more is taken.
+
+static void
+TestShutdown()
+{
+    CWorkerPool pool(2);
+    HANDLE      hGate = CreateEvent(NULL, TRUE, FALSE, NULL);
+    CTestItem   blockers[2];
+    CTestItem   queued[4];
+    CTestItem   late;
+    int         i;
+
+    for (i = 0; i < 2; i++) {
+        blockers[i].m_hGate = hGate;
+        CHECK(pool.Queue(&blockers[i]) == S_OK);
+    }
+    for (i = 0; i < 4; i++) {
+        CHECK(pool.Queue(&queued[i]) == S_OK);
+    }
+    CHECK(pool.Remove(&queued[1]));
+
+    // One reference to the DLL for the threads, given back once
+    // they've exited.
+    CHECK(g_numModuleLoads == 1);
+
+    SetEvent(hGate);
+    CHECK(pool.Shutdown(WAIT_LIMIT));
+    CHECK(pool.GetThreadCount() == 0);
+    CHECK(g_numModuleLoads == 0);
+
+    CHECK(queued[0].HasRun() && !queued[1].HasRun() &&
+          queued[2].HasRun() && queued[3].HasRun());
+
+    CHECK(pool.Queue(&late) == S_FALSE);
+
+    CloseHandle(hGate);
+}
+
+// ============================================================================
+// TestDisabled
+
+static void
+TestDisabled()
+{
+    CWorkerPool pool(0);
+    CTestItem   item;
+
+    CHECK(!pool.IsEnabled());
+    CHECK(pool.Queue(&item) == S_FALSE);
+    CHECK(!pool.Remove(&item));
+    CHECK(pool.Shutdown(WAIT_LIMIT));
+    CHECK(g_numModuleLoads == 0);
+}
+
+int
+main()
+{
+    TestRemove();
+    TestShutdown();
+    TestDisabled();
+
+    if (g_failures) {
+        printf("workerpooltest: %d failed\n", g_failures);
+        return 1;
+    }
+
+    printf("workerpooltest: passed\n");
+    return 0;
+}
@@ -0,0 +1,360 @@
+// ============================================================================
+// FILE: xmlwritetest.cpp
+//
+//      Tests of the buffer that what's written with Write and WriteLine
+//      is gathered in before it's handed to the parser (see
+//      CXMLServerDocument::WriteToXML), in UTF-16 and in UTF-8, and a
+//      measure of what each costs for a large generated document, and
+//      of a 5,000-line PASP page written as it was before and after.
+//
+//      xmlwritetest [megabytes]
+//
+// Copyright (c) 1999-2000 Microsoft Corporation. All rights reserved.
+
+#include "StdAfx.h"
+#include "charset.h"
+
+// As in Global.cpp.
+static CBufferPool s_bufferPool(16);
+CBufferPool *g_bufferPool = &s_bufferPool;
+
+// As in XMLServerDoc.cpp.
+static const ULONG XML_WRITE_HIGH_WATER = 256 * 1024;
+
+static int g_failures = 0;
+
+#define CHECK(expr)                                                     \
+    if (!(expr)) {                                                      \
+        printf("%s(%d): CHECK(%s) failed\n", __FILE__, __LINE__, #expr); \
+        g_failures++;                                                   \
+    }
+
+// ============================================================================
+// CCountingStream
+//      Stands in for the parser's stream: keeps what's written, or just
+//      counts it.
+
+class CCountingStream : public IStream
+{
+  public:
+    CCountingStream(bool bKeep) : m_bKeep(bKeep), m_cb(0), m_numWrites(0) {}
+
+    HRESULT Write(const void *pv, ULONG cb, ULONG *pcbWritten) {
+        if (m_bKeep) {
+            m_buffer.Append(pv, cb);
+        }
+        m_cb += cb;
+        m_numWrites++;
+        if (pcbWritten) {
+            *pcbWritten = cb;
+        }
+        return S_OK;
+    }
+
+    CPooledBuffer   m_buffer;
+    bool            m_bKeep;
+    double          m_cb;
+    ULONG           m_numWrites;
+};
+
+// ============================================================================
+// AppendUTF8 against WideCharToMultiByte
+
+static const WCHAR s_awchSamples[] = {
+    L'<', L'a', L'>', 0x00E9, L'x', 0x07FF, 0x0800, 0x20AC, 0xFFFD,
+    0xD83D, 0xDE00,                         // a pair
+    0xD800, L'y',                           // a high surrogate alone
+    0xDC00, L'z',                           // a low one
+    0xDBFF, 0xDFFF,                         // the last pair
+    L'<', L'/', L'a', L'>', L'\r', L'\n'
+};
+
+static void
+TestAppendUTF8()
+{
+    CPooledBuffer   buffer;
+    WCHAR           awchText[3000];
+    char            achExpected[3000 * 3];
+    int             cbExpected;
+    ULONG           cch;
+    ULONG           ich;
+    ULONG           cchPiece;
+
+    // Every length up to a few times what's encoded at once, so that the
+    // ends of the vectorized runs land everywhere.
+    for (cch = 0; cch < 300; cch++) {
+        for (ich = 0; ich < cch; ich++) {
+            awchText[ich] = (ich % 37 == 36) ?
+                            s_awchSamples[ich % COUNTOF(s_awchSamples)] :
+                            static_cast<WCHAR>(L' ' + ich % 90);
+        }
+
+        cbExpected = WideCharToMultiByte(CP_UTF8, 0, awchText, cch,
+                                         achExpected, sizeof(achExpected),
+                                         NULL, NULL);
+
+        buffer.Empty();
+        CHECK(buffer.AppendUTF8(awchText, cch) == S_OK);
+        CHECK(buffer.GetSize() == static_cast<ULONG>(cbExpected));
+        CHECK(cch == 0 || memcmp(buffer.GetData(), achExpected, cbExpected) == 0);
+    }
+
+    // Every character in the samples, at every position, in one write
+    // and in pieces that don't split a pair.
+    for (ich = 0; ich < COUNTOF(awchText); ich++) {
+        awchText[ich] = s_awchSamples[ich % COUNTOF(s_awchSamples)];
+    }
+    cbExpected = WideCharToMultiByte(CP_UTF8, 0, awchText, COUNTOF(awchText),
+                                     achExpected, sizeof(achExpected),
+                                     NULL, NULL);
+
+    buffer.Empty();
+    CHECK(buffer.AppendUTF8(awchText, COUNTOF(awchText)) == S_OK);
+    CHECK(buffer.GetSize() == static_cast<ULONG>(cbExpected));
+    CHECK(memcmp(buffer.GetData(), achExpected, cbExpected) == 0);
+
+    buffer.Empty();
+    for (ich = 0; ich < COUNTOF(awchText); ich += cchPiece) {
+        cchPiece = 1 + (ich * 7) % 40;
+        if (cchPiece > COUNTOF(awchText) - ich) {
+            cchPiece = COUNTOF(awchText) - ich;
+        }
+        if (awchText[ich + cchPiece - 1] >= 0xD800 &&
+            awchText[ich + cchPiece - 1] < 0xDC00 &&
+            ich + cchPiece < COUNTOF(awchText)) {
+            cchPiece++;
+        }
+        CHECK(buffer.AppendUTF8(awchText + ich, cchPiece) == S_OK);
+    }
+    CHECK(buffer.GetSize() == static_cast<ULONG>(cbExpected));
+    CHECK(memcmp(buffer.GetData(), achExpected, cbExpected) == 0);
+}
+
+// ============================================================================
+// A large generated document
+//      Written a line at a time, as a page's script does, mostly ASCII
+//      with a little Latin-1.  WriteDocument buffers it as WriteToXML
+//      does and hands it to pStream.
+
+static const WCHAR * const s_apwszLines[] = {
+    L"<item id=\"1042\" status=\"available\">",
+    L"<name>Caf\x00E9 cr\x00E8me table, oak</name>",
+    L"<price currency=\"EUR\">129.00</price>",
+    L"<description>Solid oak, seats four; shipped flat with fittings.</description>",
+    L"</item>"
+};
+
+static void
+WriteDocument(IStream *pStream, bool bUTF8, ULONG cbDocument)
+{
+    static const BYTE   s_abUTF8BOM[] = { 0xEF, 0xBB, 0xBF };
+    const WCHAR         chBOM = 0xFEFF;
+    CPooledBuffer       buffer;
+    ULONG               cbWritten = 0;
+    ULONG               iLine;
+    ULONG               cch;
+
+    if (bUTF8) {
+        buffer.Append(s_abUTF8BOM, sizeof(s_abUTF8BOM));
+    } else {
+        buffer.Append(&chBOM, sizeof(chBOM));
+    }
+
+    for (iLine = 0; cbWritten < cbDocument; iLine++) {
+        const WCHAR *pwszLine = s_apwszLines[iLine % COUNTOF(s_apwszLines)];
+
+        cch = lstrlen(pwszLine);
+        cbWritten += (cch + 2) * sizeof(WCHAR);
+        if (bUTF8) {
+            buffer.AppendUTF8(pwszLine, cch);
+            buffer.AppendUTF8(L"\r\n", 2);
+        } else {
+            buffer.Append(pwszLine, cch * sizeof(WCHAR));
+            buffer.Append(L"\r\n", 2 * sizeof(WCHAR));
+        }
+
+        if (buffer.GetSize() >= XML_WRITE_HIGH_WATER) {
+            buffer.WriteTo(pStream);
+        }
+    }
+    buffer.WriteTo(pStream);
+}
+
+static double
+Seconds(const LARGE_INTEGER & start)
+{
+    LARGE_INTEGER   now;
+    LARGE_INTEGER   frequency;
+
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&frequency);
+    return static_cast<double>(now.QuadPart - start.QuadPart) / frequency.QuadPart;
+}
+
+static void
+ReportDocument(ULONG cbDocument)
+{
+    CCountingStream utf16(true);
+    CCountingStream utf8(true);
+    int             cwch;
+    int             cb;
+    int             mode;
+    int             rep;
+    double          best[2] = { 1e9, 1e9 };
+    double          cbStream[2] = { 0, 0 };
+    LARGE_INTEGER   start;
+
+    // The UTF-8 the parser gets is the UTF-16 it would have got,
+    // converted.
+    WriteDocument(&utf16, false, 256 * 1024);
+    WriteDocument(&utf8, true, 256 * 1024);
+    cwch = static_cast<int>(utf16.m_buffer.GetSize() / sizeof(WCHAR)) - 1;
+    cb = static_cast<int>(utf8.m_buffer.GetSize()) - 3;
+    CHECK(cb == WideCharToMultiByte(CP_UTF8, 0,
+                                    reinterpret_cast<WCHAR *>(utf16.m_buffer.GetData()) + 1,
+                                    cwch, NULL, 0, NULL, NULL));
+    {
+        CPooledBuffer expected;
+
+        expected.AppendUTF8(reinterpret_cast<WCHAR *>(utf16.m_buffer.GetData()) + 1, cwch);
+        CHECK(expected.GetSize() == static_cast<ULONG>(cb) &&
+              memcmp(expected.GetData(), utf8.m_buffer.GetData() + 3, cb) == 0);
+    }
+
+    for (rep = 0; rep < 5; rep++) {
+        for (mode = 0; mode < 2; mode++) {
+            CCountingStream stream(false);
+
+            QueryPerformanceCounter(&start);
+            WriteDocument(&stream, mode == 1, cbDocument);
+            if (Seconds(start) < best[mode]) {
+                best[mode] = Seconds(start);
+            }
+            cbStream[mode] = stream.m_cb;
+        }
+    }
+
+    printf("xmlwritetest: a %lu KB document written a line at a time:\n"
+           "    UTF-16    %8.0f KB to the parser, buffered at %5.0f MB/s\n"
+           "    UTF-8     %8.0f KB to the parser, buffered at %5.0f MB/s\n",
+           static_cast<unsigned long>(cbDocument / 1024),
+           cbStream[0] / 1024, cbDocument / best[0] / 1e6,
+           cbStream[1] / 1024, cbDocument / best[1] / 1e6);
+}
+
+// ============================================================================
+// A 5,000-line PASP page
+//      What a preprocessed PASP page's script writes: one WriteLine per
+//      source line.  Unbuffered, each line went to the parser's stream
+//      as WriteToXML got it, with another write for its CRLF, as it did
+//      before m_xmlWriteBuffer; buffered, as WriteToXML does now.  The
+//      stream here only keeps what it's given, so the time is that of
+//      getting the page to the parser, not of parsing it.
+
+static const ULONG PASP_PAGE_LINES = 5000;
+
+static void
+WritePASPPage(IStream *pStream, bool bBuffered)
+{
+    const WCHAR     chBOM = 0xFEFF;
+    CPooledBuffer   buffer;
+    ULONG           iLine;
+    ULONG           cch;
+
+    if (bBuffered) {
+        buffer.Append(&chBOM, sizeof(chBOM));
+    } else {
+        pStream->Write(&chBOM, sizeof(chBOM), NULL);
+    }
+
+    for (iLine = 0; iLine < PASP_PAGE_LINES; iLine++) {
+        const WCHAR *pwszLine = s_apwszLines[iLine % COUNTOF(s_apwszLines)];
+
+        cch = lstrlen(pwszLine);
+        if (bBuffered) {
+            buffer.Append(pwszLine, cch * sizeof(WCHAR));
+            buffer.Append(L"\r\n", 2 * sizeof(WCHAR));
+            if (buffer.GetSize() >= XML_WRITE_HIGH_WATER) {
+                buffer.WriteTo(pStream);
+            }
+        } else {
+            pStream->Write(pwszLine, cch * sizeof(WCHAR), NULL);
+            pStream->Write(L"\r\n", 2 * sizeof(WCHAR), NULL);
+        }
+    }
+
+    if (bBuffered) {
+        buffer.WriteTo(pStream);
+    }
+}
+
+static void
+ReportPASPPage()
+{
+    static const int    NUM_PAGES = 200;
+    CCountingStream     unbuffered(true);
+    CCountingStream     buffered(true);
+    ULONG               numWrites[2] = { 0, 0 };
+    double              best[2] = { 1e9, 1e9 };
+    LARGE_INTEGER       start;
+    int                 mode;
+    int                 rep;
+    int                 iPage;
+
+    // The parser gets the same bytes either way.
+    WritePASPPage(&unbuffered, false);
+    WritePASPPage(&buffered, true);
+    CHECK(unbuffered.m_buffer.GetSize() == buffered.m_buffer.GetSize() &&
+          memcmp(unbuffered.m_buffer.GetData(), buffered.m_buffer.GetData(),
+                 buffered.m_buffer.GetSize()) == 0);
+    CHECK(unbuffered.m_numWrites == 1 + 2 * PASP_PAGE_LINES);
+    // One at the high-water mark, and the rest at Transform() time.
+    CHECK(buffered.m_buffer.GetSize() > XML_WRITE_HIGH_WATER &&
+          buffered.m_buffer.GetSize() < 2 * XML_WRITE_HIGH_WATER);
+    CHECK(buffered.m_numWrites == 2);
+
+    for (rep = 0; rep < 5; rep++) {
+        for (mode = 0; mode < 2; mode++) {
+            QueryPerformanceCounter(&start);
+            for (iPage = 0; iPage < NUM_PAGES; iPage++) {
+                CCountingStream stream(true);
+
+                WritePASPPage(&stream, mode == 1);
+                numWrites[mode] = stream.m_numWrites;
+            }
+            if (Seconds(start) < best[mode]) {
+                best[mode] = Seconds(start);
+            }
+        }
+    }
+
+    printf("xmlwritetest: a %lu-line PASP page (%lu KB) to the parser:\n"
+           "    unbuffered %6lu writes, %7.1f us a page\n"
+           "    buffered   %6lu writes, %7.1f us a page\n",
+           static_cast<unsigned long>(PASP_PAGE_LINES),
+           static_cast<unsigned long>(buffered.m_buffer.GetSize() / 1024),
+           static_cast<unsigned long>(numWrites[0]), best[0] / NUM_PAGES * 1e6,
+           static_cast<unsigned long>(numWrites[1]), best[1] / NUM_PAGES * 1e6);
+}
+
+int
+main(int argc, char **argv)
+{
+    ULONG cbDocument = 16 * 1024 * 1024;
+
+    if (argc > 1) {
+        cbDocument = static_cast<ULONG>(atoi(argv[1])) * 1024 * 1024;
+    }
+
+    TestAppendUTF8();
+    ReportDocument(cbDocument);
+    ReportPASPPage();
+
+    if (g_failures) {
+        printf("xmlwritetest: %d failed\n", g_failures);
+        return 1;
+    }
+
+    printf("xmlwritetest: passed\n");
+    return 0;
+}